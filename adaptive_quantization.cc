@@ -14,17 +14,44 @@
 
 #include "adaptive_quantization.h"
 
-#include <string.h>
 #include <algorithm>
 #include <cmath>
 #include <vector>
 
+#include "cache_aligned.h"
 #include "compiler_specific.h"
+#include "profiler.h"
+#include "simd/simd.h"
 #include "status.h"
 
 namespace pik {
 namespace {
 
+#if SIMD_ENABLE_AVX2
+// Returns min(cutoff, 0.5f * diff) for the diff computed below, including its
+// double-precision sum and product, for eight pixels.
+SIMD_NAMESPACE::f32x8 ClampedDiff(const SIMD_NAMESPACE::f32x8 center,
+                                  const SIMD_NAMESPACE::f32x8 right,
+                                  const SIMD_NAMESPACE::f32x8 below,
+                                  const double mul0, const float cutoff) {
+  using namespace SIMD_NAMESPACE;
+  const f32x8 sign = set1(f32x8(), -0.0f);
+  const f32x8 diff_x = andnot(sign, center - right);
+  const f32x8 diff_y = andnot(sign, center - below);
+  const f64x4 mul = set1(f64x4(), mul0);
+  const f64x4 lower =
+      mul * (f64x4(_mm256_cvtps_pd(_mm256_castps256_ps128(diff_x))) +
+             f64x4(_mm256_cvtps_pd(_mm256_castps256_ps128(diff_y))));
+  const f64x4 upper =
+      mul * (f64x4(_mm256_cvtps_pd(_mm256_extractf128_ps(diff_x, 1))) +
+             f64x4(_mm256_cvtps_pd(_mm256_extractf128_ps(diff_y, 1))));
+  const f32x8 diff(_mm256_insertf128_ps(
+      _mm256_castps128_ps256(_mm256_cvtpd_ps(lower)), _mm256_cvtpd_ps(upper),
+      1));
+  return min(set1(f32x8(), cutoff), set1(f32x8(), 0.5f) * diff);
+}
+#endif
+
 ImageF DiffPrecompute(const ImageF& xyb, float cutoff) {
   PIK_ASSERT(xyb.xsize() > 1);
   PIK_ASSERT(xyb.ysize() > 1);
@@ -34,7 +61,17 @@ ImageF DiffPrecompute(const ImageF& xyb, float cutoff) {
     const float* const PIK_RESTRICT row_in = xyb.Row(y);
     const float* const PIK_RESTRICT row_in2 = xyb.Row(y + 1);
     float* const PIK_RESTRICT row_out = result.Row(y);
-    for (size_t x = 0; x + 1 < xyb.xsize(); ++x) {
+    size_t x = 0;
+#if SIMD_ENABLE_AVX2
+    using namespace SIMD_NAMESPACE;
+    for (; x + 8 < xyb.xsize(); x += 8) {
+      const f32x8 diff = ClampedDiff(
+          load(f32x8(), row_in + x), load_unaligned(f32x8(), row_in + x + 1),
+          load(f32x8(), row_in2 + x), mul0, cutoff);
+      store(diff, row_out + x);
+    }
+#endif
+    for (; x + 1 < xyb.xsize(); ++x) {
       const size_t x2 = x + 1;
       const float diff = mul0 * (fabs(row_in[x] - row_in[x2]) +
                                  fabs(row_in[x] - row_in2[x]));
@@ -65,23 +102,6 @@ ImageF DiffPrecompute(const ImageF& xyb, float cutoff) {
   return result;
 }
 
-ImageF Expand(const ImageF& img, size_t out_xsize, size_t out_ysize) {
-  PIK_ASSERT(img.xsize() > 0);
-  PIK_ASSERT(img.ysize() > 0);
-  ImageF out(out_xsize, out_ysize);
-  for (size_t y = 0; y < out_ysize; ++y) {
-    const float* const PIK_RESTRICT row_in =
-        y < img.ysize() ? img.Row(y) : out.Row(y - 1);
-    float* const PIK_RESTRICT row_out = out.Row(y);
-    memcpy(row_out, row_in, img.xsize() * sizeof(row_out[0]));
-    const float lastval = row_in[img.xsize() - 1];
-    for (size_t x = img.xsize(); x < out_xsize; ++x) {
-      row_out[x] = lastval;
-    }
-  }
-  return out;
-}
-
 std::vector<float> GaussianKernel(int radius, float sigma) {
   std::vector<float> kernel(2 * radius + 1);
   const float scaler = -1.0 / (2 * sigma * sigma);
@@ -91,45 +111,69 @@ std::vector<float> GaussianKernel(int radius, float sigma) {
   return kernel;
 }
 
+// Writes the pixels [-radius, xsize + radius) of "row_in" to every "stride"-th
+// float of "row_out". The row is first extended from "in_xsize" to "xsize"
+// pixels by replicating its last pixel, then mirrored at both borders.
 inline void ExtrapolateBorders(const float* const PIK_RESTRICT row_in,
-                               float* const PIK_RESTRICT row_out,
-                               const int xsize,
-                               const int radius) {
+                               const int in_xsize, const int xsize,
+                               const int radius, const int stride,
+                               float* const PIK_RESTRICT row_out) {
   const int lastcol = xsize - 1;
+  const auto pixel = [row_in, in_xsize](const int x) {
+    return row_in[std::min(x, in_xsize - 1)];
+  };
   for (int x = 1; x <= radius; ++x) {
-    row_out[-x] = row_in[std::min(x, xsize - 1)];
+    row_out[(radius - x) * stride] = pixel(std::min(x, lastcol));
+  }
+  for (int x = 0; x < xsize; ++x) {
+    row_out[(radius + x) * stride] = pixel(x);
   }
-  memcpy(row_out, row_in, xsize * sizeof(row_out[0]));
   for (int x = 1; x <= radius; ++x) {
-    row_out[lastcol + x] = row_in[std::max(0, lastcol - x)];
+    row_out[(radius + lastcol + x) * stride] = pixel(std::max(0, lastcol - x));
   }
 }
 
-ImageF ConvolveXSampleAndTranspose(const ImageF& in,
+// Convolves the rows of "in", extended to "xsize" x "ysize" pixels by
+// replicating the last column and row, with "kernel", and returns every
+// "res"-th output pixel of each row as a column. Processes one vector of rows
+// at a time: their pixels are interleaved so that each of the (only) needed
+// outputs is a sum of whole vectors, which are stored as part of a row.
+ImageF ConvolveXSampleAndTranspose(const ImageF& in, const size_t xsize,
+                                   const size_t ysize,
                                    const std::vector<float>& kernel,
                                    const size_t res) {
+  using namespace SIMD_NAMESPACE;
+  using V = vec<float>;
+  constexpr size_t N = NumLanes<V>();
   PIK_ASSERT(kernel.size() % 2 == 1);
-  PIK_ASSERT(in.xsize() % res == 0);
+  PIK_ASSERT(xsize % res == 0);
+  PIK_ASSERT(xsize >= in.xsize() && ysize >= in.ysize());
   const int offset = (res + 1) / 2;
-  const int out_xsize = in.xsize() / res;
-  ImageF out(in.ysize(), out_xsize);
+  const int out_xsize = xsize / res;
+  // Writes to the padding after the last vector of rows are allowed.
+  ImageF out(ysize, out_xsize);
   float weight = 0.0f;
   for (int i = 0; i < kernel.size(); ++i) {
     weight += kernel[i];
   }
-  float scale = 1.0f / weight;
+  const V scale = set1(V(), 1.0f / weight);
   const int r = kernel.size() / 2;
-  std::vector<float> row_tmp(in.xsize() + 2 * r);
-  float* const PIK_RESTRICT rowp = &row_tmp[r];
-  const float* const kernelp = &kernel[r];
-  for (int y = 0; y < in.ysize(); ++y) {
-    ExtrapolateBorders(in.Row(y), rowp, in.xsize(), r);
-    for (int x = offset, ox = 0; x < in.xsize(); x += res, ++ox) {
-      float sum = 0.0f;
-      for (int i = -r; i <= r; ++i) {
-        sum += rowp[x + i] * kernelp[i];
+  CacheAlignedUniquePtrT<float> interleaved =
+      AllocateArray<float>((xsize + 2 * r) * N);
+  for (size_t y = 0; y < ysize; y += N) {
+    for (size_t i = 0; i < N; ++i) {
+      const size_t y_in = std::min(y + i, in.ysize() - 1);
+      ExtrapolateBorders(in.Row(y_in), in.xsize(), xsize, r, N,
+                         interleaved.get() + i);
+    }
+    for (int x = offset, ox = 0; x < xsize; x += res, ++ox) {
+      // Pixel x - r, i.e. the one multiplied with kernel[0].
+      const float* const PIK_RESTRICT pixels = interleaved.get() + x * N;
+      V sum = setzero(V());
+      for (int i = 0; i < kernel.size(); ++i) {
+        sum = mul_add(load(V(), pixels + i * N), set1(V(), kernel[i]), sum);
       }
-      out.Row(ox)[y] = sum * scale;
+      store(sum * scale, out.Row(ox) + y);
     }
   }
   return out;
@@ -174,6 +218,7 @@ ImageF SubsampleWithMax(const ImageF& in, int factor) {
 }  // namespace
 
 ImageF AdaptiveQuantizationMap(const ImageF& img, size_t resolution) {
+  PROFILER_FUNC;
   static const int kSampleRate = 8;
   PIK_ASSERT(resolution % kSampleRate == 0);
   const size_t out_xsize = (img.xsize() + resolution - 1) / resolution;
@@ -189,9 +234,12 @@ ImageF AdaptiveQuantizationMap(const ImageF& img, size_t resolution) {
   std::vector<float> kernel = GaussianKernel(kRadius, kSigma);
   static const float kDiffCutoff = 0.072750703471576167;
   ImageF out = DiffPrecompute(img, kDiffCutoff);
-  out = Expand(out, resolution * out_xsize, resolution * out_ysize);
-  out = ConvolveXSampleAndTranspose(out, kernel, kSampleRate);
-  out = ConvolveXSampleAndTranspose(out, kernel, kSampleRate);
+  // Transposed, hence the second convolution is along the original columns.
+  out = ConvolveXSampleAndTranspose(out, resolution * out_xsize,
+                                    resolution * out_ysize, kernel,
+                                    kSampleRate);
+  out = ConvolveXSampleAndTranspose(out, out.xsize(), out.ysize(), kernel,
+                                    kSampleRate);
   out = ComputeMask(out);
   if (resolution > kSampleRate) {
     out = SubsampleWithMax(out, resolution / kSampleRate);
@@ -22,8 +22,6 @@
 
 namespace pik {
 
-namespace {
-
 void ANSBuildInfoTable(const int* counts, int alphabet_size,
                        ANSEncSymbolInfo* info) {
   int total = 0;
@@ -32,19 +30,15 @@ void ANSBuildInfoTable(const int* counts, int alphabet_size,
     info[s].freq_ = counts[s];
     info[s].start_ = total;
     total += freq;
-#ifdef USE_MULT_BY_RECIPROCAL
     if (freq != 0) {
       info[s].ifreq_ =
           ((1ull << RECIPROCAL_PRECISION) + info[s].freq_ - 1) / info[s].freq_;
     } else {
       info[s].ifreq_ = 1;  // shouldn't matter (symbol shoudln't occur), but...
     }
-#endif
   }
 }
 
-}  // namespace
-
 void BuildAndStoreANSEncodingData(const int* histogram,
                                   int alphabet_size,
                                   ANSEncSymbolInfo* info,
@@ -29,8 +29,6 @@
 
 namespace pik {
 
-#define USE_MULT_BY_RECIPROCAL
-
 // precision must be equal to:  #bits(state_) + #bits(freq)
 #define RECIPROCAL_PRECISION 42
 
@@ -39,9 +37,7 @@ namespace pik {
 struct ANSEncSymbolInfo {
   uint16_t freq_;
   uint16_t start_;
-#ifdef USE_MULT_BY_RECIPROCAL
   uint64_t ifreq_;
-#endif
 };
 
 class ANSCoder {
@@ -56,15 +52,12 @@ class ANSCoder {
       state_ >>= 16;
       *nbits = 16;
     }
-#ifdef USE_MULT_BY_RECIPROCAL
-    // We use mult-by-reciprocal trick, but that requires 64b calc.
+    // We use mult-by-reciprocal trick, but that requires 64b calc. This avoids
+    // a division, and interleaved coders (see ANSSymbolWriter) only need
+    // independent multiplications that the CPU can overlap.
     const uint32_t v = (state_ * t.ifreq_) >> RECIPROCAL_PRECISION;
     const uint32_t offset = state_ - v * t.freq_ + t.start_;
     state_ = (v << ANS_LOG_TAB_SIZE) + offset;
-#else
-    state_ = ((state_ / t.freq_) << ANS_LOG_TAB_SIZE)
-           + (state_ % t.freq_) + t.start_;
-#endif
     return bits;
   }
 
@@ -74,6 +67,11 @@ class ANSCoder {
   uint32_t state_;
 };
 
+// Builds the encoding table from already normalized counts, which must sum to
+// ANS_TAB_SIZE.
+void ANSBuildInfoTable(const int* counts, int alphabet_size,
+                       ANSEncSymbolInfo* info);
+
 void BuildAndStoreANSEncodingData(const int* histogram,
                                   int alphabet_size,
                                   ANSEncSymbolInfo* info,
@@ -0,0 +1,431 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the hot kernels of the encoder and decoder in isolation on a
+// synthetic image and reports cycles per element, so that kernel-level
+// regressions are visible despite the noise of end-to-end measurements.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bit_reader.h"
+#include "butteraugli/butteraugli.h"
+#include "cluster.h"
+#include "compressed_image.h"
+#include "dc_predictor.h"
+#include "dct.h"
+#include "gamma_correct.h"
+#include "histogram_encode.h"
+#include "huffman_decode.h"
+#include "huffman_encode.h"
+#include "image.h"
+#include "opsin_codec.h"
+#include "opsin_image.h"
+#include "robust_statistics.h"
+#include "simd/dispatch.h"
+#include "status.h"
+#include "tsc_timer.h"
+#include "write_bits.h"
+
+namespace pik {
+namespace {
+
+// Written by kernels whose results would otherwise be unused.
+volatile uint32_t g_sink;
+
+// The kernels are compiled for a single instruction set, SIMD_TARGET.
+const char* TargetName(const int target) {
+#if SIMD_ARCH_X86
+  if (target == SIMD_AVX2) return "AVX2";
+  if (target == SIMD_SSE4) return "SSE4";
+#endif
+  return "None";
+}
+
+struct Result {
+  std::string kernel;
+  size_t num_elements;
+  // Mode of the samples divided by num_elements.
+  double cycles_per_element;
+  // Median absolute deviation of the samples relative to their median [%].
+  double variability;
+};
+
+// Calls "func", which processes "num_elements" elements, once to warm up the
+// caches and then "num_samples" times, each timed with the TSC.
+template <class Func>
+Result Measure(const char* kernel, const size_t num_elements,
+               const int num_samples, const Func& func) {
+  func();
+  std::vector<uint64_t> ticks(num_samples);
+  for (int i = 0; i < num_samples; ++i) {
+    const uint64_t t0 = Start<uint64_t>();
+    func();
+    const uint64_t t1 = Stop<uint64_t>();
+    ticks[i] = t1 - t0;
+  }
+  std::sort(ticks.begin(), ticks.end());
+  std::vector<double> samples(ticks.begin(), ticks.end());
+  const double median = Median(&samples);
+  Result result;
+  result.kernel = kernel;
+  result.num_elements = num_elements;
+  result.cycles_per_element =
+      static_cast<double>(Mode(ticks.data(), ticks.size())) / num_elements;
+  result.variability =
+      100.0 * MedianAbsoluteDeviation(samples, median) / median;
+  return result;
+}
+
+// Smooth gradients plus noise, so that the DCT coefficients and symbols have
+// roughly the statistics of photographs. The seed is fixed so that results
+// are comparable between runs.
+Image3B SyntheticImage(const size_t xsize, const size_t ysize) {
+  std::mt19937 rng(129);
+  std::uniform_int_distribution<int> noise(-12, 12);
+  Image3B srgb(xsize, ysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    auto row = srgb.Row(y);
+    for (size_t x = 0; x < xsize; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        const double wave = std::sin(x / (11.0 + 4 * c)) *
+                            std::cos(y / (17.0 - 3 * c));
+        const int value = 128 + static_cast<int>(80 * wave) + noise(rng);
+        row[c][x] = std::min(std::max(value, 0), 255);
+      }
+    }
+  }
+  return srgb;
+}
+
+// Returns "bytes" zero-padded to a multiple of 4, as required by BitReader.
+std::vector<uint8_t> PadForBitReader(const uint8_t* bytes, const size_t size) {
+  std::vector<uint8_t> padded(bytes, bytes + size);
+  padded.resize((size + 3) & ~3, 0);
+  return padded;
+}
+
+bool Matches(const char* filter, const char* kernel) {
+  return filter == nullptr || strstr(kernel, filter) != nullptr;
+}
+
+int PrintArgHelp(int argc, char** argv) {
+  fprintf(stderr,
+      "Usage: %s [--filter <substring>] [--samples <n>] [--size <pixels>]\n"
+      " --filter: Only runs kernels whose name contains the substring.\n"
+      " --samples: Number of timed calls per kernel. Default: 51.\n"
+      " --size: Width and height of the synthetic image, a multiple of 8."
+      " Default: 512.\n"
+      "Reports the mode of the TSC ticks per element and the median absolute"
+      "\ndeviation of the samples.\n",
+      argv[0]);
+  return 1;
+}
+
+int Run(int argc, char** argv) {
+  if (!dispatch::IsSupported<SIMD_TARGET>(dispatch::SupportedTargets())) {
+    fprintf(stderr, "Cannot continue because CPU lacks %s support.\n",
+            TargetName(SIMD_TARGET::value));
+    return 1;
+  }
+  const char* filter = nullptr;
+  int num_samples = 51;
+  int size = 512;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (arg == "--samples" && i + 1 < argc) {
+      num_samples = strtol(argv[++i], nullptr, 10);
+      if (num_samples <= 0) return PrintArgHelp(argc, argv);
+    } else if (arg == "--size" && i + 1 < argc) {
+      size = strtol(argv[++i], nullptr, 10);
+      if (size < 16 || size % 8 != 0) return PrintArgHelp(argc, argv);
+    } else {
+      return PrintArgHelp(argc, argv);
+    }
+  }
+
+  const size_t xsize = size;
+  const size_t ysize = size;
+  const size_t num_pixels = xsize * ysize;
+  const size_t block_xsize = xsize / 8;
+  const size_t block_ysize = ysize / 8;
+  const size_t num_coeffs = 3 * num_pixels;
+  const Image3B srgb = SyntheticImage(xsize, ysize);
+  const Image3F linear = LinearFromSrgb(srgb);
+  Image3F opsin = OpsinDynamicsImage(linear);
+
+  // Each row of "pixels" holds one row of blocks, each block contiguous, and
+  // the corresponding row of "coeffs" their DCT.
+  Image3F pixels(block_xsize * 64, block_ysize);
+  Image3F coeffs(block_xsize * 64, block_ysize);
+  for (size_t by = 0; by < block_ysize; ++by) {
+    for (int c = 0; c < 3; ++c) {
+      for (size_t bx = 0; bx < block_xsize; ++bx) {
+        float* PIK_RESTRICT block = pixels.PlaneRow(c, by) + bx * 64;
+        for (int iy = 0; iy < 8; ++iy) {
+          memcpy(block + iy * 8, opsin.PlaneRow(c, by * 8 + iy) + bx * 8,
+                 8 * sizeof(float));
+        }
+        float* PIK_RESTRICT coeff_block = coeffs.PlaneRow(c, by) + bx * 64;
+        memcpy(coeff_block, block, 64 * sizeof(float));
+        ComputeTransposedScaledBlockDCTFloat(coeff_block);
+      }
+    }
+  }
+
+  CompressedImage img = CompressedImage::FromOpsinImage(opsin, nullptr,
+                                                        nullptr);
+  img.quantizer().SetQuant(1.0f);
+  img.Quantize();
+  const Image3W& qcoeffs = img.coeffs();
+
+  std::vector<Result> results;
+
+  // Both transforms include copying their input block to "transformed",
+  // because repeated in-place transforms would overflow.
+  Image3F transformed(block_xsize * 64, block_ysize);
+  const auto transform_all = [&](const Image3F& in, void (*transform)(float*)) {
+    for (size_t by = 0; by < block_ysize; ++by) {
+      for (int c = 0; c < 3; ++c) {
+        const float* PIK_RESTRICT row_in = in.PlaneRow(c, by);
+        float* PIK_RESTRICT row_out = transformed.PlaneRow(c, by);
+        for (size_t bx = 0; bx < block_xsize; ++bx) {
+          memcpy(row_out + bx * 64, row_in + bx * 64, 64 * sizeof(float));
+          transform(row_out + bx * 64);
+        }
+      }
+    }
+  };
+  if (Matches(filter, "DCT")) {
+    results.push_back(Measure("DCT", num_coeffs, num_samples, [&]() {
+      transform_all(pixels, &ComputeTransposedScaledBlockDCTFloat);
+    }));
+  }
+  if (Matches(filter, "IDCT")) {
+    results.push_back(Measure("IDCT", num_coeffs, num_samples, [&]() {
+      transform_all(coeffs, &ComputeTransposedScaledBlockIDCTFloat);
+    }));
+  }
+
+  if (Matches(filter, "QuantizeBlock")) {
+    const Quantizer& quantizer = img.quantizer();
+    Image3W quantized(block_xsize * 64, block_ysize);
+    results.push_back(Measure("QuantizeBlock", num_coeffs, num_samples, [&]() {
+      for (size_t by = 0; by < block_ysize; ++by) {
+        for (int c = 0; c < 3; ++c) {
+          const float* PIK_RESTRICT row_in = coeffs.PlaneRow(c, by);
+          int16_t* PIK_RESTRICT row_out = quantized.PlaneRow(c, by);
+          for (size_t bx = 0; bx < block_xsize; ++bx) {
+            quantizer.QuantizeBlock(bx, by, c, 0, 64, row_in + bx * 64,
+                                    row_out + bx * 64);
+          }
+        }
+      }
+    }));
+  }
+
+  if (Matches(filter, "DequantizeBlock")) {
+    // Three channels of 64 coefficients per block.
+    ImageF dequantized(block_xsize * 3 * 64, block_ysize);
+    results.push_back(Measure("DequantizeBlock", num_coeffs, num_samples,
+                              [&]() {
+      for (size_t by = 0; by < block_ysize; ++by) {
+        float* PIK_RESTRICT row = dequantized.Row(by);
+        for (size_t bx = 0; bx < block_xsize; ++bx) {
+          img.DequantizeBlock(bx, by, row + bx * 3 * 64);
+        }
+      }
+    }));
+  }
+
+  // ANSSymbolReader is internal to opsin_codec.cc; DecodeImage with stride 1
+  // is a thin loop around its ReadSymbol plus the extra bits.
+  if (Matches(filter, "ANS ReadSymbol")) {
+    const std::string encoded = EncodeImage(qcoeffs, 1, nullptr);
+    const std::vector<uint8_t> data = PadForBitReader(
+        reinterpret_cast<const uint8_t*>(encoded.data()), encoded.size());
+    Image3W decoded(qcoeffs.xsize(), qcoeffs.ysize());
+    DecoderTables tables;
+    results.push_back(Measure("ANS ReadSymbol", num_coeffs, num_samples,
+                              [&]() {
+      BitReader br(data.data(), data.size());
+      PIK_CHECK(DecodeImage(&br, 1, &decoded, &tables));
+    }));
+  }
+
+  // HuffmanSymbolReader is internal to opsin_codec.cc and performs the same
+  // table lookups as HuffmanDecoder::ReadSymbol.
+  if (Matches(filter, "Huffman ReadSymbol")) {
+    const int kAlphabetSize = 64;
+    std::vector<int> symbols;
+    symbols.reserve(num_coeffs);
+    uint32_t histogram[kAlphabetSize] = {0};
+    for (size_t y = 0; y < qcoeffs.ysize(); ++y) {
+      for (int c = 0; c < 3; ++c) {
+        const int16_t* PIK_RESTRICT row = qcoeffs.PlaneRow(c, y);
+        for (size_t x = 0; x < qcoeffs.xsize(); ++x) {
+          const int symbol = std::min<int>(std::abs(row[x]), kAlphabetSize - 1);
+          symbols.push_back(symbol);
+          ++histogram[symbol];
+        }
+      }
+    }
+    uint8_t depths[kAlphabetSize];
+    uint16_t bits[kAlphabetSize];
+    std::vector<uint8_t> tree_storage(1024, 0);
+    size_t tree_ix = 0;
+    BuildAndStoreHuffmanTree(histogram, kAlphabetSize, depths, bits, &tree_ix,
+                             tree_storage.data());
+    const std::vector<uint8_t> tree =
+        PadForBitReader(tree_storage.data(), (tree_ix + 7) / 8);
+    // Symbols are at most 15 bits.
+    std::vector<uint8_t> storage(2 * symbols.size() + 8, 0);
+    size_t storage_ix = 0;
+    for (const int symbol : symbols) {
+      WriteBits(depths[symbol], bits[symbol], &storage_ix, storage.data());
+    }
+    const std::vector<uint8_t> data =
+        PadForBitReader(storage.data(), (storage_ix + 7) / 8);
+    HuffmanDecodingData code;
+    BitReader tree_reader(tree.data(), tree.size());
+    PIK_CHECK(code.ReadFromBitStream(&tree_reader));
+    results.push_back(Measure("Huffman ReadSymbol", num_coeffs, num_samples,
+                              [&]() {
+      BitReader br(data.data(), data.size());
+      HuffmanDecoder decoder;
+      uint32_t sum = 0;
+      for (size_t i = 0; i < num_coeffs; ++i) {
+        sum += decoder.ReadSymbol(code, &br);
+      }
+      g_sink = sum;
+    }));
+  }
+
+  if (Matches(filter, "ShrinkY") || Matches(filter, "ExpandY")) {
+    Image<DC> dc(xsize, ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      const uint8_t* PIK_RESTRICT row_in = srgb.PlaneRow(1, y);
+      DC* PIK_RESTRICT row_out = dc.Row(y);
+      for (size_t x = 0; x < xsize; ++x) {
+        row_out[x] = 16 * row_in[x];
+      }
+    }
+    Image<DC> residuals(xsize, ysize);
+    Image<DC> expanded(xsize, ysize);
+    ShrinkY(dc, &residuals);
+    if (Matches(filter, "ShrinkY")) {
+      results.push_back(Measure("ShrinkY", num_pixels, num_samples, [&]() {
+        ShrinkY(dc, &residuals);
+      }));
+    }
+    if (Matches(filter, "ExpandY")) {
+      results.push_back(Measure("ExpandY", num_pixels, num_samples, [&]() {
+        ExpandY(residuals, nullptr, &expanded);
+      }));
+    }
+  }
+
+  if (Matches(filter, "OpsinDynamicsImage")) {
+    results.push_back(Measure("OpsinDynamicsImage", num_pixels, num_samples,
+                              [&]() {
+      const Image3F xyb = OpsinDynamicsImage(linear);
+      g_sink = xyb.xsize();
+    }));
+  }
+
+  if (Matches(filter, "LinearFromSrgb")) {
+    results.push_back(Measure("LinearFromSrgb", num_pixels, num_samples,
+                              [&]() {
+      const Image3F converted = LinearFromSrgb(srgb);
+      g_sink = converted.xsize();
+    }));
+  }
+
+  if (Matches(filter, "Convolution")) {
+    // Sigma of the largest blur of the butteraugli frequency decomposition.
+    const std::vector<float> kernel = butteraugli::ComputeKernel(7.15f);
+    butteraugli::ImageF plane(xsize, ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(plane.Row(y), linear.PlaneRow(1, y), xsize * sizeof(float));
+    }
+    results.push_back(Measure("Convolution", num_pixels, num_samples, [&]() {
+      const butteraugli::ImageF convolved =
+          butteraugli::Convolution(plane, kernel, 0.0f);
+      g_sink = convolved.xsize();
+    }));
+  }
+
+  if (Matches(filter, "MaltaUnit")) {
+    std::vector<float> diffs(num_pixels);
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(&diffs[y * xsize], linear.PlaneRow(1, y), xsize * sizeof(float));
+    }
+    std::vector<float> out(num_pixels);
+    // Only pixels whose neighborhood lies within the image.
+    const size_t num_interior = (xsize - 8) * (ysize - 8);
+    results.push_back(Measure("MaltaUnit", num_interior, num_samples, [&]() {
+      for (size_t y = 4; y < ysize - 4; ++y) {
+        butteraugli::MaltaUnit(&diffs[y * xsize + 4], xsize, xsize - 8,
+                               &out[y * xsize + 4]);
+      }
+    }));
+  }
+
+  if (Matches(filter, "ClusterHistograms")) {
+    // One histogram of the absolute values per channel and coefficient index,
+    // elements are input histograms.
+    typedef Histogram<64> HistogramType;
+    std::vector<HistogramType> histograms(3 * 64);
+    for (size_t y = 0; y < qcoeffs.ysize(); ++y) {
+      for (int c = 0; c < 3; ++c) {
+        const int16_t* PIK_RESTRICT row = qcoeffs.PlaneRow(c, y);
+        for (size_t x = 0; x < qcoeffs.xsize(); ++x) {
+          histograms[c * 64 + x % 64].Add(std::min(std::abs(row[x]), 63));
+        }
+      }
+    }
+    results.push_back(Measure("ClusterHistograms", histograms.size(),
+                              num_samples, [&]() {
+      std::vector<HistogramType> clustered;
+      std::vector<uint32_t> histogram_symbols;
+      ClusterHistograms(histograms, histograms.size(), 1, std::vector<int>(),
+                        64, &clustered, &histogram_symbols);
+      g_sink = clustered.size();
+    }));
+  }
+
+  printf("%-20s %-6s %10s %12s %7s\n", "kernel", "target", "elements",
+         "cycles/elem", "MAD%");
+  for (const Result& r : results) {
+    printf("%-20s %-6s %10zu %12.3f %7.2f\n", r.kernel.c_str(),
+           TargetName(SIMD_TARGET::value), r.num_elements,
+           r.cycles_per_element, r.variability);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main(int argc, char** argv) { return pik::Run(argc, argv); }
@@ -0,0 +1,909 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Encodes and decodes each image of a corpus repeatedly and in memory for a
+// set of modes, and reports speed, size, butteraugli distance and memory.
+// Alternatively reports how the speed scales with the number of threads, or
+// checks that the encodes do not depend on it nor on the instruction set.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "butteraugli_distance.h"
+#include "cache_aligned.h"
+#include "gamma_correct.h"
+#include "image.h"
+#include "image_io.h"
+#include "kernel_targets.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_info.h"
+#include "robust_statistics.h"
+#include "simd/dispatch.h"
+#include "thread_pool.h"
+
+namespace pik {
+namespace {
+
+struct Mode {
+  std::string name;
+  CompressParams params;
+};
+
+// Parses "fast", "distance=<d>", "bitrate=<bpp>" or "uniform=<quant>".
+bool ParseMode(const std::string& spec, Mode* mode) {
+  mode->name = spec;
+  mode->params = CompressParams();
+  if (spec == "fast") {
+    mode->params.fast_mode = true;
+    return true;
+  }
+  const size_t eq = spec.find('=');
+  if (eq == std::string::npos) return false;
+  const std::string key = spec.substr(0, eq);
+  char* end;
+  const double value = strtod(spec.c_str() + eq + 1, &end);
+  if (*end != '\0' || !(value > 0.0)) return false;
+  if (key == "distance") {
+    mode->params.butteraugli_distance = value;
+  } else if (key == "bitrate") {
+    mode->params.target_bitrate = value;
+  } else if (key == "uniform") {
+    mode->params.uniform_quant = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool ParseModes(const char* list, std::vector<Mode>* modes) {
+  modes->clear();
+  const std::string specs(list);
+  size_t begin = 0;
+  while (begin <= specs.size()) {
+    size_t end = specs.find(',', begin);
+    if (end == std::string::npos) end = specs.size();
+    Mode mode;
+    if (!ParseMode(specs.substr(begin, end - begin), &mode)) {
+      fprintf(stderr, "Invalid mode '%s'.\n",
+              specs.substr(begin, end - begin).c_str());
+      return false;
+    }
+    modes->push_back(mode);
+    begin = end + 1;
+  }
+  return true;
+}
+
+// Sets "pathnames" to the images in directory "corpus" (sorted by name), or
+// to "corpus" itself if it is a file.
+bool ListCorpus(const char* corpus, std::vector<std::string>* pathnames) {
+  pathnames->clear();
+  struct stat info;
+  if (stat(corpus, &info) != 0) {
+    fprintf(stderr, "Failed to open %s.\n", corpus);
+    return false;
+  }
+  if (!S_ISDIR(info.st_mode)) {
+    pathnames->push_back(corpus);
+    return true;
+  }
+  return ListImageFiles(corpus, pathnames);
+}
+
+double Now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Returns the nearest-rank "percentile" of "values" (not empty).
+double Percentile(std::vector<double> values, const double percentile) {
+  std::sort(values.begin(), values.end());
+  size_t rank = static_cast<size_t>(percentile / 100.0 * values.size() + 0.5);
+  rank = std::min(std::max<size_t>(rank, 1), values.size());
+  return values[rank - 1];
+}
+
+// Measurements of one image in one mode; latencies in seconds.
+struct Result {
+  std::string image;
+  std::string mode;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  size_t compressed_size = 0;
+  float distance = 0.0f;
+  std::vector<double> encode_seconds;
+  std::vector<double> decode_seconds;
+  // Maximum over all repetitions of AllocationStats::peak_live_bytes of the
+  // encode/decode call, excluding the input image.
+  size_t encode_peak_bytes = 0;
+  size_t decode_peak_bytes = 0;
+
+  double Megapixels() const { return xsize * ysize * 1E-6; }
+  double BitsPerPixel() const {
+    return compressed_size * 8.0 / (xsize * ysize);
+  }
+  // Throughput of the median repetition.
+  double EncodeMPS() const {
+    return Megapixels() / Percentile(encode_seconds, 50);
+  }
+  double DecodeMPS() const {
+    return Megapixels() / Percentile(decode_seconds, 50);
+  }
+};
+
+// Encodes and decodes "linear" "reps" times. The distance is that of the
+// (identical) last decoded image. Statistics of all repetitions are added to
+// "encode_info" and "decode_info" unless they are null.
+bool BenchmarkImage(const MetaImageF& linear, const Mode& mode, const int reps,
+                    PikEncoder* encoder, PikDecoder* decoder, Result* result,
+                    PikInfo* encode_info = nullptr,
+                    PikInfo* decode_info = nullptr) {
+  CompressParams params = mode.params;
+  params.alpha_channel = linear.HasAlpha();
+  const DecompressParams dparams;
+  result->xsize = linear.xsize();
+  result->ysize = linear.ysize();
+  MetaImageB decoded;
+  for (int rep = 0; rep < reps; ++rep) {
+    PaddedBytes compressed;
+    AllocationStats encode_stats;
+    double start = Now();
+    {
+      AllocationTracker tracker(&encode_stats);
+      if (!encoder->PixelsToPik(params, linear, &compressed, encode_info)) {
+        fprintf(stderr, "Failed to compress %s (%s).\n",
+                result->image.c_str(), mode.name.c_str());
+        return false;
+      }
+    }
+    result->encode_seconds.push_back(Now() - start);
+    result->encode_peak_bytes =
+        std::max(result->encode_peak_bytes, encode_stats.peak_live_bytes);
+    result->compressed_size = compressed.size();
+
+    AllocationStats decode_stats;
+    start = Now();
+    {
+      AllocationTracker tracker(&decode_stats);
+      if (!decoder->PikToPixels(dparams, compressed, &decoded,
+                                decode_info)) {
+        fprintf(stderr, "Failed to decompress %s (%s).\n",
+                result->image.c_str(), mode.name.c_str());
+        return false;
+      }
+    }
+    result->decode_seconds.push_back(Now() - start);
+    result->decode_peak_bytes =
+        std::max(result->decode_peak_bytes, decode_stats.peak_live_bytes);
+  }
+  result->distance = ButteraugliDistance(
+      linear.GetColor(), LinearFromSrgb(decoded.GetColor()), nullptr);
+  return true;
+}
+
+void PrintResult(const Result& r) {
+  printf("%-30s %-14s %5zux%-5zu %9zu %7.4f %7.4f %8.3f %8.3f %9.2f %9.2f"
+         " %9.2f %9.2f %9.2f %9.2f %8.1f %8.1f\n",
+         r.image.c_str(), r.mode.c_str(), r.xsize, r.ysize, r.compressed_size,
+         r.BitsPerPixel(), r.distance, r.EncodeMPS(), r.DecodeMPS(),
+         1E3 * Percentile(r.encode_seconds, 50),
+         1E3 * Percentile(r.encode_seconds, 90),
+         1E3 * Percentile(r.encode_seconds, 100),
+         1E3 * Percentile(r.decode_seconds, 50),
+         1E3 * Percentile(r.decode_seconds, 90),
+         1E3 * Percentile(r.decode_seconds, 100),
+         r.encode_peak_bytes / 1048576.0, r.decode_peak_bytes / 1048576.0);
+}
+
+// Totals of all images of each mode: pixels and sizes are summed, throughput
+// is that of the summed median latencies and the distance is the maximum.
+void PrintModeTotals(const std::vector<Mode>& modes,
+                     const std::vector<Result>& results) {
+  printf("\n%-14s %6s %9s %10s %7s %7s %8s %8s\n", "mode", "images", "MP",
+         "bytes", "bpp", "maxdist", "enc_MP/s", "dec_MP/s");
+  for (const Mode& mode : modes) {
+    size_t num_images = 0;
+    size_t bytes = 0;
+    double megapixels = 0.0;
+    double encode_seconds = 0.0;
+    double decode_seconds = 0.0;
+    float max_distance = 0.0f;
+    for (const Result& r : results) {
+      if (r.mode != mode.name) continue;
+      ++num_images;
+      bytes += r.compressed_size;
+      megapixels += r.Megapixels();
+      encode_seconds += Percentile(r.encode_seconds, 50);
+      decode_seconds += Percentile(r.decode_seconds, 50);
+      max_distance = std::max(max_distance, r.distance);
+    }
+    if (num_images == 0) continue;
+    printf("%-14s %6zu %9.3f %10zu %7.4f %7.4f %8.3f %8.3f\n",
+           mode.name.c_str(), num_images, megapixels, bytes,
+           bytes * 8E-6 / megapixels, max_distance,
+           megapixels / encode_seconds, megapixels / decode_seconds);
+  }
+}
+
+bool WriteCSV(const std::vector<Result>& results, const char* pathname) {
+  FILE* f = fopen(pathname, "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname);
+    return false;
+  }
+  fprintf(f,
+          "image,mode,xsize,ysize,bytes,bpp,distance,encode_mps,decode_mps,"
+          "encode_p50_ms,encode_p90_ms,encode_max_ms,decode_p50_ms,"
+          "decode_p90_ms,decode_max_ms,encode_peak_bytes,decode_peak_bytes\n");
+  for (const Result& r : results) {
+    fprintf(f, "\"%s\",%s,%zu,%zu,%zu,%.6f,%.6f,%.6f,%.6f,%.4f,%.4f,%.4f,"
+            "%.4f,%.4f,%.4f,%zu,%zu\n",
+            r.image.c_str(), r.mode.c_str(), r.xsize, r.ysize,
+            r.compressed_size, r.BitsPerPixel(), r.distance, r.EncodeMPS(),
+            r.DecodeMPS(), 1E3 * Percentile(r.encode_seconds, 50),
+            1E3 * Percentile(r.encode_seconds, 90),
+            1E3 * Percentile(r.encode_seconds, 100),
+            1E3 * Percentile(r.decode_seconds, 50),
+            1E3 * Percentile(r.decode_seconds, 90),
+            1E3 * Percentile(r.decode_seconds, 100), r.encode_peak_bytes,
+            r.decode_peak_bytes);
+  }
+  return fclose(f) == 0;
+}
+
+std::string JSONString(const std::string& s) {
+  std::string quoted = "\"";
+  for (const char c : s) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+std::string JSONArray(const std::vector<double>& values) {
+  std::string array = "[";
+  char buf[32];
+  for (size_t i = 0; i < values.size(); ++i) {
+    snprintf(buf, sizeof(buf), "%s%.6f", i == 0 ? "" : ", ", values[i]);
+    array += buf;
+  }
+  return array + "]";
+}
+
+// Also includes the latencies of all repetitions.
+bool WriteJSON(const std::vector<Result>& results, const char* pathname) {
+  FILE* f = fopen(pathname, "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname);
+    return false;
+  }
+  fprintf(f, "[\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    fprintf(f,
+            "  {\"image\": %s, \"mode\": %s, \"xsize\": %zu, \"ysize\": %zu,"
+            " \"bytes\": %zu, \"bpp\": %.6f, \"distance\": %.6f,"
+            " \"encode_mps\": %.6f, \"decode_mps\": %.6f,"
+            " \"encode_seconds\": %s, \"decode_seconds\": %s,"
+            " \"encode_peak_bytes\": %zu, \"decode_peak_bytes\": %zu}%s\n",
+            JSONString(r.image).c_str(), JSONString(r.mode).c_str(), r.xsize,
+            r.ysize, r.compressed_size, r.BitsPerPixel(), r.distance,
+            r.EncodeMPS(), r.DecodeMPS(), JSONArray(r.encode_seconds).c_str(),
+            JSONArray(r.decode_seconds).c_str(), r.encode_peak_bytes,
+            r.decode_peak_bytes, i + 1 == results.size() ? "" : ",");
+  }
+  fprintf(f, "]\n");
+  return fclose(f) == 0;
+}
+
+// Robust summary of the latencies of one image and mode [seconds].
+struct LatencyStats {
+  explicit LatencyStats(std::vector<double> seconds) {
+    median = Median(&seconds);
+    mad = MedianAbsoluteDeviation(seconds, median);
+  }
+  LatencyStats(const double median, const double mad)
+      : median(median), mad(mad) {}
+
+  double median;
+  double mad;
+};
+
+// One line of a baseline file, see WriteBaseline.
+struct BaselineEntry {
+  std::string image;
+  std::string mode;
+  size_t compressed_size;
+  float distance;
+  LatencyStats encode;
+  LatencyStats decode;
+};
+
+const char* kBaselineHeader = "# benchmark_pik baseline 1";
+
+// Writes one tab-separated line per result: image, mode, compressed size,
+// distance and the median and median absolute deviation of the encode and
+// decode latencies.
+bool WriteBaseline(const std::vector<Result>& results, const char* pathname) {
+  FILE* f = fopen(pathname, "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname);
+    return false;
+  }
+  fprintf(f, "%s\n", kBaselineHeader);
+  for (const Result& r : results) {
+    const LatencyStats encode(r.encode_seconds);
+    const LatencyStats decode(r.decode_seconds);
+    fprintf(f, "%s\t%s\t%zu\t%.6f\t%.9f\t%.9f\t%.9f\t%.9f\n",
+            r.image.c_str(), r.mode.c_str(), r.compressed_size, r.distance,
+            encode.median, encode.mad, decode.median, decode.mad);
+  }
+  return fclose(f) == 0;
+}
+
+bool ReadBaseline(const char* pathname, std::vector<BaselineEntry>* entries) {
+  entries->clear();
+  FILE* f = fopen(pathname, "r");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname);
+    return false;
+  }
+  bool ok = true;
+  std::string line;
+  bool header = true;
+  for (int c = fgetc(f); ok && c != EOF; c = fgetc(f)) {
+    if (c != '\n') {
+      line += static_cast<char>(c);
+      continue;
+    }
+    if (header) {
+      ok = line == kBaselineHeader;
+      header = false;
+      line.clear();
+      continue;
+    }
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    for (;;) {
+      const size_t end = line.find('\t', begin);
+      fields.push_back(line.substr(begin, end - begin));
+      if (end == std::string::npos) break;
+      begin = end + 1;
+    }
+    ok = fields.size() == 8;
+    if (ok) {
+      entries->push_back(BaselineEntry{
+          fields[0], fields[1], strtoull(fields[2].c_str(), nullptr, 10),
+          strtof(fields[3].c_str(), nullptr),
+          LatencyStats(strtod(fields[4].c_str(), nullptr),
+                       strtod(fields[5].c_str(), nullptr)),
+          LatencyStats(strtod(fields[6].c_str(), nullptr),
+                       strtod(fields[7].c_str(), nullptr))});
+    }
+    line.clear();
+  }
+  fclose(f);
+  if (!ok || header) {
+    fprintf(stderr, "Invalid baseline file %s.\n", pathname);
+    return false;
+  }
+  return true;
+}
+
+// Returns the relative change of the median latency, or zero if it is within
+// the noise: "sigmas" times the combined standard deviations estimated from
+// the MADs, and at least "tolerance" (a fraction of the baseline).
+double SignificantChange(const LatencyStats& baseline,
+                         const LatencyStats& current, const double sigmas,
+                         const double tolerance) {
+  // Consistent estimator of the standard deviation for normal distributions.
+  const double kMADToSigma = 1.4826;
+  const double noise =
+      sigmas * kMADToSigma *
+      std::sqrt(baseline.mad * baseline.mad + current.mad * current.mad);
+  const double delta = current.median - baseline.median;
+  if (std::abs(delta) <= std::max(noise, tolerance * baseline.median)) {
+    return 0.0;
+  }
+  return delta / baseline.median;
+}
+
+// Prints the significant changes of "results" relative to "baseline" and
+// returns whether any image or mode became slower or larger, or is missing.
+bool CompareToBaseline(const std::vector<Result>& results,
+                       const std::vector<BaselineEntry>& baseline,
+                       const double tolerance) {
+  const double kSigmas = 3.0;
+  printf("\n%-30s %-14s %9s %9s %10s %9s  %s\n", "image", "mode", "enc_delta",
+         "dec_delta", "size_delta", "dist_delta", "verdict");
+  size_t num_slower = 0;
+  size_t num_larger = 0;
+  size_t num_bitstream_changes = 0;
+  size_t num_missing = 0;
+  for (const Result& r : results) {
+    const BaselineEntry* entry = nullptr;
+    for (const BaselineEntry& e : baseline) {
+      if (e.image == r.image && e.mode == r.mode) entry = &e;
+    }
+    if (entry == nullptr) {
+      printf("%-30s %-14s not in baseline\n", r.image.c_str(), r.mode.c_str());
+      continue;
+    }
+    const double encode_change =
+        SignificantChange(entry->encode, LatencyStats(r.encode_seconds),
+                          kSigmas, tolerance);
+    const double decode_change =
+        SignificantChange(entry->decode, LatencyStats(r.decode_seconds),
+                          kSigmas, tolerance);
+    const long size_delta = static_cast<long>(r.compressed_size) -
+                            static_cast<long>(entry->compressed_size);
+    const float distance_delta = r.distance - entry->distance;
+    std::string verdict;
+    if (encode_change > 0.0 || decode_change > 0.0) {
+      verdict += " SLOWER";
+      ++num_slower;
+    } else if (encode_change < 0.0 || decode_change < 0.0) {
+      verdict += " faster";
+    }
+    if (size_delta > 0) {
+      verdict += " LARGER";
+      ++num_larger;
+    } else if (size_delta < 0) {
+      verdict += " smaller";
+    }
+    // The encoder is deterministic, so any change of the size or distance
+    // means that the bitstream changed.
+    if (size_delta != 0 || std::abs(distance_delta) > 1E-4f) {
+      verdict += " (bitstream changed)";
+      ++num_bitstream_changes;
+    }
+    if (verdict.empty()) continue;
+    printf("%-30s %-14s %8.1f%% %8.1f%% %10ld %+9.4f %s\n", r.image.c_str(),
+           r.mode.c_str(), 100.0 * encode_change, 100.0 * decode_change,
+           size_delta, distance_delta, verdict.c_str());
+  }
+  for (const BaselineEntry& e : baseline) {
+    bool found = false;
+    for (const Result& r : results) {
+      found |= e.image == r.image && e.mode == r.mode;
+    }
+    if (!found) {
+      printf("%-30s %-14s missing (in baseline)\n", e.image.c_str(),
+             e.mode.c_str());
+      ++num_missing;
+    }
+  }
+  printf("\n%zu slower, %zu larger, %zu bitstream changes, %zu missing"
+         " (latency threshold: %.0f MAD sigmas and %.1f%%)\n",
+         num_slower, num_larger, num_bitstream_changes, num_missing, kSigmas,
+         100.0 * tolerance);
+  return num_slower == 0 && num_larger == 0 && num_missing == 0;
+}
+
+struct CorpusImage {
+  std::string pathname;
+  MetaImageF linear;
+};
+
+// Returns "percent" of the idle time of each worker relative to the time
+// spent in Run, e.g. " 3 12 40".
+std::string IdlePercentPerThread(const ThreadPoolStats& stats) {
+  std::string list;
+  char buf[16];
+  for (const double idle : stats.idle_seconds) {
+    const double percent =
+        stats.run_seconds == 0.0 ? 0.0 : 100.0 * idle / stats.run_seconds;
+    snprintf(buf, sizeof(buf), " %.0f", percent);
+    list += buf;
+  }
+  return list;
+}
+
+// Prints the stealing, serial and idle shares of "stats" (all in percent).
+void PrintPoolShares(const ThreadPoolStats& stats) {
+  const uint64_t all_tasks = stats.num_tasks + stats.num_serial_tasks;
+  const size_t num_workers = stats.idle_seconds.size();
+  const double stolen =
+      stats.num_tasks == 0 ? 0.0 : 100.0 * stats.num_stolen / stats.num_tasks;
+  const double serial =
+      all_tasks == 0 ? 0.0 : 100.0 * stats.num_serial_tasks / all_tasks;
+  const double idle = stats.run_seconds == 0.0
+                          ? 0.0
+                          : 100.0 * stats.TotalIdleSeconds() /
+                                (stats.run_seconds * num_workers);
+  printf(" %9llu %7.1f %7.1f %7.1f",
+         static_cast<unsigned long long>(all_tasks), stolen, serial, idle);
+}
+
+// Encodes and decodes each image with one encoder and decoder whose pool has
+// 1..max_threads threads. Speedup and efficiency are relative to one thread;
+// the utilization of each stage (average number of busy threads) reveals
+// serial stages that limit the scaling.
+bool ScalingWithinImages(const std::vector<CorpusImage>& images,
+                         const Mode& mode, const int reps,
+                         const int max_threads) {
+  printf("\nScaling within images (%s): one encoder and decoder per thread"
+         " count\n", mode.name.c_str());
+  printf("%7s %8s %7s %6s %8s %7s %6s %9s %7s %7s %7s %6s %6s %6s %6s %6s"
+         "  %s\n",
+         "threads", "enc_s", "speedup", "eff", "dec_s", "speedup", "eff",
+         "tasks", "stolen%", "serial%", "idle%", "opsin", "search", "encode",
+         "entdec", "recon", "idle%/thread");
+  double base_encode = 0.0;
+  double base_decode = 0.0;
+  for (int num_threads = 1; num_threads <= max_threads; ++num_threads) {
+    PikEncoder encoder(num_threads);
+    PikDecoder decoder(num_threads);
+    PikInfo encode_info;
+    PikInfo decode_info;
+    double encode_seconds = 0.0;
+    double decode_seconds = 0.0;
+    for (const CorpusImage& image : images) {
+      Result result;
+      result.image = image.pathname;
+      result.mode = mode.name;
+      if (!BenchmarkImage(image.linear, mode, reps, &encoder, &decoder,
+                          &result, &encode_info, &decode_info)) {
+        return false;
+      }
+      encode_seconds += Percentile(result.encode_seconds, 50);
+      decode_seconds += Percentile(result.decode_seconds, 50);
+    }
+    if (num_threads == 1) {
+      base_encode = encode_seconds;
+      base_decode = decode_seconds;
+    }
+    ThreadPoolStats pool_stats = encode_info.pool_stats;
+    pool_stats.Assimilate(decode_info.pool_stats);
+    const double encode_speedup = base_encode / encode_seconds;
+    const double decode_speedup = base_decode / decode_seconds;
+    printf("%7d %8.3f %7.2f %6.2f %8.3f %7.2f %6.2f", num_threads,
+           encode_seconds, encode_speedup, encode_speedup / num_threads,
+           decode_seconds, decode_speedup, decode_speedup / num_threads);
+    PrintPoolShares(pool_stats);
+    printf(" %6.2f %6.2f %6.2f %6.2f %6.2f  %s\n",
+           encode_info.opsin_time.Utilization(),
+           encode_info.search_time.Utilization(),
+           encode_info.encode_time.Utilization(),
+           decode_info.entropy_decode_time.Utilization(),
+           decode_info.reconstruct_time.Utilization(),
+           IdlePercentPerThread(pool_stats).c_str());
+    fflush(stdout);
+  }
+  return true;
+}
+
+// Encodes and then decodes all images concurrently: tasks are images, each
+// handled by one of 1..max_threads single-threaded encoders/decoders. This
+// corresponds to running that many single-threaded processes per host.
+bool ScalingAcrossImages(const std::vector<CorpusImage>& images,
+                         const Mode& mode, const int reps,
+                         const int max_threads) {
+  printf("\nScaling across images (%s): one single-threaded encoder and"
+         " decoder per thread\n", mode.name.c_str());
+  printf("%7s %8s %7s %6s %8s %7s %6s %9s %7s %7s %7s  %s\n", "threads",
+         "enc_MP/s", "speedup", "eff", "dec_MP/s", "speedup", "eff", "tasks",
+         "stolen%", "serial%", "idle%", "idle%/thread");
+  CompressParams params = mode.params;
+  const DecompressParams dparams;
+  const int num_images = static_cast<int>(images.size());
+  double megapixels = 0.0;
+  for (const CorpusImage& image : images) {
+    megapixels += image.linear.xsize() * image.linear.ysize() * 1E-6;
+  }
+  double base_encode = 0.0;
+  double base_decode = 0.0;
+  for (int num_threads = 1; num_threads <= max_threads; ++num_threads) {
+    ThreadPool pool(num_threads);
+    std::vector<std::unique_ptr<PikEncoder>> encoders;
+    std::vector<std::unique_ptr<PikDecoder>> decoders;
+    for (int i = 0; i < pool.NumThreads(); ++i) {
+      encoders.emplace_back(new PikEncoder(0));
+      decoders.emplace_back(new PikDecoder(0));
+    }
+    std::vector<PaddedBytes> compressed(images.size());
+    std::atomic<int> num_failures{0};
+    std::vector<double> encode_seconds;
+    std::vector<double> decode_seconds;
+    for (int rep = 0; rep < reps; ++rep) {
+      double start = Now();
+      pool.Run(0, num_images, [&](const int task, const int thread) {
+        CompressParams image_params = params;
+        image_params.alpha_channel = images[task].linear.HasAlpha();
+        if (!encoders[thread]->PixelsToPik(image_params, images[task].linear,
+                                           &compressed[task], nullptr)) {
+          num_failures.fetch_add(1);
+        }
+      });
+      encode_seconds.push_back(Now() - start);
+      start = Now();
+      pool.Run(0, num_images, [&](const int task, const int thread) {
+        MetaImageB decoded;
+        if (!decoders[thread]->PikToPixels(dparams, compressed[task],
+                                           &decoded, nullptr)) {
+          num_failures.fetch_add(1);
+        }
+      });
+      decode_seconds.push_back(Now() - start);
+    }
+    if (num_failures.load() != 0) {
+      fprintf(stderr, "Failed to compress or decompress %d images (%s).\n",
+              num_failures.load(), mode.name.c_str());
+      return false;
+    }
+    const double encode_mps = megapixels / Percentile(encode_seconds, 50);
+    const double decode_mps = megapixels / Percentile(decode_seconds, 50);
+    if (num_threads == 1) {
+      base_encode = encode_mps;
+      base_decode = decode_mps;
+    }
+    const double encode_speedup = encode_mps / base_encode;
+    const double decode_speedup = decode_mps / base_decode;
+    printf("%7d %8.3f %7.2f %6.2f %8.3f %7.2f %6.2f", num_threads, encode_mps,
+           encode_speedup, encode_speedup / num_threads, decode_mps,
+           decode_speedup, decode_speedup / num_threads);
+    PrintPoolShares(pool.Stats());
+    printf("  %s\n", IdlePercentPerThread(pool.Stats()).c_str());
+    fflush(stdout);
+  }
+  return true;
+}
+
+bool RunScaling(const std::vector<std::string>& pathnames,
+                const std::vector<Mode>& modes, const int reps,
+                const int max_threads) {
+  std::vector<CorpusImage> images;
+  for (const std::string& pathname : pathnames) {
+    CorpusImage image{pathname, ReadMetaImageLinear(pathname)};
+    if (image.linear.xsize() == 0 || image.linear.ysize() == 0) {
+      fprintf(stderr, "Failed to open image %s.\n", pathname.c_str());
+      return false;
+    }
+    images.push_back(std::move(image));
+  }
+  for (const Mode& mode : modes) {
+    if (!ScalingWithinImages(images, mode, reps, max_threads) ||
+        !ScalingAcrossImages(images, mode, reps, max_threads)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Encodes each image in each mode with 0..max_threads worker threads and
+// with the kernels of each instruction set the CPU supports, and checks that
+// the results are identical to the encode without workers and the default
+// kernels.
+bool CheckDeterminism(const std::vector<std::string>& pathnames,
+                      const std::vector<Mode>& modes, const int max_threads) {
+  struct Target {
+    const char* name;
+    int bits;
+  };
+  static const Target kTargets[] = {
+      {"default", ~0}, {"sse4", SIMD_SSE4}, {"none", SIMD_NONE}};
+  bool ok = true;
+  for (const std::string& pathname : pathnames) {
+    const MetaImageF linear = ReadMetaImageLinear(pathname);
+    if (linear.xsize() == 0 || linear.ysize() == 0) {
+      fprintf(stderr, "Failed to open image %s.\n", pathname.c_str());
+      ok = false;
+      continue;
+    }
+    for (const Mode& mode : modes) {
+      CompressParams params = mode.params;
+      params.alpha_channel = linear.HasAlpha();
+      PaddedBytes expected;
+      int num_mismatches = 0;
+      for (const Target& target : kTargets) {
+        if (target.bits != ~0 &&
+            (dispatch::SupportedTargets() & target.bits) != target.bits) {
+          continue;
+        }
+        SetKernelTargets(target.bits);
+        for (int num_threads = 0; num_threads <= max_threads; ++num_threads) {
+          PikEncoder encoder(num_threads);
+          PaddedBytes compressed;
+          if (!encoder.PixelsToPik(params, linear, &compressed, nullptr)) {
+            fprintf(stderr, "Failed to compress %s (%s).\n",
+                    pathname.c_str(), mode.name.c_str());
+            SetKernelTargets(~0);
+            return false;
+          }
+          if (expected.size() == 0) {
+            expected = std::move(compressed);
+          } else if (compressed.size() != expected.size() ||
+                     memcmp(compressed.data(), expected.data(),
+                            expected.size()) != 0) {
+            printf("%-30s %-14s differs with %d threads and the %s kernels\n",
+                   pathname.c_str(), mode.name.c_str(), num_threads,
+                   target.name);
+            ++num_mismatches;
+          }
+        }
+      }
+      SetKernelTargets(~0);
+      if (num_mismatches == 0) {
+        printf("%-30s %-14s %9zu bytes, identical\n", pathname.c_str(),
+               mode.name.c_str(), expected.size());
+      }
+      fflush(stdout);
+      ok &= num_mismatches == 0;
+    }
+  }
+  return ok;
+}
+
+int PrintArgHelp(int argc, char** argv) {
+  fprintf(stderr,
+      "Usage: %s <corpus_dir|image> [--modes <list>] [--reps <n>]"
+      " [--num_threads <n>] [--csv <out.csv>] [--json <out.json>]\n"
+      "       [--write_baseline <file>] [--compare <file>] [--tolerance <%%>]\n"
+      "       [--scaling <max_threads>] [--determinism <max_threads>]\n"
+      " --modes: Comma-separated list of fast, distance=<d>, bitrate=<bpp>"
+      " and\n"
+      "          uniform=<quant>. Default: fast,distance=1,distance=2.\n"
+      " --reps: Number of encodes and decodes per image and mode."
+      " Default: 3.\n"
+      " --num_threads: Worker threads of the encoder and decoder, -1 for one"
+      " per core.\n"
+      "                Default: 0 (single-threaded).\n"
+      " --csv, --json: Also write the results to a file.\n"
+      " --write_baseline: Write the size, distance and latency statistics to"
+      " a file.\n"
+      " --compare: Report significant changes relative to a baseline file;"
+      " fails if\n"
+      "            any image is slower, larger or missing.\n"
+      " --tolerance: Smallest latency change considered significant."
+      " Default: 2%%.\n"
+      " --scaling: Instead of the above, report the speedup, efficiency,"
+      " stage\n"
+      "            utilization and thread pool idle time for 1..max_threads"
+      " threads\n"
+      "            within and across images (-1 for one per core).\n"
+      " --determinism: Instead of the above, check that each encode is\n"
+      "            identical with 0..max_threads threads and with the kernels of\n"
+      "            each supported instruction set; fails otherwise.\n"
+      "Throughput is that of the median repetition; latencies are the 50th,"
+      " 90th and\n"
+      "100th percentile; peak memory is that of the image allocations,"
+      " including\nthe input image.\n",
+      argv[0]);
+  return 1;
+}
+
+int Run(int argc, char** argv) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
+    return 1;
+  }
+  const char* corpus = nullptr;
+  const char* csv = nullptr;
+  const char* json = nullptr;
+  const char* write_baseline = nullptr;
+  const char* compare = nullptr;
+  double tolerance = 0.02;
+  const char* mode_list = "fast,distance=1,distance=2";
+  int reps = 3;
+  int num_threads = 0;
+  int scaling_threads = 0;
+  int determinism_threads = -1;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--modes" && i + 1 < argc) {
+      mode_list = argv[++i];
+    } else if (arg == "--reps" && i + 1 < argc) {
+      reps = strtol(argv[++i], nullptr, 10);
+      if (reps <= 0) return PrintArgHelp(argc, argv);
+    } else if (arg == "--num_threads" && i + 1 < argc) {
+      num_threads = strtol(argv[++i], nullptr, 10);
+    } else if (arg == "--scaling" && i + 1 < argc) {
+      scaling_threads = NumThreadsFromParam(strtol(argv[++i], nullptr, 10));
+      if (scaling_threads <= 0) return PrintArgHelp(argc, argv);
+    } else if (arg == "--determinism" && i + 1 < argc) {
+      determinism_threads =
+          NumThreadsFromParam(strtol(argv[++i], nullptr, 10));
+      if (determinism_threads < 0) return PrintArgHelp(argc, argv);
+    } else if (arg == "--csv" && i + 1 < argc) {
+      csv = argv[++i];
+    } else if (arg == "--json" && i + 1 < argc) {
+      json = argv[++i];
+    } else if (arg == "--write_baseline" && i + 1 < argc) {
+      write_baseline = argv[++i];
+    } else if (arg == "--compare" && i + 1 < argc) {
+      compare = argv[++i];
+    } else if (arg == "--tolerance" && i + 1 < argc) {
+      tolerance = strtod(argv[++i], nullptr) / 100.0;
+      if (!(tolerance >= 0.0)) return PrintArgHelp(argc, argv);
+    } else if (arg[0] != '-' && corpus == nullptr) {
+      corpus = argv[i];
+    } else {
+      return PrintArgHelp(argc, argv);
+    }
+  }
+  if (corpus == nullptr) return PrintArgHelp(argc, argv);
+
+  std::vector<Mode> modes;
+  if (!ParseModes(mode_list, &modes)) return PrintArgHelp(argc, argv);
+  // Read first so that an invalid file does not waste a whole benchmark run.
+  std::vector<BaselineEntry> baseline;
+  if (compare != nullptr && !ReadBaseline(compare, &baseline)) return 1;
+  std::vector<std::string> pathnames;
+  if (!ListCorpus(corpus, &pathnames)) return 1;
+  if (pathnames.empty()) {
+    fprintf(stderr, "No images in %s.\n", corpus);
+    return 1;
+  }
+  if (scaling_threads != 0) {
+    return RunScaling(pathnames, modes, reps, scaling_threads) ? 0 : 1;
+  }
+  if (determinism_threads >= 0) {
+    return CheckDeterminism(pathnames, modes, determinism_threads) ? 0 : 1;
+  }
+
+  // Reused for all images, as in a long-running service.
+  PikEncoder encoder(num_threads);
+  PikDecoder decoder(num_threads);
+  std::vector<Result> results;
+  bool ok = true;
+  printf("%-30s %-14s %11s %9s %7s %7s %8s %8s %9s %9s %9s %9s %9s %9s"
+         " %8s %8s\n",
+         "image", "mode", "size", "bytes", "bpp", "dist", "enc_MP/s",
+         "dec_MP/s", "enc_p50ms", "enc_p90ms", "enc_maxms", "dec_p50ms",
+         "dec_p90ms", "dec_maxms", "enc_MiB", "dec_MiB");
+  for (const std::string& pathname : pathnames) {
+    const MetaImageF linear = ReadMetaImageLinear(pathname);
+    if (linear.xsize() == 0 || linear.ysize() == 0) {
+      fprintf(stderr, "Failed to open image %s.\n", pathname.c_str());
+      ok = false;
+      continue;
+    }
+    for (const Mode& mode : modes) {
+      Result result;
+      result.image = pathname;
+      result.mode = mode.name;
+      if (!BenchmarkImage(linear, mode, reps, &encoder, &decoder, &result)) {
+        ok = false;
+        continue;
+      }
+      PrintResult(result);
+      fflush(stdout);
+      results.push_back(std::move(result));
+    }
+  }
+  PrintModeTotals(modes, results);
+  if (csv != nullptr) ok &= WriteCSV(results, csv);
+  if (json != nullptr) ok &= WriteJSON(results, json);
+  if (write_baseline != nullptr) ok &= WriteBaseline(results, write_baseline);
+  if (compare != nullptr) ok &= CompareToBaseline(results, baseline, tolerance);
+  return ok ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main(int argc, char** argv) { return pik::Run(argc, argv); }
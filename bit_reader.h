@@ -18,6 +18,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "compiler_specific.h"
 #include "status.h"
@@ -25,49 +26,58 @@
 namespace pik {
 
 // Adapter for reading individual bits from a fixed memory buffer, can read up
-// to 30 bits at a time. Reads 4 bytes of input at a time into its accumulator.
+// to 30 bits at a time. Refills its 64-bit accumulator with unaligned 8-byte
+// loads, so that after each FillBitBuffer() at least 56 bits are available.
 // Performs bounds-checking, returns only 0 bit values after memory buffer
 // is depleted.
 class BitReader {
  public:
   BitReader(const uint8_t* const PIK_RESTRICT data, const size_t len)
-      : data32_(reinterpret_cast<const uint32_t*>(data)),
-        len32_(len >> 2),
-        val_(static_cast<uint64_t>(data32_[0]) << 32),
-        pos32_(1),
-        bit_pos_(32) {
+      : first_byte_(data),
+        next_byte_(data),
+        end_(data + len),
+        buf_(0),
+        bits_in_buf_(0),
+        overread_bytes_(0) {
     PIK_ASSERT(len % 4 == 0);
+    FillBitBuffer();
   }
 
   void FillBitBuffer() {
-    if (PIK_UNLIKELY(bit_pos_ >= 32)) {
-      val_ >>= 32;
-      if (pos32_ < len32_) {
-        val_ |= static_cast<uint64_t>(data32_[pos32_]) << 32;
-      }
-      ++pos32_;
-      bit_pos_ -= 32;
+    if (PIK_LIKELY(end_ - next_byte_ >= 8)) {
+      // Bits above bits_in_buf_ may already hold the same upcoming input bits
+      // from the previous load, hence OR-ing them again is harmless.
+      uint64_t bits;
+      memcpy(&bits, next_byte_, sizeof(bits));
+      buf_ |= bits << bits_in_buf_;
+      // Only whole bytes are consumed, so the lower 3 bits of bits_in_buf_
+      // are unchanged and the result is in [56, 64).
+      next_byte_ += (63 - bits_in_buf_) >> 3;
+      bits_in_buf_ |= 56;
+    } else {
+      BoundsCheckedRefill();
     }
   }
 
   void Advance(int num_bits) {
-    bit_pos_ += num_bits;
+    buf_ >>= num_bits;
+    bits_in_buf_ -= num_bits;
   }
 
   template<int N>
   int PeekFixedBits() const {
     static_assert(N <= 30, "At most 30 bits may be read.");
-    return (val_ >> bit_pos_) & ((1 << N) - 1);
+    return buf_ & ((1ULL << N) - 1);
   }
 
   int PeekBits(int nbits) const {
-    return (val_ >> bit_pos_) & ((1 << nbits) - 1);
+    return buf_ & ((1ULL << nbits) - 1);
   }
 
   int ReadBits(int nbits) {
     FillBitBuffer();
     int bits = PeekBits(nbits);
-    bit_pos_ += nbits;
+    Advance(nbits);
     return bits;
   }
 
@@ -76,25 +86,43 @@ class BitReader {
   }
 
   void JumpToByteBoundary() {
-    int rem = bit_pos_ % 8;
+    int rem = BitsRead() % 8;
     if (rem > 0) ReadBits(8 - rem);
   }
 
   // Returns the byte position, aligned to 4 bytes, where the next chunk of
   // data should be read from after all symbols have been decoded.
   size_t Position() const {
-    size_t bits_read = 32 * pos32_ + bit_pos_ - 64;
-    size_t bytes_read = (bits_read + 7) / 8;
+    size_t bytes_read = (BitsRead() + 7) / 8;
     return (bytes_read + 3) & ~3;
   }
 
+  // Returns the number of bytes (partially) consumed so far.
+  size_t BytesRead() const { return (BitsRead() + 7) / 8; }
+
  private:
-  // *32 counters/pointers are in units of 4 bytes, or 32 bits.
-  const uint32_t* const PIK_RESTRICT data32_;
-  const size_t len32_;
-  uint64_t val_;
-  size_t pos32_;
-  size_t bit_pos_;
+  size_t BitsRead() const {
+    return 8 * (next_byte_ - first_byte_ + overread_bytes_) - bits_in_buf_;
+  }
+
+  // Near the end of the buffer: loads the remaining bytes one at a time and
+  // then (virtual) zero bytes.
+  void BoundsCheckedRefill() {
+    for (; bits_in_buf_ < 56; bits_in_buf_ += 8) {
+      if (next_byte_ < end_) {
+        buf_ |= static_cast<uint64_t>(*next_byte_++) << bits_in_buf_;
+      } else {
+        ++overread_bytes_;
+      }
+    }
+  }
+
+  const uint8_t* const first_byte_;
+  const uint8_t* next_byte_;
+  const uint8_t* const end_;
+  uint64_t buf_;
+  size_t bits_in_buf_;
+  size_t overread_bytes_;
 };
 
 }  // namespace pik
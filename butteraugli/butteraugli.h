@@ -26,6 +26,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #define BUTTERAUGLI_ENABLE_CHECKS 0
@@ -34,6 +35,9 @@
 // analysis function.
 
 namespace pik {
+
+class ThreadPool;
+
 namespace butteraugli {
 
 template<typename T>
@@ -105,6 +109,74 @@ double ButteraugliFuzzyInverse(double seek);
 bool ButteraugliAdaptiveQuantization(size_t xsize, size_t ysize,
     const std::vector<std::vector<float> > &rgb, std::vector<float> &quant);
 
+// Recently freed butteraugli images of up to "max_cached_bytes", handed out
+// again for allocations of the same size while it is the current cache of the
+// allocating thread (see ImageCacheScope). Frees them upon destruction.
+class ImageCache {
+ public:
+  static const size_t kDefaultMaxCachedBytes = size_t(1) << 28;
+
+  explicit ImageCache(size_t max_cached_bytes = kDefaultMaxCachedBytes);
+  ~ImageCache();
+
+  ImageCache(const ImageCache&) = delete;
+  ImageCache& operator=(const ImageCache&) = delete;
+
+  // Returns the start of an allocation of "bytes" bytes (see Put), or null.
+  char* Take(size_t bytes);
+
+  // Returns false if the allocation (from malloc) should be freed instead.
+  bool Put(char* allocated, size_t bytes);
+
+ private:
+  static const size_t kMaxBlocks = 128;
+
+  struct Block {
+    char* allocated;
+    size_t bytes;
+  };
+
+  const size_t max_cached_bytes_;
+  std::mutex mutex_;
+  // Oldest first.
+  std::vector<Block> blocks_;
+  size_t cached_bytes_ = 0;
+};
+
+// Makes "cache" the current cache of the calling thread until destruction,
+// and also that of ThreadPool workers while they run its tasks. By default,
+// keeps the current cache if there is one (e.g. for a series of images with
+// the same size), otherwise uses its own. Scopes must be nested.
+class ImageCacheScope {
+ public:
+  ImageCacheScope();
+  explicit ImageCacheScope(ImageCache* cache);
+  ~ImageCacheScope();
+
+  ImageCacheScope(const ImageCacheScope&) = delete;
+  ImageCacheScope& operator=(const ImageCacheScope&) = delete;
+
+ private:
+  std::unique_ptr<ImageCache> own_cache_;
+  ImageCache* prev_cache_;
+};
+
+// While it exists, new butteraugli images of at least "min_bytes" bytes
+// (unless zero) are backed by transparent huge pages where supported. Applies
+// to the calling thread, and ThreadPool workers while they run its tasks;
+// restored on destruction, so scopes must be nested.
+class HugePageScope {
+ public:
+  explicit HugePageScope(size_t min_bytes);
+  ~HugePageScope();
+
+  HugePageScope(const HugePageScope&) = delete;
+  HugePageScope& operator=(const HugePageScope&) = delete;
+
+ private:
+  size_t prev_min_bytes_;
+};
+
 // Implementation details, don't use anything below or your code will
 // break in the future.
 
@@ -424,7 +496,20 @@ struct PsychoImage {
 
 class ButteraugliComparator {
  public:
-  ButteraugliComparator(const std::vector<ImageF>& rgb0);
+  // "pool" is not owned and may be null; if non-null, the row loops of the
+  // blurs and diffmaps run on it. The results are identical either way.
+  ButteraugliComparator(const std::vector<ImageF>& rgb0,
+                        ThreadPool* pool = nullptr);
+  // Compares against the same original as "other", whose frequency
+  // decomposition is copied instead of recomputed, with the row loops on
+  // "pool" (e.g. null for use on a worker thread).
+  ButteraugliComparator(const ButteraugliComparator& other, ThreadPool* pool);
+  // While any comparator exists, freed image memory is kept for reuse by
+  // subsequent allocations of the same size.
+  ~ButteraugliComparator();
+
+  ButteraugliComparator(const ButteraugliComparator&) = delete;
+  ButteraugliComparator& operator=(const ButteraugliComparator&) = delete;
 
   // Computes the butteraugli map between the original image given in the
   // constructor and the distorted image give here.
@@ -455,6 +540,7 @@ class ButteraugliComparator {
   const size_t xsize_;
   const size_t ysize_;
   const size_t num_pixels_;
+  ThreadPool* pool_;
   PsychoImage pi0_;
 };
 
@@ -475,7 +561,8 @@ void CreateHeatMapImage(const std::vector<float> &distmap,
 void Mask(const std::vector<ImageF>& xyb0,
           const std::vector<ImageF>& xyb1,
           std::vector<ImageF>* BUTTERAUGLI_RESTRICT mask,
-          std::vector<ImageF>* BUTTERAUGLI_RESTRICT mask_dc);
+          std::vector<ImageF>* BUTTERAUGLI_RESTRICT mask_dc,
+          ThreadPool* pool = nullptr);
 
 template <class V>
 BUTTERAUGLI_INLINE void RgbToXyb(const V &r, const V &g, const V &b,
@@ -525,9 +612,22 @@ BUTTERAUGLI_INLINE void OpsinAbsorbance(const V &in0, const V &in1,
   *out2 = mix8 * in0 + mix9 * in1 + mix10 * in2 + mix11;
 }
 
-std::vector<ImageF> OpsinDynamicsImage(const std::vector<ImageF>& rgb);
-
-ImageF Blur(const ImageF& in, float sigma, float border_ratio);
+std::vector<ImageF> OpsinDynamicsImage(const std::vector<ImageF>& rgb,
+                                       ThreadPool* pool = nullptr);
+
+ImageF Blur(const ImageF& in, float sigma, float border_ratio,
+            ThreadPool* pool = nullptr);
+
+// Building blocks of Blur and the diffmap, declared here so that they can be
+// benchmarked in isolation.
+std::vector<float> ComputeKernel(float sigma);
+// Convolves each row of "in" with "kernel" and returns the transposed result.
+ImageF Convolution(const ImageF& in, const std::vector<float>& kernel,
+                   const float border_ratio, ThreadPool* pool = nullptr);
+// Adds the line pattern sums of squares around "num" adjacent pixels starting
+// at "row" (row stride "xs") to "out". Reads up to 4 pixels beyond each side.
+void MaltaUnit(const float* BUTTERAUGLI_RESTRICT row, const int xs,
+               const int num, float* BUTTERAUGLI_RESTRICT out);
 
 double SimpleGamma(double v);
 
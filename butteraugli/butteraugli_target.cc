@@ -0,0 +1,392 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiled once per instruction set; see butteraugli_target_<target>.cc. The
+// loops are plain C++ for the compiler to vectorize with each instruction set;
+// the results do not depend on the lane count.
+
+#include "butteraugli/butteraugli_target.h"
+
+#include "butteraugli/butteraugli.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace butteraugli {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Number of adjacent outputs accumulated together; the partial sums fit in
+// vector registers, and each kernel tap is one multiply and add per vector.
+static const int kConvolveChunk = 32;
+
+// Convolves the interior outputs [x, x + kConvolveChunk) of a row.
+BUTTERAUGLI_INLINE void ConvolveChunk(
+    const float* const BUTTERAUGLI_RESTRICT row_in,
+    const float* const BUTTERAUGLI_RESTRICT kernel, const int len,
+    const float scale, const int x, float* const BUTTERAUGLI_RESTRICT row_out) {
+  const int offset = len / 2;
+  float sum[kConvolveChunk] = {0.0f};
+  for (int j = 0; j < len; ++j) {
+    const float* const BUTTERAUGLI_RESTRICT pixels = row_in + x - offset + j;
+    const float weight = kernel[j];
+    for (int i = 0; i < kConvolveChunk; ++i) {
+      sum[i] += pixels[i] * weight;
+    }
+  }
+  for (int i = 0; i < kConvolveChunk; ++i) {
+    row_out[x + i] = sum[i] * scale;
+  }
+}
+
+void ConvolveInterior(const float* const BUTTERAUGLI_RESTRICT row_in,
+                      const float* const BUTTERAUGLI_RESTRICT kernel,
+                      const int len, const float scale, const int x_begin,
+                      const int x_end, float* const BUTTERAUGLI_RESTRICT row_out) {
+  int x = x_begin;
+  for (; x + kConvolveChunk <= x_end; x += kConvolveChunk) {
+    ConvolveChunk(row_in, kernel, len, scale, x, row_out);
+  }
+  // Recomputes some outputs of the previous chunk instead of a tail.
+  if (x != x_end) {
+    ConvolveChunk(row_in, kernel, len, scale, x_end - kConvolveChunk, row_out);
+  }
+}
+
+// Adds the sums of squares of the line patterns around each of the "num"
+// adjacent pixels starting at "row" (with stride "xs") to "out". The pixels
+// are independent, so the compiler computes several at once in vector lanes
+// using unaligned row loads instead of per-pixel scalar loads.
+void MaltaUnit(const float* BUTTERAUGLI_RESTRICT row, const int xs,
+               const int num, float* BUTTERAUGLI_RESTRICT out) {
+  for (int i = 0; i < num; ++i) {
+    const float* BUTTERAUGLI_RESTRICT const d = row + i;
+    const int xs3 = 3 * xs;
+    float retval = 0;
+    static const float kEdgemul = 0.0309255573587;
+    {
+      // x grows, y constant
+      float sum =
+          d[-4] +
+          d[-3] +
+          d[-2] +
+          d[-1] +
+          d[0] +
+          d[1] +
+          d[2] +
+          d[3] +
+          d[4];
+      retval += sum * sum;
+      float sum2 =
+          d[xs - 4] +
+          d[xs - 3] +
+          d[xs - 2] +
+          d[xs - 1] +
+          d[xs] +
+          d[xs + 1] +
+          d[xs + 2] +
+          d[xs + 3] +
+          d[xs + 4];
+      float edge = sum - sum2;
+      retval += kEdgemul * edge * edge;
+    }
+    {
+      // y grows, x constant
+      float sum =
+          d[-xs3 - xs] +
+          d[-xs3] +
+          d[-xs - xs] +
+          d[-xs] +
+          d[0] +
+          d[xs] +
+          d[xs + xs] +
+          d[xs3] +
+          d[xs3 + xs];
+      retval += sum * sum;
+      float sum2 =
+          d[-xs3 - xs + 1] +
+          d[-xs3 + 1] +
+          d[-xs - xs + 1] +
+          d[-xs + 1] +
+          d[1] +
+          d[xs + 1] +
+          d[xs + xs + 1] +
+          d[xs3 + 1] +
+          d[xs3 + xs + 1];
+      float edge = sum - sum2;
+      retval += kEdgemul * edge * edge;
+    }
+    {
+      // both grow
+      float sum =
+          d[-xs3 - 3] +
+          d[-xs - xs - 2] +
+          d[-xs - 1] +
+          d[0] +
+          d[xs + 1] +
+          d[xs + xs + 2] +
+          d[xs3 + 3];
+      retval += sum * sum;
+    }
+    {
+      // y grows, x shrinks
+      float sum =
+          d[-xs3 + 3] +
+          d[-xs - xs + 2] +
+          d[-xs + 1] +
+          d[0] +
+          d[xs - 1] +
+          d[xs + xs - 2] +
+          d[xs3 - 3];
+      retval += sum * sum;
+    }
+    {
+      // y grows -4 to 4, x shrinks 1 -> -1
+      float sum =
+          d[-xs3 - xs + 1] +
+          d[-xs3 + 1] +
+          d[-xs - xs + 1] +
+          d[-xs] +
+          d[0] +
+          d[xs] +
+          d[xs - 1] +
+          d[xs3 - 1] +
+          d[xs3 + xs - 1];
+      retval += sum * sum;
+    }
+    {
+      //  y grows -4 to 4, x grows -1 -> 1
+      float sum =
+          d[-xs3 - xs - 1] +
+          d[-xs3 - 1] +
+          d[-xs - xs - 1] +
+          d[-xs] +
+          d[0] +
+          d[xs] +
+          d[xs + 1] +
+          d[xs3 + 1] +
+          d[xs3 + xs + 1];
+      retval += sum * sum;
+    }
+    {
+      // x grows -4 to 4, y grows -1 to 1
+      float sum =
+          d[-4 - xs] +
+          d[-3 - xs] +
+          d[-2 - xs] +
+          d[-1] +
+          d[0] +
+          d[1] +
+          d[2 + xs] +
+          d[3 + xs] +
+          d[4 + xs];
+      retval += sum * sum;
+    }
+    {
+      // x grows -4 to 4, y shrinks 1 to -1
+      float sum =
+          d[-4 + xs] +
+          d[-3 + xs] +
+          d[-2 + xs] +
+          d[-1] +
+          d[0] +
+          d[1] +
+          d[2 - xs] +
+          d[3 - xs] +
+          d[4 - xs];
+      retval += sum * sum;
+    }
+    {
+      /* 0_________
+         1__*______
+         2___*_____
+         3___*_____
+         4____0____
+         5_____*___
+         6_____*___
+         7______*__
+         8_________ */
+      float sum =
+          d[-xs3 - 2] +
+          d[-xs - xs - 1] +
+          d[-xs - 1] +
+          d[0] +
+          d[xs + 1] +
+          d[xs + xs + 1] +
+          d[xs3 + 2];
+      retval += sum * sum;
+    }
+    {
+      /* 0_________
+         1______*__
+         2_____*___
+         3_____*___
+         4____0____
+         5___*_____
+         6___*_____
+         7__*______
+         8_________ */
+      float sum =
+          d[-xs3 + 2] +
+          d[-xs - xs + 1] +
+          d[-xs + 1] +
+          d[0] +
+          d[xs - 1] +
+          d[xs + xs - 1] +
+          d[xs3 - 2];
+      retval += sum * sum;
+    }
+    {
+      /* 0_________
+         1_________
+         2_*_______
+         3__**_____
+         4____0____
+         5_____**__
+         6_______*_
+         7_________
+         8_________ */
+      float sum =
+          d[-xs - xs - 3] +
+          d[-xs - 2] +
+          d[-xs - 1] +
+          d[0] +
+          d[xs + 1] +
+          d[xs + 2] +
+          d[xs + xs + 3];
+      retval += sum * sum;
+    }
+    {
+      /* 0_________
+         1_________
+         2_______*_
+         3_____**__
+         4____0____
+         5__**_____
+         6_*_______
+         7_________
+         8_________ */
+      float sum =
+          d[-xs - xs + 3] +
+          d[-xs + 2] +
+          d[-xs + 1] +
+          d[0] +
+          d[xs - 1] +
+          d[xs - 2] +
+          d[xs + xs - 3];
+      retval += sum * sum;
+    }
+    {
+      /* 0_________
+         1_________
+         2_________
+         3______**_
+         4____0*___
+         5__**_____
+         6**_______
+         7_________
+         8_________ */
+
+      float sum =
+          d[xs + xs - 4] +
+          d[xs + xs - 3] +
+          d[xs - 2] +
+          d[xs - 1] +
+          d[0] +
+          d[1] +
+          d[-xs + 2] +
+          d[-xs + 3];
+      retval += sum * sum;
+    }
+    {
+      /* 0_________
+         1_________
+         2**_______
+         3__**_____
+         4____0*___
+         5______**_
+         6_________
+         7_________
+         8_________ */
+      float sum =
+          d[-xs - xs - 4] +
+          d[-xs - xs - 3] +
+          d[-xs - 2] +
+          d[-xs - 1] +
+          d[0] +
+          d[1] +
+          d[xs + 2] +
+          d[xs + 3];
+      retval += sum * sum;
+    }
+    {
+      /* 0__*______
+         1__*______
+         2___*_____
+         3___*_____
+         4____0____
+         5____*____
+         6_____*___
+         7_____*___
+         8_________ */
+      float sum =
+          d[-xs3 - xs - 2] +
+          d[-xs3 - 2] +
+          d[-xs - xs - 1] +
+          d[-xs - 1] +
+          d[0] +
+          d[xs] +
+          d[xs + xs + 1] +
+          d[xs3 + 1];
+      retval += sum * sum;
+    }
+    {
+      /* 0______*__
+         1______*__
+         2_____*___
+         3_____*___
+         4____0____
+         5____*____
+         6___*_____
+         7___*_____
+         8_________ */
+      float sum =
+          d[-xs3 - xs + 2] +
+          d[-xs3 + 2] +
+          d[-xs - xs + 1] +
+          d[-xs + 1] +
+          d[0] +
+          d[xs] +
+          d[xs + xs - 1] +
+          d[xs3 - 1];
+      retval += sum * sum;
+    }
+    out[i] += retval;
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+// Instantiate for the current target.
+template <>
+ButteraugliFunctions ButteraugliFunctionsForTarget::operator()<SIMD_TARGET>()
+    const {
+  ButteraugliFunctions functions;
+  functions.convolve_interior = &SIMD_NAMESPACE::ConvolveInterior;
+  functions.malta_unit = &SIMD_NAMESPACE::MaltaUnit;
+  return functions;
+}
+
+}  // namespace butteraugli
+}  // namespace pik
@@ -0,0 +1,47 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUTTERAUGLI_BUTTERAUGLI_TARGET_H_
+#define BUTTERAUGLI_BUTTERAUGLI_TARGET_H_
+
+// Per-instruction-set implementations of the hottest butteraugli loops. Only
+// butteraugli.cc should include this.
+
+namespace pik {
+namespace butteraugli {
+
+struct ButteraugliFunctions {
+  // Writes the interior outputs [x_begin, x_end) of the convolution of
+  // "row_in" with the "len" taps of "kernel" (centered), times "scale", to
+  // "row_out". Requires x_end - x_begin >= 32 and that all taps lie within
+  // the row.
+  void (*convolve_interior)(const float* row_in, const float* kernel, int len,
+                            float scale, int x_begin, int x_end,
+                            float* row_out);
+  // Same as MaltaUnit.
+  void (*malta_unit)(const float* row, int xs, int num, float* out);
+};
+
+// Call via KernelTable<ButteraugliFunctionsForTarget>. operator()<SIMD_TARGET>
+// is specialized in butteraugli_target.cc, which is compiled once per
+// instruction set (butteraugli_target_<target>.cc).
+struct ButteraugliFunctionsForTarget {
+  template <class Target>
+  ButteraugliFunctions operator()() const;
+};
+
+}  // namespace butteraugli
+}  // namespace pik
+
+#endif  // BUTTERAUGLI_BUTTERAUGLI_TARGET_H_
@@ -0,0 +1,2 @@
+// SIMD_ENABLE undefined, defaults to zero.
+#include "butteraugli/butteraugli_target.cc"
@@ -15,10 +15,14 @@
 #include "butteraugli_comparator.h"
 
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <memory>
 #include <vector>
 
+#include "butteraugli_distance.h"
 #include "compiler_specific.h"
 #include "gamma_correct.h"
 #include "opsin_inverse.h"
@@ -29,27 +33,67 @@ namespace pik {
 namespace SIMD_NAMESPACE {
 namespace {
 
-// REQUIRES: xsize <= srgb.xsize(), ysize <= srgb.ysize()
+// Converts the xsize x ysize rectangle starting at (x0, y0).
+// REQUIRES: x0 + xsize <= srgb.xsize(), y0 + ysize <= srgb.ysize()
 std::vector<butteraugli::ImageF> SrgbToLinearRgb(
-    const int xsize, const int ysize,
+    const int x0, const int y0, const int xsize, const int ysize,
     const Image3B& srgb) {
-  PIK_ASSERT(xsize <= srgb.xsize());
-  PIK_ASSERT(ysize <= srgb.ysize());
+  PIK_ASSERT(x0 + xsize <= srgb.xsize());
+  PIK_ASSERT(y0 + ysize <= srgb.ysize());
   const float* lut = Srgb8ToLinearTable();
   std::vector<butteraugli::ImageF> planes =
       butteraugli::CreatePlanes<float>(xsize, ysize, 3);
   for (size_t y = 0; y < ysize; ++y) {
-    auto row_in = srgb.Row(y);
+    auto row_in = srgb.Row(y0 + y);
     for (int c = 0; c < 3; ++c) {
+      const uint8_t* const PIK_RESTRICT row_c = row_in[c] + x0;
       float* const PIK_RESTRICT row_out = planes[c].Row(y);
       for (size_t x = 0; x < xsize; ++x) {
-        row_out[x] = lut[row_in[c][x]];
+        row_out[x] = lut[row_c[x]];
       }
     }
   }
   return planes;
 }
 
+// REQUIRES: xsize <= srgb.xsize(), ysize <= srgb.ysize()
+std::vector<butteraugli::ImageF> SrgbToLinearRgb(
+    const int xsize, const int ysize,
+    const Image3B& srgb) {
+  return SrgbToLinearRgb(0, 0, xsize, ysize, srgb);
+}
+
+// REQUIRES: xsize <= linear_rgb.xsize(), ysize <= linear_rgb.ysize()
+std::vector<butteraugli::ImageF> LinearRgbPlanes(
+    const int xsize, const int ysize,
+    const Image3F& linear_rgb) {
+  PIK_ASSERT(xsize <= linear_rgb.xsize());
+  PIK_ASSERT(ysize <= linear_rgb.ysize());
+  std::vector<butteraugli::ImageF> planes =
+      butteraugli::CreatePlanes<float>(xsize, ysize, 3);
+  for (int c = 0; c < 3; ++c) {
+    for (int y = 0; y < ysize; ++y) {
+      memcpy(planes[c].Row(y), linear_rgb.ConstPlaneRow(c, y),
+             xsize * sizeof(float));
+    }
+  }
+  return planes;
+}
+
+std::vector<butteraugli::ImageF> CropPlanes(
+    const std::vector<butteraugli::ImageF>& planes,
+    const int x0, const int y0, const int xsize, const int ysize) {
+  std::vector<butteraugli::ImageF> out =
+      butteraugli::CreatePlanes<float>(xsize, ysize, planes.size());
+  for (size_t c = 0; c < planes.size(); ++c) {
+    for (int y = 0; y < ysize; ++y) {
+      memcpy(out[c].Row(y), planes[c].Row(y0 + y) + x0,
+             xsize * sizeof(float));
+    }
+  }
+  return out;
+}
+
 // REQUIRES: xsize <= srgb.xsize(), ysize <= srgb.ysize()
 std::vector<butteraugli::ImageF> OpsinToLinearRgb(
     const int xsize, const int ysize,
@@ -78,6 +122,32 @@ std::vector<butteraugli::ImageF> OpsinToLinearRgb(
   return planes;
 }
 
+// Returns planes of (xsize + 1) / 2 x (ysize + 1) / 2 pixels, each the average
+// of a 2x2 block of "planes" (the last row/column are repeated if needed).
+std::vector<butteraugli::ImageF> Downsample2x2(
+    const std::vector<butteraugli::ImageF>& planes) {
+  const size_t xsize = planes[0].xsize();
+  const size_t ysize = planes[0].ysize();
+  const size_t out_xsize = (xsize + 1) / 2;
+  const size_t out_ysize = (ysize + 1) / 2;
+  std::vector<butteraugli::ImageF> out =
+      butteraugli::CreatePlanes<float>(out_xsize, out_ysize, planes.size());
+  for (size_t c = 0; c < planes.size(); ++c) {
+    for (size_t oy = 0; oy < out_ysize; ++oy) {
+      const float* const PIK_RESTRICT row0 = planes[c].Row(2 * oy);
+      const float* const PIK_RESTRICT row1 =
+          planes[c].Row(std::min(2 * oy + 1, ysize - 1));
+      float* const PIK_RESTRICT row_out = out[c].Row(oy);
+      for (size_t ox = 0; ox < out_xsize; ++ox) {
+        const size_t x0 = 2 * ox;
+        const size_t x1 = std::min(x0 + 1, xsize - 1);
+        row_out[ox] = 0.25f * (row0[x0] + row0[x1] + row1[x0] + row1[x1]);
+      }
+    }
+  }
+  return out;
+}
+
 Image3F Image3FromButteraugliPlanes(
     const std::vector<butteraugli::ImageF>& planes) {
   Image3F img(planes[0].xsize(), planes[0].ysize());
@@ -96,31 +166,237 @@ Image3F Image3FromButteraugliPlanes(
 }  // namespace
 }  // namespace
 
-ButteraugliComparator::ButteraugliComparator(const Image3B& srgb)
+ButteraugliComparator::ButteraugliComparator(const Image3B& srgb,
+                                             ThreadPool* pool)
     : xsize_(srgb.xsize()),
       ysize_(srgb.ysize()),
-      comparator_(SIMD_NAMESPACE::SrgbToLinearRgb(xsize_, ysize_, srgb)),
+      pool_(pool),
+      rgb0_(SIMD_NAMESPACE::SrgbToLinearRgb(xsize_, ysize_, srgb)),
+      comparator_(UseButteraugliStripes(xsize_, ysize_)
+                      ? nullptr
+                      : new butteraugli::ButteraugliComparator(rgb0_, pool)),
       distance_(0.0),
       distmap_(xsize_, ysize_, 0) {}
 
-ButteraugliComparator::ButteraugliComparator(const Image3F& opsin)
+ButteraugliComparator::ButteraugliComparator(const Image3F& opsin,
+                                             ThreadPool* pool)
     : xsize_(opsin.xsize()),
       ysize_(opsin.ysize()),
-      comparator_(SIMD_NAMESPACE::OpsinToLinearRgb(xsize_, ysize_, opsin)),
+      pool_(pool),
+      rgb0_(SIMD_NAMESPACE::OpsinToLinearRgb(xsize_, ysize_, opsin)),
+      comparator_(UseButteraugliStripes(xsize_, ysize_)
+                      ? nullptr
+                      : new butteraugli::ButteraugliComparator(rgb0_, pool)),
       distance_(0.0),
       distmap_(xsize_, ysize_, 0) {}
 
+ButteraugliComparator::ButteraugliComparator(
+    const ButteraugliComparator& other, ThreadPool* pool)
+    : xsize_(other.xsize_),
+      ysize_(other.ysize_),
+      pool_(pool),
+      rgb0_(butteraugli::CopyPlanes(other.rgb0_)),
+      distance_(0.0),
+      distmap_(xsize_, ysize_, 0) {
+  if (other.comparator_ != nullptr) {
+    comparator_.reset(
+        new butteraugli::ButteraugliComparator(*other.comparator_, pool));
+  }
+}
+
 void ButteraugliComparator::Compare(const Image3B& srgb) {
-  comparator_.Diffmap(SIMD_NAMESPACE::SrgbToLinearRgb(xsize_, ysize_, srgb),
-                      distmap_);
+  ComparePlanes(SIMD_NAMESPACE::SrgbToLinearRgb(xsize_, ysize_, srgb));
+}
+
+void ButteraugliComparator::CompareLinear(const Image3F& linear_rgb) {
+  ComparePlanes(SIMD_NAMESPACE::LinearRgbPlanes(xsize_, ysize_, linear_rgb));
+}
+
+void ButteraugliComparator::CompareCoarse(const Image3B& srgb) {
+  CompareCoarsePlanes(SIMD_NAMESPACE::SrgbToLinearRgb(xsize_, ysize_, srgb));
+}
+
+void ButteraugliComparator::CompareCoarseLinear(const Image3F& linear_rgb) {
+  CompareCoarsePlanes(
+      SIMD_NAMESPACE::LinearRgbPlanes(xsize_, ysize_, linear_rgb));
+}
+
+void ButteraugliComparator::ComparePlanes(
+    const std::vector<butteraugli::ImageF>& rgb1) {
+  if (comparator_ == nullptr) {
+    ButteraugliDiffmapStriped(rgb0_, rgb1, pool_, &distmap_);
+  } else {
+    comparator_->Diffmap(rgb1, distmap_);
+  }
+  distance_ = butteraugli::ButteraugliScoreFromDiffmap(distmap_);
+}
+
+void ButteraugliComparator::CompareCoarsePlanes(
+    const std::vector<butteraugli::ImageF>& rgb1) {
+  // Butteraugli is not defined for tiny images.
+  if (xsize_ < 16 || ysize_ < 16) return ComparePlanes(rgb1);
+  if (coarse_comparator_ == nullptr) {
+    coarse_comparator_.reset(new butteraugli::ButteraugliComparator(
+        SIMD_NAMESPACE::Downsample2x2(rgb0_), pool_));
+  }
+  butteraugli::ImageF coarse_distmap;
+  coarse_comparator_->Diffmap(SIMD_NAMESPACE::Downsample2x2(rgb1),
+                              coarse_distmap);
+  // Downsampling hides most of the high-frequency distortion; on typical
+  // images the full-resolution distance is 1.5 to 3 times larger.
+  static const float kCoarseScale = 2.2f;
+  for (int y = 0; y < ysize_; ++y) {
+    const float* const PIK_RESTRICT row_in = coarse_distmap.Row(y / 2);
+    float* const PIK_RESTRICT row_out = distmap_.Row(y);
+    for (int x = 0; x < xsize_; ++x) {
+      row_out[x] = kCoarseScale * row_in[x / 2];
+    }
+  }
+  distance_ = butteraugli::ButteraugliScoreFromDiffmap(distmap_);
+}
+
+void ButteraugliComparator::CompareIncremental(const Image3B& srgb,
+                                               const ImageB& dirty_blocks,
+                                               const int block_edge) {
+  // Butteraugli is not defined for tiny images.
+  if (xsize_ < 8 || ysize_ < 8) return Compare(srgb);
+
+  // Rectangles [pixels] of distmap to recompute, one per band of block rows
+  // containing dirty blocks.
+  struct Rect {
+    int x0, y0, x1, y1;
+  };
+  std::vector<Rect> rects;
+  const int kBandRows = kContextBorder / block_edge + 1;
+  uint64_t crop_area = 0;
+  for (int by0 = 0; by0 < dirty_blocks.ysize(); by0 += kBandRows) {
+    const int by1 = std::min<int>(dirty_blocks.ysize(), by0 + kBandRows);
+    int bx_min = dirty_blocks.xsize();
+    int bx_max = -1;
+    int by_min = by1;
+    int by_max = -1;
+    for (int by = by0; by < by1; ++by) {
+      const uint8_t* const PIK_RESTRICT row = dirty_blocks.Row(by);
+      for (int bx = 0; bx < dirty_blocks.xsize(); ++bx) {
+        if (row[bx] == 0) continue;
+        bx_min = std::min(bx_min, bx);
+        bx_max = std::max(bx_max, bx);
+        by_min = std::min(by_min, by);
+        by_max = std::max(by_max, by);
+      }
+    }
+    if (bx_max < 0) continue;
+    Rect rect;
+    rect.x0 = std::max(0, bx_min * block_edge - kUpdateBorder);
+    rect.y0 = std::max(0, by_min * block_edge - kUpdateBorder);
+    rect.x1 = std::min(xsize_, (bx_max + 1) * block_edge + kUpdateBorder);
+    rect.y1 = std::min(ysize_, (by_max + 1) * block_edge + kUpdateBorder);
+    rects.push_back(rect);
+    const int crop_xsize = std::min(xsize_, rect.x1 + kContextBorder) -
+                           std::max(0, rect.x0 - kContextBorder);
+    const int crop_ysize = std::min(ysize_, rect.y1 + kContextBorder) -
+                           std::max(0, rect.y0 - kContextBorder);
+    crop_area += static_cast<uint64_t>(crop_xsize) * crop_ysize;
+  }
+
+  // Crops overlap and require re-processing the original, so an incremental
+  // update only pays off if they cover a small part of the image.
+  if (2 * crop_area > static_cast<uint64_t>(xsize_) * ysize_) {
+    return Compare(srgb);
+  }
+
+  for (const Rect& rect : rects) {
+    const int crop_x0 = std::max(0, rect.x0 - kContextBorder);
+    const int crop_y0 = std::max(0, rect.y0 - kContextBorder);
+    const int crop_xsize =
+        std::min(xsize_, rect.x1 + kContextBorder) - crop_x0;
+    const int crop_ysize =
+        std::min(ysize_, rect.y1 + kContextBorder) - crop_y0;
+    butteraugli::ButteraugliComparator crop_comparator(
+        SIMD_NAMESPACE::CropPlanes(rgb0_, crop_x0, crop_y0, crop_xsize,
+                                   crop_ysize),
+        pool_);
+    butteraugli::ImageF crop_distmap;
+    crop_comparator.Diffmap(
+        SIMD_NAMESPACE::SrgbToLinearRgb(crop_x0, crop_y0, crop_xsize,
+                                        crop_ysize, srgb),
+        crop_distmap);
+    for (int y = rect.y0; y < rect.y1; ++y) {
+      memcpy(distmap_.Row(y) + rect.x0,
+             crop_distmap.Row(y - crop_y0) + rect.x0 - crop_x0,
+             (rect.x1 - rect.x0) * sizeof(float));
+    }
+  }
   distance_ = butteraugli::ButteraugliScoreFromDiffmap(distmap_);
 }
 
 void ButteraugliComparator::Mask(Image3F* mask, Image3F* mask_dc) {
   std::vector<butteraugli::ImageF> ba_mask, ba_mask_dc;
-  comparator_.Mask(&ba_mask, &ba_mask_dc);
-  *mask = SIMD_NAMESPACE::Image3FromButteraugliPlanes(ba_mask);
-  *mask_dc = SIMD_NAMESPACE::Image3FromButteraugliPlanes(ba_mask_dc);
+  if (comparator_ != nullptr) {
+    comparator_->Mask(&ba_mask, &ba_mask_dc);
+    *mask = SIMD_NAMESPACE::Image3FromButteraugliPlanes(ba_mask);
+    *mask_dc = SIMD_NAMESPACE::Image3FromButteraugliPlanes(ba_mask_dc);
+    return;
+  }
+  *mask = Image3F(xsize_, ysize_);
+  *mask_dc = Image3F(xsize_, ysize_);
+  for (int y0 = 0; y0 < ysize_; y0 += kStripeRows) {
+    const int y1 = std::min(ysize_, y0 + kStripeRows);
+    const int crop_y0 = std::max(0, y0 - kStripeBorder);
+    const int crop_y1 = std::min(ysize_, y1 + kStripeBorder);
+    butteraugli::ButteraugliComparator crop_comparator(
+        SIMD_NAMESPACE::CropPlanes(rgb0_, 0, crop_y0, xsize_,
+                                   crop_y1 - crop_y0),
+        pool_);
+    crop_comparator.Mask(&ba_mask, &ba_mask_dc);
+    for (int c = 0; c < 3; ++c) {
+      for (int y = y0; y < y1; ++y) {
+        memcpy(mask->PlaneRow(c, y), ba_mask[c].Row(y - crop_y0),
+               xsize_ * sizeof(float));
+        memcpy(mask_dc->PlaneRow(c, y), ba_mask_dc[c].Row(y - crop_y0),
+               xsize_ * sizeof(float));
+      }
+    }
+  }
+}
+
+ImageF ButteraugliComparator::BlockDistanceProxy(const Image3F& linear_rgb,
+                                                 const int block_edge) {
+  if (proxy_mask_ == nullptr) {
+    proxy_mask_.reset(new Image3F);
+    Image3F mask_dc;
+    Mask(proxy_mask_.get(), &mask_dc);
+  }
+  const int block_xsize = (xsize_ + block_edge - 1) / block_edge;
+  const int block_ysize = (ysize_ + block_edge - 1) / block_edge;
+  ImageF sum(block_xsize, block_ysize, 0.0f);
+  for (int y = 0; y < ysize_; ++y) {
+    const float* const PIK_RESTRICT row_r0 = rgb0_[0].Row(y);
+    const float* const PIK_RESTRICT row_g0 = rgb0_[1].Row(y);
+    const float* const PIK_RESTRICT row_b0 = rgb0_[2].Row(y);
+    auto row1 = linear_rgb.ConstRow(y);
+    auto row_mask = proxy_mask_->ConstRow(y);
+    float* const PIK_RESTRICT row_sum = sum.Row(y / block_edge);
+    for (int x = 0; x < xsize_; ++x) {
+      const float dr = row1[0][x] - row_r0[x];
+      const float dg = row1[1][x] - row_g0[x];
+      const float db = row1[2][x] - row_b0[x];
+      float dx, dy, dz;
+      butteraugli::RgbToXyb(dr, dg, db, &dx, &dy, &dz);
+      row_sum[x / block_edge] += row_mask[0][x] * dx * dx +
+                                 row_mask[1][x] * dy * dy +
+                                 row_mask[2][x] * dz * dz;
+    }
+  }
+  for (int by = 0; by < block_ysize; ++by) {
+    const int num_rows = std::min(block_edge, ysize_ - by * block_edge);
+    float* const PIK_RESTRICT row_sum = sum.Row(by);
+    for (int bx = 0; bx < block_xsize; ++bx) {
+      const int num_cols = std::min(block_edge, xsize_ - bx * block_edge);
+      row_sum[bx] = std::sqrt(row_sum[bx] / (num_rows * num_cols));
+    }
+  }
+  return sum;
 }
 
 }  // namespace pik
@@ -15,31 +15,88 @@
 #ifndef BUTTERAUGLI_COMPARATOR_H_
 #define BUTTERAUGLI_COMPARATOR_H_
 
+#include <memory>
 #include <vector>
 
 #include "butteraugli/butteraugli.h"
 #include "image.h"
+#include "thread_pool.h"
 
 namespace pik {
 
 class ButteraugliComparator {
  public:
-  ButteraugliComparator(const Image3B& srgb);
-  ButteraugliComparator(const Image3F& opsin);
+  // "pool" is not owned and may be null (single-threaded).
+  ButteraugliComparator(const Image3B& srgb, ThreadPool* pool = nullptr);
+  ButteraugliComparator(const Image3F& opsin, ThreadPool* pool = nullptr);
+  // Compares against the same original as "other", e.g. with a null "pool"
+  // for use on a worker thread. Copies its butteraugli reference instead of
+  // recomputing it, but not the results of comparisons.
+  ButteraugliComparator(const ButteraugliComparator& other, ThreadPool* pool);
 
   void Compare(const Image3B& srgb);
 
+  // Approximates Compare(srgb) under the assumption that srgb only differs
+  // from the image of the previous Compare() within the blocks (of
+  // block_edge x block_edge pixels) marked in "dirty_blocks". Only those
+  // regions (plus kUpdateBorder pixels) of distmap() are recomputed, each
+  // from a crop with an additional kContextBorder pixels of context. Falls
+  // back to Compare() if the crops would cover most of the image.
+  void CompareIncremental(const Image3B& srgb, const ImageB& dirty_blocks,
+                          int block_edge);
+
+  // Approximates Compare(srgb) by comparing 2x downsampled versions of the
+  // original and "srgb"; distmap() is the upsampled and rescaled result. About
+  // four times faster, but the distance is only accurate to within a factor
+  // of about 1.5, i.e. enough to tell that it is still far from a target.
+  // Falls back to Compare() for tiny images. The next call after this must
+  // not be CompareIncremental().
+  void CompareCoarse(const Image3B& srgb);
+
+  // Same as Compare() and CompareCoarse(), but for a linear RGB image (e.g.
+  // CompressedImage::ToLinear()), which avoids quantizing it to 8-bit sRGB and
+  // converting it back. The next call after these must not be
+  // CompareIncremental().
+  void CompareLinear(const Image3F& linear_rgb);
+  void CompareCoarseLinear(const Image3F& linear_rgb);
+
+  // Margins [pixels] used by CompareIncremental. Changes to a block affect
+  // the diffmap within the support of the butteraugli blurs; beyond that, the
+  // influence of the larger kernels is small enough to be ignored.
+  static const int kUpdateBorder = 16;
+  static const int kContextBorder = 32;
+
   const butteraugli::ImageF& distmap() const { return distmap_; }
   float distance() const { return distance_; }
 
   void Mask(Image3F* mask, Image3F* mask_dc);
 
+  // Returns a cheap stand-in for the per-block maximum of distmap() after
+  // comparing "linear_rgb": the root mean square of the (roughly XYB)
+  // difference to the original over each block_edge x block_edge block,
+  // weighted by the AC masking of the original. The masking is computed by
+  // the first call. Only proportional to butteraugli within a block, so
+  // callers have to calibrate it against a real comparison.
+  ImageF BlockDistanceProxy(const Image3F& linear_rgb, int block_edge);
+
  private:
+  void ComparePlanes(const std::vector<butteraugli::ImageF>& rgb1);
+  void CompareCoarsePlanes(const std::vector<butteraugli::ImageF>& rgb1);
+
   const int xsize_;
   const int ysize_;
-  butteraugli::ButteraugliComparator comparator_;
+  ThreadPool* pool_;
+  // Linear RGB planes of the original, for comparing crops.
+  std::vector<butteraugli::ImageF> rgb0_;
+  // Null if UseButteraugliStripes(), in which case each comparison processes
+  // the original again, one stripe at a time.
+  std::unique_ptr<butteraugli::ButteraugliComparator> comparator_;
+  // Compares the downsampled original, created by the first CompareCoarse().
+  std::unique_ptr<butteraugli::ButteraugliComparator> coarse_comparator_;
   float distance_;
   butteraugli::ImageF distmap_;
+  // Mask() of the original, created by the first BlockDistanceProxy().
+  std::unique_ptr<Image3F> proxy_mask_;
 };
 
 }  // namespace pik
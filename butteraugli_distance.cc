@@ -16,6 +16,7 @@
 
 #include <stddef.h>
 #include <string.h>
+#include <algorithm>
 #include <array>
 #include <utility>
 #include <vector>
@@ -26,6 +27,52 @@
 #include "image.h"
 
 namespace pik {
+namespace {
+
+std::vector<butteraugli::ImageF> CropRows(
+    const std::vector<butteraugli::ImageF>& planes, const size_t y0,
+    const size_t ysize) {
+  const size_t xsize = planes[0].xsize();
+  std::vector<butteraugli::ImageF> out =
+      butteraugli::CreatePlanes<float>(xsize, ysize, planes.size());
+  for (size_t c = 0; c < planes.size(); ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(out[c].Row(y), planes[c].Row(y0 + y), xsize * sizeof(float));
+    }
+  }
+  return out;
+}
+
+}  // namespace
+
+void ButteraugliDiffmapStriped(const std::vector<butteraugli::ImageF>& rgb0,
+                               const std::vector<butteraugli::ImageF>& rgb1,
+                               ThreadPool* pool, butteraugli::ImageF* distmap) {
+  const size_t xsize = rgb0[0].xsize();
+  const size_t ysize = rgb0[0].ysize();
+  if (!UseButteraugliStripes(xsize, ysize)) {
+    if (pool == nullptr || xsize < 8 || ysize < 8) {
+      butteraugli::ButteraugliDiffmap(rgb0, rgb1, *distmap);
+    } else {
+      butteraugli::ButteraugliComparator(rgb0, pool).Diffmap(rgb1, *distmap);
+    }
+    return;
+  }
+  *distmap = butteraugli::ImageF(xsize, ysize);
+  for (size_t y0 = 0; y0 < ysize; y0 += kStripeRows) {
+    const size_t y1 = std::min<size_t>(ysize, y0 + kStripeRows);
+    const size_t crop_y0 = y0 < kStripeBorder ? 0 : y0 - kStripeBorder;
+    const size_t crop_y1 = std::min<size_t>(ysize, y1 + kStripeBorder);
+    butteraugli::ImageF crop_distmap;
+    butteraugli::ButteraugliComparator(
+        CropRows(rgb0, crop_y0, crop_y1 - crop_y0), pool)
+        .Diffmap(CropRows(rgb1, crop_y0, crop_y1 - crop_y0), crop_distmap);
+    for (size_t y = y0; y < y1; ++y) {
+      memcpy(distmap->Row(y), crop_distmap.Row(y - crop_y0),
+             xsize * sizeof(float));
+    }
+  }
+}
 
 float ButteraugliDistance(const Image3F& rgb0, const Image3F& rgb1,
                           ImageF* distmap_out) {
@@ -45,7 +92,7 @@ float ButteraugliDistance(const Image3F& rgb0, const Image3F& rgb1,
     rgb1b.emplace_back(std::move(plane1));
   }
   butteraugli::ImageF distmap;
-  butteraugli::ButteraugliDiffmap(rgb0b, rgb1b, distmap);
+  ButteraugliDiffmapStriped(rgb0b, rgb1b, nullptr, &distmap);
   if (distmap_out) {
     *distmap_out = ImageF(rgb0.xsize(), rgb0.ysize());
     for (int y = 0; y < rgb0.ysize(); ++y) {
@@ -15,12 +15,35 @@
 #ifndef BUTTERAUGLI_DISTANCE_H_
 #define BUTTERAUGLI_DISTANCE_H_
 
+#include <stddef.h>
 #include <vector>
 
+#include "butteraugli/butteraugli.h"
 #include "image.h"
+#include "thread_pool.h"
 
 namespace pik {
 
+// Images with more pixels are compared in stripes of kStripeRows rows, each
+// from a crop with kStripeBorder rows of context above and below. That covers
+// the support of all butteraugli blurs, hence the result is the same, but the
+// butteraugli temporaries (a few dozen planes) only span one crop.
+static const size_t kMaxUnstripedPixels = size_t(1) << 24;
+static const int kStripeRows = 512;
+static const int kStripeBorder = 96;
+
+// Whether an image of xsize x ysize pixels is compared in stripes.
+inline bool UseButteraugliStripes(const size_t xsize, const size_t ysize) {
+  return xsize * ysize > kMaxUnstripedPixels &&
+         ysize > kStripeRows + 2 * kStripeBorder;
+}
+
+// Same as butteraugli::ButteraugliDiffmap, but stripes large images (see
+// above). "pool" is not owned and may be null.
+void ButteraugliDiffmapStriped(const std::vector<butteraugli::ImageF>& rgb0,
+                               const std::vector<butteraugli::ImageF>& rgb1,
+                               ThreadPool* pool, butteraugli::ImageF* distmap);
+
 // Returns the butteraugli distance between rgb0 and rgb1.
 // Both rgb0 and rgb1 are assumed to be in sRGB color space.
 // If distmap is not null, it must be the same size as rgb0 and rgb1.
@@ -1,15 +1,239 @@
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "image.h"
 #include "image_io.h"
+#include "butteraugli/butteraugli.h"
 #include "butteraugli_distance.h"
+#include "thread_pool.h"
+
+namespace {
 
 int PrintArgHelp(int argc, char** argv) {
-  fprintf(stderr, "Usage: %s <image a> <image b>\n", argv[0]);
+  fprintf(stderr,
+          "Usage: %s <image a> <image b>\n"
+          "       %s --batch <manifest> [--num_threads <n>] [--pnorm <p>]\n"
+          "\n"
+          " --batch: Each line of the manifest is \"<original> <distorted>"
+          " [<heatmap.png>]\";\n"
+          "   empty lines and lines starting with '#' are ignored. Prints a"
+          " tab-separated\n"
+          "   table with one row per pair: original, distorted, distance,"
+          " p-norm and\n"
+          "   heatmap path (\"-\" if none). Failed pairs have distance nan.\n"
+          " --num_threads: Number of worker threads, -1 for one per core.\n"
+          " --pnorm: Exponent of the p-norm column, default 3.\n",
+          argv[0], argv[0]);
   return 1;
 }
 
+struct BatchPair {
+  std::string original;
+  std::string distorted;
+  std::string heatmap;  // empty if none
+  double distance = NAN;
+  double pnorm = NAN;
+};
+
+bool ReadManifest(const char* pathname, std::vector<BatchPair>* pairs) {
+  FILE* f = fopen(pathname, "r");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open manifest %s\n", pathname);
+    return false;
+  }
+  bool ok = true;
+  char line[4096];
+  int line_number = 0;
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    ++line_number;
+    std::vector<std::string> fields;
+    for (char* tok = strtok(line, " \t\r\n"); tok != nullptr;
+         tok = strtok(nullptr, " \t\r\n")) {
+      fields.emplace_back(tok);
+    }
+    if (fields.empty() || fields[0][0] == '#') continue;
+    if (fields.size() < 2 || fields.size() > 3) {
+      fprintf(stderr, "%s:%d: expected 2 or 3 fields\n", pathname,
+              line_number);
+      ok = false;
+      break;
+    }
+    BatchPair pair;
+    pair.original = fields[0];
+    pair.distorted = fields[1];
+    if (fields.size() == 3) pair.heatmap = fields[2];
+    pairs->push_back(pair);
+  }
+  fclose(f);
+  return ok;
+}
+
+std::vector<pik::butteraugli::ImageF> ButteraugliPlanes(
+    const pik::Image3F& rgb) {
+  std::vector<pik::butteraugli::ImageF> planes;
+  for (int c = 0; c < 3; ++c) {
+    pik::butteraugli::ImageF plane(rgb.xsize(), rgb.ysize());
+    for (int y = 0; y < rgb.ysize(); ++y) {
+      memcpy(plane.Row(y), rgb.Row(y)[c], rgb.xsize() * sizeof(float));
+    }
+    planes.emplace_back(std::move(plane));
+  }
+  return planes;
+}
+
+// Returns (mean of distmap^p)^(1/p), which unlike the maximum also reflects
+// the extent of the differences.
+double PNorm(const pik::butteraugli::ImageF& distmap, const double p) {
+  double sum = 0.0;
+  for (size_t y = 0; y < distmap.ysize(); ++y) {
+    const float* const row = distmap.Row(y);
+    for (size_t x = 0; x < distmap.xsize(); ++x) {
+      sum += pow(row[x], p);
+    }
+  }
+  return pow(sum / (distmap.xsize() * distmap.ysize()), 1.0 / p);
+}
+
+bool WriteHeatmap(const pik::butteraugli::ImageF& distmap,
+                  const std::string& pathname) {
+  const size_t xsize = distmap.xsize();
+  const size_t ysize = distmap.ysize();
+  std::vector<float> values(xsize * ysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    memcpy(&values[y * xsize], distmap.Row(y), xsize * sizeof(float));
+  }
+  std::vector<uint8_t> rgb;
+  pik::butteraugli::CreateHeatMapImage(
+      values, pik::butteraugli::ButteraugliFuzzyInverse(1.5),
+      pik::butteraugli::ButteraugliFuzzyInverse(0.5), xsize, ysize, &rgb);
+  pik::Image3B heatmap(xsize, ysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    auto row = heatmap.Row(y);
+    for (size_t x = 0; x < xsize; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        row[c][x] = rgb[3 * (y * xsize + x) + c];
+      }
+    }
+  }
+  return pik::WriteImage(pik::ImageFormatPNG(), heatmap, pathname);
+}
+
+// Scores pairs[begin, end), which all share the same original. The
+// comparator (and thus the frequency decomposition of the original) is reused
+// for all of them. "comparator" is the one of the previous group of this
+// thread and is only replaced after the new one exists, so that the freed
+// butteraugli images are recycled rather than returned to the system.
+void ScoreGroup(const size_t begin, const size_t end, const double p,
+                std::vector<BatchPair>* pairs,
+                std::unique_ptr<pik::butteraugli::ButteraugliComparator>*
+                    comparator) {
+  const std::string& original = (*pairs)[begin].original;
+  const pik::Image3F rgb0 = pik::ReadImage3Linear(original);
+  if (rgb0.xsize() == 0) {
+    fprintf(stderr, "Failed to read image from %s\n", original.c_str());
+    return;
+  }
+  const std::vector<pik::butteraugli::ImageF> planes0 = ButteraugliPlanes(rgb0);
+  // The comparator does not support the border extension that
+  // ButteraugliDiffmap applies to tiny images.
+  const bool tiny = rgb0.xsize() < 8 || rgb0.ysize() < 8;
+  if (!tiny) {
+    std::unique_ptr<pik::butteraugli::ButteraugliComparator> next(
+        new pik::butteraugli::ButteraugliComparator(planes0));
+    *comparator = std::move(next);
+  }
+
+  for (size_t i = begin; i < end; ++i) {
+    BatchPair& pair = (*pairs)[i];
+    const pik::Image3F rgb1 = pik::ReadImage3Linear(pair.distorted);
+    if (rgb1.xsize() == 0) {
+      fprintf(stderr, "Failed to read image from %s\n",
+              pair.distorted.c_str());
+      continue;
+    }
+    if (rgb1.xsize() != rgb0.xsize() || rgb1.ysize() != rgb0.ysize()) {
+      fprintf(stderr, "%s and %s have different sizes\n", original.c_str(),
+              pair.distorted.c_str());
+      continue;
+    }
+    const std::vector<pik::butteraugli::ImageF> planes1 =
+        ButteraugliPlanes(rgb1);
+    pik::butteraugli::ImageF distmap;
+    if (tiny) {
+      pik::butteraugli::ButteraugliDiffmap(planes0, planes1, distmap);
+    } else {
+      (*comparator)->Diffmap(planes1, distmap);
+    }
+    if (!pair.heatmap.empty() && !WriteHeatmap(distmap, pair.heatmap)) {
+      fprintf(stderr, "Failed to write heatmap %s\n", pair.heatmap.c_str());
+      continue;
+    }
+    pair.distance = pik::butteraugli::ButteraugliScoreFromDiffmap(distmap);
+    pair.pnorm = PNorm(distmap, p);
+  }
+}
+
+int RunBatch(const char* manifest, const int num_threads, const double p) {
+  std::vector<BatchPair> pairs;
+  if (!ReadManifest(manifest, &pairs)) return 1;
+
+  // Consecutive pairs with the same original form one task.
+  std::vector<size_t> group_begin;
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    if (i == 0 || pairs[i].original != pairs[i - 1].original) {
+      group_begin.push_back(i);
+    }
+  }
+  group_begin.push_back(pairs.size());
+  const int num_groups = static_cast<int>(group_begin.size()) - 1;
+
+  // Each task runs single-threaded; the pool parallelizes across pairs.
+  pik::ThreadPool pool(pik::NumThreadsFromParam(num_threads));
+  std::vector<std::unique_ptr<pik::butteraugli::ButteraugliComparator>>
+      comparators(pool.NumThreads());
+  pool.Run(0, num_groups, [&](const int group, const int thread) {
+    ScoreGroup(group_begin[group], group_begin[group + 1], p, &pairs,
+               &comparators[thread]);
+  });
+
+  int num_failed = 0;
+  printf("original\tdistorted\tdistance\tpnorm\theatmap\n");
+  for (const BatchPair& pair : pairs) {
+    if (isnan(pair.distance)) ++num_failed;
+    printf("%s\t%s\t%.10f\t%.10f\t%s\n", pair.original.c_str(),
+           pair.distorted.c_str(), pair.distance, pair.pnorm,
+           pair.heatmap.empty() ? "-" : pair.heatmap.c_str());
+  }
+  if (num_failed != 0) {
+    fprintf(stderr, "%d of %zu pairs failed\n", num_failed, pairs.size());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
 int main(int argc, char** argv) {
+  if (argc >= 3 && strcmp(argv[1], "--batch") == 0) {
+    int num_threads = -1;
+    double p = 3.0;
+    for (int i = 3; i < argc; ++i) {
+      if (strcmp(argv[i], "--num_threads") == 0 && i + 1 < argc) {
+        num_threads = strtol(argv[++i], nullptr, 10);
+      } else if (strcmp(argv[i], "--pnorm") == 0 && i + 1 < argc) {
+        p = strtod(argv[++i], nullptr);
+      } else {
+        return PrintArgHelp(argc, argv);
+      }
+    }
+    return RunBatch(argv[2], num_threads, p);
+  }
+
   if (argc != 3) {
     return PrintArgHelp(argc, argv);
   }
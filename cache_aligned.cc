@@ -0,0 +1,244 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cache_aligned.h"
+
+#include <atomic>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace pik {
+namespace {
+
+// Allocations smaller than this are left to malloc, which already recycles
+// them efficiently.
+constexpr size_t kMinPooledBytes = 4096;
+
+// Rounds "bytes" up such that each power-of-two range is split into eight
+// size classes, i.e. at most 12.5% is wasted.
+size_t SizeClass(const size_t bytes) {
+  if (bytes < kMinPooledBytes) return bytes;
+  size_t granularity = kMinPooledBytes / 8;
+  while (granularity * 16 <= bytes) granularity *= 2;
+  return (bytes + granularity - 1) & ~(granularity - 1);
+}
+
+}  // namespace
+
+// Counters of one AllocationTracker. Reference-counted because allocations
+// may outlive their tracker: each holds a reference until it is freed.
+class AllocationCounters {
+ public:
+  // "parent" (of the enclosing tracker, or null) outlives this.
+  explicit AllocationCounters(AllocationCounters* parent) : parent_(parent) {
+    if (parent_ != nullptr) parent_->AddRef();
+  }
+
+  AllocationCounters(const AllocationCounters&) = delete;
+  AllocationCounters& operator=(const AllocationCounters&) = delete;
+
+  void AddRef() { num_refs_.fetch_add(1, std::memory_order_relaxed); }
+
+  void Release() {
+    if (num_refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    AllocationCounters* parent = parent_;
+    delete this;
+    if (parent != nullptr) parent->Release();
+  }
+
+  // Also counts towards the enclosing trackers.
+  void CountAllocation(const size_t size_class) {
+    for (AllocationCounters* c = this; c != nullptr; c = c->parent_) {
+      c->allocated_bytes_.fetch_add(size_class, std::memory_order_relaxed);
+      c->num_allocations_.fetch_add(1, std::memory_order_relaxed);
+      const size_t live =
+          c->live_bytes_.fetch_add(size_class, std::memory_order_relaxed) +
+          size_class;
+      size_t peak = c->peak_live_bytes_.load(std::memory_order_relaxed);
+      while (live > peak && !c->peak_live_bytes_.compare_exchange_weak(
+                                peak, live, std::memory_order_relaxed)) {
+      }
+    }
+  }
+
+  void CountFree(const size_t size_class) {
+    for (AllocationCounters* c = this; c != nullptr; c = c->parent_) {
+      c->live_bytes_.fetch_sub(size_class, std::memory_order_relaxed);
+    }
+  }
+
+  AllocationStats Stats() const {
+    AllocationStats stats;
+    stats.allocated_bytes = allocated_bytes_.load(std::memory_order_relaxed);
+    stats.num_allocations = num_allocations_.load(std::memory_order_relaxed);
+    stats.peak_live_bytes = peak_live_bytes_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  ~AllocationCounters() {}
+
+  AllocationCounters* const parent_;
+  // One for the tracker plus one per live allocation and child.
+  std::atomic<int> num_refs_{1};
+  std::atomic<size_t> allocated_bytes_{0};
+  std::atomic<size_t> num_allocations_{0};
+  std::atomic<size_t> live_bytes_{0};
+  std::atomic<size_t> peak_live_bytes_{0};
+};
+
+namespace {
+
+// Each allocation is preceded by its size class, the counters it was counted
+// by and the pointer returned by malloc, all stored within the kHeaderSize
+// bytes before the aligned memory.
+constexpr size_t kHeaderSize = 2 * CacheAligned::kCacheLineSize;
+
+// Returns memory that can be released via free(), or null.
+char* AllocateBytes(const size_t bytes) {
+#ifdef MADV_HUGEPAGE
+  const size_t min_bytes = CurrentThreadContext()->huge_page_min_bytes;
+  if (min_bytes != 0 && bytes >= min_bytes) {
+    constexpr size_t kHugePageSize = size_t(1) << 21;
+    const size_t rounded = (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    void* allocated;
+    if (posix_memalign(&allocated, kHugePageSize, rounded) == 0) {
+      // Only a hint: fails harmlessly if huge pages are disabled.
+      madvise(allocated, rounded, MADV_HUGEPAGE);
+      return static_cast<char*>(allocated);
+    }
+  }
+#endif
+  return static_cast<char*>(malloc(bytes));
+}
+
+}  // namespace
+
+void* CacheAligned::Allocate(const size_t bytes) {
+  PIK_ASSERT(bytes < 1ULL << 63);
+  const size_t size_class = SizeClass(bytes);
+  ImageArena* arena = CurrentThreadContext()->arena;
+  char* allocated = nullptr;
+  if (size_class >= kMinPooledBytes && arena != nullptr) {
+    allocated = arena->Take(size_class);
+  }
+  if (allocated == nullptr) {
+    allocated = AllocateBytes(size_class + kHeaderSize);
+  }
+  if (allocated == nullptr) {
+    return nullptr;
+  }
+  AllocationCounters* counters = CurrentThreadContext()->counters;
+  if (counters != nullptr) {
+    counters->AddRef();
+    counters->CountAllocation(size_class);
+  }
+  const uintptr_t misalignment =
+      reinterpret_cast<uintptr_t>(allocated) & (kCacheLineSize - 1);
+  // malloc is at least kPointerSize aligned, so we can store the "allocated"
+  // pointer, size class and counters immediately before the aligned memory.
+  PIK_ASSERT(misalignment % kPointerSize == 0);
+  char* const aligned = allocated + kHeaderSize - misalignment;
+  memcpy(aligned - kPointerSize, &allocated, kPointerSize);
+  memcpy(aligned - kPointerSize - sizeof(size_class), &size_class,
+         sizeof(size_class));
+  memcpy(aligned - 2 * kPointerSize - sizeof(size_class), &counters,
+         kPointerSize);
+  return aligned;
+}
+
+void CacheAligned::FreeBytes(void* aligned_pointer) {
+  if (aligned_pointer == nullptr) {
+    return;
+  }
+  char* const aligned = static_cast<char*>(aligned_pointer);
+  PIK_ASSERT(reinterpret_cast<uintptr_t>(aligned) % kCacheLineSize == 0);
+  char* allocated;
+  memcpy(&allocated, aligned - kPointerSize, kPointerSize);
+  PIK_ASSERT(allocated <= aligned - kHeaderSize + kCacheLineSize);
+  PIK_ASSERT(allocated >= aligned - kHeaderSize);
+  size_t size_class;
+  memcpy(&size_class, aligned - kPointerSize - sizeof(size_class),
+         sizeof(size_class));
+  AllocationCounters* counters;
+  memcpy(&counters, aligned - 2 * kPointerSize - sizeof(size_class),
+         kPointerSize);
+  if (counters != nullptr) {
+    counters->CountFree(size_class);
+    counters->Release();
+  }
+  ImageArena* arena = CurrentThreadContext()->arena;
+  if (size_class < kMinPooledBytes || arena == nullptr ||
+      !arena->Put(allocated, size_class)) {
+    free(allocated);
+  }
+}
+
+ImageArena::ImageArena(const size_t max_cached_bytes)
+    : max_cached_bytes_(max_cached_bytes) {}
+
+ImageArena::~ImageArena() {
+  for (const auto& size_and_list : free_lists_) {
+    for (char* allocated : size_and_list.second) {
+      free(allocated);
+    }
+  }
+}
+
+char* ImageArena::Take(const size_t size_class) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = free_lists_.find(size_class);
+  if (it == free_lists_.end() || it->second.empty()) return nullptr;
+  char* allocated = it->second.back();
+  it->second.pop_back();
+  cached_bytes_ -= size_class;
+  return allocated;
+}
+
+bool ImageArena::Put(char* allocated, const size_t size_class) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (cached_bytes_ + size_class > max_cached_bytes_) return false;
+  free_lists_[size_class].push_back(allocated);
+  cached_bytes_ += size_class;
+  return true;
+}
+
+HugePageScope::HugePageScope(const size_t min_bytes)
+    : prev_min_bytes_(CurrentThreadContext()->huge_page_min_bytes) {
+  CurrentThreadContext()->huge_page_min_bytes = min_bytes;
+}
+
+HugePageScope::~HugePageScope() {
+  CurrentThreadContext()->huge_page_min_bytes = prev_min_bytes_;
+}
+
+AllocationTracker::AllocationTracker(AllocationStats* stats)
+    : stats_(stats), prev_counters_(CurrentThreadContext()->counters) {
+  counters_ = new AllocationCounters(prev_counters_);
+  CurrentThreadContext()->counters = counters_;
+}
+
+void AllocationTracker::Stop() {
+  if (stopped_) return;
+  stopped_ = true;
+  if (CurrentThreadContext()->counters == counters_) {
+    CurrentThreadContext()->counters = prev_counters_;
+  }
+  if (stats_ != nullptr) stats_->Assimilate(counters_->Stats());
+  counters_->Release();
+}
+
+}  // namespace pik
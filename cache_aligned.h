@@ -20,12 +20,16 @@
 #include <stdlib.h>
 #include <string.h>  // memcpy
 #include <algorithm>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <vector>
 
 #include "arch_specific.h"
 #include "compiler_specific.h"
 #include "status.h"
+#include "thread_pool.h"
 
 #if PIK_ARCH_X64
 #include <emmintrin.h>
@@ -39,35 +43,15 @@ class CacheAligned {
   static constexpr size_t kPointerSize = sizeof(void*);
   static constexpr size_t kCacheLineSize = 64;
 
-  static void* Allocate(const size_t bytes) {
-    PIK_ASSERT(bytes < 1ULL << 63);
-    char* const allocated = static_cast<char*>(malloc(bytes + kCacheLineSize));
-    if (allocated == nullptr) {
-      return nullptr;
-    }
-    const uintptr_t misalignment =
-        reinterpret_cast<uintptr_t>(allocated) & (kCacheLineSize - 1);
-    // malloc is at least kPointerSize aligned, so we can store the "allocated"
-    // pointer immediately before the aligned memory.
-    PIK_ASSERT(misalignment % kPointerSize == 0);
-    char* const aligned = allocated + kCacheLineSize - misalignment;
-    memcpy(aligned - kPointerSize, &allocated, kPointerSize);
-    return aligned;
-  }
+  // Returns memory aligned to kCacheLineSize, or null. Large allocations are
+  // rounded up to a size class and, while the calling thread has an
+  // ImageArena (see ImageArenaScope), may reuse memory it cached.
+  static void* Allocate(size_t bytes);
 
   // Template allows freeing pointer-to-const.
   template <typename T>
   static void Free(T* aligned_pointer) {
-    if (aligned_pointer == nullptr) {
-      return;
-    }
-    const char* const aligned = reinterpret_cast<const char*>(aligned_pointer);
-    PIK_ASSERT(reinterpret_cast<uintptr_t>(aligned) % kCacheLineSize == 0);
-    char* allocated;
-    memcpy(&allocated, aligned - kPointerSize, kPointerSize);
-    PIK_ASSERT(allocated <= aligned - kPointerSize);
-    PIK_ASSERT(allocated >= aligned - kCacheLineSize);
-    free(allocated);
+    FreeBytes(const_cast<void*>(static_cast<const void*>(aligned_pointer)));
   }
 
   // Overwrites "to_items" without loading it into cache (read-for-ownership).
@@ -96,6 +80,135 @@ class CacheAligned {
     memcpy(to_items, from_items, kCacheLineSize);
 #endif
   }
+
+ private:
+  static void FreeBytes(void* aligned_pointer);
+};
+
+// Per-size-class free lists of up to "max_cached_bytes": memory released by
+// CacheAligned::Free in a thread whose current arena this is (see
+// ImageArenaScope) is kept here and handed out again by CacheAligned::Allocate
+// instead of going through malloc/free. An encode or decode allocates dozens
+// of same-sized planes, and this avoids the page faults of touching fresh
+// memory for each of them. Only the threads of one call (or PikEncoder/
+// PikDecoder session) share an arena; the cached memory is freed upon
+// destruction.
+class ImageArena {
+ public:
+  static constexpr size_t kDefaultMaxCachedBytes = size_t(1) << 28;
+
+  explicit ImageArena(size_t max_cached_bytes = kDefaultMaxCachedBytes);
+  ~ImageArena();
+
+  ImageArena(const ImageArena&) = delete;
+  ImageArena& operator=(const ImageArena&) = delete;
+
+ private:
+  friend class CacheAligned;
+
+  // Returns a previous allocation of "size_class" bytes (see Put), or null.
+  char* Take(size_t size_class);
+
+  // Returns false if the allocation (from malloc) should be freed instead.
+  bool Put(char* allocated, size_t size_class);
+
+  const size_t max_cached_bytes_;
+  std::mutex mutex_;
+  std::map<size_t, std::vector<char*>> free_lists_;
+  size_t cached_bytes_ = 0;
+};
+
+// Makes "arena" (unless null) the current arena of the calling thread until
+// destruction, and also that of ThreadPool workers while they run its tasks.
+// The arena must outlive the scope; scopes must be nested.
+class ImageArenaScope {
+ public:
+  explicit ImageArenaScope(ImageArena* arena)
+      : prev_arena_(CurrentThreadContext()->arena) {
+    CurrentThreadContext()->arena = arena;
+  }
+  ~ImageArenaScope() { CurrentThreadContext()->arena = prev_arena_; }
+
+  ImageArenaScope(const ImageArenaScope&) = delete;
+  ImageArenaScope& operator=(const ImageArenaScope&) = delete;
+
+ private:
+  ImageArena* prev_arena_;
+};
+
+// For the duration of an encode/decode call: keeps the current arena (e.g.
+// that of a PikEncoder session) if there is one, otherwise installs its own.
+class CallImageArena {
+ public:
+  CallImageArena()
+      : scope_(CurrentThreadContext()->arena != nullptr
+                   ? CurrentThreadContext()->arena
+                   : &own_arena_) {}
+
+  CallImageArena(const CallImageArena&) = delete;
+  CallImageArena& operator=(const CallImageArena&) = delete;
+
+ private:
+  ImageArena own_arena_;  // Constructed before and destroyed after scope_.
+  ImageArenaScope scope_;
+};
+
+// While it exists, new CacheAligned::Allocate calls of at least "min_bytes"
+// bytes (unless zero) are rounded up to whole 2 MiB pages and madvise-d for
+// transparent huge pages, which avoids most TLB misses of column passes over
+// large planes. Applies to the calling thread, and ThreadPool workers while
+// they run its tasks; restored on destruction, so scopes must be nested. Has
+// no effect on systems without MADV_HUGEPAGE.
+class HugePageScope {
+ public:
+  explicit HugePageScope(size_t min_bytes);
+  ~HugePageScope();
+
+  HugePageScope(const HugePageScope&) = delete;
+  HugePageScope& operator=(const HugePageScope&) = delete;
+
+ private:
+  size_t prev_min_bytes_;
+};
+
+// Statistics of CacheAligned::Allocate, see AllocationTracker. Sizes include
+// the rounding to a size class, but not the alignment overhead.
+struct AllocationStats {
+  void Assimilate(const AllocationStats& victim) {
+    allocated_bytes += victim.allocated_bytes;
+    num_allocations += victim.num_allocations;
+    peak_live_bytes = std::max(peak_live_bytes, victim.peak_live_bytes);
+  }
+
+  size_t allocated_bytes = 0;
+  size_t num_allocations = 0;
+  // Maximum of the total size of the live allocations made while tracking
+  // (excluding those made before, e.g. of the input image).
+  size_t peak_live_bytes = 0;
+};
+
+// Adds the allocations made between construction and destruction (or Stop)
+// by the calling thread, and by ThreadPool workers while they run its tasks,
+// to "stats" (unless null). Other threads, e.g. concurrent encodes/decodes,
+// are not included. Trackers must be nested; allocations also count towards
+// the enclosing trackers.
+class AllocationTracker {
+ public:
+  explicit AllocationTracker(AllocationStats* stats);
+  ~AllocationTracker() { Stop(); }
+
+  // Ends the tracking before destruction; subsequent calls have no effect.
+  void Stop();
+
+  AllocationTracker(const AllocationTracker&) = delete;
+  AllocationTracker& operator=(const AllocationTracker&) = delete;
+
+ private:
+  bool stopped_ = false;
+  AllocationStats* stats_;
+  AllocationCounters* counters_;
+  // Of the enclosing tracker, or null.
+  AllocationCounters* prev_counters_;
 };
 
 template <typename T>
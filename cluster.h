@@ -335,6 +335,101 @@ void ClusterHistograms(const std::vector<HistogramType>& in,
   HistogramReindex(out, histogram_symbols);
 }
 
+// Faster alternative to ClusterHistograms for many histograms. Seeds up to
+// 'max_histograms' clusters by repeatedly choosing the histogram that is the
+// most expensive to merge into any existing seed (starting with the most
+// expensive histogram), refines the assignment with a few k-means iterations
+// and finally merges the clusters greedily with HistogramCombine. This costs
+// O(in_size * max_histograms) population cost evaluations instead of
+// O(in_size^2).
+template<typename HistogramType>
+void FastClusterHistograms(const std::vector<HistogramType>& in,
+                           int max_histograms,
+                           std::vector<HistogramType>* out,
+                           std::vector<uint32_t>* histogram_symbols) {
+  // Histograms that cost fewer extra bits when merged into an existing seed
+  // do not start a new one.
+  static const float kMinDistanceForDistinct = 64.0f;
+  static const int kNumRefinements = 2;
+
+  const int in_size = in.size();
+  std::vector<float> in_cost(in_size);
+  for (int i = 0; i < in_size; ++i) {
+    in_cost[i] = in[i].PopulationCost();
+  }
+  out->clear();
+  histogram_symbols->assign(in_size, 0);
+
+  // Extra bits of merging each histogram into its closest seed so far.
+  std::vector<float> dist(in_size, std::numeric_limits<float>::max());
+  int largest = -1;
+  for (int i = 0; i < in_size; ++i) {
+    if (in[i].total_count_ != 0 &&
+        (largest < 0 || in_cost[i] > in_cost[largest])) {
+      largest = i;
+    }
+  }
+  if (largest < 0) {
+    out->push_back(in[0]);
+    return;
+  }
+  while (largest >= 0 && out->size() < max_histograms &&
+         dist[largest] > kMinDistanceForDistinct) {
+    const int seed = out->size();
+    const float seed_cost = in_cost[largest];
+    out->push_back(in[largest]);
+    dist[largest] = 0.0f;
+    (*histogram_symbols)[largest] = seed;
+    largest = -1;
+    for (int i = 0; i < in_size; ++i) {
+      if (in[i].total_count_ == 0) continue;
+      if (dist[i] > 0.0f) {
+        const float d = HistogramBitCostDistance(in[i], (*out)[seed],
+                                                 seed_cost) - in_cost[i];
+        if (d < dist[i]) {
+          dist[i] = d;
+          (*histogram_symbols)[i] = seed;
+        }
+      }
+      if (largest < 0 || dist[i] > dist[largest]) {
+        largest = i;
+      }
+    }
+  }
+
+  // k-means refinement: recompute the clusters from their members, then move
+  // each histogram to the cluster where it costs the fewest extra bits.
+  const int num_seeds = out->size();
+  std::vector<float> bit_cost(num_seeds);
+  for (auto& histogram : *out) {
+    histogram.Clear();
+  }
+  for (int i = 0; i < in_size; ++i) {
+    (*out)[(*histogram_symbols)[i]].AddHistogram(in[i]);
+  }
+  for (int iter = 0; iter < kNumRefinements; ++iter) {
+    for (int k = 0; k < num_seeds; ++k) {
+      bit_cost[k] = (*out)[k].PopulationCost();
+    }
+    HistogramRemap(&in[0], in_size, &(*out)[0], &bit_cost[0],
+                   &(*histogram_symbols)[0]);
+  }
+
+  // Bounded local merge, also taking the context map cost into account.
+  std::vector<int> cluster_size(num_seeds, 0);
+  for (int i = 0; i < in_size; ++i) {
+    ++cluster_size[(*histogram_symbols)[i]];
+  }
+  for (int k = 0; k < num_seeds; ++k) {
+    bit_cost[k] = (*out)[k].PopulationCost();
+  }
+  HistogramCombine(&(*out)[0], &cluster_size[0], &bit_cost[0],
+                   &(*histogram_symbols)[0], in_size, max_histograms);
+
+  // Convert the context map to a canonical form.
+  HistogramReindex(out, histogram_symbols);
+}
+
 }  // namespace pik
 
 #endif  // CLUSTER_H_
@@ -19,18 +19,25 @@
 #include <string.h>
 #include <algorithm>
 #include <array>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "bit_reader.h"
 #include "cache_aligned.h"
 #include "compiler_specific.h"
+#include "compressed_image_target.h"
 #include "dc_predictor.h"
 #include "dct.h"
 #include "gamma_correct.h"
 #include "image_io.h"
+#include "kernel_targets.h"
 #include "opsin_codec.h"
 #include "opsin_image.h"
 #include "opsin_inverse.h"
 #include "opsin_params.h"
+#include "profiler.h"
 #include "simd/simd.h"
 #include "status.h"
 
@@ -46,6 +53,8 @@ static const int kCoeffsPerBlock = kBlockSize;
 
 static const float kDCBlurSigma = 3.0f;
 
+const KernelTable<CompressedImageFunctionsForTarget> kernels;
+
 int DivCeil(int a, int b) {
   return (a + b - 1) / b;
 }
@@ -74,27 +83,36 @@ ImageB NormalizeAndClip(const ImageF& in, float range) {
 void DumpOpsin(const PikInfo* info, const Image3F& in,
                const std::string& label) {
   if (!info || info->debug_prefix.empty()) return;
-  WriteImage(ImageFormatPNG(),
+  ImageFormatPNG format;
+  format.fast_write = true;
+  WriteImage(format,
              Image3B(NormalizeAndClip(in.plane(0), 1.25f * kXybRange[0]),
                      NormalizeAndClip(in.plane(1), 1.50f * kXybRange[1]),
                      NormalizeAndClip(in.plane(2), 1.50f * kXybRange[2])),
              info->debug_prefix + label + ".png");
 }
 
-const double *GetQuantizeMul() {
-  static double kQuantizeMul[3] = {
+// Copies the centered and padded rows of "stripe" to block row "block_y" of
+// "opsin", for dumping the input of the streaming quantization.
+void CopyStripe(const Image3F& stripe, const int block_y, Image3F* opsin) {
+  for (int c = 0; c < 3; ++c) {
+    for (int iy = 0; iy < kBlockEdge; ++iy) {
+      memcpy(opsin->PlaneRow(c, block_y * kBlockEdge + iy),
+             stripe.PlaneRow(c, iy), opsin->xsize() * sizeof(float));
+    }
+  }
+}
+
+const double kQuantizeMul[3] = {
     1.9189204419575077,
     0.87086518648437961,
     0.14416093417099549,
-  };
-  return &kQuantizeMul[0];
 };
 
 // kQuantWeights[3 * k_zz + c] is the relative weight of the k_zz coefficient
 // (in the zig-zag order) in component c. Higher weights correspond to finer
 // quantization intervals and more bits spent in encoding.
-const double *GetQuantWeights() {
-  static double kQuantWeights[kBlockSize3] = {
+const double kQuantWeights[kBlockSize3] = {
     3.1116384958312873,
     1.9493486886858318,
     3.7356702523108076,
@@ -287,9 +305,7 @@ const double *GetQuantWeights() {
     0.75028232828887931,
     0.53230208750713925,
     0.5272846988211819,
-  };
-  return &kQuantWeights[0];
-}
+};
 
 const float* NewDequantMatrix() {
   float* table = static_cast<float*>(
@@ -300,18 +316,73 @@ const float* NewDequantMatrix() {
       int idx = k_zz * 3 + c;
       float idct_scale =
           kIDCTScales[k % kBlockEdge] * kIDCTScales[k / kBlockEdge] / 64.0f;
-      double weight = GetQuantWeights()[idx];
+      double weight = kQuantWeights[idx];
       if (weight < 0.4) { weight = 0.4; }
-      double mul = GetQuantizeMul()[c];
+      double mul = kQuantizeMul[c];
       table[c * kCoeffsPerBlock + k] = idct_scale / (weight * mul);
     }
   }
   return table;
 }
 
-const float* DequantMatrix() {
-  static const float* const kDequantMatrix = NewDequantMatrix();
-  return kDequantMatrix;
+// Built during static initialization instead of on first use, so that the
+// first concurrent calls do not wait for each other and later calls need no
+// guard. Must therefore not be used by other static initializers.
+const float* const kDequantMatrix = NewDequantMatrix();
+
+const float* DequantMatrix() { return kDequantMatrix; }
+
+// Returns the edge x edge matrix whose row m holds, for each of the lowest
+// "edge" frequencies u, the value at position m of the edge-point inverse DCT
+// basis function u, scaled such that the reduced IDCT of a dequantized block
+// (see DequantizeBlock) is its kBlockEdge-point IDCT downsampled by
+// kBlockEdge / edge. In particular, the DC basis function is 1.
+const float* NewReducedIDCTBasis(const int edge) {
+  float* table = static_cast<float*>(
+      CacheAligned::Allocate(edge * edge * sizeof(float)));
+  for (int m = 0; m < edge; ++m) {
+    for (int u = 0; u < edge; ++u) {
+      const double alpha = u == 0 ? std::sqrt(0.5) : 1.0;
+      table[m * edge + u] = 0.5 * alpha / kIDCTScales[u] *
+                            std::cos((2 * m + 1) * u * M_PI / (2 * edge));
+    }
+  }
+  return table;
+}
+
+const float* ReducedIDCTBasis(const int edge) {
+  static const float* const kBasis4 = NewReducedIDCTBasis(4);
+  static const float* const kBasis2 = NewReducedIDCTBasis(2);
+  return edge == 4 ? kBasis4 : kBasis2;
+}
+
+// Writes the edge x edge pixels (row-major) of the reduced IDCT of the
+// top-left edge x edge coefficients of the dequantized "block" to "out".
+// The higher frequencies are not read.
+void ComputeReducedBlockIDCT(const float* const PIK_RESTRICT block,
+                             const int edge, float* const PIK_RESTRICT out) {
+  const float* const PIK_RESTRICT basis = ReducedIDCTBasis(edge);
+  // As in the full IDCT, block[kBlockEdge * u + v] is horizontal frequency u
+  // and vertical frequency v.
+  float columns[kBlockSize];  // [v * edge + x]
+  for (int v = 0; v < edge; ++v) {
+    for (int x = 0; x < edge; ++x) {
+      float sum = 0.0f;
+      for (int u = 0; u < edge; ++u) {
+        sum += basis[x * edge + u] * block[kBlockEdge * u + v];
+      }
+      columns[v * edge + x] = sum;
+    }
+  }
+  for (int y = 0; y < edge; ++y) {
+    for (int x = 0; x < edge; ++x) {
+      float sum = 0.0f;
+      for (int v = 0; v < edge; ++v) {
+        sum += basis[y * edge + v] * columns[v * edge + x];
+      }
+      out[y * edge + x] = sum;
+    }
+  }
 }
 
 std::vector<float> GaussianKernel(int radius, float sigma) {
@@ -351,84 +422,312 @@ void ComputeBlockBlurWeights(const float sigma,
   }
 }
 
-Image3F ComputeDCBlurX(const Image3W& dct_coeffs,
-                       const float sigma,
-                       const float inv_quant_dc,
-                       const float ytob_dc,
-                       const float* const PIK_RESTRICT dequant_matrix) {
-  float w_prev[kBlockEdge] = { 0.0f };
-  float w_cur[kBlockEdge] = { 0.0f };
-  float w_next[kBlockEdge] = { 0.0f };
-  ComputeBlockBlurWeights(sigma, w_prev, w_cur, w_next);
-  const float inv_scale[3] = {
-    dequant_matrix[0] * inv_quant_dc,
-    dequant_matrix[kBlockSize] * inv_quant_dc,
-    dequant_matrix[kBlockSize2] * inv_quant_dc
-  };
-  const int block_xsize = dct_coeffs.xsize() / kBlockSize;
-  const int block_ysize = dct_coeffs.ysize();
-  Image3F out(block_xsize * kBlockEdge, block_ysize);
-  for (int by = 0; by < block_ysize; ++by) {
-    auto row_dc = dct_coeffs.Row(by);
+PIK_INLINE float ComputeBlurredBlock(const Image3F& blur_x, int c, int offsetx,
+                                     int y_up, int y_cur, int y_down,
+                                     const float* const PIK_RESTRICT w_up,
+                                     const float* const PIK_RESTRICT w_cur,
+                                     const float* const PIK_RESTRICT w_down,
+                                     float* const PIK_RESTRICT out) {
+  return kernels().blurred_block(blur_x.PlaneRow(c, y_up) + offsetx,
+                                 blur_x.PlaneRow(c, y_cur) + offsetx,
+                                 blur_x.PlaneRow(c, y_down) + offsetx, w_up,
+                                 w_cur, w_down, out);
+}
+
+// Separable Gaussian blur of the dequantized DC (one value per block, mirrored
+// at the image borders), upsampled to kBlockEdge x kBlockEdge per block.
+// ComputeRows() computes the horizontal pass of the block rows around a block
+// row; ComputeBlock() then computes the vertical pass of one of its blocks.
+// Only the horizontal pass of three block rows is stored at a time, and in
+// storage provided by the caller, hence concurrent calls are safe.
+// The DC of block bx is coeffs[dc_stride * bx], where dc_stride is either
+// kBlockSize or 1 (see CompressedImage::SetSparseAC and SetTiledAC).
+class DCBlur {
+ public:
+  DCBlur(const Image3W& coeffs, const int block_xsize, const float inv_quant_dc,
+         const float ytob_dc)
+      : coeffs_(coeffs),
+        block_xsize_(block_xsize),
+        block_ysize_(coeffs.ysize()),
+        dc_stride_(coeffs.xsize() / block_xsize),
+        ytob_dc_(ytob_dc) {
+    const float* const PIK_RESTRICT dequant_matrix = DequantMatrix();
     for (int c = 0; c < 3; ++c) {
-      std::vector<float> row_tmp(block_xsize + 2);
-      for (int bx = 0; bx < block_xsize; ++bx) {
-        const int offset = bx * kBlockSize;
-        float dc = row_dc[c][offset] * inv_scale[c];
-        if (c == 2) {
-          dc += row_dc[1][offset] * inv_scale[1] * ytob_dc;
+      inv_scale_[c] = dequant_matrix[c * kBlockSize] * inv_quant_dc;
+    }
+    ComputeBlockBlurWeights(kDCBlurSigma, w_prev_, w_cur_, w_next_);
+  }
+
+  // Returns storage for ComputeRows() of up to "num_blocks" blocks per row.
+  static Image3F AllocateRows(const int num_blocks) {
+    return Image3F(num_blocks * kBlockEdge, 3);
+  }
+
+  // Writes kBlockEdge horizontally blurred values per block for blocks
+  // [bx0, bx1) of the block rows above, at and below "by" to rows 0, 1 and 2
+  // of "blur_x".
+  void ComputeRows(const int by, const int bx0, const int bx1,
+                   Image3F* PIK_RESTRICT blur_x) const {
+    const int by_u = block_ysize_ == 1 ? 0 : by == 0 ? 1 : by - 1;
+    const int by_d = block_ysize_ == 1 ? 0 : by + 1 < block_ysize_ ? by + 1
+                                                                    : by - 1;
+    const int rows[3] = {by_u, by, by_d};
+    for (int i = 0; i < 3; ++i) {
+      for (int c = 0; c < 3; ++c) {
+        ComputeRowX(rows[i], c, bx0, bx1, blur_x->PlaneRow(c, i));
+      }
+    }
+  }
+
+  // Writes the kBlockSize blurred values of channel "c" of block bx0 + i
+  // (see ComputeRows) to "out" and returns their average.
+  PIK_INLINE float ComputeBlock(const Image3F& blur_x, const int c,
+                                const int i,
+                                float* const PIK_RESTRICT out) const {
+    // The vertical weights equal the horizontal ones.
+    return ComputeBlurredBlock(blur_x, c, i * kBlockEdge, 0, 1, 2, w_prev_,
+                               w_cur_, w_next_, out);
+  }
+
+  // Same as ComputeBlock, but writes the edge x edge averages of each
+  // (kBlockEdge / edge)^2 values, i.e. the blur evaluated on the reduced grid.
+  float ComputeReducedBlock(const Image3F& blur_x, const int c, const int i,
+                            const int edge,
+                            float* const PIK_RESTRICT out) const {
+    const int factor = kBlockEdge / edge;
+    const float inv_factor = 1.0f / factor;
+    const float* const weights[3] = {w_prev_, w_cur_, w_next_};
+    // Horizontal averages and vertical weights of the three block rows.
+    float row_avg[3][kBlockEdge];
+    float row_weight[3][kBlockEdge];
+    for (int r = 0; r < 3; ++r) {
+      const float* const PIK_RESTRICT row =
+          blur_x.ConstPlaneRow(c, r) + i * kBlockEdge;
+      for (int k = 0; k < edge; ++k) {
+        float sum = 0.0f;
+        float weight = 0.0f;
+        for (int j = k * factor; j < (k + 1) * factor; ++j) {
+          sum += row[j];
+          weight += weights[r][j];
         }
-        row_tmp[bx + 1] = dc;
+        row_avg[r][k] = sum * inv_factor;
+        row_weight[r][k] = weight * inv_factor;
       }
-      row_tmp[0] = row_tmp[1 + std::min(1, block_xsize - 1)];
-      row_tmp[block_xsize + 1] = row_tmp[1 + std::max(0, block_xsize - 2)];
-      float* const PIK_RESTRICT row_out = out.Row(by)[c];
-      for (int bx = 0; bx < block_xsize; ++bx) {
-        const float dc0 = row_tmp[bx];
-        const float dc1 = row_tmp[bx + 1];
-        const float dc2 = row_tmp[bx + 2];
-        const int offset = bx * kBlockEdge;
-        for (int ix = 0; ix < kBlockEdge; ++ix) {
-          row_out[offset + ix] =
-              dc0 * w_prev[ix] + dc1 * w_cur[ix] + dc2 * w_next[ix];
+    }
+    float sum = 0.0f;
+    for (int y = 0; y < edge; ++y) {
+      for (int x = 0; x < edge; ++x) {
+        const float val = row_avg[0][x] * row_weight[0][y] +
+                          row_avg[1][x] * row_weight[1][y] +
+                          row_avg[2][x] * row_weight[2][y];
+        out[y * edge + x] = val;
+        sum += val;
+      }
+    }
+    return sum / (edge * edge);
+  }
+
+ private:
+  PIK_INLINE float DequantizedDC(const int by, const int c, int bx) const {
+    if (bx < 0) bx = std::min(1, block_xsize_ - 1);
+    if (bx >= block_xsize_) bx = std::max(0, block_xsize_ - 2);
+    const auto row_dc = coeffs_.ConstRow(by);
+    const int offset = bx * dc_stride_;
+    float dc = row_dc[c][offset] * inv_scale_[c];
+    if (c == 2) {
+      dc += row_dc[1][offset] * inv_scale_[1] * ytob_dc_;
+    }
+    return dc;
+  }
+
+  void ComputeRowX(const int by, const int c, const int bx0, const int bx1,
+                   float* const PIK_RESTRICT row_out) const {
+    float dc0 = DequantizedDC(by, c, bx0 - 1);
+    float dc1 = DequantizedDC(by, c, bx0);
+    for (int bx = bx0; bx < bx1; ++bx) {
+      const float dc2 = DequantizedDC(by, c, bx + 1);
+      float* const PIK_RESTRICT out = row_out + (bx - bx0) * kBlockEdge;
+      for (int ix = 0; ix < kBlockEdge; ++ix) {
+        out[ix] = dc0 * w_prev_[ix] + dc1 * w_cur_[ix] + dc2 * w_next_[ix];
+      }
+      dc0 = dc1;
+      dc1 = dc2;
+    }
+  }
+
+  const Image3W& coeffs_;
+  const int block_xsize_;
+  const int block_ysize_;
+  const int dc_stride_;
+  const float ytob_dc_;
+  float inv_scale_[3];
+  SIMD_ALIGN float w_prev_[kBlockEdge] = {0.0f};
+  SIMD_ALIGN float w_cur_[kBlockEdge] = {0.0f};
+  SIMD_ALIGN float w_next_[kBlockEdge] = {0.0f};
+};
+
+// Computes the overlay (the blurred DC minus its block average, in opsin
+// space) of one block row at a time.
+class OpsinOverlay {
+ public:
+  OpsinOverlay(const Image3W& coeffs, const int block_xsize,
+               const float inv_quant_dc, const float ytob_dc)
+      : block_xsize_(block_xsize),
+        blur_(coeffs, block_xsize, inv_quant_dc, ytob_dc) {}
+
+  // Returns storage for ComputeRow().
+  Image3F AllocateBlurRows() const {
+    return DCBlur::AllocateRows(block_xsize_);
+  }
+
+  // Writes the kBlockSize3 values of each block of block row "by" to "row".
+  // "blur_x" is from AllocateBlurRows().
+  void ComputeRow(const int by, Image3F* PIK_RESTRICT blur_x,
+                  float* const PIK_RESTRICT row) const {
+    blur_.ComputeRows(by, 0, block_xsize_, blur_x);
+    for (int bx = 0, i = 0; bx < block_xsize_; ++bx) {
+      for (int c = 0; c < 3; ++c, i += kBlockSize) {
+        const float avg = blur_.ComputeBlock(*blur_x, c, bx, &row[i]);
+        for (int k = 0; k < kBlockSize; ++k) {
+          row[i + k] -= avg;
         }
       }
     }
   }
-  return out;
+
+ private:
+  const int block_xsize_;
+  const DCBlur blur_;
+};
+
+// Writes row_in[x] - center for x < xsize to row_out, followed by copies of
+// the last value up to padded_xsize.
+void CenterAndPadRow(const float* const PIK_RESTRICT row_in,
+                     const size_t xsize, const float center,
+                     const size_t padded_xsize,
+                     float* const PIK_RESTRICT row_out) {
+  size_t x = 0;
+  for (; x < xsize; ++x) {
+    row_out[x] = row_in[x] - center;
+  }
+  const float lastval = row_out[xsize - 1];
+  for (; x < padded_xsize; ++x) {
+    row_out[x] = lastval;
+  }
 }
 
-PIK_INLINE float ComputeBlurredBlock(const Image3F& blur_x, int c, int offsetx,
-                                     int y_up, int y_cur, int y_down,
-                                     const float* const PIK_RESTRICT w_up,
-                                     const float* const PIK_RESTRICT w_cur,
-                                     const float* const PIK_RESTRICT w_down,
-                                     float* const PIK_RESTRICT out) {
-  const float* const PIK_RESTRICT row0 = blur_x.PlaneRow(c, y_up) + offsetx;
-  const float* const PIK_RESTRICT row1 = blur_x.PlaneRow(c, y_cur) + offsetx;
-  const float* const PIK_RESTRICT row2 = blur_x.PlaneRow(c, y_down) + offsetx;
-  // "Loop" over ix = [0, kBlockEdge), one per lane.
-  using namespace SIMD_NAMESPACE;
-  using V = vec256<float>;
-  V sum = setzero(V());
-  const V val0 = load(V(), row0);
-  const V val1 = load(V(), row1);
-  const V val2 = load(V(), row2);
-  for (int iy = 0; iy < kBlockEdge; ++iy) {
-    const V val = val0 * set1(V(), w_up[iy]) + val1 * set1(V(), w_cur[iy]) +
-                  val2 * set1(V(), w_down[iy]);
-    store(val, out + iy * kBlockEdge);
-    sum += val;
+// Same as CenterAndPadRow(row, xsize, center, padded_xsize, row).
+void CenterAndPadRowInPlace(float* const PIK_RESTRICT row, const size_t xsize,
+                            const float center, const size_t padded_xsize) {
+  size_t x = 0;
+  for (; x < xsize; ++x) {
+    row[x] -= center;
+  }
+  const float lastval = row[xsize - 1];
+  for (; x < padded_xsize; ++x) {
+    row[x] = lastval;
+  }
+}
+
+// Writes the DCT of each channel of block "block_x" of the stripe "rows",
+// minus its overlay (unless null), to "block".
+void TransformBlock(const float* const rows[3][kBlockEdge],
+                    const float* const PIK_RESTRICT overlay, const int block_x,
+                    float* const PIK_RESTRICT block) {
+  const int offsetx = block_x * kBlockEdge;
+  for (int c = 0; c < 3; ++c) {
+    float* const PIK_RESTRICT cblock = &block[kBlockSize * c];
+    for (int iy = 0; iy < kBlockEdge; ++iy) {
+      memcpy(&cblock[iy * kBlockEdge], rows[c][iy] + offsetx,
+             kBlockEdge * sizeof(cblock[0]));
+    }
+  }
+  if (overlay != nullptr) {
+    const float* const PIK_RESTRICT block_overlay =
+        &overlay[3 * block_x * kBlockSize];
+    for (int k = 0; k < kBlockSize3; ++k) {
+      block[k] -= block_overlay[k];
+    }
+  }
+  PROFILER_ZONE("DCT");
+  for (int c = 0; c < 3; ++c) {
+    ComputeTransposedScaledBlockDCTFloat(&block[kBlockSize * c]);
+  }
+}
+
+size_t TotalSize(const std::vector<std::string>& sections) {
+  size_t size = 0;
+  for (const std::string& section : sections) {
+    size += section.size();
+  }
+  return size;
+}
+
+// Returns the concatenation of "sections", zero-padded to a multiple of 4
+// bytes.
+std::string JoinAndPadTo4Bytes(const std::vector<std::string>& sections) {
+  const size_t padded_size = (TotalSize(sections) + 3) & ~size_t(3);
+  std::string output;
+  output.reserve(padded_size);
+  for (const std::string& section : sections) {
+    output.append(section);
+  }
+  output.resize(padded_size, 0);
+  return output;
+}
+
+// Same as JoinAndPadTo4Bytes, but appends to "out" after growing it once.
+// The padding is relative to the previous end of "out".
+void AppendAndPadTo4Bytes(const std::vector<std::string>& sections,
+                          PaddedBytes* out) {
+  const size_t begin = out->size();
+  const size_t size = TotalSize(sections);
+  const size_t padded_size = (size + 3) & ~size_t(3);
+  out->resize(begin + padded_size);
+  uint8_t* pos = out->data() + begin;
+  for (const std::string& section : sections) {
+    memcpy(pos, section.data(), section.size());
+    pos += section.size();
   }
+  memset(pos, 0, padded_size - size);
+}
 
-  float avg;
-  store(to_subset(vec32<float>(), ext::horz_sum(sum)), &avg);
-  return avg / 64.0f;
+std::function<void(std::string&&)> AppendTo(
+    std::vector<std::string>* sections) {
+  return [sections](std::string&& section) {
+    sections->push_back(std::move(section));
+  };
 }
 
+// Passes each section to a ByteSink as soon as it is encoded.
+class SinkSectionWriter {
+ public:
+  explicit SinkSectionWriter(ByteSink* sink) : sink_(sink) {}
+
+  void operator()(std::string&& section) {
+    ok_ = ok_ && sink_->Write(reinterpret_cast<const uint8_t*>(section.data()),
+                              section.size());
+    size_ += section.size();
+  }
+
+  // Writes the padding to a multiple of 4 bytes and returns whether all
+  // writes succeeded.
+  bool Finalize() {
+    const uint8_t zeros[3] = {0};
+    const size_t padding = ((size_ + 3) & ~size_t(3)) - size_;
+    return ok_ && (padding == 0 || sink_->Write(zeros, padding));
+  }
+
+ private:
+  ByteSink* sink_;
+  size_t size_ = 0;
+  bool ok_ = true;
+};
+
 }  // namespace
 
-CompressedImage::CompressedImage(int xsize, int ysize, PikInfo* info)
+CompressedImage::CompressedImage(int xsize, int ysize, ThreadPool* pool,
+                                 PikInfo* info)
     : xsize_(xsize), ysize_(ysize),
       block_xsize_(DivCeil(xsize, kBlockEdge)),
       block_ysize_(DivCeil(ysize, kBlockEdge)),
@@ -437,15 +736,17 @@ CompressedImage::CompressedImage(int xsize, int ysize, PikInfo* info)
       num_blocks_(block_xsize_ * block_ysize_),
       quantizer_(block_xsize_, block_ysize_, kCoeffsPerBlock, DequantMatrix()),
       dct_coeffs_(block_xsize_ * kBlockSize, block_ysize_),
+      nonzero_ac_(block_xsize_, block_ysize_, 7),
       ytob_dc_(120),
       ytob_ac_(tile_xsize_, tile_ysize_, 120),
+      pool_(pool),
       pik_info_(info) {
 }
 
 // static
 CompressedImage CompressedImage::FromOpsinImage(
-    const Image3F& opsin, PikInfo* info) {
-  CompressedImage img(opsin.xsize(), opsin.ysize(), info);
+    const Image3F& opsin, ThreadPool* pool, PikInfo* info) {
+  CompressedImage img(opsin.xsize(), opsin.ysize(), pool, info);
   const size_t xsize = kBlockEdge * img.block_xsize_;
   const size_t ysize = kBlockEdge * img.block_ysize_;
   img.opsin_image_.reset(new Image3F(xsize, ysize));
@@ -453,18 +754,8 @@ CompressedImage CompressedImage::FromOpsinImage(
   int y = 0;
   for (; y < opsin.ysize(); ++y) {
     for (int c = 0; c < 3; ++c) {
-      const float* const PIK_RESTRICT row_in = &opsin.Row(y)[c][0];
-      float* const PIK_RESTRICT row_out = &img.opsin_image_->Row(y)[c][0];
-      const float center = kXybCenter[c];
-      int x = 0;
-      for (; x < opsin.xsize(); ++x) {
-        row_out[x] = row_in[x] - center;
-      }
-      const int lastcol = opsin.xsize() - 1;
-      const float lastval = row_out[lastcol];
-      for (; x < xsize; ++x) {
-        row_out[x] = lastval;
-      }
+      CenterAndPadRow(&opsin.Row(y)[c][0], opsin.xsize(), kXybCenter[c], xsize,
+                      &img.opsin_image_->Row(y)[c][0]);
     }
   }
   const int lastrow = opsin.ysize() - 1;
@@ -480,34 +771,116 @@ CompressedImage CompressedImage::FromOpsinImage(
   return img;
 }
 
+// static
+CompressedImage CompressedImage::FromOpsinImage(
+    Image3F&& opsin, ThreadPool* pool, PikInfo* info) {
+  const size_t xsize = kBlockEdge * DivCeil(opsin.xsize(), kBlockEdge);
+  for (int c = 0; c < 3; ++c) {
+    if (opsin.plane(c).bytes_per_row() < xsize * sizeof(float)) {
+      // No room for the padding columns (not the case with the default
+      // row alignment).
+      const Image3F& const_opsin = opsin;
+      return FromOpsinImage(const_opsin, pool, info);
+    }
+  }
+  CompressedImage img(opsin.xsize(), opsin.ysize(), pool, info);
+  for (int y = 0; y < opsin.ysize(); ++y) {
+    for (int c = 0; c < 3; ++c) {
+      CenterAndPadRowInPlace(&opsin.Row(y)[c][0], opsin.xsize(),
+                             kXybCenter[c], xsize);
+    }
+  }
+  // The missing padding rows are copies of the last row, see OpsinStripe.
+  img.opsin_image_.reset(new Image3F(std::move(opsin)));
+  DumpOpsin(info, *img.opsin_image_, "opsin_orig");
+  return img;
+}
+
+CompressedImage CompressedImage::CloneForSearch(ThreadPool* pool,
+                                                PikInfo* info) const {
+  PIK_CHECK(opsin_image_ != nullptr);
+  CompressedImage img(xsize_, ysize_, pool, info);
+  img.opsin_image_ = opsin_image_;
+  img.ytob_dc_ = ytob_dc_;
+  img.ytob_ac_ = CopyImage(ytob_ac_);
+  img.ac_groups_ = ac_groups_;
+  img.num_ans_states_ = num_ans_states_;
+  img.fast_clustering_ = fast_clustering_;
+  img.fast_size_estimates_ = fast_size_estimates_;
+  img.static_ac_codes_ = static_ac_codes_;
+  img.natural_coeff_order_ = natural_coeff_order_;
+  img.grayscale_ = grayscale_;
+  if (has_coeff_order_) {
+    memcpy(img.coeff_order_, coeff_order_, sizeof(coeff_order_));
+    img.has_coeff_order_ = true;
+  }
+  return img;
+}
+
 // We modify the standard DCT of the intensity channel by further decorrelating
 // the 1st and 3rd AC coefficients in the first row and first column. The
 // unscaled prediction coefficient corresponds to the 1-d DCT of a linear slope.
 static const float kACPredScale = 0.30348289542505313;
 static const float kACPred31 = kACPredScale * 0.051028376631910073;
 
-void CompressedImage::QuantizeBlock(int block_x, int block_y) {
-  const int offsetx = block_x * kBlockEdge;
-  const int offsety = block_y * kBlockEdge;
-  SIMD_ALIGN float block[kBlockSize3];
+void CompressedImage::OpsinStripe(const int block_y,
+                                  OpsinRows rows) const {
+  // An image from FromOpsinImage(Image3F&&) lacks the bottom padding rows.
+  const int last_y = opsin_image_->ysize() - 1;
   for (int c = 0; c < 3; ++c) {
-    float* const PIK_RESTRICT cblock = &block[kBlockSize * c];
     for (int iy = 0; iy < kBlockEdge; ++iy) {
-      memcpy(&cblock[iy * kBlockEdge],
-             &opsin_image_->Row(offsety + iy)[c][offsetx],
-             kBlockEdge * sizeof(cblock[0]));
+      const int y = std::min(block_y * kBlockEdge + iy, last_y);
+      rows[c][iy] = &opsin_image_->Row(y)[c][0];
     }
   }
-  if (opsin_overlay_.get() != nullptr) {
-    const float* const PIK_RESTRICT overlay =
-        &opsin_overlay_->Row(block_y)[3 * block_x * kBlockSize];
-    for (int k = 0; k < kBlockSize3; ++k) {
-      block[k] -= overlay[k];
+}
+
+void CompressedImage::QuantizeBlock(int block_x, int block_y) {
+  OpsinRows rows;
+  OpsinStripe(block_y, rows);
+  const float* const PIK_RESTRICT overlay =
+      opsin_overlay_.get() != nullptr ? opsin_overlay_->Row(block_y) : nullptr;
+  SIMD_ALIGN float block[kBlockSize3];
+  TransformBlock(rows, overlay, block_x, block);
+  QuantizeTransformedBlock(block_x, block_y, block);
+}
+
+void CompressedImage::QuantizeBlockRow(const int block_y, const OpsinRows rows,
+                                       const float* const PIK_RESTRICT
+                                           overlay) {
+  static const int kBatch = 8;
+  SIMD_ALIGN float blocks[kBatch * kBlockSize3];
+  int block_x = 0;
+  for (; block_x + kBatch <= block_xsize_; block_x += kBatch) {
+    const int offsetx = block_x * kBlockEdge;
+    {
+      PROFILER_ZONE("DCT");
+      // Gray images only need Y, see QuantizeTransformedBlock.
+      for (int c = grayscale_ ? 1 : 0; c < (grayscale_ ? 2 : 3); ++c) {
+        const float* batch_rows[kBlockEdge];
+        for (int iy = 0; iy < kBlockEdge; ++iy) {
+          batch_rows[iy] = rows[c][iy] + offsetx;
+        }
+        const float* const PIK_RESTRICT subtract =
+            overlay ? &overlay[3 * block_x * kBlockSize + kBlockSize * c]
+                    : nullptr;
+        ComputeTransposedScaledBlockDCTFloat8(batch_rows, subtract, kBlockSize3,
+                                              &blocks[kBlockSize * c]);
+      }
+    }
+    for (int i = 0; i < kBatch; ++i) {
+      QuantizeTransformedBlock(block_x + i, block_y, &blocks[i * kBlockSize3]);
     }
   }
-  for (int c = 0; c < 3; ++c) {
-    ComputeTransposedScaledBlockDCTFloat(&block[kBlockSize * c]);
+  for (; block_x < block_xsize_; ++block_x) {
+    TransformBlock(rows, overlay, block_x, blocks);
+    QuantizeTransformedBlock(block_x, block_y, blocks);
   }
+}
+
+void CompressedImage::QuantizeTransformedBlock(const int block_x,
+                                               const int block_y,
+                                               float* const PIK_RESTRICT block) {
   // Remove some correlation between the 1st and 3rd AC coefficients in the
   // first column and first row.
   block[kBlockSize + 3] -= kACPred31 * block[kBlockSize + 1];
@@ -518,13 +891,23 @@ void CompressedImage::QuantizeBlock(int block_x, int block_y) {
   const float inv_quant_dc = 64.0f * quantizer_.inv_quant_dc();
   const float inv_quant_ac = 64.0f * quantizer_.inv_quant_ac(block_x, block_y);
   const float* PIK_RESTRICT kDequantMatrix = DequantMatrix();
-  quantizer_.QuantizeBlock(block_x, block_y, 1, 0, kBlockSize,
-                           &block[kBlockSize], iblocky);
+  uint8_t nonzero_ac = 0;
+  if (quantizer_.QuantizeBlock(block_x, block_y, 1, 0, kBlockSize,
+                               &block[kBlockSize], iblocky)) {
+    nonzero_ac |= 2;
+  }
   for (int k = 0; k < kBlockSize; ++k) {
     block[kBlockSize + k] = iblocky[k] * kDequantMatrix[kBlockSize + k] *
         inv_quant_ac;
   }
   block[kBlockSize] = iblocky[0] * kDequantMatrix[kBlockSize] * inv_quant_dc;
+  if (grayscale_) {
+    // X and B are determined by Y.
+    memset(&row_out[0][offset], 0, kBlockSize * sizeof(row_out[0][0]));
+    memset(&row_out[2][offset], 0, kBlockSize * sizeof(row_out[2][0]));
+    nonzero_ac_.Row(block_y)[block_x] = nonzero_ac;
+    return;
+  }
   {
     const int tile_x = block_x / kTileToBlockRatio;
     const int tile_y = block_y / kTileToBlockRatio;
@@ -539,13 +922,25 @@ void CompressedImage::QuantizeBlock(int block_x, int block_y) {
       // y channel was already quantized
       continue;
     }
-    quantizer_.QuantizeBlock(
-        block_x, block_y, c, 0, kBlockSize,
-        &block[c * kBlockSize], &row_out[c][offset]);
+    if (quantizer_.QuantizeBlock(block_x, block_y, c, 0, kBlockSize,
+                                 &block[c * kBlockSize], &row_out[c][offset])) {
+      nonzero_ac |= 1 << c;
+    }
   }
+  nonzero_ac_.Row(block_y)[block_x] = nonzero_ac;
 }
 
 void CompressedImage::QuantizeDC() {
+  PROFILER_FUNC;
+  RunOnPool(pool_, 0, block_ysize_, [this](const int block_y,
+                                           const int thread) {
+    OpsinRows rows;
+    OpsinStripe(block_y, rows);
+    QuantizeDCRow(block_y, rows);
+  });
+}
+
+void CompressedImage::QuantizeDCRow(const int block_y, const OpsinRows rows) {
   const float inv_quant_dc = 64.0f * quantizer_.inv_quant_dc();
   const float* PIK_RESTRICT kDequantMatrix = DequantMatrix();
   const float inv_scale[3] = {
@@ -556,121 +951,486 @@ void CompressedImage::QuantizeDC() {
   const float scale[3] = {
     1.0f / inv_scale[0], 1.0f / inv_scale[1], 1.0f / inv_scale[2]
   };
-  for (int block_y = 0; block_y < block_ysize_; ++block_y) {
-    for (int block_x = 0; block_x < block_xsize_; ++block_x) {
-      const int offsetx = block_x * kBlockEdge;
-      const int offsety = block_y * kBlockEdge;
-      float dc[3] = { 0 };
-      for (int c = 0; c < 3; ++c) {
-        for (int ix = 0; ix < kBlockEdge; ++ix) {
-          for (int iy = 0; iy < kBlockEdge; ++iy) {
-            dc[c] += opsin_image_->Row(offsety + iy)[c][offsetx + ix];
-          }
+  auto row_out = dct_coeffs_.Row(block_y);
+  for (int block_x = 0; block_x < block_xsize_; ++block_x) {
+    const int offsetx = block_x * kBlockEdge;
+    float dc[3] = { 0 };
+    for (int c = grayscale_ ? 1 : 0; c < (grayscale_ ? 2 : 3); ++c) {
+      for (int ix = 0; ix < kBlockEdge; ++ix) {
+        for (int iy = 0; iy < kBlockEdge; ++iy) {
+          dc[c] += rows[c][iy][offsetx + ix];
         }
       }
-      auto row_out = dct_coeffs_.Row(block_y);
-      const int offset = block_x * kBlockSize;
-      row_out[0][offset] = std::round(dc[0] * scale[0]);
-      row_out[1][offset] = std::round(dc[1] * scale[1]);
-      dc[2] -= YToBDC() * row_out[1][offset] * inv_scale[1];
-      row_out[2][offset] = std::round(dc[2] * scale[2]);
     }
+    const int offset = block_x * kBlockSize;
+    row_out[0][offset] = std::round(dc[0] * scale[0]);
+    row_out[1][offset] = std::round(dc[1] * scale[1]);
+    if (grayscale_) {
+      row_out[2][offset] = 0;
+      continue;
+    }
+    dc[2] -= YToBDC() * row_out[1][offset] * inv_scale[1];
+    row_out[2][offset] = std::round(dc[2] * scale[2]);
   }
 }
 
 void CompressedImage::ComputeOpsinOverlay() {
+  PROFILER_FUNC;
   opsin_overlay_.reset(new ImageF(block_xsize_ * kBlockSize3, block_ysize_));
-  const float inv_quant_dc = quantizer_.inv_quant_dc();
-  Image3F dc_blur_x = ComputeDCBlurX(coeffs(), kDCBlurSigma, inv_quant_dc,
-                                     YToBDC(), DequantMatrix());
-  float w_up[kBlockSize] = { 0.0f };
-  float w_cur[kBlockSize] = { 0.0f };
-  float w_down[kBlockSize] = { 0.0f };
-  ComputeBlockBlurWeights(kDCBlurSigma, w_up, w_cur, w_down);
-  for (int by = 0; by < block_ysize_; ++by) {
-    int by_u = block_ysize_ == 1 ? 0 : by == 0 ? 1 : by - 1;
-    int by_d = block_ysize_ == 1 ? 0 : by + 1 < block_ysize_ ? by + 1 : by - 1;
-    float* const PIK_RESTRICT row = opsin_overlay_->Row(by);
-    for (int bx = 0, i = 0; bx < block_xsize_; ++bx) {
-      const int offsetx = bx * kBlockEdge;
-      for (int c = 0; c < 3; ++c, i += kBlockSize) {
-        float avg = ComputeBlurredBlock(dc_blur_x, c, offsetx, by_u, by, by_d,
-                                        w_up, w_cur, w_down, &row[i]);
-        for (int k = 0; k < kBlockSize; ++k) {
-          row[i + k] -= avg;
-        }
-      }
-    }
+  const OpsinOverlay overlay(coeffs(), block_xsize_, quantizer_.inv_quant_dc(),
+                             YToBDC());
+  const int num_threads = pool_ ? pool_->NumThreads() : 1;
+  std::vector<Image3F> blur_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    blur_rows.push_back(overlay.AllocateBlurRows());
   }
+  RunOnPool(pool_, 0, block_ysize_, [&](const int by, const int thread) {
+    overlay.ComputeRow(by, &blur_rows[thread], opsin_overlay_->Row(by));
+  });
 }
 
 void CompressedImage::Quantize() {
+  PROFILER_FUNC;
   QuantizeDC();
   ComputeOpsinOverlay();
-  for (int block_y = 0; block_y < block_ysize_; ++block_y) {
+  // Blocks only read the (already computed) DC coefficients and overlay and
+  // write their own coefficients, so block rows are independent.
+  RunOnPool(pool_, 0, block_ysize_, [this](const int block_y,
+                                           const int thread) {
+    OpsinRows rows;
+    OpsinStripe(block_y, rows);
+    QuantizeBlockRow(block_y, rows, opsin_overlay_->Row(block_y));
+  });
+  quantizer_.ClearDirty();
+  requantize_all_ = false;
+  rate_tracker_.reset();
+}
+
+void CompressedImage::QuantizeDirtyBlocks(const ImageB& dirty_blocks) {
+  PROFILER_FUNC;
+  PIK_CHECK(opsin_overlay_ != nullptr);
+  if (rate_tracker_ != nullptr) {
+    rate_tracker_->UpdateAC(dct_coeffs_, dirty_blocks, -1);
+  }
+  RunOnPool(pool_, 0, block_ysize_, [this, &dirty_blocks](const int block_y,
+                                                          const int thread) {
+    const uint8_t* const PIK_RESTRICT row_dirty = dirty_blocks.Row(block_y);
     for (int block_x = 0; block_x < block_xsize_; ++block_x) {
-      QuantizeBlock(block_x, block_y);
+      if (row_dirty[block_x]) QuantizeBlock(block_x, block_y);
     }
+  });
+  if (rate_tracker_ != nullptr) {
+    rate_tracker_->UpdateAC(dct_coeffs_, dirty_blocks, 1);
   }
 }
 
-std::string CompressedImage::Encode() const {
+void CompressedImage::QuantizeDirty() {
+  if (requantize_all_ || quantizer_.AllDirty()) {
+    Quantize();
+    return;
+  }
+  QuantizeDirtyBlocks(quantizer_.dirty_cells());
+  quantizer_.ClearDirty();
+}
+
+void CompressedImage::QuantizeOpsinImage(const Image3F& opsin) {
+  PIK_CHECK(opsin.xsize() == xsize_ && opsin.ysize() == ysize_);
+  QuantizeOpsinImage([&opsin](const int y, float* const PIK_RESTRICT row_x,
+                              float* const PIK_RESTRICT row_y,
+                              float* const PIK_RESTRICT row_b) {
+    const size_t row_size = opsin.xsize() * sizeof(float);
+    memcpy(row_x, opsin.PlaneRow(0, y), row_size);
+    memcpy(row_y, opsin.PlaneRow(1, y), row_size);
+    memcpy(row_b, opsin.PlaneRow(2, y), row_size);
+  });
+}
+
+void CompressedImage::QuantizeOpsinImage(const OpsinRowFunc& opsin_row) {
+  PROFILER_FUNC;
+  rate_tracker_.reset();
+  PIK_CHECK(opsin_image_.get() == nullptr);
+  const int num_threads = pool_ ? pool_->NumThreads() : 1;
+  const size_t padded_xsize = block_xsize_ * kBlockEdge;
+  // Per-thread stripe of kBlockEdge centered and padded rows per channel,
+  // plus the overlay of one block row.
+  std::vector<Image3F> stripes;
+  std::vector<ImageF> overlay_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    stripes.emplace_back(padded_xsize, kBlockEdge);
+    overlay_rows.emplace_back(block_xsize_ * kBlockSize3, 1);
+  }
+  // Only for DumpOpsin.
+  std::unique_ptr<Image3F> dump;
+  if (pik_info_ != nullptr && !pik_info_->debug_prefix.empty()) {
+    dump.reset(new Image3F(padded_xsize, block_ysize_ * kBlockEdge));
+  }
+  // Same values as the rows of block row "block_y" of opsin_image_.
+  const auto fill_stripe = [&](const int block_y, const int thread,
+                               OpsinRows rows) {
+    Image3F& stripe = stripes[thread];
+    for (int iy = 0; iy < kBlockEdge; ++iy) {
+      const int y = std::min(block_y * kBlockEdge + iy, ysize_ - 1);
+      auto row_out = stripe.Row(iy);
+      {
+        PROFILER_ZONE("Opsin rows");
+        opsin_row(y, row_out[0], row_out[1], row_out[2]);
+      }
+      for (int c = 0; c < 3; ++c) {
+        float* const PIK_RESTRICT row = row_out[c];
+        for (int x = 0; x < xsize_; ++x) {
+          row[x] -= kXybCenter[c];
+        }
+        for (size_t x = xsize_; x < padded_xsize; ++x) {
+          row[x] = row[xsize_ - 1];
+        }
+        rows[c][iy] = row;
+      }
+    }
+  };
+
+  RunOnPool(pool_, 0, block_ysize_, [&](const int block_y, const int thread) {
+    OpsinRows rows;
+    fill_stripe(block_y, thread, rows);
+    if (dump) CopyStripe(stripes[thread], block_y, dump.get());
+    QuantizeDCRow(block_y, rows);
+  });
+  // The overlay of a block row depends on the DC of its neighbors, hence the
+  // AC pass has to wait for all DC coefficients.
+  const OpsinOverlay overlay(coeffs(), block_xsize_, quantizer_.inv_quant_dc(),
+                             YToBDC());
+  std::vector<Image3F> blur_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    blur_rows.push_back(overlay.AllocateBlurRows());
+  }
+  RunOnPool(pool_, 0, block_ysize_, [&](const int block_y, const int thread) {
+    OpsinRows rows;
+    fill_stripe(block_y, thread, rows);
+    float* const PIK_RESTRICT overlay_row = overlay_rows[thread].Row(0);
+    overlay.ComputeRow(block_y, &blur_rows[thread], overlay_row);
+    QuantizeBlockRow(block_y, rows, overlay_row);
+  });
+  if (dump) DumpOpsin(pik_info_, *dump, "opsin_orig");
+}
+
+void CompressedImage::QuantizeOpsinRowsInOrder(const OpsinRowFunc& opsin_row) {
+  PROFILER_FUNC;
+  rate_tracker_.reset();
+  PIK_CHECK(opsin_image_.get() == nullptr);
+  const size_t padded_xsize = block_xsize_ * kBlockEdge;
+  // Ring of the centered and padded stripes of the last three block rows.
+  std::vector<Image3F> stripes;
+  for (int i = 0; i < 3; ++i) {
+    stripes.emplace_back(padded_xsize, kBlockEdge);
+  }
+  // Only for DumpOpsin.
+  std::unique_ptr<Image3F> dump;
+  if (pik_info_ != nullptr && !pik_info_->debug_prefix.empty()) {
+    dump.reset(new Image3F(padded_xsize, block_ysize_ * kBlockEdge));
+  }
+  const auto fill_stripe = [&](const int block_y) {
+    Image3F& stripe = stripes[block_y % 3];
+    for (int iy = 0; iy < kBlockEdge; ++iy) {
+      const int y = block_y * kBlockEdge + iy;
+      auto row_out = stripe.Row(iy);
+      if (y >= ysize_) {
+        for (int c = 0; c < 3; ++c) {
+          memcpy(row_out[c], stripe.Row(iy - 1)[c],
+                 padded_xsize * sizeof(row_out[c][0]));
+        }
+        continue;
+      }
+      {
+        PROFILER_ZONE("Opsin rows");
+        opsin_row(y, row_out[0], row_out[1], row_out[2]);
+      }
+      for (int c = 0; c < 3; ++c) {
+        float* const PIK_RESTRICT row = row_out[c];
+        for (int x = 0; x < xsize_; ++x) {
+          row[x] -= kXybCenter[c];
+        }
+        for (size_t x = xsize_; x < padded_xsize; ++x) {
+          row[x] = row[xsize_ - 1];
+        }
+      }
+    }
+  };
+  const auto stripe_rows = [&](const int block_y, OpsinRows rows) {
+    for (int c = 0; c < 3; ++c) {
+      for (int iy = 0; iy < kBlockEdge; ++iy) {
+        rows[c][iy] = stripes[block_y % 3].PlaneRow(c, iy);
+      }
+    }
+  };
+
+  const OpsinOverlay overlay(coeffs(), block_xsize_, quantizer_.inv_quant_dc(),
+                             YToBDC());
+  Image3F blur_rows = overlay.AllocateBlurRows();
+  ImageF overlay_row(block_xsize_ * kBlockSize3, 1);
+  // Step "s" fills the stripe of block row s while quantizing the DC of block
+  // row s - 1 and then the AC of block row s - 2, whose overlay depends on the
+  // DC of its neighbors.
+  for (int s = 0; s < block_ysize_ + 2; ++s) {
+    RunOnPool(pool_, 0, 2, [&](const int task, const int thread) {
+      if (task == 0) {
+        if (s < block_ysize_) {
+          fill_stripe(s);
+          if (dump) CopyStripe(stripes[s % 3], s, dump.get());
+        }
+        return;
+      }
+      OpsinRows rows;
+      if (s >= 1 && s <= block_ysize_) {
+        stripe_rows(s - 1, rows);
+        QuantizeDCRow(s - 1, rows);
+      }
+      if (s >= 2) {
+        stripe_rows(s - 2, rows);
+        overlay.ComputeRow(s - 2, &blur_rows, overlay_row.Row(0));
+        QuantizeBlockRow(s - 2, rows, overlay_row.Row(0));
+      }
+    });
+  }
+  if (dump) DumpOpsin(pik_info_, *dump, "opsin_orig");
+}
+
+void CompressedImage::EncodeSections(const SectionFunc& emit) const {
+  PROFILER_FUNC;
   PIK_CHECK(ytob_dc_ >= 0);
   PIK_CHECK(ytob_dc_ < 256);
   PikImageSizeInfo* ytob_info = pik_info_ ? &pik_info_->ytob_image : nullptr;
   PikImageSizeInfo* quant_info = pik_info_ ? &pik_info_->quant_image : nullptr;
   PikImageSizeInfo* dc_info = pik_info_ ? &pik_info_->dc_image : nullptr;
   PikImageSizeInfo* ac_info = pik_info_ ? &pik_info_->ac_image : nullptr;
-  std::string ytob_code =
-      std::string(1, ytob_dc_) + EncodePlane(ytob_ac_, 0, 255, ytob_info);
-  std::string quant_code = quantizer_.Encode(quant_info);
-  std::string dc_code = EncodeImage(PredictDC(dct_coeffs_), 1, dc_info);
-  std::string ac_code = EncodeAC(dct_coeffs_, ac_info);
-  return PadTo4Bytes(ytob_code + quant_code + dc_code + ac_code);
+  size_t size = 0;
+  const auto emit_and_count = [&emit, &size](std::string&& section) {
+    size += section.size();
+    emit(std::move(section));
+  };
+  emit_and_count(std::string(1, ytob_dc_));
+  emit_and_count(EncodePlane(ytob_ac_, 0, 255, ytob_info));
+  part_sizes_.ytob = size;
+  if (store_quant_field_) emit_and_count(quantizer_.Encode(quant_info));
+  part_sizes_.quant = size - part_sizes_.ytob;
+  emit_and_count(EncodeImage(PredictDC(dct_coeffs_), 1, dc_info));
+  part_sizes_.dc = size - part_sizes_.ytob - part_sizes_.quant;
+  if (ac_groups_) {
+    std::vector<std::string> group_codes;
+    emit_and_count(EncodeACGroups(dct_coeffs_, CoeffOrder(),
+                                  kTileToBlockRatio, num_ans_states_,
+                                  fast_clustering_, pool_, ac_info,
+                                  &group_codes));
+    // Each group code is already padded, and requires the preceding sections
+    // to be padded as well.
+    emit(std::string(((size + 3) & ~size_t(3)) - size, '\0'));
+    for (std::string& group_code : group_codes) {
+      emit(std::move(group_code));
+    }
+    return;
+  }
+  emit(EncodeAC(dct_coeffs_, CoeffOrder(), num_ans_states_, fast_clustering_,
+                static_ac_codes_, previous_ac_codes_, used_ac_codes_,
+                ac_info));
 }
 
-std::string CompressedImage::EncodeFast() const {
+void CompressedImage::UpdateCoeffOrder() {
+  ComputeCoeffOrder(dct_coeffs_, coeff_order_);
+  has_coeff_order_ = true;
+}
+
+const int* CompressedImage::CoeffOrder() const {
+  if (natural_coeff_order_) return nullptr;
+  if (!has_coeff_order_) {
+    ComputeCoeffOrder(dct_coeffs_, coeff_order_);
+    has_coeff_order_ = true;
+  }
+  return coeff_order_;
+}
+
+void CompressedImage::EncodeFastSections(const SectionFunc& emit) const {
+  PROFILER_FUNC;
   PIK_CHECK(ytob_dc_ >= 0);
   PIK_CHECK(ytob_dc_ < 256);
   PikImageSizeInfo* ytob_info = pik_info_ ? &pik_info_->ytob_image : nullptr;
   PikImageSizeInfo* quant_info = pik_info_ ? &pik_info_->quant_image : nullptr;
   PikImageSizeInfo* dc_info = pik_info_ ? &pik_info_->dc_image : nullptr;
   PikImageSizeInfo* ac_info = pik_info_ ? &pik_info_->ac_image : nullptr;
-  std::string ytob_code =
-      std::string(1, ytob_dc_) + EncodePlane(ytob_ac_, 0, 255, ytob_info);
-  std::string quant_code = quantizer_.Encode(quant_info);
-  std::string dc_code = EncodeImage(PredictDC(dct_coeffs_), 1, dc_info);
-  std::string ac_code = EncodeACFast(dct_coeffs_, ac_info);
-  return PadTo4Bytes(ytob_code + quant_code + dc_code + ac_code);
+  size_t size = 0;
+  const auto emit_and_count = [&emit, &size](std::string&& section) {
+    size += section.size();
+    emit(std::move(section));
+  };
+  emit_and_count(std::string(1, ytob_dc_));
+  emit_and_count(EncodePlane(ytob_ac_, 0, 255, ytob_info));
+  part_sizes_.ytob = size;
+  if (store_quant_field_) emit_and_count(quantizer_.Encode(quant_info));
+  part_sizes_.quant = size - part_sizes_.ytob;
+  emit_and_count(EncodeImage(PredictDC(dct_coeffs_), 1, dc_info));
+  part_sizes_.dc = size - part_sizes_.ytob - part_sizes_.quant;
+  emit(EncodeACFast(dct_coeffs_, natural_coeff_order_, num_ans_states_,
+                    static_ac_codes_, ac_info));
 }
 
-bool CompressedImage::Decode(const uint8_t* data, const size_t data_size,
-                             size_t* compressed_size) {
-  if (data_size == 0) {
-    return PIK_FAILURE("Empty compressed data.");
+size_t CompressedImage::EstimateEncodedSize() const {
+  const size_t header_size =
+      1 + EncodedPlaneSize(ytob_ac_, 0, 255) +
+      (store_quant_field_ ? quantizer_.EncodedSize() : 0);
+  return header_size + EstimatedCoeffSize();
+}
+
+size_t CompressedImage::EstimatedCoeffSize() const {
+  PROFILER_FUNC;
+  if (rate_tracker_ == nullptr) {
+    rate_tracker_.reset(new CoeffRateTracker(dct_coeffs_));
   }
-  BitReader br(data, data_size & ~3);
-  ytob_dc_ = br.ReadBits(8);
-  if (!DecodePlane(&br, 0, 255, &ytob_ac_)) {
+  return fast_size_estimates_ ? rate_tracker_->EstimatedSize()
+                              : rate_tracker_->EncodedSize();
+}
+
+std::string CompressedImage::Encode() const {
+  std::vector<std::string> sections;
+  EncodeSections(AppendTo(&sections));
+  return JoinAndPadTo4Bytes(sections);
+}
+
+std::string CompressedImage::EncodeFast() const {
+  std::vector<std::string> sections;
+  EncodeFastSections(AppendTo(&sections));
+  return JoinAndPadTo4Bytes(sections);
+}
+
+void CompressedImage::Encode(PaddedBytes* out) const {
+  std::vector<std::string> sections;
+  EncodeSections(AppendTo(&sections));
+  AppendAndPadTo4Bytes(sections, out);
+}
+
+void CompressedImage::EncodeFast(PaddedBytes* out) const {
+  std::vector<std::string> sections;
+  EncodeFastSections(AppendTo(&sections));
+  AppendAndPadTo4Bytes(sections, out);
+}
+
+bool CompressedImage::Encode(ByteSink* sink) const {
+  SinkSectionWriter writer(sink);
+  EncodeSections(std::ref(writer));
+  return writer.Finalize();
+}
+
+bool CompressedImage::EncodeFast(ByteSink* sink) const {
+  SinkSectionWriter writer(sink);
+  EncodeFastSections(std::ref(writer));
+  return writer.Finalize();
+}
+
+void CompressedImage::UsePreviousQuantField(const CompressedImage& previous) {
+  PIK_CHECK(previous.xsize_ == xsize_ && previous.ysize_ == ysize_);
+  quantizer_.CopyQuantField(previous.quantizer_);
+  ytob_dc_ = previous.ytob_dc_;
+  for (int y = 0; y < tile_ysize_; ++y) {
+    memcpy(ytob_ac_.Row(y), previous.ytob_ac_.Row(y),
+           tile_xsize_ * sizeof(ytob_ac_.Row(y)[0]));
+  }
+  store_quant_field_ = false;
+  requantize_all_ = true;
+  rate_tracker_.reset();
+}
+
+void CompressedImage::SetSparseAC(const bool sparse) {
+  tiled_ac_.reset();
+  if (sparse) {
+    dct_coeffs_ = Image3W(block_xsize_, block_ysize_);
+    sparse_ac_.reset(new SparseAC(block_xsize_, block_ysize_));
+  } else {
+    dct_coeffs_ = Image3W(block_xsize_ * kBlockSize, block_ysize_);
+    sparse_ac_.reset();
+  }
+}
+
+void CompressedImage::SetTiledAC(const bool tiled) {
+  static_assert(TiledAC::kTileBlocks == kTileToBlockRatio, "Tile mismatch");
+  if (tiled) {
+    dct_coeffs_ = Image3W(block_xsize_, block_ysize_);
+    sparse_ac_.reset();
+    tiled_ac_.reset(new TiledAC(block_xsize_, block_ysize_));
+  } else if (tiled_ac_ != nullptr) {
+    dct_coeffs_ = Image3W(block_xsize_ * kBlockSize, block_ysize_);
+    tiled_ac_.reset();
+  }
+}
+
+bool CompressedImage::DecodeUpToDC(BitReader* br) {
+  ytob_dc_ = br->ReadBits(8);
+  if (!DecodePlane(br, 0, 255, &ytob_ac_)) {
     return PIK_FAILURE("DecodePlane failed.");
   }
-  if (!quantizer_.Decode(&br)) {
+  if (store_quant_field_ && !quantizer_.Decode(br)) {
     return PIK_FAILURE("quantizer Decode failed.");
   }
-  if (!DecodeImage(&br, kBlockSize, &dct_coeffs_)) {
+  if (!DecodeImage(br, DCStride(), &dct_coeffs_, decoder_tables_)) {
     return PIK_FAILURE("DecodeImage failed.");
   }
-  if (!DecodeAC(&br, &dct_coeffs_)) {
+  return true;
+}
+
+bool CompressedImage::DecodeDC(const uint8_t* data, const size_t data_size) {
+  PROFILER_FUNC;
+  if (data_size == 0) {
+    return PIK_FAILURE("Empty compressed data.");
+  }
+  BitReader br(data, data_size & ~3);
+  if (!DecodeUpToDC(&br)) return false;
+  UnpredictDC(pool_, DCStride(), &dct_coeffs_);
+  return true;
+}
+
+template <class AC>
+bool CompressedImage::DecodeACTo(BitReader* br, const uint8_t* data,
+                                 const size_t data_size, AC* ac,
+                                 size_t* compressed_size) {
+  DecoderTables* const ac_tables =
+      ac_tables_ != nullptr ? ac_tables_ : decoder_tables_;
+  if (ac_groups_) {
+    const int block_y_end = decode_block_y_end_ < 0 ? block_ysize_
+                                                    : decode_block_y_end_;
+    if (!DecodeACGroups(br, data, data_size & ~3, kTileToBlockRatio,
+                        num_ans_states_, natural_coeff_order_,
+                        decode_block_y_begin_, block_y_end, pool_, ac,
+                        &nonzero_ac_, compressed_size, ac_tables)) {
+      return PIK_FAILURE("DecodeACGroups failed.");
+    }
+    return true;
+  }
+  if (!DecodeAC(br, num_ans_states_, static_ac_codes_, natural_coeff_order_,
+                ac, &nonzero_ac_, ac_tables)) {
     return PIK_FAILURE("DecodeAC failed.");
   }
-  *compressed_size = br.Position();
-  UnpredictDC(&dct_coeffs_);
+  *compressed_size = br->Position();
+  return true;
+}
+
+bool CompressedImage::Decode(const uint8_t* data, const size_t data_size,
+                             size_t* compressed_size) {
+  PROFILER_FUNC;
+  if (data_size == 0) {
+    return PIK_FAILURE("Empty compressed data.");
+  }
+  BitReader br(data, data_size & ~3);
+  if (!DecodeUpToDC(&br)) return false;
+  bool ok;
+  if (sparse_ac_ != nullptr) {
+    ok = DecodeACTo(&br, data, data_size, sparse_ac_.get(), compressed_size);
+  } else if (tiled_ac_ != nullptr) {
+    ok = DecodeACTo(&br, data, data_size, tiled_ac_.get(), compressed_size);
+  } else {
+    ok = DecodeACTo(&br, data, data_size, &dct_coeffs_, compressed_size);
+  }
+  if (!ok) return false;
+  UnpredictDC(pool_, DCStride(), &dct_coeffs_);
   return true;
 }
 
 void CompressedImage::DequantizeBlock(const int block_x, const int block_y,
                                       float* const PIK_RESTRICT block) const {
-  using namespace SIMD_NAMESPACE;
   const int tile_y = block_y / kTileToBlockRatio;
   auto row = dct_coeffs_.Row(block_y);
   const int tile_x = block_x / kTileToBlockRatio;
@@ -678,52 +1438,70 @@ void CompressedImage::DequantizeBlock(const int block_x, const int block_y,
   const float inv_quant_dc = quantizer_.inv_quant_dc();
   const float inv_quant_ac = quantizer_.inv_quant_ac(block_x, block_y);
   const float* PIK_RESTRICT kDequantMatrix = DequantMatrix();
-  for (int c = 0; c < 3; ++c) {
-    const int16_t* const PIK_RESTRICT iblock = &row[c][offset];
+  const int16_t* const PIK_RESTRICT tiled_block =
+      tiled_ac_ != nullptr ? tiled_ac_->Block(block_x, block_y) : nullptr;
+  const int dc_offset = tiled_block != nullptr ? block_x : offset;
+  for (int c = grayscale_ ? 1 : 0; c < (grayscale_ ? 2 : 3); ++c) {
+    if (sparse_ac_ != nullptr) {
+      const float* const PIK_RESTRICT muls = &kDequantMatrix[c * kBlockSize];
+      float* const PIK_RESTRICT cur_block = &block[c * kBlockSize];
+      memset(cur_block, 0, kBlockSize * sizeof(cur_block[0]));
+      cur_block[0] = row[c][block_x] * (muls[0] * inv_quant_dc);
+      const int16_t* PIK_RESTRICT values = sparse_ac_->Values(block_x, block_y,
+                                                              c);
+      for (uint64_t mask = sparse_ac_->Mask(block_x, block_y, c); mask != 0;
+           mask &= mask - 1) {
+        const int k = PIK_TZCNT64(mask);
+        cur_block[k] = *values++ * (muls[k] * inv_quant_ac);
+      }
+      continue;
+    }
+    const int16_t* const PIK_RESTRICT iblock =
+        tiled_block != nullptr ? tiled_block + c * kBlockSize
+                               : &row[c][offset];
     const float* const PIK_RESTRICT muls = &kDequantMatrix[c * kBlockSize];
     float* const PIK_RESTRICT cur_block = &block[c * kBlockSize];
-    for (int k = 0; k < kBlockSize; ++k) {
-      cur_block[k] = iblock[k] * (muls[k] * inv_quant_ac);
-    }
-    cur_block[0] = iblock[0] * (muls[0] * inv_quant_dc);
+    kernels().dequantize(iblock, muls, inv_quant_ac, cur_block);
+    cur_block[0] = row[c][dc_offset] * (muls[0] * inv_quant_dc);
   }
-  using V = vec<float>;
-  constexpr size_t N = NumLanes<V>();
-  const float kYToBAC = YToBAC(tile_x, tile_y);
-  const V vYToBAC = set1(V(), kYToBAC);
-  for (int k = 0; k < kBlockSize; k += N) {
-    const V y = load(V(), block + k + kBlockSize);
-    const V b = mul_add(vYToBAC, y, load(V(), block + k + kBlockSize2));
-    store(b, block + k + kBlockSize2);
+  if (!grayscale_) {
+    const float kYToBAC = YToBAC(tile_x, tile_y);
+    kernels().add_scaled(block + kBlockSize, kYToBAC, block + kBlockSize2);
+    block[kBlockSize2] += (YToBDC() - kYToBAC) * block[kBlockSize];
   }
-  block[kBlockSize2] += (YToBDC() - kYToBAC) * block[kBlockSize];
   block[kBlockSize + 3] += kACPred31 * block[kBlockSize + 1];
   block[kBlockSize + 24] += kACPred31 * block[kBlockSize + 8];
 }
 
+void CompressedImage::DequantizeDC(const int block_x, const int block_y,
+                                   float* const PIK_RESTRICT dc) const {
+  PIK_ASSERT(nonzero_ac_.Row(block_y)[block_x] == 0);
+  auto row = dct_coeffs_.Row(block_y);
+  const int offset = block_x * DCStride();
+  const float inv_quant_dc = quantizer_.inv_quant_dc();
+  const float* PIK_RESTRICT kDequantMatrix = DequantMatrix();
+  for (int c = 0; c < 3; ++c) {
+    dc[c] = row[c][offset] * (kDequantMatrix[c * kBlockSize] * inv_quant_dc);
+  }
+  if (grayscale_) return;
+  // Same order of operations as DequantizeBlock.
+  const float kYToBAC = YToBAC(block_x / kTileToBlockRatio,
+                               block_y / kTileToBlockRatio);
+  dc[2] += kYToBAC * dc[1];
+  dc[2] += (YToBDC() - kYToBAC) * dc[1];
+}
+
 namespace {
 
 void ColorTransformOpsinToSrgb(const float* const PIK_RESTRICT block,
-                               int block_x, int block_y,
+                               const bool gray, int block_x, int block_y,
                                Image3B* const PIK_RESTRICT srgb) {
-  using namespace SIMD_NAMESPACE;
+  PROFILER_FUNC;
   const uint8_t* lut_plus = LinearToSrgb8TablePlusQuarter();
   const uint8_t* lut_minus = LinearToSrgb8TableMinusQuarter();
   // TODO(user) Combine these two for loops and get rid of rgb[].
-  SIMD_ALIGN int rgb[kBlockSize3];
-  using V = vec<float>;
-  constexpr size_t N = NumLanes<V>();
-  for (int k = 0; k < kBlockSize; k += N) {
-    const V x = load(V(), block + k) + set1(V(), kXybCenter[0]);
-    const V y = load(V(), block + k + kBlockSize) + set1(V(), kXybCenter[1]);
-    const V b = load(V(), block + k + kBlockSize2) + set1(V(), kXybCenter[2]);
-    const V lut_scale = set1(V(), 16.0f);
-    V out_r, out_g, out_b;
-    XybToRgb(x, y, b, &out_r, &out_g, &out_b);
-    store(i32_from_f32(out_r * lut_scale), rgb + k);
-    store(i32_from_f32(out_g * lut_scale), rgb + k + kBlockSize);
-    store(i32_from_f32(out_b * lut_scale), rgb + k + kBlockSize2);
-  }
+  SIMD_ALIGN int32_t rgb[kBlockSize3];
+  kernels().opsin_to_srgb8_lut_indices(block, gray, rgb);
   const int yoff = kBlockEdge * block_y;
   const int xoff = kBlockEdge * block_x;
   for (int iy = 0; iy < kBlockEdge; ++iy) {
@@ -739,64 +1517,106 @@ void ColorTransformOpsinToSrgb(const float* const PIK_RESTRICT block,
   }
 }
 
+// Same as above for the pixels [ix0, ix1) x [iy0, iy1) of the block, written
+// interleaved with "num_channels" bytes per pixel (the fourth, if any, is
+// opaque alpha), in BGR order if "bgr". A single channel is the gray level of
+// a "gray" block. "out" receives pixel (ix0, iy0).
+void ColorTransformOpsinToSrgbInterleaved(
+    const float* const PIK_RESTRICT block, const bool gray, const int ix0,
+    const int ix1, const int iy0, const int iy1, const int num_channels,
+    const bool bgr, uint8_t* const PIK_RESTRICT out, const size_t stride) {
+  PROFILER_FUNC;
+  const uint8_t* lut_plus = LinearToSrgb8TablePlusQuarter();
+  const uint8_t* lut_minus = LinearToSrgb8TableMinusQuarter();
+  SIMD_ALIGN int32_t rgb[kBlockSize3];
+  kernels().opsin_to_srgb8_lut_indices(block, gray, rgb);
+  if (num_channels == 1) {
+    for (int iy = iy0; iy < iy1; ++iy) {
+      uint8_t* PIK_RESTRICT row = out + (iy - iy0) * stride;
+      for (int ix = ix0; ix < ix1; ++ix) {
+        const uint8_t* lut = (ix + iy) % 2 ? lut_plus : lut_minus;
+        row[ix - ix0] = lut[rgb[kBlockEdge * iy + ix + kBlockSize]];
+      }
+    }
+    return;
+  }
+  const int r = bgr ? 2 : 0;
+  const int b = 2 - r;
+  for (int iy = iy0; iy < iy1; ++iy) {
+    uint8_t* PIK_RESTRICT pixel = out + (iy - iy0) * stride;
+    for (int ix = ix0; ix < ix1; ++ix, pixel += num_channels) {
+      const int k = kBlockEdge * iy + ix;
+      const uint8_t* lut = (ix + iy) % 2 ? lut_plus : lut_minus;
+      pixel[r] = lut[rgb[k + 0]];
+      pixel[1] = lut[rgb[k + kBlockSize]];
+      pixel[b] = lut[rgb[k + kBlockSize2]];
+      if (num_channels == 4) {
+        pixel[3] = 255;
+      }
+    }
+  }
+}
+
+// 16-bit version of the above; "stride" is in bytes and the alpha, if any, is
+// 65535.
+void ColorTransformOpsinToSrgbInterleaved(
+    const float* const PIK_RESTRICT block, const bool gray, const int ix0,
+    const int ix1, const int iy0, const int iy1, const int num_channels,
+    const bool bgr, uint16_t* const PIK_RESTRICT out, const size_t stride) {
+  PROFILER_FUNC;
+  SIMD_ALIGN uint16_t rgb[kBlockSize3];
+  kernels().opsin_to_srgb16(block, gray, rgb);
+  if (num_channels == 1) {
+    for (int iy = iy0; iy < iy1; ++iy) {
+      uint16_t* PIK_RESTRICT row = reinterpret_cast<uint16_t*>(
+          reinterpret_cast<uint8_t*>(out) + (iy - iy0) * stride);
+      for (int ix = ix0; ix < ix1; ++ix) {
+        row[ix - ix0] = rgb[kBlockEdge * iy + ix + kBlockSize];
+      }
+    }
+    return;
+  }
+  const int r = bgr ? 2 : 0;
+  const int b = 2 - r;
+  for (int iy = iy0; iy < iy1; ++iy) {
+    uint16_t* PIK_RESTRICT pixel = reinterpret_cast<uint16_t*>(
+        reinterpret_cast<uint8_t*>(out) + (iy - iy0) * stride);
+    for (int ix = ix0; ix < ix1; ++ix, pixel += num_channels) {
+      const int k = kBlockEdge * iy + ix;
+      pixel[r] = rgb[k + 0];
+      pixel[1] = rgb[k + kBlockSize];
+      pixel[b] = rgb[k + kBlockSize2];
+      if (num_channels == 4) {
+        pixel[3] = 65535;
+      }
+    }
+  }
+}
+
 void ColorTransformOpsinToSrgb(const float* const PIK_RESTRICT block,
-                               int block_x, int block_y,
+                               const bool gray, int block_x, int block_y,
                                Image3U* const PIK_RESTRICT srgb) {
-  using namespace SIMD_NAMESPACE;
-  using V = vec<float>;
-  constexpr size_t N = NumLanes<V>();
-  const V scale_to_16bit = set1(V(), 257.0f);
-
-  int k = 0;  // index within 8x8 block (we access 3 consecutive blocks)
+  PROFILER_FUNC;
+  SIMD_ALIGN uint16_t rgb[kBlockSize3];
+  kernels().opsin_to_srgb16(block, gray, rgb);
   const int yoff = kBlockEdge * block_y;
   const int xoff = kBlockEdge * block_x;
-  for (int iy = 0; iy < kBlockEdge; ++iy) {
-    uint16_t* PIK_RESTRICT row0 = srgb->PlaneRow(0, iy + yoff);
-    uint16_t* PIK_RESTRICT row1 = srgb->PlaneRow(1, iy + yoff);
-    uint16_t* PIK_RESTRICT row2 = srgb->PlaneRow(2, iy + yoff);
-    for (int ix = 0; ix < kBlockEdge; ix += N) {
-      const V x = load(V(), block + k) + set1(V(), kXybCenter[0]);
-      const V y = load(V(), block + k + kBlockSize) + set1(V(), kXybCenter[1]);
-      const V b = load(V(), block + k + kBlockSize2) + set1(V(), kXybCenter[2]);
-      k += N;
-      V out_r, out_g, out_b;
-      XybToRgb(x, y, b, &out_r, &out_g, &out_b);
-
-      out_r = LinearToSrgbPoly(out_r) * scale_to_16bit;
-      out_g = LinearToSrgbPoly(out_g) * scale_to_16bit;
-      out_b = LinearToSrgbPoly(out_b) * scale_to_16bit;
-
-      // Half-vectors of half-width lanes.
-      const auto u16_r = convert_to(uint16_t(), i32_from_f32(out_r));
-      const auto u16_g = convert_to(uint16_t(), i32_from_f32(out_g));
-      const auto u16_b = convert_to(uint16_t(), i32_from_f32(out_b));
-
-      const int px = ix + xoff;
-      store(u16_r, row0 + px);
-      store(u16_g, row1 + px);
-      store(u16_b, row2 + px);
+  for (int c = 0; c < 3; ++c) {
+    for (int iy = 0; iy < kBlockEdge; ++iy) {
+      memcpy(srgb->PlaneRow(c, iy + yoff) + xoff,
+             &rgb[c * kBlockSize + iy * kBlockEdge],
+             kBlockEdge * sizeof(rgb[0]));
     }
   }
 }
 
 void ColorTransformOpsinToSrgb(const float* const PIK_RESTRICT block,
-                               int block_x, int block_y,
+                               const bool gray, int block_x, int block_y,
                                Image3F* const PIK_RESTRICT srgb) {
-  using namespace SIMD_NAMESPACE;
+  PROFILER_FUNC;
   // TODO(user) Combine these two for loops and get rid of rgb[].
   SIMD_ALIGN float rgb[kBlockSize3];
-  using V = vec<float>;
-  constexpr size_t N = NumLanes<V>();
-  for (int k = 0; k < kBlockSize; k += N) {
-    const V x = load(V(), block + k) + set1(V(), kXybCenter[0]);
-    const V y = load(V(), block + k + kBlockSize) + set1(V(), kXybCenter[1]);
-    const V b = load(V(), block + k + kBlockSize2) + set1(V(), kXybCenter[2]);
-    V out_r, out_g, out_b;
-    XybToRgb(x, y, b, &out_r, &out_g, &out_b);
-    store(out_r, rgb + k);
-    store(out_g, rgb + k + kBlockSize);
-    store(out_b, rgb + k + kBlockSize2);
-  }
+  kernels().opsin_to_linear(block, gray, rgb);
   const int yoff = kBlockEdge * block_y;
   const int xoff = kBlockEdge * block_x;
   for (int iy = 0; iy < kBlockEdge; ++iy) {
@@ -813,39 +1633,187 @@ void ColorTransformOpsinToSrgb(const float* const PIK_RESTRICT block,
 
 }  // namespace
 
+// Reconstructs the opsin-space pixels of a block from its coefficients and
+// the blurred DC of its neighbors.
+class BlockReconstructor {
+ public:
+  explicit BlockReconstructor(const CompressedImage& img)
+      : img_(img),
+        blur_(img.coeffs(), img.block_xsize(), img.quantizer().inv_quant_dc(),
+              img.YToBDC()),
+        c0_(img.grayscale() ? 1 : 0),
+        c1_(img.grayscale() ? 2 : 3) {}
+
+  // Returns storage for BeginRow() of up to "num_blocks" blocks.
+  static Image3F AllocateBlurRows(const int num_blocks) {
+    return DCBlur::AllocateRows(num_blocks);
+  }
+
+  // Must be called before Reconstruct() of blocks [bx0, bx1) of block row
+  // "by", with the same "blur_x".
+  void BeginRow(const int by, const int bx0, const int bx1,
+                Image3F* PIK_RESTRICT blur_x) const {
+    PROFILER_ZONE("DC blur");
+    blur_.ComputeRows(by, bx0, bx1, blur_x);
+  }
+
+  // Same as Reconstruct, but writes the (kBlockEdge / factor)^2 pixels of
+  // each channel of the block downsampled by "factor" to "block_out", which
+  // has the same size.
+  void ReconstructScaled(const int bx, const int by, const int bx0,
+                         const int factor, const Image3F& blur_x,
+                         float* const PIK_RESTRICT block_out) const {
+    const int edge = kBlockEdge / factor;
+    const int pixels = edge * edge;
+    if (img_.nonzero_ac().ConstRow(by)[bx] == 0) {
+      float dc[3];
+      img_.DequantizeDC(bx, by, dc);
+      const float* const PIK_RESTRICT basis = ReducedIDCTBasis(edge);
+      for (int c = c0_; c < c1_; ++c) {
+        const float val = basis[0] * (basis[0] * dc[c]);
+        std::fill(&block_out[pixels * c], &block_out[pixels * (c + 1)], val);
+      }
+    } else {
+      PROFILER_ZONE("IDCT");
+      SIMD_ALIGN float block[kBlockSize3];
+      img_.DequantizeBlock(bx, by, block);
+      for (int c = c0_; c < c1_; ++c) {
+        ComputeReducedBlockIDCT(&block[kBlockSize * c], edge,
+                                &block_out[pixels * c]);
+      }
+    }
+    PROFILER_ZONE("DC blur");
+    for (int c = c0_; c < c1_; ++c) {
+      float dc_blur[kBlockSize];
+      const float avg =
+          blur_.ComputeReducedBlock(blur_x, c, bx - bx0, edge, dc_blur);
+      for (int k = 0; k < pixels; ++k) {
+        block_out[pixels * c + k] += dc_blur[k] - avg;
+      }
+    }
+  }
+
+  void Reconstruct(const int bx, const int by, const int bx0,
+                   const Image3F& blur_x,
+                   float* const PIK_RESTRICT block_out) const {
+    if (img_.nonzero_ac().ConstRow(by)[bx] == 0) {
+      // Common in flat areas: the IDCT of a block with only a DC coefficient
+      // is constant and equal to it.
+      float dc[3];
+      img_.DequantizeDC(bx, by, dc);
+      for (int c = c0_; c < c1_; ++c) {
+        std::fill(&block_out[kBlockSize * c], &block_out[kBlockSize * (c + 1)],
+                  dc[c]);
+      }
+    } else {
+      PROFILER_ZONE("IDCT");
+      img_.DequantizeBlock(bx, by, block_out);
+      for (int c = c0_; c < c1_; ++c) {
+        ComputeTransposedScaledBlockIDCTFloat(&block_out[kBlockSize * c]);
+      }
+    }
+    PROFILER_ZONE("DC blur");
+    for (int c = c0_; c < c1_; ++c) {
+      SIMD_ALIGN float dc_blur[kBlockSize];
+      const float avg = blur_.ComputeBlock(blur_x, c, bx - bx0, dc_blur);
+      for (int k = 0; k < kBlockSize; ++k) {
+        block_out[kBlockSize * c + k] += dc_blur[k] - avg;
+      }
+    }
+  }
+
+ private:
+  const CompressedImage& img_;
+  const DCBlur blur_;
+  // Range of channels to reconstruct: only Y if grayscale.
+  const int c0_;
+  const int c1_;
+};
+
+// Returns the pixels of the rectangle [x0, x0 + xsize) x [y0, y0 + ysize).
+template <class Image3T>
+Image3T GetPixels(const CompressedImage& img, const int x0, const int y0,
+                  const int xsize, const int ysize) {
+  PROFILER_FUNC;
+  PIK_CHECK(x0 >= 0 && y0 >= 0 && xsize > 0 && ysize > 0);
+  PIK_CHECK(x0 + xsize <= img.xsize() && y0 + ysize <= img.ysize());
+  const int bx0 = x0 / kBlockEdge;
+  const int by0 = y0 / kBlockEdge;
+  const int bx1 = (x0 + xsize + kBlockEdge - 1) / kBlockEdge;
+  const int by1 = (y0 + ysize + kBlockEdge - 1) / kBlockEdge;
+  Image3T out((bx1 - bx0) * kBlockEdge, (by1 - by0) * kBlockEdge);
+  const BlockReconstructor reconstructor(img);
+  const int num_threads = img.pool() ? img.pool()->NumThreads() : 1;
+  std::vector<Image3F> blur_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    blur_rows.push_back(BlockReconstructor::AllocateBlurRows(bx1 - bx0));
+  }
+  // Blocks only write their own pixels, so block rows are independent.
+  RunOnPool(img.pool(), by0, by1, [&](const int by, const int thread) {
+    SIMD_ALIGN float block_out[kBlockSize3];
+    Image3F* blur_x = &blur_rows[thread];
+    reconstructor.BeginRow(by, bx0, bx1, blur_x);
+    for (int bx = bx0; bx < bx1; ++bx) {
+      reconstructor.Reconstruct(bx, by, bx0, *blur_x, block_out);
+      ColorTransformOpsinToSrgb(block_out, img.grayscale(), bx - bx0, by - by0,
+                                &out);
+    }
+  });
+  const int xoff = x0 - bx0 * kBlockEdge;
+  const int yoff = y0 - by0 * kBlockEdge;
+  if (xoff == 0 && yoff == 0) {
+    out.ShrinkTo(xsize, ysize);
+    return out;
+  }
+  Image3T cropped(xsize, ysize);
+  for (int c = 0; c < 3; ++c) {
+    for (int y = 0; y < ysize; ++y) {
+      memcpy(cropped.PlaneRow(c, y), out.ConstPlaneRow(c, y + yoff) + xoff,
+             xsize * sizeof(typename Image3T::T));
+    }
+  }
+  return cropped;
+}
+
 template <class Image3T>
 Image3T GetPixels(const CompressedImage& img) {
+  return GetPixels<Image3T>(img, 0, 0, img.xsize(), img.ysize());
+}
+
+template <typename T>
+bool GetPixelBands(const CompressedImage& img, Image3Sink<T>* sink) {
+  PROFILER_FUNC;
   const int block_xsize = img.block_xsize();
   const int block_ysize = img.block_ysize();
-  Image3T out(block_xsize * kBlockEdge, block_ysize * kBlockEdge);
-  const float inv_quant_dc = img.quantizer().inv_quant_dc();
-  Image3F dc_blur_x = ComputeDCBlurX(img.coeffs(), kDCBlurSigma, inv_quant_dc,
-                                     img.YToBDC(), DequantMatrix());
-  float w_up[kBlockSize] = { 0.0f };
-  float w_cur[kBlockSize] = { 0.0f };
-  float w_down[kBlockSize] = { 0.0f };
-  ComputeBlockBlurWeights(kDCBlurSigma, w_up, w_cur, w_down);
-  SIMD_ALIGN float block_out[kBlockSize3];
-  for (int by = 0; by < block_ysize; ++by) {
-    int by_u = block_ysize == 1 ? 0 : by == 0 ? 1 : by - 1;
-    int by_d = block_ysize == 1 ? 0 : by + 1 < block_ysize ? by + 1 : by - 1;
-    for (int bx = 0; bx < block_xsize; ++bx) {
-      img.DequantizeBlock(bx, by, block_out);
-      const int offsetx = bx * kBlockEdge;
-      for (int c = 0; c < 3; ++c) {
-        ComputeTransposedScaledBlockIDCTFloat(&block_out[kBlockSize * c]);
-        SIMD_ALIGN float dc_blur[kBlockSize];
-        float avg = ComputeBlurredBlock(dc_blur_x, c, offsetx, by_u, by, by_d,
-                                        w_up, w_cur, w_down, dc_blur);
-        for (int k = 0; k < kBlockSize; ++k) {
-          block_out[kBlockSize * c + k] += dc_blur[k] - avg;
-        }
+  if (!sink->Begin(img.xsize(), img.ysize())) return false;
+  // Reused for all bands; the last band may have fewer rows.
+  Image3<T> band(block_xsize * kBlockEdge, kTileEdge);
+  const BlockReconstructor reconstructor(img);
+  const int num_threads = img.pool() ? img.pool()->NumThreads() : 1;
+  std::vector<Image3F> blur_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    blur_rows.push_back(BlockReconstructor::AllocateBlurRows(block_xsize));
+  }
+  for (int band_by = 0; band_by < block_ysize; band_by += kTileToBlockRatio) {
+    const int num_block_rows =
+        std::min(kTileToBlockRatio, block_ysize - band_by);
+    RunOnPool(img.pool(), 0, num_block_rows,
+              [&](const int band_row, const int thread) {
+      SIMD_ALIGN float block_out[kBlockSize3];
+      const int by = band_by + band_row;
+      Image3F* blur_x = &blur_rows[thread];
+      reconstructor.BeginRow(by, 0, block_xsize, blur_x);
+      for (int bx = 0; bx < block_xsize; ++bx) {
+        reconstructor.Reconstruct(bx, by, 0, *blur_x, block_out);
+        ColorTransformOpsinToSrgb(block_out, img.grayscale(), bx, band_row,
+                                  &band);
       }
-      ColorTransformOpsinToSrgb(block_out, bx, by, &out);
-    }
+    });
+    const int y = band_by * kBlockEdge;
+    band.ShrinkTo(img.xsize(), std::min(kTileEdge, img.ysize() - y));
+    if (!sink->Band(y, band)) return false;
   }
-  out.ShrinkTo(img.xsize(), img.ysize());
-  return out;
+  return true;
 }
 
 Image3B CompressedImage::ToSRGB() const {
@@ -860,4 +1828,262 @@ Image3F CompressedImage::ToLinear() const {
   return GetPixels<Image3F>(*this);
 }
 
+Image3B CompressedImage::ToSRGB(int x0, int y0, int xsize, int ysize) const {
+  return GetPixels<Image3B>(*this, x0, y0, xsize, ysize);
+}
+
+Image3U CompressedImage::ToSRGB16(int x0, int y0, int xsize, int ysize) const {
+  return GetPixels<Image3U>(*this, x0, y0, xsize, ysize);
+}
+
+Image3F CompressedImage::ToLinear(int x0, int y0, int xsize, int ysize) const {
+  return GetPixels<Image3F>(*this, x0, y0, xsize, ysize);
+}
+
+namespace {
+
+// Implementation of ToSRGBInterleaved and ToSRGB16Interleaved; "stride" is in
+// bytes.
+template <typename T>
+void GetInterleavedPixels(const CompressedImage& img, const int x0,
+                          const int y0, const int xsize, const int ysize,
+                          const int num_channels, const bool bgr,
+                          T* const PIK_RESTRICT out, const size_t stride) {
+  PROFILER_FUNC;
+  PIK_CHECK(x0 >= 0 && y0 >= 0 && xsize > 0 && ysize > 0);
+  PIK_CHECK(x0 + xsize <= img.xsize() && y0 + ysize <= img.ysize());
+  PIK_CHECK(num_channels == 3 || num_channels == 4 ||
+            (num_channels == 1 && img.grayscale()));
+  PIK_CHECK(stride >= static_cast<size_t>(xsize) * num_channels * sizeof(T));
+  PIK_CHECK(stride % sizeof(T) == 0);
+  const int bx0 = x0 / kBlockEdge;
+  const int by0 = y0 / kBlockEdge;
+  const int bx1 = (x0 + xsize + kBlockEdge - 1) / kBlockEdge;
+  const int by1 = (y0 + ysize + kBlockEdge - 1) / kBlockEdge;
+  const BlockReconstructor reconstructor(img);
+  const int num_threads = img.pool() ? img.pool()->NumThreads() : 1;
+  std::vector<Image3F> blur_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    blur_rows.push_back(BlockReconstructor::AllocateBlurRows(bx1 - bx0));
+  }
+  // Blocks only write their own pixels, so block rows are independent.
+  RunOnPool(img.pool(), by0, by1, [&](const int by, const int thread) {
+    SIMD_ALIGN float block_out[kBlockSize3];
+    Image3F* blur_x = &blur_rows[thread];
+    reconstructor.BeginRow(by, bx0, bx1, blur_x);
+    const int block_y0 = by * kBlockEdge;
+    const int iy0 = std::max(0, y0 - block_y0);
+    const int iy1 = std::min(kBlockEdge, y0 + ysize - block_y0);
+    T* const PIK_RESTRICT row_out = reinterpret_cast<T*>(
+        reinterpret_cast<uint8_t*>(out) + (block_y0 + iy0 - y0) * stride);
+    for (int bx = bx0; bx < bx1; ++bx) {
+      const int block_x0 = bx * kBlockEdge;
+      const int ix0 = std::max(0, x0 - block_x0);
+      const int ix1 = std::min(kBlockEdge, x0 + xsize - block_x0);
+      reconstructor.Reconstruct(bx, by, bx0, *blur_x, block_out);
+      ColorTransformOpsinToSrgbInterleaved(
+          block_out, img.grayscale(), ix0, ix1, iy0, iy1, num_channels, bgr,
+          row_out + (block_x0 + ix0 - x0) * num_channels, stride);
+    }
+  });
+}
+
+}  // namespace
+
+void CompressedImage::ToSRGBInterleaved(const int x0, const int y0,
+                                        const int xsize, const int ysize,
+                                        const int num_channels, const bool bgr,
+                                        uint8_t* const PIK_RESTRICT out,
+                                        const size_t stride) const {
+  GetInterleavedPixels(*this, x0, y0, xsize, ysize, num_channels, bgr, out,
+                       stride);
+}
+
+void CompressedImage::ToSRGB16Interleaved(const int x0, const int y0,
+                                          const int xsize, const int ysize,
+                                          const int num_channels,
+                                          const bool bgr,
+                                          uint16_t* const PIK_RESTRICT out,
+                                          const size_t stride) const {
+  GetInterleavedPixels(*this, x0, y0, xsize, ysize, num_channels, bgr, out,
+                       stride);
+}
+
+Image3F CompressedImage::DCOpsin() const {
+  const float* const PIK_RESTRICT dequant_matrix = DequantMatrix();
+  const float inv_quant_dc = quantizer_.inv_quant_dc();
+  const float inv_scale[3] = {
+    dequant_matrix[0] * inv_quant_dc,
+    dequant_matrix[kBlockSize] * inv_quant_dc,
+    dequant_matrix[kBlockSize2] * inv_quant_dc
+  };
+  const float ytob_dc = YToBDC();
+  const int dc_stride = DCStride();
+  Image3F out(block_xsize_, block_ysize_);
+  for (int by = 0; by < block_ysize_; ++by) {
+    auto row_dc = dct_coeffs_.Row(by);
+    auto row_out = out.Row(by);
+    for (int bx = 0; bx < block_xsize_; ++bx) {
+      const int offset = bx * dc_stride;
+      const float y = row_dc[1][offset] * inv_scale[1];
+      if (grayscale_) {
+        row_out[1][bx] = y + kXybCenter[1];
+        row_out[0][bx] = kOpsinGrayX * row_out[1][bx];
+        row_out[2][bx] = row_out[1][bx];
+        continue;
+      }
+      row_out[0][bx] = row_dc[0][offset] * inv_scale[0] + kXybCenter[0];
+      row_out[1][bx] = y + kXybCenter[1];
+      row_out[2][bx] =
+          row_dc[2][offset] * inv_scale[2] + y * ytob_dc + kXybCenter[2];
+    }
+  }
+  return out;
+}
+
+Image3F CompressedImage::ScaledOpsin(const int factor) const {
+  PROFILER_FUNC;
+  PIK_CHECK(factor == 2 || factor == 4);
+  const int edge = kBlockEdge / factor;
+  const int pixels = edge * edge;
+  Image3F out(block_xsize_ * edge, block_ysize_ * edge);
+  const BlockReconstructor reconstructor(*this);
+  const int num_threads = pool_ == nullptr ? 1 : pool_->NumThreads();
+  std::vector<Image3F> blur_rows;
+  for (int i = 0; i < num_threads; ++i) {
+    blur_rows.push_back(BlockReconstructor::AllocateBlurRows(block_xsize_));
+  }
+  // Blocks only write their own pixels, so block rows are independent.
+  RunOnPool(pool_, 0, block_ysize_, [&](const int by, const int thread) {
+    float block_out[kBlockSize3];
+    Image3F* blur_x = &blur_rows[thread];
+    reconstructor.BeginRow(by, 0, block_xsize_, blur_x);
+    for (int bx = 0; bx < block_xsize_; ++bx) {
+      reconstructor.ReconstructScaled(bx, by, 0, factor, *blur_x, block_out);
+      for (int c = grayscale_ ? 1 : 0; c < (grayscale_ ? 2 : 3); ++c) {
+        for (int iy = 0; iy < edge; ++iy) {
+          float* const PIK_RESTRICT row_out =
+              out.PlaneRow(c, by * edge + iy) + bx * edge;
+          for (int ix = 0; ix < edge; ++ix) {
+            row_out[ix] =
+                block_out[pixels * c + iy * edge + ix] + kXybCenter[c];
+          }
+        }
+      }
+      if (!grayscale_) continue;
+      for (int iy = 0; iy < edge; ++iy) {
+        const int y = by * edge + iy;
+        const float* const PIK_RESTRICT row_y = out.PlaneRow(1, y) + bx * edge;
+        float* const PIK_RESTRICT row_x = out.PlaneRow(0, y) + bx * edge;
+        float* const PIK_RESTRICT row_b = out.PlaneRow(2, y) + bx * edge;
+        for (int ix = 0; ix < edge; ++ix) {
+          row_x[ix] = kOpsinGrayX * row_y[ix];
+          row_b[ix] = row_y[ix];
+        }
+      }
+    }
+  });
+  out.ShrinkTo(DivCeil(xsize_, factor), DivCeil(ysize_, factor));
+  return out;
+}
+
+namespace {
+
+Image3U Srgb16FromLinear(const Image3F& linear) {
+  Image3U out(linear.xsize(), linear.ysize());
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < linear.ysize(); ++y) {
+      const float* const PIK_RESTRICT row_in = linear.ConstPlaneRow(c, y);
+      uint16_t* const PIK_RESTRICT row_out = out.PlaneRow(c, y);
+      for (size_t x = 0; x < linear.xsize(); ++x) {
+        row_out[x] = static_cast<uint16_t>(
+            LinearToSrgb8Direct(row_in[x]) * 257.0f + 0.5f);
+      }
+    }
+  }
+  return out;
+}
+
+}  // namespace
+
+Image3B CompressedImage::DCToSRGB() const {
+  return OpsinDynamicsInverse(DCOpsin());
+}
+
+Image3U CompressedImage::DCToSRGB16() const {
+  return Srgb16FromLinear(DCToLinear());
+}
+
+Image3F CompressedImage::DCToLinear() const {
+  return LinearFromOpsin(DCOpsin());
+}
+
+Image3B CompressedImage::ScaledToSRGB(const int factor) const {
+  return OpsinDynamicsInverse(ScaledOpsin(factor));
+}
+
+Image3U CompressedImage::ScaledToSRGB16(const int factor) const {
+  return Srgb16FromLinear(ScaledToLinear(factor));
+}
+
+Image3F CompressedImage::ScaledToLinear(const int factor) const {
+  return LinearFromOpsin(ScaledOpsin(factor));
+}
+
+bool CompressedImage::ToSRGB(Image3SinkB* sink) const {
+  return GetPixelBands(*this, sink);
+}
+
+bool CompressedImage::ToSRGB16(Image3SinkU* sink) const {
+  return GetPixelBands(*this, sink);
+}
+
+bool CompressedImage::ToLinear(Image3SinkF* sink) const {
+  return GetPixelBands(*this, sink);
+}
+
+void CompressedImage::UpdateSRGB(const ImageB& dirty_blocks,
+                                 Image3B* srgb) const {
+  PROFILER_FUNC;
+  PIK_CHECK(dirty_blocks.xsize() == block_xsize_);
+  PIK_CHECK(dirty_blocks.ysize() == block_ysize_);
+  PIK_CHECK(srgb->xsize() == xsize_ && srgb->ysize() == ysize_);
+  const BlockReconstructor reconstructor(*this);
+  // srgb may end within a block, so convert into a whole block first.
+  const int num_threads = pool_ == nullptr ? 1 : pool_->NumThreads();
+  std::vector<Image3B> converted_blocks;
+  std::vector<Image3F> blur_rows;
+  converted_blocks.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    converted_blocks.emplace_back(kBlockEdge, kBlockEdge);
+    blur_rows.push_back(BlockReconstructor::AllocateBlurRows(block_xsize_));
+  }
+  RunOnPool(pool_, 0, block_ysize_, [&](const int by, const int thread) {
+    SIMD_ALIGN float block_out[kBlockSize3];
+    Image3B& converted = converted_blocks[thread];
+    Image3F* blur_x = &blur_rows[thread];
+    const uint8_t* const PIK_RESTRICT row_dirty = dirty_blocks.Row(by);
+    const int y0 = by * kBlockEdge;
+    const int num_rows = std::min(kBlockEdge, ysize_ - y0);
+    bool began_row = false;
+    for (int bx = 0; bx < block_xsize_; ++bx) {
+      if (row_dirty[bx] == 0) continue;
+      if (!began_row) {
+        reconstructor.BeginRow(by, 0, block_xsize_, blur_x);
+        began_row = true;
+      }
+      reconstructor.Reconstruct(bx, by, 0, *blur_x, block_out);
+      ColorTransformOpsinToSrgb(block_out, grayscale_, 0, 0, &converted);
+      const int x0 = bx * kBlockEdge;
+      const int num_pixels = std::min(kBlockEdge, xsize_ - x0);
+      for (int iy = 0; iy < num_rows; ++iy) {
+        for (int c = 0; c < 3; ++c) {
+          memcpy(srgb->PlaneRow(c, y0 + iy) + x0,
+                 converted.ConstPlaneRow(c, iy), num_pixels);
+        }
+      }
+    }
+  });
+}
+
 }  // namespace pik
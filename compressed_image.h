@@ -17,15 +17,19 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <functional>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "compiler_specific.h"
 #include "image.h"
 #include "opsin_codec.h"
+#include "padded_bytes.h"
 #include "pik_info.h"
 #include "quantizer.h"
+#include "thread_pool.h"
 
 namespace pik {
 
@@ -34,22 +38,49 @@ static const int kTileToBlockRatio = 8;
 static const int kBlockSize = kBlockEdge * kBlockEdge;
 static const int kTileEdge = kBlockEdge * kTileToBlockRatio;
 
+// Sizes [bytes] of the parts of an encoding before its AC coefficients, as
+// stored in the Index section.
+struct EncodedPartSizes {
+  size_t ytob = 0;   // global and per-tile Y to B correlation
+  size_t quant = 0;  // quantization field, zero if not stored
+  size_t dc = 0;
+};
+
 // Represents both the quantized and transformed original version of an image.
 // This class is used in both the encoder and decoder.
 class CompressedImage {
  public:
   // The image is in an undefined state until Decode or Quantize are called.
-  CompressedImage(int xsize, int ysize, PikInfo* info);
+  // "pool" is not owned and may be null, in which case all work is done on
+  // the calling thread.
+  CompressedImage(int xsize, int ysize, ThreadPool* pool, PikInfo* info);
 
   // Creates a compressed image from an opsin-dynamics image original.
   // The compressed image is in an undefined state until Quantize() is called.
-  static CompressedImage FromOpsinImage(const Image3F& opsin, PikInfo* info);
+  static CompressedImage FromOpsinImage(const Image3F& opsin, ThreadPool* pool,
+                                        PikInfo* info);
+  // Same as above, but converts "opsin" in place (without a copy) and keeps
+  // its planes.
+  static CompressedImage FromOpsinImage(Image3F&& opsin, ThreadPool* pool,
+                                        PikInfo* info);
+
+  // Returns an image that shares the opsin image of *this (which must have
+  // been constructed with FromOpsinImage) and copies its settings and
+  // Y-to-blue values, but not the quantization. For evaluating alternative
+  // quantizations concurrently, e.g. with a null "pool" on worker threads.
+  // "info" (may be null) receives the statistics of its Encode().
+  CompressedImage CloneForSearch(ThreadPool* pool,
+                                 PikInfo* info = nullptr) const;
 
   // Replaces *this with a compressed image from the bitstream.
   // Sets *compressed_size to the number of bytes read from the data buffer.
   bool Decode(const uint8_t* data, const size_t data_size,
               size_t* compressed_size);
 
+  // Same as Decode, but stops after the DC coefficients. Only the DC* pixel
+  // accessors may be used afterwards.
+  bool DecodeDC(const uint8_t* data, const size_t data_size);
+
   int xsize() const { return xsize_; }
   int ysize() const { return ysize_; }
   int block_xsize() const { return block_xsize_; }
@@ -57,14 +88,142 @@ class CompressedImage {
   int tile_xsize() const { return tile_xsize_; }
   int tile_ysize() const { return tile_ysize_; }
 
+  ThreadPool* pool() const { return pool_; }
+
+  // Whether Encode()/Decode() use the AC group layout (Header::kACGroups).
+  void SetACGroups(bool ac_groups) { ac_groups_ = ac_groups; }
+  bool ac_groups() const { return ac_groups_; }
+
+  // Whether Encode()/Decode() code AC with interleaved ANS states
+  // (Header::kInterleavedANS).
+  void SetInterleavedANS(bool interleaved) {
+    num_ans_states_ = interleaved ? kNumInterleavedANSStates : 1;
+  }
+
+  // Whether Encode()/EncodeFast()/Decode() allow referencing built-in AC
+  // histograms (Header::kStaticACCodes). Ignored with the AC group layout.
+  void SetStaticACCodes(bool static_codes) { static_ac_codes_ = static_codes; }
+  bool static_ac_codes() const { return static_ac_codes_; }
+
+  // Whether Encode()/EncodeFast()/Decode() code AC in kNaturalCoeffOrder
+  // without transmitting it (Header::kNaturalCoeffOrder), which saves the
+  // order and the pass over all coefficients that computes it.
+  void SetNaturalCoeffOrder(bool natural) { natural_coeff_order_ = natural; }
+  bool natural_coeff_order() const { return natural_coeff_order_; }
+
+  // Recomputes the AC coefficient order from the current coefficients. The
+  // first Encode() computes it and later ones reuse it, because the encoder
+  // searches encode similar coefficients repeatedly; a stale order only costs
+  // a little compression, not correctness.
+  void UpdateCoeffOrder();
+
+  // Whether Encode() clusters the AC histograms with FastClusterHistograms.
+  // Does not affect the bitstream format.
+  void SetFastClustering(bool fast) { fast_clustering_ = fast; }
+
+  // Whether EstimateEncodedSize and the encoder searches that rank candidates
+  // by size use HistogramBuilder::EstimatedSize instead of EncodedSize.
+  void SetFastSizeEstimates(bool fast) { fast_size_estimates_ = fast; }
+  bool fast_size_estimates() const { return fast_size_estimates_; }
+
+  // Whether the image is gray (Header::num_components == 1): Quantize*() only
+  // transforms and quantizes the Y channel and sets the X and B coefficients
+  // to zero, and the pixel accessors only reconstruct Y and output gray
+  // pixels (R = G = B, see YToGray), ignoring the X and B coefficients. The
+  // opsin image must be gray (OpsinDynamicsGrayImage).
+  void SetGrayscale(bool gray) { grayscale_ = gray; }
+  bool grayscale() const { return grayscale_; }
+
+  // Restricts Decode() to the AC coefficients of block rows
+  // [block_y_begin, block_y_end), if the AC group layout allows skipping the
+  // others. Only pixels of those block rows may then be requested.
+  void SetDecodeBlockRows(const int block_y_begin, const int block_y_end) {
+    decode_block_y_begin_ = block_y_begin;
+    decode_block_y_end_ = block_y_end;
+  }
+
+  // Makes Decode()/DecodeDC() build their entropy decoding tables in "tables"
+  // (not owned, may be null), e.g. to reuse their memory for several images.
+  void SetDecoderTables(DecoderTables* tables) { decoder_tables_ = tables; }
+
+  // Makes Decode() decode AC with "tables" (not owned) instead, which then
+  // keep the AC codes for the next frame of an animation (kPreviousACCodes).
+  void SetACDecoderTables(DecoderTables* tables) { ac_tables_ = tables; }
+
+  // Makes Encode() also consider the AC codes "previous" (may be null) of the
+  // previous frame, whose tables the decoder still has, and store the codes it
+  // used in "used" (may be null or equal to "previous"). Requires
+  // SetStaticACCodes(true). Neither is owned.
+  void SetACCodes(const ACCodes* previous, ACCodes* used) {
+    previous_ac_codes_ = previous;
+    used_ac_codes_ = used;
+  }
+
+  // Copies the quant field and Y-to-blue values of "previous", the previous
+  // frame of the same size, and makes Encode*() omit the quant field and
+  // Decode*() keep it (Frame::kPreviousQuantField). The encoder must call
+  // Quantize*() afterwards.
+  void UsePreviousQuantField(const CompressedImage& previous);
+
+  // Makes Decode() store the AC coefficients in a SparseAC and only the DC
+  // coefficients (one per block) in a coefficient image, which needs far less
+  // memory. Must be called before Decode()/DecodeDC(); afterwards, coeffs(),
+  // Encode*() and Quantize*() may no longer be used.
+  void SetSparseAC(bool sparse);
+
+  // Makes Decode() store the AC coefficients in a TiledAC and only the DC
+  // coefficients in a coefficient image, so that the reconstruction reads the
+  // three channels of each block from consecutive memory, which makes
+  // decoding about 5% faster. Same output and restrictions as SetSparseAC,
+  // which it replaces; SetTiledAC(false) keeps a previous SetSparseAC(true).
+  // The encoder passes keep the coefficient image rows.
+  void SetTiledAC(bool tiled);
+
   Quantizer& quantizer() { return quantizer_; }
   const Quantizer& quantizer() const { return quantizer_; }
 
   void QuantizeBlock(int block_x, int block_y);
   void Quantize();
 
+  // Same as Quantize(), but only re-quantizes the blocks whose entry in
+  // "dirty_blocks" (one per block) is non-zero. Requires a previous Quantize()
+  // with the same global scale and DC quantization, so that the DC
+  // coefficients and the overlay are still valid.
+  void QuantizeDirtyBlocks(const ImageB& dirty_blocks);
+
+  // Same result as Quantize(), but only re-quantizes the blocks whose
+  // quantization changed since the last Quantize*() (see Quantizer::
+  // dirty_cells), unless the DC coefficients or overlay also changed, i.e.
+  // the global scale, DC quantization or Y-to-blue correlation. Much faster
+  // in late search iterations, which only change a few blocks.
+  void QuantizeDirty();
+
+  // Same as FromOpsinImage(opsin) followed by Quantize(), for an image
+  // constructed with the dimensions of "opsin" and whose quantizer is already
+  // set up. Streams over stripes of kBlockEdge rows instead of storing the
+  // padded opsin image and the overlay, hence QuantizeBlock() and Quantize()
+  // may not be called afterwards.
+  void QuantizeOpsinImage(const Image3F& opsin);
+
+  // Writes row "y" of the opsin image (xsize() floats per channel).
+  using OpsinRowFunc =
+      std::function<void(int y, float* row_x, float* row_y, float* row_b)>;
+
+  // Same as above, but requests each row of the opsin image from "opsin_row"
+  // when it is needed (twice per row, possibly concurrently), so that the
+  // opsin image need not be stored at all.
+  void QuantizeOpsinImage(const OpsinRowFunc& opsin_row);
+
+  // Same as above, but requests each row exactly once and in order, e.g.
+  // from a decoder that produces them sequentially. Only one block row is
+  // quantized at a time, concurrently with the requests for the next one.
+  void QuantizeOpsinRowsInOrder(const OpsinRowFunc& opsin_row);
+
   void DequantizeBlock(const int block_x, const int block_y,
                        float* const PIK_RESTRICT block) const;
+  // Same as DequantizeBlock for a block whose nonzero_ac() entry is zero, but
+  // only writes its three DC coefficients to "dc". Their IDCT is constant.
+  void DequantizeDC(int block_x, int block_y, float* PIK_RESTRICT dc) const;
 
   AdaptiveQuantParams adaptive_quant_params() const {
     AdaptiveQuantParams p;
@@ -81,22 +240,143 @@ class CompressedImage {
   // Returns the image as linear (gamma expanded) sRGB
   Image3F ToLinear() const;
 
+  // Same as above, but only reconstructs the blocks overlapping the rectangle
+  // [x0, x0 + xsize) x [y0, y0 + ysize), which must lie within the image.
+  Image3B ToSRGB(int x0, int y0, int xsize, int ysize) const;
+  Image3U ToSRGB16(int x0, int y0, int xsize, int ysize) const;
+  Image3F ToLinear(int x0, int y0, int xsize, int ysize) const;
+
+  // Same as ToSRGB(x0, y0, xsize, ysize), but writes the pixels interleaved
+  // to "out", "num_channels" bytes per pixel (3 for RGB or 4 for RGBA with
+  // opaque alpha; BGR or BGRA if "bgr"; 1 for the gray level if grayscale())
+  // and "stride" bytes per row. Each block is converted right after its
+  // reconstruction, without intermediate planar images.
+  void ToSRGBInterleaved(int x0, int y0, int xsize, int ysize,
+                         int num_channels, bool bgr, uint8_t* out,
+                         size_t stride) const;
+  // Same as above with 16-bit samples; "stride" is still in bytes.
+  void ToSRGB16Interleaved(int x0, int y0, int xsize, int ysize,
+                           int num_channels, bool bgr, uint16_t* out,
+                           size_t stride) const;
+
+  // Returns a preview with one pixel per block (the block average), computed
+  // from only the DC coefficients.
+  Image3B DCToSRGB() const;
+  Image3U DCToSRGB16() const;
+  Image3F DCToLinear() const;
+
+  // Returns the image downsampled by "factor" (2 or 4) in each direction, with
+  // the dimensions rounded up. Each block is reconstructed by a reduced
+  // (kBlockEdge / factor)-point IDCT of its lowest-frequency coefficients, and
+  // the DC blur is evaluated on the same reduced grid. Requires Decode().
+  Image3B ScaledToSRGB(int factor) const;
+  Image3U ScaledToSRGB16(int factor) const;
+  Image3F ScaledToLinear(int factor) const;
+
+  // Same as above, but passes the pixels to "sink" in bands of kTileEdge rows
+  // so that only one band needs to be stored. Returns false if the sink does.
+  bool ToSRGB(Image3SinkB* sink) const;
+  bool ToSRGB16(Image3SinkU* sink) const;
+  bool ToLinear(Image3SinkF* sink) const;
+
+  // Re-decodes only the blocks whose entry in "dirty_blocks" (one per block)
+  // is non-zero into "srgb", which must be the result of a previous ToSRGB().
+  // Each block only depends on its own coefficients and the DC of its
+  // neighbors, hence the result equals ToSRGB() as long as the DC coefficients
+  // and the coefficients of all non-dirty blocks did not change in between.
+  void UpdateSRGB(const ImageB& dirty_blocks, Image3B* srgb) const;
+
   const Image3W& coeffs() const { return dct_coeffs_; }
 
+  // One entry per block, in which bit c is set if channel c may have non-zero
+  // AC coefficients. Quantize*() and Decode() clear the bits of channels whose
+  // AC coefficients are all zero; until then, all bits are set.
+  const ImageB& nonzero_ac() const { return nonzero_ac_; }
+
   // Returns a lossless encoding of the quantized coefficients.
   std::string Encode() const;
   std::string EncodeFast() const;
 
+  // Same as above, but appends the encoding to "out", which is resized only
+  // once and whose previous bytes are not copied unless it must grow. The
+  // padding to a multiple of 4 bytes is relative to the previous end of "out".
+  void Encode(PaddedBytes* out) const;
+  void EncodeFast(PaddedBytes* out) const;
+
+  // Same as above, but passes each part of the encoding to "sink" as soon as
+  // it is encoded, i.e. the Y to B, quantization and DC parts before the AC
+  // coefficients are encoded. Returns false if the sink failed.
+  bool Encode(ByteSink* sink) const;
+  bool EncodeFast(ByteSink* sink) const;
+
+  // Returns the part sizes of the last Encode*() output.
+  const EncodedPartSizes& encoded_part_sizes() const { return part_sizes_; }
+
+  // Returns an estimate of the size of Encode() from the histograms of the
+  // quantized coefficients, without entropy-coding them. Much cheaper than
+  // Encode; typically within a few percent of its size.
+  size_t EstimateEncodedSize() const;
+
+  // The part of EstimateEncodedSize for the DC and AC coefficients. The first
+  // call after Quantize() counts all coefficients; afterwards,
+  // QuantizeDirty() and QuantizeDirtyBlocks() update the counts of the
+  // changed blocks, hence repeated calls during a search are cheap.
+  size_t EstimatedCoeffSize() const;
+
   // Getters and setters for adaptive Y-to-blue correlation.
   // (Clang generates a floating-point multiply.)
   float YToBDC() const { return ytob_dc_ / 128.0f; }
   float YToBAC(int tx, int ty) const { return ytob_ac_.Row(ty)[tx] / 128.0f; }
-  void SetYToBDC(int ytob) { ytob_dc_ = ytob; }
-  void SetYToBAC(int tx, int ty, int val) { ytob_ac_.Row(ty)[tx] = val; }
+  void SetYToBDC(int ytob) {
+    ytob_dc_ = ytob;
+    requantize_all_ = true;
+    rate_tracker_.reset();
+  }
+  void SetYToBAC(int tx, int ty, int val) {
+    ytob_ac_.Row(ty)[tx] = val;
+    requantize_all_ = true;
+    rate_tracker_.reset();
+  }
 
  private:
+  // Pointers to the kBlockEdge rows of each channel of a block row, with the
+  // layout of opsin_image_.
+  using OpsinRows = const float* [3][kBlockEdge];
+
+  void OpsinStripe(int block_y, OpsinRows rows) const;
   void QuantizeDC();
+  void QuantizeDCRow(int block_y, const OpsinRows rows);
   void ComputeOpsinOverlay();
+  // Same as QuantizeBlock() for all blocks of a block row, given its pixels
+  // and overlay (may be null); transforms eight blocks at a time.
+  void QuantizeBlockRow(int block_y, const OpsinRows rows,
+                        const float* overlay);
+  // Quantizes the transformed (overlay-subtracted) opsin "block", one DCT per
+  // channel, of which the X and Y parts are modified.
+  void QuantizeTransformedBlock(int block_x, int block_y, float* block);
+  bool DecodeUpToDC(BitReader* br);
+  // Decodes the AC coefficients after DecodeUpToDC into "ac", the coefficient
+  // image, SparseAC or TiledAC. The remaining arguments are those of Decode().
+  template <class AC>
+  bool DecodeACTo(BitReader* br, const uint8_t* data, size_t data_size,
+                  AC* ac, size_t* compressed_size);
+  // Passes the sections of Encode()/EncodeFast() to "emit" in order as soon as
+  // each is encoded; they are to be concatenated and padded to a multiple of
+  // 4 bytes.
+  using SectionFunc = std::function<void(std::string&&)>;
+  void EncodeSections(const SectionFunc& emit) const;
+  void EncodeFastSections(const SectionFunc& emit) const;
+  // Returns the coefficient order for EncodeAC, computed on the first call, or
+  // null if natural_coeff_order_.
+  const int* CoeffOrder() const;
+  // Returns the dequantized DC coefficients in opsin space, one per block.
+  Image3F DCOpsin() const;
+  // Returns the opsin-space pixels downsampled by "factor" (see
+  // ScaledToSRGB), including kXybCenter.
+  Image3F ScaledOpsin(int factor) const;
+  // Distance between the DC coefficients of horizontally adjacent blocks in
+  // dct_coeffs_.
+  int DCStride() const { return dct_coeffs_.xsize() / block_xsize_; }
 
   const int xsize_;
   const int ysize_;
@@ -107,14 +387,52 @@ class CompressedImage {
   const int num_blocks_;
   Quantizer quantizer_;
   Image3W dct_coeffs_;
+  // If non-null, holds the AC coefficients instead of dct_coeffs_, which then
+  // only has the DC coefficients.
+  std::unique_ptr<SparseAC> sparse_ac_;
+  // Same for the tile-major layout; at most one of them is non-null.
+  std::unique_ptr<TiledAC> tiled_ac_;
+  // See nonzero_ac().
+  ImageB nonzero_ac_;
   // Transformed version of the original image, only present if the image
-  // was constructed with FromOpsinImage().
-  std::unique_ptr<Image3F> opsin_image_;
+  // was constructed with FromOpsinImage(). Padded to whole blocks, except that
+  // the bottom rows may be missing, in which case they equal the last row.
+  // Shared with the CloneForSearch copies, which only read it.
+  std::shared_ptr<Image3F> opsin_image_;
   // Pixel space overlay image computed from quantized dct coefficients in
   // both the encoder and the decoder.
   std::unique_ptr<ImageF> opsin_overlay_;
   int ytob_dc_;
   Image<int> ytob_ac_;
+  // Whether QuantizeDirty must re-quantize all blocks, i.e. no Quantize()
+  // since the construction or the last change of the Y-to-blue correlation.
+  bool requantize_all_ = true;
+  // Histograms of the current coefficients (see EstimatedCoeffSize), or null
+  // if they have yet to be counted.
+  mutable std::unique_ptr<CoeffRateTracker> rate_tracker_;
+  bool ac_groups_ = false;
+  int num_ans_states_ = 1;
+  bool fast_clustering_ = false;
+  bool fast_size_estimates_ = false;
+  bool static_ac_codes_ = false;
+  bool natural_coeff_order_ = false;
+  bool grayscale_ = false;
+  // AC coefficient order of Encode() (see UpdateCoeffOrder), valid if
+  // has_coeff_order_.
+  mutable int coeff_order_[3 * kBlockSize];
+  mutable bool has_coeff_order_ = false;
+  // Set by Encode*().
+  mutable EncodedPartSizes part_sizes_;
+  int decode_block_y_begin_ = 0;
+  int decode_block_y_end_ = -1;  // all rows
+  DecoderTables* decoder_tables_ = nullptr;
+  DecoderTables* ac_tables_ = nullptr;  // decoder_tables_ if null
+  const ACCodes* previous_ac_codes_ = nullptr;
+  ACCodes* used_ac_codes_ = nullptr;
+  // Whether the quant field is part of Encode*() and Decode*().
+  bool store_quant_field_ = true;
+  // Not owned, may be null.
+  ThreadPool* pool_;
   // Not owned, used to report additional statistics to the callers of
   // PixelsToPik() and PikToPixels().
   PikInfo* pik_info_;
@@ -0,0 +1,173 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiled once per instruction set; see compressed_image_target_<target>.cc.
+
+#include "compressed_image_target.h"
+
+#include "compiler_specific.h"
+#include "compressed_image.h"
+#include "gamma_correct.h"
+#include "opsin_inverse.h"
+#include "opsin_params.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+constexpr int kBlockSize2 = 2 * kBlockSize;
+
+using V = vec<float>;
+constexpr size_t N = NumLanes<V>();
+static_assert(kBlockEdge % N == 0, "Block rows must consist of whole vectors");
+
+// (Plain loops: the compiler vectorizes them for each target, and the results
+// do not depend on the lane count.)
+void Dequantize(const int16_t* PIK_RESTRICT quantized,
+                const float* PIK_RESTRICT muls, const float inv_quant,
+                float* PIK_RESTRICT block) {
+  for (int k = 0; k < kBlockSize; ++k) {
+    block[k] = quantized[k] * (muls[k] * inv_quant);
+  }
+}
+
+void AddScaled(const float* PIK_RESTRICT y, const float factor,
+               float* PIK_RESTRICT b) {
+  for (int k = 0; k < kBlockSize; ++k) {
+    b[k] += factor * y[k];
+  }
+}
+
+float BlurredBlock(const float* PIK_RESTRICT row_up,
+                   const float* PIK_RESTRICT row_cur,
+                   const float* PIK_RESTRICT row_down,
+                   const float* PIK_RESTRICT w_up,
+                   const float* PIK_RESTRICT w_cur,
+                   const float* PIK_RESTRICT w_down,
+                   float* PIK_RESTRICT out) {
+  constexpr int kVectors = kBlockEdge / N;
+  V val_up[kVectors];
+  V val_cur[kVectors];
+  V val_down[kVectors];
+  V sum[kVectors];
+  for (int i = 0; i < kVectors; ++i) {
+    val_up[i] = load(V(), row_up + i * N);
+    val_cur[i] = load(V(), row_cur + i * N);
+    val_down[i] = load(V(), row_down + i * N);
+    sum[i] = setzero(V());
+  }
+  for (int iy = 0; iy < kBlockEdge; ++iy) {
+    const V weight_up = set1(V(), w_up[iy]);
+    const V weight_cur = set1(V(), w_cur[iy]);
+    const V weight_down = set1(V(), w_down[iy]);
+    for (int i = 0; i < kVectors; ++i) {
+      const V val = val_up[i] * weight_up + val_cur[i] * weight_cur +
+                    val_down[i] * weight_down;
+      store(val, out + iy * kBlockEdge + i * N);
+      sum[i] += val;
+    }
+  }
+
+  // Same order for any lane count (unlike horz_sum).
+  SIMD_ALIGN float column_sums[kBlockEdge];
+  for (int i = 0; i < kVectors; ++i) {
+    store(sum[i], column_sums + i * N);
+  }
+  float avg = 0.0f;
+  for (int ix = 0; ix < kBlockEdge; ++ix) {
+    avg += column_sums[ix];
+  }
+  return avg / 64.0f;
+}
+
+// Converts the N opsin pixels starting at "opsin", whose channels are
+// kBlockSize apart, to linear RGB.
+PIK_INLINE void BlockToRgb(const float* const PIK_RESTRICT opsin,
+                           const bool gray, V* const PIK_RESTRICT r,
+                           V* const PIK_RESTRICT g, V* const PIK_RESTRICT b) {
+  const V y = load(V(), opsin + kBlockSize) + set1(V(), kXybCenter[1]);
+  if (gray) {
+    *r = *g = *b = YToGray(y);
+    return;
+  }
+  const V x = load(V(), opsin) + set1(V(), kXybCenter[0]);
+  const V opsin_b = load(V(), opsin + kBlockSize2) + set1(V(), kXybCenter[2]);
+  XybToRgb(x, y, opsin_b, r, g, b);
+}
+
+// Returns the nearest integer (ties upward) of the non-negative "v". Unlike
+// i32_from_f32, the result does not depend on the instruction set.
+PIK_INLINE vec<int32_t> RoundNonNegative(const V v) {
+  return i32_from_f32(round_neg_inf(v + set1(V(), 0.5f)));
+}
+
+void OpsinToSrgb8LutIndices(const float* PIK_RESTRICT opsin, const bool gray,
+                            int32_t* PIK_RESTRICT rgb) {
+  const V lut_scale = set1(V(), 16.0f);
+  for (int k = 0; k < kBlockSize; k += N) {
+    V r, g, b;
+    BlockToRgb(opsin + k, gray, &r, &g, &b);
+    store(RoundNonNegative(r * lut_scale), rgb + k);
+    store(RoundNonNegative(g * lut_scale), rgb + k + kBlockSize);
+    store(RoundNonNegative(b * lut_scale), rgb + k + kBlockSize2);
+  }
+}
+
+void OpsinToSrgb16(const float* PIK_RESTRICT opsin, const bool gray,
+                   uint16_t* PIK_RESTRICT rgb) {
+  const V scale_to_16bit = set1(V(), 257.0f);
+  for (int k = 0; k < kBlockSize; k += N) {
+    V r, g, b;
+    BlockToRgb(opsin + k, gray, &r, &g, &b);
+    // LinearToSrgbPoly clamps to [0, 255], hence the values fit.
+    const auto r16 = RoundNonNegative(LinearToSrgbPoly(r) * scale_to_16bit);
+    const auto g16 = RoundNonNegative(LinearToSrgbPoly(g) * scale_to_16bit);
+    const auto b16 = RoundNonNegative(LinearToSrgbPoly(b) * scale_to_16bit);
+    store(convert_to(uint16_t(), r16), rgb + k);
+    store(convert_to(uint16_t(), g16), rgb + k + kBlockSize);
+    store(convert_to(uint16_t(), b16), rgb + k + kBlockSize2);
+  }
+}
+
+void OpsinToLinear(const float* PIK_RESTRICT opsin, const bool gray,
+                   float* PIK_RESTRICT rgb) {
+  for (int k = 0; k < kBlockSize; k += N) {
+    V r, g, b;
+    BlockToRgb(opsin + k, gray, &r, &g, &b);
+    store(r, rgb + k);
+    store(g, rgb + k + kBlockSize);
+    store(b, rgb + k + kBlockSize2);
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+// Instantiate for the current target.
+template <>
+CompressedImageFunctions
+CompressedImageFunctionsForTarget::operator()<SIMD_TARGET>() const {
+  CompressedImageFunctions functions;
+  functions.dequantize = &SIMD_NAMESPACE::Dequantize;
+  functions.add_scaled = &SIMD_NAMESPACE::AddScaled;
+  functions.blurred_block = &SIMD_NAMESPACE::BlurredBlock;
+  functions.opsin_to_srgb8_lut_indices =
+      &SIMD_NAMESPACE::OpsinToSrgb8LutIndices;
+  functions.opsin_to_srgb16 = &SIMD_NAMESPACE::OpsinToSrgb16;
+  functions.opsin_to_linear = &SIMD_NAMESPACE::OpsinToLinear;
+  return functions;
+}
+
+}  // namespace pik
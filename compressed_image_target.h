@@ -0,0 +1,62 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef COMPRESSED_IMAGE_TARGET_H_
+#define COMPRESSED_IMAGE_TARGET_H_
+
+// Per-instruction-set implementations of the per-block kernels of the
+// decoder: dequantization, the DC blur and the color transforms. Only
+// compressed_image.cc should include this.
+
+#include <stdint.h>
+
+namespace pik {
+
+// All blocks are kBlockSize values, aligned; "opsin" are three such blocks
+// (X, Y, B). If "gray", only Y is read because X and B are not reconstructed
+// (see CompressedImage::SetGrayscale).
+struct CompressedImageFunctions {
+  // block[k] = quantized[k] * (muls[k] * inv_quant).
+  void (*dequantize)(const int16_t* quantized, const float* muls,
+                     float inv_quant, float* block);
+  // b[k] += factor * y[k].
+  void (*add_scaled)(const float* y, float factor, float* b);
+
+  // Writes the vertical pass of the DC blur (the kBlockEdge horizontally
+  // blurred values of the block rows above, at and below, weighted by w_up,
+  // w_cur and w_down for each output row) to "out" and returns its average.
+  // The rows and weights are aligned arrays of kBlockEdge values.
+  float (*blurred_block)(const float* row_up, const float* row_cur,
+                         const float* row_down, const float* w_up,
+                         const float* w_cur, const float* w_down, float* out);
+
+  // Convert "opsin" to three blocks ("rgb") of indices into the
+  // LinearToSrgb8Table* LUTs, 16-bit sRGB or linear RGB.
+  void (*opsin_to_srgb8_lut_indices)(const float* opsin, bool gray,
+                                     int32_t* rgb);
+  void (*opsin_to_srgb16)(const float* opsin, bool gray, uint16_t* rgb);
+  void (*opsin_to_linear)(const float* opsin, bool gray, float* rgb);
+};
+
+// Call via KernelTable<CompressedImageFunctionsForTarget>.
+// operator()<SIMD_TARGET> is specialized in compressed_image_target.cc, which
+// is compiled once per instruction set (compressed_image_target_<target>.cc).
+struct CompressedImageFunctionsForTarget {
+  template <class Target>
+  CompressedImageFunctions operator()() const;
+};
+
+}  // namespace pik
+
+#endif  // COMPRESSED_IMAGE_TARGET_H_
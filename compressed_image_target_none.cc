@@ -0,0 +1,2 @@
+// SIMD_ENABLE undefined, defaults to zero.
+#include "compressed_image_target.cc"
@@ -0,0 +1,152 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Encodes and decodes the same image from many threads at once, which all
+// read the global tables: the dequantization matrix (computed from the
+// quantization weights), the sRGB gamma tables and the butteraugli masks.
+// Each result must equal the single-threaded one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "image.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_params.h"
+
+namespace pik {
+namespace {
+
+constexpr size_t kXsize = 131;
+constexpr size_t kYsize = 67;
+constexpr size_t kNumThreads = 16;
+constexpr size_t kIterations = 2;
+
+MetaImageB TestImage() {
+  Image3B image(kXsize, kYsize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYsize; ++y) {
+      uint8_t* const PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < kXsize; ++x) {
+        const double ring = std::sqrt(double(x * x + y * y)) * (0.2 + 0.1 * c);
+        row[x] = static_cast<uint8_t>(128 + 90 * std::sin(ring) +
+                                      30 * std::cos(x * 0.9));
+      }
+    }
+  }
+  MetaImageB meta;
+  meta.SetColor(std::move(image));
+  return meta;
+}
+
+// One way of coding the test image: the butteraugli search (masks, gamma
+// tables) or the fast mode, decoded to 8 or 16 bits.
+struct Variant {
+  bool fast_mode;
+  bool sixteen_bit;
+  PaddedBytes compressed;
+  MetaImageB decoded8;
+  MetaImageU decoded16;
+};
+
+template <typename T>
+bool SamePixels(const MetaImage<T>& a, const MetaImage<T>& b) {
+  if (a.xsize() != b.xsize() || a.ysize() != b.ysize()) return false;
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < a.ysize(); ++y) {
+      const T* const PIK_RESTRICT row_a = a.GetColor().PlaneRow(c, y);
+      const T* const PIK_RESTRICT row_b = b.GetColor().PlaneRow(c, y);
+      if (!std::equal(row_a, row_a + a.xsize(), row_b)) return false;
+    }
+  }
+  return true;
+}
+
+bool SameBytes(const PaddedBytes& a, const PaddedBytes& b) {
+  return a.size() == b.size() && std::equal(a.data(), a.data() + a.size(),
+                                            b.data());
+}
+
+// Encodes and decodes "image" as "variant" specifies and stores the results
+// there.
+bool Code(const MetaImageB& image, Variant* variant) {
+  CompressParams params;
+  if (variant->fast_mode) {
+    params.fast_mode = true;
+  } else {
+    params.butteraugli_distance = 1.5f;
+  }
+  DecompressParams dparams;
+  if (!PixelsToPik(params, image, &variant->compressed, nullptr)) {
+    return false;
+  }
+  return variant->sixteen_bit
+             ? PikToPixels(dparams, variant->compressed, &variant->decoded16,
+                           nullptr)
+             : PikToPixels(dparams, variant->compressed, &variant->decoded8,
+                           nullptr);
+}
+
+int RunTests() {
+  const MetaImageB image = TestImage();
+  std::vector<Variant> references(4);
+  for (size_t i = 0; i < references.size(); ++i) {
+    references[i].fast_mode = (i & 1) != 0;
+    references[i].sixteen_bit = (i & 2) != 0;
+    if (!Code(image, &references[i])) {
+      fprintf(stderr, "Single-threaded variant %zu failed.\n", i);
+      return 1;
+    }
+  }
+
+  std::atomic<size_t> num_failures{0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&image, &references, &num_failures, t]() {
+      for (size_t iteration = 0; iteration < kIterations; ++iteration) {
+        const Variant& reference =
+            references[(t + iteration) % references.size()];
+        Variant variant;
+        variant.fast_mode = reference.fast_mode;
+        variant.sixteen_bit = reference.sixteen_bit;
+        const bool ok =
+            Code(image, &variant) &&
+            SameBytes(variant.compressed, reference.compressed) &&
+            (variant.sixteen_bit
+                 ? SamePixels(variant.decoded16, reference.decoded16)
+                 : SamePixels(variant.decoded8, reference.decoded8));
+        if (!ok) {
+          fprintf(stderr, "Thread %zu, iteration %zu differs.\n", t,
+                  iteration);
+          ++num_failures;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+
+  if (num_failures != 0) return 1;
+  printf("%zu threads encoded and decoded identically.\n", kNumThreads);
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main() { return pik::RunTests(); }
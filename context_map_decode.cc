@@ -26,8 +26,7 @@ namespace {
 
 void MoveToFront(uint8_t* v, uint8_t index) {
   uint8_t value = v[index];
-  uint8_t i = index;
-  for (; i; --i) v[i] = v[i - 1];
+  memmove(v + 1, v, index);
   v[0] = value;
 }
 
@@ -59,7 +58,7 @@ inline int DecodeVarLenUint8(BitReader* input) {
 
 bool VerifyContextMap(const std::vector<uint8_t>& context_map,
                       const size_t num_htrees) {
-  std::vector<bool> have_htree(num_htrees);
+  uint8_t have_htree[256] = {0};
   int num_found = 0;
   for (int i = 0; i < context_map.size(); ++i) {
     const int htree = context_map[i];
@@ -107,14 +106,12 @@ bool DecodeContextMap(std::vector<uint8_t>* context_map,
       (*context_map)[i] = 0;
       ++i;
     } else if (code <= max_run_length_prefix) {
-      int reps = 1 + (1 << code) + input->ReadBits(code);
-      while (--reps) {
-        if (i >= context_map->size()) {
-          return PIK_FAILURE("Invalid context map data.");
-        }
-        (*context_map)[i] = 0;
-        ++i;
+      const int reps = (1 << code) + input->ReadBits(code);
+      if (static_cast<size_t>(reps) > context_map->size() - i) {
+        return PIK_FAILURE("Invalid context map data.");
       }
+      memset(&(*context_map)[i], 0, reps);
+      i += reps;
     } else {
       (*context_map)[i] = static_cast<uint8_t>(code - max_run_length_prefix);
       ++i;
@@ -15,81 +15,663 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include <sys/stat.h>
+
+#include "encode_cache.h"
 #include "image.h"
 #include "image_io.h"
 #include "padded_bytes.h"
 #include "pik.h"
 #include "pik_info.h"
-#include "simd/dispatch.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include "yuv_convert.h"
 
 namespace pik {
 namespace {
 
+bool WriteCompressed(const PaddedBytes& compressed, const char* pathname) {
+  FILE* f = fopen(pathname, "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname);
+    return false;
+  }
+  const size_t bytes_written =
+      fwrite(compressed.data(), 1, compressed.size(), f);
+  if (bytes_written != compressed.size()) {
+    fprintf(stderr, "I/O error, only wrote %zu bytes.\n", bytes_written);
+    return false;
+  }
+  fclose(f);
+  return true;
+}
+
+// Passes each part of the output to the OS as soon as the encoder produces
+// it, so that e.g. a pipe or upload receives the first bytes early.
+class FileSink : public ByteSink {
+ public:
+  explicit FileSink(FILE* f) : f_(f) {}
+
+  bool Write(const uint8_t* data, const size_t size) override {
+    const size_t bytes_written = fwrite(data, 1, size, f_);
+    bytes_written_ += bytes_written;
+    if (bytes_written != size || fflush(f_) != 0) {
+      fprintf(stderr, "I/O error after %zu bytes.\n", bytes_written_);
+      return false;
+    }
+    return true;
+  }
+
+  size_t BytesWritten() const { return bytes_written_; }
+
+ private:
+  FILE* f_;
+  size_t bytes_written_ = 0;
+};
+
 // main() function, within namespace for convenience.
-int Compress(const char* pathname_in, const float butteraugli_distance,
-             const char* pathname_out, const bool fast_mode) {
-  if ((dispatch::SupportedTargets() & SIMD_AVX2) == 0) {
-    fprintf(stderr, "Cannot continue because CPU lacks AVX2/FMA support.\n");
+// If "info_json" is non-null, also writes the PikInfo to that file.
+int Compress(const char* pathname_in, const char* pathname_out,
+             CompressParams params, const bool jpeg_dct,
+             const char* info_json) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
     return 1;
   }
 
-  MetaImageF in = ReadMetaImageLinear(pathname_in);
-  if (in.xsize() == 0 || in.ysize() == 0) {
-    fprintf(stderr, "Failed to open image %s.\n", pathname_in);
-    return 1;
+  // Either "in", "in8" (lossless) or "jpeg" is used.
+  MetaImageF in;
+  MetaImageB in8;
+  std::unique_ptr<JpegSource> jpeg;
+  if (jpeg_dct && ImageFormatJPG::IsExtension(pathname_in)) {
+    jpeg.reset(new JpegSource(pathname_in));
+    if (!jpeg->Open()) {
+      fprintf(stderr, "Failed to read JPEG coefficients of %s.\n",
+              pathname_in);
+      return 1;
+    }
+  } else if (params.lossless) {
+    if (!ReadImage(ImageFormatPNG(), pathname_in, &in8)) {
+      fprintf(stderr, "Failed to open PNG image %s.\n", pathname_in);
+      return 1;
+    }
+  } else {
+    in = ReadMetaImageLinear(pathname_in);
+    if (in.xsize() == 0 || in.ysize() == 0) {
+      fprintf(stderr, "Failed to open image %s.\n", pathname_in);
+      return 1;
+    }
   }
 
-  if (fast_mode) {
+  if (params.lossless) {
+    printf("Compressing losslessly\n");
+  } else if (params.fast_mode) {
     printf("Compressing with fast mode\n");
   } else {
     printf("Compressing with maximum Butteraugli distance %f\n",
-           butteraugli_distance);
+           params.butteraugli_distance);
   }
 
-  CompressParams params;
-  params.butteraugli_distance = butteraugli_distance;
-  params.alpha_channel = in.HasAlpha();
-  if (fast_mode) {
-    params.fast_mode = true;
-    params.butteraugli_distance = -1;
+  FILE* f = fopen(pathname_out, "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname_out);
+    return 1;
   }
-  PaddedBytes compressed;
+  params.alpha_channel = params.lossless ? in8.HasAlpha() : in.HasAlpha();
+  FileSink sink(f);
   PikInfo aux_out;
-  if (!PixelsToPik(params, in, &compressed, &aux_out)) {
+  bool ok = jpeg ? PixelsToPik(params, jpeg.get(), &sink, &aux_out)
+                 : params.lossless ? PixelsToPik(params, in8, &sink, &aux_out)
+                                   : PixelsToPik(params, in, &sink, &aux_out);
+  ok &= fclose(f) == 0;
+  if (!ok) {
     fprintf(stderr, "Failed to compress.\n");
+    // Do not leave a truncated file behind (but e.g. /dev/null is kept).
+    struct stat info;
+    if (stat(pathname_out, &info) == 0 && S_ISREG(info.st_mode)) {
+      remove(pathname_out);
+    }
     return 1;
   }
 
-  printf("Compressed to %zu bytes\n", compressed.size());
+  if (aux_out.deadline_reached) {
+    printf("Deadline reached, stopped the search early\n");
+  }
+  printf("Compressed to %zu bytes\n", sink.BytesWritten());
+  if (info_json != nullptr && !WritePikInfoJSON(aux_out, info_json)) {
+    fprintf(stderr, "Failed to write %s.\n", info_json);
+    return 1;
+  }
+  return 0;
+}
 
-  FILE* f = fopen(pathname_out, "wb");
+// Encodes every "frame_step"-th frame of the Y4M stream "pathname_in" ("-"
+// for stdin) into a separate file named by the printf pattern "pattern_out"
+// and the frame index. Frames are read in batches of one per thread and
+// encoded concurrently.
+int CompressFrames(const char* pathname_in, const char* pattern_out,
+                   const CompressParams& params, const int frame_step) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
+    return 1;
+  }
+  if (!IsFramePattern(pattern_out)) {
+    fprintf(stderr, "Output %s must contain one %%d for the frame index.\n",
+            pattern_out);
+    return 1;
+  }
+  const bool from_stdin = strcmp(pathname_in, "-") == 0;
+  FILE* f = from_stdin ? stdin : fopen(pathname_in, "rb");
   if (f == nullptr) {
-    fprintf(stderr, "Failed to open %s.\n", pathname_out);
+    fprintf(stderr, "Failed to open %s.\n", pathname_in);
     return 1;
   }
-  const size_t bytes_written =
-      fwrite(compressed.data(), 1, compressed.size(), f);
-  if (bytes_written != compressed.size()) {
-    fprintf(stderr, "I/O error, only wrote %zu bytes.\n", bytes_written);
+  // Closes "f" on all paths.
+  std::unique_ptr<FILE, int (*)(FILE*)> file(from_stdin ? nullptr : f,
+                                             &fclose);
+  Y4MFrameReader reader(f);
+  if (!reader.ReadHeader()) {
+    fprintf(stderr, "Failed to read the Y4M header of %s.\n", pathname_in);
     return 1;
   }
-  fclose(f);
+
+  const size_t batch_size =
+      std::max(1, NumThreadsFromParam(params.num_threads));
+  Image3U yuv;  // Reused for all frames.
+  std::vector<MetaImageF> frames;
+  std::vector<int> frame_indices;
+  const auto flush = [&]() {
+    std::vector<PaddedBytes> compressed;
+    if (!PixelsToPik(params, frames, &compressed, nullptr)) {
+      fprintf(stderr, "Failed to compress.\n");
+      return false;
+    }
+    for (size_t i = 0; i < frames.size(); ++i) {
+      char pathname[4096];
+      snprintf(pathname, sizeof(pathname), pattern_out, frame_indices[i]);
+      printf("Compressed frame %d to %zu bytes\n", frame_indices[i],
+             compressed[i].size());
+      if (!WriteCompressed(compressed[i], pathname)) return false;
+    }
+    frames.clear();
+    frame_indices.clear();
+    return true;
+  };
+
+  for (int frame = 0;; ++frame) {
+    bool end;
+    const bool ok = frame % frame_step == 0 ? reader.NextFrame(&yuv, &end)
+                                            : reader.SkipFrame(&end);
+    if (!ok) {
+      fprintf(stderr, "Failed to read frame %d of %s.\n", frame, pathname_in);
+      return 1;
+    }
+    if (end) break;
+    if (frame % frame_step != 0) continue;
+    MetaImageF linear;
+    linear.SetColor(RGBLinearImageFromYUVRec709(yuv, reader.bit_depth()));
+    frames.push_back(std::move(linear));
+    frame_indices.push_back(frame);
+    if (frames.size() == batch_size && !flush()) return 1;
+  }
+  if (!frames.empty() && !flush()) return 1;
   return 0;
 }
 
+// Encodes every "frame_step"-th frame of the Y4M stream "pathname_in" ("-"
+// for stdin) as one frame of the animation "pathname_out" (see FramesToPik),
+// each shown for "duration" milliseconds. Frames are encoded as they are read,
+// so that only the previous one is kept in memory.
+int CompressAnimation(const char* pathname_in, const char* pathname_out,
+                      const CompressParams& params, const int frame_step,
+                      const uint32_t duration) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
+    return 1;
+  }
+  if (params.butteraugli_distance < 0.0 && params.uniform_quant <= 0.0) {
+    fprintf(stderr, "Animations require a distance, not --fast or "
+            "--target_bitrate.\n");
+    return 1;
+  }
+  const bool from_stdin = strcmp(pathname_in, "-") == 0;
+  FILE* f = from_stdin ? stdin : fopen(pathname_in, "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname_in);
+    return 1;
+  }
+  // Closes "f" on all paths.
+  std::unique_ptr<FILE, int (*)(FILE*)> file(from_stdin ? nullptr : f,
+                                             &fclose);
+  Y4MFrameReader reader(f);
+  if (!reader.ReadHeader()) {
+    fprintf(stderr, "Failed to read the Y4M header of %s.\n", pathname_in);
+    return 1;
+  }
+
+  PikEncoder encoder(params.num_threads, params.pin_threads);
+  PaddedBytes compressed;
+  Image3U yuv;  // Reused for all frames.
+  size_t num_frames = 0;
+  for (int frame = 0;; ++frame) {
+    bool end;
+    const bool ok = frame % frame_step == 0 ? reader.NextFrame(&yuv, &end)
+                                            : reader.SkipFrame(&end);
+    if (!ok) {
+      fprintf(stderr, "Failed to read frame %d of %s.\n", frame, pathname_in);
+      return 1;
+    }
+    if (end) break;
+    if (frame % frame_step != 0) continue;
+    MetaImageB image;
+    image.SetColor(RGB8ImageFromYUVRec709(yuv, reader.bit_depth()));
+    const size_t previous_size = compressed.size();
+    if (!encoder.FrameToPik(params, image, duration, &compressed, nullptr)) {
+      fprintf(stderr, "Failed to compress frame %d.\n", frame);
+      return 1;
+    }
+    printf("Compressed frame %d to %zu bytes\n", frame,
+           compressed.size() - previous_size);
+    ++num_frames;
+  }
+  if (num_frames == 0) {
+    fprintf(stderr, "%s contains no frames.\n", pathname_in);
+    return 1;
+  }
+  printf("Compressed %zu frames to %zu bytes\n", num_frames,
+         compressed.size());
+  return WriteCompressed(compressed, pathname_out) ? 0 : 1;
+}
+
+// Encodes "pathname_in" once per distance (see the PixelsToPik overload for
+// renditions) into files named by the printf pattern "pattern_out" and the
+// index of the distance.
+int CompressRenditions(const char* pathname_in, const char* pattern_out,
+                       const CompressParams& params,
+                       const std::vector<float>& distances) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
+    return 1;
+  }
+  if (!IsFramePattern(pattern_out)) {
+    fprintf(stderr, "Output %s must contain one %%d for the rendition index.\n",
+            pattern_out);
+    return 1;
+  }
+  if (params.lossless || params.fast_mode || params.target_bitrate > 0.0f) {
+    fprintf(stderr, "Renditions require distances, not --lossless, --fast or "
+            "--target_bitrate.\n");
+    return 1;
+  }
+  MetaImageF in = ReadMetaImageLinear(pathname_in);
+  if (in.xsize() == 0 || in.ysize() == 0) {
+    fprintf(stderr, "Failed to open image %s.\n", pathname_in);
+    return 1;
+  }
+  CompressParams rendition_params = params;
+  rendition_params.alpha_channel = in.HasAlpha();
+  std::vector<PaddedBytes> compressed;
+  if (!PixelsToPik(rendition_params, in, distances, &compressed, nullptr)) {
+    fprintf(stderr, "Failed to compress.\n");
+    return 1;
+  }
+  for (size_t i = 0; i < distances.size(); ++i) {
+    char pathname[4096];
+    snprintf(pathname, sizeof(pathname), pattern_out, static_cast<int>(i));
+    printf("Compressed rendition %zu (distance %.2f) to %zu bytes\n", i,
+           distances[i], compressed[i].size());
+    if (!WriteCompressed(compressed[i], pathname)) return 1;
+  }
+  return 0;
+}
+
+// Blocking FIFO with room for "capacity" items, which connects the stages of
+// CompressBatch so that a slow stage stalls the previous one instead of
+// accumulating images in memory.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(const size_t capacity) : capacity_(capacity) {}
+
+  void Push(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return items_.size() < capacity_; });
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+  }
+
+  // Returns false if the queue is empty and closed, i.e. no more items follow.
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+    if (items_.empty()) return false;
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Called by the producer(s) after the last Push.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T> items_;
+  bool closed_ = false;
+};
+
+bool LoadFile(const char* pathname, PaddedBytes* bytes) {
+  FILE* f = fopen(pathname, "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "Failed to open %s.\n", pathname);
+    return false;
+  }
+  // Closes "f" on all paths.
+  std::unique_ptr<FILE, int (*)(FILE*)> file(f, &fclose);
+  if (fseek(f, 0, SEEK_END) != 0) {
+    fprintf(stderr, "Seek error at end of %s.\n", pathname);
+    return false;
+  }
+  const long size = ftell(f);
+  if (size <= 0 || fseek(f, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Seek error at beginning of %s.\n", pathname);
+    return false;
+  }
+  bytes->resize(size);
+  const size_t bytes_read = fread(bytes->data(), 1, bytes->size(), f);
+  if (bytes_read != bytes->size()) {
+    fprintf(stderr, "I/O error, only read %zu bytes of %s.\n", bytes_read,
+            pathname);
+    return false;
+  }
+  return true;
+}
+
+// Sets "pathnames" to the images in directory "in" (sorted by name), or to
+// the non-empty lines of the manifest file "in".
+bool ListBatchInputs(const char* in, std::vector<std::string>* pathnames) {
+  pathnames->clear();
+  struct stat info;
+  if (stat(in, &info) != 0) {
+    fprintf(stderr, "Failed to open %s.\n", in);
+    return false;
+  }
+  if (S_ISDIR(info.st_mode)) return ListImageFiles(in, pathnames);
+
+  PaddedBytes manifest;
+  if (!LoadFile(in, &manifest)) return false;
+  const char* begin = reinterpret_cast<const char*>(manifest.data());
+  const char* const end = begin + manifest.size();
+  while (begin < end) {
+    const char* line_end = std::find(begin, end, '\n');
+    std::string line(begin, line_end);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (!line.empty()) pathnames->push_back(std::move(line));
+    begin = line_end + 1;
+  }
+  return true;
+}
+
+// Returns "dir_out"/<filename of "pathname_in" without extension>.pik.
+std::string BatchOutputPathname(const std::string& pathname_in,
+                                const char* dir_out) {
+  const size_t slash = pathname_in.find_last_of('/');
+  std::string name = slash == std::string::npos
+                         ? pathname_in
+                         : pathname_in.substr(slash + 1);
+  const size_t dot = name.find_last_of('.');
+  if (dot != std::string::npos && dot != 0) name.resize(dot);
+  return std::string(dir_out) + "/" + name + ".pik";
+}
+
+// Encodes each image listed by ListBatchInputs("in") into "dir_out". A reader
+// thread loads the files ahead of time, one encoder per params.num_threads
+// (each single-threaded) decodes and compresses them, and a writer thread
+// stores the results, so that disk I/O overlaps with compression. If "cache"
+// is non-null, repeated images (except with jpeg_dct) are encoded only once,
+// and with "warm_start", their search starts from the quantization field of
+// an encode at another distance.
+int CompressBatch(const char* in, const char* dir_out,
+                  const CompressParams& params, const bool jpeg_dct,
+                  EncodeCache* cache, const bool warm_start) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
+    return 1;
+  }
+  std::vector<std::string> pathnames;
+  if (!ListBatchInputs(in, &pathnames)) return 1;
+
+  struct Loaded {
+    std::string pathname;
+    PaddedBytes bytes;
+  };
+  struct Encoded {
+    std::string pathname;
+    PaddedBytes compressed;
+  };
+  const int num_encoders = std::max(1, NumThreadsFromParam(params.num_threads));
+  // Enough to keep every encoder busy while the other stages wait for I/O.
+  BoundedQueue<Loaded> loaded_queue(num_encoders);
+  BoundedQueue<Encoded> encoded_queue(num_encoders);
+  std::atomic<int> num_failures{0};
+  std::atomic<int> num_cached{0};
+
+  std::thread reader([&]() {
+    for (const std::string& pathname : pathnames) {
+      Loaded loaded;
+      loaded.pathname = pathname;
+      if (!LoadFile(pathname.c_str(), &loaded.bytes)) {
+        num_failures.fetch_add(1);
+        continue;
+      }
+      loaded_queue.Push(std::move(loaded));
+    }
+    loaded_queue.Close();
+  });
+
+  std::vector<std::thread> encoders;
+  for (int i = 0; i < num_encoders; ++i) {
+    encoders.emplace_back([&]() {
+      PikEncoder encoder(0);
+      CompressParams image_params = params;
+      image_params.num_threads = 0;
+      Loaded loaded;
+      while (loaded_queue.Pop(&loaded)) {
+        Encoded encoded;
+        encoded.pathname = BatchOutputPathname(loaded.pathname, dir_out);
+        bool ok;
+        if (jpeg_dct && ImageFormatJPG::IsExtension(loaded.pathname.c_str())) {
+          JpegSource jpeg(loaded.bytes.data(), loaded.bytes.size());
+          image_params.alpha_channel = false;
+          ok = jpeg.Open() && encoder.PixelsToPik(image_params, &jpeg,
+                                                  &encoded.compressed, nullptr);
+        } else {
+          MetaImageF linear =
+              ReadMetaImageLinear(loaded.bytes.data(), loaded.bytes.size());
+          loaded.bytes = PaddedBytes();
+          image_params.alpha_channel = linear.HasAlpha();
+          ok = linear.xsize() != 0 && linear.ysize() != 0;
+          if (ok && cache != nullptr) {
+            bool cache_hit;
+            ok = CachedPixelsToPik(image_params, linear, warm_start, cache,
+                                   &encoder, &encoded.compressed, nullptr,
+                                   &cache_hit);
+            if (cache_hit) num_cached.fetch_add(1);
+          } else if (ok) {
+            ok = encoder.PixelsToPik(image_params, std::move(linear),
+                                     &encoded.compressed, nullptr);
+          }
+        }
+        if (!ok) {
+          fprintf(stderr, "Failed to compress %s.\n", loaded.pathname.c_str());
+          num_failures.fetch_add(1);
+          continue;
+        }
+        encoded_queue.Push(std::move(encoded));
+      }
+    });
+  }
+
+  std::thread writer([&]() {
+    Encoded encoded;
+    while (encoded_queue.Pop(&encoded)) {
+      printf("Compressed to %zu bytes: %s\n", encoded.compressed.size(),
+             encoded.pathname.c_str());
+      if (!WriteCompressed(encoded.compressed, encoded.pathname.c_str())) {
+        num_failures.fetch_add(1);
+      }
+    }
+  });
+
+  reader.join();
+  for (std::thread& encoder : encoders) {
+    encoder.join();
+  }
+  encoded_queue.Close();
+  writer.join();
+
+  const int failures = num_failures.load();
+  printf("Compressed %zu of %zu images.\n", pathnames.size() - failures,
+         pathnames.size());
+  if (cache != nullptr) {
+    printf("Reused %d cached encodings.\n", num_cached.load());
+  }
+  return failures == 0 ? 0 : 1;
+}
+
 }  // namespace
 }  // namespace pik
 
 void PrintArgHelp(int argc, char** argv) {
   fprintf(stderr,
-      "Usage: %s in.png out.pik [--distance <maxError>] [--fast]\n"
+      "Usage: %s in.png out.pik [--distance <maxError>] [--fast]"
+      " [--num_threads <n>] [--ac_groups] [--interleaved_ans]"
+      " [--fast_clustering] [--parallel_ytob] [--static_ac_codes]"
+      " [--section_index] [--alpha_effort <0-11>] [--concurrent_alpha]"
+      " [--lossless] [--grayscale]"
+      " [--target_bitrate <bpp>] [--estimate_size]"
+      " [--fast_size_estimates]"
+      " [--coarse_butteraugli] [--linear_butteraugli] [--proxy_butteraugli]"
+      " [--speculative <k>] [--multires_butteraugli]"
+      " [--adaptive_initial_quant] [--effort <1-9>] [--deadline <seconds>]"
+      " [--pin_threads] [--huge_pages <min_bytes>] [--jpeg_dct] [--profile]"
+      " [--info_json <out.json>]\n"
+      "       %s --y4m_frames in.y4m out%%05d.pik [--frame_step <n>]"
+      " [options above]\n"
+      "       %s --y4m_animation in.y4m out.pik [--frame_step <n>]"
+      " [--frame_duration <ms>] [--quant_field_frames <n>]"
+      " [options above]\n"
+      "       %s --batch <in_dir|list.txt> <out_dir> [--cache]"
+      " [--cache_dir <dir>] [--warm_start] [options above]\n"
+      "       %s --renditions <d1,d2,...> in.png out%%d.pik [options above]\n"
       " --distance: Maximum butteraugli distance, smaller value means higher"
       " quality.\n"
       "             Good default: 1.0. Supported range: 0.5 .. 3.0.\n"
       " --fast: Use fast encoding, ignores distance.\n"
+      " --target_bitrate: Largest size up to the given bits per pixel,"
+      " ignores distance.\n"
+      " --estimate_size: Faster --target_bitrate search based on estimated"
+      " sizes.\n"
+      " --fast_size_estimates: Rank search candidates by histogram entropy.\n"
+      " --num_threads: Number of worker threads, -1 for one per core.\n"
+      "                Default: 0 (single-threaded).\n"
+      " --ac_groups: Allow parallel AC decoding, slightly larger output.\n"
+      " --interleaved_ans: Faster AC decoding, slightly larger output.\n"
+      " --fast_clustering: Faster histogram clustering, slightly larger"
+      " output.\n"
+      " --parallel_ytob: Optimize the Y-to-blue correlation of all tiles in"
+      " parallel.\n"
+      " --static_ac_codes: Allow built-in AC histograms, for small images.\n"
+      " --section_index: Store the offsets of the DC, AC and alpha data.\n"
+      " --alpha_effort: Alpha codec, 1 for the fast parallel codec, 2-11 for"
+      " Brotli at that quality.\n"
+      "                 Default: 0 (Brotli, quality 9 with --fast else 11).\n"
+      " --concurrent_alpha: Encode alpha while encoding the color planes.\n"
+      " --lossless: Fast lossless coding of 8-bit PNG input, ignores"
+      " distance.\n"
+      " --grayscale: Code only the luminance of gray (R = G = B) input, fails"
+      " for color input.\n"
+      " --coarse_butteraugli: Faster search, compares downsampled images while"
+      " far from the distance.\n"
+      " --linear_butteraugli: Faster search, compares the linear instead of"
+      " the 8-bit reconstruction.\n"
+      " --proxy_butteraugli: Faster search, estimates the distance from the"
+      " quantization error between butteraugli runs.\n"
+      " --speculative: Compare k candidate quantizations per search iteration"
+      " in parallel.\n"
+      " --multires_butteraugli: Faster search, starts from the result for a"
+      " 2x downsampled image.\n"
+      " --adaptive_initial_quant: Faster search, starts from the adaptive"
+      " quantization map.\n"
+      " --effort: Selects the options above from 1 (fastest, same as --fast)"
+      " to 9 (smallest output).\n"
+      " --deadline: Stop the search after this many seconds and encode the"
+      " best result so far.\n"
+      " --pin_threads: Pin each worker thread to a CPU (NUMA-local memory).\n"
+      " --huge_pages: Use transparent huge pages for allocations of at least"
+      " min_bytes.\n"
+      " --jpeg_dct: For JPEG input, convert its DCT coefficients instead of"
+      " 8-bit pixels.\n"
+      " --renditions: Encode once per distance (comma-separated) to the file"
+      " named by the\n"
+      "               printf pattern and distance index, sharing the"
+      " distance-independent stages.\n"
+      " --y4m_frames: Encode each frame of a Y4M stream (\"-\" for stdin) to"
+      " the file\n"
+      "               named by the printf pattern and frame index.\n"
+      " --y4m_animation: Encode the frames of a Y4M stream (\"-\" for stdin)"
+      " as one\n"
+      "                  animation, which may share AC codes between"
+      " frames.\n"
+      " --frame_step: With --y4m_frames or --y4m_animation, only encode every"
+      " n-th frame.\n"
+      " --frame_duration: With --y4m_animation, milliseconds per frame."
+      " Default: 40.\n"
+      " --quant_field_frames: With --y4m_animation, number of frames that"
+      " share the\n"
+      "                       quant field searched for the first of them."
+      " Default: 1.\n"
+      " --profile: Print the time spent per encoder stage (requires"
+      " make PROFILE=1).\n"
+      " --info_json: Write the sizes, time and memory per stage and the search"
+      " iterations\n"
+      "              to a JSON file (not with --y4m_frames, --y4m_animation,"
+      " --batch or --renditions).\n"
+      " --batch: Encode all images in a directory (or listed one per line in"
+      " a file)\n"
+      "          to out_dir/<name>.pik; --num_threads sets the number of"
+      " images encoded\n"
+      "          concurrently while the next files are read and previous"
+      " results written.\n"
+      " --cache: With --batch, encode identical images (and options) only"
+      " once.\n"
+      " --cache_dir: Same as --cache, but also keeps the encodings in an"
+      " existing directory\n"
+      "              and reuses those of earlier runs.\n"
+      " --warm_start: With --cache(_dir), start the search from the"
+      " quantization field of\n"
+      "               an earlier encode of the image at another distance.\n"
       " --help: Show this help.\n",
-      argv[0]);
+      argv[0], argv[0], argv[0], argv[0], argv[0]);
 }
 
 void ExitWithArgError(int argc, char** argv) {
@@ -98,21 +680,172 @@ void ExitWithArgError(int argc, char** argv) {
 }
 
 int main(int argc, char** argv) {
-  bool fast_mode = false;
+  pik::CompressParams params;
   const char* arg_maxError = nullptr;
   const char* arg_in = nullptr;
   const char* arg_out = nullptr;
+  bool jpeg_dct = false;
+  bool y4m_frames = false;
+  bool y4m_animation = false;
+  bool batch = false;
+  bool cache = false;
+  const char* cache_dir = nullptr;
+  bool warm_start = false;
+  bool profile = false;
+  const char* info_json = nullptr;
+  int frame_step = 1;
+  uint32_t frame_duration = 40;
+  const char* arg_renditions = nullptr;
   for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
+    // "-" is stdin.
+    if (argv[i][0] == '-' && argv[i][1] != '\0') {
       std::string arg = argv[i];
       if (arg == "--fast") {
-        fast_mode = true;
+        params.fast_mode = true;
       } else if (arg == "--distance") {
         if (i + 1 >= argc) {
           printf("Must give a distance value\n");
           ExitWithArgError(argc, argv);
         }
         arg_maxError = argv[++i];
+      } else if (arg == "--target_bitrate") {
+        if (i + 1 >= argc) {
+          printf("Must give a bitrate\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.target_bitrate = strtod(argv[++i], nullptr);
+        if (!(params.target_bitrate > 0.0f)) ExitWithArgError(argc, argv);
+      } else if (arg == "--estimate_size") {
+        params.estimate_target_size = true;
+      } else if (arg == "--fast_size_estimates") {
+        params.fast_size_estimates = true;
+      } else if (arg == "--num_threads") {
+        if (i + 1 >= argc) {
+          printf("Must give a number of threads\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.num_threads = strtol(argv[++i], nullptr, 10);
+      } else if (arg == "--ac_groups") {
+        params.ac_groups = true;
+      } else if (arg == "--interleaved_ans") {
+        params.interleaved_ans = true;
+      } else if (arg == "--fast_clustering") {
+        params.fast_clustering = true;
+      } else if (arg == "--parallel_ytob") {
+        params.parallel_ytob = true;
+      } else if (arg == "--static_ac_codes") {
+        params.static_ac_codes = true;
+      } else if (arg == "--section_index") {
+        params.section_index = true;
+      } else if (arg == "--alpha_effort") {
+        if (i + 1 >= argc) {
+          printf("Must give an alpha effort level\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.alpha_effort = strtol(argv[++i], nullptr, 10);
+        if (params.alpha_effort < 0 || params.alpha_effort > 11) {
+          printf("Alpha effort must be between 0 and 11\n");
+          ExitWithArgError(argc, argv);
+        }
+      } else if (arg == "--concurrent_alpha") {
+        params.concurrent_alpha = true;
+      } else if (arg == "--lossless") {
+        params.lossless = true;
+      } else if (arg == "--grayscale") {
+        params.grayscale = true;
+      } else if (arg == "--coarse_butteraugli") {
+        params.coarse_butteraugli = true;
+      } else if (arg == "--linear_butteraugli") {
+        params.linear_butteraugli = true;
+      } else if (arg == "--proxy_butteraugli") {
+        params.proxy_butteraugli = true;
+      } else if (arg == "--multires_butteraugli") {
+        params.multires_butteraugli = true;
+      } else if (arg == "--adaptive_initial_quant") {
+        params.adaptive_initial_quant = true;
+      } else if (arg == "--speculative") {
+        if (i + 1 >= argc) {
+          printf("Must give a number of candidates\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.speculative_candidates = strtol(argv[++i], nullptr, 10);
+      } else if (arg == "--effort") {
+        if (i + 1 >= argc) {
+          printf("Must give an effort level\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.effort = strtol(argv[++i], nullptr, 10);
+        if (params.effort < 1 || params.effort > 9) {
+          printf("Effort must be between 1 and 9\n");
+          ExitWithArgError(argc, argv);
+        }
+      } else if (arg == "--deadline") {
+        if (i + 1 >= argc) {
+          printf("Must give a number of seconds\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.deadline_seconds = strtod(argv[++i], nullptr);
+      } else if (arg == "--pin_threads") {
+        params.pin_threads = true;
+      } else if (arg == "--huge_pages") {
+        if (i + 1 >= argc) {
+          printf("Must give a minimum allocation size\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.huge_page_bytes = strtoull(argv[++i], nullptr, 10);
+      } else if (arg == "--jpeg_dct") {
+        jpeg_dct = true;
+      } else if (arg == "--y4m_frames") {
+        y4m_frames = true;
+      } else if (arg == "--y4m_animation") {
+        y4m_animation = true;
+      } else if (arg == "--renditions") {
+        if (i + 1 >= argc) {
+          printf("Must give a list of distances\n");
+          ExitWithArgError(argc, argv);
+        }
+        arg_renditions = argv[++i];
+      } else if (arg == "--batch") {
+        batch = true;
+      } else if (arg == "--cache") {
+        cache = true;
+      } else if (arg == "--cache_dir") {
+        if (i + 1 >= argc) {
+          printf("Must give a cache directory\n");
+          ExitWithArgError(argc, argv);
+        }
+        cache = true;
+        cache_dir = argv[++i];
+      } else if (arg == "--warm_start") {
+        warm_start = true;
+      } else if (arg == "--profile") {
+        profile = true;
+      } else if (arg == "--info_json") {
+        if (i + 1 >= argc) {
+          printf("Must give a JSON file name\n");
+          ExitWithArgError(argc, argv);
+        }
+        info_json = argv[++i];
+      } else if (arg == "--frame_step") {
+        if (i + 1 >= argc) {
+          printf("Must give a frame step\n");
+          ExitWithArgError(argc, argv);
+        }
+        frame_step = strtol(argv[++i], nullptr, 10);
+        if (frame_step <= 0) ExitWithArgError(argc, argv);
+      } else if (arg == "--frame_duration") {
+        if (i + 1 >= argc) {
+          printf("Must give a frame duration\n");
+          ExitWithArgError(argc, argv);
+        }
+        frame_duration = strtoul(argv[++i], nullptr, 10);
+      } else if (arg == "--quant_field_frames") {
+        if (i + 1 >= argc) {
+          printf("Must give a number of frames\n");
+          ExitWithArgError(argc, argv);
+        }
+        params.quant_field_frames = strtol(argv[++i], nullptr, 10);
+        if (params.quant_field_frames <= 0) ExitWithArgError(argc, argv);
       } else if (arg == "--help") {
         PrintArgHelp(argc, argv);
         return 0;
@@ -138,10 +871,69 @@ int main(int argc, char** argv) {
       return 1;
     }
   }
+  std::vector<float> renditions;
+  for (const char* pos = arg_renditions; pos != nullptr && *pos != '\0';) {
+    char* end;
+    const float distance = strtod(pos, &end);
+    if (end == pos || (*end != ',' && *end != '\0') ||
+        !(0.5f <= distance && distance <= 3.0f)) {
+      fprintf(stderr, "Invalid/out of range distances '%s', try 0.5 to 3.\n",
+              arg_renditions);
+      return 1;
+    }
+    renditions.push_back(distance);
+    pos = *end == ',' ? end + 1 : end;
+  }
 
   if (!arg_in || !arg_out) {
     ExitWithArgError(argc, argv);
   }
+  if (profile && !PROFILER_ENABLED) {
+    fprintf(stderr, "--profile requires a build with make PROFILE=1\n");
+    return 1;
+  }
+  if (y4m_frames + y4m_animation + batch + (arg_renditions != nullptr) > 1) {
+    fprintf(stderr, "--y4m_frames, --y4m_animation, --batch and --renditions "
+            "are exclusive\n");
+    return 1;
+  }
+  if (info_json != nullptr &&
+      (y4m_frames || y4m_animation || batch || arg_renditions != nullptr)) {
+    fprintf(stderr, "--info_json only supports a single image\n");
+    return 1;
+  }
+  if ((cache || warm_start) && !batch) {
+    fprintf(stderr, "--cache, --cache_dir and --warm_start require --batch\n");
+    return 1;
+  }
+  if (warm_start && !cache) {
+    fprintf(stderr, "--warm_start requires --cache or --cache_dir\n");
+    return 1;
+  }
 
-  return pik::Compress(arg_in, butteraugli_distance, arg_out, fast_mode);
+  const bool use_distance = !params.fast_mode && params.target_bitrate == 0.0f;
+  params.butteraugli_distance = use_distance ? butteraugli_distance : -1;
+  int ret;
+  if (arg_renditions != nullptr) {
+    ret = pik::CompressRenditions(arg_in, arg_out, params, renditions);
+  } else if (y4m_frames) {
+    ret = pik::CompressFrames(arg_in, arg_out, params, frame_step);
+  } else if (y4m_animation) {
+    ret = pik::CompressAnimation(arg_in, arg_out, params, frame_step,
+                                 frame_duration);
+  } else if (batch) {
+    // Bounds the memory of the cache, not counting its directory.
+    const size_t kCacheBytes = size_t(256) << 20;
+    std::unique_ptr<pik::EncodeCache> encode_cache;
+    if (cache) {
+      encode_cache.reset(new pik::EncodeCache(
+          kCacheBytes, cache_dir == nullptr ? "" : cache_dir));
+    }
+    ret = pik::CompressBatch(arg_in, arg_out, params, jpeg_dct,
+                             encode_cache.get(), warm_start);
+  } else {
+    ret = pik::Compress(arg_in, arg_out, params, jpeg_dct, info_json);
+  }
+  if (profile) PROFILER_PRINT_RESULTS();
+  return ret;
 }
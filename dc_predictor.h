@@ -33,6 +33,7 @@
 
 #include "compiler_specific.h"
 #include "image.h"
+#include "thread_pool.h"
 
 namespace pik {
 
@@ -52,12 +53,16 @@ void ShrinkUV(const Image<DC>& dc_y, const Image<DC>& dc,
               Image<DC>* const PIK_RESTRICT residuals);
 
 // Reconstructs "dc" (previously passed to ShrinkY) using "residuals".
-void ExpandY(const Image<DC>& residuals, Image<DC>* const PIK_RESTRICT dc);
+// Each pixel only depends on causal neighbors, hence rows can be expanded in
+// a diagonal wavefront on the threads of "pool" (may be null). The result is
+// the same for any number of threads.
+void ExpandY(const Image<DC>& residuals, ThreadPool* pool,
+             Image<DC>* const PIK_RESTRICT dc);
 
 // Reconstructs "dc" (previously passed to ShrinkUV) using "residuals" and
-// "dc_y" (luminance).
+// "dc_y" (luminance). Same wavefront as ExpandY.
 void ExpandUV(const Image<DC>& dc_y, const Image<DC>& residuals,
-              Image<DC>* const PIK_RESTRICT dc);
+              ThreadPool* pool, Image<DC>* const PIK_RESTRICT dc);
 
 }  // namespace pik
 
@@ -0,0 +1,822 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiled once per instruction set; see dc_predictor_target_<target>.cc.
+
+#include "dc_predictor_target.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "compiler_specific.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Not the same as avg, which rounds rather than truncates!
+template <class V>
+static PIK_INLINE V Average(const V v0, const V v1) {
+  return (v0 + v1) >> 1;
+}
+
+// Clamps gradient to the min/max of n, w, l.
+template <class V>
+static PIK_INLINE V ClampedGradient(const V n, const V w, const V l) {
+  const V grad = n + w - l;
+  const V vmin = min(n, min(w, l));
+  const V vmax = max(n, max(w, l));
+  return min(max(vmin, grad), vmax);
+}
+
+#if SIMD_ENABLE_AVX2
+
+static PIK_INLINE i32x8 AbsResidual(const i32x8& c, const i32x8& pred) {
+  return i32x8(_mm256_abs_epi32(c - pred));
+}
+
+static PIK_INLINE u16x8 Costs16(const i32x8& costs) {
+  // Saturate to 16-bit for minpos.
+  return convert_to(uint16_t(), costs);
+}
+
+// Sliding window of "causal" (already decoded) pixels, plus simple functions
+// to predict the next pixel "c" from its neighbors: l n r
+// The single-letter names shorten identifiers.      w c
+//
+// Predictions are more accurate when the preceding w pixel is available, but
+// this interferes with SIMD because subsequent pixels depend on the decoding
+// of their predecessor. The encoder can compute residuals in parallel because
+// it knows all DC values up front, but its speed is less important. A diagonal
+// 'wavefront' order would allow computing multiple predictions efficiently,
+// but scattering those to the corresponding pixel positions would be slow.
+// Interleaving pixels by the lane count (eight pixels with x mod 8 = 0, etc)
+// would work if the two pixels before each prediction are already known, but
+// scattering lanes to multiples of 10 would also be slow.
+//
+// We instead compute the various predictors using SIMD, especially because
+// many of them are similar. Horizontal operations are generally inefficient,
+// but we take advantage of special hardware support for video codecs (minpos).
+//
+// The set of 8 predictors was chosen from a set of 16 as the combination that
+// minimized a simple model of encoding cost. Their order matters because
+// minpos(lanes) returns the lowest i with lanes[i] == min. We again retained
+// the permutation with the lowest encoding cost.
+class PixelNeighborsY {
+  using V = i32x8;
+
+ public:
+  // LoadT/StoreT/compute single Y values.
+  using T = i32x4;
+  using Costs = V;
+  static PIK_INLINE T LoadT(const DC* const PIK_RESTRICT row, const size_t x) {
+    return T(_mm_cvtsi32_si128(row[x]));
+  }
+
+  static PIK_INLINE void StoreT(const T dc, DC* const PIK_RESTRICT row,
+                                const size_t x) {
+    row[x] = _mm_cvtsi128_si32(dc);
+  }
+
+  static PIK_INLINE V Broadcast(const T dc) {
+    return V(_mm256_broadcastd_epi32(dc));
+  }
+
+  // Loads the neighborhood required for predicting at x = 2. This involves
+  // top/middle/bottom rows; if y = 1, row_t == row_m == Row(0).
+  PixelNeighborsY(const DC* const PIK_RESTRICT row_ym,
+                  const DC* const PIK_RESTRICT row_yb,
+                  const DC* const PIK_RESTRICT row_t,
+                  const DC* const PIK_RESTRICT row_m,
+                  const DC* const PIK_RESTRICT row_b) {
+    const V wl = set1(V(), row_m[0]);
+    const V ww = set1(V(), row_b[0]);
+    tl_ = set1(V(), row_t[1]);
+    tn_ = set1(V(), row_t[2]);
+    l_ = set1(V(), row_m[1]);
+    n_ = set1(V(), row_m[2]);
+    w_ = set1(V(), row_b[1]);
+    pred_w_ = Predict(l_, ww, wl, n_);
+  }
+
+  // Estimates "cost" for each predictor by comparing with known n and w.
+  PIK_INLINE V PredictorCosts(const size_t x,
+                              const DC* const PIK_RESTRICT row_ym,
+                              const DC* const PIK_RESTRICT row_yb,
+                              const DC* const PIK_RESTRICT row_t) {
+    const V tr(Broadcast(LoadT(row_t, x + 1)));
+    const V costs =
+        AbsResidual(n_, Predict(tn_, l_, tl_, tr)) + AbsResidual(w_, pred_w_);
+    tl_ = tn_;
+    tn_ = tr;
+    return costs;
+  }
+
+  // Returns predictor for pixel c with min cost and updates pred_w_.
+  PIK_INLINE T PredictC(const T r, const V costs) {
+    const u16x8 idx_min(_mm_minpos_epu16(Costs16(costs)));
+    const u32x8 index = u32x8(_mm256_broadcastd_epi32(idx_min)) >> 16;
+
+    const V pred_c = Predict(n_, w_, l_, Broadcast(r));
+    pred_w_ = pred_c;
+
+    const V best(_mm256_permutevar8x32_epi32(pred_c, index));
+    return T(_mm256_castsi256_si128(best));
+  }
+
+  PIK_INLINE void Advance(const T r, const T c) {
+    l_ = n_;
+    n_ = Broadcast(r);
+    w_ = Broadcast(c);
+  }
+
+ private:
+  // Eight predictors for luminance (decreases coded size by ~0.5% vs four)
+  // 0: Average(w, n);
+  // 1: Average(Average(w, r), n);
+  // 2: Average(n, r);
+  // 3: Average(w, l);
+  // 4: Average(l, n);
+  // 5: w;
+  // 6: PredClampedGrad(n, w, l);
+  // 7: n;
+  // All arguments are broadcasted.
+  static PIK_INLINE V Predict(const V n, const V w, const V l, const V r) {
+    const V rnrnrnrn(_mm256_unpacklo_epi32(n, r));
+    // "x" are invalid/don't care lanes.
+    const V xxxnwrwn(_mm256_unpacklo_epi32(rnrnrnrn, w));
+    const V p76xxxxxx(_mm256_unpacklo_epi32(ClampedGradient(n, w, l), n));
+    const V xxxnwrww(_mm256_blend_epi32(xxxnwrwn, w, 0x01));
+    const V p765xxxxx(_mm256_blend_epi32(p76xxxxxx, w, 0x20));
+    const V xxxllnrn(_mm256_blend_epi32(rnrnrnrn, l, 0x18));
+    // The first five predictors are averages; "a" needs another Average.
+    const V pxxx432a0 = Average(xxxllnrn, xxxnwrww);
+    const V pxxxxxx1x = Average(pxxx432a0, n);  // = A(A(w, r), n)
+    const V p765432x0(_mm256_blend_epi32(pxxx432a0, p765xxxxx, 0xE0));
+    return V(_mm256_blend_epi32(p765432x0, pxxxxxx1x, 0x02));
+  }
+
+  V tl_;
+  V tn_;
+  V n_;
+  V w_;
+  V l_;
+  // (30% overall speedup by reusing the current prediction as the next pred_w_)
+  V pred_w_;
+};
+
+// Providing separate sets of predictors for the luminance and chrominance bands
+// reduces the magnitude of residuals, but differentiating between the
+// chrominance bands does not.
+class PixelNeighborsUV {
+  using V = i32x8;
+
+ public:
+  // LoadT/StoreT/compute pairs of U, V.
+  using T = i32x4;
+  using Costs = V;
+
+  // Returns 00UV.
+  static PIK_INLINE T LoadT(const DC* const PIK_RESTRICT row, const size_t x) {
+    return T(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i * PIK_RESTRICT>(row + 2 * x)));
+  }
+
+  static PIK_INLINE void StoreT(const T uv, DC* const PIK_RESTRICT row,
+                                const size_t x) {
+    _mm_storel_epi64(reinterpret_cast<__m128i * PIK_RESTRICT>(row + 2 * x), uv);
+  }
+
+  PixelNeighborsUV(const DC* const PIK_RESTRICT row_ym,
+                   const DC* const PIK_RESTRICT row_yb,
+                   const DC* const PIK_RESTRICT row_t,
+                   const DC* const PIK_RESTRICT row_m,
+                   const DC* const PIK_RESTRICT row_b) {
+    yn_ = set1(V(), row_ym[2]);
+    yw_ = set1(V(), row_yb[1]);
+    yl_ = set1(V(), row_ym[1]);
+    n_ = LoadT(row_m, 2);
+    w_ = LoadT(row_b, 1);
+    l_ = LoadT(row_m, 1);
+  }
+
+  // Estimates "cost" for each predictor by comparing with known c from Y band.
+  PIK_INLINE V PredictorCosts(const size_t x,
+                              const DC* const PIK_RESTRICT row_ym,
+                              const DC* const PIK_RESTRICT row_yb,
+                              const DC* const PIK_RESTRICT) {
+    const V yr = set1(V(), row_ym[x + 1]);
+    const V yc = set1(V(), row_yb[x]);
+    const V costs = AbsResidual(yc, Predict(yn_, yw_, yl_, yr));
+    yl_ = yn_;
+    yn_ = yr;
+    yw_ = yc;
+    return costs;
+  }
+
+  // Returns predictor for pixel c with min cost.
+  PIK_INLINE T PredictC(const T r, const V costs) const {
+    const u16x8 idx_min(_mm_minpos_epu16(Costs16(costs)));
+    const u32x8 index = u32x8(_mm256_broadcastd_epi32(idx_min)) >> 16;
+
+    const V predictors_u =
+        Predict(BroadcastU(n_), BroadcastU(w_), BroadcastU(l_), BroadcastU(r));
+    const V predictors_v =
+        Predict(BroadcastV(n_), BroadcastV(w_), BroadcastV(l_), BroadcastV(r));
+    // permutevar is faster than store + load_ss.
+    const V best_u(_mm256_permutevar8x32_epi32(predictors_u, index));
+    const V best_v(_mm256_permutevar8x32_epi32(predictors_v, index));
+    const T best_u128(_mm256_castsi256_si128(best_u));
+    const T best_v128(_mm256_castsi256_si128(best_v));
+    return T(_mm_unpacklo_epi32(best_v128, best_u128));
+  }
+
+  PIK_INLINE void Advance(const T r, const T c) {
+    l_ = n_;
+    n_ = r;
+    w_ = c;
+  }
+
+ private:
+  static PIK_INLINE V BroadcastU(const T uv) {
+    const T u = shift_bytes_right<sizeof(DC)>(uv);
+    return V(_mm256_broadcastd_epi32(u));
+  }
+
+  static PIK_INLINE V BroadcastV(const T uv) {
+    return V(_mm256_broadcastd_epi32(uv));
+  }
+
+  // Eight predictors for chrominance:
+  // 0: ClampedGrad(n, w, l);
+  // 1: n;
+  // 2: Average2(n, w);
+  // 3: Average2(Average2(w, r), n);
+  // 4: w;
+  // 5: Average2(n, r);
+  // 6: Average2(w, l);
+  // 7: r;
+  // All arguments are broadcasted.
+  static PIK_INLINE V Predict(const V n, const V w, const V l, const V r) {
+    const V xxxxxxx0 = ClampedGradient(n, w, l);
+    // "x" lanes are unused.
+    const V xxxxxx10(_mm256_unpacklo_epi32(xxxxxxx0, n));
+    const V rwrwrwrw(_mm256_unpacklo_epi32(w, r));
+    const V xlrxrwxx(_mm256_blend_epi32(rwrwrwrw, l, 0x40));
+    const V xwnxwnxx(_mm256_blend_epi32(w, n, 0x24));
+    // "a" requires further averaging.
+    const V x65xa2xx = Average(xlrxrwxx, xwnxwnxx);
+    const V x65xa210(_mm256_blend_epi32(x65xa2xx, xxxxxx10, 0x03));
+    const V xxxx3xxx = Average(x65xa210, n);
+    const V x65x3210(_mm256_blend_epi32(x65xa210, xxxx3xxx, 0x08));
+    return V(_mm256_blend_epi32(x65x3210, rwrwrwrw, 0x90));
+  }
+
+  V yn_;
+  V yw_;
+  V yl_;
+  T n_;
+  T w_;
+  T l_;
+};
+
+#else  // !SIMD_ENABLE_AVX2
+
+// Portable versions of the above with the same predictors, costs and
+// tie-breaking, hence the same residuals.
+
+static PIK_INLINE DC ClampedGradient(const DC n, const DC w, const DC l) {
+  const DC grad = n + w - l;
+  const DC vmin = std::min(n, std::min(w, l));
+  const DC vmax = std::max(n, std::max(w, l));
+  return std::min(std::max(vmin, grad), vmax);
+}
+
+// Costs of the eight predictors.
+struct Costs8 {
+  DC cost[8];
+};
+
+// Returns the lowest i with the minimum cost after saturating to 16 bits, as
+// Costs16 and minpos do.
+static PIK_INLINE size_t IndexOfMinCost(const Costs8& costs) {
+  size_t index = 0;
+  DC min_cost = std::min(std::max(costs.cost[0], 0), 0xFFFF);
+  for (size_t i = 1; i < 8; ++i) {
+    const DC cost = std::min(std::max(costs.cost[i], 0), 0xFFFF);
+    if (cost < min_cost) {
+      min_cost = cost;
+      index = i;
+    }
+  }
+  return index;
+}
+
+class PixelNeighborsY {
+ public:
+  // LoadT/StoreT/compute single Y values.
+  using T = DC;
+  using Costs = Costs8;
+
+  static PIK_INLINE T LoadT(const DC* const PIK_RESTRICT row, const size_t x) {
+    return row[x];
+  }
+
+  static PIK_INLINE void StoreT(const T dc, DC* const PIK_RESTRICT row,
+                                const size_t x) {
+    row[x] = dc;
+  }
+
+  // Loads the neighborhood required for predicting at x = 2. This involves
+  // top/middle/bottom rows; if y = 1, row_t == row_m == Row(0).
+  PixelNeighborsY(const DC* const PIK_RESTRICT row_ym,
+                  const DC* const PIK_RESTRICT row_yb,
+                  const DC* const PIK_RESTRICT row_t,
+                  const DC* const PIK_RESTRICT row_m,
+                  const DC* const PIK_RESTRICT row_b) {
+    const DC wl = row_m[0];
+    const DC ww = row_b[0];
+    tl_ = row_t[1];
+    tn_ = row_t[2];
+    l_ = row_m[1];
+    n_ = row_m[2];
+    w_ = row_b[1];
+    Predict(l_, ww, wl, n_, pred_w_);
+  }
+
+  // Estimates "cost" for each predictor by comparing with known n and w.
+  PIK_INLINE Costs PredictorCosts(const size_t x,
+                                  const DC* const PIK_RESTRICT row_ym,
+                                  const DC* const PIK_RESTRICT row_yb,
+                                  const DC* const PIK_RESTRICT row_t) {
+    const DC tr = row_t[x + 1];
+    DC pred_n[8];
+    Predict(tn_, l_, tl_, tr, pred_n);
+    Costs costs;
+    for (size_t i = 0; i < 8; ++i) {
+      costs.cost[i] = abs(n_ - pred_n[i]) + abs(w_ - pred_w_[i]);
+    }
+    tl_ = tn_;
+    tn_ = tr;
+    return costs;
+  }
+
+  // Returns predictor for pixel c with min cost and updates pred_w_.
+  PIK_INLINE T PredictC(const T r, const Costs& costs) {
+    Predict(n_, w_, l_, r, pred_w_);
+    return pred_w_[IndexOfMinCost(costs)];
+  }
+
+  PIK_INLINE void Advance(const T r, const T c) {
+    l_ = n_;
+    n_ = r;
+    w_ = c;
+  }
+
+ private:
+  // Same order as the AVX2 PixelNeighborsY::Predict.
+  static PIK_INLINE void Predict(const DC n, const DC w, const DC l,
+                                 const DC r, DC* const PIK_RESTRICT pred) {
+    pred[0] = Average(w, n);
+    pred[1] = Average(Average(w, r), n);
+    pred[2] = Average(n, r);
+    pred[3] = Average(w, l);
+    pred[4] = Average(l, n);
+    pred[5] = w;
+    pred[6] = ClampedGradient(n, w, l);
+    pred[7] = n;
+  }
+
+  DC tl_;
+  DC tn_;
+  DC n_;
+  DC w_;
+  DC l_;
+  DC pred_w_[8];
+};
+
+// Interleaved DC of the two chrominance bands, in the order of the row.
+struct PairUV {
+  PIK_INLINE PairUV operator+(const PairUV other) const {
+    return PairUV{dc[0] + other.dc[0], dc[1] + other.dc[1]};
+  }
+  PIK_INLINE PairUV operator-(const PairUV other) const {
+    return PairUV{dc[0] - other.dc[0], dc[1] - other.dc[1]};
+  }
+
+  DC dc[2];
+};
+
+class PixelNeighborsUV {
+ public:
+  // LoadT/StoreT/compute pairs of U, V.
+  using T = PairUV;
+  using Costs = Costs8;
+
+  static PIK_INLINE T LoadT(const DC* const PIK_RESTRICT row, const size_t x) {
+    return PairUV{{row[2 * x], row[2 * x + 1]}};
+  }
+
+  static PIK_INLINE void StoreT(const T uv, DC* const PIK_RESTRICT row,
+                                const size_t x) {
+    row[2 * x] = uv.dc[0];
+    row[2 * x + 1] = uv.dc[1];
+  }
+
+  PixelNeighborsUV(const DC* const PIK_RESTRICT row_ym,
+                   const DC* const PIK_RESTRICT row_yb,
+                   const DC* const PIK_RESTRICT row_t,
+                   const DC* const PIK_RESTRICT row_m,
+                   const DC* const PIK_RESTRICT row_b) {
+    yn_ = row_ym[2];
+    yw_ = row_yb[1];
+    yl_ = row_ym[1];
+    n_ = LoadT(row_m, 2);
+    w_ = LoadT(row_b, 1);
+    l_ = LoadT(row_m, 1);
+  }
+
+  // Estimates "cost" for each predictor by comparing with known c from Y band.
+  PIK_INLINE Costs PredictorCosts(const size_t x,
+                                  const DC* const PIK_RESTRICT row_ym,
+                                  const DC* const PIK_RESTRICT row_yb,
+                                  const DC* const PIK_RESTRICT) {
+    const DC yr = row_ym[x + 1];
+    const DC yc = row_yb[x];
+    DC pred_y[8];
+    Predict(yn_, yw_, yl_, yr, pred_y);
+    Costs costs;
+    for (size_t i = 0; i < 8; ++i) {
+      costs.cost[i] = abs(yc - pred_y[i]);
+    }
+    yl_ = yn_;
+    yn_ = yr;
+    yw_ = yc;
+    return costs;
+  }
+
+  // Returns predictor for pixel c with min cost.
+  PIK_INLINE T PredictC(const T r, const Costs& costs) const {
+    const size_t index = IndexOfMinCost(costs);
+    PairUV best;
+    for (size_t c = 0; c < 2; ++c) {
+      DC pred[8];
+      Predict(n_.dc[c], w_.dc[c], l_.dc[c], r.dc[c], pred);
+      best.dc[c] = pred[index];
+    }
+    return best;
+  }
+
+  PIK_INLINE void Advance(const T r, const T c) {
+    l_ = n_;
+    n_ = r;
+    w_ = c;
+  }
+
+ private:
+  // Same order as the AVX2 PixelNeighborsUV::Predict.
+  static PIK_INLINE void Predict(const DC n, const DC w, const DC l,
+                                 const DC r, DC* const PIK_RESTRICT pred) {
+    pred[0] = ClampedGradient(n, w, l);
+    pred[1] = n;
+    pred[2] = Average(n, w);
+    pred[3] = Average(Average(w, r), n);
+    pred[4] = w;
+    pred[5] = Average(n, r);
+    pred[6] = Average(w, l);
+    pred[7] = r;
+  }
+
+  DC yn_;
+  DC yw_;
+  DC yl_;
+  T n_;
+  T w_;
+  T l_;
+};
+
+#endif  // SIMD_ENABLE_AVX2
+
+// Number of pixels per row between synchronizations of a wavefront.
+static constexpr size_t kWavefrontInterval = 128;
+
+// Synchronizes the expansion of a row with that of the preceding row, which
+// may run on another thread. Both pointers may be null (serial expansion).
+class RowSync {
+ public:
+  RowSync(const std::atomic<size_t>* above, std::atomic<size_t>* row)
+      : above_(above), row_(row) {}
+
+  // Blocks until pixels [0, x_end) of the preceding row are expanded.
+  PIK_INLINE void Wait(const size_t x_end) const {
+    if (above_ == nullptr) return;
+    while (above_->load(std::memory_order_acquire) < x_end) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Indicates pixels [0, x_end) of this row are expanded.
+  PIK_INLINE void Publish(const size_t x_end) const {
+    if (row_ == nullptr) return;
+    row_->store(x_end, std::memory_order_release);
+  }
+
+ private:
+  const std::atomic<size_t>* above_;
+  std::atomic<size_t>* row_;
+};
+
+// Computes residuals of a fixed predictor (the preceding pixel W).
+// Useful for Row(0) because no preceding row is required.
+template <class N>
+struct FixedW {
+  static PIK_INLINE void Shrink(const size_t xsize,
+                                const DC* const PIK_RESTRICT dc,
+                                DC* const PIK_RESTRICT residuals) {
+    N::StoreT(N::LoadT(dc, 0), residuals, 0);
+    for (size_t x = 1; x < xsize; ++x) {
+      N::StoreT(N::LoadT(dc, x) - N::LoadT(dc, x - 1), residuals, x);
+    }
+  }
+
+  static PIK_INLINE void Expand(const size_t xsize,
+                                const DC* const PIK_RESTRICT residuals,
+                                DC* const PIK_RESTRICT dc) {
+    N::StoreT(N::LoadT(residuals, 0), dc, 0);
+    for (size_t x = 1; x < xsize; ++x) {
+      N::StoreT(N::LoadT(dc, x - 1) + N::LoadT(residuals, x), dc, x);
+    }
+  }
+};
+
+// Predicts x = 0 with n, x = 1 with w; this decreases the overall abs
+// residuals by 6% vs FixedW, which stores the first coefficient directly.
+template <class N>
+struct LeftBorder2 {
+  static PIK_INLINE void Shrink(const size_t xsize,
+                                const DC* const PIK_RESTRICT row_m,
+                                const DC* const PIK_RESTRICT row_b,
+                                DC* const PIK_RESTRICT residuals) {
+    N::StoreT(N::LoadT(row_b, 0) - N::LoadT(row_m, 0), residuals, 0);
+    if (xsize >= 2) {
+      // TODO(user): Clamped gradient should be slightly better here.
+      N::StoreT(N::LoadT(row_b, 1) - N::LoadT(row_b, 0), residuals, 1);
+    }
+  }
+
+  static PIK_INLINE void Expand(const size_t xsize,
+                                const DC* const PIK_RESTRICT residuals,
+                                const DC* const PIK_RESTRICT row_m,
+                                DC* const PIK_RESTRICT row_b) {
+    N::StoreT(N::LoadT(row_m, 0) + N::LoadT(residuals, 0), row_b, 0);
+    if (xsize >= 2) {
+      N::StoreT(N::LoadT(row_b, 0) + N::LoadT(residuals, 1), row_b, 1);
+    }
+  }
+};
+
+// Predicts the final x with w, necessary because PixelNeighbors* require "r".
+template <class N>
+struct RightBorder1 {
+  static PIK_INLINE void Shrink(const size_t xsize,
+                                const DC* const PIK_RESTRICT dc,
+                                DC* const PIK_RESTRICT residuals) {
+    // TODO(user): Clamped gradient should be slightly better here.
+    if (xsize >= 2) {
+      const auto res = N::LoadT(dc, xsize - 1) - N::LoadT(dc, xsize - 2);
+      N::StoreT(res, residuals, xsize - 1);
+    }
+  }
+
+  static PIK_INLINE void Expand(const size_t xsize,
+                                const DC* const PIK_RESTRICT residuals,
+                                DC* const PIK_RESTRICT dc) {
+    if (xsize >= 2) {
+      const auto uv = N::LoadT(dc, xsize - 2) + N::LoadT(residuals, xsize - 1);
+      N::StoreT(uv, dc, xsize - 1);
+    }
+  }
+};
+
+// Selects predictor based upon its error at the prior n and w pixels.
+// Requires two preceding rows (t, m) and the current row b. The row_y*
+// pointers are unused and may be null if N = PixelNeighborsY.
+template <class N>
+class Adaptive {
+  using T = typename N::T;
+
+ public:
+  static void Shrink(const size_t xsize, const DC* const PIK_RESTRICT row_ym,
+                     const DC* const PIK_RESTRICT row_yb,
+                     const DC* const PIK_RESTRICT row_t,
+                     const DC* const PIK_RESTRICT row_m,
+                     const DC* const PIK_RESTRICT row_b,
+                     DC* const PIK_RESTRICT residuals) {
+    LeftBorder2<N>::Shrink(xsize, row_m, row_b, residuals);
+
+    ForeachPrediction(xsize, row_ym, row_yb, row_t, row_m, row_b,
+                      RowSync(nullptr, nullptr),
+                      [row_b, residuals](const size_t x, const T pred) {
+                        const T c = N::LoadT(row_b, x);
+                        N::StoreT(c - pred, residuals, x);
+                        return c;
+                      });
+
+    RightBorder1<N>::Shrink(xsize, row_b, residuals);
+  }
+
+  // "sync" refers to row_m; row_t is complete once row_m is.
+  static void Expand(const size_t xsize, const DC* const PIK_RESTRICT row_ym,
+                     const DC* const PIK_RESTRICT row_yb,
+                     const DC* const PIK_RESTRICT residuals,
+                     const DC* const PIK_RESTRICT row_t,
+                     const DC* const PIK_RESTRICT row_m,
+                     DC* const PIK_RESTRICT row_b, const RowSync& sync) {
+    // LeftBorder2 and the PixelNeighbors* constructors read up to x = 2.
+    sync.Wait(std::min<size_t>(xsize, 3));
+    LeftBorder2<N>::Expand(xsize, residuals, row_m, row_b);
+
+    ForeachPrediction(xsize, row_ym, row_yb, row_t, row_m, row_b, sync,
+                      [row_b, residuals](const size_t x, const T pred) {
+                        const T c = pred + N::LoadT(residuals, x);
+                        N::StoreT(c, row_b, x);
+                        return c;
+                      });
+
+    RightBorder1<N>::Expand(xsize, residuals, row_b);
+    sync.Publish(xsize);
+  }
+
+ private:
+  // "Func" returns the current pixel, dc[x].
+  template <class Func>
+  static PIK_INLINE void ForeachPrediction(const size_t xsize,
+                                           const DC* const PIK_RESTRICT row_ym,
+                                           const DC* const PIK_RESTRICT row_yb,
+                                           const DC* const PIK_RESTRICT row_t,
+                                           const DC* const PIK_RESTRICT row_m,
+                                           const DC* const PIK_RESTRICT row_b,
+                                           const RowSync& sync,
+                                           const Func& func) {
+    if (xsize < 2) {
+      return;  // Avoid out of bounds reads.
+    }
+    N neighbors(row_ym, row_yb, row_t, row_m, row_b);
+    // PixelNeighborsY uses w at x - 1 => two pixel margin.
+    size_t x = 2;
+    while (x < xsize - 1) {
+      const size_t x_end = std::min(x + kWavefrontInterval, xsize - 1);
+      // Predicting x_end - 1 reads r = row_m[x_end].
+      sync.Wait(x_end + 1);
+      for (; x < x_end; ++x) {
+        const T r = N::LoadT(row_m, x + 1);
+        const typename N::Costs costs =
+            neighbors.PredictorCosts(x, row_ym, row_yb, row_t);
+        const T pred_c = neighbors.PredictC(r, costs);
+        const T c = func(x, pred_c);
+        neighbors.Advance(r, c);
+      }
+      sync.Publish(x_end);
+    }
+  }
+};
+
+
+void ShrinkY(const Image<DC>& dc, Image<DC>* const PIK_RESTRICT residuals) {
+  const size_t xsize = dc.xsize();
+  const size_t ysize = dc.ysize();
+
+  FixedW<PixelNeighborsY>::Shrink(xsize, dc.Row(0), residuals->Row(0));
+
+  if (ysize >= 2) {
+    // Only one previous row, so row_t == row_m.
+    Adaptive<PixelNeighborsY>::Shrink(xsize, nullptr, nullptr, dc.Row(0),
+                                      dc.Row(0), dc.Row(1), residuals->Row(1));
+  }
+
+  for (size_t y = 2; y < ysize; ++y) {
+    Adaptive<PixelNeighborsY>::Shrink(xsize, nullptr, nullptr, dc.Row(y - 2),
+                                      dc.Row(y - 1), dc.Row(y),
+                                      residuals->Row(y));
+  }
+}
+
+void ShrinkUV(const Image<DC>& dc_y, const Image<DC>& dc,
+              Image<DC>* const PIK_RESTRICT residuals) {
+  const size_t xsize = dc.xsize() / 2;
+  const size_t ysize = dc.ysize();
+
+  FixedW<PixelNeighborsUV>::Shrink(xsize, dc.Row(0), residuals->Row(0));
+
+  if (ysize >= 2) {
+    // Only one previous row, so row_t == row_m.
+    Adaptive<PixelNeighborsUV>::Shrink(xsize, dc_y.Row(0), dc_y.Row(1),
+                                       dc.Row(0), dc.Row(0), dc.Row(1),
+                                       residuals->Row(1));
+  }
+
+  for (size_t y = 2; y < ysize; ++y) {
+    Adaptive<PixelNeighborsUV>::Shrink(xsize, dc_y.Row(y - 1), dc_y.Row(y),
+                                       dc.Row(y - 2), dc.Row(y - 1), dc.Row(y),
+                                       residuals->Row(y));
+  }
+}
+
+// Calls expand_row(y, sync) for all rows y in increasing order, or in a
+// wavefront: rows are interleaved across the threads of "pool" and each row
+// only runs up to kWavefrontInterval pixels behind the preceding one.
+template <class Func>
+void ForeachRow(const size_t xsize, const size_t ysize, ThreadPool* pool,
+                const Func& expand_row) {
+  const int num_threads = pool == nullptr ? 1 : pool->NumThreads();
+  if (num_threads == 1 || ysize < 2 || xsize < 2 * kWavefrontInterval) {
+    for (size_t y = 0; y < ysize; ++y) {
+      expand_row(y, RowSync(nullptr, nullptr));
+    }
+    return;
+  }
+
+  std::unique_ptr<std::atomic<size_t>[]> progress(
+      new std::atomic<size_t>[ysize]);
+  for (size_t y = 0; y < ysize; ++y) {
+    progress[y].store(0, std::memory_order_relaxed);
+  }
+  // Each task only waits for rows of the task before it, and all tasks run
+  // concurrently because there is one per thread.
+  pool->Run(0, num_threads, [&](const int task, const int thread) {
+    for (size_t y = task; y < ysize; y += num_threads) {
+      const std::atomic<size_t>* above = y == 0 ? nullptr : &progress[y - 1];
+      expand_row(y, RowSync(above, &progress[y]));
+    }
+  });
+}
+
+void ExpandY(const Image<DC>& residuals, ThreadPool* pool,
+             Image<DC>* const PIK_RESTRICT dc) {
+  const size_t xsize = dc->xsize();
+  const size_t ysize = dc->ysize();
+
+  ForeachRow(xsize, ysize, pool, [&](const size_t y, const RowSync& sync) {
+    if (y == 0) {
+      FixedW<PixelNeighborsY>::Expand(xsize, residuals.Row(0), dc->Row(0));
+      sync.Publish(xsize);
+    } else {
+      // Only one previous row for y = 1, so row_t == row_m.
+      const size_t y_t = y == 1 ? 0 : y - 2;
+      Adaptive<PixelNeighborsY>::Expand(
+          xsize, nullptr, nullptr, residuals.Row(y), dc->ConstRow(y_t),
+          dc->ConstRow(y - 1), dc->Row(y), sync);
+    }
+  });
+}
+
+void ExpandUV(const Image<DC>& dc_y, const Image<DC>& residuals,
+              ThreadPool* pool, Image<DC>* const PIK_RESTRICT dc) {
+  const size_t xsize = dc->xsize() / 2;
+  const size_t ysize = dc->ysize();
+
+  ForeachRow(xsize, ysize, pool, [&](const size_t y, const RowSync& sync) {
+    if (y == 0) {
+      FixedW<PixelNeighborsUV>::Expand(xsize, residuals.Row(0), dc->Row(0));
+      sync.Publish(xsize);
+    } else {
+      const size_t y_t = y == 1 ? 0 : y - 2;
+      Adaptive<PixelNeighborsUV>::Expand(
+          xsize, dc_y.Row(y - 1), dc_y.Row(y), residuals.Row(y),
+          dc->ConstRow(y_t), dc->ConstRow(y - 1), dc->Row(y), sync);
+    }
+  });
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+// Instantiate for the current target.
+template <>
+DCPredictorFunctions DCPredictorFunctionsForTarget::operator()<SIMD_TARGET>()
+    const {
+  DCPredictorFunctions functions;
+  functions.shrink_y = &SIMD_NAMESPACE::ShrinkY;
+  functions.shrink_uv = &SIMD_NAMESPACE::ShrinkUV;
+  functions.expand_y = &SIMD_NAMESPACE::ExpandY;
+  functions.expand_uv = &SIMD_NAMESPACE::ExpandUV;
+  return functions;
+}
+
+}  // namespace pik
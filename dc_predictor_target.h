@@ -0,0 +1,46 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DC_PREDICTOR_TARGET_H_
+#define DC_PREDICTOR_TARGET_H_
+
+// Per-instruction-set implementations of the functions in dc_predictor.h.
+// Only dc_predictor.cc should include this.
+
+#include "dc_predictor.h"
+
+namespace pik {
+
+// Same semantics as the dc_predictor.h functions of the same name.
+struct DCPredictorFunctions {
+  void (*shrink_y)(const Image<DC>& dc, Image<DC>* residuals);
+  void (*shrink_uv)(const Image<DC>& dc_y, const Image<DC>& dc,
+                    Image<DC>* residuals);
+  void (*expand_y)(const Image<DC>& residuals, ThreadPool* pool,
+                   Image<DC>* dc);
+  void (*expand_uv)(const Image<DC>& dc_y, const Image<DC>& residuals,
+                    ThreadPool* pool, Image<DC>* dc);
+};
+
+// Call via KernelTable<DCPredictorFunctionsForTarget>. operator()<SIMD_TARGET>
+// is specialized in dc_predictor_target.cc, which is compiled once per
+// instruction set (dc_predictor_target_<target>.cc).
+struct DCPredictorFunctionsForTarget {
+  template <class Target>
+  DCPredictorFunctions operator()() const;
+};
+
+}  // namespace pik
+
+#endif  // DC_PREDICTOR_TARGET_H_
@@ -0,0 +1,2 @@
+#define SIMD_ENABLE 6  // SSE4 + AVX2
+#include "dc_predictor_target.cc"
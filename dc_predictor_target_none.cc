@@ -0,0 +1,2 @@
+// SIMD_ENABLE undefined, defaults to zero.
+#include "dc_predictor_target.cc"
@@ -15,6 +15,8 @@
 #ifndef DCT_H_
 #define DCT_H_
 
+#include <stddef.h>
+
 namespace pik {
 
 // Computes the in-place 8x8 DCT of block.
@@ -51,6 +53,17 @@ static const float kIDCTScales[8] = {
 // Requires that block is 32-bytes aligned.
 void ComputeTransposedScaledBlockDCTFloat(float block[64]);
 
+// Same as ComputeTransposedScaledBlockDCTFloat() for eight horizontally
+// adjacent blocks, read directly from image rows: pixel (x, y) of block b is
+// rows[y][8 * b + x]. If "subtract" is non-null, subtract[b * block_stride +
+// 8 * y + x] is first subtracted from that pixel. The result for block b is
+// written to to[b * block_stride + k], k in [0, 64). "to" and "subtract" must
+// be 32-byte aligned and "block_stride" a multiple of 8. Produces exactly the
+// same values as copying each block and calling the single-block version.
+void ComputeTransposedScaledBlockDCTFloat8(const float* const rows[8],
+                                           const float* subtract,
+                                           size_t block_stride, float* to);
+
 // Same as ComputeBlockIDCTFloat(), but the input is first transformed with
 // the following:
 //   block'[8 * ky + kx] =
@@ -58,6 +71,9 @@ void ComputeTransposedScaledBlockDCTFloat(float block[64]);
 // Requires that block is 32-bytes aligned.
 void ComputeTransposedScaledBlockIDCTFloat(float block[64]);
 
+// The functions above produce the same values with every instruction set
+// (see kernel_targets.h).
+
 }  // namespace pik
 
 #endif  // DCT_H_
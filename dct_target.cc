@@ -0,0 +1,290 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiled once per instruction set; see dct_target_<target>.cc.
+
+#include "dct_target.h"
+
+#include <math.h>
+
+#include "compiler_specific.h"
+#include "dct.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// Column passes process kLanes columns at a time. With AVX2, a vector holds an
+// entire block row.
+using V = vec<float>;
+constexpr size_t kLanes = NumLanes<V>::value;
+static_assert(8 % kLanes == 0, "Block rows must consist of whole vectors");
+
+// The results must not depend on the instruction set (see dct.h), hence the
+// multiply-adds are fused on all targets and the compiler must not fuse any
+// others (-ffp-contract=off). Without FMA instructions, the lanes are computed
+// with fmaf, which is slow but only used on CPUs that lack AVX2.
+#if SIMD_ENABLE_AVX2
+PIK_INLINE V MulAdd(const V mul, const V x, const V add) {
+  return mul_add(mul, x, add);
+}
+PIK_INLINE V MulSub(const V mul, const V x, const V sub) {
+  return mul_sub(mul, x, sub);
+}
+#else
+PIK_INLINE V MulAdd(const V mul, const V x, const V add) {
+  SIMD_ALIGN float lanes[3][kLanes];
+  store(mul, lanes[0]);
+  store(x, lanes[1]);
+  store(add, lanes[2]);
+  for (size_t i = 0; i < kLanes; ++i) {
+    lanes[0][i] = fmaf(lanes[0][i], lanes[1][i], lanes[2][i]);
+  }
+  return load(V(), lanes[0]);
+}
+PIK_INLINE V MulSub(const V mul, const V x, const V sub) {
+  return MulAdd(mul, x, setzero(V()) - sub);
+}
+#endif
+
+#if SIMD_ENABLE_AVX2
+PIK_INLINE void TransposeBlock(float block[64]) {
+  const V p0 = load(V(), &block[0]);
+  const V p1 = load(V(), &block[8]);
+  const V p2 = load(V(), &block[16]);
+  const V p3 = load(V(), &block[24]);
+  const V p4 = load(V(), &block[32]);
+  const V p5 = load(V(), &block[40]);
+  const V p6 = load(V(), &block[48]);
+  const V p7 = load(V(), &block[56]);
+  const V q0 = interleave_lo(p0, p2);
+  const V q1 = interleave_lo(p1, p3);
+  const V q2 = interleave_hi(p0, p2);
+  const V q3 = interleave_hi(p1, p3);
+  const V q4 = interleave_lo(p4, p6);
+  const V q5 = interleave_lo(p5, p7);
+  const V q6 = interleave_hi(p4, p6);
+  const V q7 = interleave_hi(p5, p7);
+  const V r0 = interleave_lo(q0, q1);
+  const V r1 = interleave_hi(q0, q1);
+  const V r2 = interleave_lo(q2, q3);
+  const V r3 = interleave_hi(q2, q3);
+  const V r4 = interleave_lo(q4, q5);
+  const V r5 = interleave_hi(q4, q5);
+  const V r6 = interleave_lo(q6, q7);
+  const V r7 = interleave_hi(q6, q7);
+  store(V(_mm256_permute2f128_ps(r0, r4, 0x20)), &block[0]);
+  store(V(_mm256_permute2f128_ps(r1, r5, 0x20)), &block[8]);
+  store(V(_mm256_permute2f128_ps(r2, r6, 0x20)), &block[16]);
+  store(V(_mm256_permute2f128_ps(r3, r7, 0x20)), &block[24]);
+  store(V(_mm256_permute2f128_ps(r0, r4, 0x31)), &block[32]);
+  store(V(_mm256_permute2f128_ps(r1, r5, 0x31)), &block[40]);
+  store(V(_mm256_permute2f128_ps(r2, r6, 0x31)), &block[48]);
+  store(V(_mm256_permute2f128_ps(r3, r7, 0x31)), &block[56]);
+}
+#else
+PIK_INLINE void TransposeBlock(float block[64]) {
+  for (int y = 0; y < 8; ++y) {
+    for (int x = y + 1; x < 8; ++x) {
+      const float tmp = block[8 * y + x];
+      block[8 * y + x] = block[8 * x + y];
+      block[8 * x + y] = tmp;
+    }
+  }
+}
+#endif
+
+// Transforms the kLanes columns starting at "columns" (within a block).
+PIK_INLINE void ColumnIDCTLanes(float* PIK_RESTRICT columns) {
+  const V i0 = load(V(), &columns[0]);
+  const V i1 = load(V(), &columns[8]);
+  const V i2 = load(V(), &columns[16]);
+  const V i3 = load(V(), &columns[24]);
+  const V i4 = load(V(), &columns[32]);
+  const V i5 = load(V(), &columns[40]);
+  const V i6 = load(V(), &columns[48]);
+  const V i7 = load(V(), &columns[56]);
+  const V c1 = set1(V(), 1.41421356237310f);
+  const V c2 = set1(V(), 0.76536686473018f);
+  const V c3 = set1(V(), 2.61312592975275f);
+  const V c4 = set1(V(), 1.08239220029239f);
+  const V t00 = i0 + i4;
+  const V t01 = i0 - i4;
+  const V t02 = i2 + i6;
+  const V t03 = i2 - i6;
+  const V t04 = i1 + i7;
+  const V t05 = i1 - i7;
+  const V t06 = i5 + i3;
+  const V t07 = i5 - i3;
+  const V t08 = t04 + t06;
+  const V t09 = t04 - t06;
+  const V t10 = t00 + t02;
+  const V t11 = t00 - t02;
+  const V t12 = t05 + t07;
+  const V t13 = c2 * t12;
+  const V t14 = MulSub(c1, t03, t02);
+  const V t15 = t01 + t14;
+  const V t16 = t01 - t14;
+  const V t17 = MulSub(c3, t05, t13);
+  const V t18 = MulAdd(c4, t07, t13);
+  const V t19 = t17 - t08;
+  const V t20 = MulSub(c1, t09, t19);
+  const V t21 = t18 - t20;
+  store(t10 + t08, &columns[0]);
+  store(t15 + t19, &columns[8]);
+  store(t16 + t20, &columns[16]);
+  store(t11 + t21, &columns[24]);
+  store(t11 - t21, &columns[32]);
+  store(t16 - t20, &columns[40]);
+  store(t15 - t19, &columns[48]);
+  store(t10 - t08, &columns[56]);
+}
+
+// Stores the 1-D DCT of the eight rows i0..i7 to the rows of the kLanes
+// columns starting at "columns".
+PIK_INLINE void ColumnDCT(const V i0, const V i1, const V i2, const V i3,
+                          const V i4, const V i5, const V i6, const V i7,
+                          float* PIK_RESTRICT columns) {
+  const V c1 = set1(V(), 0.707106781186548f);
+  const V c2 = set1(V(), 0.382683432365090f);
+  const V c3 = set1(V(), 1.30656296487638f);
+  const V c4 = set1(V(), 0.541196100146197f);
+  const V t00 = i0 + i7;
+  const V t01 = i0 - i7;
+  const V t02 = i3 + i4;
+  const V t03 = i3 - i4;
+  const V t04 = i2 + i5;
+  const V t05 = i2 - i5;
+  const V t06 = i1 + i6;
+  const V t07 = i1 - i6;
+  const V t08 = t00 + t02;
+  const V t09 = t00 - t02;
+  const V t10 = t06 + t04;
+  const V t11 = t06 - t04;
+  const V t12 = t07 + t05;
+  const V t13 = t01 + t07;
+  const V t14 = t05 + t03;
+  const V t15 = t11 + t09;
+  const V t16 = t13 - t14;
+  const V t17 = c1 * t15;
+  const V t18 = c1 * t12;
+  const V t19 = c2 * t16;
+  const V t20 = t01 + t18;
+  const V t21 = t01 - t18;
+  const V t22 = MulSub(c3, t13, t19);
+  const V t23 = MulSub(c4, t14, t19);
+  store(t08 + t10, &columns[0]);
+  store(t20 + t22, &columns[8]);
+  store(t09 + t17, &columns[16]);
+  store(t21 - t23, &columns[24]);
+  store(t08 - t10, &columns[32]);
+  store(t21 + t23, &columns[40]);
+  store(t09 - t17, &columns[48]);
+  store(t20 - t22, &columns[56]);
+}
+
+PIK_INLINE void ColumnDCTLanes(float* PIK_RESTRICT columns) {
+  ColumnDCT(load(V(), &columns[0]), load(V(), &columns[8]),
+            load(V(), &columns[16]), load(V(), &columns[24]),
+            load(V(), &columns[32]), load(V(), &columns[40]),
+            load(V(), &columns[48]), load(V(), &columns[56]), columns);
+}
+
+PIK_INLINE void ColumnDCT(float block[64]) {
+  for (size_t x = 0; x < 8; x += kLanes) {
+    ColumnDCTLanes(block + x);
+  }
+}
+
+PIK_INLINE void ColumnIDCT(float block[64]) {
+  for (size_t x = 0; x < 8; x += kLanes) {
+    ColumnIDCTLanes(block + x);
+  }
+}
+
+void TransposedScaledDCT(float block[64]) {
+  ColumnDCT(block);
+  TransposeBlock(block);
+  ColumnDCT(block);
+}
+
+void TransposedScaledDCT8(const float* const rows[8],
+                          const float* const PIK_RESTRICT subtract,
+                          const size_t block_stride,
+                          float* const PIK_RESTRICT to) {
+  for (int b = 0; b < 8; ++b) {
+    float* const PIK_RESTRICT block = to + b * block_stride;
+    // The first pass reads the pixels directly, hence no copy is needed.
+    for (size_t x = 0; x < 8; x += kLanes) {
+      V in[8];
+      for (int y = 0; y < 8; ++y) {
+        in[y] = load_unaligned(V(), rows[y] + 8 * b + x);
+      }
+      if (subtract != nullptr) {
+        const float* const PIK_RESTRICT sub = subtract + b * block_stride;
+        for (int y = 0; y < 8; ++y) {
+          in[y] -= load(V(), sub + 8 * y + x);
+        }
+      }
+      ColumnDCT(in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7],
+                block + x);
+    }
+    TransposeBlock(block);
+    ColumnDCT(block);
+  }
+}
+
+void TransposedScaledIDCT(float block[64]) {
+  ColumnIDCT(block);
+  TransposeBlock(block);
+  ColumnIDCT(block);
+}
+
+void BlockDCT(float block[64]) {
+  TransposedScaledDCT(block);
+  TransposeBlock(block);
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 8; ++x) {
+      block[8 * y + x] /= 64.0f * kIDCTScales[y] * kIDCTScales[x];
+    }
+  }
+}
+
+void BlockIDCT(float block[64]) {
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 8; ++x) {
+      block[8 * y + x] *= kIDCTScales[y] * kIDCTScales[x];
+    }
+  }
+  TransposeBlock(block);
+  TransposedScaledIDCT(block);
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+// Instantiate for the current target.
+template <>
+DCTFunctions DCTFunctionsForTarget::operator()<SIMD_TARGET>() const {
+  DCTFunctions functions;
+  functions.block_dct = &SIMD_NAMESPACE::BlockDCT;
+  functions.block_idct = &SIMD_NAMESPACE::BlockIDCT;
+  functions.transposed_scaled_dct = &SIMD_NAMESPACE::TransposedScaledDCT;
+  functions.transposed_scaled_dct8 = &SIMD_NAMESPACE::TransposedScaledDCT8;
+  functions.transposed_scaled_idct = &SIMD_NAMESPACE::TransposedScaledIDCT;
+  return functions;
+}
+
+}  // namespace pik
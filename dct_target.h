@@ -0,0 +1,46 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DCT_TARGET_H_
+#define DCT_TARGET_H_
+
+// Per-instruction-set implementations of the functions in dct.h. Only dct.cc
+// (and benchmarks) should include this.
+
+#include <stddef.h>
+
+namespace pik {
+
+// Same semantics as the dct.h functions of the same name.
+struct DCTFunctions {
+  void (*block_dct)(float block[64]);
+  void (*block_idct)(float block[64]);
+  void (*transposed_scaled_dct)(float block[64]);
+  void (*transposed_scaled_dct8)(const float* const rows[8],
+                                 const float* subtract, size_t block_stride,
+                                 float* to);
+  void (*transposed_scaled_idct)(float block[64]);
+};
+
+// Call via KernelTable<DCTFunctionsForTarget>. operator()<SIMD_TARGET> is
+// specialized in dct_target.cc, which is compiled once per instruction set
+// (dct_target_<target>.cc).
+struct DCTFunctionsForTarget {
+  template <class Target>
+  DCTFunctions operator()() const;
+};
+
+}  // namespace pik
+
+#endif  // DCT_TARGET_H_
@@ -0,0 +1,2 @@
+#define SIMD_ENABLE 6  // SSE4 + AVX2
+#include "dct_target.cc"
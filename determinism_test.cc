@@ -0,0 +1,155 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that the encoder output and the decoded pixels do not depend on the
+// number of worker threads or on the instruction set of the DCT (see
+// SetKernelTargets). benchmark_pik --determinism does the same for a corpus.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+
+#include "image.h"
+#include "kernel_targets.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_params.h"
+#include "simd/dispatch.h"
+
+namespace pik {
+namespace {
+
+// Not a multiple of the block size.
+constexpr size_t kXsize = 101;
+constexpr size_t kYsize = 83;
+constexpr int kMaxThreads = 3;
+
+MetaImageB TestImage() {
+  Image3B image(kXsize, kYsize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYsize; ++y) {
+      uint8_t* const PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < kXsize; ++x) {
+        const double ring = std::sqrt(double(x * x + y * y)) * (0.3 + 0.1 * c);
+        row[x] = static_cast<uint8_t>(128 + 90 * std::sin(ring) +
+                                      30 * std::cos(y * 1.3));
+      }
+    }
+  }
+  MetaImageB meta;
+  meta.SetColor(std::move(image));
+  return meta;
+}
+
+bool SamePixels(const MetaImageB& a, const MetaImageB& b) {
+  if (a.xsize() != b.xsize() || a.ysize() != b.ysize()) return false;
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < a.ysize(); ++y) {
+      const uint8_t* const PIK_RESTRICT row_a = a.GetColor().PlaneRow(c, y);
+      const uint8_t* const PIK_RESTRICT row_b = b.GetColor().PlaneRow(c, y);
+      if (!std::equal(row_a, row_a + a.xsize(), row_b)) return false;
+    }
+  }
+  return true;
+}
+
+struct Target {
+  const char* name;
+  int bits;
+};
+
+struct Mode {
+  const char* name;
+  CompressParams params;
+};
+
+// Returns whether all combinations of kernel target and thread count encode
+// "image" with "mode" to the same bytes and decode those to the same pixels.
+bool CheckMode(const MetaImageB& image, const Mode& mode) {
+  static const Target kTargets[] = {
+      {"default", ~0}, {"sse4", SIMD_SSE4}, {"none", SIMD_NONE}};
+  PaddedBytes expected;
+  MetaImageB expected_pixels;
+  bool ok = true;
+  for (const Target& target : kTargets) {
+    if (target.bits != ~0 &&
+        (dispatch::SupportedTargets() & target.bits) != target.bits) {
+      continue;
+    }
+    SetKernelTargets(target.bits);
+    for (int num_threads = 0; num_threads <= kMaxThreads; ++num_threads) {
+      CompressParams params = mode.params;
+      params.num_threads = num_threads;
+      DecompressParams dparams;
+      dparams.num_threads = num_threads;
+      PaddedBytes compressed;
+      MetaImageB pixels;
+      if (!PixelsToPik(params, image, &compressed, nullptr) ||
+          !PikToPixels(dparams, compressed, &pixels, nullptr)) {
+        fprintf(stderr, "%s: failed with %d threads and the %s kernels.\n",
+                mode.name, num_threads, target.name);
+        ok = false;
+        continue;
+      }
+      if (expected.size() == 0) {
+        expected = std::move(compressed);
+        expected_pixels = std::move(pixels);
+        continue;
+      }
+      if (compressed.size() != expected.size() ||
+          !std::equal(compressed.data(), compressed.data() + compressed.size(),
+                      expected.data())) {
+        fprintf(stderr,
+                "%s: output differs with %d threads and the %s kernels.\n",
+                mode.name, num_threads, target.name);
+        ok = false;
+      } else if (!SamePixels(pixels, expected_pixels)) {
+        fprintf(stderr,
+                "%s: pixels differ with %d threads and the %s kernels.\n",
+                mode.name, num_threads, target.name);
+        ok = false;
+      }
+    }
+  }
+  SetKernelTargets(~0);
+  return ok;
+}
+
+int RunTests() {
+  const MetaImageB image = TestImage();
+  Mode modes[4];
+  modes[0].name = "distance";
+  modes[0].params.butteraugli_distance = 1.5f;
+  modes[1].name = "fast";
+  modes[1].params.fast_mode = true;
+  modes[2].name = "ac_groups";
+  modes[2].params.fast_mode = true;
+  modes[2].params.ac_groups = true;
+  modes[3].name = "parallel_ytob";
+  modes[3].params.butteraugli_distance = 1.5f;
+  modes[3].params.parallel_ytob = true;
+  bool ok = true;
+  for (const Mode& mode : modes) {
+    ok &= CheckMode(image, mode);
+  }
+  if (!ok) return 1;
+  printf("Output is independent of the thread count and kernel target.\n");
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main() { return pik::RunTests(); }
@@ -14,15 +14,24 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "gamma_correct.h"
 #include "image.h"
 #include "image_io.h"
-#include "simd/dispatch.h"
 #include "padded_bytes.h"
 #include "pik.h"
 #include "pik_info.h"
+#include "profiler.h"
 
 namespace pik {
 namespace {
@@ -54,19 +63,76 @@ bool LoadFile(const char* pathname, PaddedBytes* compressed) {
   return true;
 }
 
+// Read-only mapping of an entire file, which avoids copying it (e.g. from the
+// page cache) into a PaddedBytes.
+class MappedFile {
+ public:
+  MappedFile() {}
+  ~MappedFile() {
+#ifdef __linux__
+    if (data_ != nullptr) munmap(data_, size_);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool Map(const char* pathname) {
+#ifdef __linux__
+    const int fd = open(pathname, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open %s.\n", pathname);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      fprintf(stderr, "Failed to stat %s or empty file.\n", pathname);
+      close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping remains valid.
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s.\n", pathname);
+      return false;
+    }
+    data_ = data;
+    size_ = st.st_size;
+    printf("Mapped %zu compressed bytes\n", size_);
+    return true;
+#else
+    fprintf(stderr, "Memory-mapped input is not supported.\n");
+    return false;
+#endif
+  }
+
+  ByteSpan bytes() const {
+    return ByteSpan(static_cast<const uint8_t*>(data_), size_);
+  }
+
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// If "use_mmap", decodes directly from a mapping of the input file. If
+// "info_json" is non-null, also writes the PikInfo to that file.
 template<typename ComponentType>
-int Decompress(const char* pathname_in, const char* pathname_out) {
-  if ((dispatch::SupportedTargets() & SIMD_AVX2) == 0) {
-    fprintf(stderr, "Cannot continue because CPU lacks AVX2/FMA support.\n");
+int Decompress(const char* pathname_in, const char* pathname_out,
+               const bool use_mmap, const ImageFormatPNG& format,
+               const DecompressParams& params, const char* info_json) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
     return 1;
   }
 
-  PaddedBytes compressed;
-  if (!LoadFile(pathname_in, &compressed)) {
+  PaddedBytes loaded;
+  MappedFile mapped;
+  if (use_mmap ? !mapped.Map(pathname_in) : !LoadFile(pathname_in, &loaded)) {
     return 1;
   }
+  const ByteSpan compressed = use_mmap ? mapped.bytes() : ByteSpan(loaded);
 
-  DecompressParams params;
   MetaImage<ComponentType> image;
   PikInfo info;
   if (!PikToPixels(params, compressed, &image, &info)) {
@@ -75,14 +141,59 @@ int Decompress(const char* pathname_in, const char* pathname_out) {
   }
   printf("Decompressed %zu x %zu pixels.\n", image.xsize(), image.ysize());
 
-  if (!WriteImage(ImageFormatPNG(), image, pathname_out)) {
+  if (!WriteImage(format, image, pathname_out)) {
     fprintf(stderr, "Failed to write %s.\n", pathname_out);
     return 1;
   }
+  if (info_json != nullptr && !WritePikInfoJSON(info, info_json)) {
+    fprintf(stderr, "Failed to write %s.\n", info_json);
+    return 1;
+  }
 
   return 0;
 }
 
+// Decodes all frames of the animation "pathname_in" (see FramesToPik) to the
+// files named by the printf pattern "pattern_out" and the frame index.
+int DecompressFrames(const char* pathname_in, const char* pattern_out,
+                     const bool use_mmap, const ImageFormatPNG& format,
+                     const DecompressParams& params) {
+  if (!CpuSupportsCodec()) {
+    fprintf(stderr, "Cannot continue because CPU lacks SSE4 support.\n");
+    return 1;
+  }
+  if (!IsFramePattern(pattern_out)) {
+    fprintf(stderr, "Output %s must contain one %%d for the frame index.\n",
+            pattern_out);
+    return 1;
+  }
+
+  PaddedBytes loaded;
+  MappedFile mapped;
+  if (use_mmap ? !mapped.Map(pathname_in) : !LoadFile(pathname_in, &loaded)) {
+    return 1;
+  }
+  const ByteSpan compressed = use_mmap ? mapped.bytes() : ByteSpan(loaded);
+
+  std::vector<MetaImageB> frames;
+  std::vector<uint32_t> durations;
+  if (!PikToFrames(params, compressed, &frames, &durations, nullptr)) {
+    fprintf(stderr, "Failed to decompress.\n");
+    return 1;
+  }
+  for (size_t i = 0; i < frames.size(); ++i) {
+    char pathname[4096];
+    snprintf(pathname, sizeof(pathname), pattern_out, static_cast<int>(i));
+    printf("Decompressed frame %zu: %zu x %zu pixels, %u ms.\n", i,
+           frames[i].xsize(), frames[i].ysize(), durations[i]);
+    if (!WriteImage(format, frames[i], pathname)) {
+      fprintf(stderr, "Failed to write %s.\n", pathname);
+      return 1;
+    }
+  }
+  return 0;
+}
+
 }  // namespace
 }  // namespace pik
 
@@ -91,11 +202,46 @@ int main(int argc, char** argv) {
   const char* file_out = 0;
   bool arg_error = false;
   bool sixteen_bit = false;
+  bool use_mmap = false;
+  bool profile = false;
+  bool frames = false;
+  const char* info_json = nullptr;
+  pik::ImageFormatPNG format;
+  pik::DecompressParams params;
 
   for (int i = 1; i < argc; i++) {
     if (argv[i][0] == '-') {
       if (strcmp(argv[i], "--16bit") == 0) {
         sixteen_bit = true;
+      } else if (strcmp(argv[i], "--num_threads") == 0 && i + 1 < argc) {
+        params.num_threads = strtol(argv[++i], nullptr, 10);
+      } else if (strcmp(argv[i], "--pin_threads") == 0) {
+        params.pin_threads = true;
+      } else if (strcmp(argv[i], "--huge_pages") == 0 && i + 1 < argc) {
+        params.huge_page_bytes = strtoull(argv[++i], nullptr, 10);
+      } else if (strcmp(argv[i], "--dc_preview") == 0) {
+        params.dc_preview = true;
+      } else if (strcmp(argv[i], "--downsample") == 0 && i + 1 < argc) {
+        params.downsampling = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--sparse_ac") == 0) {
+        params.sparse_ac = true;
+      } else if (strcmp(argv[i], "--mmap") == 0) {
+        use_mmap = true;
+      } else if (strcmp(argv[i], "--frames") == 0) {
+        frames = true;
+      } else if (strcmp(argv[i], "--fast_png") == 0) {
+        format.fast_write = true;
+      } else if (strcmp(argv[i], "--profile") == 0) {
+        profile = true;
+      } else if (strcmp(argv[i], "--info_json") == 0 && i + 1 < argc) {
+        info_json = argv[++i];
+      } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+        if (sscanf(argv[++i], "%zu,%zu,%zu,%zu", &params.crop_x0,
+                   &params.crop_y0, &params.crop_xsize,
+                   &params.crop_ysize) != 4) {
+          arg_error = true;
+          break;
+        }
       } else {
         arg_error = true;
         break;
@@ -114,16 +260,55 @@ int main(int argc, char** argv) {
 
   if (!file_in || !file_out || arg_error) {
     fprintf(stderr,
-        "Usage: %s [--16bit] in.pik out.png\n"
+        "Usage: %s [--16bit] [--num_threads <n>] [--crop <x0,y0,xsize,ysize>]"
+        " [--dc_preview] [--downsample <2|4>] [--pin_threads]"
+        " [--huge_pages <min_bytes>] [--sparse_ac] [--mmap] [--fast_png]"
+        " [--profile] [--info_json <out.json>] in.pik out.png\n"
+        "       %s --frames [--num_threads <n>] [--mmap] [--fast_png]"
+        " in.pik out%%05d.png\n"
         "    out.png will have 8 bit per color channel by default,\n"
         "    16 bit per channel if --16bit is set\n"
-        , argv[0]);
+        "    --num_threads: worker threads, -1 for one per core\n"
+        "    --crop: only decode the given rectangle\n"
+        "    --dc_preview: only decode a 1:8 preview from the DC coefficients\n"
+        "    --downsample: decode at 1:2 or 1:4 scale with a reduced IDCT\n"
+        "    --pin_threads: pin each worker thread to a CPU\n"
+        "    --huge_pages: transparent huge pages for allocations of at least"
+        " min_bytes\n"
+        "    --sparse_ac: store only the non-zero AC coefficients\n"
+        "    --mmap: decode from a memory mapping of in.pik instead of a copy\n"
+        "    --fast_png: faster PNG compression, larger output\n"
+        "    --frames: decode all frames of an animation to the files named"
+        " by the\n"
+        "              printf pattern and frame index\n"
+        "    --profile: print the time spent per decoder stage (requires"
+        " make PROFILE=1)\n"
+        "    --info_json: write the time and memory per decoder stage to a"
+        " JSON file\n"
+        , argv[0], argv[0]);
+    return 1;
+  }
+
+  if (profile && !PROFILER_ENABLED) {
+    fprintf(stderr, "--profile requires a build with make PROFILE=1\n");
+    return 1;
+  }
+
+  if (frames && (sixteen_bit || info_json != nullptr)) {
+    fprintf(stderr, "--frames does not support --16bit or --info_json\n");
     return 1;
   }
 
-  if (sixteen_bit) {
-    return pik::Decompress<uint16_t>(file_in, file_out);
+  int ret;
+  if (frames) {
+    ret = pik::DecompressFrames(file_in, file_out, use_mmap, format, params);
+  } else if (sixteen_bit) {
+    ret = pik::Decompress<uint16_t>(file_in, file_out, use_mmap, format,
+                                    params, info_json);
   } else {
-    return pik::Decompress<uint8_t>(file_in, file_out);
+    ret = pik::Decompress<uint8_t>(file_in, file_out, use_mmap, format,
+                                   params, info_json);
   }
+  if (profile) PROFILER_PRINT_RESULTS();
+  return ret;
 }
@@ -0,0 +1,498 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "encode_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "compressed_image.h"
+
+namespace pik {
+namespace {
+
+// Changes whenever the encoder output or the entry format does, invalidating
+// cache directories.
+constexpr uint64_t kCacheVersion = 2;
+
+PIK_INLINE uint64_t Mix(uint64_t hash, uint64_t word) {
+  hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+  return hash ^ (hash >> 29);
+}
+
+PIK_INLINE uint64_t RotateLeft(const uint64_t x, const int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+// Computes CacheKey::hash and CacheKey::check of the same sequence of 64-bit
+// words; the latter via the SipHash-2-4 rounds, with "hash_key".
+class Hasher {
+ public:
+  Hasher(const HashKey& hash_key, const uint64_t seed) : hash_(seed) {
+    v_[0] = hash_key.k0 ^ 0x736F6D6570736575ull;
+    v_[1] = hash_key.k1 ^ 0x646F72616E646F6Dull;
+    v_[2] = hash_key.k0 ^ 0x6C7967656E657261ull;
+    v_[3] = hash_key.k1 ^ 0x7465646279746573ull;
+    Add(seed);
+  }
+
+  void Add(const uint64_t word) {
+    hash_ = Mix(hash_, word);
+    v_[3] ^= word;
+    SipRound(v_);
+    SipRound(v_);
+    v_[0] ^= word;
+    ++num_words_;
+  }
+
+  template <typename T>
+  void AddValue(const T value) {
+    static_assert(sizeof(T) <= sizeof(uint64_t), "Value too large");
+    uint64_t word = 0;
+    memcpy(&word, &value, sizeof(T));
+    Add(word);
+  }
+
+  void AddBytes(const uint8_t* bytes, const size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, bytes + i, sizeof(word));
+      Add(word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    Add(tail);
+  }
+
+  template <typename T>
+  void AddPlane(const Image<T>& plane) {
+    AddValue(plane.xsize());
+    AddValue(plane.ysize());
+    for (size_t y = 0; y < plane.ysize(); ++y) {
+      AddBytes(reinterpret_cast<const uint8_t*>(plane.ConstRow(y)),
+               plane.xsize() * sizeof(T));
+    }
+  }
+
+  uint64_t hash() const { return hash_; }
+
+  // SipHash finalization; does not change the state.
+  uint64_t Check() const {
+    uint64_t v[4] = {v_[0], v_[1], v_[2], v_[3]};
+    const uint64_t last = num_words_ << 56;
+    v[3] ^= last;
+    SipRound(v);
+    SipRound(v);
+    v[0] ^= last;
+    v[2] ^= 0xFF;
+    for (int i = 0; i < 4; ++i) SipRound(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+  }
+
+ private:
+  static void SipRound(uint64_t* PIK_RESTRICT v) {
+    v[0] += v[1];
+    v[1] = RotateLeft(v[1], 13) ^ v[0];
+    v[0] = RotateLeft(v[0], 32);
+    v[2] += v[3];
+    v[3] = RotateLeft(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = RotateLeft(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = RotateLeft(v[1], 17) ^ v[2];
+    v[2] = RotateLeft(v[2], 32);
+  }
+
+  uint64_t hash_;
+  uint64_t v_[4];
+  uint64_t num_words_ = 0;
+};
+
+template <typename T>
+CacheKey HashImageT(const MetaImage<T>& image, const HashKey& hash_key) {
+  Hasher hasher(hash_key, kCacheVersion);
+  hasher.AddValue(sizeof(T));
+  const Image3<T>& color = image.GetColor();
+  for (int c = 0; c < 3; ++c) {
+    hasher.AddPlane(color.plane(c));
+  }
+  hasher.AddValue(image.HasAlpha());
+  if (image.HasAlpha()) {
+    hasher.AddPlane(image.GetAlpha());
+  }
+  return {hasher.hash(), hasher.Check(), static_cast<uint32_t>(image.xsize()),
+          static_cast<uint32_t>(image.ysize())};
+}
+
+// Entries begin with CacheKey::check, xsize and ysize in native byte order.
+constexpr size_t kEntryHeaderSize = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+PaddedBytes MakeEntry(const CacheKey& key, const PaddedBytes& payload) {
+  PaddedBytes entry(kEntryHeaderSize + payload.size());
+  memcpy(entry.data(), &key.check, sizeof(key.check));
+  memcpy(entry.data() + sizeof(key.check), &key.xsize, sizeof(key.xsize));
+  memcpy(entry.data() + sizeof(key.check) + sizeof(key.xsize), &key.ysize,
+         sizeof(key.ysize));
+  if (payload.size() != 0) {
+    memcpy(entry.data() + kEntryHeaderSize, payload.data(), payload.size());
+  }
+  return entry;
+}
+
+// Returns whether "entry" belongs to "key" (and not to another key with the
+// same hash), and if so copies its payload to "payload".
+bool ParseEntry(const CacheKey& key, const PaddedBytes& entry,
+                PaddedBytes* payload) {
+  if (entry.size() < kEntryHeaderSize) {
+    return PIK_FAILURE("Cache entry truncated");
+  }
+  uint64_t check;
+  uint32_t xsize, ysize;
+  memcpy(&check, entry.data(), sizeof(check));
+  memcpy(&xsize, entry.data() + sizeof(check), sizeof(xsize));
+  memcpy(&ysize, entry.data() + sizeof(check) + sizeof(xsize), sizeof(ysize));
+  if (check != key.check || xsize != key.xsize || ysize != key.ysize) {
+    return PIK_FAILURE("Cache entry of another key");
+  }
+  PaddedBytes bytes(entry.size() - kEntryHeaderSize);
+  if (bytes.size() != 0) {
+    memcpy(bytes.data(), entry.data() + kEntryHeaderSize, bytes.size());
+  }
+  *payload = std::move(bytes);
+  return true;
+}
+
+PaddedBytes Copy(const PaddedBytes& bytes) {
+  PaddedBytes copy(bytes.size());
+  if (bytes.size() != 0) memcpy(copy.data(), bytes.data(), bytes.size());
+  return copy;
+}
+
+// Serialization of quantization fields: xsize and ysize as uint32_t, then the
+// rows of floats, all in native byte order.
+PaddedBytes SerializeQuantField(const ImageF& quant_field) {
+  const uint32_t xsize = quant_field.xsize();
+  const uint32_t ysize = quant_field.ysize();
+  const size_t row_size = xsize * sizeof(float);
+  PaddedBytes bytes(2 * sizeof(uint32_t) + ysize * row_size);
+  memcpy(bytes.data(), &xsize, sizeof(xsize));
+  memcpy(bytes.data() + sizeof(xsize), &ysize, sizeof(ysize));
+  for (size_t y = 0; y < ysize; ++y) {
+    memcpy(bytes.data() + 2 * sizeof(uint32_t) + y * row_size,
+           quant_field.ConstRow(y), row_size);
+  }
+  return bytes;
+}
+
+bool DeserializeQuantField(const PaddedBytes& bytes, ImageF* quant_field) {
+  uint32_t xsize, ysize;
+  if (bytes.size() < 2 * sizeof(uint32_t)) {
+    return PIK_FAILURE("Quant field truncated");
+  }
+  memcpy(&xsize, bytes.data(), sizeof(xsize));
+  memcpy(&ysize, bytes.data() + sizeof(xsize), sizeof(ysize));
+  const size_t row_size = xsize * sizeof(float);
+  if (bytes.size() != 2 * sizeof(uint32_t) + ysize * row_size) {
+    return PIK_FAILURE("Quant field size mismatch");
+  }
+  ImageF field(xsize, ysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    memcpy(field.Row(y), bytes.data() + 2 * sizeof(uint32_t) + y * row_size,
+           row_size);
+  }
+  *quant_field = std::move(field);
+  return true;
+}
+
+bool ReadFile(const std::string& pathname, PaddedBytes* bytes) {
+  FILE* f = fopen(pathname.c_str(), "rb");
+  if (f == nullptr) return false;
+  bool ok = fseek(f, 0, SEEK_END) == 0;
+  const long size = ok ? ftell(f) : -1;
+  ok = size >= 0 && fseek(f, 0, SEEK_SET) == 0;
+  if (ok) {
+    PaddedBytes contents(size);
+    ok = fread(contents.data(), 1, size, f) == static_cast<size_t>(size);
+    if (ok) *bytes = std::move(contents);
+  }
+  fclose(f);
+  return ok;
+}
+
+// Writes to a temporary file first so that concurrent readers (also in other
+// processes) never see partial files. If "keep_existing", an existing file is
+// not replaced (and that is not a failure).
+bool WriteFile(const PaddedBytes& bytes, const std::string& pathname,
+               const bool keep_existing = false) {
+  const std::string temp =
+      pathname + ".tmp" + std::to_string(getpid()) + "_" +
+      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  FILE* f = fopen(temp.c_str(), "wb");
+  if (f == nullptr) return PIK_FAILURE("Failed to open cache file");
+  bool ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+  ok &= fclose(f) == 0;
+  if (keep_existing) {
+    ok = ok && (link(temp.c_str(), pathname.c_str()) == 0 || errno == EEXIST);
+    remove(temp.c_str());
+  } else {
+    ok = ok && rename(temp.c_str(), pathname.c_str()) == 0;
+    if (!ok) remove(temp.c_str());
+  }
+  if (!ok) return PIK_FAILURE("Failed to write cache file");
+  return true;
+}
+
+HashKey RandomHashKey() {
+  std::random_device random;
+  HashKey hash_key;
+  hash_key.k0 = (static_cast<uint64_t>(random()) << 32) ^ random();
+  hash_key.k1 = (static_cast<uint64_t>(random()) << 32) ^ random();
+  return hash_key;
+}
+
+bool ReadHashKey(const std::string& pathname, HashKey* hash_key) {
+  PaddedBytes bytes;
+  if (!ReadFile(pathname, &bytes)) return false;
+  if (bytes.size() != sizeof(HashKey)) {
+    return PIK_FAILURE("Invalid cache hash key");
+  }
+  memcpy(hash_key, bytes.data(), sizeof(HashKey));
+  return true;
+}
+
+// Returns the hash key stored in "dir", after storing a random one unless
+// another instance already did. Without a directory (or if it cannot be
+// written), the key is random and only valid for this instance.
+HashKey LoadOrCreateHashKey(const std::string& dir) {
+  HashKey hash_key = RandomHashKey();
+  if (dir.empty()) return hash_key;
+  const std::string pathname = dir + "/hash_key";
+  HashKey stored;
+  if (ReadHashKey(pathname, &stored)) return stored;
+  PaddedBytes bytes(sizeof(HashKey));
+  memcpy(bytes.data(), &hash_key, sizeof(HashKey));
+  // Whichever instance links its key first wins; all then use that one.
+  if (WriteFile(bytes, pathname, /*keep_existing=*/true) &&
+      ReadHashKey(pathname, &stored)) {
+    return stored;
+  }
+  return hash_key;
+}
+
+template <class Image>
+bool CachedPixelsToPikT(const CompressParams& params, const Image& image,
+                        const bool warm_start, EncodeCache* cache,
+                        PikEncoder* encoder, PaddedBytes* compressed,
+                        PikInfo* aux_out, bool* cache_hit) {
+  if (cache_hit != nullptr) *cache_hit = false;
+  const bool cacheable = IsCacheable(params);
+  const CacheKey image_key = HashImage(image, cache->hash_key());
+  const CacheKey key = EncodeKey(params, image_key, cache->hash_key());
+  if (cacheable && cache->Lookup(key, compressed)) {
+    if (cache_hit != nullptr) *cache_hit = true;
+    return true;
+  }
+
+  CompressParams encode_params = params;
+  ImageF warm_field;
+  bool warm = false;
+  if (warm_start && params.initial_quant_field == nullptr &&
+      cache->LookupQuantField(image_key, &warm_field)) {
+    // Guard against a corrupted cache directory.
+    const size_t xsize_blocks = (image.xsize() + kBlockEdge - 1) / kBlockEdge;
+    const size_t ysize_blocks = (image.ysize() + kBlockEdge - 1) / kBlockEdge;
+    warm = warm_field.xsize() == xsize_blocks &&
+           warm_field.ysize() == ysize_blocks;
+    if (warm) encode_params.initial_quant_field = &warm_field;
+  }
+
+  PikInfo info;
+  PikInfo* info_out = aux_out != nullptr ? aux_out : &info;
+  // Otherwise a stale field of a previous image could be cached.
+  info_out->quant_field = ImageF();
+  const bool ok =
+      encoder != nullptr
+          ? encoder->PixelsToPik(encode_params, image, compressed, info_out)
+          : PixelsToPik(encode_params, image, compressed, info_out);
+  if (!ok) return false;
+
+  if (cacheable && !warm) {
+    cache->Insert(key, *compressed);
+    if (info_out->quant_field.xsize() != 0) {
+      cache->InsertQuantField(image_key, info_out->quant_field);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+CacheKey HashImage(const MetaImageB& image, const HashKey& hash_key) {
+  return HashImageT(image, hash_key);
+}
+CacheKey HashImage(const MetaImageF& image, const HashKey& hash_key) {
+  return HashImageT(image, hash_key);
+}
+
+CacheKey EncodeKey(const CompressParams& params, const CacheKey& image_key,
+                   const HashKey& hash_key) {
+  Hasher hasher(hash_key, kCacheVersion);
+  hasher.Add(image_key.hash);
+  hasher.Add(image_key.check);
+  hasher.AddValue(params.jpeg_quality);
+  hasher.AddValue(params.jpeg_chroma_subsampling);
+  hasher.AddValue(params.clear_metadata);
+  hasher.AddValue(params.butteraugli_distance);
+  hasher.AddValue(params.target_bitrate);
+  hasher.AddValue(params.uniform_quant);
+  hasher.AddValue(params.fast_mode);
+  hasher.AddValue(params.max_butteraugli_iters);
+  hasher.AddValue(params.effort);
+  hasher.AddValue(params.incremental_butteraugli);
+  hasher.AddValue(params.coarse_butteraugli);
+  hasher.AddValue(params.linear_butteraugli);
+  hasher.AddValue(params.proxy_butteraugli);
+  hasher.AddValue(params.speculative_candidates);
+  hasher.AddValue(params.multires_butteraugli);
+  hasher.AddValue(params.adaptive_initial_quant);
+  hasher.AddValue(params.initial_quant_field != nullptr);
+  if (params.initial_quant_field != nullptr) {
+    hasher.AddPlane(*params.initial_quant_field);
+  }
+  hasher.AddValue(params.estimate_target_size);
+  hasher.AddValue(params.fast_size_estimates);
+  hasher.AddValue(params.lossless);
+  hasher.AddValue(params.grayscale);
+  hasher.AddValue(params.alpha_channel);
+  hasher.AddValue(params.alpha_effort);
+  hasher.AddValue(params.ac_groups);
+  hasher.AddValue(params.interleaved_ans);
+  hasher.AddValue(params.fast_clustering);
+  hasher.AddValue(params.static_ac_codes);
+  hasher.AddValue(params.section_index);
+  hasher.AddValue(params.quant_field_frames);
+  hasher.AddValue(params.parallel_ytob);
+  hasher.AddValue(params.ytob_refinement);
+  return {hasher.hash(), hasher.Check(), image_key.xsize, image_key.ysize};
+}
+
+bool IsCacheable(const CompressParams& params) {
+  return params.deadline_seconds <= 0.0;
+}
+
+EncodeCache::EncodeCache(size_t max_bytes, const std::string& dir)
+    : max_bytes_(max_bytes), dir_(dir), hash_key_(LoadOrCreateHashKey(dir)) {}
+
+std::string EncodeCache::Pathname(const CacheKey& key,
+                                  const char* extension) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx",
+           static_cast<unsigned long long>(key.hash));
+  return dir_ + name + extension;
+}
+
+bool EncodeCache::Lookup(const CacheKey& key, const char* extension, Map* map,
+                         PaddedBytes* bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = map->find(key.hash);
+    if (it != map->end()) {
+      // Otherwise, another key with the same hash owns the entry.
+      return ParseEntry(key, it->second, bytes);
+    }
+  }
+  PaddedBytes entry;
+  if (dir_.empty() || !ReadFile(Pathname(key, extension), &entry) ||
+      !ParseEntry(key, entry, bytes)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (map->count(key.hash) == 0 && entry.size() <= max_bytes_) {
+    InsertLocked(key.hash, std::move(entry), map);
+  }
+  return true;
+}
+
+void EncodeCache::Insert(const CacheKey& key, const char* extension,
+                         const PaddedBytes& bytes, Map* map) {
+  PaddedBytes entry = MakeEntry(key, bytes);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Entries of a key are identical, so the first one stays. Upon a hash
+    // collision, so does the entry of the other key.
+    if (map->count(key.hash) != 0) return;
+    if (entry.size() <= max_bytes_) InsertLocked(key.hash, Copy(entry), map);
+  }
+  if (!dir_.empty()) {
+    // Failure only costs later lookups (PIK_FAILURE already reported it).
+    (void)WriteFile(entry, Pathname(key, extension));
+  }
+}
+
+void EncodeCache::InsertLocked(uint64_t hash, PaddedBytes&& bytes, Map* map) {
+  while (bytes_ + bytes.size() > max_bytes_) {
+    const std::pair<Map*, uint64_t> oldest = order_.front();
+    order_.pop_front();
+    auto it = oldest.first->find(oldest.second);
+    bytes_ -= it->second.size();
+    oldest.first->erase(it);
+  }
+  bytes_ += bytes.size();
+  order_.emplace_back(map, hash);
+  map->emplace(hash, std::move(bytes));
+}
+
+bool EncodeCache::Lookup(const CacheKey& key, PaddedBytes* compressed) {
+  return Lookup(key, ".pik", &encodings_, compressed);
+}
+
+void EncodeCache::Insert(const CacheKey& key, const PaddedBytes& compressed) {
+  Insert(key, ".pik", compressed, &encodings_);
+}
+
+bool EncodeCache::LookupQuantField(const CacheKey& image_key,
+                                   ImageF* quant_field) {
+  PaddedBytes bytes;
+  return Lookup(image_key, ".qf", &quant_fields_, &bytes) &&
+         DeserializeQuantField(bytes, quant_field);
+}
+
+void EncodeCache::InsertQuantField(const CacheKey& image_key,
+                                   const ImageF& quant_field) {
+  Insert(image_key, ".qf", SerializeQuantField(quant_field), &quant_fields_);
+}
+
+bool CachedPixelsToPik(const CompressParams& params, const MetaImageB& image,
+                       bool warm_start, EncodeCache* cache,
+                       PikEncoder* encoder, PaddedBytes* compressed,
+                       PikInfo* aux_out, bool* cache_hit) {
+  return CachedPixelsToPikT(params, image, warm_start, cache, encoder,
+                            compressed, aux_out, cache_hit);
+}
+
+bool CachedPixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                       bool warm_start, EncodeCache* cache,
+                       PikEncoder* encoder, PaddedBytes* compressed,
+                       PikInfo* aux_out, bool* cache_hit) {
+  return CachedPixelsToPikT(params, linear, warm_start, cache, encoder,
+                            compressed, aux_out, cache_hit);
+}
+
+}  // namespace pik
@@ -0,0 +1,150 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ENCODE_CACHE_H_
+#define ENCODE_CACHE_H_
+
+// Cache of encoder results for repeated inputs, e.g. re-uploads of the same
+// image. Entries are keyed by a hash of the pixels (HashImage) and of the
+// CompressParams fields that affect the output (EncodeKey). Each entry also
+// stores the dimensions and a second, keyed hash, which lookups verify. The
+// encoder is deterministic, hence a cached result equals a fresh encode. The
+// converged quantization field of an image (PikInfo::quant_field, which is
+// scaled to distance 1) is also cached by itself, for starting the search at
+// another distance (CompressParams::initial_quant_field).
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "image.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_info.h"
+#include "pik_params.h"
+
+namespace pik {
+
+// Secret key of CacheKey::check, see EncodeCache::hash_key.
+struct HashKey {
+  uint64_t k0;
+  uint64_t k1;
+};
+
+// Identifies an image or an encoding of it.
+struct CacheKey {
+  // Names the entry. Fast, but not collision-resistant.
+  uint64_t hash;
+  // Independent hash of the same data (SipHash-2-4 with a HashKey), stored
+  // in the entry together with the dimensions and verified on lookup.
+  uint64_t check;
+  uint32_t xsize;
+  uint32_t ysize;
+};
+
+// Returns the key of the dimensions and samples (including alpha, if any) of
+// "image".
+CacheKey HashImage(const MetaImageB& image, const HashKey& hash_key);
+CacheKey HashImage(const MetaImageF& image, const HashKey& hash_key);
+
+// Returns the key of encoding the image with key "image_key" with "params".
+// Only includes the options that change the output, i.e. not num_threads,
+// pin_threads, huge_page_bytes, max_encoder_memory and concurrent_alpha.
+CacheKey EncodeKey(const CompressParams& params, const CacheKey& image_key,
+                   const HashKey& hash_key);
+
+// Whether the output of "params" is reproducible and may be cached: not if it
+// depends on deadline_seconds.
+bool IsCacheable(const CompressParams& params);
+
+// Thread-safe map from keys to encodings and from image hashes to quantization
+// fields, held in memory and optionally also in a directory, whose files are
+// found again by later instances (e.g. runs of cpik --cache_dir).
+class EncodeCache {
+ public:
+  // Keeps up to "max_bytes" of entries in memory, evicting the oldest first.
+  // If "dir" is non-empty, it must exist; entries are also written to and
+  // looked up in it, without a size limit.
+  explicit EncodeCache(size_t max_bytes, const std::string& dir = "");
+
+  EncodeCache(const EncodeCache&) = delete;
+  EncodeCache& operator=(const EncodeCache&) = delete;
+
+  // Key of the CacheKey::check of all entries: random, and stored in the
+  // directory (if any) by the first instance that uses it.
+  const HashKey& hash_key() const { return hash_key_; }
+
+  // Returns whether "key" is cached, and if so copies its encoding to
+  // "compressed".
+  bool Lookup(const CacheKey& key, PaddedBytes* compressed);
+  void Insert(const CacheKey& key, const PaddedBytes& compressed);
+
+  // Same for the quantization field of the image with key "image_key".
+  bool LookupQuantField(const CacheKey& image_key, ImageF* quant_field);
+  void InsertQuantField(const CacheKey& image_key, const ImageF& quant_field);
+
+ private:
+  // Entries begin with the fields of their CacheKey other than the hash.
+  using Map = std::unordered_map<uint64_t, PaddedBytes>;
+
+  // Returns the file of "key" in dir_.
+  std::string Pathname(const CacheKey& key, const char* extension) const;
+  // Implementations of the public functions for the entries of "map", whose
+  // files have the given extension.
+  bool Lookup(const CacheKey& key, const char* extension, Map* map,
+              PaddedBytes* bytes);
+  void Insert(const CacheKey& key, const char* extension,
+              const PaddedBytes& bytes, Map* map);
+  // Adds an entry to "map", first evicting the oldest entries of either map
+  // until it fits. Requires mutex_ to be held and bytes.size() <= max_bytes_.
+  void InsertLocked(uint64_t hash, PaddedBytes&& bytes, Map* map);
+
+  const size_t max_bytes_;
+  const std::string dir_;
+  const HashKey hash_key_;
+  std::mutex mutex_;
+  Map encodings_;
+  // Serialized ImageF.
+  Map quant_fields_;
+  // Insertion order of the entries of both maps, for evicting the oldest.
+  std::deque<std::pair<Map*, uint64_t>> order_;
+  // Sum of the sizes of all entries in memory.
+  size_t bytes_ = 0;
+};
+
+// Same as PixelsToPik (or encoder->PixelsToPik unless "encoder" is null), but
+// returns the encoding cached for the same pixels and "params", if any, and
+// otherwise caches the result and its quantization field. If "warm_start" and
+// params.initial_quant_field is null, a butteraugli search instead starts
+// from the cached quantization field of the image (from an encode at another
+// distance), if any. This mainly saves time for nearby distances (e.g. 1.2
+// after 1.0, not 2.0); such encodings are a few percent larger than fresh
+// ones and hence not cached. Sets *cache_hit (unless null) to whether the
+// encoding was cached, in which case "aux_out" is not updated. Caches nothing
+// unless IsCacheable(params).
+bool CachedPixelsToPik(const CompressParams& params, const MetaImageB& image,
+                       bool warm_start, EncodeCache* cache,
+                       PikEncoder* encoder, PaddedBytes* compressed,
+                       PikInfo* aux_out, bool* cache_hit = nullptr);
+bool CachedPixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                       bool warm_start, EncodeCache* cache,
+                       PikEncoder* encoder, PaddedBytes* compressed,
+                       PikInfo* aux_out, bool* cache_hit = nullptr);
+
+}  // namespace pik
+
+#endif  // ENCODE_CACHE_H_
@@ -0,0 +1,209 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Round trip of FramesToPik/PikEncoder::FrameToPik and PikToFrames. The AC
+// codes shared between frames are lossless, hence each decoded frame must
+// equal the decoding of the same frame encoded by itself with the same
+// (uniform) quantization. Sharing them must also make the animation smaller
+// than the separately coded frames.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "image.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_info.h"
+#include "pik_params.h"
+
+namespace pik {
+namespace {
+
+// Not a multiple of the block size.
+constexpr size_t kXsize = 77;
+constexpr size_t kYsize = 45;
+constexpr size_t kNumFrames = 4;
+
+// Smooth pattern that moves by a few pixels per frame, like video.
+MetaImageB MovingFrame(const size_t frame) {
+  Image3B image(kXsize, kYsize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYsize; ++y) {
+      uint8_t* const PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < kXsize; ++x) {
+        const double phase = (x + 3 * frame) * 0.15 + y * 0.07 * (c + 1);
+        row[x] = static_cast<uint8_t>(128 + 100 * std::sin(phase));
+      }
+    }
+  }
+  MetaImageB meta;
+  meta.SetColor(std::move(image));
+  return meta;
+}
+
+bool SameImages(const char* name, const size_t frame, const MetaImageB& a,
+                const MetaImageB& b) {
+  if (a.xsize() != b.xsize() || a.ysize() != b.ysize()) {
+    fprintf(stderr, "%s, frame %zu: size %zu x %zu, expected %zu x %zu.\n",
+            name, frame, a.xsize(), a.ysize(), b.xsize(), b.ysize());
+    return false;
+  }
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < a.ysize(); ++y) {
+      const uint8_t* const PIK_RESTRICT row_a = a.GetColor().PlaneRow(c, y);
+      const uint8_t* const PIK_RESTRICT row_b = b.GetColor().PlaneRow(c, y);
+      for (size_t x = 0; x < a.xsize(); ++x) {
+        if (row_a[x] != row_b[x]) {
+          fprintf(stderr, "%s, frame %zu: mismatch at %zu, %zu, plane %d.\n",
+                  name, frame, x, y, c);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Returns whether "compressed" decodes to the first "num_frames" of
+// "expected", shown for the corresponding "durations".
+bool CheckFrames(const char* name, const PaddedBytes& compressed,
+                 const std::vector<MetaImageB>& expected,
+                 const std::vector<uint32_t>& durations,
+                 const size_t num_frames) {
+  DecompressParams dparams;
+  std::vector<MetaImageB> frames;
+  std::vector<uint32_t> decoded_durations;
+  if (!PikToFrames(dparams, compressed, &frames, &decoded_durations,
+                   nullptr)) {
+    fprintf(stderr, "%s: failed to decode the frames.\n", name);
+    return false;
+  }
+  if (frames.size() != num_frames ||
+      !std::equal(durations.begin(), durations.begin() + num_frames,
+                  decoded_durations.begin())) {
+    fprintf(stderr, "%s: decoded %zu frames, expected %zu.\n", name,
+            frames.size(), num_frames);
+    return false;
+  }
+  for (size_t i = 0; i < frames.size(); ++i) {
+    if (!SameImages(name, i, frames[i], expected[i])) return false;
+  }
+  // PikToPixels only decodes the first frame.
+  MetaImageB first;
+  if (!PikToPixels(dparams, compressed, &first, nullptr)) {
+    fprintf(stderr, "%s: failed to decode the first frame.\n", name);
+    return false;
+  }
+  return SameImages(name, 0, first, expected[0]);
+}
+
+int RunTests() {
+  std::vector<MetaImageB> frames;
+  std::vector<uint32_t> durations;
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    frames.push_back(MovingFrame(i));
+    durations.push_back(40 + 10 * i);
+  }
+
+  CompressParams params;
+  params.uniform_quant = 1.0f;
+  // The settings that FramesToPik uses for each frame.
+  CompressParams single_params = params;
+  single_params.static_ac_codes = true;
+  DecompressParams dparams;
+  std::vector<MetaImageB> expected(kNumFrames);
+  size_t separate_size = 0;
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    PaddedBytes compressed;
+    if (!PixelsToPik(single_params, frames[i], &compressed, nullptr) ||
+        !PikToPixels(dparams, compressed, &expected[i], nullptr)) {
+      fprintf(stderr, "Failed to encode or decode frame %zu by itself.\n", i);
+      return 1;
+    }
+    separate_size += compressed.size();
+  }
+
+  bool ok = true;
+  PaddedBytes animation;
+  PikInfo info;
+  if (!FramesToPik(params, frames, durations, &animation, &info)) {
+    fprintf(stderr, "FramesToPik failed.\n");
+    return 1;
+  }
+  ok &= CheckFrames("FramesToPik", animation, expected, durations,
+                    kNumFrames);
+  // Each frame after the first references the codes of its predecessor.
+  if (info.ac_image.num_shared_codes != kNumFrames - 1) {
+    fprintf(stderr, "%zu frames shared the AC codes, expected %zu.\n",
+            info.ac_image.num_shared_codes, kNumFrames - 1);
+    ok = false;
+  }
+  if (animation.size() >= separate_size) {
+    fprintf(stderr, "Animation of %zu bytes, but %zu when coded separately.\n",
+            animation.size(), separate_size);
+    ok = false;
+  }
+
+  // The streaming interface produces the same bytes.
+  PikEncoder encoder(0);
+  PaddedBytes streamed;
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    if (!encoder.FrameToPik(params, frames[i], durations[i], &streamed,
+                            nullptr)) {
+      fprintf(stderr, "FrameToPik failed for frame %zu.\n", i);
+      return 1;
+    }
+  }
+  if (streamed.size() != animation.size() ||
+      !std::equal(streamed.data(), streamed.data() + streamed.size(),
+                  animation.data())) {
+    fprintf(stderr, "FrameToPik differs from FramesToPik.\n");
+    ok = false;
+  }
+
+  // After ResetFrames, the next frame again starts an animation.
+  encoder.ResetFrames();
+  PaddedBytes restarted;
+  if (!encoder.FrameToPik(params, frames[0], durations[0], &restarted,
+                          nullptr)) {
+    fprintf(stderr, "FrameToPik failed after ResetFrames.\n");
+    return 1;
+  }
+  ok &= CheckFrames("ResetFrames", restarted, expected, durations, 1);
+
+  // A shared quant field is only signaled, so frames after the first of each
+  // group decode like the others.
+  CompressParams shared_params = params;
+  shared_params.quant_field_frames = 2;
+  PaddedBytes shared;
+  if (!FramesToPik(shared_params, frames, durations, &shared, nullptr)) {
+    fprintf(stderr, "FramesToPik with quant_field_frames failed.\n");
+    return 1;
+  }
+  ok &= CheckFrames("quant_field_frames", shared, expected, durations,
+                    kNumFrames);
+
+  if (!ok) return 1;
+  printf("%zu frames round-trip in %zu bytes (%zu when coded separately).\n",
+         kNumFrames, animation.size(), separate_size);
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main() { return pik::RunTests(); }
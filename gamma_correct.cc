@@ -19,6 +19,7 @@
 
 #include "compiler_specific.h"
 #include "profiler.h"
+#include "simd/simd.h"
 
 namespace pik {
 
@@ -30,10 +31,6 @@ const float* NewSrgb8ToLinearTable() {
   return table;
 }
 
-const float* Srgb8ToLinearTable() {
-  static const float* const kSrgb8ToLinearTable = NewSrgb8ToLinearTable();
-  return kSrgb8ToLinearTable;
-}
 
 const uint8_t* NewLinearToSrgb8Table(float bias) {
   uint8_t* table = new uint8_t[4096];
@@ -44,20 +41,26 @@ const uint8_t* NewLinearToSrgb8Table(float bias) {
   return table;
 }
 
-const uint8_t* LinearToSrgb8Table() {
-  static const uint8_t* const kLinearToSrgb8Table = NewLinearToSrgb8Table(0.0f);
-  return kLinearToSrgb8Table;
-}
+// The tables are built during static initialization instead of on first use,
+// so that the first concurrent calls do not wait for each other and later
+// calls need no guard. They must therefore not be used by other static
+// initializers.
+const float* const kSrgb8ToLinearTable = NewSrgb8ToLinearTable();
+const uint8_t* const kLinearToSrgb8Table = NewLinearToSrgb8Table(0.0f);
+const uint8_t* const kLinearToSrgb8TablePlusQuarter =
+    NewLinearToSrgb8Table(0.25);
+const uint8_t* const kLinearToSrgb8TableMinusQuarter =
+    NewLinearToSrgb8Table(-0.25);
+
+const float* Srgb8ToLinearTable() { return kSrgb8ToLinearTable; }
+
+const uint8_t* LinearToSrgb8Table() { return kLinearToSrgb8Table; }
 
 const uint8_t* LinearToSrgb8TablePlusQuarter() {
-  static const uint8_t* const kLinearToSrgb8TablePlusQuarter =
-      NewLinearToSrgb8Table(0.25);
   return kLinearToSrgb8TablePlusQuarter;
 }
 
 const uint8_t* LinearToSrgb8TableMinusQuarter() {
-  static const uint8_t* const kLinearToSrgb8TableMinusQuarter =
-      NewLinearToSrgb8Table(-0.25);
   return kLinearToSrgb8TableMinusQuarter;
 }
 
@@ -70,7 +73,18 @@ ImageF LinearFromSrgb(const ImageB& srgb) {
   for (size_t y = 0; y < ysize; ++y) {
     const uint8_t* const PIK_RESTRICT row = srgb.Row(y);
     float* const PIK_RESTRICT row_linear = linear.Row(y);
-    for (size_t x = 0; x < xsize; ++x) {
+    size_t x = 0;
+#if SIMD_ENABLE_AVX2
+    using namespace SIMD_NAMESPACE;
+    // 256 entries are too many for shuffles, hence gather.
+    for (; x + 8 <= xsize; x += 8) {
+      const vec256<int32_t> indices =
+          convert_to(int32_t(), load(vec64<uint8_t>(), row + x));
+      store(vec256<float>(_mm256_i32gather_ps(lut, indices, 4)),
+            row_linear + x);
+    }
+#endif
+    for (; x < xsize; ++x) {
       row_linear[x] = lut[row[x]];
     }
   }
@@ -91,7 +105,28 @@ ImageF LinearFromSrgb(const ImageU& srgb) {
   for (size_t y = 0; y < ysize; ++y) {
     const uint16_t* const PIK_RESTRICT row = srgb.Row(y);
     float* const PIK_RESTRICT row_linear = linear.Row(y);
-    for (size_t x = 0; x < xsize; ++x) {
+    size_t x = 0;
+#if SIMD_ENABLE_AVX2
+    using namespace SIMD_NAMESPACE;
+    using V = vec256<float>;
+    using VI = vec256<int32_t>;
+    const float* lut = Srgb8ToLinearTable();
+    const V vnorm = set1(V(), norm);
+    const VI k255 = set1(VI(), 255);
+    for (; x + 8 <= xsize; x += 8) {
+      const VI srgb = convert_to(int32_t(), load(vec128<uint16_t>(), row + x));
+      const VI srgb8 = srgb >> 8;
+      // Values expanded from 8 bits (e.g. 8-bit PNG) have equal upper and
+      // lower bytes; for those the table is exact and also faster.
+      if (ext::all_zero((srgb & k255) ^ srgb8)) {
+        store(V(_mm256_i32gather_ps(lut, srgb8, 4)), row_linear + x);
+      } else {
+        const V linear = SrgbToLinearPoly(f32_from_i32(srgb) * vnorm);
+        store(linear, row_linear + x);
+      }
+    }
+#endif
+    for (; x < xsize; ++x) {
       row_linear[x] = Srgb8ToLinearDirect(row[x] * norm);
     }
   }
@@ -103,17 +138,38 @@ Image3F LinearFromSrgb(const Image3U& srgb) {
                  LinearFromSrgb(srgb.plane(2)));
 }
 
+void LinearFromSrgbRow(const float* srgb, const size_t xsize, float* linear) {
+  size_t x = 0;
+#if SIMD_ENABLE_AVX2
+  using namespace SIMD_NAMESPACE;
+  using V = vec256<float>;
+  for (; x + 8 <= xsize; x += 8) {
+    const V clamped =
+        clamp(load_unaligned(V(), srgb + x), setzero(V()), set1(V(), 255.0f));
+    store_unaligned(SrgbToLinearPoly(clamped), linear + x);
+  }
+#endif
+  for (; x < xsize; ++x) {
+    linear[x] = Srgb8ToLinearDirect(srgb[x]);
+  }
+}
+
 ImageB Srgb8FromLinear(const ImageF& linear) {
   PROFILER_FUNC;
   const size_t xsize = linear.xsize();
   const size_t ysize = linear.ysize();
   ImageB srgb(xsize, ysize);
+  using namespace SIMD_NAMESPACE;
+  using V = vec<float>;
+  constexpr size_t N = NumLanes<V>();
   for (size_t y = 0; y < ysize; ++y) {
     const float* const PIK_RESTRICT row_linear = linear.Row(y);
     uint8_t* const PIK_RESTRICT row = srgb.Row(y);
-    for (size_t x = 0; x < xsize; ++x) {
-      row[x] = static_cast<uint8_t>(
-          std::round(LinearToSrgb8Direct(row_linear[x])));
+    // Rows are padded to a multiple of the vector size, as in
+    // OpsinDynamicsInverse.
+    for (size_t x = 0; x < xsize; x += N) {
+      const V srgb = LinearToSrgbPoly(load(V(), row_linear + x));
+      store(convert_to(uint8_t(), i32_from_f32(srgb)), row + x);
     }
   }
   return srgb;
@@ -130,11 +186,14 @@ ImageF SrgbFFromLinear(const ImageF& linear) {
   const size_t xsize = linear.xsize();
   const size_t ysize = linear.ysize();
   ImageF srgb(xsize, ysize);
+  using namespace SIMD_NAMESPACE;
+  using V = vec<float>;
+  constexpr size_t N = NumLanes<V>();
   for (size_t y = 0; y < ysize; ++y) {
     const float* const PIK_RESTRICT row_linear = linear.Row(y);
     float* const PIK_RESTRICT row = srgb.Row(y);
-    for (size_t x = 0; x < xsize; ++x) {
-      row[x] = LinearToSrgb8Direct(row_linear[x]);
+    for (size_t x = 0; x < xsize; x += N) {
+      store(LinearToSrgbPoly(load(V(), row_linear + x)), row + x);
     }
   }
   return srgb;
@@ -55,6 +55,9 @@ PIK_INLINE float LinearToSrgb8Direct(float val) {
 ImageF LinearFromSrgb(const ImageB& srgb);
 Image3F LinearFromSrgb(const Image3B& srgb);
 Image3F LinearFromSrgb(const Image3U& srgb);
+// Converts "xsize" non-integer sRGB values (0-255, clamped); "linear" may be
+// equal to "srgb".
+void LinearFromSrgbRow(const float* srgb, size_t xsize, float* linear);
 
 ImageB Srgb8FromLinear(const ImageF& linear);
 Image3B Srgb8FromLinear(const Image3F& linear);
@@ -93,6 +96,37 @@ V LinearToSrgbPoly(V z) {
   return clamp(ret, setzero(V()), set1(V(), 255.0f));
 }
 
+// Rational approximation of Srgb8ToLinearDirect for z in [10.31475, 255].
+template <typename V>
+V Pow24PolyInverse(V z) {
+  // Max error: 0.00008, well below 16-bit precision in range 0-255.
+  return ((((set1(V(), 2.38762405422676e-07f) * z +
+             set1(V(), 5.17403976040738e-05f)) *
+                z +
+            set1(V(), 0.00250676659808119f)) *
+               z +
+           set1(V(), 0.0402622069954475f)) *
+              z +
+          set1(V(), 0.212826373338214f)) /
+         ((((set1(V(), 1.07974615658051e-11f) * z +
+             set1(V(), -2.00317340777025e-08f)) *
+                z +
+            set1(V(), 3.94336647462960e-05f)) *
+               z +
+           set1(V(), 0.0185336399904628f)) *
+              z +
+          set1(V(), 1.0f));
+}
+
+// In/out: 0-255, same as Srgb8ToLinearDirect.
+template <typename V>
+V SrgbToLinearPoly(V z) {
+  const V linear = z * set1(V(), 1.0f / 12.92f);
+  const V poly = Pow24PolyInverse(z);
+  const V ret = select(linear, poly, z > set1(V(), 10.31475f));
+  return clamp(ret, setzero(V()), set1(V(), 255.0f));
+}
+
 // Returns sRGB as floating-point (same range but not rounded to integer).
 ImageF SrgbFFromLinear(const ImageF& linear);
 Image3F SrgbFFromLinear(const Image3F& linear);
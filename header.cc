@@ -344,18 +344,24 @@ class SectionSizes {
 // Reads sections (and bits/sizes) from BitSource.
 class SectionReader {
  public:
-  explicit SectionReader(BitSource* const PIK_RESTRICT source) {
+  SectionReader(BitSource* const PIK_RESTRICT source, const uint8_t* end) {
     section_bits_.Load(source);
     section_sizes_.Load(section_bits_, source);
 
     // Sections are byte-aligned to simplify skipping over them.
     section_bytes_ = source->Finalize();
+    size_t total_size = 0;
+    section_bits_.Foreach([this, &total_size](const int idx) {
+      total_size += section_sizes_.Get(idx);
+    });
+    in_bounds_ = section_bytes_ <= end &&
+                 total_size <= static_cast<size_t>(end - section_bytes_);
   }
 
   template <class T>
   void operator()(std::unique_ptr<T>* const PIK_RESTRICT ptr) {
     ++idx_section_;
-    if (!section_bits_.TestAndReset(idx_section_)) {
+    if (!in_bounds_ || !section_bits_.TestAndReset(idx_section_)) {
       return;
     }
 
@@ -369,8 +375,9 @@ class SectionReader {
     PIK_CHECK(section_bytes_ == end);
   }
 
-  // Returns end pointer.
+  // Returns end pointer, or nullptr if out of bounds.
   const uint8_t* const PIK_RESTRICT Finalize() {
+    if (!in_bounds_) return nullptr;
     // Skip any remaining/unknown sections.
     section_bits_.Foreach(
         [this](const int idx) { section_bytes_ += section_sizes_.Get(idx); });
@@ -384,6 +391,7 @@ class SectionReader {
   int idx_section_ = -1;
   // Points to the start of the current section.
   const uint8_t* PIK_RESTRICT section_bytes_;
+  bool in_bounds_;
 };
 
 class SectionMaxSize {
@@ -468,9 +476,9 @@ size_t MaxCompressedSectionsSize(const Sections& sections_const) {
 }
 
 const uint8_t* const PIK_RESTRICT
-LoadSections(BitSource* const PIK_RESTRICT source,
+LoadSections(BitSource* const PIK_RESTRICT source, const uint8_t* end,
              Sections* const PIK_RESTRICT sections) {
-  SectionReader reader(source);
+  SectionReader reader(source, end);
   sections->VisitSections(&reader);
   return reader.Finalize();
 }
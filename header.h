@@ -46,12 +46,30 @@ struct Header {
     // other components are premultiplied.
     kAlpha = 1,
 
+    // The AC coefficients are coded in kNaturalCoeffOrder, which is not
+    // transmitted, instead of an order computed for the image.
+    kNaturalCoeffOrder = 2,
 
     // Any non-alpha plane(s) are compressed without loss.
     kWebPLossless = 4,
 
     // A palette precedes the image data (indices, possibly more than 8 bits).
     kPalette = 8,
+
+    // The AC coefficients are split into independently decodable groups of
+    // tile rows, preceded by a table of their sizes (see EncodeACGroups).
+    kACGroups = 16,
+
+    // The AC symbols are coded with kNumInterleavedANSStates interleaved ANS
+    // states instead of one.
+    kInterleavedANS = 32,
+
+    // The AC stream (without kACGroups) starts with a byte selecting one of
+    // the built-in histogram sets, or 0 if the histograms are transmitted.
+    kStaticACCodes = 64,
+
+    // Sections (see StoreSections) follow the header.
+    kSections = 128,
   };
 
   // For loading/storing fields from/to the compressed stream. Accepts Bytes,
@@ -115,25 +133,84 @@ struct EXIF {
   Bytes metadata;
 };
 
+// Byte sizes of the consecutive parts of the image data, which starts after
+// the sections. Allows seeking to e.g. the DC or alpha without decoding the
+// parts before it.
+struct Index {
+  // All fields use 32 bits, so that the encoder can reserve the space for the
+  // Index before the sizes are known and fill it in afterwards.
+  static constexpr uint32_t kSelectors = 0x20202020;
+
+  template <class Visitor>
+  void VisitFields(Visitor* const PIK_RESTRICT visitor) {
+    (*visitor)(kSelectors, &ytob_size);
+    (*visitor)(kSelectors, &quant_size);
+    (*visitor)(kSelectors, &dc_size);
+    (*visitor)(kSelectors, &ac_size);
+    (*visitor)(kSelectors, &alpha_size);
+  }
+
+  // Offsets relative to the start of the image data.
+  size_t QuantOffset() const { return ytob_size; }
+  size_t DCOffset() const { return QuantOffset() + quant_size; }
+  size_t ACOffset() const { return DCOffset() + dc_size; }
+  size_t AlphaOffset() const { return ACOffset() + ac_size; }
+  size_t DataSize() const { return AlphaOffset() + alpha_size; }
+
+  uint32_t ytob_size = 0;   // global and per-tile Y to B correlation
+  uint32_t quant_size = 0;  // quantization field
+  uint32_t dc_size = 0;
+  uint32_t ac_size = 0;     // including the AC group table and groups
+  uint32_t alpha_size = 0;  // zero unless Header::kAlpha
+};
+
+// Present in each frame of a multi-frame file (see FramesToPik), which is a
+// sequence of frames that each consist of a header, sections and image data,
+// as in a single image. Frames after the first may reference the previous
+// frame's AC entropy codes (kPreviousACCodes), replacing some of their
+// histograms (kUpdatedACCodes), and its quantization field.
+struct Frame {
+  enum Flags {
+    // The quantization field is not stored; it equals the previous frame's.
+    kPreviousQuantField = 1,
+  };
+
+  template <class Visitor>
+  void VisitFields(Visitor* const PIK_RESTRICT visitor) {
+    (*visitor)(kU32Selectors, &size);
+    (*visitor)(kU32Selectors, &duration);
+    (*visitor)(kU32Selectors, &flags);
+  }
+
+  uint32_t size = 0;      // [bytes] of the image data after the sections
+  uint32_t duration = 0;  // [ms] until the next frame is shown
+  uint32_t flags = 0;
+};
+
 struct Sections {
   template <class Visitor>
   void VisitSections(Visitor* const PIK_RESTRICT visitor) {
     // Sections are read/written in this order, so do not rearrange.
     (*visitor)(&icc);
     (*visitor)(&exif);
+    (*visitor)(&index);
+    (*visitor)(&frame);
     // Add new sections before this comment.
   }
 
   // Valid/present if non-null.
   std::unique_ptr<ICC> icc;
   std::unique_ptr<EXIF> exif;
+  std::unique_ptr<Index> index;
+  std::unique_ptr<Frame> frame;
 };
 
 // Returns an upper bound on the number of bytes needed to store "sections".
 size_t MaxCompressedSectionsSize(const Sections& sections);
 
+// Returns the end pointer, or nullptr if the sections extend beyond "end".
 const uint8_t* const PIK_RESTRICT
-LoadSections(BitSource* const PIK_RESTRICT source,
+LoadSections(BitSource* const PIK_RESTRICT source, const uint8_t* end,
              Sections* const PIK_RESTRICT sections);
 
 // "max_bytes" is the return value of MaxCompressedSectionsSize.
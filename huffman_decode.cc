@@ -259,7 +259,8 @@ int ReadHuffmanCodeLengths(
   return 1;
 }
 
-bool HuffmanDecodingData::ReadFromBitStream(BitReader* input) {
+bool HuffmanDecodingData::ReadFromBitStream(BitReader* input,
+                                            bool multi_symbol) {
   int ok = 1;
   int simple_code_or_skip;
 
@@ -348,7 +349,32 @@ bool HuffmanDecodingData::ReadFromBitStream(BitReader* input) {
   BuildHuffmanTable(&table_, kHuffmanTableBits,
                     &code_lengths[0], code_lengths.size(),
                     &counts[0]);
+  if (multi_symbol) {
+    BuildMultiSymbolTable();
+  } else {
+    multi_table_.clear();
+  }
   return true;
 }
 
+void HuffmanDecodingData::BuildMultiSymbolTable() {
+  multi_table_.resize(1 << kHuffmanMultiTableBits);
+  for (int key = 0; key < (1 << kHuffmanMultiTableBits); ++key) {
+    HuffmanMultiCode entry = { 0, 0, { 0 } };
+    /* Root entries are replicated for all unused high bits, so looking up
+       the remaining known bits is exact as long as the code fits into them. */
+    while (entry.num_symbols < kHuffmanMaxSymbolsPerCode) {
+      const HuffmanCode& code =
+          table_[(key >> entry.bits) & kHuffmanTableMask];
+      if (code.bits > kHuffmanTableBits ||
+          entry.bits + code.bits > kHuffmanMultiTableBits) {
+        break;
+      }
+      entry.values[entry.num_symbols++] = code.value;
+      entry.bits = static_cast<uint8_t>(entry.bits + code.bits);
+    }
+    multi_table_[key] = entry;
+  }
+}
+
 }  // namespace pik
@@ -30,12 +30,24 @@ namespace pik {
 static const int kHuffmanMaxLength = 15;
 static const int kHuffmanTableMask = 0xff;
 static const int kHuffmanTableBits = 8;
+// Lookup width and capacity of the optional multi-symbol table.
+static const int kHuffmanMultiTableBits = 11;
+static const int kHuffmanMaxSymbolsPerCode = 3;
 
 typedef struct {
   uint8_t bits;     /* number of bits used for this symbol */
   uint16_t value;   /* symbol value or table offset */
 } HuffmanCode;
 
+// Up to kHuffmanMaxSymbolsPerCode consecutive symbols whose codes together
+// fit into kHuffmanMultiTableBits bits. num_symbols == 0 means that the first
+// code is longer than kHuffmanTableBits and must be decoded with ReadSymbol.
+struct HuffmanMultiCode {
+  uint8_t bits;         /* total number of bits used for the symbols */
+  uint8_t num_symbols;
+  uint16_t values[kHuffmanMaxSymbolsPerCode];
+};
+
 struct HuffmanDecodingData {
   HuffmanDecodingData() {
     table_.reserve(2048);
@@ -44,7 +56,8 @@ struct HuffmanDecodingData {
   // Decodes the Huffman code lengths from the bit-stream and fills in the
   // pre-allocated table with the corresponding 2-level Huffman decoding table.
   // Returns false if the Huffman code lengths can not de decoded.
-  bool ReadFromBitStream(BitReader* input);
+  // If "multi_symbol" is true, also builds multi_table_ for ReadSymbols.
+  bool ReadFromBitStream(BitReader* input, bool multi_symbol = false);
 
   void ReorderSymbols(const uint8_t* symbol_lut, const size_t symbol_lut_size) {
     for (size_t i = 0; i < table_.size(); ++i) {
@@ -53,9 +66,15 @@ struct HuffmanDecodingData {
         table_[i].value = symbol_lut[table_[i].value];
       }
     }
+    if (!multi_table_.empty()) BuildMultiSymbolTable();
   }
 
+  // (Re)builds multi_table_ from the root level of table_.
+  void BuildMultiSymbolTable();
+
   std::vector<HuffmanCode> table_;
+  // Indexed by the next kHuffmanMultiTableBits bits; empty unless requested.
+  std::vector<HuffmanMultiCode> multi_table_;
 };
 
 struct HuffmanDecoder {
@@ -74,6 +93,27 @@ struct HuffmanDecoder {
     input->Advance(table->bits);
     return table->value;
   }
+
+  // Decodes between 1 and kHuffmanMaxSymbolsPerCode symbols into "symbols"
+  // with a single lookup in code.multi_table_, which must have been built.
+  // Returns the number of symbols decoded. Callers must not use this if fewer
+  // than kHuffmanMaxSymbolsPerCode symbols remain, because the bits of any
+  // surplus symbols are consumed, too.
+  int ReadSymbols(const HuffmanDecodingData& code, BitReader* input,
+                  int* PIK_RESTRICT symbols) {
+    input->FillBitBuffer();
+    const HuffmanMultiCode& entry =
+        code.multi_table_[input->PeekFixedBits<kHuffmanMultiTableBits>()];
+    if (entry.num_symbols == 0) {
+      symbols[0] = ReadSymbol(code, input);
+      return 1;
+    }
+    input->Advance(entry.bits);
+    for (int i = 0; i < kHuffmanMaxSymbolsPerCode; ++i) {
+      symbols[i] = entry.values[i];
+    }
+    return entry.num_symbols;
+  }
 };
 
 }  // namespace pik
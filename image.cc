@@ -17,9 +17,190 @@
 #include <stdint.h>
 
 #include "profiler.h"
+#include "simd/simd.h"
 
 namespace pik {
 
+RowInterleaver::RowInterleaver(const size_t num_planes,
+                               const size_t bytes_per_sample,
+                               const bool big_endian, const bool flip_sign)
+    : num_planes_(num_planes),
+      bytes_per_sample_(bytes_per_sample),
+      big_endian_(big_endian),
+      flip_sign_(flip_sign) {
+  PIK_CHECK(num_planes <= kMaxPlanes);
+  PIK_CHECK(bytes_per_sample == 1 || bytes_per_sample == 2);
+  for (size_t i = 0; i < kVectorBytes * num_planes; ++i) {
+    const size_t sample = i / bytes_per_sample;
+    const size_t plane = sample % num_planes;
+    const size_t x = sample / num_planes;
+    const size_t byte = SampleByte(i % bytes_per_sample);
+    for (size_t c = 0; c < num_planes; ++c) {
+      interleave_[i / kVectorBytes][c][i % kVectorBytes] =
+          c == plane ? x * bytes_per_sample + byte : 0x80;
+    }
+    const bool is_msb = bytes_per_sample == 2 && byte == 1;
+    interleaved_signs_[i / kVectorBytes][i % kVectorBytes] =
+        flip_sign && is_msb ? 0x80 : 0;
+  }
+  for (size_t i = 0; i < kVectorBytes; ++i) {
+    const size_t x = i / bytes_per_sample;
+    const size_t byte = i % bytes_per_sample;
+    for (size_t c = 0; c < num_planes; ++c) {
+      const size_t pos = (x * num_planes + c) * bytes_per_sample +
+                         SampleByte(byte);
+      for (size_t v = 0; v < num_planes; ++v) {
+        deinterleave_[c][v][i] =
+            v == pos / kVectorBytes ? pos % kVectorBytes : 0x80;
+      }
+    }
+    const bool is_msb = bytes_per_sample == 2 && byte == 1;
+    plane_signs_[i] = flip_sign && is_msb ? 0x80 : 0;
+  }
+}
+
+#if SIMD_ENABLE_SSE4
+
+template <size_t kNumPlanes>
+size_t RowInterleaver::InterleaveVectors(
+    const uint8_t* const* rows, const size_t xsize,
+    uint8_t* const PIK_RESTRICT out) const {
+  using namespace SIMD_NAMESPACE;
+  using V = u8x16;
+  // Loaded once so that the loop only touches the pixels.
+  V indices[kNumPlanes][kNumPlanes];
+  V signs[kNumPlanes];
+  for (size_t i = 0; i < kNumPlanes; ++i) {
+    for (size_t c = 0; c < kNumPlanes; ++c) {
+      indices[i][c] = load(V(), interleave_[i][c]);
+    }
+    signs[i] = load(V(), interleaved_signs_[i]);
+  }
+  const size_t bytes_per_sample = bytes_per_sample_;
+  const size_t pixels_per_vector = kVectorBytes / bytes_per_sample;
+  size_t x = 0;
+  for (; x + pixels_per_vector <= xsize; x += pixels_per_vector) {
+    V in[kNumPlanes];
+    for (size_t c = 0; c < kNumPlanes; ++c) {
+      in[c] = load_unaligned(V(), rows[c] + x * bytes_per_sample);
+    }
+    uint8_t* const PIK_RESTRICT pos = out + x * kNumPlanes * bytes_per_sample;
+    for (size_t i = 0; i < kNumPlanes; ++i) {
+      V packed = shuffle_bytes(in[0], indices[i][0]);
+      for (size_t c = 1; c < kNumPlanes; ++c) {
+        packed |= shuffle_bytes(in[c], indices[i][c]);
+      }
+      store_unaligned(packed ^ signs[i], pos + i * kVectorBytes);
+    }
+  }
+  return x;
+}
+
+template <size_t kNumPlanes>
+size_t RowInterleaver::DeinterleaveVectors(
+    const uint8_t* const PIK_RESTRICT in, const size_t xsize,
+    uint8_t* const* rows) const {
+  using namespace SIMD_NAMESPACE;
+  using V = u8x16;
+  V indices[kNumPlanes][kNumPlanes];
+  for (size_t c = 0; c < kNumPlanes; ++c) {
+    for (size_t i = 0; i < kNumPlanes; ++i) {
+      indices[c][i] = load(V(), deinterleave_[c][i]);
+    }
+  }
+  const V signs = load(V(), plane_signs_);
+  const size_t bytes_per_sample = bytes_per_sample_;
+  const size_t pixels_per_vector = kVectorBytes / bytes_per_sample;
+  size_t x = 0;
+  for (; x + pixels_per_vector <= xsize; x += pixels_per_vector) {
+    const uint8_t* const PIK_RESTRICT pos =
+        in + x * kNumPlanes * bytes_per_sample;
+    V packed[kNumPlanes];
+    for (size_t i = 0; i < kNumPlanes; ++i) {
+      packed[i] = load_unaligned(V(), pos + i * kVectorBytes);
+    }
+    for (size_t c = 0; c < kNumPlanes; ++c) {
+      V plane = shuffle_bytes(packed[0], indices[c][0]);
+      for (size_t i = 1; i < kNumPlanes; ++i) {
+        plane |= shuffle_bytes(packed[i], indices[c][i]);
+      }
+      store_unaligned(plane ^ signs, rows[c] + x * bytes_per_sample);
+    }
+  }
+  return x;
+}
+
+#endif  // SIMD_ENABLE_SSE4
+
+void RowInterleaver::Interleave(const uint8_t* const* rows, const size_t xsize,
+                                uint8_t* const PIK_RESTRICT out) const {
+  size_t x = 0;
+#if SIMD_ENABLE_SSE4
+  switch (num_planes_) {
+    case 1:
+      x = InterleaveVectors<1>(rows, xsize, out);
+      break;
+    case 2:
+      x = InterleaveVectors<2>(rows, xsize, out);
+      break;
+    case 3:
+      x = InterleaveVectors<3>(rows, xsize, out);
+      break;
+    case 4:
+      x = InterleaveVectors<4>(rows, xsize, out);
+      break;
+  }
+#endif
+  const uint8_t sign = flip_sign_ ? 0x80 : 0;
+  for (; x < xsize; ++x) {
+    for (size_t c = 0; c < num_planes_; ++c) {
+      uint8_t* const PIK_RESTRICT pos =
+          out + (x * num_planes_ + c) * bytes_per_sample_;
+      if (bytes_per_sample_ == 1) {
+        pos[0] = rows[c][x];
+      } else {
+        pos[SampleByte(0)] = rows[c][2 * x + 0];
+        pos[SampleByte(1)] = rows[c][2 * x + 1] ^ sign;
+      }
+    }
+  }
+}
+
+void RowInterleaver::Deinterleave(const uint8_t* const PIK_RESTRICT in,
+                                  const size_t xsize,
+                                  uint8_t* const* rows) const {
+  size_t x = 0;
+#if SIMD_ENABLE_SSE4
+  switch (num_planes_) {
+    case 1:
+      x = DeinterleaveVectors<1>(in, xsize, rows);
+      break;
+    case 2:
+      x = DeinterleaveVectors<2>(in, xsize, rows);
+      break;
+    case 3:
+      x = DeinterleaveVectors<3>(in, xsize, rows);
+      break;
+    case 4:
+      x = DeinterleaveVectors<4>(in, xsize, rows);
+      break;
+  }
+#endif
+  const uint8_t sign = flip_sign_ ? 0x80 : 0;
+  for (; x < xsize; ++x) {
+    for (size_t c = 0; c < num_planes_; ++c) {
+      const uint8_t* const PIK_RESTRICT pos =
+          in + (x * num_planes_ + c) * bytes_per_sample_;
+      if (bytes_per_sample_ == 1) {
+        rows[c][x] = pos[0];
+      } else {
+        rows[c][2 * x + 0] = pos[SampleByte(0)];
+        rows[c][2 * x + 1] = pos[SampleByte(1)] ^ sign;
+      }
+    }
+  }
+}
+
 ImageB Float255ToByteImage(const ImageF& from) {
   ImageB to(from.xsize(), from.ysize());
   PROFILER_FUNC;
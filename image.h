@@ -735,6 +735,47 @@ using MetaImageU = MetaImage<uint16_t>;
 using MetaImageF = MetaImage<float>;
 using MetaImageD = MetaImage<double>;
 
+// Receives an image as a sequence of horizontal bands, from top to bottom, as
+// an alternative to returning the whole Image3 at once.
+template <typename ComponentType>
+class Image3Sink {
+ public:
+  virtual ~Image3Sink() {}
+
+  // Called once before the first band with the dimensions of the whole image.
+  // Returning false aborts.
+  virtual bool Begin(const size_t xsize, const size_t ysize) { return true; }
+
+  // "band" holds the rows [y, y + band.ysize()) of the image and is only valid
+  // until the call returns. Returning false aborts.
+  virtual bool Band(size_t y, const Image3<ComponentType>& band) = 0;
+};
+
+using Image3SinkB = Image3Sink<uint8_t>;
+using Image3SinkU = Image3Sink<uint16_t>;
+using Image3SinkF = Image3Sink<float>;
+
+// Counterpart of Image3Sink: produces an image in bands of consecutive rows,
+// e.g. while decoding it from a file, so that it need not be stored at once.
+template <typename ComponentType>
+class Image3Source {
+ public:
+  virtual ~Image3Source() {}
+
+  // Dimensions of the whole image.
+  virtual size_t xsize() const = 0;
+  virtual size_t ysize() const = 0;
+
+  // Writes the next rows of the image to rows [0, n) of "band", which has at
+  // least xsize() columns, where n is the smaller of band->ysize() and the
+  // number of remaining rows. Returning false aborts.
+  virtual bool NextBand(Image3<ComponentType>* band) = 0;
+};
+
+using Image3SourceU = Image3Source<uint16_t>;
+// By convention, float sources produce linear RGB (0-255) like MetaImageF.
+using Image3SourceF = Image3Source<float>;
+
 template <typename T>
 Image3<T> CopyImage3(const Image3<T>& image3) {
   return Image3<T>(CopyImage(image3.plane(0)), CopyImage(image3.plane(1)),
@@ -886,19 +927,74 @@ void FillImage(const Generator& generator, Image3<T>* image) {
   }
 }
 
+// Converts between up to four planes (rows of 8 or 16-bit samples) and
+// interleaved pixels, e.g. RGB, RGBA or BGRA (pass the rows in that order).
+// Each group of 16 bytes per plane is gathered with byte shuffles whose
+// indices are precomputed for the layout. The interleaved samples are in
+// native byte order unless "big_endian" (e.g. PNG); "flip_sign" adds 0x8000
+// to 16-bit samples, i.e. converts between int16_t and uint16_t.
+class RowInterleaver {
+ public:
+  RowInterleaver() {}
+  RowInterleaver(size_t num_planes, size_t bytes_per_sample,
+                 bool big_endian = false, bool flip_sign = false);
+
+  // Writes "xsize" interleaved pixels from "rows" (num_planes) to "out".
+  void Interleave(const uint8_t* const* rows, size_t xsize,
+                  uint8_t* PIK_RESTRICT out) const;
+
+  // Writes "xsize" pixels from the interleaved "in" to "rows" (num_planes).
+  void Deinterleave(const uint8_t* PIK_RESTRICT in, size_t xsize,
+                    uint8_t* const* rows) const;
+
+ private:
+  static constexpr size_t kMaxPlanes = 4;
+  static constexpr size_t kVectorBytes = 16;
+
+  // Convert whole vectors and return the number of pixels converted.
+  template <size_t kNumPlanes>
+  size_t InterleaveVectors(const uint8_t* const* rows, size_t xsize,
+                           uint8_t* PIK_RESTRICT out) const;
+  template <size_t kNumPlanes>
+  size_t DeinterleaveVectors(const uint8_t* PIK_RESTRICT in, size_t xsize,
+                             uint8_t* const* rows) const;
+
+  // Returns the byte of a sample that is at "offset" in the interleaved
+  // order.
+  size_t SampleByte(const size_t offset) const {
+    return big_endian_ ? bytes_per_sample_ - 1 - offset : offset;
+  }
+
+  size_t num_planes_ = 0;
+  size_t bytes_per_sample_ = 1;
+  bool big_endian_ = false;
+  bool flip_sign_ = false;
+  // For interleaved vector i, the bytes of the vector of plane c that it
+  // receives, or 0x80 (none).
+  alignas(16) uint8_t interleave_[kMaxPlanes][kMaxPlanes][kVectorBytes];
+  // For the vector of plane c, the bytes of interleaved vector i that it
+  // receives, or 0x80 (none).
+  alignas(16) uint8_t deinterleave_[kMaxPlanes][kMaxPlanes][kVectorBytes];
+  // Masks for flip_sign_ (the upper byte of every 16-bit sample) in the
+  // interleaved vectors and in the planes.
+  alignas(16) uint8_t interleaved_signs_[kMaxPlanes][kVectorBytes];
+  alignas(16) uint8_t plane_signs_[kVectorBytes];
+};
+
 template <typename T>
 std::vector<T> InterleavedFromImage3(const Image3<T>& image3) {
+  static_assert(sizeof(T) <= 2, "RowInterleaver requires 8 or 16-bit samples");
   const size_t xsize = image3.xsize();
   const size_t ysize = image3.ysize();
   std::vector<T> interleaved(xsize * ysize * 3);
+  const RowInterleaver interleaver(3, sizeof(T));
   for (size_t y = 0; y < ysize; ++y) {
-    auto row = image3.Row(y);
-    T* const PIK_RESTRICT interleaved_row = &interleaved[y * xsize * 3];
-    for (size_t x = 0; x < xsize; ++x) {
-      interleaved_row[3 * x + 0] = row[0][x];
-      interleaved_row[3 * x + 1] = row[1][x];
-      interleaved_row[3 * x + 2] = row[2][x];
+    const uint8_t* rows[3];
+    for (int c = 0; c < 3; ++c) {
+      rows[c] = reinterpret_cast<const uint8_t*>(image3.ConstPlaneRow(c, y));
     }
+    interleaver.Interleave(
+        rows, xsize, reinterpret_cast<uint8_t*>(&interleaved[y * xsize * 3]));
   }
   return interleaved;
 }
@@ -907,32 +1003,30 @@ template <typename T>
 Image3<T> Image3FromInterleaved(const T* const interleaved, const size_t xsize,
                                 const size_t ysize,
                                 const size_t bytes_per_row) {
+  static_assert(sizeof(T) <= 2, "RowInterleaver requires 8 or 16-bit samples");
   PIK_ASSERT(bytes_per_row >= 3 * xsize * sizeof(T));
   Image3<T> image3(xsize, ysize);
   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(interleaved);
+  const RowInterleaver interleaver(3, sizeof(T));
   for (size_t y = 0; y < ysize; ++y) {
-    auto out_row = image3.Row(y);
-    const auto interleaved_row =
-        reinterpret_cast<const T*>(bytes + y * bytes_per_row);
-    for (size_t x = 0; x < xsize; ++x) {
-      out_row[0][x] = interleaved_row[3 * x + 0];
-      out_row[1][x] = interleaved_row[3 * x + 1];
-      out_row[2][x] = interleaved_row[3 * x + 2];
+    uint8_t* rows[3];
+    for (int c = 0; c < 3; ++c) {
+      rows[c] = reinterpret_cast<uint8_t*>(image3.PlaneRow(c, y));
     }
+    interleaver.Deinterleave(bytes + y * bytes_per_row, xsize, rows);
   }
   return image3;
 }
 
 template <typename T>
 std::vector<std::vector<T>> Packed3FromImage3(const Image3<T>& planes) {
+  const size_t xsize = planes.xsize();
   std::vector<std::vector<T>> result(
-      3, std::vector<T>(planes.xsize() * planes.ysize()));
-  for (size_t y = 0; y < planes.ysize(); y++) {
-    auto row = planes.Row(y);
-    for (size_t x = 0; x < planes.xsize(); x++) {
-      for (int i = 0; i < 3; i++) {
-        result[i][y * planes.xsize() + x] = row[i][x];
-      }
+      3, std::vector<T>(xsize * planes.ysize()));
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < planes.ysize(); y++) {
+      memcpy(&result[c][y * xsize], planes.ConstPlaneRow(c, y),
+             xsize * sizeof(T));
     }
   }
   return result;
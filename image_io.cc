@@ -17,18 +17,31 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
 #include <array>
 #include <memory>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "cache_aligned.h"
 #include "compiler_specific.h"
+#include "dct.h"
 #include "gamma_correct.h"
+#include "simd/simd.h"
 #include "yuv_convert.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 
 extern "C" {
 #include "jpeglib.h"
@@ -57,44 +70,123 @@ class FileWrapper {
 };
 
 
-bool ReadImage(ImageFormatPNM, const std::string& pathname, ImageB* image) {
-  FileWrapper f(pathname, "rb");
-  if (f == nullptr) {
-    return PIK_FAILURE("File open");
+// Sequential reads from either a file (not owned) or a memory buffer.
+class ByteReader {
+ public:
+  explicit ByteReader(FILE* f) : file_(f) {}
+  ByteReader(const uint8_t* buf, const size_t size)
+      : pos_(buf), end_(buf + size) {}
+
+  // Copies the next "size" bytes to "to" and returns how many there were
+  // (fewer than "size" only at the end of the input).
+  size_t Read(void* to, const size_t size) {
+    if (file_ != nullptr) return fread(to, 1, size, file_);
+    const size_t num_bytes = std::min<size_t>(size, end_ - pos_);
+    memcpy(to, pos_, num_bytes);
+    pos_ += num_bytes;
+    return num_bytes;
+  }
+
+  bool ReadChar(char* c) {
+    if (file_ == nullptr) return Read(c, 1) == 1;
+    // Much cheaper than fread for the character-wise header parsing.
+    const int ch = getc(file_);
+    *c = static_cast<char>(ch);
+    return ch != EOF;
+  }
+
+  // Skips the next "size" bytes and returns how many there were. Regular
+  // files are seeked instead of read, e.g. for skipping video frames.
+  size_t Skip(const size_t size) {
+    if (file_ == nullptr) {
+      const size_t num_bytes = std::min<size_t>(size, end_ - pos_);
+      pos_ += num_bytes;
+      return num_bytes;
+    }
+#ifdef __linux__
+    struct stat st;
+    const off_t pos = ftello(file_);
+    if (pos >= 0 && fstat(fileno(file_), &st) == 0 && S_ISREG(st.st_mode)) {
+      const size_t num_bytes =
+          std::min<size_t>(size, std::max<off_t>(st.st_size - pos, 0));
+      if (fseeko(file_, num_bytes, SEEK_CUR) == 0) return num_bytes;
+    }
+#endif
+    uint8_t buffer[4096];
+    size_t num_bytes = 0;
+    while (num_bytes < size) {
+      const size_t chunk = std::min(size - num_bytes, sizeof(buffer));
+      const size_t bytes_read = Read(buffer, chunk);
+      num_bytes += bytes_read;
+      if (bytes_read != chunk) break;
+    }
+    return num_bytes;
+  }
+
+ private:
+  FILE* const file_ = nullptr;
+  const uint8_t* pos_ = nullptr;
+  const uint8_t* const end_ = nullptr;
+};
+
+// Skips whitespace and reads a decimal field including the single whitespace
+// character that terminates it.
+bool ReadPNMField(ByteReader* reader, size_t* field) {
+  char c;
+  do {
+    if (!reader->ReadChar(&c)) return false;
+  } while (isspace(c));
+  if (!isdigit(c)) return false;
+  *field = 0;
+  while (isdigit(c)) {
+    if (*field >= (size_t(1) << 32)) return false;
+    *field = *field * 10 + (c - '0');
+    if (!reader->ReadChar(&c)) return false;
+  }
+  return isspace(c) != 0;
+}
+
+// Reads the "P<mode> <xsize> <ysize> 255" header of a binary PGM or PPM.
+bool ReadPNMHeader(ByteReader* reader, int* mode, size_t* xsize,
+                   size_t* ysize) {
+  char c;
+  if (!reader->ReadChar(&c) || c != 'P' || !reader->ReadChar(&c) ||
+      !isdigit(c)) {
+    return PIK_FAILURE("Read header");
+  }
+  *mode = c - '0';
+  size_t max_value;
+  if (!ReadPNMField(reader, xsize) || !ReadPNMField(reader, ysize) ||
+      !ReadPNMField(reader, &max_value) || max_value != 255) {
+    return PIK_FAILURE("Read header");
   }
+  return true;
+}
 
+bool ReadPNM(ByteReader* reader, ImageB* image) {
   int mode;
   size_t xsize, ysize;
-  const int num_fields =
-      fscanf(f, "P%d\n%zu %zu\n255\n", &mode, &xsize, &ysize);
-  if (num_fields != 3) {
-    return PIK_FAILURE("Read header");
+  if (!ReadPNMHeader(reader, &mode, &xsize, &ysize)) {
+    return false;
   }
   if (mode != 5) {
     return PIK_FAILURE("Not grayscale");
   }
 
   *image = ImageB(xsize, ysize);
-  size_t bytes_read = 0;
-      for (size_t y = 0; y < ysize; ++y) {
-        bytes_read += fread(image->Row(y), 1, xsize, f);
-      }
-      PIK_CHECK(bytes_read == xsize * ysize);
-      return true;
-}
-
-bool ReadImage(ImageFormatPNM, const std::string& pathname, Image3B* image) {
-  FileWrapper f(pathname, "rb");
-  if (f == nullptr) {
-    return PIK_FAILURE("File open");
+  for (size_t y = 0; y < ysize; ++y) {
+    if (reader->Read(image->Row(y), xsize) != xsize) {
+      return PIK_FAILURE("Read pixels");
+    }
   }
+  return true;
+}
 
+bool ReadPNM(ByteReader* reader, Image3B* image) {
   int mode;
   size_t xsize, ysize;
-  const int num_fields =
-      fscanf(f, "P%d\n%zu %zu\n255\n", &mode, &xsize, &ysize);
-  if (num_fields != 3) {
-    return PIK_FAILURE("Read header");
+  if (!ReadPNMHeader(reader, &mode, &xsize, &ysize)) {
+    return false;
   }
   if (mode != 6) {
     return PIK_FAILURE("Not RGB");
@@ -102,13 +194,45 @@ bool ReadImage(ImageFormatPNM, const std::string& pathname, Image3B* image) {
 
   const size_t bytes_per_row = xsize * 3;
   std::vector<uint8_t> interleaved(ysize * bytes_per_row);
-  const size_t bytes_read = fread(interleaved.data(), 1, interleaved.size(), f);
-  PIK_CHECK(bytes_read == interleaved.size());
+  if (reader->Read(interleaved.data(), interleaved.size()) !=
+      interleaved.size()) {
+    return PIK_FAILURE("Read pixels");
+  }
   *image =
       Image3FromInterleaved(interleaved.data(), xsize, ysize, bytes_per_row);
   return true;
 }
 
+template <class Image>
+bool ReadPNMFile(const std::string& pathname, Image* image) {
+  FileWrapper f(pathname, "rb");
+  if (f == nullptr) {
+    return PIK_FAILURE("File open");
+  }
+  ByteReader reader(f);
+  return ReadPNM(&reader, image);
+}
+
+bool ReadImage(ImageFormatPNM, const std::string& pathname, ImageB* image) {
+  return ReadPNMFile(pathname, image);
+}
+
+bool ReadImage(ImageFormatPNM, const std::string& pathname, Image3B* image) {
+  return ReadPNMFile(pathname, image);
+}
+
+bool ReadImage(ImageFormatPNM, const uint8_t* buf, size_t size,
+               ImageB* image) {
+  ByteReader reader(buf, size);
+  return ReadPNM(&reader, image);
+}
+
+bool ReadImage(ImageFormatPNM, const uint8_t* buf, size_t size,
+               Image3B* image) {
+  ByteReader reader(buf, size);
+  return ReadPNM(&reader, image);
+}
+
 // PGM
 bool WriteImage(ImageFormatPNM, const ImageB& image,
                 const std::string& pathname) {
@@ -147,9 +271,49 @@ bool WriteImage(ImageFormatPNM, const Image3B& image3,
 }
 
 // Y4M
+
+// Widens the "num" 8-bit samples at "from" to 16 bits; "to" is aligned.
+void WidenRow(const uint8_t* PIK_RESTRICT from, const size_t num,
+              uint16_t* PIK_RESTRICT to) {
+  size_t x = 0;
+#if SIMD_ENABLE_AVX2
+  using namespace SIMD_NAMESPACE;
+  for (; x + 16 <= num; x += 16) {
+    store(convert_to(uint16_t(), load_unaligned(u8x16(), from + x)), to + x);
+  }
+#endif
+  for (; x < num; ++x) {
+    to[x] = from[x];
+  }
+}
+
+// Returns the bitwise OR of the "num" samples at (aligned) "row", i.e.
+// whether any of them exceeds a limit of the form 2^n - 1.
+uint16_t OrOfSamples(const uint16_t* PIK_RESTRICT row, const size_t num) {
+  uint16_t bits = 0;
+  size_t x = 0;
+#if SIMD_ENABLE_AVX2
+  using namespace SIMD_NAMESPACE;
+  u16x16 vbits = setzero(u16x16());
+  for (; x + 16 <= num; x += 16) {
+    vbits |= load(u16x16(), row + x);
+  }
+  SIMD_ALIGN uint16_t lanes[16];
+  store(vbits, lanes);
+  for (const uint16_t lane : lanes) {
+    bits |= lane;
+  }
+#endif
+  for (; x < num; ++x) {
+    bits |= row[x];
+  }
+  return bits;
+}
+
 class Y4MReader {
  public:
-  explicit Y4MReader(FILE* f) : f_(f), xsize_(0), ysize_(0) {}
+  explicit Y4MReader(ByteReader* reader)
+      : reader_(reader), xsize_(0), ysize_(0) {}
 
   int bit_depth() const { return bit_depth_; }
 
@@ -209,18 +373,56 @@ class Y4MReader {
     return (xsize_ > 0 && ysize_ > 0);
   }
 
-  bool ReadFrame(Image3B* yuv) {
-    if (!ReadLine()) return false;
+  size_t xsize() const { return xsize_; }
+  size_t ysize() const { return ysize_; }
+
+  // Reads the header of the next frame. Sets "end" instead if the input ends
+  // before it.
+  bool ReadFrameHeader(bool* end) {
+    *end = false;
+    if (!reader_->ReadChar(&line_[0])) {
+      *end = true;
+      return true;
+    }
+    if (line_[0] == '\n') {
+      line_[0] = '\0';
+    } else if (!ReadLine(1)) {
+      return false;
+    }
     if (memcmp(line_, "FRAME", 5)) {
       return PIK_FAILURE("Invalid frame header");
     }
+    return true;
+  }
+
+  // The following read a frame including its header. They reuse the planes
+  // of "yuv" if it already has the frame size.
+
+  bool ReadFrame(Image3B* yuv) {
+    bool end;
+    if (!ReadFrameHeader(&end)) return false;
+    if (end) return PIK_FAILURE("Unexpected end of file");
+    return ReadFrameData(yuv);
+  }
+
+  bool ReadFrame(Image3U* yuv) {
+    bool end;
+    if (!ReadFrameHeader(&end)) return false;
+    if (end) return PIK_FAILURE("Unexpected end of file");
+    return ReadFrameData(yuv);
+  }
+
+  // Same as ReadFrame, but after ReadFrameHeader.
+  bool ReadFrameData(Image3B* yuv) {
     if (bit_depth_ != 8) {
       return PIK_FAILURE("Invalid bit-depth");
     }
-    *yuv = Image3B(xsize_, ysize_);
+    if (yuv->xsize() != xsize_ || yuv->ysize() != ysize_) {
+      *yuv = Image3B(xsize_, ysize_);
+    }
     for (int c = 0; c < 3; ++c) {
       for (int y = 0; y < ysize_; ++y) {
-        const size_t bytes_read = fread(yuv->Row(y)[c], 1, xsize_, f_);
+        const size_t bytes_read = reader_->Read(yuv->Row(y)[c], xsize_);
         if (bytes_read != xsize_) {
           return PIK_FAILURE("Unexpected end of file");
         }
@@ -229,42 +431,54 @@ class Y4MReader {
     return true;
   }
 
-  bool ReadFrame(Image3U* yuv) {
-    if (!ReadLine()) return false;
-    if (memcmp(line_, "FRAME", 5)) {
-      return PIK_FAILURE("Invalid frame header");
+  bool ReadFrameData(Image3U* yuv) {
+    if (yuv->xsize() != xsize_ || yuv->ysize() != ysize_) {
+      *yuv = Image3U(xsize_, ysize_);
     }
-    *yuv = Image3U(xsize_, ysize_);
-    int byte_depth = (bit_depth_ + 7) / 8;
-    int limit = (1 << bit_depth_) - 1;
+    const size_t byte_depth = (bit_depth_ + 7) / 8;
+    const uint16_t limit = (1 << bit_depth_) - 1;
     PIK_ASSERT(byte_depth == 1 || byte_depth == 2);
+    // 16-bit samples are little-endian like the image and are read directly
+    // into its rows; 8-bit rows go through row_.
+    row_.resize(byte_depth == 1 ? xsize_ : 0);
+    uint16_t bits = 0;
     for (int c = 0; c < 3; ++c) {
       for (int y = 0; y < ysize_; ++y) {
-        for (int x = 0; x < xsize_; ++x) {
-          if (byte_depth == 1) {
-            uint8_t val;
-            if (fread(&val, sizeof(val), 1, f_) != 1) return false;
-            yuv->Row(y)[c][x] = val;
-          } else {
-            uint16_t val;
-            if (fread(&val, sizeof(val), 1, f_) != 1) return false;
-            if (val > limit) {
-              return PIK_FAILURE("Value greater than indicated by bit-depth");
-            }
-            yuv->Row(y)[c][x] = val;
+        uint16_t* const PIK_RESTRICT row_out = yuv->PlaneRow(c, y);
+        if (byte_depth == 1) {
+          if (reader_->Read(row_.data(), xsize_) != xsize_) {
+            return PIK_FAILURE("Unexpected end of file");
+          }
+          WidenRow(row_.data(), xsize_, row_out);
+        } else {
+          const size_t row_size = xsize_ * byte_depth;
+          if (reader_->Read(row_out, row_size) != row_size) {
+            return PIK_FAILURE("Unexpected end of file");
           }
+          bits |= OrOfSamples(row_out, xsize_);
         }
       }
     }
+    if ((bits & ~limit) != 0) {
+      return PIK_FAILURE("Value greater than indicated by bit-depth");
+    }
+    return true;
+  }
+
+  // Same as ReadFrameData, but discards the frame.
+  bool SkipFrameData() {
+    const size_t frame_size = 3 * ysize_ * xsize_ * ((bit_depth_ + 7) / 8);
+    if (reader_->Skip(frame_size) != frame_size) {
+      return PIK_FAILURE("Unexpected end of file");
+    }
     return true;
   }
 
  private:
-  bool ReadLine() {
-    int pos = 0;
+  // Reads the rest of a line whose first "pos" characters are in line_.
+  bool ReadLine(int pos = 0) {
     for (; pos < 79; ++pos) {
-      int n = fread(&line_[pos], 1, 1, f_);
-      if (n != 1) {
+      if (!reader_->ReadChar(&line_[pos])) {
         return PIK_FAILURE("Unexpected end of file");
       }
       if (line_[pos] == '\n') break;
@@ -273,37 +487,94 @@ class Y4MReader {
     return true;
   }
 
-  FILE* f_;
+  ByteReader* reader_;
   size_t xsize_;
   size_t ysize_;
   int bit_depth_ = 8;
   char line_[80];
+  std::vector<uint8_t> row_;
 };
 
-bool ReadImage(ImageFormatY4M, const std::string& pathname, Image3B* image) {
-  FileWrapper f(pathname, "rb");
-  if (f == nullptr) {
-    return PIK_FAILURE("File open");
+struct Y4MFrameReader::Impl {
+  explicit Impl(FILE* f) : input(f), reader(&input) {}
+  Impl(const uint8_t* buf, const size_t size)
+      : input(buf, size), reader(&input) {}
+
+  ByteReader input;
+  Y4MReader reader;
+};
+
+Y4MFrameReader::Y4MFrameReader(FILE* f) : impl_(new Impl(f)) {}
+
+Y4MFrameReader::Y4MFrameReader(const uint8_t* buf, const size_t size)
+    : impl_(new Impl(buf, size)) {}
+
+Y4MFrameReader::~Y4MFrameReader() {}
+
+bool Y4MFrameReader::ReadHeader() { return impl_->reader.ReadHeader(); }
+
+size_t Y4MFrameReader::xsize() const { return impl_->reader.xsize(); }
+size_t Y4MFrameReader::ysize() const { return impl_->reader.ysize(); }
+int Y4MFrameReader::bit_depth() const { return impl_->reader.bit_depth(); }
+
+bool Y4MFrameReader::NextFrame(Image3U* yuv, bool* end) {
+  if (!impl_->reader.ReadFrameHeader(end)) return false;
+  if (*end) return true;
+  return impl_->reader.ReadFrameData(yuv);
+}
+
+bool Y4MFrameReader::SkipFrame(bool* end) {
+  if (!impl_->reader.ReadFrameHeader(end)) return false;
+  if (*end) return true;
+  return impl_->reader.SkipFrameData();
+}
+
+bool ReadY4M(ByteReader* input, Image3B* image) {
+  Y4MReader reader(input);
+  if (!reader.ReadHeader()) {
+    return false;
   }
-  Y4MReader reader(f);
+  return reader.ReadFrame(image);
+}
+
+bool ReadY4M(ByteReader* input, Image3U* image, int* bit_depth) {
+  Y4MReader reader(input);
   if (!reader.ReadHeader()) {
     return false;
   }
+  *bit_depth = reader.bit_depth();
   return reader.ReadFrame(image);
 }
 
+bool ReadImage(ImageFormatY4M, const std::string& pathname, Image3B* image) {
+  FileWrapper f(pathname, "rb");
+  if (f == nullptr) {
+    return PIK_FAILURE("File open");
+  }
+  ByteReader input(f);
+  return ReadY4M(&input, image);
+}
+
 bool ReadImage(ImageFormatY4M, const std::string& pathname, Image3U* image,
                int* bit_depth) {
   FileWrapper f(pathname, "rb");
   if (f == nullptr) {
     return PIK_FAILURE("File open");
   }
-  Y4MReader reader(f);
-  if (!reader.ReadHeader()) {
-    return false;
-  }
-  *bit_depth = reader.bit_depth();
-  return reader.ReadFrame(image);
+  ByteReader input(f);
+  return ReadY4M(&input, image, bit_depth);
+}
+
+bool ReadImage(ImageFormatY4M, const uint8_t* buf, size_t size,
+               Image3B* image) {
+  ByteReader input(buf, size);
+  return ReadY4M(&input, image);
+}
+
+bool ReadImage(ImageFormatY4M, const uint8_t* buf, size_t size, Image3U* image,
+               int* bit_depth) {
+  ByteReader input(buf, size);
+  return ReadY4M(&input, image, bit_depth);
 }
 
 bool WriteImage(ImageFormatY4M, const Image3B& image3,
@@ -363,9 +634,18 @@ bool WriteImage(ImageFormatY4M format, const Image3U& image3,
   return true;
 }
 
+// libpng read callback for PngReader and PngSource, whose io_ptr is a
+// ByteReader. Files and memory buffers are thus handled alike.
+void PngReadCallback(png_structp png, png_bytep data, png_size_t size) {
+  ByteReader* input = static_cast<ByteReader*>(png_get_io_ptr(png));
+  if (input->Read(data, size) != size) {
+    png_error(png, "Unexpected end of input");  // Does not return.
+  }
+}
+
 class PngReader {
  public:
-  PngReader(const std::string& pathname) : file_(pathname, "rb") {
+  explicit PngReader(ByteReader* input) : input_(input) {
     png_ = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
                                   nullptr);
     if (png_ != nullptr) {
@@ -382,19 +662,11 @@ class PngReader {
       return PIK_FAILURE("PNG");
     }
 
-#if PIK_PORTABLE_IO
-    if (file_ == nullptr) {
-      return PIK_FAILURE("File open");
-    }
-#endif
-
     if (setjmp(png_jmpbuf(png_)) != 0) {
       return PIK_FAILURE("PNG");
     }
 
-#if PIK_PORTABLE_IO
-    png_init_io(png_, file_);
-#endif
+    png_set_read_fn(png_, input_, &PngReadCallback);
 
     // Convert 1..4 samples to bytes. Resolve palette to RGB(A).
     const unsigned int transforms =
@@ -413,9 +685,7 @@ class PngReader {
   png_bytep* Rows() const { return png_get_rows(png_, info_); }
 
  private:
-#if PIK_PORTABLE_IO
-  FileWrapper file_;
-#endif
+  ByteReader* input_;
   png_structp png_ = nullptr;
   png_infop info_ = nullptr;
 };
@@ -446,9 +716,8 @@ T PIK_INLINE ReadFromU16(const uint8_t* const p, const int bias) {
 // bias is 0x8000 when T=int16_t to convert the smallest unsigned value into
 // the smallest signed value.
 template <typename T>
-bool ReadPNGImage(const std::string& pathname, const int bias,
-                  Image<T>* image) {
-  PngReader reader(pathname);
+bool ReadPNGImage(ByteReader* input, const int bias, Image<T>* image) {
+  PngReader reader(input);
   size_t xsize, ysize, num_planes, bit_depth;
   if (!reader.ReadHeader(&xsize, &ysize, &num_planes, &bit_depth)) {
     return false;
@@ -482,9 +751,9 @@ bool ReadPNGImage(const std::string& pathname, const int bias,
 
 // Adds alpha channel to the output image only if a non-opaque pixel is present.
 template <typename T>
-bool ReadPNGMetaImage(const std::string& pathname, const int bias,
+bool ReadPNGMetaImage(ByteReader* input, const int bias,
                       MetaImage<T>* image) {
-  PngReader reader(pathname);
+  PngReader reader(input);
   size_t xsize, ysize, num_planes, bit_depth;
   if (!reader.ReadHeader(&xsize, &ysize, &num_planes, &bit_depth)) {
     return false;
@@ -553,6 +822,17 @@ bool ReadPNGMetaImage(const std::string& pathname, const int bias,
         }
       }
     }
+  } else if (num_planes == 3 && sizeof(T) == stride) {
+    // Same bit depth: only shuffles.
+    const RowInterleaver deinterleaver(3, stride, /*big_endian=*/true,
+                                       bias != 0);
+    for (size_t y = 0; y < ysize; ++y) {
+      uint8_t* rows[3];
+      for (int c = 0; c < 3; ++c) {
+        rows[c] = reinterpret_cast<uint8_t*>(image->GetColor().PlaneRow(c, y));
+      }
+      deinterleaver.Deinterleave(interleaved_rows[y], xsize, rows);
+    }
   } else if (num_planes == 3) {
     for (size_t y = 0; y < ysize; ++y) {
       const uint8_t* const PIK_RESTRICT interleaved_row = interleaved_rows[y];
@@ -576,10 +856,23 @@ bool ReadPNGMetaImage(const std::string& pathname, const int bias,
     }
   } else /* if (num_planes == 4) */ {
     uint16_t alpha_masked = 65535;
+    // Same bit depth: only shuffles; the alpha samples go to a temporary row.
+    const RowInterleaver deinterleaver(4, stride, /*big_endian=*/true,
+                                       bias != 0);
+    std::vector<T> alpha_row(sizeof(T) == stride ? xsize : 0);
     for (size_t y = 0; y < ysize; ++y) {
       const uint8_t* const PIK_RESTRICT interleaved_row = interleaved_rows[y];
       auto rows = image->GetColor().Row(y);
-      if (stride == 1) {
+      if (sizeof(T) == stride) {
+        uint8_t* planes[4] = {reinterpret_cast<uint8_t*>(rows[0]),
+                              reinterpret_cast<uint8_t*>(rows[1]),
+                              reinterpret_cast<uint8_t*>(rows[2]),
+                              reinterpret_cast<uint8_t*>(alpha_row.data())};
+        deinterleaver.Deinterleave(interleaved_row, xsize, planes);
+        for (size_t x = 0; x < xsize; ++x) {
+          alpha_masked &= alpha_row[x];
+        }
+      } else if (stride == 1) {
         for (size_t x = 0; x < xsize; ++x) {
           rows[0][x] = ReadFromU8<T>(&interleaved_row[4 * x + 0], bias);
           rows[1][x] = ReadFromU8<T>(&interleaved_row[4 * x + 1], bias);
@@ -622,10 +915,9 @@ bool ReadPNGMetaImage(const std::string& pathname, const int bias,
 }
 
 template <typename T>
-bool ReadPNGImage3(const std::string& pathname, const int bias,
-                   Image3<T>* image) {
+bool ReadPNGImage3(ByteReader* input, const int bias, Image3<T>* image) {
   MetaImage<T> meta;
-  if (!ReadPNGMetaImage(pathname, bias, &meta)) {
+  if (!ReadPNGMetaImage(input, bias, &meta)) {
     return false;
   }
   if (meta.HasAlpha()) {
@@ -635,43 +927,220 @@ bool ReadPNGImage3(const std::string& pathname, const int bias,
   return true;
 }
 
+// Reads a PNG with bias 0x8000 for signed (int16_t) and otherwise 0.
+template <class Image>
+bool ReadPNG(ByteReader* input, Image* image) {
+  using T = typename Image::T;
+  const int bias = std::is_signed<T>::value ? 0x8000 : 0;
+  return ReadPNGImage(input, bias, image);
+}
+
+template <typename T>
+bool ReadPNG(ByteReader* input, Image3<T>* image) {
+  return ReadPNGImage3(input, std::is_signed<T>::value ? 0x8000 : 0, image);
+}
+
+template <typename T>
+bool ReadPNG(ByteReader* input, MetaImage<T>* image) {
+  return ReadPNGMetaImage(input, 0, image);
+}
+
+template <class Image>
+bool ReadPNGFile(const std::string& pathname, Image* image) {
+  FileWrapper f(pathname, "rb");
+  if (f == nullptr) {
+    return PIK_FAILURE("File open");
+  }
+  ByteReader input(f);
+  return ReadPNG(&input, image);
+}
+
+template <class Image>
+bool ReadPNGBuffer(const uint8_t* buf, const size_t size, Image* image) {
+  ByteReader input(buf, size);
+  return ReadPNG(&input, image);
+}
+
 bool ReadImage(ImageFormatPNG, const std::string& pathname, ImageB* image) {
-  return ReadPNGImage(pathname, 0, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, ImageW* image) {
-  return ReadPNGImage(pathname, 0x8000, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, ImageU* image) {
-  return ReadPNGImage(pathname, 0, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, Image3B* image) {
-  return ReadPNGImage3(pathname, 0, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, Image3W* image) {
-  return ReadPNGImage3(pathname, 0x8000, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, Image3U* image) {
-  return ReadPNGImage3(pathname, 0, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, MetaImageB* image) {
-  return ReadPNGMetaImage(pathname, 0, image);
+  return ReadPNGFile(pathname, image);
 }
 
 bool ReadImage(ImageFormatPNG, const std::string& pathname, MetaImageU* image) {
-  return ReadPNGMetaImage(pathname, 0, image);
+  return ReadPNGFile(pathname, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               ImageB* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               ImageW* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               ImageU* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               Image3B* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               Image3W* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               Image3U* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               MetaImageB* image) {
+  return ReadPNGBuffer(buf, size, image);
+}
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size,
+               MetaImageU* image) {
+  return ReadPNGBuffer(buf, size, image);
 }
 
-// Allocates an internal buffer for 16-bit pixels in WriteHeader => not
-// thread-safe, and cannot reuse for multiple images with different sizes.
+struct PngSource::Impl {
+  explicit Impl(const std::string& pathname)
+      : file(new FileWrapper(pathname, "rb")) {
+    if (*file != nullptr) input.reset(new ByteReader(*file));
+  }
+  Impl(const uint8_t* buf, const size_t size)
+      : input(new ByteReader(buf, size)) {}
+
+  ~Impl() { png_destroy_read_struct(&png, &info, nullptr); }
+
+  std::unique_ptr<FileWrapper> file;  // null for memory buffers
+  std::unique_ptr<ByteReader> input;  // null if the file could not be opened
+  png_structp png = nullptr;
+  png_infop info = nullptr;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  size_t num_planes = 0;
+  size_t bit_depth = 0;
+  size_t next_y = 0;
+  std::vector<uint8_t> row;
+};
+
+PngSource::PngSource(const std::string& pathname)
+    : impl_(new Impl(pathname)) {}
+
+PngSource::PngSource(const uint8_t* buf, const size_t size)
+    : impl_(new Impl(buf, size)) {}
+
+PngSource::~PngSource() {}
+
+bool PngSource::Open() {
+  Impl& impl = *impl_;
+  if (impl.input == nullptr) {
+    return PIK_FAILURE("File open");
+  }
+  impl.png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                    nullptr);
+  if (impl.png == nullptr) return PIK_FAILURE("PNG");
+  impl.info = png_create_info_struct(impl.png);
+  if (impl.info == nullptr) return PIK_FAILURE("PNG");
+  if (setjmp(png_jmpbuf(impl.png)) != 0) {
+    return PIK_FAILURE("PNG");
+  }
+  png_set_read_fn(impl.png, impl.input.get(), &PngReadCallback);
+  png_read_info(impl.png, impl.info);
+  if (png_get_interlace_type(impl.png, impl.info) != PNG_INTERLACE_NONE) {
+    return PIK_FAILURE("Interlaced PNG");
+  }
+  // Same as the PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND of PngReader.
+  png_set_packing(impl.png);
+  png_set_expand(impl.png);
+  png_read_update_info(impl.png, impl.info);
+
+  impl.xsize = png_get_image_width(impl.png, impl.info);
+  impl.ysize = png_get_image_height(impl.png, impl.info);
+  impl.bit_depth = png_get_bit_depth(impl.png, impl.info);
+  impl.num_planes = png_get_channels(impl.png, impl.info);
+  if (impl.num_planes != 1 && impl.num_planes != 3) {
+    return PIK_FAILURE("PNG with alpha");
+  }
+  if (impl.bit_depth != 8 && impl.bit_depth != 16) {
+    return PIK_FAILURE("Wrong bit-depth");
+  }
+  impl.row.resize(png_get_rowbytes(impl.png, impl.info));
+  return true;
+}
+
+size_t PngSource::xsize() const { return impl_->xsize; }
+size_t PngSource::ysize() const { return impl_->ysize; }
+
+bool PngSource::NextBand(Image3U* band) {
+  Impl& impl = *impl_;
+  PIK_ASSERT(band->xsize() >= impl.xsize);
+  if (setjmp(png_jmpbuf(impl.png)) != 0) {
+    return PIK_FAILURE("PNG");
+  }
+  const size_t num_rows = std::min(band->ysize(), impl.ysize - impl.next_y);
+  const size_t stride = impl.bit_depth / 8;
+  const size_t num_planes = impl.num_planes;
+  for (size_t iy = 0; iy < num_rows; ++iy) {
+    png_read_row(impl.png, impl.row.data(), nullptr);
+    const uint8_t* const PIK_RESTRICT row = impl.row.data();
+    auto rows_out = band->Row(iy);
+    for (int c = 0; c < 3; ++c) {
+      const size_t offset = num_planes == 1 ? 0 : c;
+      uint16_t* const PIK_RESTRICT row_out = rows_out[c];
+      if (stride == 1) {
+        for (size_t x = 0; x < impl.xsize; ++x) {
+          row_out[x] = ReadFromU8<uint16_t>(&row[num_planes * x + offset], 0);
+        }
+      } else {
+        for (size_t x = 0; x < impl.xsize; ++x) {
+          row_out[x] = ReadFromU16<uint16_t>(
+              &row[stride * (num_planes * x + offset)], 0);
+        }
+      }
+    }
+  }
+  impl.next_y += num_rows;
+  return true;
+}
+
+// Allocates an internal row buffer in WriteHeader => not thread-safe, and
+// cannot reuse for multiple images with different sizes.
 class PngWriter {
  public:
-  PngWriter(const std::string& pathname) : file_(pathname, "wb") {
+  PngWriter(const std::string& pathname, const bool fast)
+      : file_(pathname, "wb"), fast_(fast) {
     png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
                                    nullptr);
     if (png_ != nullptr) {
@@ -704,8 +1173,12 @@ class PngWriter {
 
     static const size_t num_planes = GetNumColorPlanes(image);
     if (sizeof(T) != 1 || num_planes != 1 || HasAlpha(image)) {
-      row_buffer_.resize((num_planes + (HasAlpha(image) ? 1 : 0))
-          * xsize_ * sizeof(T));
+      const size_t num_channels = num_planes + (HasAlpha(image) ? 1 : 0);
+      row_buffer_.resize(num_channels * xsize_ * sizeof(T));
+      // PNG stores the most-significant byte first.
+      interleaver_ = RowInterleaver(num_channels, sizeof(T),
+                                    /*big_endian=*/true,
+                                    std::is_signed<T>::value);
     }
 
 #if PIK_PORTABLE_IO
@@ -727,6 +1200,12 @@ class PngWriter {
     png_set_IHDR(png_, info_, xsize_, image.ysize(), sizeof(T) * 8, color_type_,
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_DEFAULT);
+    if (fast_) {
+      // The adaptive filter selection and zlib's default level take most of
+      // the time, for a typical size reduction of only 15-25%.
+      png_set_filter(png_, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+      png_set_compression_level(png_, 1);
+    }
     png_write_info(png_, info_);
     return true;
   }
@@ -737,109 +1216,11 @@ class PngWriter {
     png_write_row(png_, row);
   }
 
-  PIK_INLINE void WriteRow(const Image3B& image, const size_t y) {
-    const auto rows = image.ConstRow(y);
-    for (size_t x = 0; x < xsize_; ++x) {
-      row_buffer_[3 * x + 0] = rows[0][x];
-      row_buffer_[3 * x + 1] = rows[1][x];
-      row_buffer_[3 * x + 2] = rows[2][x];
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  PIK_INLINE void WriteRow(const MetaImageB& image, const size_t y) {
-    const auto rows = image.GetColor().ConstRow(y);
-    if (color_type_ == PNG_COLOR_TYPE_RGBA) {
-      for (size_t x = 0; x < xsize_; ++x) {
-        row_buffer_[4 * x + 0] = rows[0][x];
-        row_buffer_[4 * x + 1] = rows[1][x];
-        row_buffer_[4 * x + 2] = rows[2][x];
-        row_buffer_[4 * x + 3] = image.GetAlpha().Row(y)[x];
-      }
-    } else {
-      for (size_t x = 0; x < xsize_; ++x) {
-        row_buffer_[3 * x + 0] = rows[0][x];
-        row_buffer_[3 * x + 1] = rows[1][x];
-        row_buffer_[3 * x + 2] = rows[2][x];
-      }
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  void WriteRow(const ImageW& image, const size_t y) {
-    const auto row = image.ConstRow(y);
-    uint8_t* PIK_RESTRICT bytes = row_buffer_.data();
-    for (size_t x = 0; x < xsize_; ++x) {
-      StoreUnsignedBigEndian(row[x], bytes + 2 * x);
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  void WriteRow(const Image3W& image, const size_t y) {
-    const auto row = image.ConstRow(y);
-    uint8_t* PIK_RESTRICT bytes = row_buffer_.data();
-    for (size_t x = 0; x < xsize_; ++x) {
-      StoreUnsignedBigEndian(row[0][x], bytes + 6 * x + 0);
-      StoreUnsignedBigEndian(row[1][x], bytes + 6 * x + 2);
-      StoreUnsignedBigEndian(row[2][x], bytes + 6 * x + 4);
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  void WriteRow(const MetaImageW& image, const size_t y) {
-    const auto row = image.GetColor().ConstRow(y);
-    uint8_t* PIK_RESTRICT bytes = row_buffer_.data();
-    if (color_type_ == PNG_COLOR_TYPE_RGBA) {
-      for (size_t x = 0; x < xsize_; ++x) {
-        StoreUnsignedBigEndian(row[0][x], bytes + 8 * x + 0);
-        StoreUnsignedBigEndian(row[1][x], bytes + 8 * x + 2);
-        StoreUnsignedBigEndian(row[2][x], bytes + 8 * x + 4);
-        StoreUnsignedBigEndian(image.GetAlpha().Row(y)[x],
-                               bytes + 8 * x + 6);
-      }
-    } else {
-      for (size_t x = 0; x < xsize_; ++x) {
-        StoreUnsignedBigEndian(row[0][x], bytes + 6 * x + 0);
-        StoreUnsignedBigEndian(row[1][x], bytes + 6 * x + 2);
-        StoreUnsignedBigEndian(row[2][x], bytes + 6 * x + 4);
-      }
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  void WriteRow(const ImageU& image, const size_t y) {
-    const auto row = image.ConstRow(y);
-    uint8_t* PIK_RESTRICT bytes = row_buffer_.data();
-    for (size_t x = 0; x < xsize_; ++x) {
-      StoreUnsignedBigEndian(row[x], bytes + 2 * x);
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  void WriteRow(const Image3U& image, const size_t y) {
-    const auto row = image.ConstRow(y);
-    uint8_t* PIK_RESTRICT bytes = row_buffer_.data();
-    for (size_t x = 0; x < xsize_; ++x) {
-      StoreUnsignedBigEndian(row[0][x], bytes + 6 * x + 0);
-      StoreUnsignedBigEndian(row[1][x], bytes + 6 * x + 2);
-      StoreUnsignedBigEndian(row[2][x], bytes + 6 * x + 4);
-    }
-    png_write_row(png_, row_buffer_.data());
-  }
-
-  void WriteRow(const MetaImageU& image, const size_t y) {
-    const auto row = image.GetColor().ConstRow(y);
-    const int stride = color_type_ == PNG_COLOR_TYPE_RGBA ? 8 : 6;
-    uint8_t* PIK_RESTRICT bytes = row_buffer_.data();
-    for (size_t x = 0; x < xsize_; ++x) {
-      StoreUnsignedBigEndian(row[0][x], bytes + stride * x + 0);
-      StoreUnsignedBigEndian(row[1][x], bytes + stride * x + 2);
-      StoreUnsignedBigEndian(row[2][x], bytes + stride * x + 4);
-      if (color_type_ == PNG_COLOR_TYPE_RGBA) {
-        StoreUnsignedBigEndian(
-            image.GetAlpha().Row(y)[x], bytes + stride * x + 6);
-      }
-    }
+  template <class Image>
+  void WriteRow(const Image& image, const size_t y) {
+    const uint8_t* rows[4];
+    GetRows(image, y, rows);
+    interleaver_.Interleave(rows, xsize_, row_buffer_.data());
     png_write_row(png_, row_buffer_.data());
   }
 
@@ -847,15 +1228,31 @@ class PngWriter {
   void WriteEnd() { png_write_end(png_, nullptr); }
 
  private:
-  void StoreUnsignedBigEndian(const int16_t value, uint8_t* bytes) {
-    const unsigned unsigned_value = value + 0x8000;  // [0, 0x10000)
-    bytes[0] = unsigned_value >> 8;
-    bytes[1] = unsigned_value & 0xFF;
+  // Sets "rows" to the bytes of the planes of row "y" in PNG order and
+  // returns their number.
+  template <typename T>
+  static size_t GetRows(const Image<T>& image, const size_t y,
+                        const uint8_t** rows) {
+    rows[0] = reinterpret_cast<const uint8_t*>(image.ConstRow(y));
+    return 1;
+  }
+
+  template <typename T>
+  static size_t GetRows(const Image3<T>& image, const size_t y,
+                        const uint8_t** rows) {
+    for (int c = 0; c < 3; ++c) {
+      rows[c] = reinterpret_cast<const uint8_t*>(image.ConstPlaneRow(c, y));
+    }
+    return 3;
   }
 
-  void StoreUnsignedBigEndian(const uint16_t unsigned_value, uint8_t* bytes) {
-    bytes[0] = unsigned_value >> 8;
-    bytes[1] = unsigned_value & 0xFF;
+  template <typename T>
+  static size_t GetRows(const MetaImage<T>& image, const size_t y,
+                        const uint8_t** rows) {
+    GetRows(image.GetColor(), y, rows);
+    if (!image.HasAlpha()) return 3;
+    rows[3] = reinterpret_cast<const uint8_t*>(image.GetAlpha().ConstRow(y));
+    return 4;
   }
 
   template<typename T>
@@ -892,18 +1289,21 @@ class PngWriter {
 #if PIK_PORTABLE_IO
   FileWrapper file_;
 #endif
+  const bool fast_;
   size_t xsize_;
   png_structp png_ = nullptr;
   png_infop info_ = nullptr;
   int color_type_ = 0;
 
-  // Buffer for byte-swapping 16-bit pixels, allocated in WriteHeader.
+  // Interleaved and/or byte-swapped pixels, allocated in WriteHeader.
   std::vector<uint8_t> row_buffer_;
+  RowInterleaver interleaver_;
 };
 
 template <class Image>
-bool WritePNGImage(const Image& image, const std::string& pathname) {
-  PngWriter png(pathname);
+bool WritePNGImage(const ImageFormatPNG& format, const Image& image,
+                   const std::string& pathname) {
+  PngWriter png(pathname, format.fast_write);
   if (!png.WriteHeader(image)) {
     return false;
   }
@@ -914,44 +1314,44 @@ bool WritePNGImage(const Image& image, const std::string& pathname) {
   return true;
 }
 
-bool WriteImage(ImageFormatPNG, const ImageB& image,
+bool WriteImage(ImageFormatPNG format, const ImageB& image,
                 const std::string& pathname) {
-  return WritePNGImage(image, pathname);
+  return WritePNGImage(format, image, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const ImageW& image,
+bool WriteImage(ImageFormatPNG format, const ImageW& image,
                 const std::string& pathname) {
-  return WritePNGImage(image, pathname);
+  return WritePNGImage(format, image, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const ImageU& image,
+bool WriteImage(ImageFormatPNG format, const ImageU& image,
                 const std::string& pathname) {
-  return WritePNGImage(image, pathname);
+  return WritePNGImage(format, image, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const Image3B& image3,
+bool WriteImage(ImageFormatPNG format, const Image3B& image3,
                 const std::string& pathname) {
-  return WritePNGImage(image3, pathname);
+  return WritePNGImage(format, image3, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const Image3W& image3,
+bool WriteImage(ImageFormatPNG format, const Image3W& image3,
                 const std::string& pathname) {
-  return WritePNGImage(image3, pathname);
+  return WritePNGImage(format, image3, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const Image3U& image3,
+bool WriteImage(ImageFormatPNG format, const Image3U& image3,
                 const std::string& pathname) {
-  return WritePNGImage(image3, pathname);
+  return WritePNGImage(format, image3, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const MetaImageB& image,
+bool WriteImage(ImageFormatPNG format, const MetaImageB& image,
                 const std::string& pathname) {
-  return WritePNGImage(image, pathname);
+  return WritePNGImage(format, image, pathname);
 }
 
-bool WriteImage(ImageFormatPNG, const MetaImageU& image,
+bool WriteImage(ImageFormatPNG format, const MetaImageU& image,
                 const std::string& pathname) {
-  return WritePNGImage(image, pathname);
+  return WritePNGImage(format, image, pathname);
 }
 
 void jpeg_catch_error(j_common_ptr cinfo) {
@@ -1039,15 +1439,7 @@ bool ReadJpegImage(const JpegInput& input, Image3B* rgb) {
         output_line += row_stride;
       }
 
-      for (int y = 0; y < ysize; ++y) {
-        const uint8_t* const PIK_RESTRICT row = &imagep[y * row_stride];
-        auto rows = rgb->Row(y);
-        for (int x = 0; x < xsize; x++) {
-          rows[0][x] = row[3 * x + 0];
-          rows[1][x] = row[3 * x + 1];
-          rows[2][x] = row[3 * x + 2];
-        }
-      }
+      *rgb = Image3FromInterleaved(imagep, xsize, ysize, row_stride);
       break;
 
     default:
@@ -1069,6 +1461,256 @@ bool ReadImage(ImageFormatJPG, const uint8_t* buf, size_t size, Image3B* rgb) {
   return ReadJpegImage(input, rgb);
 }
 
+// Size of JPEG (and PIK) DCT blocks.
+constexpr size_t kDCTBlockEdge = 8;
+constexpr size_t kDCTBlockSize = kDCTBlockEdge * kDCTBlockEdge;
+
+struct JpegSource::Impl {
+  explicit Impl(const std::string& pathname)
+      : file(new FileWrapper(pathname, "rb")) {}
+  Impl(const uint8_t* buf, const size_t size) : buf(buf), size(size) {}
+
+  // Also safe after jpeg_catch_error destroyed "cinfo".
+  ~Impl() {
+    if (created) jpeg_destroy_decompress(&cinfo);
+  }
+
+  // Writes the IDCT of component "c" (0-255) for output rows [y0, y0 + n) to
+  // "rows", upsampled to xsize columns.
+  void ComponentRows(int c, size_t y0, size_t n, float* const* rows);
+
+  // Writes the linear RGB of rows [y0, y0 + n), at most one MCU row, to rows
+  // [band_y0, band_y0 + n) of "band".
+  bool ConvertRows(size_t y0, size_t n, Image3F* band, size_t band_y0);
+
+  // Upper bound for the number of rows of an MCU.
+  static constexpr size_t kMaxRows = 4 * kDCTBlockEdge;
+
+  std::unique_ptr<FileWrapper> file;  // null for memory buffers
+  const uint8_t* buf = nullptr;
+  size_t size = 0;
+
+  jpeg_decompress_struct cinfo;
+  jpeg_error_mgr jerr;
+  jmp_buf jpeg_jmpbuf;
+  bool created = false;
+  jvirt_barray_ptr* coefficients = nullptr;
+  bool ycbcr = false;
+  size_t next_y = 0;
+  // Per component: factors that dequantize coefficient k (natural order) and
+  // also apply the scaling of ComputeTransposedScaledBlockIDCTFloat, stored
+  // at the transposed position of k.
+  std::vector<float> dequant;
+};
+
+void JpegSource::Impl::ComponentRows(const int c, const size_t y0,
+                                     const size_t n, float* const* rows) {
+  const jpeg_component_info& comp = cinfo.comp_info[c];
+  const size_t factor_x = cinfo.max_h_samp_factor / comp.h_samp_factor;
+  const size_t factor_y = cinfo.max_v_samp_factor / comp.v_samp_factor;
+  const size_t comp_xsize = comp.downsampled_width;
+  const size_t comp_ysize = comp.downsampled_height;
+  // The nearer and farther component sample for output row "y", weighted 3/4
+  // and 1/4 as in libjpeg's fancy upsampling; the edges are replicated.
+  const auto near_row = [factor_y](const size_t y) { return y / factor_y; };
+  const auto far_row = [factor_y, comp_ysize](const size_t y) {
+    if (factor_y == 1) return y;
+    const size_t near = y / 2;
+    if (y % 2 == 0) return near == 0 ? 0 : near - 1;
+    return std::min(near + 1, comp_ysize - 1);
+  };
+
+  // Inverse-transforms the block rows covering the required component rows.
+  const size_t first_row = std::min(near_row(y0), far_row(y0));
+  const size_t last_row = std::max(near_row(y0 + n - 1), far_row(y0 + n - 1));
+  const size_t first_block_row = first_row / kDCTBlockEdge;
+  const size_t num_block_rows = last_row / kDCTBlockEdge - first_block_row + 1;
+  const size_t width_in_blocks = comp.width_in_blocks;
+  ImageF pixels(width_in_blocks * kDCTBlockEdge,
+                num_block_rows * kDCTBlockEdge);
+  const float* const PIK_RESTRICT dequant_c = &dequant[c * kDCTBlockSize];
+  SIMD_ALIGN float block[kDCTBlockSize];
+  for (size_t by = 0; by < num_block_rows; ++by) {
+    JBLOCKARRAY coefficient_rows = (*cinfo.mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(&cinfo), coefficients[c],
+        first_block_row + by, 1, FALSE);
+    for (size_t bx = 0; bx < width_in_blocks; ++bx) {
+      const JCOEF* const PIK_RESTRICT coefficients = coefficient_rows[0][bx];
+      for (size_t ky = 0; ky < kDCTBlockEdge; ++ky) {
+        for (size_t kx = 0; kx < kDCTBlockEdge; ++kx) {
+          const size_t transposed = kx * kDCTBlockEdge + ky;
+          block[transposed] = coefficients[ky * kDCTBlockEdge + kx] *
+                              dequant_c[transposed];
+        }
+      }
+      // Level shift: a DC of 8 * 128 (after dequantization) adds 128.
+      block[0] += 1024.0f * kIDCTScales[0] * kIDCTScales[0];
+      ComputeTransposedScaledBlockIDCTFloat(block);
+      for (size_t iy = 0; iy < kDCTBlockEdge; ++iy) {
+        memcpy(pixels.Row(by * kDCTBlockEdge + iy) + bx * kDCTBlockEdge,
+               block + iy * kDCTBlockEdge, kDCTBlockEdge * sizeof(float));
+      }
+    }
+  }
+
+  const size_t out_xsize = cinfo.image_width;
+  const size_t pixels_y0 = first_block_row * kDCTBlockEdge;
+  std::vector<float> vertical(factor_y == 1 ? 0 : comp_xsize);
+  for (size_t iy = 0; iy < n; ++iy) {
+    const size_t y = y0 + iy;
+    const float* PIK_RESTRICT row_in = pixels.Row(near_row(y) - pixels_y0);
+    if (factor_y != 1) {
+      const float* const PIK_RESTRICT row_far =
+          pixels.Row(far_row(y) - pixels_y0);
+      for (size_t x = 0; x < comp_xsize; ++x) {
+        vertical[x] = 0.75f * row_in[x] + 0.25f * row_far[x];
+      }
+      row_in = vertical.data();
+    }
+    float* const PIK_RESTRICT row_out = rows[iy];
+    if (factor_x == 1) {
+      memcpy(row_out, row_in, out_xsize * sizeof(float));
+      continue;
+    }
+    // Output columns 2x and 2x + 1 are nearest to component column x.
+    for (size_t x = 0; 2 * x < out_xsize; ++x) {
+      const float near = 0.75f * row_in[x];
+      const float left = row_in[x == 0 ? 0 : x - 1];
+      const float right = row_in[std::min(x + 1, comp_xsize - 1)];
+      row_out[2 * x] = near + 0.25f * left;
+      if (2 * x + 1 < out_xsize) row_out[2 * x + 1] = near + 0.25f * right;
+    }
+  }
+}
+
+JpegSource::JpegSource(const std::string& pathname)
+    : impl_(new Impl(pathname)) {}
+
+JpegSource::JpegSource(const uint8_t* buf, const size_t size)
+    : impl_(new Impl(buf, size)) {}
+
+JpegSource::~JpegSource() {}
+
+bool JpegSource::Open() {
+  Impl& impl = *impl_;
+  if (impl.file != nullptr && *impl.file == nullptr) {
+    return PIK_FAILURE("File open");
+  }
+  jpeg_decompress_struct& cinfo = impl.cinfo;
+  cinfo.err = jpeg_std_error(&impl.jerr);
+  cinfo.client_data = &impl.jpeg_jmpbuf;
+  impl.jerr.error_exit = jpeg_catch_error;
+  if (setjmp(impl.jpeg_jmpbuf)) {
+    impl.created = false;  // jpeg_catch_error destroyed it.
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  impl.created = true;
+  if (impl.file != nullptr) {
+    jpeg_stdio_src(&cinfo, *impl.file);
+  } else {
+    // Libjpeg versions before 9b used a non-const buffer here.
+    jpeg_mem_src(&cinfo, const_cast<uint8_t*>(impl.buf), impl.size);
+  }
+  jpeg_read_header(&cinfo, TRUE);
+  if (cinfo.num_components == 3 && cinfo.jpeg_color_space == JCS_YCbCr) {
+    impl.ycbcr = true;
+  } else if (!(cinfo.num_components == 3 &&
+               cinfo.jpeg_color_space == JCS_RGB) &&
+             !(cinfo.num_components == 1 &&
+               cinfo.jpeg_color_space == JCS_GRAYSCALE)) {
+    return PIK_FAILURE("Unsupported color space");
+  }
+  for (int c = 0; c < cinfo.num_components; ++c) {
+    const jpeg_component_info& comp = cinfo.comp_info[c];
+    const int factor_x = cinfo.max_h_samp_factor / comp.h_samp_factor;
+    const int factor_y = cinfo.max_v_samp_factor / comp.v_samp_factor;
+    if (factor_x * comp.h_samp_factor != cinfo.max_h_samp_factor ||
+        factor_y * comp.v_samp_factor != cinfo.max_v_samp_factor ||
+        factor_x > 2 || factor_y > 2) {
+      return PIK_FAILURE("Unsupported subsampling");
+    }
+  }
+  impl.coefficients = jpeg_read_coefficients(&cinfo);
+
+  impl.dequant.resize(cinfo.num_components * kDCTBlockSize);
+  for (int c = 0; c < cinfo.num_components; ++c) {
+    const JQUANT_TBL* quant = cinfo.comp_info[c].quant_table;
+    if (quant == nullptr) return PIK_FAILURE("Missing quantization table");
+    for (size_t ky = 0; ky < kDCTBlockEdge; ++ky) {
+      for (size_t kx = 0; kx < kDCTBlockEdge; ++kx) {
+        impl.dequant[c * kDCTBlockSize + kx * kDCTBlockEdge + ky] =
+            quant->quantval[ky * kDCTBlockEdge + kx] * kIDCTScales[ky] *
+            kIDCTScales[kx];
+      }
+    }
+  }
+  return true;
+}
+
+size_t JpegSource::xsize() const { return impl_->cinfo.image_width; }
+size_t JpegSource::ysize() const { return impl_->cinfo.image_height; }
+
+bool JpegSource::NextBand(Image3F* band) {
+  Impl& impl = *impl_;
+  PIK_ASSERT(band->xsize() >= xsize());
+  if (setjmp(impl.jpeg_jmpbuf)) {
+    impl.created = false;
+    return false;
+  }
+  const size_t num_rows = std::min(band->ysize(), ysize() - impl.next_y);
+  // Converts one MCU row at a time, so that large bands need no
+  // full-size temporary images and the rows are still in cache.
+  const size_t chunk_rows = kDCTBlockEdge * impl.cinfo.max_v_samp_factor;
+  for (size_t chunk_y = 0; chunk_y < num_rows; chunk_y += chunk_rows) {
+    const size_t num_chunk_rows = std::min(chunk_rows, num_rows - chunk_y);
+    if (!impl.ConvertRows(impl.next_y + chunk_y, num_chunk_rows, band,
+                          chunk_y)) {
+      return false;
+    }
+  }
+  impl.next_y += num_rows;
+  return true;
+}
+
+bool JpegSource::Impl::ConvertRows(const size_t y0, const size_t n,
+                                   Image3F* band, const size_t band_y0) {
+  float* rows[kMaxRows];
+  PIK_CHECK(n <= kMaxRows);
+  for (int c = 0; c < cinfo.num_components; ++c) {
+    for (size_t iy = 0; iy < n; ++iy) {
+      rows[iy] = band->PlaneRow(c, band_y0 + iy);
+    }
+    ComponentRows(c, y0, n, rows);
+  }
+
+  const size_t xsize = cinfo.image_width;
+  for (size_t iy = band_y0; iy < band_y0 + n; ++iy) {
+    auto rows_rgb = band->Row(iy);
+    if (cinfo.num_components == 1) {
+      memcpy(rows_rgb[1], rows_rgb[0], xsize * sizeof(float));
+      memcpy(rows_rgb[2], rows_rgb[0], xsize * sizeof(float));
+    } else if (ycbcr) {
+      // Same matrix as libjpeg's ycc_rgb_convert.
+      float* const PIK_RESTRICT row0 = rows_rgb[0];
+      float* const PIK_RESTRICT row1 = rows_rgb[1];
+      float* const PIK_RESTRICT row2 = rows_rgb[2];
+      for (size_t x = 0; x < xsize; ++x) {
+        const float luma = row0[x];
+        const float cb = row1[x] - 128.0f;
+        const float cr = row2[x] - 128.0f;
+        row0[x] = luma + 1.40200f * cr;
+        row1[x] = luma - 0.34414f * cb - 0.71414f * cr;
+        row2[x] = luma + 1.77200f * cb;
+      }
+    }
+    for (int c = 0; c < 3; ++c) {
+      LinearFromSrgbRow(rows_rgb[c], xsize, rows_rgb[c]);
+    }
+  }
+  return true;
+}
+
 // Planes
 
 struct PlanesHeader {
@@ -1135,20 +1777,19 @@ class FieldCoder {
   }
 };
 
-// Reads/writes headers from/to file. Pre/postcondition: PlanesHeader passes a
-// basic sanity check.
+// Reads/writes headers from/to file or memory. Pre/postcondition:
+// PlanesHeader passes a basic sanity check.
 class HeaderIO {
-  static constexpr size_t kSize = 64;
-  static constexpr size_t kPaddedSize = kSize + 4 * FieldCoder::kMaxChars;
+  static constexpr size_t kPaddedSize = 64 + 4 * FieldCoder::kMaxChars;
 
  public:
-  static bool Read(const FileWrapper& f, PlanesHeader* header) {
-    if (f == nullptr) {
-      return PIK_FAILURE("File open");
-    }
+  // The planes follow immediately; this is a multiple of the cache line size,
+  // so they are aligned within a mapping of the file (see MapPlanes).
+  static constexpr size_t kSize = 64;
 
+  static bool Read(ByteReader* input, PlanesHeader* header) {
     char storage[kPaddedSize] = {0};
-    const size_t bytes_read = fread(storage, 1, kSize, f);
+    const size_t bytes_read = input->Read(storage, kSize);
     if (bytes_read != kSize) {
       return PIK_FAILURE("Read header");
     }
@@ -1225,13 +1866,11 @@ class HeaderIO {
 };
 
 namespace {
-// Loads header from file and returns one or more 2D arrays.
-CacheAlignedUniquePtr LoadPlanes(const std::string& pathname,
-                                 PlanesHeader* header) {
+// Loads header from "input" and returns one or more 2D arrays.
+CacheAlignedUniquePtr LoadPlanes(ByteReader* input, PlanesHeader* header) {
   CacheAlignedUniquePtr null(nullptr, CacheAligned::Free);
 
-  FileWrapper f(pathname, "rb");
-  if (!HeaderIO::Read(f, header)) {
+  if (!HeaderIO::Read(input, header)) {
     return null;
   }
 
@@ -1239,7 +1878,7 @@ CacheAlignedUniquePtr LoadPlanes(const std::string& pathname,
       header->bytes_per_row * header->ysize * header->num_planes;
   CacheAlignedUniquePtr planes = AllocateArray(size);
 
-  const size_t bytes_read = fread(planes.get(), 1, size, f);
+  const size_t bytes_read = input->Read(planes.get(), size);
   if (bytes_read != size) {
     PIK_NOTIFY_ERROR("Read planes");
     return null;
@@ -1247,6 +1886,90 @@ CacheAlignedUniquePtr LoadPlanes(const std::string& pathname,
   return planes;
 }
 
+CacheAlignedUniquePtr LoadPlanes(const std::string& pathname,
+                                 PlanesHeader* header) {
+  FileWrapper f(pathname, "rb");
+  if (f == nullptr) {
+    PIK_NOTIFY_ERROR("File open");
+    return CacheAlignedUniquePtr(nullptr, CacheAligned::Free);
+  }
+  ByteReader input(f);
+  return LoadPlanes(&input, header);
+}
+
+CacheAlignedUniquePtr LoadPlanes(const uint8_t* buf, const size_t size,
+                                 PlanesHeader* header) {
+  ByteReader input(buf, size);
+  return LoadPlanes(&input, header);
+}
+
+#ifdef __linux__
+// Deleter for the result of MapPlanes. The length of the mapping is stored
+// immediately before the planes, i.e. at the end of the (already parsed)
+// header.
+void UnmapPlanes(uint8_t* planes) {
+  if (planes == nullptr) return;
+  size_t mapped_size;
+  memcpy(&mapped_size, planes - sizeof(mapped_size), sizeof(mapped_size));
+  munmap(planes - HeaderIO::kSize, mapped_size);
+}
+#endif
+
+// Returns a copy-on-write mapping of the planes stored in "pathname", which
+// avoids reading them until they are accessed, or null if the file cannot be
+// mapped or its rows are not aligned. Callers then fall back to LoadPlanes.
+CacheAlignedUniquePtr MapPlanes(const std::string& pathname,
+                                PlanesHeader* header) {
+  CacheAlignedUniquePtr null(nullptr, CacheAligned::Free);
+#ifdef __linux__
+  static_assert(HeaderIO::kSize % CacheAligned::kCacheLineSize == 0,
+                "Planes must be aligned");
+  const int fd = open(pathname.c_str(), O_RDONLY);
+  if (fd < 0) return null;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < off_t(HeaderIO::kSize)) {
+    close(fd);
+    return null;
+  }
+  const size_t mapped_size = st.st_size;
+  // Writable so that callers may modify the image (without changing the
+  // file); only the touched pages are copied.
+  void* mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping remains valid.
+  if (mapped == MAP_FAILED) return null;
+  uint8_t* const bytes = static_cast<uint8_t*>(mapped);
+
+  ByteReader input(bytes, mapped_size);
+  const size_t size =
+      HeaderIO::Read(&input, header)
+          ? header->bytes_per_row * header->ysize * header->num_planes
+          : 0;
+  if (size == 0 || size > mapped_size - HeaderIO::kSize ||
+      header->bytes_per_row % CacheAligned::kCacheLineSize != 0) {
+    munmap(mapped, mapped_size);
+    return null;
+  }
+
+  uint8_t* const planes = bytes + HeaderIO::kSize;
+  memcpy(planes - sizeof(mapped_size), &mapped_size, sizeof(mapped_size));
+  return CacheAlignedUniquePtr(planes, UnmapPlanes);
+#else
+  return null;
+#endif
+}
+
+// Maps (if requested and possible) or loads the planes from "pathname".
+CacheAlignedUniquePtr MapOrLoadPlanes(const ImageFormatPlanes& format,
+                                      const std::string& pathname,
+                                      PlanesHeader* header) {
+  if (format.use_mmap) {
+    CacheAlignedUniquePtr mapped = MapPlanes(pathname, header);
+    if (mapped != nullptr) return mapped;
+  }
+  return LoadPlanes(pathname, header);
+}
+
 // Stores "header" and "planes" (of any type) to file.
 bool StorePlanes(const PlanesHeader& header,
                  const std::vector<const uint8_t*>& planes,
@@ -1270,11 +1993,12 @@ bool StorePlanes(const PlanesHeader& header,
 }
 }  // namespace
 
+namespace {
+
+// Takes ownership of "storage" from LoadPlanes.
 template <typename T>
-bool ReadImage(ImageFormatPlanes, const std::string& pathname,
-               Image<T>* image) {
-  PlanesHeader header;
-  CacheAlignedUniquePtr storage = LoadPlanes(pathname, &header);
+bool PlanesToImage(const PlanesHeader& header, CacheAlignedUniquePtr storage,
+                   Image<T>* image) {
   if (storage == nullptr) {
     return false;
   }
@@ -1290,10 +2014,8 @@ bool ReadImage(ImageFormatPlanes, const std::string& pathname,
 }
 
 template <typename T>
-bool ReadImage(ImageFormatPlanes, const std::string& pathname,
-               Image3<T>* image) {
-  PlanesHeader header;
-  CacheAlignedUniquePtr storage = LoadPlanes(pathname, &header);
+bool PlanesToImage(const PlanesHeader& header, CacheAlignedUniquePtr storage,
+                   Image3<T>* image) {
   if (storage == nullptr) {
     return false;
   }
@@ -1318,6 +2040,40 @@ bool ReadImage(ImageFormatPlanes, const std::string& pathname,
   return true;
 }
 
+}  // namespace
+
+template <typename T>
+bool ReadImage(ImageFormatPlanes format, const std::string& pathname,
+               Image<T>* image) {
+  PlanesHeader header;
+  CacheAlignedUniquePtr storage = MapOrLoadPlanes(format, pathname, &header);
+  return PlanesToImage(header, std::move(storage), image);
+}
+
+template <typename T>
+bool ReadImage(ImageFormatPlanes format, const std::string& pathname,
+               Image3<T>* image) {
+  PlanesHeader header;
+  CacheAlignedUniquePtr storage = MapOrLoadPlanes(format, pathname, &header);
+  return PlanesToImage(header, std::move(storage), image);
+}
+
+template <typename T>
+bool ReadImage(ImageFormatPlanes, const uint8_t* buf, size_t size,
+               Image<T>* image) {
+  PlanesHeader header;
+  CacheAlignedUniquePtr storage = LoadPlanes(buf, size, &header);
+  return PlanesToImage(header, std::move(storage), image);
+}
+
+template <typename T>
+bool ReadImage(ImageFormatPlanes, const uint8_t* buf, size_t size,
+               Image3<T>* image) {
+  PlanesHeader header;
+  CacheAlignedUniquePtr storage = LoadPlanes(buf, size, &header);
+  return PlanesToImage(header, std::move(storage), image);
+}
+
 template <typename T>
 bool WriteImage(ImageFormatPlanes, const Image<T>& image,
                 const std::string& pathname) {
@@ -1380,6 +2136,47 @@ bool ImageFormatPlanes::IsExtension(const char* filename) {
   return EndsWith(filename, "planes");
 }
 
+bool IsImageExtension(const char* filename) {
+  return ImageFormatPNG::IsExtension(filename) ||
+         ImageFormatPNM::IsExtension(filename) ||
+         ImageFormatJPG::IsExtension(filename) ||
+         ImageFormatY4M::IsExtension(filename);
+}
+
+bool ListImageFiles(const char* dir, std::vector<std::string>* pathnames) {
+  pathnames->clear();
+  DIR* entries = opendir(dir);
+  if (entries == nullptr) {
+    fprintf(stderr, "Failed to list %s.\n", dir);
+    return false;
+  }
+  while (const dirent* entry = readdir(entries)) {
+    const std::string pathname = std::string(dir) + "/" + entry->d_name;
+    struct stat info;
+    if (IsImageExtension(entry->d_name) &&
+        stat(pathname.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+      pathnames->push_back(pathname);
+    }
+  }
+  closedir(entries);
+  std::sort(pathnames->begin(), pathnames->end());
+  return true;
+}
+
+bool IsFramePattern(const char* pattern) {
+  int num_conversions = 0;
+  for (const char* p = pattern; *p != '\0'; ++p) {
+    if (*p != '%') continue;
+    ++p;
+    if (*p == '%') continue;
+    while (*p == '0' || *p == '-') ++p;
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p != 'd') return false;
+    ++num_conversions;
+  }
+  return num_conversions == 1;
+}
+
 // Returns true when the visitor returns true.
 template <class Visitor>
 bool VisitFormats(Visitor* visitor) {
@@ -1391,14 +2188,19 @@ bool VisitFormats(Visitor* visitor) {
   return false;
 }
 
-// Returns true if the given file was loaded and converted to linear RGB.
-// Called via VisitFormats. To avoid opening and loading the file multiple
-// times, we first attempt to detect the format via file extension.
+// Returns true if the given file (or buffer) was loaded and converted to
+// linear RGB. Called via VisitFormats. To avoid opening and loading the file
+// multiple times, we first attempt to detect the format via file extension.
 class LinearLoader {
  public:
   LinearLoader(const std::string& pathname, MetaImageF* linear_rgb)
       : pathname_(pathname), linear_rgb_(linear_rgb) {}
 
+  // Buffers have no extension, so each format is attempted in turn.
+  LinearLoader(const uint8_t* buf, const size_t size, MetaImageF* linear_rgb)
+      : buf_(buf), size_(size), linear_rgb_(linear_rgb),
+        check_extension_(false) {}
+
   void DisregardExtensions() { check_extension_ = false; }
 
   template <class Format>
@@ -1408,7 +2210,9 @@ class LinearLoader {
     }
 
     typename Format::NativeImage3 image;
-    if (!ReadImage(format, pathname_, &image)) {
+    const bool ok = buf_ != nullptr ? ReadImage(format, buf_, size_, &image)
+                                    : ReadImage(format, pathname_, &image);
+    if (!ok) {
       return false;
     }
 
@@ -1432,19 +2236,10 @@ class LinearLoader {
   // From 16-bit sRGB
   template <class Format>
   void ConvertToLinearRGB(Format, const Image3U& srgb) {
-    linear_rgb_->SetColor(Image3F(srgb.xsize(), srgb.ysize()));
-    for (size_t y = 0; y < srgb.ysize(); ++y) {
-      auto row_rgb = srgb.Row(y);
-      auto row_lin = linear_rgb_->GetColor().Row(y);
-      for (size_t x = 0; x < srgb.xsize(); ++x) {
-        for (int c = 0; c < 3; ++c) {
-          // Dividing the 16 value by 257 scales it to the [0.0, 255.0]
-          // interval. If the PNG was 8-bit, this has the same effect as
-          // casting the original 8-bit value to a float.
-          row_lin[c][x] = Srgb8ToLinearDirect(row_rgb[c][x] / 257.0f);
-        }
-      }
-    }
+    // Dividing the 16 value by 257 scales it to the [0.0, 255.0] interval. If
+    // the PNG was 8-bit, this has the same effect as casting the original
+    // 8-bit value to a float.
+    linear_rgb_->SetColor(LinearFromSrgb(srgb));
   }
 
   // From 16-bit signed
@@ -1508,6 +2303,8 @@ class LinearLoader {
   }
 
   const std::string pathname_;
+  const uint8_t* const buf_ = nullptr;  // used instead of pathname_ if set
+  const size_t size_ = 0;
   MetaImageF* linear_rgb_;
   bool check_extension_ = true;
 };
@@ -1531,6 +2328,17 @@ MetaImageF ReadMetaImageLinear(const std::string& pathname) {
   return linear_rgb;
 }
 
+MetaImageF ReadMetaImageLinear(const uint8_t* buf, const size_t size) {
+  MetaImageF linear_rgb;
+  LinearLoader loader(buf, size, &linear_rgb);
+  if (VisitFormats(&loader)) {
+    return linear_rgb;
+  }
+
+  PIK_NOTIFY_ERROR("Unsupported file format");
+  return linear_rgb;
+}
+
 Image3F ReadImage3Linear(const std::string& pathname) {
   MetaImageF meta = ReadMetaImageLinear(pathname);
   if (meta.HasAlpha()) {
@@ -1539,6 +2347,14 @@ Image3F ReadImage3Linear(const std::string& pathname) {
   return std::move(meta.GetColor());
 }
 
+Image3F ReadImage3Linear(const uint8_t* buf, const size_t size) {
+  MetaImageF meta = ReadMetaImageLinear(buf, size);
+  if (meta.HasAlpha()) {
+    PIK_NOTIFY_ERROR("Alpha channel not supported");
+  }
+  return std::move(meta.GetColor());
+}
+
 template bool ReadImage<uint8_t>(ImageFormatPlanes, const std::string&,
                                  ImageB*);
 template bool ReadImage<int16_t>(ImageFormatPlanes, const std::string&,
@@ -1555,6 +2371,24 @@ template bool ReadImage<uint16_t>(ImageFormatPlanes, const std::string&,
                                   Image3U*);
 template bool ReadImage<float>(ImageFormatPlanes, const std::string&, Image3F*);
 
+template bool ReadImage<uint8_t>(ImageFormatPlanes, const uint8_t*, size_t,
+                                 ImageB*);
+template bool ReadImage<int16_t>(ImageFormatPlanes, const uint8_t*, size_t,
+                                 ImageW*);
+template bool ReadImage<uint16_t>(ImageFormatPlanes, const uint8_t*, size_t,
+                                  ImageU*);
+template bool ReadImage<float>(ImageFormatPlanes, const uint8_t*, size_t,
+                               ImageF*);
+
+template bool ReadImage<uint8_t>(ImageFormatPlanes, const uint8_t*, size_t,
+                                 Image3B*);
+template bool ReadImage<int16_t>(ImageFormatPlanes, const uint8_t*, size_t,
+                                 Image3W*);
+template bool ReadImage<uint16_t>(ImageFormatPlanes, const uint8_t*, size_t,
+                                  Image3U*);
+template bool ReadImage<float>(ImageFormatPlanes, const uint8_t*, size_t,
+                               Image3F*);
+
 template bool WriteImage<uint8_t>(ImageFormatPlanes, const ImageB&,
                                   const std::string&);
 template bool WriteImage<int16_t>(ImageFormatPlanes, const ImageW&,
@@ -19,6 +19,8 @@
 
 // Read/write Image or Image3.
 
+#include <stdio.h>
+#include <memory>
 #include <string>
 #include <utility>  // std::move
 #include <vector>
@@ -50,6 +52,11 @@ struct ImageFormatPNG {
   static bool IsExtension(const char* filename);
   static constexpr bool kPortableOnly = false;
   using NativeImage3 = MetaImageU;
+
+  // If true, WriteImage uses a fixed filter and the fastest zlib level, which
+  // is several times faster but the files are larger. Useful for debug
+  // output or PNGs that are only read once.
+  bool fast_write = false;
 };
 
 struct ImageFormatY4M {
@@ -75,6 +82,12 @@ struct ImageFormatPlanes {
   static bool IsExtension(const char* filename);
   static constexpr bool kPortableOnly = true;
   using NativeImage3 = Image3F;
+
+  // If true, ReadImage from a file returns images backed by a (copy-on-write)
+  // mapping of the file, so that the pixels are only read when accessed.
+  // Falls back to reading if mapping fails or rows are not cache-aligned
+  // (they always are in files written by WriteImage).
+  bool use_mmap = false;
 };
 
 // Wrappers
@@ -84,6 +97,22 @@ struct ImageFormatPlanes {
 MetaImageF ReadMetaImageLinear(const std::string& pathname);
 Image3F ReadImage3Linear(const std::string& pathname);
 
+// Same as above, but decodes the "size" bytes of an in-memory file at "buf".
+MetaImageF ReadMetaImageLinear(const uint8_t* buf, size_t size);
+Image3F ReadImage3Linear(const uint8_t* buf, size_t size);
+
+// Whether "filename" has the extension of a format the above can read: PNG,
+// PNM, JPEG or Y4M.
+bool IsImageExtension(const char* filename);
+
+// Sets "pathnames" to the regular files in directory "dir" for which
+// IsImageExtension is true, sorted by name.
+bool ListImageFiles(const char* dir, std::vector<std::string>* pathnames);
+
+// Returns whether "pattern" contains exactly one printf conversion, which is
+// an integer (e.g. "frame%05d.pik"), and no other '%' except "%%".
+bool IsFramePattern(const char* pattern);
+
 
 // Writes after linear rescaling to 0-255.
 template <class Format>
@@ -102,11 +131,17 @@ void WriteScaledToB(Format format, const Image3F& image,
   WriteImage(format, bytes, pathname);
 }
 
+// The ReadImage overloads with "buf" and "size" read from the "size" bytes of
+// an in-memory file at "buf" instead of a file.
+
 // PNM
 
 bool ReadImage(ImageFormatPNM, const std::string&, ImageB*);
 bool ReadImage(ImageFormatPNM, const std::string&, Image3B*);
 
+bool ReadImage(ImageFormatPNM, const uint8_t* buf, size_t size, ImageB*);
+bool ReadImage(ImageFormatPNM, const uint8_t* buf, size_t size, Image3B*);
+
 bool WriteImage(ImageFormatPNM, const ImageB&, const std::string&);
 bool WriteImage(ImageFormatPNM, const Image3B&, const std::string&);
 
@@ -121,6 +156,44 @@ bool ReadImage(ImageFormatPNG, const std::string&, ImageU*);
 bool ReadImage(ImageFormatPNG, const std::string&, Image3B*);
 bool ReadImage(ImageFormatPNG, const std::string&, Image3W*);
 bool ReadImage(ImageFormatPNG, const std::string&, Image3U*);
+bool ReadImage(ImageFormatPNG, const std::string&, MetaImageB*);
+bool ReadImage(ImageFormatPNG, const std::string&, MetaImageU*);
+
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, ImageB*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, ImageW*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, ImageU*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, Image3B*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, Image3W*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, Image3U*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, MetaImageB*);
+bool ReadImage(ImageFormatPNG, const uint8_t* buf, size_t size, MetaImageU*);
+
+// Decodes a PNG row by row as they are requested, with the same 16-bit
+// samples as ReadImage(ImageFormatPNG, ..., Image3U*) (gray is expanded to
+// RGB), so that the decoded image need not be stored.
+class PngSource : public Image3SourceU {
+ public:
+  explicit PngSource(const std::string& pathname);
+  // Reads from the "size" bytes at "buf", which must outlive the source.
+  PngSource(const uint8_t* buf, size_t size);
+  ~PngSource() override;
+
+  PngSource(const PngSource&) = delete;
+  PngSource& operator=(const PngSource&) = delete;
+
+  // Reads the header; must succeed before calling the other methods. Also
+  // fails for PNGs with alpha (or transparency) and interlaced PNGs, which
+  // ReadImage can still decode.
+  bool Open();
+
+  size_t xsize() const override;
+  size_t ysize() const override;
+  bool NextBand(Image3U* band) override;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
 
 bool WriteImage(ImageFormatPNG, const ImageB&, const std::string&);
 bool WriteImage(ImageFormatPNG, const ImageW&, const std::string&);
@@ -137,6 +210,42 @@ bool ReadImage(ImageFormatY4M, const std::string&, Image3B*);
 bool ReadImage(ImageFormatY4M, const std::string& pathname, Image3U* image,
                int* bit_depth);
 
+bool ReadImage(ImageFormatY4M, const uint8_t* buf, size_t size, Image3B*);
+bool ReadImage(ImageFormatY4M, const uint8_t* buf, size_t size, Image3U* image,
+               int* bit_depth);
+
+// Reads the frames of a Y4M stream one after the other, e.g. from a pipe.
+class Y4MFrameReader {
+ public:
+  // Reads from "f" (not owned, need not be seekable), e.g. stdin.
+  explicit Y4MFrameReader(FILE* f);
+  // Reads from the "size" bytes at "buf", which must outlive the reader.
+  Y4MFrameReader(const uint8_t* buf, size_t size);
+  ~Y4MFrameReader();
+
+  Y4MFrameReader(const Y4MFrameReader&) = delete;
+  Y4MFrameReader& operator=(const Y4MFrameReader&) = delete;
+
+  // Reads the stream header; must succeed before calling the other methods.
+  bool ReadHeader();
+
+  // Frame dimensions and bit depth of the samples, as in ReadImage.
+  size_t xsize() const;
+  size_t ysize() const;
+  int bit_depth() const;
+
+  // Reads the next YUV frame into "yuv", reusing its planes if it already has
+  // the frame size. Sets "end" (and returns true) if there are no more
+  // frames; returns false if the stream is invalid or truncated.
+  bool NextFrame(Image3U* yuv, bool* end);
+  // Same as above, but discards the frame.
+  bool SkipFrame(bool* end);
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
 bool WriteImage(ImageFormatY4M, const Image3B&, const std::string&);
 bool WriteImage(ImageFormatY4M, const Image3U&, const std::string&);
 
@@ -146,6 +255,34 @@ bool ReadImage(ImageFormatJPG, const std::string&, Image3B*);
 
 bool ReadImage(ImageFormatJPG, const uint8_t* buf, size_t size, Image3B*);
 
+// Produces linear RGB bands of a baseline or progressive JPEG directly from
+// its quantized DCT coefficients (jpeg_read_coefficients): the blocks are
+// dequantized and inverse-transformed in floating point, upsampled with the
+// same triangle filter as libjpeg's fancy upsampling and converted to RGB and
+// then linear without rounding to 8 bits. Supports grayscale, YCbCr and RGB
+// JPEGs whose components are subsampled by at most 2x.
+class JpegSource : public Image3SourceF {
+ public:
+  explicit JpegSource(const std::string& pathname);
+  // Reads from the "size" bytes at "buf", which must outlive the source.
+  JpegSource(const uint8_t* buf, size_t size);
+  ~JpegSource() override;
+
+  JpegSource(const JpegSource&) = delete;
+  JpegSource& operator=(const JpegSource&) = delete;
+
+  // Reads all coefficients; must succeed before calling the other methods.
+  bool Open();
+
+  size_t xsize() const override;
+  size_t ysize() const override;
+  bool NextBand(Image3F* band) override;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
 // Planes - text header, raw (linear) 2D array[s] with padding
 
 template <typename T>
@@ -153,6 +290,12 @@ bool ReadImage(ImageFormatPlanes, const std::string&, Image<T>*);
 template <typename T>
 bool ReadImage(ImageFormatPlanes, const std::string&, Image3<T>*);
 
+template <typename T>
+bool ReadImage(ImageFormatPlanes, const uint8_t* buf, size_t size, Image<T>*);
+template <typename T>
+bool ReadImage(ImageFormatPlanes, const uint8_t* buf, size_t size,
+               Image3<T>*);
+
 template <typename T>
 bool WriteImage(ImageFormatPlanes, const Image<T>&, const std::string&);
 template <typename T>
@@ -0,0 +1,43 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kernel_targets.h"
+
+namespace pik {
+namespace {
+
+// Returns the index into KernelTable of the best of "targets" that the CPU
+// supports, in the same order as dispatch::Run.
+int IndexForTargets(const int targets) {
+#if SIMD_ARCH_X86
+  const int supported = dispatch::SupportedTargets() & targets;
+  if (supported & SIMD_AVX2) return 2;
+  if (supported & SIMD_SSE4) return 1;
+#endif
+  return 0;
+}
+
+// Chosen once instead of dispatching for every call. Zero (the portable
+// kernels) until its dynamic initialization. Only changed by SetKernelTargets.
+int target_index = IndexForTargets(~0);
+
+}  // namespace
+
+int KernelTargetIndex() { return target_index; }
+
+void SetKernelTargets(const int targets) {
+  target_index = IndexForTargets(targets);
+}
+
+}  // namespace pik
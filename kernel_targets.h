@@ -0,0 +1,79 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KERNEL_TARGETS_H_
+#define KERNEL_TARGETS_H_
+
+// Runtime selection of the hot kernels. The codec only requires SSE4 (see
+// SIMD_FLAGS in the Makefile), but the kernels of each module X are compiled
+// once per instruction set: X_target.cc specializes
+// XFunctionsForTarget::operator()<SIMD_TARGET>, which returns a struct of
+// function pointers, and is included by X_target_<target>.cc. X.cc calls them
+// through a KernelTable.
+//
+// The kernels produce exactly the same values with every instruction set, so
+// that the encoder output and the decoded pixels do not depend on the CPU (see
+// determinism_test). Hence they are compiled with -ffp-contract=off and only
+// the DCT fuses multiply-adds (with fmaf where FMA instructions are missing).
+
+#include "simd/dispatch.h"
+
+namespace pik {
+
+#if SIMD_ARCH_X86
+constexpr int kNumKernelTargets = 3;  // None, SSE4, AVX2
+#else
+constexpr int kNumKernelTargets = 1;  // None
+#endif
+
+// Returns the index of the instruction set whose kernels are used: the best of
+// those the CPU supports, or those passed to SetKernelTargets.
+int KernelTargetIndex();
+
+// For tests only (determinism_test, benchmark_pik --determinism): makes all
+// kernels use the best of "targets" (bits of dispatch::SupportedTargets) that
+// the CPU supports, or the portable versions; ~0 restores the default. Changes
+// global state, hence must be called before any encode or decode starts and
+// not while another thread may call a kernel.
+void SetKernelTargets(int targets);
+
+// The kernels of one module for all instruction sets. Namespace-scope
+// instances are built during static initialization, hence the kernels must
+// not be called from other static initializers.
+template <class Functor>
+class KernelTable {
+ public:
+  using Functions = decltype(Functor().template operator()<None>());
+
+  KernelTable()
+      : functions_{Functor().template operator()<None>(),
+#if SIMD_ARCH_X86
+                   Functor().template operator()<SSE4>(),
+                   Functor().template operator()<AVX2>()
+#endif
+        } {
+  }
+
+  // Returns the kernels for the current instruction set.
+  const Functions& operator()() const {
+    return functions_[KernelTargetIndex()];
+  }
+
+ private:
+  Functions functions_[kNumKernelTargets];
+};
+
+}  // namespace pik
+
+#endif  // KERNEL_TARGETS_H_
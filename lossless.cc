@@ -0,0 +1,367 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lossless.h"
+
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "bit_reader.h"
+#include "brotli/decode.h"
+#include "brotli/encode.h"
+#include "compiler_specific.h"
+#include "dc_predictor.h"
+#include "opsin_codec.h"
+#include "profiler.h"
+#include "status.h"
+
+namespace pik {
+namespace {
+
+// Selects how the planes are coded (first byte of the lossless data).
+// Predicted by the DC predictors and coded with EncodeImage.
+const uint8_t kLosslessPredicted = 0;
+// Interleaved bytes (red - green, green, blue - green, or the palette index)
+// compressed with Brotli, preceded by the 32-bit size of the Brotli data.
+// Matches repeated content (e.g. text in screenshots) that the predictors
+// cannot exploit.
+const uint8_t kLosslessBrotli = 1;
+// Same, but the bytes are replaced with their residuals after MED prediction
+// (see MEDResiduals), which helps for smooth gradients.
+const uint8_t kLosslessBrotliMED = 2;
+
+// Relatively fast; higher qualities are much slower but only about 5% smaller.
+const int kLosslessBrotliQuality = 5;
+
+uint32_t PackColor(const uint8_t r, const uint8_t g, const uint8_t b) {
+  return (r << 16) | (g << 8) | b;
+}
+
+// Integer luminance (BT.601 weights), only used to order the palette so that
+// similar indices have similar colors.
+uint32_t PaletteLuminance(const uint32_t color) {
+  return 299 * (color >> 16) + 587 * ((color >> 8) & 255) + 114 * (color & 255);
+}
+
+// Median edge detector (LOCO-I) prediction of byte "x" of the row "row" (of
+// "num_channels" interleaved channels) from the same channel of its left,
+// top ("prev", null for the first row) and top-left neighbors.
+uint8_t PredictMED(const uint8_t* PIK_RESTRICT row,
+                   const uint8_t* PIK_RESTRICT prev, const size_t x,
+                   const size_t num_channels) {
+  if (prev == nullptr) return x < num_channels ? 0 : row[x - num_channels];
+  if (x < num_channels) return prev[x];
+  const int w = row[x - num_channels];
+  const int n = prev[x];
+  const int nw = prev[x - num_channels];
+  if (nw >= std::max(w, n)) return std::min(w, n);
+  if (nw <= std::min(w, n)) return std::max(w, n);
+  return w + n - nw;
+}
+
+// Returns the differences (modulo 256) between "bytes" ("row_size" bytes per
+// row) and their PredictMED.
+std::vector<uint8_t> MEDResiduals(const std::vector<uint8_t>& bytes,
+                                  const size_t row_size,
+                                  const size_t num_channels) {
+  std::vector<uint8_t> residuals(bytes.size());
+  for (size_t pos = 0; pos < bytes.size(); pos += row_size) {
+    const uint8_t* PIK_RESTRICT row = bytes.data() + pos;
+    const uint8_t* PIK_RESTRICT prev = pos == 0 ? nullptr : row - row_size;
+    for (size_t x = 0; x < row_size; ++x) {
+      residuals[pos + x] = row[x] - PredictMED(row, prev, x, num_channels);
+    }
+  }
+  return residuals;
+}
+
+// Inverse of MEDResiduals, in place.
+void UndoMEDResiduals(const size_t row_size, const size_t num_channels,
+                      std::vector<uint8_t>* bytes) {
+  for (size_t pos = 0; pos < bytes->size(); pos += row_size) {
+    uint8_t* PIK_RESTRICT row = bytes->data() + pos;
+    const uint8_t* PIK_RESTRICT prev = pos == 0 ? nullptr : row - row_size;
+    for (size_t x = 0; x < row_size; ++x) {
+      row[x] += PredictMED(row, prev, x, num_channels);
+    }
+  }
+}
+
+// Returns "bytes" compressed with Brotli, or an empty vector on failure.
+std::vector<uint8_t> BrotliCompress(const std::vector<uint8_t>& bytes) {
+  size_t size = BrotliEncoderMaxCompressedSize(bytes.size());
+  std::vector<uint8_t> out(size);
+  if (!BrotliEncoderCompress(kLosslessBrotliQuality, BROTLI_MAX_WINDOW_BITS,
+                             BROTLI_MODE_GENERIC, bytes.size(), bytes.data(),
+                             &size, out.data())) {
+    return std::vector<uint8_t>();
+  }
+  out.resize(size);
+  return out;
+}
+
+// Stores the residuals of the luminance "residual_y" and the interleaved
+// chrominance "residual_uv" in the channels of "residuals" expected by
+// EncodeImage/UnpredictDC (1 = luminance).
+void StoreResiduals(const Image<DC>& residual_y, const Image<DC>& residual_uv,
+                    Image3W* residuals) {
+  for (size_t y = 0; y < residuals->ysize(); ++y) {
+    const DC* PIK_RESTRICT row_y = residual_y.ConstRow(y);
+    const DC* PIK_RESTRICT row_uv = residual_uv.ConstRow(y);
+    auto row_out = residuals->Row(y);
+    for (size_t x = 0; x < residuals->xsize(); ++x) {
+      row_out[0][x] = row_uv[2 * x];
+      row_out[1][x] = row_y[x];
+      row_out[2][x] = row_uv[2 * x + 1];
+    }
+  }
+}
+
+}  // namespace
+
+bool FindPalette(const Image3B& srgb, std::vector<uint32_t>* palette) {
+  PROFILER_FUNC;
+  std::unordered_set<uint32_t> colors;
+  for (size_t y = 0; y < srgb.ysize(); ++y) {
+    auto row = srgb.ConstRow(y);
+    // Screenshots mostly consist of runs of the same color; skip the lookup.
+    uint32_t previous = ~0u;
+    for (size_t x = 0; x < srgb.xsize(); ++x) {
+      const uint32_t color = PackColor(row[0][x], row[1][x], row[2][x]);
+      if (color == previous) continue;
+      previous = color;
+      colors.insert(color);
+      if (colors.size() > kMaxPaletteSize) return false;
+    }
+  }
+  palette->assign(colors.begin(), colors.end());
+  std::sort(palette->begin(), palette->end(),
+            [](const uint32_t a, const uint32_t b) {
+              const uint32_t luminance_a = PaletteLuminance(a);
+              const uint32_t luminance_b = PaletteLuminance(b);
+              return luminance_a != luminance_b ? luminance_a < luminance_b
+                                                : a < b;
+            });
+  return true;
+}
+
+bool LosslessToPik(const Image3B& srgb, const std::vector<uint32_t>& palette,
+                   PikImageSizeInfo* info, PaddedBytes* compressed) {
+  PROFILER_FUNC;
+  const size_t xsize = srgb.xsize();
+  const size_t ysize = srgb.ysize();
+  const size_t num_channels = palette.empty() ? 3 : 1;
+  Image<DC> dc_y(xsize, ysize);
+  Image<DC> residual_y(xsize, ysize);
+  Image<DC> residual_uv(2 * xsize, ysize);
+  std::vector<uint8_t> interleaved(xsize * ysize * num_channels);
+  std::string palette_bytes;
+  if (!palette.empty()) {
+    PIK_CHECK(palette.size() <= kMaxPaletteSize);
+    palette_bytes.push_back(palette.size() - 1);
+    std::unordered_map<uint32_t, DC> indices;
+    for (size_t i = 0; i < palette.size(); ++i) {
+      palette_bytes.push_back(palette[i] >> 16);
+      palette_bytes.push_back((palette[i] >> 8) & 255);
+      palette_bytes.push_back(palette[i] & 255);
+      indices[palette[i]] = i;
+    }
+    for (size_t y = 0; y < ysize; ++y) {
+      auto row = srgb.ConstRow(y);
+      DC* PIK_RESTRICT row_y = dc_y.Row(y);
+      uint8_t* PIK_RESTRICT row_out = interleaved.data() + y * xsize;
+      uint32_t previous = ~0u;
+      DC index = 0;
+      for (size_t x = 0; x < xsize; ++x) {
+        const uint32_t color = PackColor(row[0][x], row[1][x], row[2][x]);
+        if (color != previous) {
+          const auto it = indices.find(color);
+          if (it == indices.end()) return PIK_FAILURE("Color not in palette");
+          index = it->second;
+          previous = color;
+        }
+        row_y[x] = index;
+        row_out[x] = index;
+      }
+      DC* PIK_RESTRICT row_uv = residual_uv.Row(y);
+      std::fill(row_uv, row_uv + 2 * xsize, 0);
+    }
+    ShrinkY(dc_y, &residual_y);
+  } else {
+    // Red and blue minus green are much less correlated than RGB.
+    Image<DC> dc_uv(2 * xsize, ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      auto row = srgb.ConstRow(y);
+      DC* PIK_RESTRICT row_y = dc_y.Row(y);
+      DC* PIK_RESTRICT row_uv = dc_uv.Row(y);
+      uint8_t* PIK_RESTRICT row_out = interleaved.data() + y * xsize * 3;
+      for (size_t x = 0; x < xsize; ++x) {
+        row_y[x] = row[1][x];
+        row_uv[2 * x] = row[0][x] - row[1][x];
+        row_uv[2 * x + 1] = row[2][x] - row[1][x];
+        row_out[3 * x + 0] = row[0][x] - row[1][x];
+        row_out[3 * x + 1] = row[1][x];
+        row_out[3 * x + 2] = row[2][x] - row[1][x];
+      }
+    }
+    ShrinkY(dc_y, &residual_y);
+    ShrinkUV(dc_y, dc_uv, &residual_uv);
+  }
+
+  Image3W residuals(xsize, ysize);
+  StoreResiduals(residual_y, residual_uv, &residuals);
+  const std::string predicted = PadTo4Bytes(EncodeImage(residuals, 1, info));
+
+  const std::vector<uint8_t> brotli_bytes = BrotliCompress(interleaved);
+  const std::vector<uint8_t> brotli_med =
+      BrotliCompress(MEDResiduals(interleaved, xsize * num_channels,
+                                  num_channels));
+  if (brotli_bytes.empty() || brotli_med.empty()) {
+    return PIK_FAILURE("Brotli compression failed");
+  }
+
+  // Stores whichever is smallest.
+  uint8_t method = kLosslessPredicted;
+  size_t planes_size = predicted.size();
+  const std::vector<uint8_t>* brotli = nullptr;
+  if (4 + brotli_bytes.size() < planes_size) {
+    method = kLosslessBrotli;
+    planes_size = 4 + brotli_bytes.size();
+    brotli = &brotli_bytes;
+  }
+  if (4 + brotli_med.size() < planes_size) {
+    method = kLosslessBrotliMED;
+    planes_size = 4 + brotli_med.size();
+    brotli = &brotli_med;
+  }
+  const size_t pos = compressed->size();
+  compressed->resize(pos + 1 + palette_bytes.size() + planes_size);
+  uint8_t* PIK_RESTRICT out = compressed->data() + pos;
+  *out++ = method;
+  memcpy(out, palette_bytes.data(), palette_bytes.size());
+  out += palette_bytes.size();
+  if (brotli != nullptr) {
+    for (int i = 0; i < 4; ++i) {
+      *out++ = (brotli->size() >> (8 * i)) & 255;
+    }
+    memcpy(out, brotli->data(), brotli->size());
+  } else {
+    memcpy(out, predicted.data(), predicted.size());
+  }
+  return true;
+}
+
+bool PikToLossless(const uint8_t* data, const size_t data_size,
+                   const bool has_palette, ThreadPool* pool,
+                   size_t* bytes_read, Image3B* srgb) {
+  PROFILER_FUNC;
+  const size_t xsize = srgb->xsize();
+  const size_t ysize = srgb->ysize();
+  if (data_size == 0) return PIK_FAILURE("Empty lossless data.");
+  const uint8_t method = data[0];
+  size_t pos = 1;
+  std::vector<uint32_t> palette;
+  if (has_palette) {
+    if (pos >= data_size) return PIK_FAILURE("Truncated palette.");
+    palette.resize(data[pos] + 1);
+    if (pos + 1 + 3 * palette.size() > data_size) {
+      return PIK_FAILURE("Truncated palette.");
+    }
+    for (size_t i = 0; i < palette.size(); ++i) {
+      const uint8_t* PIK_RESTRICT rgb = data + pos + 1 + 3 * i;
+      palette[i] = PackColor(rgb[0], rgb[1], rgb[2]);
+    }
+    pos += 1 + 3 * palette.size();
+  }
+
+  // All methods yield red - green, green, blue - green (or the index in the
+  // green channel).
+  Image3W planes(xsize, ysize);
+  if (method == kLosslessPredicted) {
+    BitReader br(data + pos, (data_size - pos) & ~3);
+    if (!DecodeImage(&br, 1, &planes)) {
+      return PIK_FAILURE("DecodeImage failed.");
+    }
+    pos += br.Position();
+    if (pos > data_size) return PIK_FAILURE("Truncated lossless data.");
+    UnpredictDC(pool, 1, &planes);
+  } else if (method == kLosslessBrotli || method == kLosslessBrotliMED) {
+    if (pos + 4 > data_size) return PIK_FAILURE("Truncated lossless data.");
+    size_t brotli_size = 0;
+    for (int i = 0; i < 4; ++i) {
+      brotli_size |= size_t(data[pos++]) << (8 * i);
+    }
+    if (brotli_size > data_size - pos) {
+      return PIK_FAILURE("Truncated lossless data.");
+    }
+    const size_t num_channels = has_palette ? 1 : 3;
+    std::vector<uint8_t> interleaved(xsize * ysize * num_channels);
+    size_t decoded_size = interleaved.size();
+    if (BrotliDecoderDecompress(brotli_size, data + pos, &decoded_size,
+                                interleaved.data()) !=
+            BROTLI_DECODER_RESULT_SUCCESS ||
+        decoded_size != interleaved.size()) {
+      return PIK_FAILURE("Brotli decompression failed.");
+    }
+    pos += brotli_size;
+    if (method == kLosslessBrotliMED) {
+      UndoMEDResiduals(xsize * num_channels, num_channels, &interleaved);
+    }
+    for (size_t y = 0; y < ysize; ++y) {
+      const uint8_t* PIK_RESTRICT row =
+          interleaved.data() + y * xsize * num_channels;
+      auto row_out = planes.Row(y);
+      for (size_t x = 0; x < xsize; ++x) {
+        if (has_palette) {
+          row_out[1][x] = row[x];
+        } else {
+          row_out[0][x] = static_cast<int8_t>(row[3 * x + 0]);
+          row_out[1][x] = row[3 * x + 1];
+          row_out[2][x] = static_cast<int8_t>(row[3 * x + 2]);
+        }
+      }
+    }
+  } else {
+    return PIK_FAILURE("Invalid lossless method.");
+  }
+  *bytes_read = pos;
+
+  for (size_t y = 0; y < ysize; ++y) {
+    auto row = planes.ConstRow(y);
+    auto row_out = srgb->Row(y);
+    if (has_palette) {
+      for (size_t x = 0; x < xsize; ++x) {
+        const int index = row[1][x];
+        if (index < 0 || index >= palette.size()) {
+          return PIK_FAILURE("Invalid palette index.");
+        }
+        row_out[0][x] = palette[index] >> 16;
+        row_out[1][x] = (palette[index] >> 8) & 255;
+        row_out[2][x] = palette[index] & 255;
+      }
+    } else {
+      for (size_t x = 0; x < xsize; ++x) {
+        row_out[0][x] = row[0][x] + row[1][x];
+        row_out[1][x] = row[1][x];
+        row_out[2][x] = row[2][x] + row[1][x];
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace pik
@@ -0,0 +1,60 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LOSSLESS_H_
+#define LOSSLESS_H_
+
+// Fast lossless coding of 8-bit color planes (Header::kWebPLossless), e.g.
+// for screenshots and UI assets. The planes are green and red/blue minus
+// green, or the palette index if there are at most kMaxPaletteSize colors
+// (Header::kPalette). Each pixel is predicted at full resolution by the DC
+// predictors (dc_predictor.h, green as luminance and the differences as the
+// chrominance pair) and the residuals are coded with the DC entropy coder.
+// Because predictors cannot exploit repeated content such as text, the
+// encoder also compresses the interleaved planes (with and without MED
+// prediction) with a fast Brotli setting and stores the smallest of the
+// three. There is no other search.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "image.h"
+#include "padded_bytes.h"
+#include "pik_info.h"
+#include "thread_pool.h"
+
+namespace pik {
+
+static constexpr size_t kMaxPaletteSize = 256;
+
+// Returns whether "srgb" has at most kMaxPaletteSize distinct colors, and if
+// so stores them (0xRRGGBB, ordered by luminance) in *palette.
+bool FindPalette(const Image3B& srgb, std::vector<uint32_t>* palette);
+
+// Appends the coded "srgb" to "compressed". "palette" is either empty or the
+// result of FindPalette; the decoder must be told which (kPalette).
+bool LosslessToPik(const Image3B& srgb, const std::vector<uint32_t>& palette,
+                   PikImageSizeInfo* info, PaddedBytes* compressed);
+
+// Decodes the output of LosslessToPik from "data", which holds "data_size"
+// bytes, into "srgb" (already sized to the image dimensions). The prediction
+// is reversed in a wavefront on "pool" (may be null). Sets *bytes_read to the
+// size of the coded planes.
+bool PikToLossless(const uint8_t* data, size_t data_size, bool has_palette,
+                   ThreadPool* pool, size_t* bytes_read, Image3B* srgb);
+
+}  // namespace pik
+
+#endif  // LOSSLESS_H_
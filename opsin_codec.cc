@@ -33,12 +33,15 @@
 #include "histogram_decode.h"
 #include "huffman_decode.h"
 #include "huffman_encode.h"
+#include "profiler.h"
+#include "static_ac_codes.h"
 #include "status.h"
 #include "write_bits.h"
 
 namespace pik {
 
 static const int kANSBufferSize = 1 << 16;
+static const int kMaxANSStates = 8;
 
 static inline int SymbolFromSignedInt(int diff) {
   return diff >= 0 ? 2 * diff : -2 * diff - 1;
@@ -77,15 +80,16 @@ Image3W PredictDC(const Image3W& coeffs) {
   return out;
 }
 
-void UnpredictDC(Image3W* coeffs) {
-  Image<int32_t> dc_y(coeffs->xsize() / 64, coeffs->ysize());
-  Image<int32_t> dc_xz(coeffs->xsize() / 64 * 2, coeffs->ysize());
+void UnpredictDC(ThreadPool* pool, const int stride, Image3W* coeffs) {
+  PROFILER_FUNC;
+  Image<int32_t> dc_y(coeffs->xsize() / stride, coeffs->ysize());
+  Image<int32_t> dc_xz(coeffs->xsize() / stride * 2, coeffs->ysize());
 
   for (int y = 0; y < coeffs->ysize(); y++) {
     auto row = coeffs->Row(y);
     auto row_y = dc_y.Row(y);
     auto row_xz = dc_xz.Row(y);
-    for (int x = 0, block_x = 0; x < coeffs->xsize(); x += 64, block_x++) {
+    for (int x = 0, block_x = 0; x < coeffs->xsize(); x += stride, block_x++) {
       row_y[block_x] = row[1][x];
 
       row_xz[2 * block_x] = row[0][x];
@@ -93,17 +97,17 @@ void UnpredictDC(Image3W* coeffs) {
     }
   }
 
-  Image<int32_t> dc_y_out(coeffs->xsize() / 64, coeffs->ysize());
-  Image<int32_t> dc_xz_out(coeffs->xsize() / 64 * 2, coeffs->ysize());
+  Image<int32_t> dc_y_out(coeffs->xsize() / stride, coeffs->ysize());
+  Image<int32_t> dc_xz_out(coeffs->xsize() / stride * 2, coeffs->ysize());
 
-  ExpandY(dc_y, &dc_y_out);
-  ExpandUV(dc_y_out, dc_xz, &dc_xz_out);
+  ExpandY(dc_y, pool, &dc_y_out);
+  ExpandUV(dc_y_out, dc_xz, pool, &dc_xz_out);
 
   for (int y = 0; y < coeffs->ysize(); y++) {
     auto row_y = dc_y_out.Row(y);
     auto row_xz = dc_xz_out.Row(y);
     auto row_out = coeffs->Row(y);
-    for (int x = 0, block_x = 0; x < coeffs->xsize(); x += 64, block_x++) {
+    for (int x = 0, block_x = 0; x < coeffs->xsize(); x += stride, block_x++) {
       row_out[1][x] = row_y[block_x];
 
       row_out[0][x] = row_xz[2 * block_x];
@@ -123,13 +127,14 @@ size_t HistogramBuilder::EncodedSize(
   size_t total_histogram_bits = 0;
   size_t total_data_bits = num_extra_bits_;
   for (int c = 0; c < histograms_.size(); ++c) {
-    size_t histogram_bits;
-    size_t data_bits;
-    BuildHuffmanTreeAndCountBits(histograms_[c].data_.data(),
-                                 histograms_[c].data_.size(),
-                                 &histogram_bits, &data_bits);
-    total_histogram_bits += histogram_bits;
-    total_data_bits += data_bits;
+    if (dirty_[c] & kStaleCodes) {
+      BuildHuffmanTreeAndCountBits(histograms_[c].data_.data(),
+                                   histograms_[c].data_.size(),
+                                   &histogram_bits_[c], &data_bits_[c]);
+      dirty_[c] &= ~kStaleCodes;
+    }
+    total_histogram_bits += histogram_bits_[c];
+    total_data_bits += data_bits_[c];
   }
   if (lg2_histo_align >= 0) {
     return (RoundToBytes(total_histogram_bits, lg2_histo_align) +
@@ -140,6 +145,27 @@ size_t HistogramBuilder::EncodedSize(
   }
 }
 
+size_t HistogramBuilder::EstimatedSize() const {
+  // Approximate cost of storing a (Huffman) code; fitted to
+  // BuildHuffmanTreeAndCountBits for typical AC histograms.
+  constexpr double kBitsPerHistogram = 20.0;
+  constexpr double kBitsPerUsedSymbol = 4.0;
+  double total_bits = num_extra_bits_;
+  for (int c = 0; c < histograms_.size(); ++c) {
+    if (dirty_[c] & kStaleEntropy) {
+      const Histogram& histogram = histograms_[c];
+      const size_t num_used = histogram.NumUsedSymbols();
+      estimated_bits_[c] =
+          num_used == 0 ? 0.0
+                        : kBitsPerHistogram + kBitsPerUsedSymbol * num_used +
+                              histogram.ShannonEntropy();
+      dirty_[c] &= ~kStaleEntropy;
+    }
+    total_bits += estimated_bits_[c];
+  }
+  return static_cast<size_t>(total_bits + 7) / 8;
+}
+
 struct HuffmanEncodingData {
   void BuildAndStore(const uint32_t* histogram, size_t histo_size,
                      size_t* storage_ix, uint8_t* storage) {
@@ -191,18 +217,79 @@ struct ANSEncodingData {
                                  storage_ix, storage);
   }
 
+  // Uses the given normalized counts instead of a histogram; stores nothing.
+  void BuildFromCounts(const uint16_t* normalized_counts, size_t num_counts) {
+    std::vector<int> counts(normalized_counts, normalized_counts + num_counts);
+    ans_table.resize(num_counts);
+    ANSBuildInfoTable(counts.data(), counts.size(), ans_table.data());
+  }
+
   std::vector<ANSEncSymbolInfo> ans_table;
 };
 
+// Scratch buffers of the AC token writers. Allocating (and zero-filling) them
+// for every ANSSymbolWriter and EncodeACFast call costs more than encoding
+// small images or groups, hence each thread keeps one set for reuse.
+struct ACTokenBuffers {
+  // Tokens of EncodeACFast, see MakeToken.
+  std::vector<uint32_t> tokens;
+  // Positions and values of the 16-bit ANS outputs of one EncodeACFast chunk.
+  std::vector<uint32_t> chunk_outputs;
+  // (bits, nbits) pairs and (context, symbol) pairs of ANSSymbolWriter.
+  std::vector<uint32_t> code_words;
+  std::vector<uint32_t> symbols;
+  bool in_use = false;
+};
+
+// Grants exclusive access to the calling thread's ACTokenBuffers during its
+// lifetime. Nested arenas on the same thread use private buffers instead.
+class ACTokenArena {
+ public:
+  ACTokenArena() : buffers_(&ThreadBuffers()) {
+    if (buffers_->in_use) {
+      owned_.reset(new ACTokenBuffers);
+      buffers_ = owned_.get();
+    }
+    buffers_->in_use = true;
+  }
+  ~ACTokenArena() { buffers_->in_use = false; }
+
+  ACTokenArena(const ACTokenArena&) = delete;
+  ACTokenArena& operator=(const ACTokenArena&) = delete;
+
+  ACTokenBuffers* operator->() const { return buffers_; }
+
+ private:
+  static ACTokenBuffers& ThreadBuffers() {
+    static thread_local ACTokenBuffers buffers;
+    return buffers;
+  }
+
+  std::unique_ptr<ACTokenBuffers> owned_;
+  ACTokenBuffers* buffers_;
+};
+
 // Symbol visitor that collects symbols and raw bits to be encoded.
+// With "num_states" > 1, the symbols of each chunk of kANSBufferSize symbols
+// are distributed round-robin over that many interleaved ANS states, which
+// allows the decoder to overlap the table lookups of consecutive symbols.
 class ANSSymbolWriter {
  public:
   ANSSymbolWriter(const std::vector<ANSEncodingData>& codes,
                   const std::vector<uint8_t>& context_map,
-                  size_t* storage_ix, uint8_t* storage)
-      : idx_(0), symbol_idx_(0), code_words_(2 * kANSBufferSize),
-        symbols_(kANSBufferSize), codes_(codes), context_map_(context_map),
-        storage_ix_(storage_ix), storage_(storage) {}
+                  size_t* storage_ix, uint8_t* storage,
+                  const int num_states = 1)
+      : idx_(0), symbol_idx_(0), num_states_(num_states),
+        code_words_(arena_->code_words), symbols_(arena_->symbols),
+        codes_(codes), context_map_(context_map),
+        storage_ix_(storage_ix), storage_(storage) {
+    PIK_ASSERT(1 <= num_states && num_states <= kMaxANSStates);
+    PIK_ASSERT((num_states & (num_states - 1)) == 0);
+    // Only the first writer on each thread allocates; entries are always
+    // written before being read.
+    code_words_.resize(2 * kANSBufferSize);
+    symbols_.resize(kANSBufferSize);
+  }
 
   void VisitBits(size_t nbits, uint64_t bits) {
     PIK_ASSERT(nbits <= 16);
@@ -223,7 +310,8 @@ class ANSSymbolWriter {
 
   void FlushToBitStream() {
     const int num_codewords = idx_;
-    ANSCoder ans;
+    ANSCoder ans[kMaxANSStates];
+    const int state_mask = num_states_ - 1;
     int first_symbol = num_codewords;
     // Replace placeholder code words with actual bits by feeding symbols to the
     // ANS encoder in a reverse order.
@@ -236,16 +324,18 @@ class ANSSymbolWriter {
         const uint32_t symbol = sym & 0xffff;
         const ANSEncSymbolInfo info = codes_[histo_idx].ans_table[symbol];
         uint8_t nbits = 0;
-        uint32_t bits = ans.PutSymbol(info, &nbits);
+        uint32_t bits = ans[symbol_idx_ & state_mask].PutSymbol(info, &nbits);
         code_words_[i] = (bits << 16) + nbits;
         first_symbol = i;
       }
     }
     for (int i = 0; i < num_codewords; ++i) {
       if (i == first_symbol) {
-        const uint32_t state = ans.GetState();
-        WriteBits(16, (state >> 16) & 0xffff, storage_ix_, storage_);
-        WriteBits(16, state & 0xffff, storage_ix_, storage_);
+        for (int j = 0; j < num_states_; ++j) {
+          const uint32_t state = ans[j].GetState();
+          WriteBits(16, (state >> 16) & 0xffff, storage_ix_, storage_);
+          WriteBits(16, state & 0xffff, storage_ix_, storage_);
+        }
       }
       const uint32_t cw = code_words_[i];
       const uint32_t nbits = cw & 0xffff;
@@ -257,12 +347,15 @@ class ANSSymbolWriter {
   }
 
  private:
+  // Declared first because it owns the storage of code_words_ and symbols_.
+  ACTokenArena arena_;
   int idx_;
   int symbol_idx_;
+  const int num_states_;
   // Vector of (bits, nbits) pairs to be encoded.
-  std::vector<uint32_t> code_words_;
+  std::vector<uint32_t>& code_words_;
   // Vector of (context, symbol) pairs to be encoded.
-  std::vector<uint32_t> symbols_;
+  std::vector<uint32_t>& symbols_;
   const std::vector<ANSEncodingData>& codes_;
   const std::vector<uint8_t>& context_map_;
   size_t* storage_ix_;
@@ -297,12 +390,22 @@ void ComputeCoeffOrder(const Image3W& img, int* order) {
 
 template <class EntropyEncodingData, class SymbolWriter>
 struct EncodeImageInternal {
+  explicit EncodeImageInternal(const int num_ans_states = 1,
+                               const bool fast_clustering = false)
+      : num_ans_states(num_ans_states), fast_clustering(fast_clustering) {}
+
+  // Unless null, "used_codes" and "used_context_map" receive the codes.
   template <class Processor>
-  std::string operator()(const Image3W& img, Processor* processor,
-                         PikImageSizeInfo* info) {
+  std::string operator()(
+      const Image3W& img, Processor* processor, PikImageSizeInfo* info,
+      std::vector<EntropyEncodingData>* used_codes = nullptr,
+      std::vector<uint8_t>* used_context_map = nullptr) {
     // Build histograms.
     HistogramBuilder builder(Processor::num_contexts());
-    ProcessImage3(img, processor, &builder);
+    {
+      PROFILER_ZONE("Build histograms");
+      ProcessImage3(img, processor, &builder);
+    }
     // Encode histograms.
     const size_t max_out_size = 2 * builder.EncodedSize(1, 2) + 1024;
     std::string output(max_out_size, 0);
@@ -312,16 +415,20 @@ struct EncodeImageInternal {
     std::vector<EntropyEncodingData> codes;
     std::vector<uint8_t> context_map;
     builder.BuildAndStoreEntropyCodes(
-        &codes, &context_map, &storage_ix, storage, info);
+        &codes, &context_map, &storage_ix, storage, info, fast_clustering);
     // Close the histogram bit stream.
     size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
     WriteBits(jump_bits, 0, &storage_ix, storage);
     PIK_ASSERT(storage_ix % 8 == 0);
     const size_t histo_bytes = storage_ix >> 3;
     // Entropy encode data.
-    SymbolWriter symbol_writer(codes, context_map, &storage_ix, storage);
-    ProcessImage3(img, processor, &symbol_writer);
-    symbol_writer.FlushToBitStream();
+    {
+      PROFILER_ZONE("ANS encode");
+      SymbolWriter symbol_writer(codes, context_map, &storage_ix, storage,
+                                 num_ans_states);
+      ProcessImage3(img, processor, &symbol_writer);
+      symbol_writer.FlushToBitStream();
+    }
     const size_t data_bits = storage_ix - 8 * histo_bytes;
     const size_t data_bytes = (data_bits + 7) >> 3;
     const int out_size = histo_bytes + data_bytes;
@@ -334,8 +441,13 @@ struct EncodeImageInternal {
       info->extra_bits += builder.num_extra_bits();
       info->total_size += out_size;
     }
+    if (used_codes != nullptr) used_codes->swap(codes);
+    if (used_context_map != nullptr) used_context_map->swap(context_map);
     return output;
   }
+
+  const int num_ans_states;
+  const bool fast_clustering;
 };
 
 template <class Processor>
@@ -353,13 +465,412 @@ std::string EncodeImage(const Image3W& img, int stride,
       img, &processor, info);
 }
 
-std::string EncodeAC(const Image3W& coeffs, PikImageSizeInfo* info) {
+// Symbol visitor computing an upper bound of the ANSSymbolWriter output size:
+// each symbol emits at most 16 bits and each flush writes a 32-bit state.
+class ANSMaxBitsCounter {
+ public:
+  explicit ANSMaxBitsCounter(const int num_states) : num_states_(num_states) {}
+
+  void VisitBits(size_t nbits, uint64_t bits) { num_bits_ += nbits; }
+
+  void VisitSymbol(int symbol, int ctx) {
+    num_bits_ += 16;
+    if (++num_symbols_ % kANSBufferSize == 0) num_bits_ += 32 * num_states_;
+  }
+
+  size_t MaxBytes() const { return (num_bits_ + 32 * num_states_ + 7) / 8; }
+
+ private:
+  const int num_states_;
+  size_t num_bits_ = 0;
+  size_t num_symbols_ = 0;
+};
+
+// Symbol visitor checking whether given codes (e.g. a built-in AC code set)
+// can represent all symbols, and counting the extra bits.
+class ACCodeChecker {
+ public:
+  ACCodeChecker(const std::vector<ANSEncodingData>& codes,
+                const std::vector<uint8_t>& context_map)
+      : codes_(codes), context_map_(context_map) {}
+
+  void VisitBits(size_t nbits, uint64_t bits) { num_extra_bits_ += nbits; }
+
+  void VisitSymbol(int symbol, int ctx) {
+    const std::vector<ANSEncSymbolInfo>& table =
+        codes_[context_map_[ctx]].ans_table;
+    if (symbol >= table.size() || table[symbol].freq_ == 0) {
+      ok_ = false;
+    }
+  }
+
+  bool ok() const { return ok_; }
+  size_t num_extra_bits() const { return num_extra_bits_; }
+
+ private:
+  const std::vector<ANSEncodingData>& codes_;
+  const std::vector<uint8_t>& context_map_;
+  bool ok_ = true;
+  size_t num_extra_bits_ = 0;
+};
+
+std::vector<ANSEncodingData> StaticACCodes(const int index) {
+  const uint16_t* counts = StaticACCounts(index);
+  std::vector<ANSEncodingData> codes(kNumStaticACContexts);
+  for (int c = 0; c < kNumStaticACContexts; ++c) {
+    codes[c].BuildFromCounts(&counts[c * kStaticACAlphabetSize],
+                             kStaticACAlphabetSize);
+  }
+  return codes;
+}
+
+// Returns the AC stream (without the code set index) coded with the given
+// codes, which are not transmitted, and "order" (null for
+// kNaturalCoeffOrder; transmitted if "transmit_order"), or an empty string
+// if the codes cannot represent all symbols.
+std::string EncodeACWithCodes(const Image3W& coeffs,
+                              const std::vector<ANSEncodingData>& codes,
+                              const std::vector<uint8_t>& context_map,
+                              const int* order, const bool transmit_order,
+                              const int num_ans_states,
+                              PikImageSizeInfo* info) {
   ACBlockProcessor processor;
-  int order[192];
-  ComputeCoeffOrder(coeffs, order);
-  processor.SetCoeffOrder(order);
-  return EncodeImageInternal<ANSEncodingData, ANSSymbolWriter>()(
-      coeffs, &processor, info);
+  if (order != nullptr) processor.SetCoeffOrder(order);
+  processor.SetTransmitCoeffOrder(transmit_order);
+  ACCodeChecker checker(codes, context_map);
+  ProcessImage3(coeffs, &processor, &checker);
+  if (!checker.ok()) return std::string();
+  ANSMaxBitsCounter counter(num_ans_states);
+  ProcessImage3(coeffs, &processor, &counter);
+  std::string output(counter.MaxBytes() + 8, 0);
+  size_t storage_ix = 0;
+  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
+  storage[0] = 0;
+  ANSSymbolWriter symbol_writer(codes, context_map, &storage_ix, storage,
+                                num_ans_states);
+  ProcessImage3(coeffs, &processor, &symbol_writer);
+  symbol_writer.FlushToBitStream();
+  const size_t out_size = (storage_ix + 7) >> 3;
+  PIK_CHECK(out_size <= output.size());
+  output.resize(out_size);
+  if (info) {
+    info->entropy_coded_bits += storage_ix - checker.num_extra_bits();
+    info->extra_bits += checker.num_extra_bits();
+    info->total_size += out_size;
+  }
+  return output;
+}
+
+namespace {
+
+// Symbol visitor that counts the symbols of each clustered histogram.
+class ClusteredHistogramCounter {
+ public:
+  ClusteredHistogramCounter(const std::vector<uint8_t>& context_map,
+                            const size_t num_histograms)
+      : context_map_(context_map), counts_(num_histograms) {}
+
+  void VisitBits(size_t nbits, uint64_t bits) {}
+
+  void VisitSymbol(int symbol, int ctx) {
+    std::vector<uint32_t>& counts = counts_[context_map_[ctx]];
+    if (symbol >= counts.size()) counts.resize(symbol + 1);
+    ++counts[symbol];
+  }
+
+  const std::vector<uint32_t>& counts(const size_t histogram) const {
+    return counts_[histogram];
+  }
+
+ private:
+  const std::vector<uint8_t>& context_map_;
+  std::vector<std::vector<uint32_t>> counts_;
+};
+
+// Returns the bits of coding "counts" with "table", or a negative value if
+// the table cannot represent all of them.
+double CodedBits(const std::vector<uint32_t>& counts,
+                 const std::vector<ANSEncSymbolInfo>& table) {
+  double bits = 0.0;
+  for (size_t symbol = 0; symbol < counts.size(); ++symbol) {
+    if (counts[symbol] == 0) continue;
+    if (symbol >= table.size() || table[symbol].freq_ == 0) return -1.0;
+    bits += counts[symbol] * (ANS_LOG_TAB_SIZE - std::log2(
+                                  static_cast<double>(table[symbol].freq_)));
+  }
+  return bits;
+}
+
+// Returns the AC stream (without the code set index) coded with the codes and
+// order of "previous", except for the histograms that cannot represent the
+// symbols of "coeffs" or cost more than transmitting a replacement
+// (kUpdatedACCodes). "codes" receives all codes of the output.
+std::string EncodeACWithUpdatedCodes(const Image3W& coeffs,
+                                     const ACCodes& previous,
+                                     const int num_ans_states,
+                                     std::vector<ANSEncodingData>* codes,
+                                     PikImageSizeInfo* info) {
+  ACBlockProcessor processor;
+  processor.SetCoeffOrder(previous.order);
+  processor.SetTransmitCoeffOrder(false);
+  const size_t num_histograms = previous.tables.size();
+  ClusteredHistogramCounter counter(previous.context_map, num_histograms);
+  ProcessImage3(coeffs, &processor, &counter);
+
+  // Upper bound of one stored histogram (of at most 256 symbols).
+  constexpr size_t kMaxHistogramBytes = 1024;
+  std::vector<uint8_t> scratch(kMaxHistogramBytes);
+  std::vector<bool> replace(num_histograms, false);
+  size_t num_replaced = 0;
+  for (size_t i = 0; i < num_histograms; ++i) {
+    const std::vector<uint32_t>& counts = counter.counts(i);
+    if (counts.empty()) continue;
+    std::fill(scratch.begin(), scratch.end(), 0);
+    size_t histogram_bits = 0;
+    ANSEncodingData code;
+    code.BuildAndStore(counts.data(), counts.size(), &histogram_bits,
+                       scratch.data());
+    PIK_CHECK(histogram_bits <= 8 * kMaxHistogramBytes);
+    const double previous_bits = CodedBits(counts, previous.tables[i]);
+    if (previous_bits < 0.0 ||
+        histogram_bits + CodedBits(counts, code.ans_table) < previous_bits) {
+      replace[i] = true;
+      ++num_replaced;
+    }
+  }
+
+  ANSMaxBitsCounter max_bits(num_ans_states);
+  ProcessImage3(coeffs, &processor, &max_bits);
+  std::string output(num_histograms / 8 + num_replaced * kMaxHistogramBytes +
+                         max_bits.MaxBytes() + 8,
+                     0);
+  size_t storage_ix = 0;
+  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
+  codes->clear();
+  codes->resize(num_histograms);
+  for (size_t i = 0; i < num_histograms; ++i) {
+    WriteBits(1, replace[i], &storage_ix, storage);
+    if (replace[i]) {
+      const std::vector<uint32_t>& counts = counter.counts(i);
+      (*codes)[i].BuildAndStore(counts.data(), counts.size(), &storage_ix,
+                                storage);
+    } else {
+      (*codes)[i].ans_table = previous.tables[i];
+    }
+  }
+  WriteBits(((storage_ix + 7) & ~7) - storage_ix, 0, &storage_ix, storage);
+  const size_t histogram_bytes = storage_ix / 8;
+  ACCodeChecker checker(*codes, previous.context_map);
+  ProcessImage3(coeffs, &processor, &checker);
+  if (!checker.ok()) return std::string();
+  ANSSymbolWriter symbol_writer(*codes, previous.context_map, &storage_ix,
+                                storage, num_ans_states);
+  ProcessImage3(coeffs, &processor, &symbol_writer);
+  symbol_writer.FlushToBitStream();
+  const size_t out_size = (storage_ix + 7) >> 3;
+  PIK_CHECK(out_size <= output.size());
+  output.resize(out_size);
+  if (info) {
+    info->num_clustered_histograms += num_replaced;
+    info->histogram_size += histogram_bytes;
+    info->entropy_coded_bits +=
+        storage_ix - 8 * histogram_bytes - checker.num_extra_bits();
+    info->extra_bits += checker.num_extra_bits();
+    info->total_size += out_size;
+  }
+  return output;
+}
+
+void StoreACCodes(const std::vector<ANSEncodingData>& codes,
+                  const std::vector<uint8_t>& context_map, const int* order,
+                  ACCodes* used) {
+  used->tables.resize(codes.size());
+  for (size_t i = 0; i < codes.size(); ++i) {
+    used->tables[i] = codes[i].ans_table;
+  }
+  used->context_map = context_map;
+  for (int c = 0; c < 3; ++c) {
+    memcpy(&used->order[c * 64],
+           order != nullptr ? &order[c * 64] : kNaturalCoeffOrder,
+           64 * sizeof(used->order[0]));
+  }
+}
+
+}  // namespace
+
+std::string EncodeAC(const Image3W& coeffs, const int* order,
+                     const int num_ans_states, const bool fast_clustering,
+                     const bool static_codes, const ACCodes* previous,
+                     ACCodes* used, PikImageSizeInfo* info) {
+  ACBlockProcessor processor;
+  if (order != nullptr) {
+    processor.SetCoeffOrder(order);
+  } else {
+    processor.SetTransmitCoeffOrder(false);
+  }
+  std::vector<ANSEncodingData> best_codes;
+  std::vector<uint8_t> best_context_map;
+  if (!static_codes) {
+    std::string output =
+        EncodeImageInternal<ANSEncodingData, ANSSymbolWriter>(
+            num_ans_states, fast_clustering)(coeffs, &processor, info,
+                                             &best_codes, &best_context_map);
+    if (used != nullptr) {
+      StoreACCodes(best_codes, best_context_map, order, used);
+    }
+    return output;
+  }
+  PikImageSizeInfo best_info;
+  std::string best = EncodeImageInternal<ANSEncodingData, ANSSymbolWriter>(
+      num_ans_states, fast_clustering)(coeffs, &processor, &best_info,
+                                       &best_codes, &best_context_map);
+  int best_index = 0;
+  const int* best_order = order;
+  for (int index = 1; index <= kNumStaticACCodeSets; ++index) {
+    PikImageSizeInfo static_info;
+    std::vector<ANSEncodingData> codes = StaticACCodes(index);
+    std::string output = EncodeACWithCodes(
+        coeffs, codes, StaticACContextMap(), nullptr, order != nullptr,
+        num_ans_states, &static_info);
+    if (!output.empty() && output.size() < best.size()) {
+      best.swap(output);
+      best_info = static_info;
+      best_index = index;
+      best_codes.swap(codes);
+      best_context_map = StaticACContextMap();
+      best_order = nullptr;
+    }
+  }
+  if (previous != nullptr) {
+    PikImageSizeInfo previous_info;
+    std::vector<ANSEncodingData> codes(previous->tables.size());
+    for (size_t i = 0; i < codes.size(); ++i) {
+      codes[i].ans_table = previous->tables[i];
+    }
+    std::string output = EncodeACWithCodes(
+        coeffs, codes, previous->context_map, previous->order,
+        /*transmit_order=*/false, num_ans_states, &previous_info);
+    // Keeps referencing the same codes if they are as good, e.g. a static
+    // code set chosen by an earlier frame.
+    if (!output.empty() && output.size() <= best.size()) {
+      best.swap(output);
+      best_info = previous_info;
+      best_index = kPreviousACCodes;
+    }
+    PikImageSizeInfo updated_info;
+    output = EncodeACWithUpdatedCodes(coeffs, *previous, num_ans_states,
+                                      &codes, &updated_info);
+    if (!output.empty() && output.size() < best.size()) {
+      best.swap(output);
+      best_info = updated_info;
+      best_index = kUpdatedACCodes;
+      best_codes.swap(codes);
+    }
+  }
+  if (used != nullptr) {
+    if (best_index == kPreviousACCodes || best_index == kUpdatedACCodes) {
+      if (used != previous) *used = *previous;
+      if (best_index == kUpdatedACCodes) {
+        for (size_t i = 0; i < best_codes.size(); ++i) {
+          used->tables[i] = best_codes[i].ans_table;
+        }
+      }
+    } else {
+      StoreACCodes(best_codes, best_context_map, best_order, used);
+    }
+  }
+  if (info) {
+    info->Assimilate(best_info);
+    info->histogram_size += 1;
+    info->total_size += 1;
+    if (best_index == kPreviousACCodes || best_index == kUpdatedACCodes) {
+      info->num_shared_codes += 1;
+    }
+  }
+  return std::string(1, best_index) + best;
+}
+
+std::string EncodeACGroups(const Image3W& coeffs, const int* order,
+                           const int group_ysize, const int num_ans_states,
+                           const bool fast_clustering, ThreadPool* pool,
+                           PikImageSizeInfo* info,
+                           std::vector<std::string>* group_codes) {
+  ACBlockProcessor processor;
+  if (order != nullptr) {
+    processor.SetCoeffOrder(order);
+  } else {
+    processor.SetTransmitCoeffOrder(false);
+  }
+  // Build histograms over the whole image.
+  HistogramBuilder builder(ACBlockProcessor::num_contexts());
+  {
+    PROFILER_ZONE("Build histograms");
+    ProcessImage3(coeffs, &processor, &builder);
+  }
+
+  const int num_groups = (coeffs.ysize() + group_ysize - 1) / group_ysize;
+  const size_t max_out_size =
+      2 * builder.EncodedSize(1, 2) + 4 * num_groups + 1024;
+  std::string output(max_out_size, 0);
+  size_t storage_ix = 0;
+  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
+  storage[0] = 0;
+  std::vector<ANSEncodingData> codes;
+  std::vector<uint8_t> context_map;
+  builder.BuildAndStoreEntropyCodes(
+      &codes, &context_map, &storage_ix, storage, info, fast_clustering);
+  size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
+  WriteBits(jump_bits, 0, &storage_ix, storage);
+  const size_t histo_bytes = storage_ix >> 3;
+  {
+    // Only emits bits, hence the flush does not write an ANS state.
+    ANSSymbolWriter header_writer(codes, context_map, &storage_ix, storage);
+    processor.ProcessHeader(&header_writer);
+    header_writer.FlushToBitStream();
+  }
+
+  // Groups are independent because the AC contexts are reset at the start of
+  // each row.
+  group_codes->resize(num_groups);
+  RunOnPool(pool, 0, num_groups, [&](const int group, const int thread) {
+    PROFILER_ZONE("ANS encode");
+    const int y_begin = group * group_ysize;
+    const int y_end = std::min<int>(y_begin + group_ysize, coeffs.ysize());
+    ACBlockProcessor group_processor = processor;
+    ANSMaxBitsCounter counter(num_ans_states);
+    ProcessImage3Rows(coeffs, y_begin, y_end, &group_processor, &counter);
+    std::string& group_code = (*group_codes)[group];
+    group_code.assign(counter.MaxBytes(), 0);
+    size_t group_ix = 0;
+    uint8_t* group_storage = reinterpret_cast<uint8_t*>(&group_code[0]);
+    ANSSymbolWriter symbol_writer(codes, context_map, &group_ix,
+                                  group_storage, num_ans_states);
+    ProcessImage3Rows(coeffs, y_begin, y_end, &group_processor,
+                      &symbol_writer);
+    symbol_writer.FlushToBitStream();
+    PIK_CHECK(group_ix <= 8 * group_code.size());
+    group_code.resize((group_ix + 7) >> 3);
+    group_code = PadTo4Bytes(group_code);
+  });
+
+  size_t groups_size = 0;
+  for (const std::string& group_code : *group_codes) {
+    WriteBits(16, group_code.size() >> 16, &storage_ix, storage);
+    WriteBits(16, group_code.size() & 0xffff, &storage_ix, storage);
+    groups_size += group_code.size();
+  }
+  const int out_size = (storage_ix + 7) >> 3;
+  PIK_CHECK(out_size <= max_out_size);
+  output.resize(out_size);
+  if (info) {
+    info->num_clustered_histograms += codes.size();
+    info->histogram_size += histo_bytes;
+    info->entropy_coded_bits += 8 * (out_size - histo_bytes + groups_size) -
+                                builder.num_extra_bits();
+    info->extra_bits += builder.num_extra_bits();
+    info->total_size += out_size + groups_size;
+  }
+  return output;
 }
 
 PIK_INLINE uint32_t MakeToken(const uint32_t context, const uint32_t symbol,
@@ -367,34 +878,58 @@ PIK_INLINE uint32_t MakeToken(const uint32_t context, const uint32_t symbol,
   return (context << 26) | (symbol << 18) | (nbits << 14) | bits;
 }
 
-std::string EncodeACFast(const Image3W& coeffs, PikImageSizeInfo* info) {
-  // Build static context map.
-  static const int kNumContexts = 408;
-  static const int kStaticZdensContextMap[120] = {
-    0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
-    0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
-    4, 4, 4, 4, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
-    4, 4, 4, 4, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
-    5, 5, 5, 5, 5, 5, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
-    6, 6, 6, 6, 5, 5, 2, 2, 2, 2, 2, 3, 3, 3, 3,
-    6, 6, 6, 6, 5, 5, 2, 2, 2, 2, 2, 3, 3, 3,
-    6, 6, 6, 6, 5, 5, 2, 2, 2, 2, 2,
-  };
-  static const int kNumStaticZdensContexts = 7;
-  static const int kNumStaticContexts = 3 * (1 + kNumStaticZdensContexts);
-  PIK_ASSERT(kNumStaticContexts <= 64);
-  std::vector<uint8_t> context_map(kNumContexts);
-  for (int c = 0; c < 3; ++c) {
-    for (int i = 0; i < 16; ++i) {
-      context_map[c * 16 + i] = c;
+// Given the histograms of the static context map (256 symbols each), returns
+// the index of the built-in code set with the lowest estimated cost, or 0 if
+// none is cheaper than transmitting the histograms.
+int ChooseStaticACCodes(const uint32_t* histograms, const int num_histograms) {
+  PIK_ASSERT(num_histograms == kNumStaticACContexts);
+  double best_bits = 0.0;
+  for (int c = 0; c < num_histograms; ++c) {
+    size_t histogram_bits;
+    size_t data_bits;
+    BuildHuffmanTreeAndCountBits(&histograms[c << 8], 256,
+                                 &histogram_bits, &data_bits);
+    best_bits += histogram_bits + ShannonEntropy(&histograms[c << 8], 256);
+  }
+  int best_index = 0;
+  for (int index = 1; index <= kNumStaticACCodeSets; ++index) {
+    const uint16_t* counts = StaticACCounts(index);
+    double bits = 0.0;
+    for (int c = 0; c < num_histograms && bits < best_bits; ++c) {
+      for (int s = 0; s < 256; ++s) {
+        const uint32_t n = histograms[(c << 8) + s];
+        if (n == 0) continue;
+        const int count = s < kStaticACAlphabetSize ?
+            counts[c * kStaticACAlphabetSize + s] : 0;
+        if (count == 0) {
+          bits = best_bits;  // not representable
+          break;
+        }
+        bits += n * (ANS_LOG_TAB_SIZE - FastLog2(count));
+      }
     }
-    for (int i = 0; i < 120; ++i) {
-      context_map[48 + c * 120 + i] =
-          3 + c * kNumStaticZdensContexts + kStaticZdensContextMap[i];
+    if (bits < best_bits) {
+      best_bits = bits;
+      best_index = index;
     }
   }
+  return best_index;
+}
+
+std::string EncodeACFast(const Image3W& coeffs, const bool natural_order,
+                         const int num_ans_states, const bool static_codes,
+                         PikImageSizeInfo* info) {
+  PROFILER_FUNC;
+  PIK_ASSERT(1 <= num_ans_states && num_ans_states <= kMaxANSStates);
+  PIK_ASSERT((num_ans_states & (num_ans_states - 1)) == 0);
+  // Build static context map.
+  static const int kNumStaticContexts = kNumStaticACContexts;
+  PIK_ASSERT(kNumStaticContexts <= 64);
+  const std::vector<uint8_t> context_map = StaticACContextMap();
   // Tokenize the coefficient stream.
-  std::vector<uint32_t> tokens;
+  ACTokenArena arena;
+  std::vector<uint32_t>& tokens = arena->tokens;
+  tokens.clear();
   tokens.reserve(3 * coeffs.xsize() * coeffs.ysize());
   size_t num_extra_bits = 0;
   for (int y = 0; y < coeffs.ysize(); ++y) {
@@ -456,19 +991,30 @@ std::string EncodeACFast(const Image3W& coeffs, PikImageSizeInfo* info) {
     num_bits += histogram_bits + data_bits;
   }
   size_t num_bytes = (num_bits + 7) >> 3;
-  const size_t max_out_size = 2 * num_bytes + 1024;
+  const size_t num_chunks = tokens.size() / kANSBufferSize + 1;
+  const size_t max_out_size =
+      2 * num_bytes + 4 * num_ans_states * num_chunks + 1024;
   // Allocate output string.
   std::string output(max_out_size, 0);
   size_t storage_ix = 0;
   uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
   storage[0] = 0;
-  // Encode the histograms.
+  // Encode the histograms, unless a built-in code set is cheaper.
+  int static_index = 0;
+  if (static_codes) {
+    static_index = ChooseStaticACCodes(histograms.data(), kNumStaticContexts);
+    WriteBits(8, static_index, &storage_ix, storage);
+  }
   std::vector<ANSEncodingData> codes;
-  EncodeContextMap(context_map, kNumStaticContexts, &storage_ix, storage);
-  for (int c = 0; c < kNumStaticContexts; ++c) {
-    ANSEncodingData code;
-    code.BuildAndStore(&histograms[c << 8], 256, &storage_ix, storage);
-    codes.emplace_back(std::move(code));
+  if (static_index != 0) {
+    codes = StaticACCodes(static_index);
+  } else {
+    EncodeContextMap(context_map, kNumStaticContexts, &storage_ix, storage);
+    for (int c = 0; c < kNumStaticContexts; ++c) {
+      ANSEncodingData code;
+      code.BuildAndStore(&histograms[c << 8], 256, &storage_ix, storage);
+      codes.emplace_back(std::move(code));
+    }
   }
   // Close the histogram bit stream.
   size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
@@ -476,27 +1022,34 @@ std::string EncodeACFast(const Image3W& coeffs, PikImageSizeInfo* info) {
   PIK_ASSERT(storage_ix % 8 == 0);
   const size_t histo_bytes = storage_ix >> 3;
   // Entropy encode data.
-  WriteBits(12, 0, &storage_ix, storage);  // zig-zag coefficient order
+  if (!natural_order) {
+    WriteBits(12, 0, &storage_ix, storage);  // zig-zag coefficient order
+  }
   PIK_ASSERT(kANSBufferSize <= (1 << 16));
+  std::vector<uint32_t>& out = arena->chunk_outputs;
+  out.reserve(kANSBufferSize);
   for (int start = 0; start < tokens.size(); start += kANSBufferSize) {
-    std::vector<uint32_t> out;
-    out.reserve(kANSBufferSize);
+    out.clear();
     const int end = std::min<int>(start + kANSBufferSize, tokens.size());
-    ANSCoder ans;
+    // Same round-robin assignment of symbols to states as ANSSymbolWriter.
+    ANSCoder ans[kMaxANSStates];
+    const int state_mask = num_ans_states - 1;
     for (int i = end - 1; i >= start; --i) {
       const uint32_t token = tokens[i];
       const uint32_t context = token >> 26;
       const uint32_t symbol = (token >> 18) & 0xff;
       const ANSEncSymbolInfo info = codes[context].ans_table[symbol];
       uint8_t nbits = 0;
-      uint32_t bits = ans.PutSymbol(info, &nbits);
+      uint32_t bits = ans[(i - start) & state_mask].PutSymbol(info, &nbits);
       if (nbits == 16) {
         out.push_back(((i - start) << 16) | bits);
       }
     }
-    const uint32_t state = ans.GetState();
-    WriteBits(16, (state >> 16) & 0xffff, &storage_ix, storage);
-    WriteBits(16, state & 0xffff, &storage_ix, storage);
+    for (int j = 0; j < num_ans_states; ++j) {
+      const uint32_t state = ans[j].GetState();
+      WriteBits(16, (state >> 16) & 0xffff, &storage_ix, storage);
+      WriteBits(16, state & 0xffff, &storage_ix, storage);
+    }
     int tokenidx = start;
     for (int i = out.size(); i >= 0; --i) {
       int nextidx = i > 0 ? start + (out[i - 1] >> 16) : end;
@@ -536,6 +1089,71 @@ size_t EncodedACSize(const Image3W& coeffs) {
   return EncodedImageSizeInternal(coeffs, &processor);
 }
 
+size_t EstimatedImageSize(const Image3W& img, int stride) {
+  CoeffProcessor processor(stride);
+  HistogramBuilder builder(processor.num_contexts());
+  ProcessImage3(img, &processor, &builder);
+  return builder.EstimatedSize();
+}
+
+size_t EstimatedACSize(const Image3W& coeffs) {
+  ACBlockProcessor processor;
+  HistogramBuilder builder(processor.num_contexts());
+  ProcessImage3(coeffs, &processor, &builder);
+  return builder.EstimatedSize();
+}
+
+namespace {
+
+// For setting up the context of ACBlockProcessor.
+struct DiscardingVisitor {
+  void VisitSymbol(int symbol, int ctx) {}
+  void VisitBits(size_t nbits, uint64_t bits) {}
+};
+
+}  // namespace
+
+CoeffRateTracker::CoeffRateTracker(const Image3W& coeffs)
+    : dc_histo_(CoeffProcessor::num_contexts()),
+      ac_histo_(ac_processor_.num_contexts()) {
+  CoeffProcessor dc_processor(1);
+  ProcessImage3(PredictDC(coeffs), &dc_processor, &dc_histo_);
+  ProcessImage3(coeffs, &ac_processor_, &ac_histo_);
+}
+
+void CoeffRateTracker::UpdateAC(const Image3W& coeffs,
+                                const ImageB& dirty_blocks, const int weight) {
+  const size_t block_size = ac_processor_.block_size();
+  PIK_CHECK(dirty_blocks.xsize() * block_size == coeffs.xsize());
+  ac_histo_.set_weight(weight);
+  DiscardingVisitor discard;
+  for (size_t by = 0; by < dirty_blocks.ysize(); ++by) {
+    const uint8_t* const PIK_RESTRICT row_dirty = dirty_blocks.Row(by);
+    auto row = coeffs.Row(by);
+    // Whether the processor context is that of block bx - 1.
+    bool has_context = false;
+    for (size_t bx = 0; bx < dirty_blocks.xsize(); ++bx) {
+      if (row_dirty[bx] == 0 && (bx == 0 || row_dirty[bx - 1] == 0)) {
+        has_context = false;
+        continue;
+      }
+      const size_t x = bx * block_size;
+      if (!has_context && bx != 0) {
+        for (int c = 0; c < 3; ++c) {
+          ac_processor_.ProcessBlock(&row[c][x - block_size], x - block_size,
+                                     by, c, &discard);
+        }
+      }
+      for (int c = 0; c < 3; ++c) {
+        ac_processor_.ProcessBlock(&row[c][x], x, by, c, &ac_histo_);
+      }
+      has_context = true;
+    }
+  }
+  ac_histo_.set_weight(1);
+  ac_histo_.TrimZeroCounts();
+}
+
 class ANSBitCounter {
  public:
   ANSBitCounter(const std::vector<ANSEncodingData>& codes,
@@ -642,14 +1260,22 @@ class HuffmanSymbolReader {
   }
 };
 
+// Decodes the output of ANSSymbolWriter with the same number of states.
+// "tables" (not owned) stores the decoding tables; copies of the reader share
+// them, but each has its own ANS state.
 class ANSSymbolReader {
  public:
+  explicit ANSSymbolReader(DecoderTables* tables, const int num_states = 1)
+      : state_mask_(num_states - 1), tables_(tables) {
+    PIK_ASSERT(1 <= num_states && num_states <= kMaxANSStates);
+    PIK_ASSERT((num_states & (num_states - 1)) == 0);
+  }
+
   bool DecodeHistograms(const size_t num_histograms,
                         const size_t max_alphabet_size,
                         const uint8_t* symbol_lut, size_t symbol_lut_size,
                         BitReader* in) {
-    map_.resize(num_histograms << ANS_LOG_TAB_SIZE);
-    info_.resize(num_histograms << 8);
+    ResizeTables(num_histograms);
     for (int c = 0; c < num_histograms; ++c) {
       std::vector<int> counts;
       if (!ReadHistogram(ANS_LOG_TAB_SIZE, &counts, in)) {
@@ -658,56 +1284,200 @@ class ANSSymbolReader {
       if (counts.size() > max_alphabet_size) {
         return PIK_FAILURE("Alphabet size is too long.");
       }
-      int offset = 0;
-      for (int i = 0, pos = 0; i < counts.size(); ++i) {
-        int symbol = i;
-        if (symbol_lut != nullptr && symbol < symbol_lut_size) {
-          symbol = symbol_lut[symbol];
-        }
-        info_[(c << 8) + symbol].offset_ = offset;
-        info_[(c << 8) + symbol].freq_ = counts[i];
-        offset += counts[i];
-        if (offset > ANS_TAB_SIZE) {
-          return PIK_FAILURE("Invalid ANS histogram data.");
-        }
-        for (int j = 0; j < counts[i]; ++j, ++pos) {
-          map_[(c << ANS_LOG_TAB_SIZE) + pos] = symbol;
-        }
+      if (!SetHistogram(c, counts.data(), counts.size(),
+                        symbol_lut, symbol_lut_size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Same as DecodeHistograms, but uses "num_histograms" given normalized
+  // histograms of "alphabet_size" counts each instead of reading them.
+  bool SetHistograms(const size_t num_histograms, const uint16_t* counts,
+                     const size_t alphabet_size,
+                     const uint8_t* symbol_lut, size_t symbol_lut_size) {
+    ResizeTables(num_histograms);
+    std::vector<int> histogram(alphabet_size);
+    for (int c = 0; c < num_histograms; ++c) {
+      for (int i = 0; i < alphabet_size; ++i) {
+        histogram[i] = counts[c * alphabet_size + i];
+      }
+      if (!SetHistogram(c, histogram.data(), alphabet_size,
+                        symbol_lut, symbol_lut_size)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Instead of DecodeHistograms, reads with the histograms that were last
+  // built in the tables.
+  void UseCurrentHistograms() {
+    map_ = tables_->ans_map.data();
+    info_ = tables_->ans_info.data();
+  }
+
+  // After UseCurrentHistograms: replaces the histograms whose preceding bit is
+  // set with ones read from "in" (see kUpdatedACCodes).
+  bool UpdateHistograms(const size_t max_alphabet_size,
+                        const uint8_t* symbol_lut, size_t symbol_lut_size,
+                        BitReader* in) {
+    const size_t num_histograms =
+        tables_->ans_map.size() >> ANS_LOG_TAB_SIZE;
+    for (size_t c = 0; c < num_histograms; ++c) {
+      if (!in->ReadBits(1)) continue;
+      std::vector<int> counts;
+      if (!ReadHistogram(ANS_LOG_TAB_SIZE, &counts, in)) {
+        return PIK_FAILURE("Invalid histogram bitstream.");
+      }
+      if (counts.size() > max_alphabet_size) {
+        return PIK_FAILURE("Alphabet size is too long.");
+      }
+      if (!SetHistogram(c, counts.data(), counts.size(),
+                        symbol_lut, symbol_lut_size)) {
+        return false;
       }
     }
+    in->JumpToByteBoundary();
     return true;
   }
 
   int ReadSymbol(const int histo_idx, BitReader* const PIK_RESTRICT br) {
     if (symbols_left_ == 0) {
-      state_ = br->ReadBits(16);
-      state_ = (state_ << 16) | br->ReadBits(16);
+      for (int i = 0; i <= state_mask_; ++i) {
+        states_[i] = br->ReadBits(16);
+        states_[i] = (states_[i] << 16) | br->ReadBits(16);
+      }
       br->FillBitBuffer();
       symbols_left_ = kANSBufferSize;
+      state_idx_ = 0;
     }
-    const uint32_t res = state_ & (ANS_TAB_SIZE - 1);
+    // Consecutive symbols use different states, so their lookups do not
+    // depend on each other (unless there is only one state).
+    uint32_t& state = states_[state_idx_];
+    state_idx_ = (state_idx_ + 1) & state_mask_;
+    const uint32_t res = state & (ANS_TAB_SIZE - 1);
     const uint8_t symbol = map_[(histo_idx << ANS_LOG_TAB_SIZE) + res];
     const ANSSymbolInfo s = info_[(histo_idx << 8) + symbol];
-    state_ = s.freq_ * (state_ >> ANS_LOG_TAB_SIZE) + res - s.offset_;
+    state = s.freq_ * (state >> ANS_LOG_TAB_SIZE) + res - s.offset_;
     --symbols_left_;
-    if (state_ < (1u << 16)) {
-      state_ = (state_ << 16) | br->PeekFixedBits<16>();
+    if (state < (1u << 16)) {
+      state = (state << 16) | br->PeekFixedBits<16>();
       br->Advance(16);
     }
     return symbol;
   }
 
-  bool CheckANSFinalState() { return state_ == (ANS_SIGNATURE << 16); }
+  bool CheckANSFinalState() {
+    for (int i = 0; i <= state_mask_; ++i) {
+      if (states_[i] != (ANS_SIGNATURE << 16)) return false;
+    }
+    return true;
+  }
 
  private:
-  struct ANSSymbolInfo {
-    uint16_t offset_;
-    uint16_t freq_;
-  };
+  using ANSSymbolInfo = DecoderTables::ANSSymbolInfo;
+
+  // Reused tables keep their previous contents, which is fine because
+  // SetHistogram overwrites all entries that ReadSymbol can access.
+  void ResizeTables(const size_t num_histograms) {
+    tables_->ans_map.resize(num_histograms << ANS_LOG_TAB_SIZE);
+    tables_->ans_info.resize(num_histograms << 8);
+    map_ = tables_->ans_map.data();
+    info_ = tables_->ans_info.data();
+  }
+
+  using CachedHistogram = DecoderTables::CachedHistogram;
+
+  static uint64_t HashHistogram(const int* counts, const size_t num_counts,
+                                const uint8_t* symbol_lut) {
+    uint64_t hash = reinterpret_cast<uintptr_t>(symbol_lut) + num_counts;
+    for (size_t i = 0; i < num_counts; ++i) {
+      hash = (hash ^ counts[i]) * 0x9E3779B97F4A7C15ull;
+    }
+    return hash;
+  }
+
+  // Returns the cached tables built from the same histogram, or null.
+  const CachedHistogram* FindCachedHistogram(const uint64_t hash,
+                                             const int* counts,
+                                             const size_t num_counts,
+                                             const uint8_t* symbol_lut,
+                                             const size_t symbol_lut_size) {
+    for (const CachedHistogram& cached : tables_->histogram_cache) {
+      if (cached.hash == hash && cached.symbol_lut == symbol_lut &&
+          cached.symbol_lut_size == symbol_lut_size &&
+          cached.counts.size() == num_counts &&
+          std::equal(counts, counts + num_counts, cached.counts.begin())) {
+        return &cached;
+      }
+    }
+    return nullptr;
+  }
+
+  void AddCachedHistogram(const int c, const uint64_t hash, const int* counts,
+                          const size_t num_counts, const uint8_t* symbol_lut,
+                          const size_t symbol_lut_size) {
+    std::vector<CachedHistogram>& cache = tables_->histogram_cache;
+    if (cache.size() < DecoderTables::kMaxCachedHistograms) {
+      cache.emplace_back();
+      tables_->next_cached_histogram = cache.size() - 1;
+    }
+    CachedHistogram& cached = cache[tables_->next_cached_histogram];
+    tables_->next_cached_histogram =
+        (tables_->next_cached_histogram + 1) %
+        DecoderTables::kMaxCachedHistograms;
+    cached.hash = hash;
+    cached.symbol_lut = symbol_lut;
+    cached.symbol_lut_size = symbol_lut_size;
+    cached.counts.assign(counts, counts + num_counts);
+    cached.map.assign(map_ + (c << ANS_LOG_TAB_SIZE),
+                      map_ + ((c + 1) << ANS_LOG_TAB_SIZE));
+    cached.info.assign(info_ + (c << 8), info_ + ((c + 1) << 8));
+  }
+
+  bool SetHistogram(const int c, const int* counts, const size_t num_counts,
+                    const uint8_t* symbol_lut, size_t symbol_lut_size) {
+    uint8_t* const PIK_RESTRICT map = map_ + (c << ANS_LOG_TAB_SIZE);
+    ANSSymbolInfo* const PIK_RESTRICT info = info_ + (c << 8);
+    const uint64_t hash = HashHistogram(counts, num_counts, symbol_lut);
+    const CachedHistogram* cached = FindCachedHistogram(
+        hash, counts, num_counts, symbol_lut, symbol_lut_size);
+    if (cached != nullptr) {
+      memcpy(map, cached->map.data(), ANS_TAB_SIZE);
+      memcpy(info, cached->info.data(), 256 * sizeof(ANSSymbolInfo));
+      return true;
+    }
+    int offset = 0;
+    for (int i = 0; i < num_counts; ++i) {
+      int symbol = i;
+      if (symbol_lut != nullptr && symbol < symbol_lut_size) {
+        symbol = symbol_lut[symbol];
+      }
+      info[symbol].offset_ = offset;
+      info[symbol].freq_ = counts[i];
+      if (counts[i] > ANS_TAB_SIZE - offset) {
+        return PIK_FAILURE("Invalid ANS histogram data.");
+      }
+      // Each symbol occupies a run of map entries.
+      memset(map + offset, symbol, counts[i]);
+      offset += counts[i];
+    }
+    if (tables_->cache_histograms) {
+      AddCachedHistogram(c, hash, counts, num_counts, symbol_lut,
+                         symbol_lut_size);
+    }
+    return true;
+  }
+
   size_t symbols_left_ = 0;
-  uint32_t state_ = 0;
-  std::vector<uint8_t> map_;
-  std::vector<ANSSymbolInfo> info_;
+  const int state_mask_;
+  int state_idx_ = 0;
+  uint32_t states_[kMaxANSStates] = { 0 };
+  DecoderTables* tables_;
+  uint8_t* map_ = nullptr;
+  ANSSymbolInfo* info_ = nullptr;
 };
 
 bool DecodeHistograms(BitReader* br,
@@ -790,20 +1560,127 @@ bool DecodeCoeffOrder(int* order, BitReader* br) {
   return true;
 }
 
-bool DecodeACData(BitReader* const PIK_RESTRICT br,
+SparseAC::SparseAC(const int block_xsize, const int block_ysize)
+    : block_xsize_(block_xsize), rows_(block_ysize) {
+  for (Row& row : rows_) {
+    row.masks.resize(3 * block_xsize);
+    row.offsets.resize(3 * block_xsize);
+  }
+}
+
+void SparseAC::ClearRow(const int by) { rows_[by].values.clear(); }
+
+void SparseAC::SetBlock(const int bx, const int by, const int c,
+                        const int16_t* const PIK_RESTRICT block) {
+  Row& row = rows_[by];
+  uint64_t mask = NonZeroMask(block) & ~1ull;
+  row.masks[3 * bx + c] = mask;
+  row.offsets[3 * bx + c] = row.values.size();
+  while (mask != 0) {
+    row.values.push_back(block[PIK_TZCNT64(mask)]);
+    mask &= mask - 1;
+  }
+}
+
+TiledAC::TiledAC(const int block_xsize, const int block_ysize)
+    : block_xsize_(block_xsize),
+      block_ysize_(block_ysize),
+      tile_xsize_((block_xsize + kTileBlocks - 1) / kTileBlocks),
+      blocks_(nullptr, CacheAligned::Free) {
+  const size_t tile_ysize = (block_ysize + kTileBlocks - 1) / kTileBlocks;
+  const size_t num_coeffs =
+      tile_xsize_ * tile_ysize * kTileBlocks * kTileBlocks * kBlockCoeffs;
+  blocks_ = AllocateArray<int16_t>(num_coeffs);
+}
+
+namespace {
+
+// Destinations of DecodeACRows: a coefficient image, SparseAC or TiledAC.
+// Copies of an instance write to the same destination, but must only be used
+// by one thread at a time.
+class DenseACOutput {
+ public:
+  explicit DenseACOutput(Image3W* coeffs) : coeffs_(coeffs) {}
+
+  int block_xsize() const { return coeffs_->xsize() / 64; }
+  int block_ysize() const { return coeffs_->ysize(); }
+
+  void BeginRow(const int by) {}
+  // Returns the 64 coefficients of the block, whose AC coefficients are zero
+  // and then set by the caller.
+  int16_t* BeginBlock(const int bx, const int by, const int c) {
+    int16_t* const PIK_RESTRICT block = coeffs_->PlaneRow(c, by) + bx * 64;
+    memset(block + 1, 0, 63 * sizeof(block[0]));
+    return block;
+  }
+  void EndBlock(const int bx, const int by, const int c) {}
+
+ private:
+  Image3W* coeffs_;
+};
+
+class SparseACOutput {
+ public:
+  explicit SparseACOutput(SparseAC* ac) : ac_(ac) {}
+
+  int block_xsize() const { return ac_->block_xsize(); }
+  int block_ysize() const { return ac_->block_ysize(); }
+
+  void BeginRow(const int by) { ac_->ClearRow(by); }
+  int16_t* BeginBlock(const int bx, const int by, const int c) {
+    memset(block_, 0, sizeof(block_));
+    return block_;
+  }
+  void EndBlock(const int bx, const int by, const int c) {
+    ac_->SetBlock(bx, by, c, block_);
+  }
+
+ private:
+  SparseAC* ac_;
+  SIMD_ALIGN int16_t block_[64];
+};
+
+class TiledACOutput {
+ public:
+  explicit TiledACOutput(TiledAC* ac) : ac_(ac) {}
+
+  int block_xsize() const { return ac_->block_xsize(); }
+  int block_ysize() const { return ac_->block_ysize(); }
+
+  void BeginRow(const int by) {}
+  int16_t* BeginBlock(const int bx, const int by, const int c) {
+    int16_t* const PIK_RESTRICT block = ac_->Block(bx, by) + c * 64;
+    memset(block + 1, 0, 63 * sizeof(block[0]));
+    return block;
+  }
+  void EndBlock(const int bx, const int by, const int c) {}
+
+ private:
+  TiledAC* ac_;
+};
+
+}  // namespace
+
+// Decodes the AC coefficients of rows [y_begin, y_end) into "output"
+// (DenseACOutput, SparseACOutput or TiledACOutput) and, if non-null,
+// "nonzero_ac".
+template <class Output>
+bool DecodeACRows(BitReader* const PIK_RESTRICT br,
                   const std::vector<uint8_t>& context_map,
+                  const int* const PIK_RESTRICT coeff_order,
+                  const int y_begin, const int y_end,
                   ANSSymbolReader* const PIK_RESTRICT decoder,
-                  Image3W* const PIK_RESTRICT coeffs) {
-  int coeff_order[192];
-  for (int c = 0; c < 3; ++c) {
-    DecodeCoeffOrder(&coeff_order[c * 64], br);
-  }
-  for (int y = 0; y < coeffs->ysize(); ++y) {
-    auto row = coeffs->Row(y);
+                  Output* const PIK_RESTRICT output,
+                  ImageB* const PIK_RESTRICT nonzero_ac) {
+  for (int y = y_begin; y < y_end; ++y) {
+    output->BeginRow(y);
+    uint8_t* const PIK_RESTRICT row_nonzero =
+        nonzero_ac != nullptr ? nonzero_ac->Row(y) : nullptr;
     int prev_num_nzeros[3] = { 0 };
-    for (int x = 0; x < coeffs->xsize(); x += 64) {
+    for (int bx = 0; bx < output->block_xsize(); ++bx) {
+      uint8_t block_nonzero = 0;
       for (int c = 0; c < 3; ++c) {
-        memset(&row[c][x + 1], 0, 63 * sizeof(row[0][0]));
+        int16_t* const PIK_RESTRICT block = output->BeginBlock(bx, y, c);
         br->FillBitBuffer();
         const int context1 = c * 16 + (prev_num_nzeros[c] >> 2);
         int num_nzeros =
@@ -812,7 +1689,11 @@ bool DecodeACData(BitReader* const PIK_RESTRICT br,
           return PIK_FAILURE("Invalid AC data.");
         }
         prev_num_nzeros[c] = num_nzeros;
-        if (num_nzeros == 0) continue;
+        if (num_nzeros == 0) {
+          output->EndBlock(bx, y, c);
+          continue;
+        }
+        block_nonzero |= 1 << c;
         const int histo_offset = 48 + c * 120;
         const int context2 = ZeroDensityContext(num_nzeros - 1, 0, 4);
         int histo_idx = context_map[histo_offset + context2];
@@ -832,21 +1713,41 @@ bool DecodeACData(BitReader* const PIK_RESTRICT br,
             histo_idx = context_map[histo_offset + context];
             --num_nzeros;
           }
-          row[c][x + coeff_order[c * 64 + k]] = s;
+          block[coeff_order[c * 64 + k]] = s;
         }
         if (num_nzeros != 0) {
           return PIK_FAILURE("Invalid AC data.");
         }
+        output->EndBlock(bx, y, c);
       }
+      if (row_nonzero != nullptr) row_nonzero[bx] = block_nonzero;
     }
   }
-  br->JumpToByteBoundary();
   return true;
 }
 
-bool DecodeImage(BitReader* br, int stride,  Image3W* coeffs) {
-  std::vector<uint8_t> context_map;
-  ANSSymbolReader decoder;
+// Reads the three coefficient orders, or sets them to kNaturalCoeffOrder if
+// "natural_order" (not transmitted).
+void DecodeCoeffOrders(const bool natural_order, BitReader* br,
+                       int* coeff_order) {
+  for (int c = 0; c < 3; ++c) {
+    if (natural_order) {
+      memcpy(&coeff_order[c * 64], kNaturalCoeffOrder, 64 * sizeof(int));
+    } else {
+      DecodeCoeffOrder(&coeff_order[c * 64], br);
+    }
+  }
+}
+
+bool DecodeImage(BitReader* br, int stride, Image3W* coeffs,
+                 DecoderTables* tables) {
+  PROFILER_FUNC;
+  DecoderTables local_tables;
+  local_tables.cache_histograms = false;
+  if (tables == nullptr) tables = &local_tables;
+  tables->has_ac_codes = false;
+  std::vector<uint8_t>& context_map = tables->context_map;
+  ANSSymbolReader decoder(tables);
   if (!DecodeHistograms(br, CoeffProcessor::num_contexts(), 16,
                         nullptr, 0, &decoder, &context_map) ||
       !DecodeImageData(br, context_map, stride,
@@ -859,21 +1760,188 @@ bool DecodeImage(BitReader* br, int stride,  Image3W* coeffs) {
   return true;
 }
 
-bool DecodeAC(BitReader* br, Image3W* coeffs) {
-  std::vector<uint8_t> context_map;
-  ANSSymbolReader decoder;
-  if (!DecodeHistograms(br, ACBlockProcessor::num_contexts(), 256,
-                        kSymbolLut, sizeof(kSymbolLut),
-                        &decoder, &context_map) ||
-      !DecodeACData(br, context_map, &decoder, coeffs)) {
+template <class Output>
+bool DecodeACT(BitReader* br, const int num_ans_states,
+               const bool static_codes, const bool natural_order,
+               Output* output, ImageB* nonzero_ac, DecoderTables* tables) {
+  PROFILER_FUNC;
+  DecoderTables local_tables;
+  local_tables.cache_histograms = false;
+  if (tables == nullptr) tables = &local_tables;
+  std::vector<uint8_t>& context_map = tables->context_map;
+  int* const PIK_RESTRICT coeff_order = tables->ac_coeff_order;
+  ANSSymbolReader decoder(tables, num_ans_states);
+  const int static_index = static_codes ? br->ReadBits(8) : 0;
+  if (static_index == kPreviousACCodes || static_index == kUpdatedACCodes) {
+    // Same context map, histograms and coefficient order as the last stream.
+    if (!tables->has_ac_codes) {
+      return PIK_FAILURE("No previous AC codes.");
+    }
+    decoder.UseCurrentHistograms();
+    // Invalid until this stream was decoded, in case some fail to update.
+    tables->has_ac_codes = false;
+    if (static_index == kUpdatedACCodes &&
+        !decoder.UpdateHistograms(256, kSymbolLut, sizeof(kSymbolLut), br)) {
+      return false;
+    }
+  } else {
+    tables->has_ac_codes = false;
+    if (static_index > kNumStaticACCodeSets) {
+      return PIK_FAILURE("Unknown static AC code set.");
+    }
+    if (static_index != 0) {
+      context_map = StaticACContextMap();
+      if (!decoder.SetHistograms(kNumStaticACContexts,
+                                 StaticACCounts(static_index),
+                                 kStaticACAlphabetSize,
+                                 kSymbolLut, sizeof(kSymbolLut))) {
+        return false;
+      }
+    } else if (!DecodeHistograms(br, ACBlockProcessor::num_contexts(), 256,
+                                 kSymbolLut, sizeof(kSymbolLut),
+                                 &decoder, &context_map)) {
+      return false;
+    }
+    DecodeCoeffOrders(natural_order, br, coeff_order);
+  }
+  if (!DecodeACRows(br, context_map, coeff_order, 0, output->block_ysize(),
+                    &decoder, output, nonzero_ac)) {
     return false;
   }
+  br->JumpToByteBoundary();
   if (!decoder.CheckANSFinalState()) {
     return PIK_FAILURE("ANS checksum failure.");
   }
+  tables->has_ac_codes = true;
+  return true;
+}
+
+bool DecodeAC(BitReader* br, const int num_ans_states,
+              const bool static_codes, const bool natural_order,
+              Image3W* coeffs, ImageB* nonzero_ac, DecoderTables* tables) {
+  DenseACOutput output(coeffs);
+  return DecodeACT(br, num_ans_states, static_codes, natural_order, &output,
+                   nonzero_ac, tables);
+}
+
+bool DecodeAC(BitReader* br, const int num_ans_states,
+              const bool static_codes, const bool natural_order, SparseAC* ac,
+              ImageB* nonzero_ac, DecoderTables* tables) {
+  SparseACOutput output(ac);
+  return DecodeACT(br, num_ans_states, static_codes, natural_order, &output,
+                   nonzero_ac, tables);
+}
+
+bool DecodeAC(BitReader* br, const int num_ans_states,
+              const bool static_codes, const bool natural_order, TiledAC* ac,
+              ImageB* nonzero_ac, DecoderTables* tables) {
+  TiledACOutput output(ac);
+  return DecodeACT(br, num_ans_states, static_codes, natural_order, &output,
+                   nonzero_ac, tables);
+}
+
+template <class Output>
+bool DecodeACGroupsT(BitReader* br, const uint8_t* data,
+                     const size_t data_size, const int group_ysize,
+                     const int num_ans_states, const bool natural_order,
+                     const int y_begin,
+                     const int y_end, ThreadPool* pool, const Output& output,
+                     ImageB* nonzero_ac, size_t* compressed_size,
+                     DecoderTables* tables) {
+  PROFILER_FUNC;
+  DecoderTables local_tables;
+  local_tables.cache_histograms = false;
+  if (tables == nullptr) tables = &local_tables;
+  tables->has_ac_codes = false;
+  std::vector<uint8_t>& context_map = tables->context_map;
+  ANSSymbolReader decoder(tables, num_ans_states);
+  if (!DecodeHistograms(br, ACBlockProcessor::num_contexts(), 256,
+                        kSymbolLut, sizeof(kSymbolLut),
+                        &decoder, &context_map)) {
+    return false;
+  }
+  int coeff_order[192];
+  DecodeCoeffOrders(natural_order, br, coeff_order);
+  const int ysize = output.block_ysize();
+  const int num_groups = (ysize + group_ysize - 1) / group_ysize;
+  std::vector<size_t> group_offsets(num_groups + 1);
+  for (int group = 0; group < num_groups; ++group) {
+    size_t group_size = br->ReadBits(16);
+    group_size = (group_size << 16) | br->ReadBits(16);
+    if (group_size == 0 || group_size % 4 != 0) {
+      return PIK_FAILURE("Invalid AC group size.");
+    }
+    group_offsets[group + 1] = group_offsets[group] + group_size;
+  }
+  br->JumpToByteBoundary();
+  const size_t groups_begin = br->Position();
+  if (groups_begin + group_offsets[num_groups] > data_size) {
+    return PIK_FAILURE("Truncated AC groups.");
+  }
+
+  const int first_group = y_begin / group_ysize;
+  const int end_group =
+      std::min(num_groups, (y_end + group_ysize - 1) / group_ysize);
+  std::vector<int> group_ok(num_groups, 1);
+  RunOnPool(pool, first_group, end_group, [&](const int group,
+                                              const int thread) {
+    const size_t group_size = group_offsets[group + 1] - group_offsets[group];
+    BitReader group_br(data + groups_begin + group_offsets[group], group_size);
+    // Shares the decoding tables, but has its own ANS state.
+    ANSSymbolReader group_decoder = decoder;
+    const int group_y_begin = group * group_ysize;
+    const int group_y_end = std::min(group_y_begin + group_ysize, ysize);
+    Output group_output = output;
+    group_ok[group] = DecodeACRows(&group_br, context_map, coeff_order,
+                                   group_y_begin, group_y_end, &group_decoder,
+                                   &group_output, nonzero_ac) &&
+                      group_decoder.CheckANSFinalState();
+  });
+  for (int group = first_group; group < end_group; ++group) {
+    if (!group_ok[group]) {
+      return PIK_FAILURE("AC group decoding failed.");
+    }
+  }
+  *compressed_size = groups_begin + group_offsets[num_groups];
   return true;
 }
 
+bool DecodeACGroups(BitReader* br, const uint8_t* data, const size_t data_size,
+                    const int group_ysize, const int num_ans_states,
+                    const bool natural_order, const int y_begin,
+                    const int y_end, ThreadPool* pool, Image3W* coeffs,
+                    ImageB* nonzero_ac, size_t* compressed_size,
+                    DecoderTables* tables) {
+  return DecodeACGroupsT(br, data, data_size, group_ysize, num_ans_states,
+                         natural_order, y_begin, y_end, pool,
+                         DenseACOutput(coeffs), nonzero_ac, compressed_size,
+                         tables);
+}
+
+bool DecodeACGroups(BitReader* br, const uint8_t* data, const size_t data_size,
+                    const int group_ysize, const int num_ans_states,
+                    const bool natural_order, const int y_begin,
+                    const int y_end, ThreadPool* pool, SparseAC* ac,
+                    ImageB* nonzero_ac, size_t* compressed_size,
+                    DecoderTables* tables) {
+  return DecodeACGroupsT(br, data, data_size, group_ysize, num_ans_states,
+                         natural_order, y_begin, y_end, pool,
+                         SparseACOutput(ac), nonzero_ac, compressed_size,
+                         tables);
+}
+
+bool DecodeACGroups(BitReader* br, const uint8_t* data, const size_t data_size,
+                    const int group_ysize, const int num_ans_states,
+                    const bool natural_order, const int y_begin,
+                    const int y_end, ThreadPool* pool, TiledAC* ac,
+                    ImageB* nonzero_ac, size_t* compressed_size,
+                    DecoderTables* tables) {
+  return DecodeACGroupsT(br, data, data_size, group_ysize, num_ans_states,
+                         natural_order, y_begin, y_end, pool,
+                         TiledACOutput(ac), nonzero_ac, compressed_size,
+                         tables);
+}
+
 class DeltaCodingProcessor {
  public:
   DeltaCodingProcessor(int minval, int maxval, int xsize)
@@ -958,16 +2026,25 @@ size_t EncodedPlaneSize(const Image<int>& img, int minval, int maxval) {
 
 bool DecodePlane(BitReader* br, int minval, int maxval, Image<int>* img) {
   HuffmanDecodingData huff;
-  if (!huff.ReadFromBitStream(br)) {
+  if (!huff.ReadFromBitStream(br, /*multi_symbol=*/true)) {
     return PIK_FAILURE("Failed to decode histogram.");
   }
   HuffmanDecoder decoder;
   DeltaCodingProcessor processor(minval, maxval, img->xsize());
+  // The symbols do not depend on the prediction, so decode each row up front
+  // with several symbols per table lookup.
+  std::vector<int> symbols(img->xsize() + kHuffmanMaxSymbolsPerCode);
   for (int y = 0; y < img->ysize(); ++y) {
+    int num_symbols = 0;
+    while (num_symbols + kHuffmanMaxSymbolsPerCode <= img->xsize()) {
+      num_symbols += decoder.ReadSymbols(huff, br, &symbols[num_symbols]);
+    }
+    for (; num_symbols < img->xsize(); ++num_symbols) {
+      symbols[num_symbols] = decoder.ReadSymbol(huff, br);
+    }
     auto row = img->Row(y);
     for (int x = 0; x < img->xsize(); ++x) {
-      int symbol = decoder.ReadSymbol(huff, br);
-      int diff = SignedIntFromSymbol(symbol);
+      int diff = SignedIntFromSymbol(symbols[x]);
       row[x] = diff + processor.PredictVal(x, y, 0);
       if (row[x] > maxval || row[x] < minval) {
         return PIK_FAILURE("Out of range value in quantization plane.");
@@ -979,4 +2056,333 @@ bool DecodePlane(BitReader* br, int minval, int maxval, Image<int>* img) {
   return true;
 }
 
+namespace {
+
+// Residuals are coded in a context given by the gradient class of their
+// neighborhood and the (clamped) mapped residuals to the left and above; run
+// lengths have their own context.
+const int kNumAlphaGradientClasses = 11;
+const int kNumAlphaResidualClasses = 3;
+const int kAlphaRunContext =
+    kNumAlphaGradientClasses * kNumAlphaResidualClasses;
+const int kNumAlphaContexts = kAlphaRunContext + 1;
+// Values (residuals mapped by SymbolFromSignedInt, and run lengths) below
+// kAlphaDirectValues are coded as symbols, larger ones as tokens (see
+// VisitAlphaValue). Residuals are wrapped to [-2^15, 2^15) for 16-bit
+// samples, hence the mapped residuals and run lengths are below 2^16.
+const int kAlphaDirectBits = 4;
+const int kAlphaDirectValues = 1 << kAlphaDirectBits;
+const int kMaxAlphaAlphabetSize =
+    kAlphaDirectValues + 2 * (15 - kAlphaDirectBits + 1);
+const int kMaxAlphaRun = 0xFFFF;
+
+// Returns the median edge detector prediction of row[x] and sets *gradient to
+// the class of the gradients around it, which is zero iff all neighbors are
+// equal. "prev" is the previous row of the same group, or null in the
+// first row of a group.
+PIK_INLINE int PredictAlpha(const uint16_t* PIK_RESTRICT row,
+                            const uint16_t* PIK_RESTRICT prev, const size_t x,
+                            const size_t xsize, const int activity_shift,
+                            int* PIK_RESTRICT gradient) {
+  int w, n, nw, ne;
+  if (prev == nullptr) {
+    w = n = nw = ne = x == 0 ? 0 : row[x - 1];
+  } else {
+    n = prev[x];
+    w = x == 0 ? n : row[x - 1];
+    nw = x == 0 ? n : prev[x - 1];
+    ne = x + 1 == xsize ? n : prev[x + 1];
+  }
+  const int activity = std::abs(w - nw) + std::abs(n - nw) + std::abs(ne - n);
+  *gradient = activity == 0 ? 0 : std::min(
+      kNumAlphaGradientClasses - 1,
+      Log2Floor(std::max(1, activity >> activity_shift)) + 1);
+  const int lo = std::min(w, n);
+  const int hi = std::max(w, n);
+  if (nw >= hi) return lo;
+  if (nw <= lo) return hi;
+  return w + n - nw;
+}
+
+// Visits "value" as a symbol, or if it is at least kAlphaDirectValues, a token
+// for its highest two bits followed by the remaining bits.
+template <class Visitor>
+PIK_INLINE void VisitAlphaValue(const uint32_t value, const int ctx,
+                                Visitor* visitor) {
+  if (value < kAlphaDirectValues) {
+    visitor->VisitSymbol(value, ctx);
+    return;
+  }
+  const int nbits = Log2FloorNonZero(value);
+  visitor->VisitSymbol(kAlphaDirectValues + 2 * (nbits - kAlphaDirectBits) +
+                           ((value >> (nbits - 1)) & 1),
+                       ctx);
+  visitor->VisitBits(nbits - 1, value & ((1u << (nbits - 1)) - 1));
+}
+
+// Where all neighbors are equal (as in the first row of a group), codes the
+// number of following samples that equal the prediction instead of the
+// samples (as in JPEG-LS). The sample that ends a run (unless the run was
+// capped by kMaxAlphaRun) differs from the prediction and is coded normally.
+template <class Visitor>
+void VisitAlphaRows(const ImageU& plane, const int bit_depth,
+                    const int y_begin, const int y_end, Visitor* visitor) {
+  const size_t xsize = plane.xsize();
+  const int maxval = (1 << bit_depth) - 1;
+  const int activity_shift = std::max(0, bit_depth - 8);
+  // Clamped mapped residuals of the previous and current row (zero for runs).
+  std::vector<uint8_t> above(xsize);
+  std::vector<uint8_t> current(xsize);
+  for (int y = y_begin; y < y_end; ++y) {
+    const uint16_t* PIK_RESTRICT row = plane.Row(y);
+    const uint16_t* PIK_RESTRICT prev =
+        y == y_begin ? nullptr : plane.Row(y - 1);
+    bool interrupted = false;
+    int left_residual = 0;
+    above.swap(current);
+    size_t x = 0;
+    while (x < xsize) {
+      int gradient;
+      const int pred =
+          PredictAlpha(row, prev, x, xsize, activity_shift, &gradient);
+      if (gradient == 0 && !interrupted) {
+        const size_t max_run = std::min<size_t>(xsize - x, kMaxAlphaRun);
+        size_t run = 0;
+        while (run < max_run && row[x + run] == pred) ++run;
+        VisitAlphaValue(run, kAlphaRunContext, visitor);
+        std::fill(current.begin() + x, current.begin() + x + run, 0);
+        x += run;
+        interrupted = run < kMaxAlphaRun;
+        left_residual = 0;
+        continue;
+      }
+      const int ctx =
+          gradient * kNumAlphaResidualClasses +
+          std::min(left_residual + above[x], kNumAlphaResidualClasses - 1);
+      // Modulo 2^bit_depth, so that jumps between the extremes are small.
+      int wrapped = (row[x] - pred) & maxval;
+      if (wrapped > maxval / 2) wrapped -= maxval + 1;
+      const int residual = SymbolFromSignedInt(wrapped);
+      VisitAlphaValue(residual, ctx, visitor);
+      left_residual = std::min(residual, kNumAlphaResidualClasses - 1);
+      current[x] = left_residual;
+      interrupted = false;
+      ++x;
+    }
+  }
+}
+
+// Inverse of VisitAlphaValue.
+PIK_INLINE int ReadAlphaValue(const int histo_idx, BitReader* br,
+                              ANSSymbolReader* decoder) {
+  br->FillBitBuffer();
+  const int symbol = decoder->ReadSymbol(histo_idx, br);
+  if (symbol < kAlphaDirectValues) return symbol;
+  const int token = symbol - kAlphaDirectValues;
+  const int nbits = (token >> 1) + kAlphaDirectBits;
+  const int bits = br->PeekBits(nbits - 1);
+  br->Advance(nbits - 1);
+  return ((2 + (token & 1)) << (nbits - 1)) + bits;
+}
+
+bool DecodeAlphaRows(BitReader* const PIK_RESTRICT br,
+                     const std::vector<uint8_t>& context_map,
+                     const int bit_depth, const int y_begin, const int y_end,
+                     ANSSymbolReader* decoder, ImageU* plane) {
+  const size_t xsize = plane->xsize();
+  const int maxval = (1 << bit_depth) - 1;
+  const int activity_shift = std::max(0, bit_depth - 8);
+  // Clamped mapped residuals of the previous and current row (zero for runs).
+  std::vector<uint8_t> above(xsize);
+  std::vector<uint8_t> current(xsize);
+  for (int y = y_begin; y < y_end; ++y) {
+    uint16_t* PIK_RESTRICT row = plane->Row(y);
+    const uint16_t* PIK_RESTRICT prev =
+        y == y_begin ? nullptr : plane->ConstRow(y - 1);
+    bool interrupted = false;
+    int left_residual = 0;
+    above.swap(current);
+    size_t x = 0;
+    while (x < xsize) {
+      int gradient;
+      const int pred =
+          PredictAlpha(row, prev, x, xsize, activity_shift, &gradient);
+      if (gradient == 0 && !interrupted) {
+        const int run =
+            ReadAlphaValue(context_map[kAlphaRunContext], br, decoder);
+        if (run > std::min<size_t>(xsize - x, kMaxAlphaRun)) {
+          return PIK_FAILURE("Invalid alpha run.");
+        }
+        std::fill(row + x, row + x + run, pred);
+        std::fill(current.begin() + x, current.begin() + x + run, 0);
+        x += run;
+        interrupted = run < kMaxAlphaRun;
+        left_residual = 0;
+        continue;
+      }
+      const int ctx =
+          gradient * kNumAlphaResidualClasses +
+          std::min(left_residual + above[x], kNumAlphaResidualClasses - 1);
+      const int residual = ReadAlphaValue(context_map[ctx], br, decoder);
+      row[x] = (pred + SignedIntFromSymbol(residual)) & maxval;
+      left_residual = std::min(residual, kNumAlphaResidualClasses - 1);
+      current[x] = left_residual;
+      interrupted = false;
+      ++x;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+std::string EncodeAlphaPlane(const ImageU& plane, const int bit_depth,
+                             const int group_ysize, ThreadPool* pool,
+                             PikImageSizeInfo* info) {
+  PROFILER_FUNC;
+  PIK_ASSERT(1 <= bit_depth && bit_depth <= 16);
+  const int num_groups = (plane.ysize() + group_ysize - 1) / group_ysize;
+  // Per-group histograms and output size bounds, from a single pass.
+  struct GroupStats {
+    GroupStats()
+        : histograms(kNumAlphaContexts), counter(kNumInterleavedANSStates) {}
+    void VisitSymbol(int symbol, int ctx) {
+      histograms.VisitSymbol(symbol, ctx);
+      counter.VisitSymbol(symbol, ctx);
+    }
+    void VisitBits(size_t nbits, uint64_t bits) {
+      histograms.VisitBits(nbits, bits);
+      counter.VisitBits(nbits, bits);
+    }
+    HistogramBuilder histograms;
+    ANSMaxBitsCounter counter;
+  };
+  std::vector<GroupStats> group_stats(num_groups);
+  RunOnPool(pool, 0, num_groups, [&](const int group, const int thread) {
+    PROFILER_ZONE("Build histograms");
+    const int y_begin = group * group_ysize;
+    const int y_end = std::min<int>(y_begin + group_ysize, plane.ysize());
+    VisitAlphaRows(plane, bit_depth, y_begin, y_end, &group_stats[group]);
+  });
+  HistogramBuilder builder(kNumAlphaContexts);
+  for (const GroupStats& stats : group_stats) {
+    builder.Assimilate(stats.histograms);
+  }
+
+  // Histogram counts take at most 16 bits each.
+  const size_t max_out_size =
+      2 * kNumAlphaContexts * kMaxAlphaAlphabetSize + 4 * num_groups + 1024;
+  std::string output(max_out_size, 0);
+  size_t storage_ix = 0;
+  uint8_t* storage = reinterpret_cast<uint8_t*>(&output[0]);
+  storage[0] = 0;
+  std::vector<ANSEncodingData> codes;
+  std::vector<uint8_t> context_map;
+  builder.BuildAndStoreEntropyCodes(&codes, &context_map, &storage_ix, storage,
+                                    info, /*fast_clustering=*/true);
+  size_t jump_bits = ((storage_ix + 7) & ~7) - storage_ix;
+  WriteBits(jump_bits, 0, &storage_ix, storage);
+  const size_t histo_bytes = storage_ix >> 3;
+
+  std::vector<std::string> group_codes(num_groups);
+  RunOnPool(pool, 0, num_groups, [&](const int group, const int thread) {
+    PROFILER_ZONE("ANS encode");
+    const int y_begin = group * group_ysize;
+    const int y_end = std::min<int>(y_begin + group_ysize, plane.ysize());
+    std::string& group_code = group_codes[group];
+    group_code.assign(group_stats[group].counter.MaxBytes(), 0);
+    size_t group_ix = 0;
+    uint8_t* group_storage = reinterpret_cast<uint8_t*>(&group_code[0]);
+    ANSSymbolWriter symbol_writer(codes, context_map, &group_ix,
+                                  group_storage, kNumInterleavedANSStates);
+    VisitAlphaRows(plane, bit_depth, y_begin, y_end, &symbol_writer);
+    symbol_writer.FlushToBitStream();
+    PIK_CHECK(group_ix <= 8 * group_code.size());
+    group_code.resize((group_ix + 7) >> 3);
+    group_code = PadTo4Bytes(group_code);
+  });
+
+  size_t groups_size = 0;
+  for (const std::string& group_code : group_codes) {
+    WriteBits(16, group_code.size() >> 16, &storage_ix, storage);
+    WriteBits(16, group_code.size() & 0xffff, &storage_ix, storage);
+    groups_size += group_code.size();
+  }
+  const size_t out_size = (storage_ix + 7) >> 3;
+  PIK_CHECK(out_size <= max_out_size);
+  output.resize(out_size);
+  output = PadTo4Bytes(output);
+  const size_t header_size = output.size();
+  output.reserve(header_size + groups_size);
+  for (const std::string& group_code : group_codes) {
+    output += group_code;
+  }
+  if (info) {
+    info->num_clustered_histograms += codes.size();
+    info->histogram_size += histo_bytes;
+    info->entropy_coded_bits += 8 * (output.size() - histo_bytes) -
+                                builder.num_extra_bits();
+    info->extra_bits += builder.num_extra_bits();
+    info->total_size += output.size();
+  }
+  return output;
+}
+
+bool DecodeAlphaPlane(const uint8_t* data, const size_t data_size,
+                      const int bit_depth, const int group_ysize,
+                      ThreadPool* pool, ImageU* plane,
+                      size_t* compressed_size) {
+  PROFILER_FUNC;
+  if (bit_depth < 1 || bit_depth > 16) {
+    return PIK_FAILURE("Invalid alpha bit depth.");
+  }
+  // The encoder pads the histograms and group sizes to a multiple of 4 bytes.
+  BitReader br(data, data_size & ~size_t(3));
+  DecoderTables tables;
+  tables.cache_histograms = false;
+  std::vector<uint8_t>& context_map = tables.context_map;
+  ANSSymbolReader decoder(&tables, kNumInterleavedANSStates);
+  if (!DecodeHistograms(&br, kNumAlphaContexts, kMaxAlphaAlphabetSize,
+                        nullptr, 0, &decoder, &context_map)) {
+    return false;
+  }
+  const int ysize = plane->ysize();
+  const int num_groups = (ysize + group_ysize - 1) / group_ysize;
+  std::vector<size_t> group_offsets(num_groups + 1);
+  for (int group = 0; group < num_groups; ++group) {
+    size_t group_size = br.ReadBits(16);
+    group_size = (group_size << 16) | br.ReadBits(16);
+    if (group_size == 0 || group_size % 4 != 0) {
+      return PIK_FAILURE("Invalid alpha group size.");
+    }
+    group_offsets[group + 1] = group_offsets[group] + group_size;
+  }
+  br.JumpToByteBoundary();
+  const size_t groups_begin = (br.Position() + 3) & ~size_t(3);
+  if (groups_begin + group_offsets[num_groups] > data_size) {
+    return PIK_FAILURE("Truncated alpha groups.");
+  }
+
+  std::vector<int> group_ok(num_groups, 1);
+  RunOnPool(pool, 0, num_groups, [&](const int group, const int thread) {
+    PROFILER_ZONE("ANS decode");
+    const size_t group_size = group_offsets[group + 1] - group_offsets[group];
+    BitReader group_br(data + groups_begin + group_offsets[group], group_size);
+    // Shares the decoding tables, but has its own ANS state.
+    ANSSymbolReader group_decoder = decoder;
+    const int y_begin = group * group_ysize;
+    const int y_end = std::min(y_begin + group_ysize, ysize);
+    group_ok[group] = DecodeAlphaRows(&group_br, context_map, bit_depth,
+                                      y_begin, y_end, &group_decoder, plane) &&
+                      group_decoder.CheckANSFinalState();
+  });
+  for (int group = 0; group < num_groups; ++group) {
+    if (!group_ok[group]) {
+      return PIK_FAILURE("Alpha group decoding failed.");
+    }
+  }
+  *compressed_size = groups_begin + group_offsets[num_groups];
+  return true;
+}
+
 }  // namespace pik
@@ -28,6 +28,8 @@
 
 #include "ans_encode.h"
 #include "bit_reader.h"
+#include "bits.h"
+#include "cache_aligned.h"
 #include "cluster.h"
 #include "compiler_specific.h"
 #include "context.h"
@@ -37,13 +39,20 @@
 #include "image.h"
 #include "lehmer_code.h"
 #include "pik_info.h"
+#include "profiler.h"
+#include "simd/simd.h"
 #include "status.h"
+#include "thread_pool.h"
 
 namespace pik {
 
 const int kDCAlphabetSize = 16;
 const int kACAlphabetSize = 256;
 
+// Number of interleaved ANS states of the AC stream if Header::kInterleavedANS
+// is set, otherwise 1.
+const int kNumInterleavedANSStates = 4;
+
 const int kNaturalCoeffOrder[80] = {
   0,   1,  8, 16,  9,  2,  3, 10,
   17, 24, 32, 25, 18, 11,  4,  5,
@@ -146,6 +155,42 @@ void VisitACSymbol(int runlen, int nbits, int histo_idx, Visitor* visitor) {
   visitor->VisitSymbol(symbol, histo_idx);
 }
 
+// Returns a mask whose bit i is set iff coeffs[i] != 0, for i in [0, 64).
+// "coeffs" must be SIMD_ALIGN-ed.
+PIK_INLINE uint64_t NonZeroMask(const int16_t* PIK_RESTRICT coeffs) {
+#if SIMD_ENABLE_SSE4
+  using namespace SIMD_NAMESPACE;
+  using V = vec<int16_t>;
+  constexpr size_t N = NumLanes<V>();
+  // movemask yields two identical bits per 16-bit lane; "pairs" holds the
+  // zero flags of 32 coefficients.
+  const V zero = setzero(V());
+  uint64_t mask = 0;
+  for (int half = 0; half < 2; ++half) {
+    uint64_t pairs = 0;
+    for (size_t i = 0; i < 32; i += N) {
+      const V is_zero = load(V(), coeffs + 32 * half + i) == zero;
+      pairs |= uint64_t(ext::movemask(vec<uint8_t>(is_zero))) << (2 * i);
+    }
+    // Keep one bit per pair and compact them into the lower 32 bits.
+    uint64_t bits = pairs & 0x5555555555555555ull;
+    bits = (bits | (bits >> 1)) & 0x3333333333333333ull;
+    bits = (bits | (bits >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+    bits = (bits | (bits >> 4)) & 0x00FF00FF00FF00FFull;
+    bits = (bits | (bits >> 8)) & 0x0000FFFF0000FFFFull;
+    bits = (bits | (bits >> 16)) & 0x00000000FFFFFFFFull;
+    mask |= bits << (32 * half);
+  }
+  return ~mask;
+#else
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; ++i) {
+    mask |= uint64_t(coeffs[i] != 0) << i;
+  }
+  return mask;
+#endif
+}
+
 class ACBlockProcessor {
  public:
   ACBlockProcessor() {
@@ -160,12 +205,19 @@ class ACBlockProcessor {
   int block_size() const { return 64; }
   static int num_contexts() { return 408; }
 
-  void SetCoeffOrder(int order[192]) {
+  void SetCoeffOrder(const int order[192]) {
     memcpy(order_, order, sizeof(order_));
   }
 
+  // If false, ProcessHeader() visits nothing because the decoder assumes
+  // kNaturalCoeffOrder (see Header::kNaturalCoeffOrder).
+  void SetTransmitCoeffOrder(const bool transmit) {
+    transmit_order_ = transmit;
+  }
+
   template <class Visitor>
   void ProcessHeader(Visitor* visitor) {
+    if (!transmit_order_) return;
     const int kJPEGZigZagOrder[64] = {
       0,   1,  5,  6, 14, 15, 27, 28,
       2,   4,  7, 13, 16, 26, 29, 42,
@@ -217,53 +269,61 @@ class ACBlockProcessor {
   template <class Visitor>
   void ProcessBlock(const int16_t* coeffs, int x, int y, int c,
                     Visitor* visitor) {
-    int num_nzeros = 0;
-    for (int k = 1; k < block_size(); ++k) {
-      if (coeffs[k] != 0) ++num_nzeros;
-    }
     if (x == 0) {
       prev_num_nzeros_[c] = 0;
     }
-    int context = c * 16 + (prev_num_nzeros_[c] >> 2);
+    const int context = c * 16 + (prev_num_nzeros_[c] >> 2);
+    // Blocks without AC coefficients (excluding the DC coefficient, which is
+    // not coded here) are frequent and only code their count, so skip the
+    // reordering.
+    if ((NonZeroMask(coeffs) & ~1ull) == 0) {
+      visitor->VisitSymbol(0, context);
+      prev_num_nzeros_[c] = 0;
+      return;
+    }
+    // Gather the block in coding order so that zero runs can be read off a
+    // bit mask instead of testing each coefficient.
+    SIMD_ALIGN int16_t ordered[64];
+    const int* PIK_RESTRICT order = &order_[c * 64];
+    for (int k = 0; k < 64; ++k) {
+      ordered[k] = coeffs[order[k]];
+    }
+    uint64_t nonzero_mask = NonZeroMask(ordered) & ~1ull;
+    int num_nzeros = __builtin_popcountll(nonzero_mask);
     visitor->VisitSymbol(num_nzeros, context);
     prev_num_nzeros_[c] = num_nzeros;
-    if (num_nzeros == 0) return;
-    // Run length of zero coefficients preceding the current non-zero symbol.
-    int r = 0;
     const int histo_offset = 48 + c * 120;
     int histo_idx = histo_offset + ZeroDensityContext(num_nzeros - 1, 0, 4);
-    for (int k = 1; k < block_size(); ++k) {
-      int16_t coeff = coeffs[order_[c * 64 + k]];
-      if (coeff == 0) {
-        r++;
-        continue;
-      }
+    int prev_k = 0;
+    while (nonzero_mask != 0) {
+      const int k = PIK_TZCNT64(nonzero_mask);
+      nonzero_mask &= nonzero_mask - 1;
+      // Run length of zero coefficients preceding the current non-zero symbol.
+      int r = k - prev_k - 1;
+      prev_k = k;
       while (r > 15) {
         VisitACSymbol(15, 0, histo_idx, visitor);
         r -= 16;
       }
       int nbits, bits;
-      EncodeCoeff(coeff, &nbits, &bits);
+      EncodeCoeff(ordered[k], &nbits, &bits);
       VisitACSymbol(r, nbits, histo_idx, visitor);
       visitor->VisitBits(nbits, bits);
-      r = 0;
       histo_idx = histo_offset + ZeroDensityContext(num_nzeros - 1, k, 4);
       --num_nzeros;
     }
-    PIK_CHECK(num_nzeros == 0);
   }
  private:
   int order_[192];
   int prev_num_nzeros_[3];
+  bool transmit_order_ = true;
 };
 
+// Visits the blocks of rows [y_begin, y_end), without the header.
 template <typename T, class Processor, class Visitor>
-void ProcessImage3(const Image3<T>& img,
-                   Processor* processor,
-                   Visitor* visitor) {
-  processor->Reset();
-  processor->ProcessHeader(visitor);
-  for (int y = 0; y < img.ysize(); ++y) {
+void ProcessImage3Rows(const Image3<T>& img, const int y_begin, const int y_end,
+                       Processor* processor, Visitor* visitor) {
+  for (int y = y_begin; y < y_end; ++y) {
     auto row = img.Row(y);
     for (int x = 0; x < img.xsize(); x += processor->block_size()) {
       for (int c = 0; c < 3; ++c) {
@@ -273,6 +333,15 @@ void ProcessImage3(const Image3<T>& img,
   }
 }
 
+template <typename T, class Processor, class Visitor>
+void ProcessImage3(const Image3<T>& img,
+                   Processor* processor,
+                   Visitor* visitor) {
+  processor->Reset();
+  processor->ProcessHeader(visitor);
+  ProcessImage3Rows(img, 0, img.ysize(), processor, visitor);
+}
+
 template <typename T, class Processor, class Visitor>
 void ProcessImage(const Image<T>& img,
                   Processor* processor,
@@ -304,30 +373,55 @@ inline double ShannonEntropy(const uint32_t* data, const size_t data_size) {
 class HistogramBuilder {
  public:
   explicit HistogramBuilder(const size_t num_contexts)
-      : weight_(1), num_extra_bits_(0), histograms_(num_contexts) {
+      : weight_(1), num_extra_bits_(0), histograms_(num_contexts),
+        dirty_(num_contexts, kStaleCodes | kStaleEntropy),
+        histogram_bits_(num_contexts), data_bits_(num_contexts),
+        estimated_bits_(num_contexts) {
   }
 
   void set_weight(int weight) { weight_ = weight; }
 
   void VisitSymbol(int symbol, int histo_idx) {
     histograms_[histo_idx].Add(symbol, weight_);
+    dirty_[histo_idx] = kStaleCodes | kStaleEntropy;
   }
 
   void VisitBits(size_t nbits, uint64_t bits) {
     num_extra_bits_ += weight_ * nbits;
   }
 
+  // Adds the counts of "other", which has the same number of contexts, e.g.
+  // to merge builders that visited disjoint parts of an image.
+  void Assimilate(const HistogramBuilder& other) {
+    PIK_ASSERT(other.histograms_.size() == histograms_.size());
+    for (size_t c = 0; c < histograms_.size(); ++c) {
+      if (other.histograms_[c].total_count_ == 0) continue;
+      histograms_[c].AddHistogram(other.histograms_[c]);
+      dirty_[c] = kStaleCodes | kStaleEntropy;
+    }
+    num_extra_bits_ += other.num_extra_bits_;
+  }
+
   template <class EntropyEncodingData>
   void BuildAndStoreEntropyCodes(std::vector<EntropyEncodingData>* codes,
                                  std::vector<uint8_t>* context_map,
                                  size_t* storage_ix, uint8_t* storage,
-                                 PikImageSizeInfo* info) const {
+                                 PikImageSizeInfo* info,
+                                 bool fast_clustering = false) const {
+    PROFILER_FUNC;
     std::vector<Histogram> clustered_histograms(histograms_);
     context_map->resize(histograms_.size());
     if (histograms_.size() > 1) {
+      PROFILER_ZONE("Cluster histograms");
       std::vector<uint32_t> histogram_symbols;
-      ClusterHistograms(histograms_, histograms_.size(), 1, std::vector<int>(),
-                        64, &clustered_histograms, &histogram_symbols);
+      if (fast_clustering) {
+        FastClusterHistograms(histograms_, 64, &clustered_histograms,
+                              &histogram_symbols);
+      } else {
+        ClusterHistograms(histograms_, histograms_.size(), 1,
+                          std::vector<int>(), 64, &clustered_histograms,
+                          &histogram_symbols);
+      }
       for (int c = 0; c < histograms_.size(); ++c) {
         (*context_map)[c] = static_cast<uint8_t>(histogram_symbols[c]);
       }
@@ -350,10 +444,35 @@ class HistogramBuilder {
     }
   }
 
+  // Only recomputes the cost of histograms that changed since the last call,
+  // hence repeated calls after small (e.g. set_weight(-1/+1)) updates are
+  // cheap. Must not be called concurrently on the same instance.
   size_t EncodedSize(int lg2_histo_align, int lg2_data_align) const;
+
+  // Cheaper approximation of EncodedSize (without alignment) for ranking
+  // candidates: the Shannon entropy of the unclustered histograms plus a
+  // fixed cost per non-empty histogram and used symbol instead of building
+  // the actual codes. Has its own cache with the same update rules.
+  size_t EstimatedSize() const;
+
   size_t num_extra_bits() const { return num_extra_bits_; }
 
+  // Drops the trailing zero counts that set_weight(-1) updates may leave
+  // behind, after which EncodedSize equals that of a builder that never
+  // visited the removed symbols.
+  void TrimZeroCounts() {
+    for (size_t c = 0; c < histograms_.size(); ++c) {
+      if (histograms_[c].TrimZeroCounts()) {
+        dirty_[c] = kStaleCodes | kStaleEntropy;
+      }
+    }
+  }
+
  private:
+  // Flags in dirty_.
+  static constexpr uint8_t kStaleCodes = 1;    // histogram_bits_, data_bits_
+  static constexpr uint8_t kStaleEntropy = 2;  // estimated_bits_
+
   struct Histogram {
     Histogram() {
       data_.reserve(256);
@@ -370,6 +489,12 @@ class HistogramBuilder {
       data_[symbol] += weight;
       total_count_ += weight;
     }
+    // Returns whether there were trailing zero counts.
+    bool TrimZeroCounts() {
+      const size_t size = data_.size();
+      while (!data_.empty() && data_.back() == 0) data_.pop_back();
+      return data_.size() != size;
+    }
     void AddHistogram(const Histogram& other) {
       if (other.data_.size() > data_.size()) {
         data_.resize(other.data_.size());
@@ -389,27 +514,129 @@ class HistogramBuilder {
     double ShannonEntropy() const {
       return pik::ShannonEntropy(data_.data(), data_.size());
     }
+    size_t NumUsedSymbols() const {
+      size_t num_used = 0;
+      for (const uint32_t count : data_) num_used += count != 0;
+      return num_used;
+    }
     std::vector<uint32_t> data_;
     uint32_t total_count_;
   };
   int weight_;
   size_t num_extra_bits_;
   std::vector<Histogram> histograms_;
+  // Per-histogram cost caches for EncodedSize and EstimatedSize.
+  mutable std::vector<uint8_t> dirty_;
+  mutable std::vector<size_t> histogram_bits_;
+  mutable std::vector<size_t> data_bits_;
+  mutable std::vector<double> estimated_bits_;
 };
 
 Image3W PredictDC(const Image3W& coeffs);
-void UnpredictDC(Image3W* coeffs);
+
+// Reconstructs the DC coefficients from the PredictDC residuals, with the
+// expansion distributed over "pool" (may be null). There is one DC
+// coefficient every "stride" (64 or 1) coefficients.
+void UnpredictDC(ThreadPool* pool, int stride, Image3W* coeffs);
 
 std::string EncodeImage(const Image3W& img, int stride,
                         PikImageSizeInfo* info);
 
-std::string EncodeAC(const Image3W& coeffs, PikImageSizeInfo* info);
-std::string EncodeACFast(const Image3W& coeffs, PikImageSizeInfo* info);
+// Stores in "order" (64 positions per channel) the coefficient order of
+// EncodeAC that best suits "coeffs": positions with fewer zeros come first.
+// Requires a pass over all coefficients, hence encoders that code similar
+// coefficients repeatedly should compute it once.
+void ComputeCoeffOrder(const Image3W& coeffs, int* order);
+
+// Entropy codes and coefficient order of an AC stream, which the next AC
+// stream (e.g. of the next animation frame) may reference instead of
+// transmitting its own.
+struct ACCodes {
+  // ANS encoding tables of the histograms selected by "context_map".
+  std::vector<std::vector<ANSEncSymbolInfo>> tables;
+  std::vector<uint8_t> context_map;
+  int order[192];
+};
+
+// Code set index (see EncodeAC) of the codes of the previous AC stream that
+// was decoded with the same DecoderTables.
+static constexpr int kPreviousACCodes = 255;
+// As kPreviousACCodes, but followed by one bit per histogram and the
+// histograms whose bit is set, which replace those of the previous stream.
+static constexpr int kUpdatedACCodes = 254;
+
+// "order" is either from ComputeCoeffOrder and transmitted with the symbols,
+// or null, in which case the coefficients are coded in kNaturalCoeffOrder,
+// which is not transmitted (the decoder is told via "natural_order").
+// "num_ans_states" is 1 or kNumInterleavedANSStates. "fast_clustering"
+// selects FastClusterHistograms instead of ClusterHistograms. If
+// "static_codes", the output starts with the index of a built-in code set
+// (see static_ac_codes.h) that replaces the histograms, or 0 if they are
+// transmitted, or kPreviousACCodes if "previous" is non-null and its codes
+// and order (neither of which is transmitted) are used, or kUpdatedACCodes if
+// only some of its histograms are replaced, whichever is smallest (preferring
+// the previous codes if equal). Unless null, "used" receives the codes of the
+// output, which may be the same object as "previous".
+std::string EncodeAC(const Image3W& coeffs, const int* order,
+                     int num_ans_states, bool fast_clustering,
+                     bool static_codes, const ACCodes* previous,
+                     ACCodes* used, PikImageSizeInfo* info);
+// Always codes the coefficients in kNaturalCoeffOrder, which is transmitted
+// unless "natural_order".
+std::string EncodeACFast(const Image3W& coeffs, bool natural_order,
+                         int num_ans_states, bool static_codes,
+                         PikImageSizeInfo* info);
+
+// Alternative AC layout for parallel decoding: the rows of "coeffs" are split
+// into groups of "group_ysize" block rows, each with its own ANS stream that
+// uses the shared histograms and coefficient order. Returns the histograms,
+// coefficient order and a table of group sizes, which must start at a 4-byte
+// aligned position. The group streams are stored in "group_codes"; each is
+// padded to a multiple of 4 bytes and they must follow the returned string
+// (after padding it to 4 bytes) in order.
+// "order" is as in EncodeAC.
+std::string EncodeACGroups(const Image3W& coeffs, const int* order,
+                           int group_ysize, int num_ans_states,
+                           bool fast_clustering,
+                           ThreadPool* pool, PikImageSizeInfo* info,
+                           std::vector<std::string>* group_codes);
 
 size_t EncodedImageSize(const Image3W& img, int stride);
 
 size_t EncodedACSize(const Image3W& coeffs);
 
+// Same as above, but based on HistogramBuilder::EstimatedSize.
+size_t EstimatedImageSize(const Image3W& img, int stride);
+size_t EstimatedACSize(const Image3W& coeffs);
+
+// Histograms of the DC (PredictDC) and AC sizes above that are kept current
+// while only the AC coefficients of some blocks change: each change is
+// bracketed by UpdateAC(-1) and UpdateAC(+1) with the same "dirty_blocks".
+class CoeffRateTracker {
+ public:
+  explicit CoeffRateTracker(const Image3W& coeffs);
+
+  // Adds "weight" times the AC symbols of the blocks whose entry in
+  // "dirty_blocks" (one per block) is non-zero and of their right neighbors,
+  // whose context depends on them.
+  void UpdateAC(const Image3W& coeffs, const ImageB& dirty_blocks, int weight);
+
+  // Same as EncodedImageSize(PredictDC(coeffs), 1) + EncodedACSize(coeffs)
+  // (or the Estimated* counterparts) of the current coefficients. Only the
+  // changed histograms are re-evaluated.
+  size_t EncodedSize() const {
+    return dc_histo_.EncodedSize(1, 2) + ac_histo_.EncodedSize(1, 2);
+  }
+  size_t EstimatedSize() const {
+    return dc_histo_.EstimatedSize() + ac_histo_.EstimatedSize();
+  }
+
+ private:
+  HistogramBuilder dc_histo_;
+  ACBlockProcessor ac_processor_;
+  HistogramBuilder ac_histo_;
+};
+
 Image3F LocalACInformationDensity(const Image3W& coeffs);
 
 std::string EncodeNonZeroLocations(const std::vector<Image3W>& vals);
@@ -417,9 +644,175 @@ std::string EncodeNonZeroLocations(const std::vector<Image3W>& vals);
 std::string EncodeNonZeroVals(const std::vector<Image3W>& absvals,
                          const std::vector<Image3W>& phases);
 
-bool DecodeImage(BitReader* br, int stride, Image3W* coeffs);
+// Decoding tables built by DecodeImage, DecodeAC and DecodeACGroups. Passing
+// the same instance to subsequent calls reuses their memory; otherwise (null)
+// each call allocates its own.
+struct DecoderTables {
+  struct ANSSymbolInfo {
+    uint16_t offset_;
+    uint16_t freq_;
+  };
+
+  // Tables of a previously built histogram, identified by the decoded counts
+  // and the symbol LUT (whose contents are assumed to be constant).
+  struct CachedHistogram {
+    uint64_t hash;
+    const uint8_t* symbol_lut;
+    size_t symbol_lut_size;
+    std::vector<int> counts;
+    std::vector<uint8_t> map;
+    std::vector<ANSSymbolInfo> info;
+  };
+  // Bounds the cache memory to about 400 KiB.
+  static constexpr size_t kMaxCachedHistograms = 64;
+
+  std::vector<uint8_t> ans_map;
+  std::vector<ANSSymbolInfo> ans_info;
+  std::vector<uint8_t> context_map;
+  // Recently built histograms, replaced in round-robin order. Identical
+  // histograms in later streams, e.g. of the next image decoded with the same
+  // tables, are copied from here instead of being rebuilt. Disabled for
+  // tables that only live for one stream.
+  bool cache_histograms = true;
+  std::vector<CachedHistogram> histogram_cache;
+  size_t next_cached_histogram = 0;
+  // Whether the tables and context map are those of the last DecodeAC, whose
+  // coefficient order is "ac_coeff_order", so that the next DecodeAC may
+  // reference or update them (kPreviousACCodes, kUpdatedACCodes).
+  bool has_ac_codes = false;
+  int ac_coeff_order[192];
+};
+
+// Compact alternative to the AC coefficients of a coefficient image (with 64
+// coefficients per block and channel): stores the mask of the non-zero AC
+// coefficients of each block and channel (bit k for coefficient k) and their
+// values in increasing order of k. At typical distances, most of the 63 AC
+// coefficients are zero, so this needs far less memory and bandwidth.
+class SparseAC {
+ public:
+  SparseAC() {}
+  // All coefficients are initially zero.
+  SparseAC(int block_xsize, int block_ysize);
+
+  int block_xsize() const { return block_xsize_; }
+  int block_ysize() const { return static_cast<int>(rows_.size()); }
 
-bool DecodeAC(BitReader* br,Image3W* coeffs);
+  uint64_t Mask(const int bx, const int by, const int c) const {
+    return rows_[by].masks[3 * bx + c];
+  }
+  // Returns the PopCount(Mask(bx, by, c)) non-zero values.
+  const int16_t* Values(const int bx, const int by, const int c) const {
+    const Row& row = rows_[by];
+    return row.values.data() + row.offsets[3 * bx + c];
+  }
+
+  // Discards the values of block row "by", after which SetBlock must be called
+  // for each of its blocks and channels, in order of bx and c.
+  void ClearRow(int by);
+  // Stores the AC coefficients of the 64 coefficients (SIMD_ALIGN-ed) at
+  // "block"; ignores the DC coefficient block[0].
+  void SetBlock(int bx, int by, int c, const int16_t* block);
+
+ private:
+  struct Row {
+    // Indexed by 3 * bx + c.
+    std::vector<uint64_t> masks;
+    std::vector<uint32_t> offsets;
+    std::vector<int16_t> values;
+  };
+
+  int block_xsize_ = 0;
+  std::vector<Row> rows_;
+};
+
+// Tile-major alternative to the AC coefficients of a coefficient image: the
+// blocks of each tile of kTileBlocks x kTileBlocks blocks are stored
+// contiguously (tiles and their blocks in raster order), and the coefficients
+// of the three channels of a block are adjacent. A coefficient image keeps
+// the channels of a block in three distant planes, so each block touches
+// three separate cache lines and pages; here its six lines are consecutive
+// and the blocks of a tile (the unit of tile-parallel work) share pages.
+class TiledAC {
+ public:
+  // Blocks per tile edge; equals kTileToBlockRatio.
+  static constexpr int kTileBlocks = 8;
+  // Coefficients per block, 64 per channel.
+  static constexpr int kBlockCoeffs = 3 * 64;
+
+  TiledAC() : blocks_(nullptr, CacheAligned::Free) {}
+  // As for a coefficient image, the blocks are uninitialized until decoded.
+  TiledAC(int block_xsize, int block_ysize);
+
+  int block_xsize() const { return block_xsize_; }
+  int block_ysize() const { return block_ysize_; }
+
+  // Returns the kBlockCoeffs coefficients of the block, those of channel c at
+  // [c * 64, c * 64 + 64). The DC coefficients (c * 64) are unused. Aligned
+  // to a cache line.
+  int16_t* Block(const int bx, const int by) {
+    return blocks_.get() + BlockIndex(bx, by) * kBlockCoeffs;
+  }
+  const int16_t* Block(const int bx, const int by) const {
+    return blocks_.get() + BlockIndex(bx, by) * kBlockCoeffs;
+  }
+
+ private:
+  size_t BlockIndex(const int bx, const int by) const {
+    const size_t tile =
+        static_cast<size_t>(by / kTileBlocks) * tile_xsize_ + bx / kTileBlocks;
+    return (tile * kTileBlocks + by % kTileBlocks) * kTileBlocks +
+           bx % kTileBlocks;
+  }
+
+  int block_xsize_ = 0;
+  int block_ysize_ = 0;
+  size_t tile_xsize_ = 0;
+  // Whole tiles, also at the right and bottom borders.
+  CacheAlignedUniquePtrT<int16_t> blocks_;
+};
+
+bool DecodeImage(BitReader* br, int stride, Image3W* coeffs,
+                 DecoderTables* tables = nullptr);
+
+// "static_codes" must match the value passed to EncodeAC, and
+// "natural_order" whether its "order" was null. If "nonzero_ac" (one entry
+// per block) is non-null, sets bit c of each entry iff channel c of the
+// block has non-zero AC coefficients.
+bool DecodeAC(BitReader* br, int num_ans_states, bool static_codes,
+              bool natural_order, Image3W* coeffs, ImageB* nonzero_ac,
+              DecoderTables* tables = nullptr);
+// Same as above, but stores the AC coefficients in "ac" instead of a
+// coefficient image.
+bool DecodeAC(BitReader* br, int num_ans_states, bool static_codes,
+              bool natural_order, SparseAC* ac, ImageB* nonzero_ac,
+              DecoderTables* tables = nullptr);
+bool DecodeAC(BitReader* br, int num_ans_states, bool static_codes,
+              bool natural_order, TiledAC* ac, ImageB* nonzero_ac,
+              DecoderTables* tables = nullptr);
+
+// Decodes the output of EncodeACGroups. "br" reads from "data", which holds
+// "data_size" bytes. "natural_order" and "nonzero_ac" are as in DecodeAC.
+// Only the groups overlapping rows [y_begin, y_end) are decoded, concurrently
+// on "pool" (may be null); the AC coefficients and "nonzero_ac" entries of
+// other rows are left unchanged. Sets *compressed_size to the number of bytes
+// of "data" up to and including the last group.
+bool DecodeACGroups(BitReader* br, const uint8_t* data, size_t data_size,
+                    int group_ysize, int num_ans_states, bool natural_order,
+                    int y_begin, int y_end, ThreadPool* pool, Image3W* coeffs,
+                    ImageB* nonzero_ac, size_t* compressed_size,
+                    DecoderTables* tables = nullptr);
+// Same as above, but stores the AC coefficients in "ac". The rows of other
+// groups remain zero unless they were decoded before.
+bool DecodeACGroups(BitReader* br, const uint8_t* data, size_t data_size,
+                    int group_ysize, int num_ans_states, bool natural_order,
+                    int y_begin, int y_end, ThreadPool* pool, SparseAC* ac,
+                    ImageB* nonzero_ac, size_t* compressed_size,
+                    DecoderTables* tables = nullptr);
+bool DecodeACGroups(BitReader* br, const uint8_t* data, size_t data_size,
+                    int group_ysize, int num_ans_states, bool natural_order,
+                    int y_begin, int y_end, ThreadPool* pool, TiledAC* ac,
+                    ImageB* nonzero_ac, size_t* compressed_size,
+                    DecoderTables* tables = nullptr);
 
 std::string EncodePlane(const Image<int>& img, int minval, int maxval,
                         PikImageSizeInfo* info);
@@ -428,6 +821,24 @@ size_t EncodedPlaneSize(const Image<int>& img, int minval, int maxval);
 
 bool DecodePlane(BitReader* br, int minval, int maxval, Image<int>* img);
 
+// Codes an alpha plane whose samples have "bit_depth" (1 to 16) bits. Each
+// sample is predicted from its causal neighbors with the median edge detector
+// (LOCO-I) and the residual is ANS-coded in a context given by the local
+// gradient; runs of samples in flat areas are coded as their length. Groups
+// of "group_ysize" rows share the histograms but are predicted and coded
+// independently, concurrently on "pool" (may be null).
+std::string EncodeAlphaPlane(const ImageU& plane, int bit_depth,
+                             int group_ysize, ThreadPool* pool,
+                             PikImageSizeInfo* info);
+
+// Decodes the output of EncodeAlphaPlane from "data", which holds "data_size"
+// bytes, into "plane" (already sized to the encoded dimensions). The groups
+// are decoded concurrently on "pool" (may be null). Sets *compressed_size to
+// the number of bytes of "data" up to and including the last group.
+bool DecodeAlphaPlane(const uint8_t* data, size_t data_size, int bit_depth,
+                      int group_ysize, ThreadPool* pool, ImageU* plane,
+                      size_t* compressed_size);
+
 }  // namespace pik
 
 #endif  // OPSIN_CODEC_H_
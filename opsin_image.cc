@@ -16,10 +16,14 @@
 
 #include <stddef.h>
 #include <array>
+#include <utility>
 
 #include "approx_cube_root.h"
 #include "compiler_specific.h"
 #include "gamma_correct.h"
+#include "kernel_targets.h"
+#include "opsin_image_target.h"
+#include "profiler.h"
 
 namespace pik {
 
@@ -46,6 +50,8 @@ void LinearToXyb(const float rgb[3], float* PIK_RESTRICT valx,
   LinearXybTransform(mixed[0], mixed[1], mixed[2], valx, valy, valz);
 }
 
+const KernelTable<OpsinImageFunctionsForTarget> kernels;
+
 }  // namespace
 
 void RgbToXyb(uint8_t r, uint8_t g, uint8_t b, float* PIK_RESTRICT valx,
@@ -56,38 +62,78 @@ void RgbToXyb(uint8_t r, uint8_t g, uint8_t b, float* PIK_RESTRICT valx,
   LinearToXyb(rgb, valx, valy, valz);
 }
 
+void OpsinDynamicsRow(const Image3B& srgb, const size_t iy,
+                      float* const PIK_RESTRICT row_x,
+                      float* const PIK_RESTRICT row_y,
+                      float* const PIK_RESTRICT row_b) {
+  const auto row_in = srgb.ConstRow(iy);
+  kernels().srgb8_to_xyb(row_in[0], row_in[1], row_in[2], srgb.xsize(), row_x,
+                         row_y, row_b);
+}
+
+void OpsinDynamicsRow(const Image3F& linear, const size_t iy,
+                      float* const PIK_RESTRICT row_x,
+                      float* const PIK_RESTRICT row_y,
+                      float* const PIK_RESTRICT row_b) {
+  const auto row_in = linear.ConstRow(iy);
+  kernels().linear_to_xyb(row_in[0], row_in[1], row_in[2], linear.xsize(),
+                          row_x, row_y, row_b);
+}
+
 Image3F OpsinDynamicsImage(const Image3B& srgb) {
+  PROFILER_ZONE("Opsin image");
   // This is different from butteraugli::OpsinDynamicsImage() in the sense that
   // it does not contain a sensitivity multiplier based on the blurred image.
-  const size_t xsize = srgb.xsize();
-  const size_t ysize = srgb.ysize();
-  Image3F opsin(xsize, ysize);
-  for (size_t iy = 0; iy < ysize; iy++) {
-    const auto row_in = srgb.ConstRow(iy);
+  Image3F opsin(srgb.xsize(), srgb.ysize());
+  for (size_t iy = 0; iy < srgb.ysize(); iy++) {
     auto row_out = opsin.Row(iy);
-    for (size_t ix = 0; ix < xsize; ix++) {
-      RgbToXyb(row_in[0][ix], row_in[1][ix], row_in[2][ix], &row_out[0][ix],
-               &row_out[1][ix], &row_out[2][ix]);
+    OpsinDynamicsRow(srgb, iy, row_out[0], row_out[1], row_out[2]);
+  }
+  return opsin;
+}
+
+Image3F OpsinDynamicsGrayImage(const ImageB& gray) {
+  PROFILER_ZONE("Opsin image");
+  // Same scalar computation as OpsinDynamicsRow, whose kernels return the same
+  // values.
+  float table[3][256];
+  for (int v = 0; v < 256; ++v) {
+    RgbToXyb(v, v, v, &table[0][v], &table[1][v], &table[2][v]);
+  }
+  Image3F opsin(gray.xsize(), gray.ysize());
+  for (size_t iy = 0; iy < gray.ysize(); iy++) {
+    const uint8_t* const PIK_RESTRICT row_in = gray.ConstRow(iy);
+    auto row_out = opsin.Row(iy);
+    for (int c = 0; c < 3; ++c) {
+      float* const PIK_RESTRICT row = row_out[c];
+      for (size_t ix = 0; ix < gray.xsize(); ix++) {
+        row[ix] = table[c][row_in[ix]];
+      }
     }
   }
   return opsin;
 }
 
 Image3F OpsinDynamicsImage(const Image3F& linear) {
+  PROFILER_ZONE("Opsin image");
   // This is different from butteraugli::OpsinDynamicsImage() in the sense that
   // it does not contain a sensitivity multiplier based on the blurred image.
-  const size_t xsize = linear.xsize();
-  const size_t ysize = linear.ysize();
-  Image3F opsin(xsize, ysize);
-  for (size_t iy = 0; iy < ysize; iy++) {
-    const auto row_in = linear.ConstRow(iy);
+  Image3F opsin(linear.xsize(), linear.ysize());
+  for (size_t iy = 0; iy < linear.ysize(); iy++) {
     auto row_out = opsin.Row(iy);
-    for (size_t ix = 0; ix < xsize; ix++) {
-      const float rgb[3] = {row_in[0][ix], row_in[1][ix], row_in[2][ix]};
-      LinearToXyb(rgb, &row_out[0][ix], &row_out[1][ix], &row_out[2][ix]);
-    }
+    OpsinDynamicsRow(linear, iy, row_out[0], row_out[1], row_out[2]);
   }
   return opsin;
 }
 
+Image3F OpsinDynamicsImage(Image3F&& linear) {
+  PROFILER_ZONE("Opsin image");
+  for (size_t iy = 0; iy < linear.ysize(); iy++) {
+    const auto row = linear.Row(iy);
+    kernels().linear_to_xyb(row[0], row[1], row[2], linear.xsize(), row[0],
+                            row[1], row[2]);
+  }
+  return std::move(linear);
+}
+
 }  // namespace pik
@@ -36,6 +36,24 @@ PIK_INLINE void OpsinAbsorbance(const float in[3], float out[3]) {
 Image3F OpsinDynamicsImage(const Image3B& srgb);
 
 Image3F OpsinDynamicsImage(const Image3F& linear);
+// Same as above, but converts "linear" in place and returns its planes.
+Image3F OpsinDynamicsImage(Image3F&& linear);
+
+// Ratio of X to Y for gray pixels, for which B equals Y: the rows of
+// kOpsinAbsorbanceMatrix sum to 1 / kScale, hence all mixed channels are
+// equal (up to rounding).
+static constexpr float kOpsinGrayX = (kScaleR - kScaleG) * 0.5f;
+
+// Same as OpsinDynamicsImage of an sRGB image whose three planes equal "gray",
+// but with one table lookup per pixel and channel.
+Image3F OpsinDynamicsGrayImage(const ImageB& gray);
+
+// Same as row "y" of the above, written to the "xsize" floats at each of
+// "row_x", "row_y" and "row_b". Allows converting large images in stripes.
+void OpsinDynamicsRow(const Image3B& srgb, size_t y, float* row_x,
+                      float* row_y, float* row_b);
+void OpsinDynamicsRow(const Image3F& linear, size_t y, float* row_x,
+                      float* row_y, float* row_b);
 
 void RgbToXyb(uint8_t r, uint8_t g, uint8_t b, float *valx, float *valy,
               float *valz);
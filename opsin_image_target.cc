@@ -0,0 +1,160 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiled once per instruction set; see opsin_image_target_<target>.cc.
+
+#include "opsin_image_target.h"
+
+#include "approx_cube_root.h"
+#include "compiler_specific.h"
+#include "gamma_correct.h"
+#include "opsin_params.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// The functions below perform the same operations in the same order as the
+// scalar LinearToXyb (OpsinAbsorbance, ApproxCubeRoot and LinearXybTransform),
+// hence all targets and the scalar code produce exactly the same values.
+
+#if SIMD_ENABLE_SSE4
+// Same as pik::CubeRootInitialGuess, including the truncating signed division.
+PIK_INLINE vec<float> CubeRootInitialGuess(const vec<float> y) {
+  using VI = vec<int32_t>;
+  using VU = vec<uint32_t>;
+  using VU64 = vec<uint64_t>;
+  const VI ix = bits_from_float(y);
+  // |ix| / 3 via a 32x32 -> 64 bit multiplication by ceil(2^33 / 3).
+  const VI sign = ix >> 31;
+  const VU abs_ix = VU((ix ^ sign) - sign);
+  const VU kMul = set1(VU(), 0xAAAAAAABu);
+  const VU64 q_even = mul_even(abs_ix, kMul) >> 33;
+  const VU64 q_odd = mul_even(VU(VU64(abs_ix) >> 32), kMul) >> 33;
+  const VI q = VI(q_even | (q_odd << 32));
+  return float_from_bits(set1(VI(), 0x2a50f200) + ((q ^ sign) - sign));
+}
+#endif
+
+PIK_INLINE vec1<float> CubeRootInitialGuess(const vec1<float> y) {
+  return vec1<float>(pik::CubeRootInitialGuess(y));
+}
+
+template <class V>
+PIK_INLINE V CubeRootNewtonStep(const V y, const V xn) {
+  const V kOneThird = set1(V(), 1.0f / 3.0f);
+  const V kTwo = set1(V(), 2.0f);
+  return kOneThird * (kTwo * xn + y / (xn * xn));
+}
+
+template <class V>
+PIK_INLINE V SimpleGamma(const V v) {
+  const V x0 = CubeRootInitialGuess(v);
+  const V x1 = CubeRootNewtonStep(v, x0);
+  return CubeRootNewtonStep(v, x1);
+}
+
+template <class V>
+PIK_INLINE V MixRow(const float* mix, const V r, const V g, const V b) {
+  return set1(V(), mix[0]) * r + set1(V(), mix[1]) * g + set1(V(), mix[2]) * b;
+}
+
+// Converts NumLanes<V>() pixels.
+template <class V>
+PIK_INLINE void LinearToXyb(const V r, const V g, const V b,
+                            V* PIK_RESTRICT valx, V* PIK_RESTRICT valy,
+                            V* PIK_RESTRICT valz) {
+  const float* mix = &kOpsinAbsorbanceMatrix[0];
+  const V gamma_r = SimpleGamma(MixRow(mix + 0, r, g, b));
+  const V gamma_g = SimpleGamma(MixRow(mix + 3, r, g, b));
+  const V scaled_r = set1(V(), kScaleR) * gamma_r;
+  const V scaled_g = set1(V(), kScaleG) * gamma_g;
+  const V half = set1(V(), 0.5f);
+  *valx = (scaled_r - scaled_g) * half;
+  *valy = (scaled_r + scaled_g) * half;
+  *valz = SimpleGamma(MixRow(mix + 6, r, g, b));
+}
+
+// Converts NumLanes<V>() pixels and stores them at "x" of each row.
+template <class V>
+PIK_INLINE void LinearToXybStore(const V r, const V g, const V b,
+                                 const size_t x, float* row_x, float* row_y,
+                                 float* row_xyb_b) {
+  V valx, valy, valz;
+  LinearToXyb(r, g, b, &valx, &valy, &valz);
+  store_unaligned(valx, row_x + x);
+  store_unaligned(valy, row_y + x);
+  store_unaligned(valz, row_xyb_b + x);
+}
+
+void LinearRowToXyb(const float* row_r, const float* row_g, const float* row_b,
+                    const size_t xsize, float* row_x, float* row_y,
+                    float* row_xyb_b) {
+  using V = vec<float>;
+  constexpr size_t N = NumLanes<V>();
+  size_t x = 0;
+  for (; x + N <= xsize; x += N) {
+    LinearToXybStore(load_unaligned(V(), row_r + x),
+                     load_unaligned(V(), row_g + x),
+                     load_unaligned(V(), row_b + x), x, row_x, row_y,
+                     row_xyb_b);
+  }
+  using V1 = vec1<float>;
+  for (; x < xsize; ++x) {
+    LinearToXybStore(load(V1(), row_r + x), load(V1(), row_g + x),
+                     load(V1(), row_b + x), x, row_x, row_y, row_xyb_b);
+  }
+}
+
+void Srgb8RowToXyb(const uint8_t* PIK_RESTRICT row_r,
+                   const uint8_t* PIK_RESTRICT row_g,
+                   const uint8_t* PIK_RESTRICT row_b, const size_t xsize,
+                   float* PIK_RESTRICT row_x, float* PIK_RESTRICT row_y,
+                   float* PIK_RESTRICT row_xyb_b) {
+  const float* lut = Srgb8ToLinearTable();
+  using V = vec<float>;
+  constexpr size_t N = NumLanes<V>();
+  size_t x = 0;
+  SIMD_ALIGN float linear[3][N];
+  for (; x + N <= xsize; x += N) {
+    for (size_t i = 0; i < N; ++i) {
+      linear[0][i] = lut[row_r[x + i]];
+      linear[1][i] = lut[row_g[x + i]];
+      linear[2][i] = lut[row_b[x + i]];
+    }
+    LinearToXybStore(load(V(), linear[0]), load(V(), linear[1]),
+                     load(V(), linear[2]), x, row_x, row_y, row_xyb_b);
+  }
+  using V1 = vec1<float>;
+  for (; x < xsize; ++x) {
+    LinearToXybStore(set1(V1(), lut[row_r[x]]), set1(V1(), lut[row_g[x]]),
+                     set1(V1(), lut[row_b[x]]), x, row_x, row_y, row_xyb_b);
+  }
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+// Instantiate for the current target.
+template <>
+OpsinImageFunctions OpsinImageFunctionsForTarget::operator()<SIMD_TARGET>()
+    const {
+  OpsinImageFunctions functions;
+  functions.linear_to_xyb = &SIMD_NAMESPACE::LinearRowToXyb;
+  functions.srgb8_to_xyb = &SIMD_NAMESPACE::Srgb8RowToXyb;
+  return functions;
+}
+
+}  // namespace pik
@@ -0,0 +1,49 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef OPSIN_IMAGE_TARGET_H_
+#define OPSIN_IMAGE_TARGET_H_
+
+// Per-instruction-set implementations of the row conversions behind
+// OpsinDynamicsRow and OpsinDynamicsImage. Only opsin_image.cc should include
+// this.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace pik {
+
+// Both convert "xsize" pixels, whose channels are in separate rows, to XYB
+// with exactly the same values as RgbToXyb.
+struct OpsinImageFunctions {
+  // The outputs may equal the inputs (in-place conversion).
+  void (*linear_to_xyb)(const float* row_r, const float* row_g,
+                        const float* row_b, size_t xsize, float* row_x,
+                        float* row_y, float* row_xyb_b);
+  void (*srgb8_to_xyb)(const uint8_t* row_r, const uint8_t* row_g,
+                       const uint8_t* row_b, size_t xsize, float* row_x,
+                       float* row_y, float* row_xyb_b);
+};
+
+// Call via KernelTable<OpsinImageFunctionsForTarget>. operator()<SIMD_TARGET>
+// is specialized in opsin_image_target.cc, which is compiled once per
+// instruction set (opsin_image_target_<target>.cc).
+struct OpsinImageFunctionsForTarget {
+  template <class Target>
+  OpsinImageFunctions operator()() const;
+};
+
+}  // namespace pik
+
+#endif  // OPSIN_IMAGE_TARGET_H_
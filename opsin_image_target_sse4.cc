@@ -0,0 +1,2 @@
+#define SIMD_ENABLE 4  // SSE4
+#include "opsin_image_target.cc"
@@ -85,6 +85,14 @@ PIK_INLINE void XybToRgb(const V x, const V y, const V b,
   *blue = Clamp0To255(MixedToBlue(r_mix, g_mix, b_mix));
 }
 
+// Same as XybToRgb for a gray pixel (R = G = B, see OpsinDynamicsGrayImage),
+// whose X and B are determined by "y"; returns the gray value.
+template <typename V>
+PIK_INLINE V YToGray(const V y) {
+  // The rows of kOpsinAbsorbanceInverseMatrix sum to kScale.
+  return Clamp0To255(SimpleGammaInverse(y) * set1(V(), kScale));
+}
+
 Image3B OpsinDynamicsInverse(const Image3F& opsin);
 Image3F LinearFromOpsin(const Image3F& opsin);
 
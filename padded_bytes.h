@@ -56,6 +56,33 @@ class PaddedBytes {
   CacheAlignedUniquePtr data_;
 };
 
+// Read-only view of "size" bytes at "data" (not owned), e.g. a memory-mapped
+// file. Unlike PaddedBytes, there is no padding after the valid bytes.
+class ByteSpan {
+ public:
+  ByteSpan(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+  // Implicit so that PaddedBytes can be passed to functions taking a ByteSpan.
+  ByteSpan(const PaddedBytes& bytes)  // NOLINT
+      : data_(bytes.data()), size_(bytes.size()) {}
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
+// Receives the output of an encoder in consecutive chunks as soon as each is
+// ready, e.g. to send the first bytes before the rest is encoded.
+class ByteSink {
+ public:
+  virtual ~ByteSink() {}
+
+  // Returns false on errors (e.g. I/O), which cause the encoder to fail.
+  virtual bool Write(const uint8_t* data, size_t size) = 0;
+};
+
 }  // namespace pik
 
 #endif  // PADDED_BYTES_H_
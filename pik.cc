@@ -20,23 +20,34 @@
 #include <string.h>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <limits>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "adaptive_quantization.h"
 #include "arch_specific.h"
 #include "bit_buffer.h"
 #include "bits.h"
+#include "butteraugli/butteraugli.h"
 #include "byte_order.h"
 #include "butteraugli_comparator.h"
 #include "compiler_specific.h"
 #include "compressed_image.h"
+#include "gamma_correct.h"
 #include "header.h"
 #include "image_io.h"
+#include "lossless.h"
 #include "opsin_image.h"
 #include "pik_alpha.h"
+#include "profiler.h"
 #include "quantizer.h"
+#include "simd/dispatch.h"
+#include "thread_pool.h"
 
 // If true, prints the quantization maps at each iteration.
 bool FLAGS_dump_quant_state = false;
@@ -96,6 +107,30 @@ ImageF TileDistMap(const butteraugli::ImageF& distmap, int tile_size) {
   return tile_distmap;
 }
 
+// Returns per-block factors that map the BlockDistanceProxy() "proxy" of an
+// image to its "tile_distmap". The proxy is floored at a fraction of its mean
+// so that nearly lossless (e.g. flat) blocks do not get huge factors.
+ImageF ProxyCalibration(const ImageF& tile_distmap, const ImageF& proxy) {
+  double sum = 0.0;
+  for (int y = 0; y < proxy.ysize(); ++y) {
+    for (int x = 0; x < proxy.xsize(); ++x) {
+      sum += proxy.Row(y)[x];
+    }
+  }
+  const float floor =
+      std::max(1E-6, 0.1 * sum / (proxy.xsize() * proxy.ysize()));
+  ImageF calibration(proxy.xsize(), proxy.ysize());
+  for (int y = 0; y < proxy.ysize(); ++y) {
+    const float* const PIK_RESTRICT row_dist = tile_distmap.Row(y);
+    const float* const PIK_RESTRICT row_proxy = proxy.Row(y);
+    float* const PIK_RESTRICT row_out = calibration.Row(y);
+    for (int x = 0; x < proxy.xsize(); ++x) {
+      row_out[x] = row_dist[x] / std::max(floor, row_proxy[x]);
+    }
+  }
+  return calibration;
+}
+
 ImageF DistToPeakMap(const ImageF& field, float peak_min,
                      int local_radius, float peak_weight) {
   ImageF result(field.xsize(), field.ysize(), -1.0f);
@@ -138,6 +173,95 @@ bool AdjustQuantVal(float* const PIK_RESTRICT q,
   return true;
 }
 
+// Wall-clock limit of the quantization searches of one encode, see
+// CompressParams::deadline_seconds, and their cancellation via
+// CompressParams::progress.
+class Deadline {
+ public:
+  explicit Deadline(const CompressParams& params)
+      : enabled_(params.deadline_seconds > 0.0),
+        end_(std::chrono::steady_clock::now() +
+             std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                 std::chrono::duration<double>(params.deadline_seconds))),
+        progress_(params.progress) {}
+
+  // Reports "fraction_done" to the progress callback, if any, and returns
+  // whether the encode is (or was already) cancelled.
+  bool Cancelled(const float fraction_done) const {
+    if (!cancelled_ && progress_ && !progress_(fraction_done)) {
+      cancelled_ = true;
+    }
+    return cancelled_;
+  }
+
+  // Returns whether the search should stop because the encode is cancelled
+  // (see Cancelled) or the deadline has passed, in which case it also sets
+  // aux_out->deadline_reached.
+  bool Reached(const float fraction_done, PikInfo* aux_out) const {
+    if (Cancelled(fraction_done)) return true;
+    if (!enabled_ || std::chrono::steady_clock::now() < end_) return false;
+    if (aux_out != nullptr) aux_out->deadline_reached = true;
+    return true;
+  }
+
+  // Whether a previous Cancelled or Reached returned true due to cancellation.
+  bool cancelled() const { return cancelled_; }
+
+ private:
+  const bool enabled_;
+  const std::chrono::steady_clock::time_point end_;
+  const ProgressCallback& progress_;
+  // Set once; the searches only see const references.
+  mutable bool cancelled_ = false;
+};
+
+// Outer iterations of FindBestQuantization: each starts from the previous
+// result scaled by kQuantScale and adjusts it with a slower kAdjSpeed.
+static const int kMaxOuterIters = 3;
+static const float kAdjSpeed[kMaxOuterIters] = { 0.1, 0.05, 0.025 };
+static const float kQuantScale[kMaxOuterIters] = { 0.0, 0.8, 0.9 };
+
+// One adjustment step of FindBestQuantization: increases the quantization
+// around the peaks of "tile_distmap" if "distance" exceeds the target, and
+// raises "quant_max" until that changes something. Returns whether
+// "quant_field" changed.
+bool AdjustQuantField(const ImageF& tile_distmap, const float distance,
+                      const float butteraugli_target, const float adj_speed,
+                      float* quant_max, ImageF* quant_field) {
+  PROFILER_FUNC;
+  bool changed = false;
+  while (!changed && distance > butteraugli_target) {
+    for (int radius = 1; radius <= 4 && !changed; ++radius) {
+      ImageF dist_to_peak_map = DistToPeakMap(
+          tile_distmap, butteraugli_target, radius, 0.65);
+      for (int y = 0; y < quant_field->ysize(); ++y) {
+        float* const PIK_RESTRICT row_q = quant_field->Row(y);
+        const float* const PIK_RESTRICT row_dist = dist_to_peak_map.Row(y);
+        for (int x = 0; x < quant_field->xsize(); ++x) {
+          if (row_dist[x] >= 0.0f) {
+            const float factor = adj_speed * tile_distmap.Row(y)[x];
+            if (AdjustQuantVal(&row_q[x], row_dist[x], factor, *quant_max)) {
+              changed = true;
+            }
+          }
+        }
+      }
+    }
+    if (*quant_max >= 8.0f) break;
+    if (!changed) *quant_max += 0.5f;
+  }
+  return changed;
+}
+
+void ScaleQuantField(const float scale, ImageF* quant_field) {
+  for (int y = 0; y < quant_field->ysize(); ++y) {
+    float* const PIK_RESTRICT row = quant_field->Row(y);
+    for (int x = 0; x < quant_field->xsize(); ++x) {
+      row[x] *= scale;
+    }
+  }
+}
+
 void DumpHeatmap(const PikInfo* info, const std::string& label,
                  const std::vector<float>& vals, size_t xsize, size_t ysize,
                  float good_threshold, float bad_threshold) {
@@ -148,7 +272,9 @@ void DumpHeatmap(const PikInfo* info, const std::string& label,
   snprintf(pathname, sizeof(pathname), "%s%s%05d.png",
            info->debug_prefix.c_str(), label.c_str(),
            info->num_butteraugli_iters);
-  WriteImage(ImageFormatPNG(),
+  ImageFormatPNG format;
+  format.fast_write = true;
+  WriteImage(format,
              Image3FromInterleaved(&heatmap[0], xsize, ysize, 3 * xsize),
              pathname);
 }
@@ -183,24 +309,255 @@ void DumpHeatmaps(const PikInfo* info,
               ba_target, 1.5f * ba_target);
 }
 
+// Remembers the quantization field of the previous butteraugli evaluation to
+// determine which blocks changed since then.
+class QuantChangeTracker {
+ public:
+  QuantChangeTracker(int block_xsize, int block_ysize)
+      : dirty_blocks_(block_xsize, block_ysize) {}
+
+  // Marks the blocks whose quantization differs from the previous call in
+  // dirty_blocks(). Returns false if that is unknown or affects all blocks
+  // (first call, global scale or DC quantization changed).
+  bool Update(const Quantizer& quantizer) {
+    const Image<int>& quant_ac = quantizer.quant_img_ac();
+    const bool all_changed = !has_prev_ ||
+                             quantizer.global_scale() != prev_global_scale_ ||
+                             quantizer.quant_dc() != prev_quant_dc_;
+    if (!all_changed) {
+      for (int y = 0; y < quant_ac.ysize(); ++y) {
+        const int* const PIK_RESTRICT row = quant_ac.Row(y);
+        const int* const PIK_RESTRICT row_prev = prev_quant_ac_.Row(y);
+        uint8_t* const PIK_RESTRICT row_dirty = dirty_blocks_.Row(y);
+        for (int x = 0; x < quant_ac.xsize(); ++x) {
+          row_dirty[x] = row[x] != row_prev[x];
+        }
+      }
+    }
+    has_prev_ = true;
+    prev_global_scale_ = quantizer.global_scale();
+    prev_quant_dc_ = quantizer.quant_dc();
+    prev_quant_ac_ = CopyImage(quant_ac);
+    return !all_changed;
+  }
+
+  const ImageB& dirty_blocks() const { return dirty_blocks_; }
+
+ private:
+  ImageB dirty_blocks_;
+  bool has_prev_ = false;
+  int prev_global_scale_ = 0;
+  int prev_quant_dc_ = 0;
+  Image<int> prev_quant_ac_;
+};
+
+// FindBestQuantization for params.speculative_candidates = K > 1. Each round
+// derives up to K candidate fields from the last distance map by applying
+// one to K adjustment steps (i.e. the fields that K sequential iterations
+// would reach if the distance map did not change) and compares them in
+// parallel on copies of "img". The round continues from the first candidate
+// within the target (the least quantized) or else the one with the largest
+// distance reduction per (estimated) byte. A round counts as one of
+// max_butteraugli_iters. The first round starts from "initial_quant_field"
+// unless it is null, as in FindBestQuantization. Ignores the other search
+// options of "params".
+void FindBestQuantizationSpeculative(ButteraugliComparator* original,
+                                     float butteraugli_target,
+                                     const CompressParams& params,
+                                     const Deadline& deadline,
+                                     CompressedImage* img, PikInfo* aux_out,
+                                     const ImageF* initial_quant_field) {
+  PROFILER_FUNC;
+  const int max_candidates = params.speculative_candidates;
+  AdaptiveQuantParams quant_params = img->adaptive_quant_params();
+  const float kInitialQuantDC =
+      quant_params.initial_quant_val_dc / butteraugli_target;
+  const float kInitialQuantAC =
+      quant_params.initial_quant_val_ac / butteraugli_target;
+  ImageF quant_field =
+      initial_quant_field != nullptr
+          ? CopyImage(*initial_quant_field)
+          : ImageF(img->block_xsize(), img->block_ysize(), kInitialQuantAC);
+  float quant_max = 4.0f;
+  int outer_iter = 0;
+
+  // Each candidate has its own image and comparator so that they can be
+  // evaluated concurrently, each on a single thread.
+  ThreadPool* pool = img->pool();
+  std::vector<CompressedImage> images;
+  std::vector<ButteraugliComparator> comparators;
+  for (int i = 0; i < max_candidates; ++i) {
+    images.push_back(img->CloneForSearch(nullptr));
+    comparators.emplace_back(*original, nullptr);
+  }
+  std::vector<ImageF> fields(max_candidates);
+  std::vector<float> quant_maxes(max_candidates);
+  std::vector<ImageF> tile_distmaps(max_candidates);
+  std::vector<float> distances(max_candidates);
+  std::vector<size_t> sizes(max_candidates);
+  // Reconstruction of each candidate image, updated incrementally (see
+  // CompressedImage::UpdateSRGB).
+  std::vector<Image3B> srgbs(max_candidates);
+  std::vector<QuantChangeTracker> change_trackers;
+  for (int i = 0; i < max_candidates; ++i) {
+    change_trackers.emplace_back(img->block_xsize(), img->block_ysize());
+  }
+
+  // The initial field is the only candidate of the first round.
+  fields[0] = CopyImage(quant_field);
+  quant_maxes[0] = quant_max;
+  int num_candidates = 1;
+  ImageF tile_distmap;
+  float distance = 0.0f;
+  size_t size = 0;
+  for (int round = 0;; ++round) {
+    RunOnPool(pool, 0, num_candidates, [&](const int i, const int thread) {
+      PROFILER_ZONE("FBQ candidate");
+      images[i].quantizer().SetQuantField(kInitialQuantDC, fields[i]);
+      images[i].QuantizeDirty();
+      if (change_trackers[i].Update(images[i].quantizer())) {
+        images[i].UpdateSRGB(change_trackers[i].dirty_blocks(), &srgbs[i]);
+      } else {
+        srgbs[i] = images[i].ToSRGB();
+      }
+      comparators[i].Compare(srgbs[i]);
+      tile_distmaps[i] = TileDistMap(comparators[i].distmap(), kBlockEdge);
+      distances[i] = comparators[i].distance();
+      sizes[i] = images[i].EstimateEncodedSize();
+    });
+    int best = -1;
+    for (int i = 0; i < num_candidates; ++i) {
+      if (distances[i] <= butteraugli_target) {
+        best = i;
+        break;
+      }
+    }
+    if (best < 0) {
+      // Further steps based on the same distance map tend to overshoot, hence
+      // prefer the largest distance reduction per additional byte.
+      double best_gain = 0.0;
+      for (int i = 0; i < num_candidates; ++i) {
+        const double added_bytes = std::max(
+            1.0, static_cast<double>(sizes[i]) - static_cast<double>(size));
+        const double gain = (distance - distances[i]) / added_bytes;
+        if (best < 0 || gain > best_gain) {
+          best_gain = gain;
+          best = i;
+        }
+      }
+    }
+    size = sizes[best];
+    quant_field = std::move(fields[best]);
+    quant_max = quant_maxes[best];
+    tile_distmap = std::move(tile_distmaps[best]);
+    distance = distances[best];
+    if (aux_out) {
+      DumpHeatmaps(aux_out, img->xsize(), img->ysize(), kBlockEdge,
+                   butteraugli_target, quant_field, tile_distmap);
+      ++aux_out->num_butteraugli_iters;
+      aux_out->num_speculative_candidates += num_candidates;
+    }
+    if (FLAGS_dump_quant_state) {
+      printf("\nSpeculative round %d: %d candidates, chose %d\n", round,
+             num_candidates, best);
+      printf("Butteraugli distance: %f\n", distance);
+    }
+    if (round + 1 >= params.max_butteraugli_iters ||
+        deadline.Reached(static_cast<float>(round + 1) /
+                             params.max_butteraugli_iters,
+                         aux_out)) {
+      break;
+    }
+
+    // Candidates for the next round.
+    ImageF field = CopyImage(quant_field);
+    num_candidates = 0;
+    while (num_candidates < max_candidates &&
+           AdjustQuantField(tile_distmap, distance, butteraugli_target,
+                            kAdjSpeed[outer_iter], &quant_max, &field)) {
+      fields[num_candidates] = CopyImage(field);
+      quant_maxes[num_candidates] = quant_max;
+      ++num_candidates;
+    }
+    if (num_candidates == 0) {
+      if (++outer_iter == kMaxOuterIters) break;
+      ScaleQuantField(kQuantScale[outer_iter], &field);
+      fields[0] = std::move(field);
+      quant_maxes[0] = quant_max;
+      num_candidates = 1;
+    }
+  }
+  img->quantizer().SetQuantField(kInitialQuantDC, quant_field);
+  img->QuantizeDirty();
+}
+
+// If params.incremental_butteraugli is true, iterations after the first only
+// re-quantize, re-decode and re-compare the blocks whose quantization changed,
+// see ButteraugliComparator::CompareIncremental. If params.coarse_butteraugli is
+// true, iterations use ButteraugliComparator::CompareCoarse until its distance
+// is within kCoarseBand times the target. If params.linear_butteraugli is
+// true, the linear RGB reconstruction is compared instead of the sRGB one.
+//
+// If params.proxy_butteraugli is true, up to kMaxProxyIters iterations between
+// two butteraugli comparisons only evaluate ButteraugliComparator::
+// BlockDistanceProxy, calibrated per block by the previous comparison. A
+// comparison always confirms that the search converged, hence
+// max_butteraugli_iters still bounds the number of comparisons.
+//
+// If params.speculative_candidates > 1, uses FindBestQuantizationSpeculative
+// instead. If "initial_quant_field" is non-null, the search starts from it
+// instead of a uniform field. Once "deadline" is reached, the search stops as
+// if max_butteraugli_iters were reached, i.e. after the next adjustment.
+//
+// "original" is a comparator constructed from the original opsin image, which
+// "img" need not retain.
 template <class CompressedImageT>
-void FindBestQuantization(const Image3F& opsin_orig,
+void FindBestQuantization(ButteraugliComparator* original,
                           float butteraugli_target,
-                          int max_butteraugli_iters,
+                          const CompressParams& params,
+                          const Deadline& deadline,
                           CompressedImageT* img,
-                          PikInfo* aux_out) {
-  ButteraugliComparator comparator(opsin_orig);
+                          PikInfo* aux_out,
+                          const ImageF* initial_quant_field = nullptr) {
+  PROFILER_FUNC;
+  if (params.speculative_candidates > 1) {
+    FindBestQuantizationSpeculative(original, butteraugli_target, params,
+                                    deadline, img, aux_out,
+                                    initial_quant_field);
+    return;
+  }
+  static const float kCoarseBand = 1.5f;
+  ButteraugliComparator& comparator = *original;
   AdaptiveQuantParams quant_params = img->adaptive_quant_params();
   const float kInitialQuantDC =
       quant_params.initial_quant_val_dc / butteraugli_target;
   const float kInitialQuantAC =
       quant_params.initial_quant_val_ac / butteraugli_target;
-  ImageF quant_field(img->block_xsize(), img->block_ysize(), kInitialQuantAC);
+  ImageF quant_field =
+      initial_quant_field != nullptr
+          ? CopyImage(*initial_quant_field)
+          : ImageF(img->block_xsize(), img->block_ysize(), kInitialQuantAC);
   ImageF tile_distmap;
-  static const int kMaxOuterIters = 3;
+  const int max_butteraugli_iters = params.max_butteraugli_iters;
+  const bool linear = params.linear_butteraugli;
+  const bool incremental = params.incremental_butteraugli && !linear;
+  bool coarse = params.coarse_butteraugli;
+  const bool proxy = params.proxy_butteraugli;
+  static const int kMaxProxyIters = 2;
   int outer_iter = 0;
   int butteraugli_iter = 0;
   float quant_max = 4.0f;
+  QuantChangeTracker change_tracker(img->block_xsize(), img->block_ysize());
+  Image3B srgb;
+  Image3F linear_rgb;
+  float distance = 0.0f;
+  // Valid after the first comparison if "proxy".
+  ImageF proxy_calibration;
+  int proxy_iters = 0;
+  // Whether the last evaluation used the proxy, and whether the next one must
+  // be a comparison even if the quantization did not change.
+  bool used_proxy = false;
+  bool confirm = false;
   for (;;) {
     if (FLAGS_dump_quant_state) {
       printf("\nQuantization field:\n");
@@ -212,69 +569,145 @@ void FindBestQuantization(const Image3F& opsin_orig,
       }
       printf("max_butteraugli_iters = %d\n", max_butteraugli_iters);
     }
-    if (img->quantizer().SetQuantField(kInitialQuantDC, quant_field)) {
-      img->Quantize();
-      if (butteraugli_iter >= max_butteraugli_iters) {
+    if (img->quantizer().SetQuantField(kInitialQuantDC, quant_field) ||
+        confirm) {
+      // Settled regions cost nothing: only the blocks whose quantization
+      // changed since the last Quantize*() are re-quantized (and, if
+      // "incremental", re-decoded and re-compared).
+      {
+        PROFILER_ZONE("FBQ quantize");
+        img->QuantizeDirty();
+      }
+      if (butteraugli_iter >= max_butteraugli_iters ||
+          deadline.Reached(
+              static_cast<float>(butteraugli_iter) / max_butteraugli_iters,
+              aux_out)) {
         break;
       }
-      Image3B srgb = img->ToSRGB();
-      comparator.Compare(srgb);
-      tile_distmap = TileDistMap(comparator.distmap(), kBlockEdge);
-      ++butteraugli_iter;
-      if (aux_out) {
-        DumpHeatmaps(aux_out, opsin_orig.xsize(), opsin_orig.ysize(),
-                     kBlockEdge, butteraugli_target, quant_field, tile_distmap);
-        if (!aux_out->debug_prefix.empty()) {
-          char pathname[200];
-          snprintf(pathname, 200, "%s%s%05d.png", aux_out->debug_prefix.c_str(),
-                   "rgb_out", aux_out->num_butteraugli_iters);
-          WriteImage(ImageFormatPNG(), srgb, pathname);
+      used_proxy = proxy && butteraugli_iter != 0 && !confirm &&
+                   proxy_iters < kMaxProxyIters;
+      confirm = false;
+      if (used_proxy) {
+        PROFILER_ZONE("FBQ proxy");
+        tile_distmap =
+            comparator.BlockDistanceProxy(img->ToLinear(), kBlockEdge);
+        distance = 0.0f;
+        for (int y = 0; y < tile_distmap.ysize(); ++y) {
+          float* const PIK_RESTRICT row = tile_distmap.Row(y);
+          const float* const PIK_RESTRICT row_calibration =
+              proxy_calibration.Row(y);
+          for (int x = 0; x < tile_distmap.xsize(); ++x) {
+            row[x] *= row_calibration[x];
+            distance = std::max(distance, row[x]);
+          }
+        }
+        ++proxy_iters;
+        if (aux_out) ++aux_out->num_proxy_iters;
+        if (FLAGS_dump_quant_state) {
+          printf("\nProxy distance: %f\n", distance);
         }
-        ++aux_out->num_butteraugli_iters;
-      }
-      if (FLAGS_dump_quant_state) {
-        printf("\nButteraugli iter: %d\n", butteraugli_iter);
-        printf("Butteraugli distance: %f\n", comparator.distance());
-        printf("quant_max: %f\n", quant_max);
-        img->quantizer().DumpQuantizationMap();
-      }
-    }
-    bool changed = false;
-    while (!changed && comparator.distance() > butteraugli_target) {
-      for (int radius = 1; radius <= 4 && !changed; ++radius) {
-        ImageF dist_to_peak_map = DistToPeakMap(
-            tile_distmap, butteraugli_target, radius, 0.65);
-        for (int y = 0; y < img->block_ysize(); ++y) {
-          float* const PIK_RESTRICT row_q = quant_field.Row(y);
-          const float* const PIK_RESTRICT row_dist = dist_to_peak_map.Row(y);
-          for (int x = 0; x < img->block_xsize(); ++x) {
-            if (row_dist[x] >= 0.0f) {
-              static const float kAdjSpeed[kMaxOuterIters] =
-                  { 0.1, 0.05, 0.025 };
-              const float factor =
-                  kAdjSpeed[outer_iter] * tile_distmap.Row(y)[x];
-              if (AdjustQuantVal(&row_q[x], row_dist[x], factor, quant_max)) {
-                changed = true;
+      } else {
+        // "srgb" persists across iterations; only the blocks whose
+        // quantization changed since the last comparison are re-decoded.
+        const bool update = !linear && change_tracker.Update(img->quantizer());
+        {
+          PROFILER_ZONE("FBQ reconstruct");
+          if (linear) {
+            linear_rgb = img->ToLinear();
+          } else if (update) {
+            img->UpdateSRGB(change_tracker.dirty_blocks(), &srgb);
+          } else {
+            srgb = img->ToSRGB();
+          }
+        }
+        {
+          PROFILER_ZONE("FBQ compare");
+          if (coarse) {
+            if (linear) {
+              comparator.CompareCoarseLinear(linear_rgb);
+            } else {
+              comparator.CompareCoarse(srgb);
+            }
+            if (comparator.distance() <= kCoarseBand * butteraugli_target) {
+              // Close enough for the full resolution to matter; also provides
+              // the baseline for subsequent incremental comparisons.
+              coarse = false;
+              if (linear) {
+                comparator.CompareLinear(linear_rgb);
+              } else {
+                comparator.Compare(srgb);
               }
             }
+          } else if (linear) {
+            comparator.CompareLinear(linear_rgb);
+          } else if (incremental && update) {
+            comparator.CompareIncremental(srgb, change_tracker.dirty_blocks(),
+                                          kBlockEdge);
+          } else {
+            comparator.Compare(srgb);
+          }
+          tile_distmap = TileDistMap(comparator.distmap(), kBlockEdge);
+          distance = comparator.distance();
+        }
+        if (proxy) {
+          PROFILER_ZONE("FBQ calibrate proxy");
+          if (!linear) linear_rgb = img->ToLinear();
+          proxy_calibration = ProxyCalibration(
+              tile_distmap,
+              comparator.BlockDistanceProxy(linear_rgb, kBlockEdge));
+          proxy_iters = 0;
+        }
+        ++butteraugli_iter;
+        if (aux_out) {
+          DumpHeatmaps(aux_out, img->xsize(), img->ysize(),
+                       kBlockEdge, butteraugli_target, quant_field,
+                       tile_distmap);
+          if (!aux_out->debug_prefix.empty()) {
+            char pathname[200];
+            snprintf(pathname, 200, "%s%s%05d.png",
+                     aux_out->debug_prefix.c_str(), "rgb_out",
+                     aux_out->num_butteraugli_iters);
+            if (linear) srgb = img->ToSRGB();
+            ImageFormatPNG format;
+            format.fast_write = true;
+            WriteImage(format, srgb, pathname);
           }
+          ++aux_out->num_butteraugli_iters;
+        }
+        if (FLAGS_dump_quant_state) {
+          printf("\nButteraugli iter: %d\n", butteraugli_iter);
+          printf("Butteraugli distance: %f\n", distance);
+          printf("quant_max: %f\n", quant_max);
+          img->quantizer().DumpQuantizationMap();
         }
       }
-      if (quant_max >= 8.0f) break;
-      if (!changed) quant_max += 0.5f;
     }
+    const bool changed =
+        AdjustQuantField(tile_distmap, distance, butteraugli_target,
+                         kAdjSpeed[outer_iter], &quant_max, &quant_field);
     if (!changed) {
-      if (++outer_iter == kMaxOuterIters) break;
-      static const float kQuantScale[kMaxOuterIters] = { 0.0, 0.8, 0.9 };
-      for (int y = 0; y < img->block_ysize(); ++y) {
-        for (int x = 0; x < img->block_xsize(); ++x) {
-          quant_field.Row(y)[x] *= kQuantScale[outer_iter];
-        }
+      if (used_proxy) {
+        // Only a comparison can tell whether the search converged.
+        confirm = true;
+        continue;
       }
+      if (++outer_iter == kMaxOuterIters) break;
+      ScaleQuantField(kQuantScale[outer_iter], &quant_field);
     }
   }
 }
 
+// Returns the size (or its estimate, see SetFastSizeEstimates) that the
+// YToB search minimizes.
+size_t DCAndACSize(const CompressedImage& img,
+                   const HistogramBuilder& dc_histo,
+                   const HistogramBuilder& ac_histo) {
+  if (img.fast_size_estimates()) {
+    return dc_histo.EstimatedSize() + ac_histo.EstimatedSize();
+  }
+  return dc_histo.EncodedSize(1, 2) + ac_histo.EncodedSize(1, 2);
+}
+
 struct EvalGlobalYToB {
   void SetVal(int ytob) const {
     img->SetYToBDC(ytob);
@@ -293,7 +726,7 @@ struct EvalGlobalYToB {
     HistogramBuilder ac_histo(ac_processor.num_contexts());
     ProcessImage3(PredictDC(img->coeffs()), &dc_processor, &dc_histo);
     ProcessImage3(img->coeffs(), &ac_processor, &ac_histo);
-    return dc_histo.EncodedSize(1, 2) + ac_histo.EncodedSize(1, 2);
+    return DCAndACSize(*img, dc_histo, ac_histo);
   }
   CompressedImage* img;
 };
@@ -302,9 +735,8 @@ struct EvalLocalYToB {
   explicit EvalLocalYToB(CompressedImage* image) :
       img(image), dc_processor(1),
       dc_histo(dc_processor.num_contexts()),
-      ac_histo(ac_processor.num_contexts()),
-      dc_residuals(PredictDC(img->coeffs())) {
-    ProcessImage3(dc_residuals, &dc_processor, &dc_histo);
+      ac_histo(ac_processor.num_contexts()) {
+    ProcessImage3(PredictDC(img->coeffs()), &dc_processor, &dc_histo);
     ProcessImage3(img->coeffs(), &ac_processor, &ac_histo);
   }
   void SetTile(int tx, int ty) {
@@ -340,14 +772,13 @@ struct EvalLocalYToB {
   }
   size_t operator()(int ytob) {
     SetVal(ytob);
-    return dc_histo.EncodedSize(1, 2) + ac_histo.EncodedSize(1, 2);
+    return DCAndACSize(*img, dc_histo, ac_histo);
   }
   CompressedImage* img;
   CoeffProcessor dc_processor;
   ACBlockProcessor ac_processor;
   HistogramBuilder dc_histo;
   HistogramBuilder ac_histo;
-  Image3W dc_residuals;
   int tilex;
   int tiley;
 };
@@ -372,42 +803,368 @@ int Optimize(Eval* eval, int minval, int maxval,
   return best_val;
 }
 
-void FindBestYToBCorrelation(CompressedImage* img) {
+void QuantizeTile(const int tilex, const int tiley, CompressedImage* img) {
+  const int factor = kTileToBlockRatio;
+  for (int iy = 0; iy < factor; ++iy) {
+    for (int ix = 0; ix < factor; ++ix) {
+      int block_y = factor * tiley + iy;
+      int block_x = factor * tilex + ix;
+      if (block_x >= img->block_xsize() || block_y >= img->block_ysize()) {
+        continue;
+      }
+      img->QuantizeBlock(block_x, block_y);
+    }
+  }
+}
+
+// Optimizes the ytob value of each tile independently, against the
+// histograms of the image with "global_ytob" in all other tiles, so that the
+// tiles can be processed in parallel on img->pool(). The result does not
+// depend on the number of threads. Returns the chosen values in raster order.
+std::vector<int> FindBestLocalYToBParallel(const int global_ytob,
+                                           CompressedImage* img) {
+  EvalLocalYToB snapshot(img);
+  // Also fills the cost caches which the copies below inherit.
+  const size_t snapshot_size =
+      DCAndACSize(*img, snapshot.dc_histo, snapshot.ac_histo);
+  ThreadPool* pool = img->pool();
+  const int num_threads = pool == nullptr ? 1 : pool->NumThreads();
+  std::vector<EvalLocalYToB> evals(num_threads, snapshot);
+  const int tile_xsize = img->tile_xsize();
+  const int num_tiles = tile_xsize * img->tile_ysize();
+  std::vector<int> best_ytob(num_tiles);
+  RunOnPool(pool, 0, num_tiles, [&](const int task, const int thread) {
+    const int tilex = task % tile_xsize;
+    const int tiley = task / tile_xsize;
+    EvalLocalYToB* eval = &evals[thread];
+    eval->SetTile(tilex, tiley);
+    size_t best_size = snapshot_size;
+    best_ytob[task] = Optimize(eval, 0, 255, global_ytob, &best_size);
+    // Restore the snapshot histograms for the next tile of this thread, then
+    // requantize with the chosen value without updating them.
+    eval->SetVal(global_ytob);
+    img->SetYToBAC(tilex, tiley, best_ytob[task]);
+    QuantizeTile(tilex, tiley, img);
+  });
+  return best_ytob;
+}
+
+// If "parallel", the tiles are first optimized independently and then, if
+// "refine", once more serially in a small range around the parallel result.
+void FindBestYToBCorrelation(const bool parallel, const bool refine,
+                             CompressedImage* img) {
+  PROFILER_FUNC;
+  // Gray images have no B coefficients to predict.
+  if (img->grayscale()) return;
   static const int kStartYToB = 120;
   EvalGlobalYToB eval_global{img};
   size_t best_size = eval_global(kStartYToB);
   int global_ytob = Optimize(&eval_global, 0, 255, kStartYToB, &best_size);
-  EvalLocalYToB eval_local(img);
-  for (int tiley = 0; tiley < img->tile_ysize(); ++tiley) {
-    for (int tilex = 0; tilex < img->tile_xsize(); ++tilex) {
-      eval_local.SetTile(tilex, tiley);
-      Optimize(&eval_local, 0, 255, global_ytob, &best_size);
+  if (!parallel) {
+    EvalLocalYToB eval_local(img);
+    for (int tiley = 0; tiley < img->tile_ysize(); ++tiley) {
+      for (int tilex = 0; tilex < img->tile_xsize(); ++tilex) {
+        eval_local.SetTile(tilex, tiley);
+        Optimize(&eval_local, 0, 255, global_ytob, &best_size);
+      }
+    }
+    return;
+  }
+  const std::vector<int> tile_ytob =
+      FindBestLocalYToBParallel(global_ytob, img);
+  if (refine) {
+    // Serial refinement close to the parallel result, now taking the choices
+    // of the other tiles into account.
+    static const int kRefineRadius = 3;
+    EvalLocalYToB eval_local(img);
+    best_size = DCAndACSize(*img, eval_local.dc_histo, eval_local.ac_histo);
+    for (int tiley = 0; tiley < img->tile_ysize(); ++tiley) {
+      for (int tilex = 0; tilex < img->tile_xsize(); ++tilex) {
+        const int ytob = tile_ytob[tiley * img->tile_xsize() + tilex];
+        eval_local.SetTile(tilex, tiley);
+        Optimize(&eval_local, std::max(0, ytob - kRefineRadius),
+                 std::min(255, ytob + kRefineRadius), ytob, &best_size);
+      }
     }
   }
 }
 
-std::string CompressToButteraugliDistance(const Image3F& opsin_orig,
-                                          const CompressParams& params,
-                                          PikInfo* info) {
-  CompressedImage img = CompressedImage::FromOpsinImage(opsin_orig, info);
+// Returns the 2x2 averages of "opsin" (the last row/column is duplicated if
+// the size is odd).
+Image3F DownsampleOpsin(const Image3F& opsin) {
+  const size_t xsize = (opsin.xsize() + 1) / 2;
+  const size_t ysize = (opsin.ysize() + 1) / 2;
+  Image3F downsampled(xsize, ysize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      const float* const PIK_RESTRICT row0 = opsin.PlaneRow(c, 2 * y);
+      const float* const PIK_RESTRICT row1 =
+          opsin.PlaneRow(c, std::min(2 * y + 1, opsin.ysize() - 1));
+      float* const PIK_RESTRICT row_out = downsampled.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        const size_t x1 = std::min(2 * x + 1, opsin.xsize() - 1);
+        row_out[x] =
+            0.25f * (row0[2 * x] + row0[x1] + row1[2 * x] + row1[x1]);
+      }
+    }
+  }
+  return downsampled;
+}
+
+// Runs FindBestQuantization on "downsampled" (see DownsampleOpsin) and
+// returns the resulting quantization field, nearest-neighbor upsampled to the
+// blocks of "img", as the initial field of the full resolution search. Takes
+// over the planes of "downsampled".
+ImageF CoarseQuantField(Image3F&& downsampled, const float butteraugli_target,
+                        const CompressParams& params, const Deadline& deadline,
+                        ThreadPool* pool, const CompressedImage& img) {
+  PROFILER_FUNC;
+  ButteraugliComparator comparator(downsampled, pool);
+  CompressedImage coarse =
+      CompressedImage::FromOpsinImage(std::move(downsampled), pool, nullptr);
+  coarse.SetGrayscale(img.grayscale());
+  coarse.quantizer().SetQuant(1.0);
+  coarse.Quantize();
+  FindBestYToBCorrelation(params.parallel_ytob, params.ytob_refinement,
+                          &coarse);
+  FindBestQuantization(&comparator, butteraugli_target, params, deadline,
+                       &coarse, nullptr);
+  float quant_dc;
+  ImageF coarse_field;
+  coarse.quantizer().GetQuantField(&quant_dc, &coarse_field);
+  // The coarse field is slightly finer than the full resolution requires;
+  // starting below it lets the refinement grow the field as usual, which
+  // results in smaller files.
+  const float kScale = 0.85f;
+  ImageF quant_field(img.block_xsize(), img.block_ysize());
+  for (int y = 0; y < quant_field.ysize(); ++y) {
+    const float* const PIK_RESTRICT row_in =
+        coarse_field.Row(std::min<int>(y / 2, coarse_field.ysize() - 1));
+    float* const PIK_RESTRICT row_out = quant_field.Row(y);
+    for (int x = 0; x < quant_field.xsize(); ++x) {
+      row_out[x] =
+          kScale * row_in[std::min<int>(x / 2, coarse_field.xsize() - 1)];
+    }
+  }
+  return quant_field;
+}
+
+// Inputs of the initial quantization field of the butteraugli search that
+// are computed from the original opsin image, i.e. before FromOpsinImage
+// converts it in place.
+struct QuantSearchStart {
+  // Sufficient if params.initial_quant_field is non-null.
+  QuantSearchStart() {}
+  QuantSearchStart(const Image3F& opsin, const CompressParams& params) {
+    if (params.initial_quant_field != nullptr) return;
+    if (params.multires_butteraugli) {
+      downsampled = DownsampleOpsin(opsin);
+    } else if (params.adaptive_initial_quant) {
+      adaptive_map = AdaptiveQuantizationMap(opsin.plane(1), kBlockEdge);
+    }
+  }
+
+  // Returns an independent copy for another search of the same image; the
+  // inputs do not depend on the distance.
+  QuantSearchStart Copy() const {
+    QuantSearchStart copy;
+    if (downsampled.xsize() != 0) copy.downsampled = CopyImage3(downsampled);
+    if (adaptive_map.xsize() != 0) copy.adaptive_map = CopyImage(adaptive_map);
+    return copy;
+  }
+
+  // Result of DownsampleOpsin if params.multires_butteraugli.
+  Image3F downsampled;
+  // Result of AdaptiveQuantizationMap if params.adaptive_initial_quant.
+  ImageF adaptive_map;
+};
+
+// Whether params.initial_quant_field, if any, has one value per block of an
+// image of the given size.
+bool CheckInitialQuantField(const CompressParams& params, const size_t xsize,
+                            const size_t ysize) {
+  const ImageF* field = params.initial_quant_field;
+  if (field == nullptr) return true;
+  if (field->xsize() != (xsize + kBlockEdge - 1) / kBlockEdge ||
+      field->ysize() != (ysize + kBlockEdge - 1) / kBlockEdge) {
+    return PIK_FAILURE("initial_quant_field size mismatch");
+  }
+  return true;
+}
+
+// FindBestQuantization, starting from (in order of precedence)
+// params.initial_quant_field, CoarseQuantField if params.multires_butteraugli
+// or the adaptive quantization map if params.adaptive_initial_quant, each
+// scaled to "butteraugli_target". Also stores the resulting field, scaled to
+// distance 1, in aux_out->quant_field.
+void FindBestQuantization(ButteraugliComparator* original,
+                          QuantSearchStart&& start, float butteraugli_target,
+                          const CompressParams& params,
+                          const Deadline& deadline, ThreadPool* pool,
+                          CompressedImage* img, PikInfo* aux_out) {
+  ImageF initial_quant_field;
+  if (params.initial_quant_field != nullptr) {
+    // As with the uniform field, the quantization is inversely proportional
+    // to the target distance. The size was verified by the caller of the
+    // encoder (see CheckInitialQuantField).
+    initial_quant_field =
+        ScaleImage(1.0f / butteraugli_target, *params.initial_quant_field);
+  } else if (params.multires_butteraugli) {
+    initial_quant_field =
+        CoarseQuantField(std::move(start.downsampled), butteraugli_target,
+                         params, deadline, pool, *img);
+  } else if (params.adaptive_initial_quant) {
+    const float scale =
+        img->adaptive_quant_params().initial_quant_val_ac / butteraugli_target;
+    initial_quant_field = ScaleImage(scale, start.adaptive_map);
+  }
+  FindBestQuantization(
+      original, butteraugli_target, params, deadline, img, aux_out,
+      initial_quant_field.xsize() != 0 ? &initial_quant_field : nullptr);
+  if (aux_out != nullptr) {
+    float quant_dc;
+    ImageF quant_field;
+    img->quantizer().GetQuantField(&quant_dc, &quant_field);
+    aux_out->quant_field = ScaleImage(butteraugli_target, quant_field);
+  }
+}
+
+// Whether OpsinToPik uses CompressFast, which always writes a single AC
+// stream.
+bool UsesFastMode(const CompressParams& params) {
+  return params.butteraugli_distance < 0.0 && params.target_bitrate <= 0.0 &&
+         params.uniform_quant <= 0.0 && params.fast_mode;
+}
+
+// Images with at most this many blocks (64x64 pixels) use
+// Header::kNaturalCoeffOrder: the transmitted order is then a noticeable part
+// of the output, and its gain depends on the content (it is usually smaller
+// for photos than for graphics).
+static const size_t kMaxBlocksForNaturalCoeffOrder = 64;
+
+// Whether an image encoded with "params" codes AC in kNaturalCoeffOrder
+// (Header::kNaturalCoeffOrder); CompressFast always does.
+bool UsesNaturalCoeffOrder(const CompressParams& params, const size_t xsize,
+                           const size_t ysize) {
+  const size_t num_blocks = ((xsize + kBlockEdge - 1) / kBlockEdge) *
+                            ((ysize + kBlockEdge - 1) / kBlockEdge);
+  return UsesFastMode(params) || num_blocks <= kMaxBlocksForNaturalCoeffOrder;
+}
+
+// Returns the image whose quantization the butteraugli searches adjust, with
+// the settings of "params" and the Y-to-blue correlation, which does not
+// depend on the quantization. Takes over the planes of "opsin".
+CompressedImage ImageForSearch(Image3F&& opsin, const CompressParams& params,
+                               ThreadPool* pool, PikInfo* info) {
+  CompressedImage img =
+      CompressedImage::FromOpsinImage(std::move(opsin), pool, info);
+  img.SetACGroups(params.ac_groups);
+  img.SetInterleavedANS(params.interleaved_ans);
+  img.SetStaticACCodes(params.static_ac_codes);
+  img.SetGrayscale(params.grayscale);
+  img.SetNaturalCoeffOrder(
+      UsesNaturalCoeffOrder(params, img.xsize(), img.ysize()));
+  img.SetFastClustering(params.fast_clustering);
+  img.SetFastSizeEstimates(params.fast_size_estimates);
   img.quantizer().SetQuant(1.0);
   img.Quantize();
-  FindBestYToBCorrelation(&img);
-  FindBestQuantization(opsin_orig, params.butteraugli_distance,
-                       params.max_butteraugli_iters, &img, info);
-  return img.Encode();
+  FindBestYToBCorrelation(params.parallel_ytob, params.ytob_refinement, &img);
+  return img;
+}
+
+// Returns the image quantized for params.butteraugli_distance. Takes over the
+// planes of "opsin_orig". Sets *cancelled if params.progress cancelled the
+// search, in which case the image must not be used.
+CompressedImage SearchButteraugliDistance(Image3F&& opsin_orig,
+                                          const CompressParams& params,
+                                          ThreadPool* pool, PikInfo* info,
+                                          bool* cancelled) {
+  const Deadline deadline(params);
+  AllocationTracker search_tracker(info ? &info->search_memory : nullptr);
+  StageTimer search_timer(info ? &info->search_time : nullptr);
+  // Before FromOpsinImage, which converts the image in place.
+  ButteraugliComparator comparator(opsin_orig, pool);
+  QuantSearchStart start(opsin_orig, params);
+  CompressedImage img =
+      ImageForSearch(std::move(opsin_orig), params, pool, info);
+  FindBestQuantization(&comparator, std::move(start),
+                       params.butteraugli_distance, params, deadline, pool,
+                       &img, info);
+  *cancelled = deadline.cancelled();
+  return img;
 }
 
-std::string CompressFast(const Image3F& opsin_orig,
-                         const CompressParams& params,
-                         PikInfo* info) {
+// Appends the encoding to "compressed" and stores the sizes of its parts in
+// "part_sizes". Takes over the planes of "opsin_orig".
+bool CompressToButteraugliDistance(Image3F&& opsin_orig,
+                                   const CompressParams& params,
+                                   ThreadPool* pool, PikInfo* info,
+                                   PaddedBytes* compressed,
+                                   EncodedPartSizes* part_sizes) {
+  bool cancelled;
+  CompressedImage img = SearchButteraugliDistance(std::move(opsin_orig),
+                                                  params, pool, info,
+                                                  &cancelled);
+  if (cancelled) return PIK_FAILURE("Cancelled");
+  AllocationTracker encode_tracker(info ? &info->encode_memory : nullptr);
+  StageTimer encode_timer(info ? &info->encode_time : nullptr);
+  img.Encode(compressed);
+  *part_sizes = img.encoded_part_sizes();
+  return true;
+}
+
+// Appends the encoding of "img" to "compressed" and stores the sizes of its
+// parts in "part_sizes". If "sink" is non-null, it instead receives
+// "compressed" and then the parts of the encoding as soon as each is ready,
+// and "compressed" is cleared.
+bool EncodeTo(const CompressedImage& img, const bool fast, ByteSink* sink,
+              PaddedBytes* compressed, EncodedPartSizes* part_sizes) {
+  if (sink == nullptr) {
+    if (fast) {
+      img.EncodeFast(compressed);
+    } else {
+      img.Encode(compressed);
+    }
+    *part_sizes = img.encoded_part_sizes();
+    return true;
+  }
+  if (!sink->Write(compressed->data(), compressed->size())) {
+    return PIK_FAILURE("Failed to write output.");
+  }
+  compressed->resize(0);
+  const bool ok = fast ? img.EncodeFast(sink) : img.Encode(sink);
+  *part_sizes = img.encoded_part_sizes();
+  return ok ? true : PIK_FAILURE("Failed to write output.");
+}
+
+// Appends the encoding to "compressed", or passes it to "sink" (see EncodeTo).
+// "opsin" is either an Image3F or a CompressedImage::OpsinRowFunc, and
+// "opsin_y" its Y channel.
+template <class Opsin>
+bool CompressFast(const ImageF& opsin_y, const Opsin& opsin,
+                  const CompressParams& params, ThreadPool* pool,
+                  PikInfo* info, PaddedBytes* compressed,
+                  EncodedPartSizes* part_sizes, ByteSink* sink = nullptr) {
+  PROFILER_FUNC;
   const float kQuantDC = 0.76953163840390082;
   const float kQuantAC = 1.52005680264295;
-  CompressedImage img = CompressedImage::FromOpsinImage(opsin_orig, info);
-  ImageF qf = AdaptiveQuantizationMap(opsin_orig.plane(1), kBlockEdge);
+  AllocationTracker search_tracker(info ? &info->search_memory : nullptr);
+  StageTimer search_timer(info ? &info->search_time : nullptr);
+  // Quantized only once, hence the padded opsin image is not needed.
+  CompressedImage img(opsin_y.xsize(), opsin_y.ysize(), pool, info);
+  img.SetInterleavedANS(params.interleaved_ans);
+  img.SetStaticACCodes(params.static_ac_codes);
+  img.SetGrayscale(params.grayscale);
+  img.SetNaturalCoeffOrder(
+      UsesNaturalCoeffOrder(params, img.xsize(), img.ysize()));
+  ImageF qf = AdaptiveQuantizationMap(opsin_y, kBlockEdge);
   img.quantizer().SetQuantField(kQuantDC, ScaleImage(kQuantAC, qf));
-  img.Quantize();
-  return img.EncodeFast();
+  img.QuantizeOpsinImage(opsin);
+  search_tracker.Stop();
+  search_timer.Stop();
+  AllocationTracker encode_tracker(info ? &info->encode_memory : nullptr);
+  StageTimer encode_timer(info ? &info->encode_time : nullptr);
+  return EncodeTo(img, /*fast=*/true, sink, compressed, part_sizes);
 }
 
 template <typename CompressedImageT>
@@ -422,13 +1179,18 @@ bool ScaleQuantizationMap(const float quant_dc,
     printf("\nScaling quantization map with scale %f\n", scale);
     img->quantizer().DumpQuantizationMap();
   }
-  img->Quantize();
+  img->QuantizeDirty();
   return changed;
 }
 
+// Once "deadline" is reached, returns the best encoding so far that fits, if
+// any, and stores the sizes of its parts in "part_sizes"; the search for the
+// first one that fits always continues unless the encode is cancelled (then
+// the result is meaningless).
 template <typename CompressedImageT>
-std::string CompressToTargetSize(const Image3F& opsin_orig, size_t target_size,
-                                 CompressedImageT* img, PikInfo* aux_out) {
+std::string CompressToTargetSize(size_t target_size, const Deadline& deadline,
+                                 CompressedImageT* img, PikInfo* aux_out,
+                                 EncodedPartSizes* part_sizes) {
   float quant_dc;
   ImageF quant_ac;
   img->quantizer().GetQuantField(&quant_dc, &quant_ac);
@@ -436,9 +1198,15 @@ std::string CompressToTargetSize(const Image3F& opsin_orig, size_t target_size,
   float scale_good = 1.0;
   std::string candidate;
   std::string compressed;
+  // Steps of the two searches below, for the progress.
+  constexpr float kMaxSteps = 10 + 16;
   for (int i = 0; i < 10; ++i) {
+    if (deadline.Cancelled(i / kMaxSteps)) return "";
     ScaleQuantizationMap(quant_dc, quant_ac, scale_good, img);
+    img->UpdateCoeffOrder();
     candidate = img->Encode();
+    *part_sizes = img->encoded_part_sizes();
+    if (aux_out) ++aux_out->num_size_search_encodes;
     if (candidate.size() <= target_size) {
       compressed = candidate;
       break;
@@ -455,208 +1223,2196 @@ std::string CompressToTargetSize(const Image3F& opsin_orig, size_t target_size,
     // We dont want to go below butteraugli distance 1.0
     return compressed;
   }
+  // The scale only changes a little from here on, hence the candidates reuse
+  // the coefficient order of the first one that fit.
   for (int i = 0; i < 16; ++i) {
     float scale = 0.5 * (scale_bad + scale_good);
     if (!ScaleQuantizationMap(quant_dc, quant_ac, scale, img)) {
       break;
     }
     candidate = img->Encode();
+    if (aux_out) ++aux_out->num_size_search_encodes;
     if (candidate.size() <= target_size) {
       compressed = candidate;
+      *part_sizes = img->encoded_part_sizes();
       scale_good = scale;
     } else {
       scale_bad = scale;
     }
+    if (deadline.Reached((10 + i + 1) / kMaxSteps, aux_out)) break;
   }
   return compressed;
 }
 
-std::string CompressToTargetSize(const Image3F& opsin_orig,
-                                 const CompressParams& params,
-                                 size_t target_size, PikInfo* aux_out) {
-  CompressedImage img = CompressedImage::FromOpsinImage(opsin_orig, aux_out);
-  img.quantizer().SetQuant(1.0);
-  img.Quantize();
-  FindBestYToBCorrelation(&img);
-  FindBestQuantization(opsin_orig, 1.0, params.max_butteraugli_iters,
-                       &img, aux_out);
-  return CompressToTargetSize(opsin_orig, target_size, &img, aux_out);
-}
+// Ratio of the actual to the estimated size as a function of the
+// quantization scale, interpolated linearly between the last two encodings.
+class EncodedSizeModel {
+ public:
+  void Add(const float scale, const size_t actual, const size_t estimate) {
+    points_[0] = points_[1];
+    points_[1] = {scale, static_cast<double>(actual) / estimate};
+    ++num_points_;
+  }
 
+  double Ratio(const float scale) const {
+    if (num_points_ == 0) return 1.0;
+    const Point& p0 = points_[0];
+    const Point& p1 = points_[1];
+    if (num_points_ == 1 || p0.scale == p1.scale) return p1.ratio;
+    // Limits the extrapolation beyond the two scales.
+    const double t = std::min(
+        std::max((scale - p0.scale) / (p1.scale - p0.scale), -1.0), 2.0);
+    return p0.ratio + t * (p1.ratio - p0.ratio);
+  }
 
+ private:
+  struct Point {
+    double scale;
+    double ratio;
+  };
+  Point points_[2] = {};
+  size_t num_points_ = 0;
+};
 
+// Sets "scale" to the largest scale (at most 1) for which the size predicted
+// by "model" is at most "target_size", using the same search as above.
+// Returns false (with the smallest scale tried) if there is none.
+template <typename CompressedImageT>
+bool ScaleForEstimatedSize(const size_t target_size,
+                           const EncodedSizeModel& model, const float quant_dc,
+                           const ImageF& quant_ac, CompressedImageT* img,
+                           PikInfo* aux_out, float* scale) {
+  const auto fits = [target_size, &model, img, aux_out](const float scale) {
+    if (aux_out) ++aux_out->num_size_search_estimates;
+    return img->EstimateEncodedSize() * model.Ratio(scale) <= target_size;
+  };
+  float scale_bad = 1.0;
+  float scale_good = 1.0;
+  bool found = false;
+  for (int i = 0; i < 10; ++i) {
+    ScaleQuantizationMap(quant_dc, quant_ac, scale_good, img);
+    if (fits(scale_good)) {
+      found = true;
+      break;
+    }
+    scale_bad = scale_good;
+    scale_good *= 0.5;
+  }
+  if (!found || scale_good == 1.0) {
+    *scale = found ? scale_good : scale_bad;
+    return found;
+  }
+  for (int i = 0; i < 16; ++i) {
+    float scale = 0.5 * (scale_bad + scale_good);
+    if (!ScaleQuantizationMap(quant_dc, quant_ac, scale, img)) {
+      break;
+    }
+    if (fits(scale)) {
+      scale_good = scale;
+    } else {
+      scale_bad = scale;
+    }
+  }
+  *scale = scale_good;
+  return true;
+}
 
-void ToImage3(const CompressedImage& compressed, Image3B* image) {
-  *image = compressed.ToSRGB();
+// Same result constraint as CompressToTargetSize, but the search only
+// quantizes and estimates the size (see EstimateEncodedSize). Each encoding
+// calibrates the estimate for the next search; only if none of them is
+// small enough do we fall back to the exact search.
+template <typename CompressedImageT>
+std::string CompressToEstimatedTargetSize(size_t target_size,
+                                          const Deadline& deadline,
+                                          CompressedImageT* img,
+                                          PikInfo* aux_out,
+                                          EncodedPartSizes* part_sizes) {
+  constexpr int kMaxEncodings = 3;
+  // Accept an encoding if it is at least this fraction of the target.
+  constexpr double kTolerance = 0.98;
+  float quant_dc;
+  ImageF quant_ac;
+  img->quantizer().GetQuantField(&quant_dc, &quant_ac);
+  EncodedSizeModel model;
+  std::string compressed;
+  EncodedPartSizes compressed_sizes;
+  for (int i = 0; i < kMaxEncodings; ++i) {
+    if (deadline.Cancelled(static_cast<float>(i) / kMaxEncodings)) return "";
+    float scale;
+    const bool fits = ScaleForEstimatedSize(target_size, model, quant_dc,
+                                            quant_ac, img, aux_out, &scale);
+    ScaleQuantizationMap(quant_dc, quant_ac, scale, img);
+    img->UpdateCoeffOrder();
+    std::string candidate = img->Encode();
+    model.Add(scale, candidate.size(), img->EstimateEncodedSize());
+    if (aux_out) {
+      ++aux_out->num_size_search_encodes;
+      ++aux_out->num_size_search_estimates;
+    }
+    if (candidate.size() <= target_size) {
+      const bool done =
+          candidate.size() >= kTolerance * target_size || scale == 1.0;
+      if (candidate.size() > compressed.size()) {
+        compressed = std::move(candidate);
+        compressed_sizes = img->encoded_part_sizes();
+      }
+      if (done) break;
+    } else if (!fits) {
+      // Even the smallest scale is too large; same as the exact search.
+      if (compressed.empty()) {
+        *part_sizes = img->encoded_part_sizes();
+        return candidate;
+      }
+      break;
+    }
+    if (!compressed.empty() &&
+        deadline.Reached(static_cast<float>(i + 1) / kMaxEncodings, aux_out)) {
+      break;
+    }
+  }
+  if (!compressed.empty()) {
+    *part_sizes = compressed_sizes;
+    return compressed;
+  }
+  return CompressToTargetSize(target_size, deadline, img, aux_out,
+                              part_sizes);
 }
 
-void ToImage3(const CompressedImage& compressed, Image3U* image) {
-  *image = compressed.ToSRGB16();
+// Stores the encoding in "compressed" and the sizes of its parts in
+// "part_sizes", and returns whether the encode was not cancelled. Takes over
+// the planes of "opsin_orig".
+bool CompressToTargetSize(Image3F&& opsin_orig, const CompressParams& params,
+                          size_t target_size, ThreadPool* pool,
+                          PikInfo* aux_out, std::string* compressed,
+                          EncodedPartSizes* part_sizes) {
+  const Deadline deadline(params);
+  // Includes the trial encodings.
+  AllocationTracker search_tracker(aux_out ? &aux_out->search_memory
+                                           : nullptr);
+  StageTimer search_timer(aux_out ? &aux_out->search_time : nullptr);
+  ButteraugliComparator comparator(opsin_orig, pool);
+  QuantSearchStart start(opsin_orig, params);
+  CompressedImage img =
+      ImageForSearch(std::move(opsin_orig), params, pool, aux_out);
+  FindBestQuantization(&comparator, std::move(start), 1.0, params, deadline,
+                       pool, &img, aux_out);
+  if (deadline.cancelled()) return PIK_FAILURE("Cancelled");
+  *compressed =
+      params.estimate_target_size
+          ? CompressToEstimatedTargetSize(target_size, deadline, &img, aux_out,
+                                          part_sizes)
+          : CompressToTargetSize(target_size, deadline, &img, aux_out,
+                                 part_sizes);
+  return deadline.cancelled() ? PIK_FAILURE("Cancelled") : true;
 }
 
-void ToImage3(const CompressedImage& compressed, Image3F* image) {
-  *image = compressed.ToLinear();
+
+
+
+// Region of the image to decode.
+struct Rect {
+  int x0;
+  int y0;
+  int xsize;
+  int ysize;
+};
+
+void ToImage3(const CompressedImage& compressed, const Rect& rect,
+              Image3B* image) {
+  *image = compressed.ToSRGB(rect.x0, rect.y0, rect.xsize, rect.ysize);
 }
-}  // namespace
 
+void ToImage3(const CompressedImage& compressed, const Rect& rect,
+              Image3U* image) {
+  *image = compressed.ToSRGB16(rect.x0, rect.y0, rect.xsize, rect.ysize);
+}
 
-template<typename T>
-bool AlphaToPik(const CompressParams& params, const MetaImage<T>& image,
-                 PaddedBytes* compressed, PikInfo* aux_out) {
-  if (!image.HasAlpha()) {
-    return PIK_FAILURE("Must have alpha if alpha_channel set");
-  }
-  size_t bytepos = compressed->size();
-  if (!AlphaToPik(params, image.GetAlpha(), &bytepos, compressed)) {
-    return false;
-  }
-  return true;
+void ToImage3(const CompressedImage& compressed, const Rect& rect,
+              Image3F* image) {
+  *image = compressed.ToLinear(rect.x0, rect.y0, rect.xsize, rect.ysize);
 }
 
-template<typename T>
-bool AlphaToPik(const CompressParams& params, const Image3<T>& image,
-                 PaddedBytes* compressed, PikInfo* aux_out) {
-  return PIK_FAILURE("Alpha not supported for Image3");
+void ToPreview(const CompressedImage& compressed, Image3B* image) {
+  *image = compressed.DCToSRGB();
 }
 
-template<typename T>
-Image3F OpsinDynamicsImage(const MetaImage<T>& image) {
-  return OpsinDynamicsImage(image.GetColor());
+void ToPreview(const CompressedImage& compressed, Image3U* image) {
+  *image = compressed.DCToSRGB16();
 }
 
-template<typename Image>
-bool PixelsToPikT(const CompressParams& params, const Image& image,
-                  PaddedBytes* compressed, PikInfo* aux_out) {
-  if (image.xsize() == 0 || image.ysize() == 0) {
-    return PIK_FAILURE("Empty image");
-  }
-  if (!OpsinToPik(params, OpsinDynamicsImage(image), compressed, aux_out)) {
-    return false;
-  }
-  if (params.alpha_channel) {
-    if (!AlphaToPik(params, image, compressed, aux_out)) {
-      return false;
-    }
-  }
-  return true;
+void ToPreview(const CompressedImage& compressed, Image3F* image) {
+  *image = compressed.DCToLinear();
 }
 
-bool PixelsToPik(const CompressParams& params, const Image3B& image,
-                 PaddedBytes* compressed, PikInfo* aux_out) {
-  return PixelsToPikT(params, image, compressed, aux_out);
+void ToScaled(const CompressedImage& compressed, const int factor,
+              Image3B* image) {
+  *image = compressed.ScaledToSRGB(factor);
 }
 
-bool PixelsToPik(const CompressParams& params, const Image3F& image,
-                 PaddedBytes* compressed, PikInfo* aux_out) {
-  return PixelsToPikT(params, image, compressed, aux_out);
+void ToScaled(const CompressedImage& compressed, const int factor,
+              Image3U* image) {
+  *image = compressed.ScaledToSRGB16(factor);
 }
 
-bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
-                 PaddedBytes* compressed, PikInfo* aux_out) {
-  return PixelsToPikT(params, image, compressed, aux_out);
+void ToScaled(const CompressedImage& compressed, const int factor,
+              Image3F* image) {
+  *image = compressed.ScaledToLinear(factor);
 }
 
-bool PixelsToPik(const CompressParams& params, const MetaImageF& image,
-                 PaddedBytes* compressed, PikInfo* aux_out) {
-  return PixelsToPikT(params, image, compressed, aux_out);
+// Sample type of the "Output" of PikToPixelsT.
+template <class Output>
+struct OutputSampleT;
+template <typename T>
+struct OutputSampleT<MetaImage<T>> {
+  using type = T;
+};
+template <typename T>
+struct OutputSampleT<Image3Sink<T>> {
+  using type = T;
+};
+template <typename T>
+struct OutputSampleT<InterleavedImage<T>> {
+  using type = T;
+};
+template <typename T>
+struct OutputSampleT<Image<T>> {
+  using type = T;
+};
+template <class Output>
+using OutputSample = typename OutputSampleT<Output>::type;
+
+// Passes the whole image "planes" to the output.
+template <typename T>
+bool OutputPlanes(Image3<T>&& planes, MetaImage<T>* image) {
+  image->SetColor(std::move(planes));
+  return true;
 }
 
-bool OpsinToPik(const CompressParams& params, const Image3F& opsin,
-                PaddedBytes* compressed, PikInfo* aux_out) {
-  if (opsin.xsize() == 0 || opsin.ysize() == 0) {
-    return PIK_FAILURE("Empty image");
+template <typename T>
+bool OutputPlanes(Image3<T>&& planes, Image3Sink<T>* sink) {
+  return sink->Begin(planes.xsize(), planes.ysize()) && sink->Band(0, planes);
+}
+
+// The planes of grayscale images are equal.
+template <typename T>
+bool OutputPlanes(Image3<T>&& planes, Image<T>* gray) {
+  *gray = std::move(planes.Deconstruct()[1]);
+  return true;
+}
+
+// Sets the dimensions of "image" and returns whether its buffer can hold them.
+template <typename T>
+bool SetInterleavedSize(const size_t xsize, const size_t ysize,
+                        InterleavedImage<T>* image) {
+  if (image->num_channels != 3 && image->num_channels != 4) {
+    return PIK_FAILURE("Invalid number of interleaved channels");
+  }
+  const size_t row_size = xsize * image->num_channels * sizeof(T);
+  if (image->stride == 0) image->stride = row_size;
+  if (image->stride % sizeof(T) != 0 ||
+      reinterpret_cast<uintptr_t>(image->pixels) % sizeof(T) != 0) {
+    return PIK_FAILURE("Misaligned interleaved output buffer");
+  }
+  if (image->pixels == nullptr || image->stride < row_size ||
+      image->size < (ysize - 1) * image->stride + row_size) {
+    return PIK_FAILURE("Interleaved output buffer too small");
+  }
+  image->xsize = xsize;
+  image->ysize = ysize;
+  return true;
+}
+
+// Returns row "y" of the interleaved output.
+template <typename T>
+T* InterleavedRow(const InterleavedImage<T>* image, const size_t y) {
+  return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(image->pixels) +
+                              y * image->stride);
+}
+
+template <typename T>
+bool OutputPlanes(Image3<T>&& planes, InterleavedImage<T>* image) {
+  if (!SetInterleavedSize(planes.xsize(), planes.ysize(), image)) {
+    return false;
+  }
+  const int r = image->bgr ? 2 : 0;
+  const int b = 2 - r;
+  // The fourth channel is opaque; OutputAlpha may overwrite it.
+  const std::vector<T> opaque(planes.xsize(), std::numeric_limits<T>::max());
+  const RowInterleaver interleaver(image->num_channels, sizeof(T));
+  for (size_t y = 0; y < planes.ysize(); ++y) {
+    const uint8_t* rows[4];
+    rows[r] = reinterpret_cast<const uint8_t*>(planes.ConstPlaneRow(0, y));
+    rows[1] = reinterpret_cast<const uint8_t*>(planes.ConstPlaneRow(1, y));
+    rows[b] = reinterpret_cast<const uint8_t*>(planes.ConstPlaneRow(2, y));
+    rows[3] = reinterpret_cast<const uint8_t*>(opaque.data());
+    uint8_t* row_out = reinterpret_cast<uint8_t*>(InterleavedRow(image, y));
+    interleaver.Interleave(rows, planes.xsize(), row_out);
+  }
+  return true;
+}
+
+// Passes the DC-only preview of "compressed" to the output.
+template <class Output>
+bool OutputPreview(const CompressedImage& compressed, Output* output) {
+  Image3<OutputSample<Output>> planes;
+  ToPreview(compressed, &planes);
+  return OutputPlanes(std::move(planes), output);
+}
+
+// Passes "compressed" downsampled by "factor" to the output.
+template <class Output>
+bool OutputScaled(const CompressedImage& compressed, const int factor,
+                  Output* output) {
+  Image3<OutputSample<Output>> planes;
+  ToScaled(compressed, factor, &planes);
+  return OutputPlanes(std::move(planes), output);
+}
+
+// Returns whether the downsampled decode of params.downsampling is possible.
+// Rejects header dimensions that are zero or exceed the limits, before anything
+// is allocated for them.
+bool CheckImageSize(const DecompressParams& params, const Header& header) {
+  if (header.xsize == 0 || header.ysize == 0) {
+    return PIK_FAILURE("Empty image.");
+  }
+  static const uint32_t kMaxWidth = (1 << 25) - 1;
+  if (header.xsize > kMaxWidth) {
+    return PIK_FAILURE("Image too wide.");
+  }
+  uint64_t num_pixels = static_cast<uint64_t>(header.xsize) * header.ysize;
+  if (num_pixels > params.max_num_pixels) {
+    return PIK_FAILURE("Image too big.");
+  }
+  return true;
+}
+
+bool CheckDownsampling(const DecompressParams& params, const Header& header) {
+  if (params.downsampling != 2 && params.downsampling != 4) {
+    return PIK_FAILURE("Unsupported downsampling factor");
+  }
+  if (header.flags & Header::kWebPLossless) {
+    return PIK_FAILURE("No downsampling of lossless images");
+  }
+  if (params.crop_xsize != 0 && params.crop_ysize != 0) {
+    return PIK_FAILURE("Crop is not supported when downsampling");
+  }
+  return true;
+}
+
+// Converts the "rect" part of the lossless "srgb" (the whole image) to the
+// sample type of the lossy decoder output.
+void FromLossless(const Image3B& srgb, const Rect& rect, Image3B* image) {
+  *image = Image3B(rect.xsize, rect.ysize);
+  for (int y = 0; y < rect.ysize; ++y) {
+    const auto row = srgb.ConstRow(rect.y0 + y);
+    auto row_out = image->Row(y);
+    for (int c = 0; c < 3; ++c) {
+      memcpy(row_out[c], row[c] + rect.x0, rect.xsize);
+    }
+  }
+}
+
+void FromLossless(const Image3B& srgb, const Rect& rect, Image3U* image) {
+  *image = Image3U(rect.xsize, rect.ysize);
+  for (int y = 0; y < rect.ysize; ++y) {
+    const auto row = srgb.ConstRow(rect.y0 + y);
+    auto row_out = image->Row(y);
+    for (int c = 0; c < 3; ++c) {
+      for (int x = 0; x < rect.xsize; ++x) {
+        row_out[c][x] = row[c][rect.x0 + x] * 257;
+      }
+    }
+  }
+}
+
+void FromLossless(const Image3B& srgb, const Rect& rect, Image3F* image) {
+  Image3B crop;
+  FromLossless(srgb, rect, &crop);
+  *image = LinearFromSrgb(crop);
+}
+
+template <class Output>
+bool OutputLossless(const Image3B& srgb, const Rect& rect, Output* output) {
+  Image3<OutputSample<Output>> planes;
+  FromLossless(srgb, rect, &planes);
+  return OutputPlanes(std::move(planes), output);
+}
+
+// Passes the decoded color planes of "compressed" to the output.
+template <typename T>
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 MetaImage<T>* image) {
+  Image3<T> planes;
+  ToImage3(compressed, rect, &planes);
+  image->SetColor(std::move(planes));
+  return true;
+}
+
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 Image3SinkB* sink) {
+  return compressed.ToSRGB(sink);
+}
+
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 Image3SinkU* sink) {
+  return compressed.ToSRGB16(sink);
+}
+
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 Image3SinkF* sink) {
+  return compressed.ToLinear(sink);
+}
+
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 InterleavedImageB* image) {
+  if (!SetInterleavedSize(rect.xsize, rect.ysize, image)) return false;
+  compressed.ToSRGBInterleaved(rect.x0, rect.y0, rect.xsize, rect.ysize,
+                               image->num_channels, image->bgr, image->pixels,
+                               image->stride);
+  return true;
+}
+
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 InterleavedImageU* image) {
+  if (!SetInterleavedSize(rect.xsize, rect.ysize, image)) return false;
+  compressed.ToSRGB16Interleaved(rect.x0, rect.y0, rect.xsize, rect.ysize,
+                                 image->num_channels, image->bgr,
+                                 image->pixels, image->stride);
+  return true;
+}
+
+// Writes the gray level of the "rect" part of the grayscale "compressed" to
+// "out", with "stride" bytes per row.
+void ToGray(const CompressedImage& compressed, const Rect& rect, uint8_t* out,
+            const size_t stride) {
+  compressed.ToSRGBInterleaved(rect.x0, rect.y0, rect.xsize, rect.ysize,
+                               /*num_channels=*/1, /*bgr=*/false, out, stride);
+}
+
+void ToGray(const CompressedImage& compressed, const Rect& rect,
+            uint16_t* out, const size_t stride) {
+  compressed.ToSRGB16Interleaved(rect.x0, rect.y0, rect.xsize, rect.ysize,
+                                 /*num_channels=*/1, /*bgr=*/false, out,
+                                 stride);
+}
+
+template <typename T>
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 Image<T>* gray) {
+  if (!compressed.grayscale()) return PIK_FAILURE("Not a grayscale image.");
+  *gray = Image<T>(rect.xsize, rect.ysize);
+  ToGray(compressed, rect, gray->Row(0), gray->bytes_per_row());
+  return true;
+}
+
+// Rows per band of the banded OutputColor; a multiple of kBlockEdge.
+static constexpr int kProgressBandRows = 512;
+
+// Calls "func(band)" for consecutive bands of "rect" after reporting the
+// fraction of rows done to "progress". Returns false if "func" fails or the
+// decode is cancelled.
+template <class Func>
+bool ForEachBand(const Rect& rect, const ProgressCallback& progress,
+                 const Func& func) {
+  for (int y = 0; y < rect.ysize; y += kProgressBandRows) {
+    if (!progress(static_cast<float>(y) / rect.ysize)) {
+      return PIK_FAILURE("Cancelled");
+    }
+    const int band_ysize = std::min(kProgressBandRows, rect.ysize - y);
+    const Rect band = {rect.x0, rect.y0 + y, rect.xsize, band_ysize};
+    if (!func(band)) return false;
+  }
+  return true;
+}
+
+// As above, but reports the progress to "progress" (if set), which may cancel.
+template <typename T>
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 const ProgressCallback& progress, MetaImage<T>* image) {
+  if (!progress) return OutputColor(compressed, rect, image);
+  Image3<T> planes(rect.xsize, rect.ysize);
+  if (!ForEachBand(rect, progress, [&](const Rect& band) {
+        Image3<T> rows;
+        ToImage3(compressed, band, &rows);
+        for (int c = 0; c < 3; ++c) {
+          for (int y = 0; y < band.ysize; ++y) {
+            memcpy(planes.PlaneRow(c, band.y0 - rect.y0 + y),
+                   rows.ConstPlaneRow(c, y), band.xsize * sizeof(T));
+          }
+        }
+        return true;
+      })) {
+    return false;
+  }
+  image->SetColor(std::move(planes));
+  return true;
+}
+
+template <typename T>
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 const ProgressCallback& progress, InterleavedImage<T>* image) {
+  if (!progress) return OutputColor(compressed, rect, image);
+  if (!SetInterleavedSize(rect.xsize, rect.ysize, image)) return false;
+  return ForEachBand(rect, progress, [&](const Rect& band) {
+    // The rows of "image" that hold "band".
+    InterleavedImage<T> rows = *image;
+    rows.pixels = InterleavedRow(image, band.y0 - rect.y0);
+    rows.size = image->size - (band.y0 - rect.y0) * image->stride;
+    return OutputColor(compressed, band, &rows);
+  });
+}
+
+template <typename T>
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 const ProgressCallback& progress, Image<T>* gray) {
+  if (!progress) return OutputColor(compressed, rect, gray);
+  if (!compressed.grayscale()) return PIK_FAILURE("Not a grayscale image.");
+  Image<T> rows(rect.xsize, rect.ysize);
+  if (!ForEachBand(rect, progress, [&](const Rect& band) {
+        ToGray(compressed, band, rows.Row(band.y0 - rect.y0),
+               rows.bytes_per_row());
+        return true;
+      })) {
+    return false;
+  }
+  *gray = std::move(rows);
+  return true;
+}
+
+// Forwards to "sink" after reporting the progress of each band.
+template <typename T>
+class ProgressSink : public Image3Sink<T> {
+ public:
+  ProgressSink(const ProgressCallback& progress, Image3Sink<T>* sink)
+      : progress_(progress), sink_(sink) {}
+
+  bool Begin(const size_t xsize, const size_t ysize) override {
+    ysize_ = ysize;
+    return sink_->Begin(xsize, ysize);
+  }
+
+  bool Band(size_t y, const Image3<T>& band) override {
+    if (!progress_(static_cast<float>(y) / ysize_)) {
+      return PIK_FAILURE("Cancelled");
+    }
+    return sink_->Band(y, band);
+  }
+
+ private:
+  const ProgressCallback& progress_;
+  Image3Sink<T>* sink_;
+  size_t ysize_ = 0;
+};
+
+template <typename T>
+bool OutputColor(const CompressedImage& compressed, const Rect& rect,
+                 const ProgressCallback& progress, Image3Sink<T>* sink) {
+  if (!progress) return OutputColor(compressed, rect, sink);
+  ProgressSink<T> progress_sink(progress, sink);
+  return OutputColor(compressed, rect, &progress_sink);
+}
+
+// Returns whether the output can store the decoded alpha channel / a crop.
+template <typename T>
+bool SupportsAlpha(const MetaImage<T>* image) { return true; }
+
+template <typename T>
+bool SupportsAlpha(const Image3Sink<T>* sink) { return false; }
+
+template <typename T>
+bool SupportsAlpha(const InterleavedImage<T>* image) {
+  return image->num_channels == 4;
+}
+
+template <typename T>
+bool SupportsAlpha(const Image<T>* gray) { return false; }
+
+template <typename T>
+bool SupportsCrop(const MetaImage<T>* image) { return true; }
+
+template <typename T>
+bool SupportsCrop(const InterleavedImage<T>* image) { return true; }
+
+template <typename T>
+bool SupportsCrop(const Image3Sink<T>* sink) { return false; }
+
+template <typename T>
+bool SupportsCrop(const Image<T>* gray) { return true; }
+
+// Decodes the alpha channel of the whole image ("xsize" x "ysize") and stores
+// the "rect" part of it.
+template <typename T>
+bool OutputAlpha(const DecompressParams& params, const size_t byte_pos,
+                 ByteSpan compressed, const int xsize,
+                 const int ysize, const Rect& rect, ThreadPool* pool,
+                 size_t* bytes_read,
+                 MetaImage<T>* image) {
+  image->AddAlpha();
+  T value;
+  if (PikAlphaIsConstant(byte_pos, compressed, bytes_read, &value)) {
+    for (int y = 0; y < rect.ysize; ++y) {
+      T* const PIK_RESTRICT row_out = image->GetAlpha().Row(y);
+      std::fill(row_out, row_out + rect.xsize, value);
+    }
+    return true;
+  }
+  if (rect.xsize == xsize && rect.ysize == ysize) {
+    return PikToAlpha(params, byte_pos, compressed, pool, bytes_read,
+                      &image->GetAlpha());
+  }
+  Image<T> alpha(xsize, ysize);
+  if (!PikToAlpha(params, byte_pos, compressed, pool, bytes_read, &alpha)) {
+    return false;
+  }
+  for (int y = 0; y < rect.ysize; ++y) {
+    memcpy(image->GetAlpha().Row(y), alpha.Row(rect.y0 + y) + rect.x0,
+           rect.xsize * sizeof(T));
+  }
+  return true;
+}
+
+template <typename T>
+bool OutputAlpha(const DecompressParams& params, const size_t byte_pos,
+                 ByteSpan compressed, const int xsize,
+                 const int ysize, const Rect& rect, ThreadPool* pool,
+                 size_t* bytes_read,
+                 InterleavedImage<T>* image) {
+  // Fills the interleaved channel directly, e.g. for opaque images.
+  T value;
+  if (PikAlphaIsConstant(byte_pos, compressed, bytes_read, &value)) {
+    for (int y = 0; y < rect.ysize; ++y) {
+      T* const PIK_RESTRICT row_out = InterleavedRow(image, y);
+      for (int x = 0; x < rect.xsize; ++x) {
+        row_out[4 * x + 3] = value;
+      }
+    }
+    return true;
+  }
+  Image<T> alpha(xsize, ysize);
+  if (!PikToAlpha(params, byte_pos, compressed, pool, bytes_read, &alpha)) {
+    return false;
+  }
+  for (int y = 0; y < rect.ysize; ++y) {
+    const T* const PIK_RESTRICT row = alpha.Row(rect.y0 + y) + rect.x0;
+    T* const PIK_RESTRICT row_out = InterleavedRow(image, y);
+    for (int x = 0; x < rect.xsize; ++x) {
+      row_out[4 * x + 3] = row[x];
+    }
+  }
+  return true;
+}
+
+template <typename T>
+bool OutputAlpha(const DecompressParams& params, const size_t byte_pos,
+                 ByteSpan compressed, const int xsize,
+                 const int ysize, const Rect& rect, ThreadPool* pool,
+                 size_t* bytes_read,
+                 Image3Sink<T>* sink) {
+  return PIK_FAILURE("Unable to output alpha channel");
+}
+
+template <typename T>
+bool OutputAlpha(const DecompressParams& params, const size_t byte_pos,
+                 ByteSpan compressed, const int xsize,
+                 const int ysize, const Rect& rect, ThreadPool* pool,
+                 size_t* bytes_read,
+                 Image<T>* gray) {
+  return PIK_FAILURE("Unable to output alpha channel");
+}
+
+// Encoder stages selected by CompressParams::effort, see kEffortLevels.
+struct EffortLevel {
+  int max_butteraugli_iters;
+  bool proxy_butteraugli;
+  bool coarse_butteraugli;
+  bool incremental_butteraugli;
+  bool adaptive_initial_quant;
+  bool parallel_ytob;
+  bool ytob_refinement;
+  bool fast_clustering;
+  bool fast_size_estimates;
+  bool static_ac_codes;
+};
+
+// Levels 2 to 9; level 1 is fast_mode. At distance 1, a 640x480 image takes
+// about 0.15 (level 2) to 0.7 (levels 8 and 9) times the time of the default
+// options, with 10% larger to 1% smaller output. Only level 2 may end the
+// search before reaching the distance, and only level 9 tries the built-in
+// codes, which mainly helps small images. The multires_butteraugli and
+// linear_butteraugli shortcuts are not used because proxy_butteraugli saves
+// more time for the same size.
+const EffortLevel kEffortLevels[8] = {
+    // iters proxy coarse incr adapt par_ytob refine fclust fest static
+    {10, true, true, true, true, true, false, true, true, false},
+    {100, true, true, true, true, true, false, true, true, false},
+    {100, true, true, true, true, false, false, false, true, false},
+    {100, true, false, true, true, false, false, false, true, false},
+    {100, false, true, true, true, false, false, false, true, false},
+    {100, false, false, true, true, false, false, false, true, false},
+    {100, false, false, false, true, true, true, false, true, false},
+    {100, false, false, false, true, true, true, false, true, true},
+};
+
+// Returns "params" with the options selected by params.effort (if non-zero)
+// and effort = 0.
+CompressParams ParamsForEffort(const CompressParams& params) {
+  CompressParams result = params;
+  result.effort = 0;
+  if (params.effort == 0) return result;
+  const int effort = std::min(std::max(params.effort, 1), 9);
+  if (effort == 1 && params.target_bitrate <= 0.0 &&
+      params.uniform_quant <= 0.0) {
+    result.butteraugli_distance = -1.0f;
+    result.fast_mode = true;
+    return result;
+  }
+  const EffortLevel& level = kEffortLevels[std::max(effort, 2) - 2];
+  result.fast_mode = false;
+  result.max_butteraugli_iters = level.max_butteraugli_iters;
+  result.proxy_butteraugli = level.proxy_butteraugli;
+  result.coarse_butteraugli = level.coarse_butteraugli;
+  result.incremental_butteraugli = level.incremental_butteraugli;
+  result.linear_butteraugli = false;
+  result.multires_butteraugli = false;
+  result.adaptive_initial_quant = level.adaptive_initial_quant;
+  result.speculative_candidates = 0;
+  result.parallel_ytob = level.parallel_ytob;
+  result.ytob_refinement = level.ytob_refinement;
+  result.fast_clustering = level.fast_clustering;
+  result.fast_size_estimates = level.fast_size_estimates;
+  result.estimate_target_size = effort <= 4;
+  // Built-in codes are not supported with AC groups.
+  result.static_ac_codes = level.static_ac_codes && !params.ac_groups;
+  return result;
+}
+
+// Replaces "compressed" with "header", followed by an empty Index section if
+// "section_index", which StoreIndex fills in once the encoding is complete.
+bool StoreHeaderAndIndex(Header header, const bool section_index,
+                         PaddedBytes* compressed) {
+  Sections sections;
+  if (section_index) {
+    header.flags |= Header::kSections;
+    sections.index.reset(new Index);
+  }
+  const size_t max_sections_size = MaxCompressedSectionsSize(sections);
+  // The encoders append to the header, which is the only part that is copied
+  // when they grow "compressed" to its final size.
+  compressed->resize(MaxCompressedHeaderSize() + max_sections_size);
+  BitSink sink(compressed->data());
+  if (!StoreHeader(header, &sink)) return false;
+  uint8_t* end = sink.Finalize();
+  if (section_index) {
+    BitSink sections_sink(end);
+    end = StoreSections(sections, max_sections_size, &sections_sink);
+    if (end == nullptr) return PIK_FAILURE("Failed to store sections");
+  }
+  compressed->resize(end - compressed->data());
+  return true;
+}
+
+// Replaces "compressed" with the header of an image encoded with "params".
+bool StorePikHeader(const CompressParams& params, const size_t xsize,
+                    const size_t ysize, PaddedBytes* compressed) {
+  const bool ac_groups = params.ac_groups && !UsesFastMode(params);
+  Header header;
+  header.xsize = xsize;
+  header.ysize = ysize;
+  if (params.grayscale) {
+    header.num_components = 1;
+  }
+  if (params.alpha_channel) {
+    header.flags |= Header::kAlpha;
+  }
+  if (ac_groups) {
+    header.flags |= Header::kACGroups;
+  }
+  if (params.interleaved_ans) {
+    header.flags |= Header::kInterleavedANS;
+  }
+  if (params.static_ac_codes && !ac_groups) {
+    header.flags |= Header::kStaticACCodes;
+  }
+  if (UsesNaturalCoeffOrder(params, xsize, ysize)) {
+    header.flags |= Header::kNaturalCoeffOrder;
+  }
+  return StoreHeaderAndIndex(header, params.section_index, compressed);
+}
+
+// Replaces "compressed", which holds "header" and the image data starting at
+// "data_pos", with the header, "sections" and the data.
+bool InsertSections(Header header, const size_t data_pos,
+                    const Sections& sections, PaddedBytes* compressed) {
+  const size_t data_size = compressed->size() - data_pos;
+  header.flags |= Header::kSections;
+  const size_t max_sections_size = MaxCompressedSectionsSize(sections);
+  PaddedBytes out(MaxCompressedHeaderSize() + max_sections_size + data_size);
+  BitSink sink(out.data());
+  if (!StoreHeader(header, &sink)) return false;
+  BitSink sections_sink(sink.Finalize());
+  uint8_t* const end =
+      StoreSections(sections, max_sections_size, &sections_sink);
+  if (end == nullptr) return PIK_FAILURE("Failed to store sections");
+  memcpy(end, compressed->data() + data_pos, data_size);
+  out.resize(end + data_size - out.data());
+  *compressed = std::move(out);
+  return true;
+}
+
+// Loads the header and any sections at the start of "compressed" and sets
+// "byte_pos" to the start of the image data.
+bool LoadHeaderAndSections(ByteSpan compressed, Header* header,
+                           Sections* sections, size_t* byte_pos) {
+  PROFILER_FUNC;
+  // LoadHeader may read beyond the end of the header (and of "compressed"),
+  // but PaddedBytes guarantees MaxCompressedHeaderSize() readable bytes.
+  PaddedBytes header_bytes(
+      std::min(compressed.size(), MaxCompressedHeaderSize()));
+  memcpy(header_bytes.data(), compressed.data(), header_bytes.size());
+  BitSource source(header_bytes.data());
+  if (!LoadHeader(&source, header)) return false;
+  *byte_pos = source.Finalize() - header_bytes.data();
+  if (*byte_pos > compressed.size()) {
+    return PIK_FAILURE("Truncated header.");
+  }
+  if ((header->flags & Header::kSections) == 0) return true;
+
+  // Same for the sections, which are typically much smaller than this.
+  constexpr size_t kMaxSectionsSize = 1 << 16;
+  PaddedBytes section_bytes(
+      std::min(compressed.size() - *byte_pos, kMaxSectionsSize));
+  memcpy(section_bytes.data(), compressed.data() + *byte_pos,
+         section_bytes.size());
+  BitSource section_source(section_bytes.data());
+  const uint8_t* const end =
+      LoadSections(&section_source,
+                   section_bytes.data() + section_bytes.size(), sections);
+  if (end == nullptr) {
+    return PIK_FAILURE("Truncated or too large sections.");
+  }
+  *byte_pos += end - section_bytes.data();
+  return true;
+}
+
+// Fills in the Index section reserved by StoreHeaderAndIndex in
+// "compressed", which holds the output of the encoders: the color data up to
+// "color_end", consisting of the parts in "part_sizes" and the AC, and then
+// the alpha, if any. The Index has a fixed size, hence only the header and
+// sections are rewritten.
+bool StoreIndex(const EncodedPartSizes& part_sizes, const size_t color_end,
+                PaddedBytes* compressed) {
+  Header header;
+  Sections sections;
+  size_t data_pos;
+  if (!LoadHeaderAndSections(*compressed, &header, &sections,
+                             &data_pos)) {
+    return false;
+  }
+  PIK_CHECK(sections.index != nullptr);
+  PIK_CHECK(data_pos <= color_end && color_end <= compressed->size());
+  Index* index = sections.index.get();
+  index->ytob_size = part_sizes.ytob;
+  index->quant_size = part_sizes.quant;
+  index->dc_size = part_sizes.dc;
+  PIK_CHECK(index->ACOffset() <= color_end - data_pos);
+  index->ac_size = color_end - data_pos - index->ACOffset();
+  index->alpha_size = compressed->size() - color_end;
+
+  const size_t max_sections_size = MaxCompressedSectionsSize(sections);
+  PaddedBytes prefix(MaxCompressedHeaderSize() + max_sections_size);
+  BitSink sink(prefix.data());
+  if (!StoreHeader(header, &sink)) return false;
+  BitSink sections_sink(sink.Finalize());
+  const uint8_t* const end =
+      StoreSections(sections, max_sections_size, &sections_sink);
+  if (end == nullptr) return PIK_FAILURE("Failed to store sections");
+  PIK_CHECK(static_cast<size_t>(end - prefix.data()) == data_pos);
+  memcpy(compressed->data(), prefix.data(), data_pos);
+  return true;
+}
+
+// Inserts a Frame section after the header in "compressed", which holds the
+// output of StorePikHeader and the encoder.
+bool StoreFrameSection(const uint32_t duration, const uint32_t flags,
+                       PaddedBytes* compressed) {
+  Header header;
+  BitSource source(compressed->data());
+  if (!LoadHeader(&source, &header)) return false;
+  const size_t data_pos = source.Finalize() - compressed->data();
+
+  Sections sections;
+  sections.frame.reset(new Frame);
+  sections.frame->size = compressed->size() - data_pos;
+  sections.frame->duration = duration;
+  sections.frame->flags = flags;
+  return InsertSections(header, data_pos, sections, compressed);
+}
+
+template <typename T>
+void OpsinDynamicsRow(const MetaImage<T>& image, const size_t y,
+                      float* const PIK_RESTRICT row_x,
+                      float* const PIK_RESTRICT row_y,
+                      float* const PIK_RESTRICT row_b) {
+  OpsinDynamicsRow(image.GetColor(), y, row_x, row_y, row_b);
+}
+
+// Stores the number of threads of "pool" (may be null) in "aux_out" (unless
+// null), the upper bound of StageTime::Utilization, and upon destruction adds
+// the pool's counters since construction to aux_out->pool_stats. Nested
+// instances for the same "aux_out" do not count the same Run() twice.
+class ThreadPoolRecorder {
+ public:
+  ThreadPoolRecorder(const ThreadPool* pool, PikInfo* aux_out)
+      : pool_(pool), aux_out_(aux_out) {
+    if (aux_out_ == nullptr) return;
+    aux_out_->num_threads = pool_ == nullptr ? 1 : pool_->NumThreads();
+    if (pool_ == nullptr) return;
+    initial_ = aux_out_->pool_stats;
+    before_ = pool_->Stats();
+  }
+
+  ~ThreadPoolRecorder() {
+    if (aux_out_ == nullptr || pool_ == nullptr) return;
+    aux_out_->pool_stats = initial_;
+    aux_out_->pool_stats.Assimilate(pool_->Stats().Since(before_));
+  }
+
+  ThreadPoolRecorder(const ThreadPoolRecorder&) = delete;
+  ThreadPoolRecorder& operator=(const ThreadPoolRecorder&) = delete;
+
+ private:
+  const ThreadPool* pool_;
+  PikInfo* aux_out_;
+  ThreadPoolStats initial_;
+  ThreadPoolStats before_;
+};
+
+// Whether PixelsToPik should use StripedPixelsToPik for an image of the given
+// size.
+bool UseOpsinStripes(const CompressParams& params, const size_t xsize,
+                     const size_t ysize) {
+  if (params.max_encoder_memory == 0) return false;
+  if (params.butteraugli_distance >= 0.0 || params.target_bitrate > 0.0) {
+    return false;
+  }
+  if (params.uniform_quant <= 0.0 && !params.fast_mode) return false;
+  const size_t kBytesPerPixel = 3 * sizeof(float) + 3 * sizeof(int16_t);
+  return xsize * ysize * kBytesPerPixel > params.max_encoder_memory;
+}
+
+// Same as OpsinToPik(OpsinDynamicsImage(image)) for the uniform_quant and
+// fast_mode paths, but only converts the stripes of "image" that are being
+// quantized; fast_mode additionally stores the Y channel. "part_sizes" and
+// "sink" are as in EncodeTo.
+template <class Image>
+bool StripedPixelsToPik(const CompressParams& params, const Image& image,
+                        ThreadPool* pool, PaddedBytes* compressed,
+                        PikInfo* aux_out, EncodedPartSizes* part_sizes,
+                        ByteSink* sink) {
+  const size_t xsize = image.xsize();
+  const size_t ysize = image.ysize();
+  if (!StorePikHeader(params, xsize, ysize, compressed)) return false;
+  const CompressedImage::OpsinRowFunc opsin_row =
+      [&image](const int y, float* const PIK_RESTRICT row_x,
+               float* const PIK_RESTRICT row_y,
+               float* const PIK_RESTRICT row_b) {
+        OpsinDynamicsRow(image, y, row_x, row_y, row_b);
+      };
+  if (params.uniform_quant > 0.0) {
+    AllocationTracker search_tracker(aux_out ? &aux_out->search_memory
+                                             : nullptr);
+    StageTimer search_timer(aux_out ? &aux_out->search_time : nullptr);
+    CompressedImage img(xsize, ysize, pool, aux_out);
+    img.SetACGroups(params.ac_groups);
+    img.SetInterleavedANS(params.interleaved_ans);
+    img.SetStaticACCodes(params.static_ac_codes);
+    img.SetGrayscale(params.grayscale);
+    img.SetNaturalCoeffOrder(
+        UsesNaturalCoeffOrder(params, img.xsize(), img.ysize()));
+    img.SetFastClustering(params.fast_clustering);
+    img.quantizer().SetQuant(params.uniform_quant);
+    img.QuantizeOpsinImage(opsin_row);
+    search_tracker.Stop();
+    search_timer.Stop();
+    AllocationTracker encode_tracker(aux_out ? &aux_out->encode_memory
+                                             : nullptr);
+    StageTimer encode_timer(aux_out ? &aux_out->encode_time : nullptr);
+    return EncodeTo(img, /*fast=*/false, sink, compressed, part_sizes);
+  }
+  AllocationTracker opsin_tracker(aux_out ? &aux_out->opsin_memory : nullptr);
+  StageTimer opsin_timer(aux_out ? &aux_out->opsin_time : nullptr);
+  ImageF opsin_y(xsize, ysize);
+  std::vector<float> row_xb(2 * xsize);
+  for (size_t y = 0; y < ysize; ++y) {
+    opsin_row(y, row_xb.data(), opsin_y.Row(y), row_xb.data() + xsize);
+  }
+  opsin_tracker.Stop();
+  opsin_timer.Stop();
+  return CompressFast(opsin_y, opsin_row, params, pool, aux_out, compressed,
+                      part_sizes, sink);
+}
+
+Image3F TakeOrCopy(const Image3F& image, Image3F* movable_image) {
+  if (movable_image != nullptr) return std::move(*movable_image);
+  return CopyImage3(image);
+}
+
+// Same as OpsinToPik, but runs on "pool" instead of params.num_threads.
+// The modes that store a padded copy of the opsin image instead take over the
+// planes of "movable_opsin" unless it is null, in which case it must point to
+// "opsin". Stores the sizes of the parts of the color data in "part_sizes".
+// The uniform_quant and fast_mode paths pass their output to "sink" as in
+// EncodeTo; the others always append it to "compressed".
+bool OpsinToPikWithPool(const CompressParams& params, const Image3F& opsin,
+                        Image3F* movable_opsin, ThreadPool* pool,
+                        PaddedBytes* compressed, PikInfo* aux_out,
+                        EncodedPartSizes* part_sizes,
+                        ByteSink* sink = nullptr) {
+  if (opsin.xsize() == 0 || opsin.ysize() == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+  const size_t xsize = opsin.xsize();
+  const size_t ysize = opsin.ysize();
+  if (!CheckInitialQuantField(params, xsize, ysize)) return false;
+  const bool fast_mode = UsesFastMode(params);
+  if (!StorePikHeader(params, xsize, ysize, compressed)) return false;
+
+  // OpsinDynamics code path.
+  if (params.butteraugli_distance >= 0.0) {
+    if (!CompressToButteraugliDistance(TakeOrCopy(opsin, movable_opsin),
+                                       params, pool, aux_out, compressed,
+                                       part_sizes)) {
+      return false;
+    }
+  } else if (params.target_bitrate > 0.0) {
+    size_t target_size =
+        opsin.xsize() * opsin.ysize() * params.target_bitrate / 8.0;
+    std::string compressed_data;
+    if (!CompressToTargetSize(TakeOrCopy(opsin, movable_opsin), params,
+                              target_size, pool, aux_out, &compressed_data,
+                              part_sizes)) {
+      return false;
+    }
+    const size_t header_size = compressed->size();
+    compressed->resize(header_size + compressed_data.size());
+    memcpy(compressed->data() + header_size, compressed_data.data(),
+           compressed_data.size());
+  } else if (params.uniform_quant > 0.0) {
+    AllocationTracker search_tracker(aux_out ? &aux_out->search_memory
+                                             : nullptr);
+    StageTimer search_timer(aux_out ? &aux_out->search_time : nullptr);
+    CompressedImage img(opsin.xsize(), opsin.ysize(), pool, aux_out);
+    img.SetACGroups(params.ac_groups);
+    img.SetInterleavedANS(params.interleaved_ans);
+    img.SetStaticACCodes(params.static_ac_codes);
+    img.SetGrayscale(params.grayscale);
+    img.SetNaturalCoeffOrder(
+        UsesNaturalCoeffOrder(params, img.xsize(), img.ysize()));
+    img.SetFastClustering(params.fast_clustering);
+    img.quantizer().SetQuant(params.uniform_quant);
+    img.QuantizeOpsinImage(opsin);
+    search_tracker.Stop();
+    search_timer.Stop();
+    AllocationTracker encode_tracker(aux_out ? &aux_out->encode_memory
+                                             : nullptr);
+    StageTimer encode_timer(aux_out ? &aux_out->encode_time : nullptr);
+    return EncodeTo(img, /*fast=*/false, sink, compressed, part_sizes);
+  } else if (fast_mode) {
+    return CompressFast(opsin.plane(1), opsin, params, pool, aux_out,
+                        compressed, part_sizes, sink);
+  } else {
+    return PIK_FAILURE("Not implemented");
+  }
+  return true;
+}
+
+// Implements the public OpsinToPik; the opsin image has no alpha.
+bool IndexedOpsinToPik(const CompressParams& params, const Image3F& opsin,
+                       Image3F* movable_opsin, ThreadPool* pool,
+                       PaddedBytes* compressed, PikInfo* aux_out) {
+  if (params.effort != 0) {
+    return IndexedOpsinToPik(ParamsForEffort(params), opsin, movable_opsin,
+                             pool, compressed, aux_out);
+  }
+  ThreadPoolRecorder pool_recorder(pool, aux_out);
+  EncodedPartSizes part_sizes;
+  if (!OpsinToPikWithPool(params, opsin, movable_opsin, pool, compressed,
+                          aux_out, &part_sizes)) {
+    return false;
+  }
+  if (params.section_index &&
+      !StoreIndex(part_sizes, compressed->size(), compressed)) {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+
+template<typename T>
+bool AlphaToPik(const CompressParams& params, const MetaImage<T>& image,
+                ThreadPool* pool, PaddedBytes* compressed) {
+  if (!image.HasAlpha()) {
+    return PIK_FAILURE("Must have alpha if alpha_channel set");
+  }
+  size_t bytepos = compressed->size();
+  if (!AlphaToPik(params, image.GetAlpha(), pool, &bytepos, compressed)) {
+    return false;
+  }
+  return true;
+}
+
+template<typename T>
+bool AlphaToPik(const CompressParams& params, const Image3<T>& image,
+                ThreadPool* pool, PaddedBytes* compressed) {
+  return PIK_FAILURE("Alpha not supported for Image3");
+}
+
+// Encodes the alpha channel of "image" (if params.alpha_channel), either in
+// Finish or, with params.concurrent_alpha, on an additional thread started by
+// the constructor, while the caller encodes the color planes on "pool".
+// "image" must not be modified by the caller in the meantime, except for
+// taking over its color planes.
+template <class Image>
+class AlphaEncoder {
+ public:
+  AlphaEncoder(const CompressParams& params, const Image& image,
+               ThreadPool* pool)
+      : params_(params), image_(image), pool_(pool) {
+    if (params_.alpha_channel && params_.concurrent_alpha) {
+      // Same arena etc. as the caller, which joins before they end.
+      const ThreadContext context = *CurrentThreadContext();
+      thread_ = std::thread([this, context]() {
+        *CurrentThreadContext() = context;
+        ok_ = AlphaToPik(params_, image_, nullptr, &alpha_);
+      });
+    }
+  }
+
+  ~AlphaEncoder() {
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // Appends the alpha data to "compressed", after the color data.
+  bool Finish(PaddedBytes* compressed) {
+    if (!params_.alpha_channel) return true;
+    if (!thread_.joinable()) {
+      return AlphaToPik(params_, image_, pool_, compressed);
+    }
+    thread_.join();
+    if (!ok_) return false;
+    const size_t pos = compressed->size();
+    compressed->resize(pos + alpha_.size());
+    memcpy(compressed->data() + pos, alpha_.data(), alpha_.size());
+    return true;
+  }
+
+ private:
+  const CompressParams& params_;
+  const Image& image_;
+  ThreadPool* pool_;
+  std::thread thread_;
+  bool ok_ = false;
+  PaddedBytes alpha_;
+};
+
+// Returns whether the first "num_rows" rows of "image" have R = G = B.
+template <typename T>
+bool IsGray(const Image3<T>& image, const size_t num_rows) {
+  for (size_t y = 0; y < num_rows; ++y) {
+    const T* const PIK_RESTRICT row_r = image.ConstPlaneRow(0, y);
+    const T* const PIK_RESTRICT row_g = image.ConstPlaneRow(1, y);
+    const T* const PIK_RESTRICT row_b = image.ConstPlaneRow(2, y);
+    for (size_t x = 0; x < image.xsize(); ++x) {
+      if (row_r[x] != row_g[x] || row_b[x] != row_g[x]) return false;
+    }
+  }
+  return true;
+}
+
+template <typename T>
+const Image3<T>& ColorPlanes(const Image3<T>& image) { return image; }
+template <typename T>
+const Image3<T>& ColorPlanes(const MetaImage<T>& image) {
+  return image.GetColor();
+}
+
+// Returns false if params.grayscale is set but "image" has color, which the
+// encoder would otherwise silently drop.
+template <class Image>
+bool CheckGrayscaleInput(const CompressParams& params, const Image& image) {
+  if (params.grayscale && !IsGray(ColorPlanes(image), image.ysize())) {
+    return PIK_FAILURE("Grayscale input must have R = G = B");
+  }
+  return true;
+}
+
+// Returns the opsin image of "srgb" to encode with "params". Gray images (see
+// CheckGrayscaleInput) are converted via their green plane.
+Image3F EncoderOpsin(const CompressParams& params, const Image3B& srgb) {
+  if (params.grayscale) return OpsinDynamicsGrayImage(srgb.plane(1));
+  return OpsinDynamicsImage(srgb);
+}
+
+Image3F EncoderOpsin(const CompressParams& params, const Image3F& linear) {
+  return OpsinDynamicsImage(linear);
+}
+
+template<typename T>
+Image3F EncoderOpsin(const CompressParams& params, const MetaImage<T>& image) {
+  return EncoderOpsin(params, image.GetColor());
+}
+
+// Fills in the Index if requested, given the sizes of the parts of the color
+// data and its end in "compressed", and then passes all remaining output to
+// "sink" unless it is null.
+bool FinishOutput(const CompressParams& params,
+                  const EncodedPartSizes& part_sizes, const size_t color_end,
+                  PaddedBytes* compressed, ByteSink* sink) {
+  if (params.section_index &&
+      !StoreIndex(part_sizes, color_end, compressed)) {
+    return false;
+  }
+  if (sink != nullptr) {
+    if (!sink->Write(compressed->data(), compressed->size())) {
+      return PIK_FAILURE("Failed to write output.");
+    }
+    compressed->resize(0);
+  }
+  return true;
+}
+
+// The Index requires the whole output, hence only the other output is passed
+// to "sink" as soon as it is encoded.
+ByteSink* ColorSink(const CompressParams& params, ByteSink* sink) {
+  return params.section_index ? nullptr : sink;
+}
+
+// Runs on "pool" instead of params.num_threads. If "sink" is non-null, it
+// receives the output instead of "compressed", which is cleared.
+template<typename Image>
+bool PixelsToPikT(const CompressParams& params, const Image& image,
+                  ThreadPool* pool, PaddedBytes* compressed,
+                  PikInfo* aux_out, ByteSink* sink = nullptr) {
+  if (params.effort != 0) {
+    return PixelsToPikT(ParamsForEffort(params), image, pool, compressed,
+                        aux_out, sink);
+  }
+  if (image.xsize() == 0 || image.ysize() == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+  ThreadPoolRecorder pool_recorder(pool, aux_out);
+  if (params.lossless) {
+    return LosslessPixelsToPik(params, image, pool, compressed, aux_out, sink);
+  }
+  if (!CheckGrayscaleInput(params, image)) return false;
+  // Recycles the planes of the many temporary images of the encoder.
+  CallImageArena arena;
+  butteraugli::ImageCacheScope butteraugli_cache;
+  AlphaEncoder<Image> alpha_encoder(params, image, pool);
+  HugePageScope huge_pages(params.huge_page_bytes);
+  butteraugli::HugePageScope butteraugli_huge_pages(params.huge_page_bytes);
+  EncodedPartSizes part_sizes;
+  if (UseOpsinStripes(params, image.xsize(), image.ysize())) {
+    if (!StripedPixelsToPik(params, image, pool, compressed, aux_out,
+                            &part_sizes, ColorSink(params, sink))) {
+      return false;
+    }
+  } else {
+    AllocationTracker opsin_tracker(aux_out ? &aux_out->opsin_memory
+                                            : nullptr);
+    StageTimer opsin_timer(aux_out ? &aux_out->opsin_time : nullptr);
+    Image3F opsin = EncoderOpsin(params, image);
+    opsin_tracker.Stop();
+    opsin_timer.Stop();
+    if (!OpsinToPikWithPool(params, opsin, &opsin, pool, compressed,
+                            aux_out, &part_sizes, ColorSink(params, sink))) {
+      return false;
+    }
+  }
+  const size_t color_end = compressed->size();
+  if (!alpha_encoder.Finish(compressed)) return false;
+  return FinishOutput(params, part_sizes, color_end, compressed, sink);
+}
+
+// Returns the color planes for LosslessPixelsToPik, or null if the samples
+// are not 8-bit.
+const Image3B* LosslessColor(const Image3B& image) { return &image; }
+const Image3B* LosslessColor(const MetaImageB& image) {
+  return &image.GetColor();
+}
+template <class Image>
+const Image3B* LosslessColor(const Image& image) {
+  return nullptr;
+}
+
+// Lossless path of PixelsToPikT (params.lossless), see lossless.h.
+template <class Image>
+bool LosslessPixelsToPik(const CompressParams& params, const Image& image,
+                         ThreadPool* pool, PaddedBytes* compressed,
+                         PikInfo* aux_out, ByteSink* sink) {
+  const Image3B* srgb = LosslessColor(image);
+  if (srgb == nullptr) {
+    return PIK_FAILURE("Lossless mode requires 8-bit input");
+  }
+  AlphaEncoder<Image> alpha_encoder(params, image, pool);
+  StageTimer encode_timer(aux_out ? &aux_out->encode_time : nullptr);
+  std::vector<uint32_t> palette;
+  FindPalette(*srgb, &palette);
+
+  Header header;
+  header.xsize = srgb->xsize();
+  header.ysize = srgb->ysize();
+  header.flags = Header::kWebPLossless;
+  if (!palette.empty()) {
+    header.flags |= Header::kPalette;
+  }
+  if (params.alpha_channel) {
+    header.flags |= Header::kAlpha;
+  }
+  if (!StoreHeaderAndIndex(header, params.section_index, compressed)) {
+    return false;
+  }
+  // The planes are coded like the DC coefficients.
+  if (!LosslessToPik(*srgb, palette, aux_out ? &aux_out->dc_image : nullptr,
+                     compressed)) {
+    return false;
+  }
+  encode_timer.Stop();
+  const size_t color_end = compressed->size();
+  if (!alpha_encoder.Finish(compressed)) return false;
+  // Lossless color data has no parts and is counted as AC.
+  return FinishOutput(params, EncodedPartSizes(), color_end, compressed, sink);
+}
+
+Image3F& MutableColor(Image3F* image) { return *image; }
+Image3F& MutableColor(MetaImageF* image) { return image->GetColor(); }
+
+// Same as PixelsToPikT, but converts the color planes of "image" (Image3F or
+// MetaImageF) in place and hands them over to the encoder. Does not convert
+// in stripes because no opsin image is allocated anyway.
+template<typename Image>
+bool MovedPixelsToPikT(const CompressParams& params, Image* image,
+                       ThreadPool* pool, PaddedBytes* compressed,
+                       PikInfo* aux_out, ByteSink* sink = nullptr) {
+  if (params.effort != 0) {
+    return MovedPixelsToPikT(ParamsForEffort(params), image, pool, compressed,
+                             aux_out, sink);
+  }
+  if (image->xsize() == 0 || image->ysize() == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+  if (params.lossless) {
+    return PIK_FAILURE("Lossless mode requires 8-bit input");
+  }
+  if (!CheckGrayscaleInput(params, *image)) return false;
+  ThreadPoolRecorder pool_recorder(pool, aux_out);
+  CallImageArena arena;
+  butteraugli::ImageCacheScope butteraugli_cache;
+  AlphaEncoder<Image> alpha_encoder(params, *image, pool);
+  HugePageScope huge_pages(params.huge_page_bytes);
+  butteraugli::HugePageScope butteraugli_huge_pages(params.huge_page_bytes);
+  AllocationTracker opsin_tracker(aux_out ? &aux_out->opsin_memory : nullptr);
+  StageTimer opsin_timer(aux_out ? &aux_out->opsin_time : nullptr);
+  Image3F opsin = OpsinDynamicsImage(std::move(MutableColor(image)));
+  opsin_tracker.Stop();
+  opsin_timer.Stop();
+  EncodedPartSizes part_sizes;
+  if (!OpsinToPikWithPool(params, opsin, &opsin, pool, compressed, aux_out,
+                          &part_sizes, ColorSink(params, sink))) {
+    return false;
+  }
+  const size_t color_end = compressed->size();
+  if (!alpha_encoder.Finish(compressed)) return false;
+  return FinishOutput(params, part_sizes, color_end, compressed, sink);
+}
+
+// Linear RGB of pixels produced by an Image3Source; "storage" holds the
+// result if a conversion is required.
+const Image3F& LinearFromSource(const Image3U& srgb, Image3F* storage) {
+  *storage = LinearFromSrgb(srgb);
+  return *storage;
+}
+const Image3F& LinearFromSource(const Image3F& linear, Image3F* storage) {
+  return linear;
+}
+
+// Same as above, but may take over the planes of "pixels".
+Image3F TakeLinearFromSource(Image3U* srgb) { return LinearFromSrgb(*srgb); }
+Image3F TakeLinearFromSource(Image3F* linear) { return std::move(*linear); }
+
+// Same as PixelsToPikT for the image produced by "source". The uniform_quant
+// mode converts and quantizes each band as soon as it is read, so that
+// neither the sRGB nor the opsin image are stored; other modes read the whole
+// image first.
+template <typename T>
+bool SourcePixelsToPik(const CompressParams& params, Image3Source<T>* source,
+                       ThreadPool* pool, PaddedBytes* compressed,
+                       PikInfo* aux_out, ByteSink* sink = nullptr) {
+  if (params.effort != 0) {
+    return SourcePixelsToPik(ParamsForEffort(params), source, pool, compressed,
+                             aux_out, sink);
+  }
+  const size_t xsize = source->xsize();
+  const size_t ysize = source->ysize();
+  if (xsize == 0 || ysize == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+  if (params.alpha_channel) {
+    return PIK_FAILURE("Alpha not supported for Image3Source");
+  }
+  if (params.lossless) {
+    return PIK_FAILURE("Lossless mode requires 8-bit input");
+  }
+  const bool streaming = params.butteraugli_distance < 0.0 &&
+                         params.target_bitrate <= 0.0 &&
+                         params.uniform_quant > 0.0;
+  if (!streaming) {
+    Image3<T> pixels(xsize, ysize);
+    if (!source->NextBand(&pixels)) return false;
+    Image3F linear = TakeLinearFromSource(&pixels);
+    pixels = Image3<T>();
+    return MovedPixelsToPikT(params, &linear, pool, compressed, aux_out,
+                             sink);
+  }
+
+  ThreadPoolRecorder pool_recorder(pool, aux_out);
+  CallImageArena arena;
+  HugePageScope huge_pages(params.huge_page_bytes);
+  if (!StorePikHeader(params, xsize, ysize, compressed)) return false;
+  // One block row; its linear conversion is only used for OpsinDynamicsRow.
+  constexpr size_t kBandRows = 8;
+  Image3<T> band(xsize, kBandRows);
+  Image3F storage;
+  const Image3F* linear = nullptr;
+  size_t band_y = 0;
+  bool ok = true;
+  bool gray = true;
+  // Rows are requested in order, so each band is read exactly once.
+  const CompressedImage::OpsinRowFunc opsin_row =
+      [&](const int y, float* const PIK_RESTRICT row_x,
+          float* const PIK_RESTRICT row_y, float* const PIK_RESTRICT row_b) {
+        if (y == 0 || y >= band_y + kBandRows) {
+          band_y = y;
+          ok &= source->NextBand(&band);
+          if (params.grayscale) {
+            gray &= IsGray(band, std::min(kBandRows, ysize - band_y));
+          }
+          linear = &LinearFromSource(band, &storage);
+        }
+        OpsinDynamicsRow(*linear, y - band_y, row_x, row_y, row_b);
+      };
+  AllocationTracker search_tracker(aux_out ? &aux_out->search_memory
+                                           : nullptr);
+  StageTimer search_timer(aux_out ? &aux_out->search_time : nullptr);
+  CompressedImage img(xsize, ysize, pool, aux_out);
+  img.SetACGroups(params.ac_groups);
+  img.SetInterleavedANS(params.interleaved_ans);
+  img.SetStaticACCodes(params.static_ac_codes);
+  img.SetGrayscale(params.grayscale);
+  img.SetNaturalCoeffOrder(
+      UsesNaturalCoeffOrder(params, img.xsize(), img.ysize()));
+  img.SetFastClustering(params.fast_clustering);
+  img.quantizer().SetQuant(params.uniform_quant);
+  img.QuantizeOpsinRowsInOrder(opsin_row);
+  search_tracker.Stop();
+  search_timer.Stop();
+  if (!ok) return PIK_FAILURE("Failed to read source");
+  if (!gray) return PIK_FAILURE("Grayscale input must have R = G = B");
+  AllocationTracker encode_tracker(aux_out ? &aux_out->encode_memory
+                                           : nullptr);
+  StageTimer encode_timer(aux_out ? &aux_out->encode_time : nullptr);
+  EncodedPartSizes part_sizes;
+  if (!EncodeTo(img, /*fast=*/false, ColorSink(params, sink), compressed,
+                &part_sizes)) {
+    return false;
+  }
+  return FinishOutput(params, part_sizes, compressed->size(), compressed,
+                      sink);
+}
+
+bool CpuSupportsCodec() {
+  return (dispatch::SupportedTargets() & SIMD_SSE4) != 0;
+}
+
+bool PixelsToPik(const CompressParams& params, const Image3B& image,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PixelsToPikT(params, image, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, const Image3F& image,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PixelsToPikT(params, image, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PixelsToPikT(params, image, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, const MetaImageF& image,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PixelsToPikT(params, image, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, MetaImageF&& linear,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return MovedPixelsToPikT(params, &linear, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, Image3F&& linear,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return MovedPixelsToPikT(params, &linear, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, Image3SourceU* source,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return SourcePixelsToPik(params, source, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, Image3SourceF* source,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return SourcePixelsToPik(params, source, &pool, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
+                 ByteSink* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  PaddedBytes compressed;
+  return PixelsToPikT(params, image, &pool, &compressed, aux_out, sink);
+}
+
+bool PixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                 ByteSink* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  PaddedBytes compressed;
+  return PixelsToPikT(params, linear, &pool, &compressed, aux_out, sink);
+}
+
+bool PixelsToPik(const CompressParams& params, Image3SourceU* source,
+                 ByteSink* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  PaddedBytes compressed;
+  return SourcePixelsToPik(params, source, &pool, &compressed, aux_out, sink);
+}
+
+bool PixelsToPik(const CompressParams& params, Image3SourceF* source,
+                 ByteSink* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  PaddedBytes compressed;
+  return SourcePixelsToPik(params, source, &pool, &compressed, aux_out, sink);
+}
+
+template <typename Image>
+bool PixelsToPikBatchT(const CompressParams& params,
+                       const std::vector<Image>& images,
+                       std::vector<PaddedBytes>* compressed,
+                       std::vector<PikInfo>* aux_out) {
+  // Shared by all images, which typically have similar sizes.
+  CallImageArena arena;
+  butteraugli::ImageCacheScope butteraugli_cache;
+  HugePageScope huge_pages(params.huge_page_bytes);
+  butteraugli::HugePageScope butteraugli_huge_pages(params.huge_page_bytes);
+  compressed->clear();
+  compressed->resize(images.size());
+  if (aux_out != nullptr) {
+    aux_out->clear();
+    aux_out->resize(images.size());
+  }
+  // One image per task, each encoded on a single thread: the pool is not
+  // reentrant, and this scales better than splitting small images.
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  std::vector<int> ok(images.size());
+  pool.Run(0, images.size(), [&](const int i, const int thread) {
+    PikInfo* info = aux_out == nullptr ? nullptr : &(*aux_out)[i];
+    ThreadPool image_pool(0);
+    ok[i] = PixelsToPikT(params, images[i], &image_pool, &(*compressed)[i],
+                         info);
+  });
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (!ok[i]) return PIK_FAILURE("Failed to compress an image of the batch");
+  }
+  return true;
+}
+
+// Reports the progress of concurrent searches to "progress" (if set) as the
+// mean of their fractions done, one call at a time. Once "progress" cancels,
+// the shared flag also cancels all other searches.
+class SharedProgress {
+ public:
+  SharedProgress(const ProgressCallback& progress, const size_t num_searches)
+      : progress_(progress), fractions_(num_searches, 0.0f) {}
+
+  // Returns the callback for CompressParams::progress of search "i", or an
+  // empty one if there is no "progress".
+  ProgressCallback ForSearch(const size_t i) {
+    if (!progress_) return ProgressCallback();
+    return [this, i](const float fraction_done) {
+      return Report(i, fraction_done);
+    };
   }
-  const size_t xsize = opsin.xsize();
-  const size_t ysize = opsin.ysize();
-  // OpsinDynamics code path.
-  std::string compressed_data;
-  if (params.butteraugli_distance >= 0.0) {
-    compressed_data = CompressToButteraugliDistance(opsin, params, aux_out);
-  } else if (params.target_bitrate > 0.0) {
-    size_t target_size =
-        opsin.xsize() * opsin.ysize() * params.target_bitrate / 8.0;
-    compressed_data = CompressToTargetSize(opsin, params, target_size,
-                                           aux_out);
-  } else if (params.uniform_quant > 0.0) {
-    CompressedImage img = CompressedImage::FromOpsinImage(opsin, aux_out);
-    img.quantizer().SetQuant(params.uniform_quant);
-    img.Quantize();
-    compressed_data = img.Encode();
-  } else if (params.fast_mode) {
-    compressed_data = CompressFast(opsin, params, aux_out);
+
+  // Counts search "i" as done without calling "progress".
+  void Finish(const size_t i) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fractions_[i] = 1.0f;
+  }
+
+  bool cancelled() const { return cancelled_.load(); }
+
+ private:
+  bool Report(const size_t i, const float fraction_done) {
+    if (cancelled_.load(std::memory_order_relaxed)) return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    fractions_[i] = fraction_done;
+    float sum = 0.0f;
+    for (const float fraction : fractions_) sum += fraction;
+    if (!cancelled_.load() && !progress_(sum / fractions_.size())) {
+      cancelled_.store(true);
+    }
+    return !cancelled_.load();
+  }
+
+  const ProgressCallback& progress_;
+  std::mutex mutex_;
+  std::vector<float> fractions_;
+  std::atomic<bool> cancelled_{false};
+};
+
+// Implements PixelsToPik for several distances. The stages that do not depend
+// on the distance run once on all threads. Each search then starts afresh,
+// because starting from the quantization field of another distance yields
+// larger output (the search mostly raises the quality of its start). The
+// searches run concurrently, each on a single thread, if there are enough to
+// occupy the threads, otherwise one after the other on all threads.
+template <typename Image>
+bool RenditionsToPikT(const CompressParams& orig_params, const Image& image,
+                      const std::vector<float>& distances,
+                      std::vector<PaddedBytes>* compressed,
+                      std::vector<PikInfo>* aux_out) {
+  if (orig_params.lossless || orig_params.effort == 1) {
+    return PIK_FAILURE("Renditions require the butteraugli search");
+  }
+  const CompressParams params = ParamsForEffort(orig_params);
+  if (image.xsize() == 0 || image.ysize() == 0) {
+    return PIK_FAILURE("Empty image");
+  }
+  if (!CheckInitialQuantField(params, image.xsize(), image.ysize())) {
+    return false;
+  }
+  if (!CheckGrayscaleInput(params, image)) return false;
+  if (distances.empty()) return PIK_FAILURE("No distances");
+  for (const float distance : distances) {
+    if (!(distance > 0.0f)) return PIK_FAILURE("Distances must be positive");
+  }
+  const size_t num_renditions = distances.size();
+  compressed->clear();
+  compressed->resize(num_renditions);
+  if (aux_out != nullptr) {
+    aux_out->clear();
+    aux_out->resize(num_renditions);
+  }
+  CallImageArena arena;
+  butteraugli::ImageCacheScope butteraugli_cache;
+  HugePageScope huge_pages(params.huge_page_bytes);
+  butteraugli::HugePageScope butteraugli_huge_pages(params.huge_page_bytes);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  // Does not depend on the distance.
+  PaddedBytes alpha;
+  if (params.alpha_channel && !AlphaToPik(params, image, &pool, &alpha)) {
+    return false;
+  }
+
+  // The shared stages are counted in the first PikInfo.
+  PikInfo* shared_info = aux_out ? &(*aux_out)[0] : nullptr;
+  AllocationTracker shared_tracker(shared_info ? &shared_info->search_memory
+                                               : nullptr);
+  StageTimer shared_timer(shared_info ? &shared_info->search_time : nullptr);
+  Image3F opsin = EncoderOpsin(params, image);
+  const ButteraugliComparator comparator(opsin, &pool);
+  const QuantSearchStart start(opsin, params);
+  const CompressedImage shared =
+      ImageForSearch(std::move(opsin), params, &pool, shared_info);
+  shared_tracker.Stop();
+  shared_timer.Stop();
+
+  SharedProgress shared_progress(params.progress, num_renditions);
+  // Searches rendition "i" on "search_pool" (which may be null) and appends
+  // the header, its color data and the alpha data.
+  const auto search_and_encode = [&](const size_t i, ThreadPool* search_pool) {
+    PikInfo* info = aux_out ? &(*aux_out)[i] : nullptr;
+    CompressParams rendition_params = params;
+    rendition_params.butteraugli_distance = distances[i];
+    rendition_params.progress = shared_progress.ForSearch(i);
+    const Deadline deadline(rendition_params);
+    AllocationTracker search_tracker(info ? &info->search_memory : nullptr);
+    StageTimer search_timer(info ? &info->search_time : nullptr);
+    CompressedImage img = shared.CloneForSearch(search_pool, info);
+    ButteraugliComparator rendition_comparator(comparator, search_pool);
+    FindBestQuantization(&rendition_comparator, start.Copy(), distances[i],
+                         rendition_params, deadline, search_pool, &img, info);
+    search_tracker.Stop();
+    search_timer.Stop();
+    if (deadline.cancelled()) return false;
+    shared_progress.Finish(i);
+
+    PaddedBytes* out = &(*compressed)[i];
+    if (!StorePikHeader(params, image.xsize(), image.ysize(), out)) {
+      return false;
+    }
+    AllocationTracker encode_tracker(info ? &info->encode_memory : nullptr);
+    StageTimer encode_timer(info ? &info->encode_time : nullptr);
+    img.Encode(out);
+    const size_t color_end = out->size();
+    out->resize(color_end + alpha.size());
+    memcpy(out->data() + color_end, alpha.data(), alpha.size());
+    return FinishOutput(params, img.encoded_part_sizes(), color_end, out,
+                        nullptr);
+  };
+
+  std::vector<int> ok(num_renditions, 0);
+  if (num_renditions >= static_cast<size_t>(pool.NumThreads())) {
+    // One search per task: the pool is not reentrant.
+    pool.Run(0, num_renditions, [&](const int i, const int thread) {
+      ok[i] = search_and_encode(i, nullptr);
+    });
   } else {
-    return PIK_FAILURE("Not implemented");
+    for (size_t i = 0; i < num_renditions; ++i) {
+      ok[i] = search_and_encode(i, &pool);
+      if (!ok[i]) break;
+    }
+  }
+  if (shared_progress.cancelled()) return PIK_FAILURE("Cancelled");
+  for (size_t i = 0; i < num_renditions; ++i) {
+    if (!ok[i]) return PIK_FAILURE("Failed to compress a rendition");
   }
+  return true;
+}
 
-  Header header;
-  header.xsize = xsize;
-  header.ysize = ysize;
-  if (params.alpha_channel) {
-    header.flags |= Header::kAlpha;
+bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
+                 const std::vector<float>& distances,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out) {
+  return RenditionsToPikT(params, image, distances, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                 const std::vector<float>& distances,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out) {
+  return RenditionsToPikT(params, linear, distances, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params,
+                 const std::vector<MetaImageB>& images,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out) {
+  return PixelsToPikBatchT(params, images, compressed, aux_out);
+}
+
+bool PixelsToPik(const CompressParams& params,
+                 const std::vector<MetaImageF>& images,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out) {
+  return PixelsToPikBatchT(params, images, compressed, aux_out);
+}
+
+bool OpsinToPik(const CompressParams& params, const Image3F& opsin,
+                PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return IndexedOpsinToPik(params, opsin, nullptr, &pool, compressed,
+                           aux_out);
+}
+
+bool OpsinToPik(const CompressParams& params, Image3F&& opsin,
+                PaddedBytes* compressed, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return IndexedOpsinToPik(params, opsin, &opsin, &pool, compressed,
+                           aux_out);
+}
+
+namespace {
+
+// Encodes the frames of one animation (see PikEncoder::FrameToPik). Keeps the
+// previous frame, whose AC codes and quant field the next one may reference.
+class FrameEncoder {
+ public:
+  void Reset() {
+    previous_.reset();
+    has_ac_codes_ = false;
+    frames_since_search_ = 0;
+  }
+
+  bool Encode(const CompressParams& params, const MetaImageB& image,
+              const uint32_t duration, ThreadPool* pool,
+              PaddedBytes* compressed, PikInfo* aux_out) {
+    if (params.effort != 0) {
+      return Encode(ParamsForEffort(params), image, duration, pool,
+                    compressed, aux_out);
+    }
+    if (image.xsize() == 0 || image.ysize() == 0) {
+      return PIK_FAILURE("Empty image");
+    }
+    if (image.HasAlpha() || params.alpha_channel) {
+      return PIK_FAILURE("Frames with alpha are not supported");
+    }
+    if (!CheckInitialQuantField(params, image.xsize(), image.ysize())) {
+      return false;
+    }
+    if (!CheckGrayscaleInput(params, image)) return false;
+    if (params.butteraugli_distance < 0.0 && params.uniform_quant <= 0.0) {
+      return PIK_FAILURE("Frames require butteraugli_distance or "
+                         "uniform_quant");
+    }
+    // Only a single AC stream with a code set index can reference codes.
+    CompressParams frame_params = params;
+    // Frames are located via their Frame section instead.
+    frame_params.section_index = false;
+    frame_params.ac_groups = false;
+    frame_params.static_ac_codes = true;
+    const bool reuse_quant_field =
+        previous_ != nullptr && previous_->xsize() == image.xsize() &&
+        previous_->ysize() == image.ysize() &&
+        frames_since_search_ + 1 < params.quant_field_frames;
+
+    Image3F opsin = EncoderOpsin(frame_params, image);
+    std::unique_ptr<CompressedImage> img;
+    if (reuse_quant_field || params.butteraugli_distance < 0.0) {
+      AllocationTracker search_tracker(aux_out ? &aux_out->search_memory
+                                               : nullptr);
+      StageTimer search_timer(aux_out ? &aux_out->search_time : nullptr);
+      img.reset(
+          new CompressedImage(opsin.xsize(), opsin.ysize(), pool, aux_out));
+      img->SetInterleavedANS(frame_params.interleaved_ans);
+      img->SetStaticACCodes(true);
+      img->SetGrayscale(frame_params.grayscale);
+      img->SetNaturalCoeffOrder(
+          UsesNaturalCoeffOrder(frame_params, img->xsize(), img->ysize()));
+      img->SetFastClustering(frame_params.fast_clustering);
+      if (reuse_quant_field) {
+        img->UsePreviousQuantField(*previous_);
+      } else {
+        img->quantizer().SetQuant(params.uniform_quant);
+      }
+      img->QuantizeOpsinImage(opsin);
+    } else {
+      bool cancelled;
+      img.reset(new CompressedImage(SearchButteraugliDistance(
+          std::move(opsin), frame_params, pool, aux_out, &cancelled)));
+      if (cancelled) return PIK_FAILURE("Cancelled");
+    }
+    frames_since_search_ = reuse_quant_field ? frames_since_search_ + 1 : 0;
+
+    PaddedBytes frame;
+    if (!StorePikHeader(frame_params, img->xsize(), img->ysize(), &frame)) {
+      return false;
+    }
+    {
+      AllocationTracker encode_tracker(aux_out ? &aux_out->encode_memory
+                                               : nullptr);
+      StageTimer encode_timer(aux_out ? &aux_out->encode_time : nullptr);
+      img->SetACCodes(has_ac_codes_ ? &ac_codes_ : nullptr, &ac_codes_);
+      img->Encode(&frame);
+      img->SetACCodes(nullptr, nullptr);
+    }
+    has_ac_codes_ = true;
+    const uint32_t flags = reuse_quant_field ? Frame::kPreviousQuantField : 0;
+    if (!StoreFrameSection(duration, flags, &frame)) return false;
+    const size_t pos = compressed->size();
+    compressed->resize(pos + frame.size());
+    memcpy(compressed->data() + pos, frame.data(), frame.size());
+    previous_ = std::move(img);
+    return true;
+  }
+
+ private:
+  std::unique_ptr<CompressedImage> previous_;
+  // AC codes of previous_, valid if has_ac_codes_.
+  ACCodes ac_codes_;
+  bool has_ac_codes_ = false;
+  // Number of frames since the last quant field search.
+  int frames_since_search_ = 0;
+};
+
+}  // namespace
+
+struct PikEncoder::Impl {
+  Impl(const int num_threads, const bool pin_threads)
+      : pool(NumThreadsFromParam(num_threads), pin_threads) {}
+
+  ThreadPool pool;
+  ImageArena arena;
+  butteraugli::ImageCache butteraugli_cache;
+  FrameEncoder frames;
+};
+
+PikEncoder::PikEncoder(const int num_threads, const bool pin_threads)
+    : impl_(new Impl(num_threads, pin_threads)) {}
+
+PikEncoder::~PikEncoder() {}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             const MetaImageB& image, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return PixelsToPikT(params, image, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             const Image3B& image, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return PixelsToPikT(params, image, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             const MetaImageF& linear, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return PixelsToPikT(params, linear, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             const Image3F& linear, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return PixelsToPikT(params, linear, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             MetaImageF&& linear, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return MovedPixelsToPikT(params, &linear, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params, Image3F&& linear,
+                             PaddedBytes* compressed, PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return MovedPixelsToPikT(params, &linear, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             Image3SourceU* source, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return SourcePixelsToPik(params, source, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::PixelsToPik(const CompressParams& params,
+                             Image3SourceF* source, PaddedBytes* compressed,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return SourcePixelsToPik(params, source, &impl_->pool, compressed, aux_out);
+}
+
+bool PikEncoder::OpsinToPik(const CompressParams& params, const Image3F& opsin,
+                            PaddedBytes* compressed, PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return IndexedOpsinToPik(params, opsin, nullptr, &impl_->pool, compressed,
+                           aux_out);
+}
+
+bool PikEncoder::OpsinToPik(const CompressParams& params, Image3F&& opsin,
+                            PaddedBytes* compressed, PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return IndexedOpsinToPik(params, opsin, &opsin, &impl_->pool, compressed,
+                           aux_out);
+}
+
+bool PikEncoder::FrameToPik(const CompressParams& params,
+                            const MetaImageB& image, const uint32_t duration,
+                            PaddedBytes* compressed, PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  const butteraugli::ImageCacheScope butteraugli_cache(
+      &impl_->butteraugli_cache);
+  return impl_->frames.Encode(params, image, duration, &impl_->pool,
+                              compressed, aux_out);
+}
+
+void PikEncoder::ResetFrames() { impl_->frames.Reset(); }
+
+bool FramesToPik(const CompressParams& params,
+                 const std::vector<MetaImageB>& frames,
+                 const std::vector<uint32_t>& durations,
+                 PaddedBytes* compressed, PikInfo* aux_out) {
+  if (frames.size() != durations.size()) {
+    return PIK_FAILURE("Number of frames and durations differ");
+  }
+  PikEncoder encoder(params.num_threads, params.pin_threads);
+  compressed->resize(0);
+  for (size_t i = 0; i < frames.size(); ++i) {
+    if (!encoder.FrameToPik(params, frames[i], durations[i], compressed,
+                            aux_out)) {
+      return false;
+    }
   }
-  compressed->resize(MaxCompressedHeaderSize() + compressed_data.size());
-  BitSink sink(compressed->data());
-  if (!StoreHeader(header, &sink)) return false;
-  const size_t header_size = sink.Finalize() - compressed->data();
-  compressed->resize(header_size + compressed_data.size());  // no copy!
-  memcpy(compressed->data() + header_size, compressed_data.data(),
-         compressed_data.size());
   return true;
 }
 
 
-template <typename T>
-bool PikToPixelsT(const DecompressParams& params, const PaddedBytes& compressed,
-                  MetaImage<T>* image, PikInfo* aux_out) {
+// "Output" is either MetaImage<T>, Image3Sink<T>, InterleavedImage<T> or, for
+// grayscale images, Image<T>.
+// Runs on "pool" instead of params.num_threads; "tables" may be null.
+template <class Output>
+bool PikToPixelsT(const DecompressParams& params, ByteSpan compressed,
+                  ThreadPool* pool, DecoderTables* tables, Output* output,
+                  PikInfo* aux_out) {
   if (compressed.size() == 0) {
     return PIK_FAILURE("Empty input.");
   }
-  Image3<T> planes;
-  const uint8_t* const compressed_end = compressed.data() + compressed.size();
+  CallImageArena arena;
+  HugePageScope huge_pages(params.huge_page_bytes);
+  AllocationTracker tracker(aux_out ? &aux_out->decode_memory : nullptr);
+  StageTimer timer(aux_out ? &aux_out->decode_time : nullptr);
+  ThreadPoolRecorder pool_recorder(pool, aux_out);
 
   Header header;
-  BitSource source(compressed.data());
-  if (!LoadHeader(&source, &header)) return false;
-  const uint8_t* const PIK_RESTRICT header_end = source.Finalize();
-  if (header_end > compressed_end) {
-    return PIK_FAILURE("Truncated header.");
+  Sections sections;
+  size_t byte_pos;
+  if (!LoadHeaderAndSections(compressed, &header, &sections, &byte_pos)) {
+    return false;
   }
-  size_t byte_pos = header_end - compressed.data();
+  if (sections.frame != nullptr) {
+    // Only the first frame of an animation; see PikToFrames.
+    if (sections.frame->size > compressed.size() - byte_pos) {
+      return PIK_FAILURE("Truncated frame.");
+    }
+    compressed = ByteSpan(compressed.data(), byte_pos + sections.frame->size);
+  }
+  const uint8_t* const PIK_RESTRICT header_end = compressed.data() + byte_pos;
+  if (!CheckImageSize(params, header)) return false;
 
-  if (header.flags & Header::kWebPLossless) {
-    return PIK_FAILURE("Invalid format code");
-  } else {  // Pik
-    if (header.xsize == 0 || header.ysize == 0) {
-      return PIK_FAILURE("Empty image.");
+  if (params.dc_preview) {
+    if (header.flags & Header::kWebPLossless) {
+      return PIK_FAILURE("No preview of lossless images");
     }
-    static const uint32_t kMaxWidth = (1 << 25) - 1;
-    if (header.xsize > kMaxWidth) {
-      return PIK_FAILURE("Image too wide.");
+    if (params.crop_xsize != 0 && params.crop_ysize != 0) {
+      return PIK_FAILURE("Crop is not supported for previews");
     }
-    uint64_t num_pixels = static_cast<uint64_t>(header.xsize) * header.ysize;
-    if (num_pixels > params.max_num_pixels) {
-      return PIK_FAILURE("Image too big.");
+    CompressedImage img(header.xsize, header.ysize, pool, aux_out);
+    img.SetDecoderTables(tables);
+    img.SetSparseAC(params.sparse_ac);
+    img.SetGrayscale(header.num_components == 1);
+    if (!img.DecodeDC(header_end, compressed.size() - byte_pos)) {
+      return PIK_FAILURE("Pik DC decoding failed.");
     }
-    CompressedImage img(header.xsize, header.ysize, aux_out);
-    size_t bytes_read;
-    if (!img.Decode(header_end, compressed.size() - byte_pos, &bytes_read)) {
-      return PIK_FAILURE("Pik decoding failed.");
+    // The size of the remaining data is unknown, so there is nothing to check.
+    return OutputPreview(img, output);
+  } else if (params.downsampling != 1 && !CheckDownsampling(params, header)) {
+    return false;
+  } else if ((header.flags & Header::kAlpha) && params.downsampling == 1 &&
+             !SupportsAlpha(output)) {
+    return PIK_FAILURE("Unable to output alpha channel");
+  } else if (params.crop_xsize != 0 && params.crop_ysize != 0 &&
+             !SupportsCrop(output)) {
+    return PIK_FAILURE("Unable to output a crop");
+  } else {  // Pik
+    Rect rect = {0, 0, static_cast<int>(header.xsize),
+                 static_cast<int>(header.ysize)};
+    if (params.crop_xsize != 0 && params.crop_ysize != 0) {
+      if (params.crop_x0 >= header.xsize || params.crop_y0 >= header.ysize ||
+          params.crop_xsize > header.xsize - params.crop_x0 ||
+          params.crop_ysize > header.ysize - params.crop_y0) {
+        return PIK_FAILURE("Crop rectangle outside of the image.");
+      }
+      rect = {static_cast<int>(params.crop_x0),
+              static_cast<int>(params.crop_y0),
+              static_cast<int>(params.crop_xsize),
+              static_cast<int>(params.crop_ysize)};
+    }
+    if (header.flags & Header::kWebPLossless) {
+      Image3B srgb(header.xsize, header.ysize);
+      size_t bytes_read;
+      StageTimer entropy_decode_timer(
+          aux_out ? &aux_out->entropy_decode_time : nullptr);
+      if (!PikToLossless(header_end, compressed.size() - byte_pos,
+                         (header.flags & Header::kPalette) != 0, pool,
+                         &bytes_read, &srgb)) {
+        return PIK_FAILURE("Pik lossless decoding failed.");
+      }
+      entropy_decode_timer.Stop();
+      byte_pos += bytes_read;
+      if (!OutputLossless(srgb, rect, output)) {
+        return PIK_FAILURE("Pik output failed.");
+      }
+    } else {
+      CompressedImage img(header.xsize, header.ysize, pool, aux_out);
+      img.SetDecoderTables(tables);
+      img.SetSparseAC(params.sparse_ac);
+      img.SetTiledAC(!params.sparse_ac);
+      img.SetGrayscale(header.num_components == 1);
+      img.SetACGroups((header.flags & Header::kACGroups) != 0);
+      img.SetInterleavedANS((header.flags & Header::kInterleavedANS) != 0);
+      img.SetStaticACCodes((header.flags & Header::kStaticACCodes) != 0);
+      img.SetNaturalCoeffOrder(
+          (header.flags & Header::kNaturalCoeffOrder) != 0);
+      img.SetDecodeBlockRows(
+          rect.y0 / kBlockEdge,
+          (rect.y0 + rect.ysize + kBlockEdge - 1) / kBlockEdge);
+      size_t bytes_read;
+      StageTimer entropy_decode_timer(
+          aux_out ? &aux_out->entropy_decode_time : nullptr);
+      if (!img.Decode(header_end, compressed.size() - byte_pos, &bytes_read)) {
+        return PIK_FAILURE("Pik decoding failed.");
+      }
+      entropy_decode_timer.Stop();
+      byte_pos += bytes_read;
+      StageTimer reconstruct_timer(aux_out ? &aux_out->reconstruct_time
+                                           : nullptr);
+      if (params.downsampling != 1) {
+        if (!OutputScaled(img, params.downsampling, output)) {
+          return PIK_FAILURE("Pik output failed.");
+        }
+      } else if (!OutputColor(img, rect, params.progress, output)) {
+        return PIK_FAILURE("Pik output failed.");
+      }
+      reconstruct_timer.Stop();
     }
-    byte_pos += bytes_read;
-    ToImage3(img, &planes);
-    image->SetColor(std::move(planes));
 
-    if (header.flags & Header::kAlpha) {
-      image->AddAlpha();
+    if ((header.flags & Header::kAlpha) && params.downsampling == 1) {
       size_t bytes_read;
-      if (!PikToAlpha(params, byte_pos, compressed, &bytes_read,
-                      &image->GetAlpha())) {
+      if (!OutputAlpha(params, byte_pos, compressed, header.xsize,
+                       header.ysize, rect, pool, &bytes_read, output)) {
         return false;
       }
       byte_pos += bytes_read;
     }
   }
-  if (params.check_decompressed_size && byte_pos != compressed.size()) {
+  // Without the alpha channel, the size of the remaining data is unknown.
+  const bool skipped_alpha =
+      (header.flags & Header::kAlpha) && params.downsampling != 1;
+  if (params.check_decompressed_size && !skipped_alpha &&
+      byte_pos != compressed.size()) {
     return PIK_FAILURE("Pik compressed data size mismatch.");
   }
   if (aux_out != nullptr) {
@@ -665,26 +3421,60 @@ bool PikToPixelsT(const DecompressParams& params, const PaddedBytes& compressed,
   return true;
 }
 
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  MetaImageB* image, PikInfo* aux_out) {
-  return PikToPixelsT(params, compressed, image, aux_out);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
+}
+
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 InterleavedImageB* image, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
 }
 
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 InterleavedImageU* image, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
+}
+
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  MetaImageU* image, PikInfo* aux_out) {
-  return PikToPixelsT(params, compressed, image, aux_out);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
 }
 
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  MetaImageF* image, PikInfo* aux_out) {
-  return PikToPixelsT(params, compressed, image, aux_out);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
+}
+
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 Image3SinkB* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, sink, aux_out);
+}
+
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 Image3SinkU* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, sink, aux_out);
+}
+
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 Image3SinkF* sink, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, sink, aux_out);
 }
 
 template<typename T>
-bool PikToPixelsT(const DecompressParams& params, const PaddedBytes& compressed,
-                 Image3<T>* image, PikInfo* aux_out) {
+bool PikToPixelsT(const DecompressParams& params, ByteSpan compressed,
+                  ThreadPool* pool, DecoderTables* tables, Image3<T>* image,
+                  PikInfo* aux_out) {
   MetaImage<T> temp;
-  if (!PikToPixelsT(params, compressed, &temp, aux_out)) {
+  if (!PikToPixelsT(params, compressed, pool, tables, &temp, aux_out)) {
     return false;
   }
   if (temp.HasAlpha()) {
@@ -695,19 +3485,325 @@ bool PikToPixelsT(const DecompressParams& params, const PaddedBytes& compressed,
 }
 
 bool PikToPixels(const DecompressParams& params,
-                 const PaddedBytes& compressed,
+                 ByteSpan compressed,
                  Image3B* image, PikInfo* aux_out) {
-  return PikToPixelsT(params, compressed, image, aux_out);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
 }
 bool PikToPixels(const DecompressParams& params,
-                 const PaddedBytes& compressed,
+                 ByteSpan compressed,
                  Image3U* image, PikInfo* aux_out) {
-  return PikToPixelsT(params, compressed, image, aux_out);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
 }
 bool PikToPixels(const DecompressParams& params,
-                 const PaddedBytes& compressed,
+                 ByteSpan compressed,
                  Image3F* image, PikInfo* aux_out) {
-  return PikToPixelsT(params, compressed, image, aux_out);
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, image, aux_out);
+}
+
+template <typename T>
+bool PikToGrayT(const DecompressParams& params, ByteSpan compressed,
+                Image<T>* gray, PikInfo* aux_out) {
+  if (compressed.size() == 0) {
+    return PIK_FAILURE("Empty input.");
+  }
+  Header header;
+  Sections sections;
+  size_t byte_pos;
+  if (!LoadHeaderAndSections(compressed, &header, &sections, &byte_pos)) {
+    return false;
+  }
+  if (header.num_components != 1) {
+    return PIK_FAILURE("Not a grayscale image.");
+  }
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return PikToPixelsT(params, compressed, &pool, nullptr, gray, aux_out);
+}
+
+bool PikToGray(const DecompressParams& params, ByteSpan compressed,
+               ImageB* gray, PikInfo* aux_out) {
+  return PikToGrayT(params, compressed, gray, aux_out);
+}
+
+bool PikToGray(const DecompressParams& params, ByteSpan compressed,
+               ImageU* gray, PikInfo* aux_out) {
+  return PikToGrayT(params, compressed, gray, aux_out);
+}
+
+// Runs on "pool" instead of params.num_threads.
+template <typename T>
+bool IndexedPikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                       ThreadPool* pool, Image<T>* alpha, PikInfo* aux_out) {
+  if (compressed.size() == 0) {
+    return PIK_FAILURE("Empty input.");
+  }
+  Header header;
+  Sections sections;
+  size_t byte_pos;
+  if (!LoadHeaderAndSections(compressed, &header, &sections, &byte_pos)) {
+    return false;
+  }
+  if ((header.flags & Header::kAlpha) == 0) {
+    return PIK_FAILURE("No alpha channel.");
+  }
+  if (!CheckImageSize(params, header)) return false;
+  if (sections.index == nullptr) {
+    return PIK_FAILURE("No index section.");
+  }
+  const Index& index = *sections.index;
+  if (index.DataSize() > compressed.size() - byte_pos) {
+    return PIK_FAILURE("Truncated image data.");
+  }
+  byte_pos += index.AlphaOffset();
+  *alpha = Image<T>(header.xsize, header.ysize);
+  size_t bytes_read;
+  if (!PikToAlpha(params, byte_pos, compressed, pool, &bytes_read, alpha)) {
+    return false;
+  }
+  byte_pos += bytes_read;
+  if (params.check_decompressed_size && byte_pos != compressed.size()) {
+    return PIK_FAILURE("Pik compressed data size mismatch.");
+  }
+  if (aux_out != nullptr) {
+    aux_out->decoded_size = byte_pos;
+  }
+  return true;
+}
+
+bool PikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                ImageB* alpha, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return IndexedPikToAlpha(params, compressed, &pool, alpha, aux_out);
+}
+
+bool PikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                ImageU* alpha, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  return IndexedPikToAlpha(params, compressed, &pool, alpha, aux_out);
+}
+
+// Runs on "pool" instead of params.num_threads. "ac_tables" keep the AC codes
+// from one frame to the next.
+bool PikToFramesT(const DecompressParams& params, ByteSpan compressed,
+                  ThreadPool* pool, DecoderTables* tables,
+                  DecoderTables* ac_tables, std::vector<MetaImageB>* frames,
+                  std::vector<uint32_t>* durations, PikInfo* aux_out) {
+  frames->clear();
+  durations->clear();
+  if (compressed.size() == 0) {
+    return PIK_FAILURE("Empty input.");
+  }
+  CallImageArena arena;
+  HugePageScope huge_pages(params.huge_page_bytes);
+  AllocationTracker tracker(aux_out ? &aux_out->decode_memory : nullptr);
+  StageTimer timer(aux_out ? &aux_out->decode_time : nullptr);
+  ThreadPoolRecorder pool_recorder(pool, aux_out);
+
+  // The first frame must not reference codes of an earlier decode.
+  ac_tables->has_ac_codes = false;
+  std::unique_ptr<CompressedImage> previous;
+  size_t pos = 0;
+  while (pos < compressed.size()) {
+    const ByteSpan rest(compressed.data() + pos, compressed.size() - pos);
+    Header header;
+    Sections sections;
+    size_t byte_pos;
+    if (!LoadHeaderAndSections(rest, &header, &sections, &byte_pos)) {
+      return false;
+    }
+    if (sections.frame == nullptr) {
+      return PIK_FAILURE("Missing frame section.");
+    }
+    const Frame& frame = *sections.frame;
+    if (frame.size > rest.size() - byte_pos) {
+      return PIK_FAILURE("Truncated frame.");
+    }
+    if (header.flags &
+        (Header::kWebPLossless | Header::kAlpha | Header::kACGroups)) {
+      return PIK_FAILURE("Unsupported frame type.");
+    }
+    if (!CheckImageSize(params, header)) return false;
+    std::unique_ptr<CompressedImage> img(
+        new CompressedImage(header.xsize, header.ysize, pool, aux_out));
+    img->SetDecoderTables(tables);
+    img->SetACDecoderTables(ac_tables);
+    img->SetSparseAC(params.sparse_ac);
+    img->SetTiledAC(!params.sparse_ac);
+    img->SetGrayscale(header.num_components == 1);
+    img->SetInterleavedANS((header.flags & Header::kInterleavedANS) != 0);
+    img->SetStaticACCodes((header.flags & Header::kStaticACCodes) != 0);
+    img->SetNaturalCoeffOrder((header.flags & Header::kNaturalCoeffOrder) != 0);
+    if (frame.flags & Frame::kPreviousQuantField) {
+      if (previous == nullptr || previous->xsize() != img->xsize() ||
+          previous->ysize() != img->ysize()) {
+        return PIK_FAILURE("No previous quant field of the same size.");
+      }
+      img->UsePreviousQuantField(*previous);
+    }
+    size_t bytes_read;
+    StageTimer entropy_decode_timer(
+        aux_out ? &aux_out->entropy_decode_time : nullptr);
+    if (!img->Decode(rest.data() + byte_pos, frame.size, &bytes_read)) {
+      return PIK_FAILURE("Pik decoding failed.");
+    }
+    entropy_decode_timer.Stop();
+    if (params.check_decompressed_size && bytes_read != frame.size) {
+      return PIK_FAILURE("Pik compressed data size mismatch.");
+    }
+    StageTimer reconstruct_timer(aux_out ? &aux_out->reconstruct_time
+                                         : nullptr);
+    const Rect rect = {0, 0, img->xsize(), img->ysize()};
+    frames->emplace_back();
+    if (!OutputColor(*img, rect, params.progress, &frames->back())) {
+      return PIK_FAILURE("Pik output failed.");
+    }
+    reconstruct_timer.Stop();
+    durations->push_back(frame.duration);
+    previous = std::move(img);
+    pos += byte_pos + frame.size;
+  }
+  if (aux_out != nullptr) {
+    aux_out->decoded_size = pos;
+  }
+  return true;
+}
+
+bool PikToFrames(const DecompressParams& params, ByteSpan compressed,
+                 std::vector<MetaImageB>* frames,
+                 std::vector<uint32_t>* durations, PikInfo* aux_out) {
+  ThreadPool pool(NumThreadsFromParam(params.num_threads), params.pin_threads);
+  DecoderTables ac_tables;
+  return PikToFramesT(params, compressed, &pool, nullptr, &ac_tables, frames,
+                      durations, aux_out);
+}
+
+struct PikDecoder::Impl {
+  Impl(const int num_threads, const bool pin_threads)
+      : pool(NumThreadsFromParam(num_threads), pin_threads) {}
+
+  ThreadPool pool;
+  ImageArena arena;
+  DecoderTables tables;
+  DecoderTables ac_tables;
+};
+
+PikDecoder::PikDecoder(const int num_threads, const bool pin_threads)
+    : impl_(new Impl(num_threads, pin_threads)) {}
+
+PikDecoder::~PikDecoder() {}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, MetaImageB* image,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, Image3B* image,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed,
+                             InterleavedImageB* image, PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed,
+                             InterleavedImageU* image, PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, MetaImageU* image,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, Image3U* image,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, MetaImageF* image,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, Image3F* image,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, image,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, Image3SinkB* sink,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, sink,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, Image3SinkU* sink,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, sink,
+                      aux_out);
+}
+
+bool PikDecoder::PikToPixels(const DecompressParams& params,
+                             ByteSpan compressed, Image3SinkF* sink,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToPixelsT(params, compressed, &impl_->pool, &impl_->tables, sink,
+                      aux_out);
+}
+
+bool PikDecoder::PikToAlpha(const DecompressParams& params,
+                            ByteSpan compressed, ImageB* alpha,
+                            PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return IndexedPikToAlpha(params, compressed, &impl_->pool, alpha, aux_out);
+}
+
+bool PikDecoder::PikToAlpha(const DecompressParams& params,
+                            ByteSpan compressed, ImageU* alpha,
+                            PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return IndexedPikToAlpha(params, compressed, &impl_->pool, alpha, aux_out);
+}
+
+bool PikDecoder::PikToFrames(const DecompressParams& params,
+                             ByteSpan compressed,
+                             std::vector<MetaImageB>* frames,
+                             std::vector<uint32_t>* durations,
+                             PikInfo* aux_out) {
+  const ImageArenaScope arena(&impl_->arena);
+  return PikToFramesT(params, compressed, &impl_->pool, &impl_->tables,
+                      &impl_->ac_tables, frames, durations, aux_out);
 }
 
 }  // namespace pik
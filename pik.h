@@ -15,7 +15,11 @@
 #ifndef PIK_H_
 #define PIK_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "image.h"
 #include "pik_info.h"
@@ -25,6 +29,23 @@
 
 namespace pik {
 
+// Thread safety: all functions below are re-entrant and may be called
+// concurrently from any number of threads, as long as the calls do not share
+// outputs or PikEncoder/PikDecoder instances. The constant tables they use
+// (quantization, gamma and butteraugli lookup tables, DCT dispatch) are built
+// during static initialization, hence the first calls do not wait for each
+// other; the functions must not be called from static initializers. Freed
+// images are only cached per call or PikEncoder/PikDecoder session (see
+// ImageArena and butteraugli::ImageCache), hence concurrent calls share no
+// locks; only the threads of one call contend for its cache.
+
+// Returns whether the CPU supports the instruction sets the codec requires.
+// The hot kernels are compiled for several instruction sets and selected at
+// runtime (see kernel_targets.h); everything else is compiled for SSE4
+// (SIMD_FLAGS in the Makefile), hence the functions below must not be called
+// unless this returns true.
+bool CpuSupportsCodec();
+
 // The input image is an 8-bit sRGB image.
 bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
                  PaddedBytes* compressed, PikInfo* aux_out);
@@ -36,29 +57,279 @@ bool PixelsToPik(const CompressParams& params, const MetaImageF& linear,
                  PaddedBytes* compressed, PikInfo* aux_out);
 bool PixelsToPik(const CompressParams& params, const Image3F& linear,
                  PaddedBytes* compressed, PikInfo* aux_out);
+// Same as above, but converts "linear" in place and may keep its planes
+// instead of copying them; its pixels are unspecified afterwards.
+bool PixelsToPik(const CompressParams& params, MetaImageF&& linear,
+                 PaddedBytes* compressed, PikInfo* aux_out);
+bool PixelsToPik(const CompressParams& params, Image3F&& linear,
+                 PaddedBytes* compressed, PikInfo* aux_out);
+
+// The input image is a 16-bit sRGB image read from "source" (e.g. PngSource)
+// in bands, as with ReadImage(ImageFormatPNG, ..., Image3U*). With
+// uniform_quant, each band is encoded as soon as it is read and the image is
+// never stored. Alpha is not supported.
+bool PixelsToPik(const CompressParams& params, Image3SourceU* source,
+                 PaddedBytes* compressed, PikInfo* aux_out);
+// Same as above for a linear RGB source (e.g. JpegSource).
+bool PixelsToPik(const CompressParams& params, Image3SourceF* source,
+                 PaddedBytes* compressed, PikInfo* aux_out);
+
+// Same as the corresponding functions above, but pass the output to "sink" in
+// order. With uniform_quant or fast_mode (and without section_index), the
+// header, Y to B, quantization and DC parts are written before the AC
+// coefficients are encoded; other modes write everything at the end.
+bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
+                 ByteSink* sink, PikInfo* aux_out);
+bool PixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                 ByteSink* sink, PikInfo* aux_out);
+bool PixelsToPik(const CompressParams& params, Image3SourceU* source,
+                 ByteSink* sink, PikInfo* aux_out);
+bool PixelsToPik(const CompressParams& params, Image3SourceF* source,
+                 ByteSink* sink, PikInfo* aux_out);
+
+// Compresses a batch of images with the same "params". Up to
+// params.num_threads images are compressed concurrently, each on a single
+// thread. "compressed" and "aux_out" (unless null) receive one entry per
+// image. Returns false if any image failed to compress.
+bool PixelsToPik(const CompressParams& params,
+                 const std::vector<MetaImageB>& images,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out);
+bool PixelsToPik(const CompressParams& params,
+                 const std::vector<MetaImageF>& linear_images,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out);
+
+// Compresses "image" once per butteraugli distance in "distances" (in any
+// order) into the corresponding entry of "compressed" and "aux_out" (unless
+// null), ignoring params.butteraugli_distance, target_bitrate and
+// uniform_quant. The opsin image, its DCT, the butteraugli reference and the
+// Y-to-blue correlation are computed once (and counted in the first PikInfo),
+// and the alpha channel is encoded once. Each search starts as in a separate
+// encode, hence each output equals that of PixelsToPik at its distance. The
+// searches run concurrently, each on a single thread, if there are at least
+// as many distances as params.num_threads, otherwise one after the other.
+// params.progress receives the mean fraction done of all searches and may
+// cancel all of them; deadline_seconds applies to each. Not supported with
+// lossless or effort 1 (fast_mode).
+bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
+                 const std::vector<float>& distances,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out);
+bool PixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                 const std::vector<float>& distances,
+                 std::vector<PaddedBytes>* compressed,
+                 std::vector<PikInfo>* aux_out);
 
 // The input image is an opsin dynamics image.
 bool OpsinToPik(const CompressParams& params, const Image3F& opsin,
                 PaddedBytes* compressed, PikInfo* aux_out);
+// Same as above, but may keep the planes of "opsin" instead of copying them.
+bool OpsinToPik(const CompressParams& params, Image3F&& opsin,
+                PaddedBytes* compressed, PikInfo* aux_out);
+
+// Replaces "compressed" with an animation of "frames", each shown for the
+// corresponding number of milliseconds in "durations". Each frame is coded
+// like an image with a Frame section, and may reuse the AC entropy codes and
+// (see CompressParams::quant_field_frames) the quant field of the previous
+// one. Requires butteraugli_distance or uniform_quant; frames cannot have
+// alpha. PikToPixels decodes only the first frame.
+bool FramesToPik(const CompressParams& params,
+                 const std::vector<MetaImageB>& frames,
+                 const std::vector<uint32_t>& durations,
+                 PaddedBytes* compressed, PikInfo* aux_out);
+
+// Same as the above functions, but for a stream of images (of any size):
+// keeps the worker threads and the memory of freed images, including those
+// of the butteraugli search, alive from one call to the next. Not
+// thread-safe; use one PikEncoder per encoding thread.
+class PikEncoder {
+ public:
+  // Like CompressParams::num_threads and pin_threads, which the methods below
+  // ignore.
+  explicit PikEncoder(int num_threads, bool pin_threads = false);
+  ~PikEncoder();
+
+  PikEncoder(const PikEncoder&) = delete;
+  PikEncoder& operator=(const PikEncoder&) = delete;
 
+  bool PixelsToPik(const CompressParams& params, const MetaImageB& image,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, const Image3B& image,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, const MetaImageF& linear,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, const Image3F& linear,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, MetaImageF&& linear,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, Image3F&& linear,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, Image3SourceU* source,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool PixelsToPik(const CompressParams& params, Image3SourceF* source,
+                   PaddedBytes* compressed, PikInfo* aux_out);
+  bool OpsinToPik(const CompressParams& params, const Image3F& opsin,
+                  PaddedBytes* compressed, PikInfo* aux_out);
+  bool OpsinToPik(const CompressParams& params, Image3F&& opsin,
+                  PaddedBytes* compressed, PikInfo* aux_out);
+
+  // Appends "image" as the next frame of an animation (see FramesToPik) to
+  // "compressed". The previous frame of this encoder, if any, stays alive for
+  // referencing its codes and quant field until ResetFrames(), which starts a
+  // new animation.
+  bool FrameToPik(const CompressParams& params, const MetaImageB& image,
+                  uint32_t duration, PaddedBytes* compressed,
+                  PikInfo* aux_out);
+  void ResetFrames();
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+
+// "compressed" need not be padded (only the header is read from a padded copy
+// of its first bytes), so it may also point to e.g. a memory-mapped file.
 
 // The output image is an 8-bit sRGB image.
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  MetaImageB* image, PikInfo* aux_out);
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  Image3B* image, PikInfo* aux_out);
 
+// Caller-provided buffer for interleaved sRGB output with 8-bit (T = uint8_t)
+// or 16-bit (T = uint16_t) samples.
+template <typename T>
+struct InterleavedImage {
+  T* pixels = nullptr;  // Not owned.
+  size_t size = 0;      // Bytes available at "pixels".
+  // Bytes per row, a multiple of sizeof(T); zero means the minimum.
+  size_t stride = 0;
+  // 3 for RGB, 4 for RGBA. Alpha is opaque unless the image has alpha.
+  int num_channels = 3;
+  // Whether to store BGR or BGRA instead.
+  bool bgr = false;
+
+  // Set by PikToPixels to the dimensions of the decoded image (or crop).
+  size_t xsize = 0;
+  size_t ysize = 0;
+};
+
+using InterleavedImageB = InterleavedImage<uint8_t>;
+using InterleavedImageU = InterleavedImage<uint16_t>;
+
+// The output image is an interleaved sRGB image written directly to the
+// caller's buffer; fails if "image" is too small for it. Avoids the planar
+// intermediate images of the other overloads.
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 InterleavedImageB* image, PikInfo* aux_out);
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 InterleavedImageU* image, PikInfo* aux_out);
+
 // The output image is a 16-bit sRGB image.
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  MetaImageU* image, PikInfo* aux_out);
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  Image3U* image, PikInfo* aux_out);
 
 // The output image is a linear (gamma expanded) sRGB image.
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  MetaImageF* image, PikInfo* aux_out);
-bool PikToPixels(const DecompressParams& params, const PaddedBytes& compressed,
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
                  Image3F* image, PikInfo* aux_out);
+
+// Streaming variants of the above: the output is passed to "sink" in bands of
+// 64 rows as soon as they are decoded, so the caller never needs to hold the
+// whole image. Fails for images with alpha.
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 Image3SinkB* sink, PikInfo* aux_out);
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 Image3SinkU* sink, PikInfo* aux_out);
+bool PikToPixels(const DecompressParams& params, ByteSpan compressed,
+                 Image3SinkF* sink, PikInfo* aux_out);
+
+// Decodes an image compressed with CompressParams::grayscale to one plane of
+// 8-bit or 16-bit sRGB samples; fails for color images.
+bool PikToGray(const DecompressParams& params, ByteSpan compressed,
+               ImageB* gray, PikInfo* aux_out);
+bool PikToGray(const DecompressParams& params, ByteSpan compressed,
+               ImageU* gray, PikInfo* aux_out);
+
+// Decodes only the alpha channel, which requires an image compressed with
+// CompressParams::alpha_channel and section_index; the color data is skipped.
+bool PikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                ImageB* alpha, PikInfo* aux_out);
+bool PikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                ImageU* alpha, PikInfo* aux_out);
+
+// Decodes all frames of the output of FramesToPik and their durations.
+// Ignores the crop, downsampling and preview options.
+bool PikToFrames(const DecompressParams& params, ByteSpan compressed,
+                 std::vector<MetaImageB>* frames,
+                 std::vector<uint32_t>* durations, PikInfo* aux_out);
+
+// Same as the above functions, but for a stream of images: keeps the worker
+// threads, the entropy decoding tables and the memory of freed images alive
+// from one call to the next. Not thread-safe; use one PikDecoder per decoding
+// thread.
+class PikDecoder {
+ public:
+  // Like DecompressParams::num_threads and pin_threads, which the methods
+  // below ignore.
+  explicit PikDecoder(int num_threads, bool pin_threads = false);
+  ~PikDecoder();
+
+  PikDecoder(const PikDecoder&) = delete;
+  PikDecoder& operator=(const PikDecoder&) = delete;
+
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, MetaImageB* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, Image3B* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, InterleavedImageB* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, InterleavedImageU* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, MetaImageU* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, Image3U* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, MetaImageF* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, Image3F* image,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, Image3SinkB* sink,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, Image3SinkU* sink,
+                   PikInfo* aux_out);
+  bool PikToPixels(const DecompressParams& params,
+                   ByteSpan compressed, Image3SinkF* sink,
+                   PikInfo* aux_out);
+
+  bool PikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                  ImageB* alpha, PikInfo* aux_out);
+  bool PikToAlpha(const DecompressParams& params, ByteSpan compressed,
+                  ImageU* alpha, PikInfo* aux_out);
+
+  bool PikToFrames(const DecompressParams& params,
+                   ByteSpan compressed, std::vector<MetaImageB>* frames,
+                   std::vector<uint32_t>* durations, PikInfo* aux_out);
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
 }  // namespace pik
 
 #endif  // PIK_H_
@@ -14,15 +14,20 @@
 
 #include "pik_alpha.h"
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "brotli/decode.h"
 #include "brotli/encode.h"
+#include "opsin_codec.h"
+#include "simd/simd.h"
+#include "status.h"
 
 namespace pik {
 namespace {
 
-bool BrotliDecompress(const std::vector<uint8_t>& in,
+bool BrotliDecompress(const uint8_t* in, size_t insize,
                       size_t max_output_size,
                       size_t* bytes_read,
                       std::vector<uint8_t>* out) {
@@ -33,9 +38,8 @@ bool BrotliDecompress(const std::vector<uint8_t>& in,
   const size_t kBufferSize = 128 * 1024;
   uint8_t* temp_buffer = reinterpret_cast<uint8_t*>(malloc(kBufferSize));
 
-  size_t insize = in.size();
   size_t avail_in = insize;
-  const uint8_t* next_in = &in[0];
+  const uint8_t* next_in = in;
   BrotliDecoderResult code;
 
   while (1) {
@@ -123,33 +127,277 @@ std::vector<uint8_t> DeltaDecode(const std::vector<uint8_t>& in, int stride) {
   return result;
 }
 
+// Format tags stored in the first byte: the codec combined with the stride
+// (bytes per sample) of the original 8 or 16-bit samples.
+const uint8_t kAlphaBrotli = 0x00;
+const uint8_t kAlphaANS = 0x80;
+// Followed by the value of all samples (stride bytes, little-endian).
+const uint8_t kAlphaConstant = 0x40;
+// Followed by two values and a plane that selects between them.
+const uint8_t kAlphaTwoLevels = 0xC0;
+const uint8_t kAlphaCodecMask = 0xC0;
+// Rows per independently coded group of the ANS planes.
+const int kAlphaGroupRows = 64;
+
+// Returns whether the samples of "plane", reinterpreted as U, take at most two
+// values, and if so sets *first and *second to them (equal if constant). Stops
+// at the first sample with a third value.
+template <typename U, typename T>
+bool FindTwoLevels(const Image<T>& plane, U* PIK_RESTRICT first,
+                   U* PIK_RESTRICT second) {
+  static_assert(sizeof(U) == sizeof(T), "U must have the size of T");
+  using namespace SIMD_NAMESPACE;
+  using V = vec<U>;
+  constexpr size_t N = NumLanes<V>();
+  const size_t xsize = plane.xsize();
+  if (xsize == 0 || plane.ysize() == 0) return false;
+  *first = *second = *reinterpret_cast<const U*>(plane.Row(0));
+  bool have_second = false;
+  const auto scalar_visit = [&](const U* PIK_RESTRICT row, const size_t x_begin,
+                                const size_t x_end) {
+    for (size_t x = x_begin; x < x_end; ++x) {
+      if (row[x] == *first || row[x] == *second) continue;
+      if (have_second) return false;
+      *second = row[x];
+      have_second = true;
+    }
+    return true;
+  };
+  const V first_v = set1(V(), *first);
+  V second_v = first_v;
+  const V all_ones = set1(V(), static_cast<U>(~U(0)));
+  for (size_t y = 0; y < plane.ysize(); ++y) {
+    const U* PIK_RESTRICT row = reinterpret_cast<const U*>(plane.Row(y));
+    size_t x = 0;
+    for (; x + N <= xsize; x += N) {
+      const V v = load(V(), row + x);
+      const V either = (v == first_v) | (v == second_v);
+      if (ext::all_zero(andnot(either, all_ones))) continue;
+      if (!scalar_visit(row, x, x + N)) return false;
+      second_v = set1(V(), *second);
+    }
+    if (!scalar_visit(row, x, xsize)) return false;
+  }
+  return true;
+}
+
+int BrotliQuality(const CompressParams& params) {
+  if (params.alpha_effort >= 2) return std::min(params.alpha_effort, 11);
+  return params.fast_mode ? 9 : 11;
+}
+
+// How the selector plane of kAlphaTwoLevels is stored (one byte after the
+// levels).
+const uint8_t kSelectorBrotli = 0;  // Bit-packed rows XORed with the previous.
+const uint8_t kSelectorANS = 1;     // 1-bit EncodeAlphaPlane.
+
+// Returns bit-packed rows of "selector", each XORed with the previous one.
+std::vector<uint8_t> PackSelector(const ImageU& selector) {
+  const size_t row_bytes = (selector.xsize() + 7) / 8;
+  std::vector<uint8_t> packed(row_bytes * selector.ysize());
+  for (size_t y = 0; y < selector.ysize(); ++y) {
+    const uint16_t* PIK_RESTRICT row = selector.ConstRow(y);
+    uint8_t* PIK_RESTRICT row_out = packed.data() + y * row_bytes;
+    for (size_t x = 0; x < selector.xsize(); ++x) {
+      row_out[x / 8] |= row[x] << (x % 8);
+    }
+  }
+  // Bottom-up so that each row is XORed with the unmodified previous one.
+  for (size_t i = packed.size(); i > row_bytes; --i) {
+    packed[i - 1] ^= packed[i - 1 - row_bytes];
+  }
+  return packed;
+}
+
+// Inverse of PackSelector; returns false if "packed" has the wrong size.
+bool UnpackSelector(std::vector<uint8_t>* packed, ImageU* selector) {
+  const size_t row_bytes = (selector->xsize() + 7) / 8;
+  if (packed->size() != row_bytes * selector->ysize()) return false;
+  for (size_t y = 0; y < selector->ysize(); ++y) {
+    uint8_t* PIK_RESTRICT row = packed->data() + y * row_bytes;
+    if (y != 0) {
+      for (size_t i = 0; i < row_bytes; ++i) {
+        row[i] ^= row[i - row_bytes];
+      }
+    }
+    uint16_t* PIK_RESTRICT row_out = selector->Row(y);
+    for (size_t x = 0; x < selector->xsize(); ++x) {
+      row_out[x] = (row[x / 8] >> (x % 8)) & 1;
+    }
+  }
+  return true;
+}
+
+// Stores a plane whose samples (reinterpreted as U) are all "first" or the
+// other of two levels, which have the 8 or 16-bit values "samples" (of size
+// "stride"). If both values are equal, only the constant is stored.
+template <typename U, typename T>
+bool EncodeTwoLevels(const CompressParams& params, const Image<T>& plane,
+                     const U first, const uint16_t samples[2],
+                     const size_t stride, ThreadPool* pool, size_t* bytepos,
+                     PaddedBytes* compressed) {
+  std::vector<uint8_t> selector_bytes;
+  uint8_t tag = kAlphaConstant;
+  if (samples[0] != samples[1]) {
+    ImageU selector(plane.xsize(), plane.ysize());
+    for (size_t y = 0; y < plane.ysize(); ++y) {
+      const U* PIK_RESTRICT row = reinterpret_cast<const U*>(plane.Row(y));
+      uint16_t* PIK_RESTRICT row_out = selector.Row(y);
+      for (size_t x = 0; x < plane.xsize(); ++x) {
+        row_out[x] = row[x] != first;
+      }
+    }
+    if (params.alpha_effort == 1) {
+      const std::string ans =
+          EncodeAlphaPlane(selector, 1, kAlphaGroupRows, pool, nullptr);
+      selector_bytes.push_back(kSelectorANS);
+      selector_bytes.insert(selector_bytes.end(), ans.begin(), ans.end());
+    } else {
+      selector_bytes.push_back(kSelectorBrotli);
+      if (!BrotliCompress(BrotliQuality(params), PackSelector(selector),
+                          &selector_bytes)) {
+        return false;
+      }
+    }
+    tag = kAlphaTwoLevels;
+  }
+  const size_t num_levels = tag == kAlphaConstant ? 1 : 2;
+  const size_t size = 1 + num_levels * stride + selector_bytes.size();
+  compressed->resize(*bytepos + size);
+  uint8_t* out = compressed->data() + *bytepos;
+  *out++ = tag | stride;
+  for (size_t i = 0; i < num_levels; ++i) {
+    for (size_t b = 0; b < stride; ++b) {
+      *out++ = (samples[i] >> (8 * b)) & 255;
+    }
+  }
+  memcpy(out, selector_bytes.data(), selector_bytes.size());
+  *bytepos += size;
+  return true;
+}
+
 bool EncodeAlpha(const std::vector<uint8_t>& data, size_t stride,
     const CompressParams& params, size_t* bytepos, PaddedBytes* compressed) {
   std::vector<uint8_t> delta = DeltaEncode(data, stride);
   std::vector<uint8_t> brotli;
-  int quality = params.fast_mode ? 9 : 11;
-  if (!BrotliCompress(quality, delta, &brotli)) return false;
+  if (!BrotliCompress(BrotliQuality(params), delta, &brotli)) return false;
   compressed->resize(*bytepos + 1 + brotli.size());
-  compressed->data()[*bytepos] = stride;
+  compressed->data()[*bytepos] = kAlphaBrotli | stride;
   memcpy(compressed->data() + *bytepos + 1, brotli.data(), brotli.size());
   *bytepos += brotli.size() + 1;
   return true;
 }
 
+bool EncodeAlphaANS(const ImageU& plane, size_t stride, ThreadPool* pool,
+                    size_t* bytepos, PaddedBytes* compressed) {
+  const std::string ans = EncodeAlphaPlane(plane, 8 * stride, kAlphaGroupRows,
+                                           pool, nullptr);
+  compressed->resize(*bytepos + 1 + ans.size());
+  compressed->data()[*bytepos] = kAlphaANS | stride;
+  memcpy(compressed->data() + *bytepos + 1, ans.data(), ans.size());
+  *bytepos += ans.size() + 1;
+  return true;
+}
+
+// Reads the tag at "bytepos"; returns false if it is invalid.
+bool ReadAlphaTag(size_t bytepos, ByteSpan compressed, uint8_t* codec,
+                  size_t* cstride) {
+  if (bytepos + 1 >= compressed.size()) return false;
+  const uint8_t tag = compressed.data()[bytepos];
+  *codec = tag & kAlphaCodecMask;
+  *cstride = tag & ~kAlphaCodecMask;
+  return *cstride == 1 || *cstride == 2;
+}
+
+// Returns the value of the "cstride"-byte sample at "bytes".
+uint16_t ReadAlphaSample(const uint8_t* bytes, size_t cstride) {
+  return cstride == 1 ? bytes[0] : bytes[0] + (bytes[1] << 8);
+}
+
+// Converts 8 or 16-bit samples with stride "cstride" to the sample types of
+// PikToAlpha, as the Brotli decoder does.
+uint8_t ConvertSample(const uint16_t sample, const size_t cstride, uint8_t*) {
+  return cstride == 2 ? sample >> 8 : sample;
+}
+uint16_t ConvertSample(const uint16_t sample, const size_t cstride,
+                       uint16_t*) {
+  return cstride == 1 ? sample * 257 : sample;
+}
+float ConvertSample(const uint16_t sample, const size_t cstride, float*) {
+  return cstride == 2 ? sample / 257.0f : sample;
+}
+
+// Decodes the ANS or two-level codecs into 16-bit "plane" and sets *cstride to
+// the stride (bytes per sample) of the original samples.
+bool DecodeAlphaSamples(const DecompressParams& params, size_t bytepos,
+                        ByteSpan compressed, ThreadPool* pool,
+                        size_t* bytes_read, size_t* cstride, ImageU* plane) {
+  uint8_t codec;
+  if (!ReadAlphaTag(bytepos, compressed, &codec, cstride)) {
+    return PIK_FAILURE("Invalid alpha codec.");
+  }
+  ++bytepos;
+  if (codec == kAlphaANS) {
+    if (!DecodeAlphaPlane(compressed.data() + bytepos,
+                          compressed.size() - bytepos, 8 * *cstride,
+                          kAlphaGroupRows, pool, plane, bytes_read)) {
+      return false;
+    }
+    *bytes_read += 1;  // tag
+    return true;
+  }
+  if (codec != kAlphaTwoLevels) return PIK_FAILURE("Invalid alpha codec.");
+  if (bytepos + 2 * *cstride + 1 > compressed.size()) return false;
+  uint16_t levels[2];
+  for (int i = 0; i < 2; ++i) {
+    levels[i] = ReadAlphaSample(compressed.data() + bytepos, *cstride);
+    bytepos += *cstride;
+  }
+  const uint8_t selector_codec = compressed.data()[bytepos++];
+  if (selector_codec == kSelectorANS) {
+    if (!DecodeAlphaPlane(compressed.data() + bytepos,
+                          compressed.size() - bytepos, 1, kAlphaGroupRows,
+                          pool, plane, bytes_read)) {
+      return false;
+    }
+  } else if (selector_codec == kSelectorBrotli) {
+    std::vector<uint8_t> packed;
+    const size_t packed_size = (plane->xsize() + 7) / 8 * plane->ysize();
+    if (!BrotliDecompress(compressed.data() + bytepos,
+                          compressed.size() - bytepos, packed_size,
+                          bytes_read, &packed) ||
+        !UnpackSelector(&packed, plane)) {
+      return false;
+    }
+  } else {
+    return PIK_FAILURE("Invalid alpha selector codec.");
+  }
+  *bytes_read += 2 + 2 * *cstride;  // tag, levels, selector codec
+  for (size_t y = 0; y < plane->ysize(); ++y) {
+    uint16_t* PIK_RESTRICT row = plane->Row(y);
+    for (size_t x = 0; x < plane->xsize(); ++x) {
+      row[x] = levels[row[x]];
+    }
+  }
+  return true;
+}
+
 bool DecodeAlpha(size_t stride, size_t num_pixels,
                  const DecompressParams& params, size_t bytepos,
-                 const PaddedBytes& compressed,
+                 ByteSpan compressed,
                  size_t* bytes_read, std::vector<uint8_t>* result) {
   if (bytepos + 1 >= compressed.size()) return false;
   size_t cstride = compressed.data()[bytepos++];
-  std::vector<uint8_t> data(compressed.data() + bytepos,
-      compressed.data() + compressed.size());
+  if (cstride != 1 && cstride != 2) return false;
   std::vector<uint8_t> delta;
-  if (!BrotliDecompress(data, num_pixels * cstride, bytes_read, &delta)) {
+  if (!BrotliDecompress(compressed.data() + bytepos,
+                        compressed.size() - bytepos, num_pixels * cstride,
+                        bytes_read, &delta)) {
     return false;
   }
+  *bytes_read += 1;  // stride
   if (delta.size() != num_pixels * cstride) return false;
-  data = DeltaDecode(delta, cstride);
+  std::vector<uint8_t> data = DeltaDecode(delta, cstride);
   if (stride == cstride) {
     result->swap(data);
   } else if (stride == 1 && cstride == 2) {
@@ -169,10 +417,78 @@ bool DecodeAlpha(size_t stride, size_t num_pixels,
 
   return true;
 }
+
+template <typename T>
+bool ConstantAlpha(size_t bytepos, ByteSpan compressed, size_t* bytes_read,
+                   T* value) {
+  uint8_t codec;
+  size_t cstride;
+  if (!ReadAlphaTag(bytepos, compressed, &codec, &cstride) ||
+      codec != kAlphaConstant || bytepos + 1 + cstride > compressed.size()) {
+    return false;
+  }
+  const uint16_t sample =
+      ReadAlphaSample(compressed.data() + bytepos + 1, cstride);
+  *value = ConvertSample(sample, cstride, value);
+  *bytes_read = 1 + cstride;
+  return true;
+}
+
+// Decodes any codec but Brotli (checked by the caller) into "plane".
+template <typename T>
+bool DecodeAlphaToPlane(const DecompressParams& params, size_t bytepos,
+                        ByteSpan compressed, ThreadPool* pool,
+                        size_t* bytes_read, Image<T>* plane) {
+  T value;
+  if (ConstantAlpha(bytepos, compressed, bytes_read, &value)) {
+    for (size_t y = 0; y < plane->ysize(); ++y) {
+      T* PIK_RESTRICT row = plane->Row(y);
+      std::fill(row, row + plane->xsize(), value);
+    }
+    return true;
+  }
+  ImageU samples(plane->xsize(), plane->ysize());
+  size_t cstride;
+  if (!DecodeAlphaSamples(params, bytepos, compressed, pool, bytes_read,
+                          &cstride, &samples)) {
+    return false;
+  }
+  for (size_t y = 0; y < plane->ysize(); ++y) {
+    const uint16_t* PIK_RESTRICT row = samples.ConstRow(y);
+    T* PIK_RESTRICT row_out = plane->Row(y);
+    for (size_t x = 0; x < plane->xsize(); ++x) {
+      row_out[x] = ConvertSample(row[x], cstride, row_out);
+    }
+  }
+  return true;
+}
+
+bool IsBrotliAlpha(size_t bytepos, ByteSpan compressed) {
+  return bytepos < compressed.size() &&
+         (compressed.data()[bytepos] & kAlphaCodecMask) == kAlphaBrotli;
+}
+
 }  // namespace
 
-bool AlphaToPik(const CompressParams& params,
-    const ImageB& plane, size_t* bytepos, PaddedBytes* compressed) {
+bool AlphaToPik(const CompressParams& params, const ImageB& plane,
+                ThreadPool* pool, size_t* bytepos, PaddedBytes* compressed) {
+  uint8_t levels[2];
+  if (FindTwoLevels(plane, &levels[0], &levels[1])) {
+    const uint16_t samples[2] = {levels[0], levels[1]};
+    return EncodeTwoLevels(params, plane, levels[0], samples, 1, pool, bytepos,
+                           compressed);
+  }
+  if (params.alpha_effort == 1) {
+    ImageU samples(plane.xsize(), plane.ysize());
+    for (size_t y = 0; y < plane.ysize(); ++y) {
+      auto row = plane.Row(y);
+      auto row_out = samples.Row(y);
+      for (size_t x = 0; x < plane.xsize(); ++x) {
+        row_out[x] = row[x];
+      }
+    }
+    return EncodeAlphaANS(samples, 1, pool, bytepos, compressed);
+  }
   std::vector<uint8_t> data(plane.xsize() * plane.ysize());
   for (size_t y = 0; y < plane.ysize(); ++y) {
     auto row = plane.Row(y);
@@ -183,8 +499,49 @@ bool AlphaToPik(const CompressParams& params,
   return EncodeAlpha(data, 1, params, bytepos, compressed);
 }
 
-bool AlphaToPik(const CompressParams& params,
-    const ImageF& plane, size_t* bytepos, PaddedBytes* compressed) {
+bool AlphaToPik(const CompressParams& params, const ImageF& plane,
+                ThreadPool* pool, size_t* bytepos, PaddedBytes* compressed) {
+  uint32_t levels[2];
+  if (FindTwoLevels(plane, &levels[0], &levels[1])) {
+    uint16_t samples[2];
+    for (int i = 0; i < 2; ++i) {
+      float level;
+      memcpy(&level, &levels[i], sizeof(level));
+      samples[i] = static_cast<uint16_t>(std::round(level * 257.0f));
+    }
+    // Stores 8-bit levels if that is lossless, e.g. for 8-bit inputs.
+    size_t stride = 2;
+    if (samples[0] % 257 == 0 && samples[1] % 257 == 0) {
+      samples[0] /= 257;
+      samples[1] /= 257;
+      stride = 1;
+    }
+    return EncodeTwoLevels(params, plane, levels[0], samples, stride, pool,
+                           bytepos, compressed);
+  }
+  if (params.alpha_effort == 1) {
+    // Stores 8-bit samples if that is lossless, e.g. for 8-bit inputs.
+    ImageU samples(plane.xsize(), plane.ysize());
+    bool is_8bit = true;
+    for (size_t y = 0; y < plane.ysize(); ++y) {
+      auto row = plane.Row(y);
+      auto row_out = samples.Row(y);
+      for (size_t x = 0; x < plane.xsize(); ++x) {
+        row_out[x] = static_cast<uint16_t>(std::round(row[x] * 257.0f));
+        is_8bit &= row_out[x] % 257 == 0;
+      }
+    }
+    if (is_8bit) {
+      for (size_t y = 0; y < plane.ysize(); ++y) {
+        auto row = samples.Row(y);
+        for (size_t x = 0; x < plane.xsize(); ++x) {
+          row[x] /= 257;
+        }
+      }
+    }
+    return EncodeAlphaANS(samples, is_8bit ? 1 : 2, pool, bytepos,
+                          compressed);
+  }
   std::vector<uint8_t> data(plane.xsize() * plane.ysize() * 2);
   for (size_t y = 0; y < plane.ysize(); ++y) {
     auto row = plane.Row(y);
@@ -197,8 +554,16 @@ bool AlphaToPik(const CompressParams& params,
   return EncodeAlpha(data, 2, params, bytepos, compressed);
 }
 
-bool AlphaToPik(const CompressParams& params,
-    const ImageU& plane, size_t* bytepos, PaddedBytes* compressed) {
+bool AlphaToPik(const CompressParams& params, const ImageU& plane,
+                ThreadPool* pool, size_t* bytepos, PaddedBytes* compressed) {
+  uint16_t levels[2];
+  if (FindTwoLevels(plane, &levels[0], &levels[1])) {
+    return EncodeTwoLevels(params, plane, levels[0], levels, 2, pool, bytepos,
+                           compressed);
+  }
+  if (params.alpha_effort == 1) {
+    return EncodeAlphaANS(plane, 2, pool, bytepos, compressed);
+  }
   std::vector<uint8_t> data(plane.xsize() * plane.ysize() * 2);
   for (size_t y = 0; y < plane.ysize(); ++y) {
     auto row = plane.Row(y);
@@ -211,8 +576,12 @@ bool AlphaToPik(const CompressParams& params,
 }
 
 bool PikToAlpha(const DecompressParams& params,
-                size_t bytepos, const PaddedBytes& compressed,
+                size_t bytepos, ByteSpan compressed, ThreadPool* pool,
                 size_t* bytes_read, ImageB* plane) {
+  if (!IsBrotliAlpha(bytepos, compressed)) {
+    return DecodeAlphaToPlane(params, bytepos, compressed, pool, bytes_read,
+                              plane);
+  }
   std::vector<uint8_t> data;
   if (!DecodeAlpha(1, plane->xsize() * plane->ysize(),
                    params, bytepos, compressed, bytes_read, &data)) {
@@ -229,8 +598,12 @@ bool PikToAlpha(const DecompressParams& params,
 }
 
 bool PikToAlpha(const DecompressParams& params,
-                size_t bytepos, const PaddedBytes& compressed,
+                size_t bytepos, ByteSpan compressed, ThreadPool* pool,
                 size_t* bytes_read, ImageF* plane) {
+  if (!IsBrotliAlpha(bytepos, compressed)) {
+    return DecodeAlphaToPlane(params, bytepos, compressed, pool, bytes_read,
+                              plane);
+  }
   std::vector<uint8_t> data;
   if (!DecodeAlpha(2, plane->xsize() * plane->ysize(),
                    params, bytepos, compressed, bytes_read, &data)) {
@@ -249,8 +622,12 @@ bool PikToAlpha(const DecompressParams& params,
 }
 
 bool PikToAlpha(const DecompressParams& params,
-                size_t bytepos, const PaddedBytes& compressed,
+                size_t bytepos, ByteSpan compressed, ThreadPool* pool,
                 size_t* bytes_read, ImageU* plane) {
+  if (!IsBrotliAlpha(bytepos, compressed)) {
+    return DecodeAlphaToPlane(params, bytepos, compressed, pool, bytes_read,
+                              plane);
+  }
   std::vector<uint8_t> data;
   if (!DecodeAlpha(2, plane->xsize() * plane->ysize(),
                    params, bytepos, compressed, bytes_read, &data)) {
@@ -268,4 +645,19 @@ bool PikToAlpha(const DecompressParams& params,
   return true;
 }
 
+bool PikAlphaIsConstant(size_t bytepos, ByteSpan compressed,
+                        size_t* bytes_read, uint8_t* value) {
+  return ConstantAlpha(bytepos, compressed, bytes_read, value);
+}
+
+bool PikAlphaIsConstant(size_t bytepos, ByteSpan compressed,
+                        size_t* bytes_read, float* value) {
+  return ConstantAlpha(bytepos, compressed, bytes_read, value);
+}
+
+bool PikAlphaIsConstant(size_t bytepos, ByteSpan compressed,
+                        size_t* bytes_read, uint16_t* value) {
+  return ConstantAlpha(bytepos, compressed, bytes_read, value);
+}
+
 }  // namespace pik
@@ -20,25 +20,42 @@
 #include "image.h"
 #include "padded_bytes.h"
 #include "pik_params.h"
+#include "thread_pool.h"
 
 namespace pik {
 
-bool AlphaToPik(const CompressParams& params,
-    const ImageB& plane, size_t* bytepos, PaddedBytes* compressed);
-bool AlphaToPik(const CompressParams& params,
-    const ImageF& plane, size_t* bytepos, PaddedBytes* compressed);
-bool AlphaToPik(const CompressParams& params,
-    const ImageU& plane, size_t* bytepos, PaddedBytes* compressed);
-
+// Appends the alpha "plane" at *bytepos of "compressed" and advances
+// *bytepos. The codec is selected by params.alpha_effort; the ANS codec runs
+// on "pool" (may be null).
+bool AlphaToPik(const CompressParams& params, const ImageB& plane,
+                ThreadPool* pool, size_t* bytepos, PaddedBytes* compressed);
+bool AlphaToPik(const CompressParams& params, const ImageF& plane,
+                ThreadPool* pool, size_t* bytepos, PaddedBytes* compressed);
+bool AlphaToPik(const CompressParams& params, const ImageU& plane,
+                ThreadPool* pool, size_t* bytepos, PaddedBytes* compressed);
+
+// Decodes the alpha channel at "bytepos" of "compressed" into "plane" (already
+// sized to the image dimensions), converting the sample type if needed. Sets
+// *bytes_read to the size of the alpha data.
 bool PikToAlpha(const DecompressParams& params,
-                size_t bytepos, const PaddedBytes& compressed,
+                size_t bytepos, ByteSpan compressed, ThreadPool* pool,
                 size_t* bytes_read, ImageB* plane);
 bool PikToAlpha(const DecompressParams& params,
-                size_t bytepos, const PaddedBytes& compressed,
+                size_t bytepos, ByteSpan compressed, ThreadPool* pool,
                 size_t* bytes_read, ImageF* plane);
 bool PikToAlpha(const DecompressParams& params,
-                size_t bytepos, const PaddedBytes& compressed,
+                size_t bytepos, ByteSpan compressed, ThreadPool* pool,
                 size_t* bytes_read, ImageU* plane);
+// Returns whether the alpha data at "bytepos" of "compressed" is a constant
+// (e.g. fully opaque), and if so sets *value to it, converted as in
+// PikToAlpha, and *bytes_read; callers can then fill their output without
+// decoding a plane.
+bool PikAlphaIsConstant(size_t bytepos, ByteSpan compressed,
+                        size_t* bytes_read, uint8_t* value);
+bool PikAlphaIsConstant(size_t bytepos, ByteSpan compressed,
+                        size_t* bytes_read, float* value);
+bool PikAlphaIsConstant(size_t bytepos, ByteSpan compressed,
+                        size_t* bytes_read, uint16_t* value);
 
 }  // namespace pik
 
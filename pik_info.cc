@@ -0,0 +1,143 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pik_info.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <chrono>
+
+#include "status.h"
+
+namespace pik {
+namespace {
+
+double WallSeconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Appends printf-style formatted text to "out".
+void Append(std::string* out, const char* format, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  *out += buf;
+}
+
+void AppendSizeInfo(const char* name, const PikImageSizeInfo& size,
+                    const bool last, std::string* out) {
+  Append(out,
+         "    \"%s\": {\"num_clustered_histograms\": %zu,"
+         " \"histogram_size\": %zu, \"entropy_coded_bits\": %zu,"
+         " \"extra_bits\": %zu, \"total_size\": %zu,"
+         " \"clustered_entropy\": %.6f, \"num_shared_codes\": %zu}%s\n",
+         name, size.num_clustered_histograms, size.histogram_size,
+         size.entropy_coded_bits, size.extra_bits, size.total_size,
+         size.clustered_entropy, size.num_shared_codes, last ? "" : ",");
+}
+
+// "memory" may be null for stages without their own AllocationStats.
+void AppendStage(const char* name, const StageTime& time,
+                 const AllocationStats* memory, const bool last,
+                 std::string* out) {
+  Append(out,
+         "    \"%s\": {\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f,"
+         " \"utilization\": %.4f",
+         name, time.wall_seconds, time.cpu_seconds, time.Utilization());
+  if (memory != nullptr) {
+    Append(out,
+           ", \"allocated_bytes\": %zu, \"num_allocations\": %zu,"
+           " \"peak_live_bytes\": %zu",
+           memory->allocated_bytes, memory->num_allocations,
+           memory->peak_live_bytes);
+  }
+  Append(out, "}%s\n", last ? "" : ",");
+}
+
+}  // namespace
+
+StageTimer::StageTimer(StageTime* time) : time_(time) {
+  if (time_ == nullptr) return;
+  begin_wall_seconds_ = WallSeconds();
+  begin_cpu_ = std::clock();
+}
+
+void StageTimer::Stop() {
+  if (time_ == nullptr) return;
+  time_->wall_seconds += WallSeconds() - begin_wall_seconds_;
+  time_->cpu_seconds +=
+      static_cast<double>(std::clock() - begin_cpu_) / CLOCKS_PER_SEC;
+  time_ = nullptr;
+}
+
+std::string PikInfoToJSON(const PikInfo& info) {
+  std::string out = "{\n  \"sections\": {\n";
+  AppendSizeInfo("ytob", info.ytob_image, false, &out);
+  AppendSizeInfo("quant", info.quant_image, false, &out);
+  AppendSizeInfo("dc", info.dc_image, false, &out);
+  AppendSizeInfo("ac", info.ac_image, false, &out);
+  AppendSizeInfo("total", info.TotalImageSize(), true, &out);
+  out += "  },\n  \"stages\": {\n";
+  AppendStage("opsin", info.opsin_time, &info.opsin_memory, false, &out);
+  AppendStage("search", info.search_time, &info.search_memory, false, &out);
+  AppendStage("encode", info.encode_time, &info.encode_memory, false, &out);
+  AppendStage("decode", info.decode_time, &info.decode_memory, false, &out);
+  AppendStage("entropy_decode", info.entropy_decode_time, nullptr, false,
+              &out);
+  AppendStage("reconstruct", info.reconstruct_time, nullptr, true, &out);
+  Append(&out,
+         "  },\n  \"iterations\": {\"butteraugli\": %d, \"proxy\": %d,"
+         " \"speculative_candidates\": %d, \"size_search_encodes\": %d,"
+         " \"size_search_estimates\": %d},\n",
+         info.num_butteraugli_iters, info.num_proxy_iters,
+         info.num_speculative_candidates, info.num_size_search_encodes,
+         info.num_size_search_estimates);
+  const ThreadPoolStats& pool = info.pool_stats;
+  Append(&out,
+         "  \"thread_pool\": {\"runs\": %llu, \"tasks\": %llu,"
+         " \"stolen_tasks\": %llu, \"serial_tasks\": %llu,"
+         " \"run_seconds\": %.6f, \"idle_seconds\": [",
+         static_cast<unsigned long long>(pool.num_runs),
+         static_cast<unsigned long long>(pool.num_tasks),
+         static_cast<unsigned long long>(pool.num_stolen),
+         static_cast<unsigned long long>(pool.num_serial_tasks),
+         pool.run_seconds);
+  for (size_t i = 0; i < pool.idle_seconds.size(); ++i) {
+    Append(&out, "%s%.6f", i == 0 ? "" : ", ", pool.idle_seconds[i]);
+  }
+  out += "]},\n";
+  Append(&out,
+         "  \"num_threads\": %d,\n  \"deadline_reached\": %s,\n"
+         "  \"decoded_size\": %zu\n}\n",
+         info.num_threads, info.deadline_reached ? "true" : "false",
+         info.decoded_size);
+  return out;
+}
+
+bool WritePikInfoJSON(const PikInfo& info, const char* pathname) {
+  FILE* f = fopen(pathname, "w");
+  if (f == nullptr) {
+    return PIK_FAILURE("Failed to open the PikInfo JSON file.");
+  }
+  const std::string json = PikInfoToJSON(info);
+  const bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+  return (fclose(f) == 0 && ok) ? true
+                                : PIK_FAILURE("Failed to write PikInfo JSON.");
+}
+
+}  // namespace pik
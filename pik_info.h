@@ -15,9 +15,15 @@
 #ifndef PIK_INFO_H_
 #define PIK_INFO_H_
 
+#include <algorithm>
 #include <cstddef>
+#include <ctime>
 #include <string>
 
+#include "cache_aligned.h"
+#include "image.h"
+#include "thread_pool.h"
+
 namespace pik {
 
 struct PikImageSizeInfo {
@@ -28,6 +34,7 @@ struct PikImageSizeInfo {
     extra_bits += victim.extra_bits;
     total_size += victim.total_size;
     clustered_entropy += victim.clustered_entropy;
+    num_shared_codes += victim.num_shared_codes;
   }
   size_t num_clustered_histograms = 0;
   size_t histogram_size = 0;
@@ -35,6 +42,43 @@ struct PikImageSizeInfo {
   size_t extra_bits = 0;
   size_t total_size = 0;
   double clustered_entropy = 0.0f;
+  // Number of streams that reused (some of) the previous frame's codes, see
+  // kPreviousACCodes and kUpdatedACCodes.
+  size_t num_shared_codes = 0;
+};
+
+// Wall and CPU time of a stage [seconds]. The CPU time is that of all threads
+// of the process, hence Utilization() is the average number of busy threads.
+struct StageTime {
+  void Assimilate(const StageTime& victim) {
+    wall_seconds += victim.wall_seconds;
+    cpu_seconds += victim.cpu_seconds;
+  }
+  double Utilization() const {
+    return wall_seconds == 0.0 ? 0.0 : cpu_seconds / wall_seconds;
+  }
+
+  double wall_seconds = 0.0;
+  double cpu_seconds = 0.0;
+};
+
+// Adds the time between construction and destruction (or Stop) to "time"
+// (unless null). Concurrent encodes/decodes are included in the CPU time.
+class StageTimer {
+ public:
+  explicit StageTimer(StageTime* time);
+  ~StageTimer() { Stop(); }
+
+  // Ends the timing before destruction; subsequent calls have no effect.
+  void Stop();
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  StageTime* time_;
+  double begin_wall_seconds_ = 0.0;
+  std::clock_t begin_cpu_ = 0;
 };
 
 // Metadata and statistics gathered during compression or decompression.
@@ -45,6 +89,23 @@ struct PikInfo {
     dc_image.Assimilate(victim.dc_image);
     ac_image.Assimilate(victim.ac_image);
     num_butteraugli_iters += victim.num_butteraugli_iters;
+    num_proxy_iters += victim.num_proxy_iters;
+    num_speculative_candidates += victim.num_speculative_candidates;
+    num_size_search_encodes += victim.num_size_search_encodes;
+    num_size_search_estimates += victim.num_size_search_estimates;
+    deadline_reached |= victim.deadline_reached;
+    opsin_memory.Assimilate(victim.opsin_memory);
+    search_memory.Assimilate(victim.search_memory);
+    encode_memory.Assimilate(victim.encode_memory);
+    decode_memory.Assimilate(victim.decode_memory);
+    opsin_time.Assimilate(victim.opsin_time);
+    search_time.Assimilate(victim.search_time);
+    encode_time.Assimilate(victim.encode_time);
+    decode_time.Assimilate(victim.decode_time);
+    entropy_decode_time.Assimilate(victim.entropy_decode_time);
+    reconstruct_time.Assimilate(victim.reconstruct_time);
+    num_threads = std::max(num_threads, victim.num_threads);
+    pool_stats.Assimilate(victim.pool_stats);
   }
   PikImageSizeInfo TotalImageSize() const {
     PikImageSizeInfo total;
@@ -58,13 +119,53 @@ struct PikInfo {
   PikImageSizeInfo quant_image;
   PikImageSizeInfo dc_image;
   PikImageSizeInfo ac_image;
+  // Iterations of the search loops: butteraugli comparisons (or speculative
+  // rounds), proxy evaluations between comparisons, speculative candidates
+  // and the trial encodings and size estimates of the target size search.
   int num_butteraugli_iters = 0;
+  int num_proxy_iters = 0;
+  int num_speculative_candidates = 0;
+  int num_size_search_encodes = 0;
+  int num_size_search_estimates = 0;
+  // Whether a search stopped early because of CompressParams::deadline_seconds.
+  bool deadline_reached = false;
   size_t decoded_size = 0;
+  // Image memory (CacheAligned allocations) of the conversion to opsin, the
+  // quantization search (or the one-time quantization), the entropy coding
+  // and a whole PikToPixels call.
+  AllocationStats opsin_memory;
+  AllocationStats search_memory;
+  AllocationStats encode_memory;
+  AllocationStats decode_memory;
+  // Time of the same stages; decode_time is further split into the entropy
+  // decoding and the reconstruction of the pixels.
+  StageTime opsin_time;
+  StageTime search_time;
+  StageTime encode_time;
+  StageTime decode_time;
+  StageTime entropy_decode_time;
+  StageTime reconstruct_time;
+  // ThreadPool::NumThreads of the encoder or decoder, i.e. the upper bound of
+  // StageTime::Utilization.
+  int num_threads = 0;
+  // Counters of the encoder's or decoder's ThreadPool during the call; the
+  // share of idle and serial time shows how well the call scales.
+  ThreadPoolStats pool_stats;
+  // Result of the butteraugli search times the target distance, see
+  // CompressParams::initial_quant_field.
+  ImageF quant_field;
   // If not empty, additional debugging information (e.g. debug images) is
   // saved in files with this prefix.
   std::string debug_prefix;
 };
 
+// Returns all of the above except quant_field and debug_prefix as a JSON
+// object, e.g. for shipping to a metrics system.
+std::string PikInfoToJSON(const PikInfo& info);
+
+// Writes PikInfoToJSON(info) to the file "pathname".
+bool WritePikInfoJSON(const PikInfo& info, const char* pathname);
+
 }  // namespace pik
 
 #endif  // PIK_INFO_H_
@@ -2,9 +2,17 @@
 #define PIK_PARAMS_H_
 
 #include <stdint.h>
+#include <functional>
+
+#include "image.h"
 
 namespace pik {
 
+// Receives the estimated fraction of the work done so far, in [0, 1], at the
+// points where a call can stop early; returning false cancels the call, which
+// then fails. Invoked on the calling thread.
+using ProgressCallback = std::function<bool(float fraction_done)>;
+
 struct CompressParams {
   // Only used for benchmarking (comparing vs libjpeg)
   int jpeg_quality = 100;
@@ -22,9 +30,165 @@ struct CompressParams {
   // quality-adjusted-bits-per-pixel metric.
   bool fast_mode = false;
   int max_butteraugli_iters = 100;
+  // If positive, the butteraugli and target_bitrate searches stop after this
+  // many seconds (measured from the start of the search, i.e. after the
+  // conversion to opsin) and encode the current quantization, see
+  // PikInfo::deadline_reached. The target_bitrate search still continues
+  // until the size fits. The fast_mode and uniform_quant paths do not search
+  // and ignore this.
+  double deadline_seconds = 0.0;
+  // If set, invoked before each iteration of the butteraugli search (with the
+  // fraction of max_butteraugli_iters) and each step of the target_bitrate
+  // search (with the fraction of its steps; after the butteraugli search).
+  // The fast_mode, uniform_quant and lossless paths do not search and do not
+  // invoke it.
+  ProgressCallback progress;
+  // If non-zero, selects the encoder stages by a single setting from 1
+  // (fastest: fast_mode, which ignores butteraugli_distance, or the cheapest
+  // search for target_bitrate) to 9 (smallest output), overriding the
+  // corresponding options below: the butteraugli search shortcuts, the
+  // Y-to-blue search, the histogram clustering and size estimates and the
+  // built-in AC codes. Zero uses the options as set.
+  int effort = 0;
+  // If true, butteraugli iterations after the first only re-decode and
+  // re-compare the blocks whose quantization changed (plus a margin for the
+  // blur support). Much faster for large images, but the distance map near
+  // the changed blocks is an approximation.
+  bool incremental_butteraugli = false;
+  // If true, early iterations of the butteraugli search compare 2x
+  // downsampled images until the estimated distance is within a factor of
+  // 1.5 of the target; the remaining iterations use full resolution. Saves
+  // much of the butteraugli time when the initial quantization is far off.
+  bool coarse_butteraugli = false;
+  // If true, the butteraugli search compares the floating-point linear RGB
+  // reconstruction instead of the 8-bit sRGB one, which saves two color
+  // conversions per iteration. The decoder output is 8-bit, so the distances
+  // underestimate the final one (by about 7% at distance 1). Disables
+  // incremental_butteraugli.
+  bool linear_butteraugli = false;
+  // If true, most iterations of the butteraugli search only evaluate a
+  // mask-weighted quantization error that is calibrated per block by the
+  // preceding butteraugli comparison; max_butteraugli_iters then bounds the
+  // number of comparisons.
+  bool proxy_butteraugli = false;
+  // If greater than one, each iteration of the butteraugli search compares
+  // this many candidate quantizations (different numbers of adjustment
+  // steps) in parallel and continues from the best, which reduces the number
+  // of sequential iterations when there are idle cores (by half with 4
+  // candidates), but the output is a few percent larger. Ignores the other
+  // butteraugli options above.
+  int speculative_candidates = 0;
+  // If true, the butteraugli search first runs on a 2x downsampled image and
+  // starts the full resolution search from the (upsampled) result. About a
+  // third fewer full resolution iterations, but a few percent larger output.
+  bool multires_butteraugli = false;
+  // If true, the butteraugli search starts from the adaptive quantization map
+  // (as in fast_mode) scaled to the target instead of a uniform field, which
+  // saves 15-25% of the iterations at about the same size. Ignored if
+  // multires_butteraugli.
+  bool adaptive_initial_quant = false;
+  // If non-null, the butteraugli search starts from this field (one value per
+  // block) divided by the target distance, e.g. PikInfo::quant_field of a
+  // previous encode of the same image at another distance. Saves about a
+  // third of the iterations, but the output is a few percent larger. Takes
+  // precedence over multires_butteraugli and adaptive_initial_quant. Must
+  // outlive the PixelsToPik call.
+  const ImageF* initial_quant_field = nullptr;
+  // If true, the target_bitrate search compares the estimated instead of the
+  // actual encoded size (see CompressedImage::EstimateEncodedSize), and
+  // encodes only once or twice at the end. The result is also at most the
+  // target size, but may differ slightly from the exact search.
+  bool estimate_target_size = false;
+  // If true, the Y-to-blue and estimate_target_size searches rank candidates
+  // by the entropy of their histograms plus a fixed code cost instead of
+  // building the codes (see HistogramBuilder::EstimatedSize).
+  bool fast_size_estimates = false;
+
+  // If true, the color planes are coded without loss (see lossless.h) in a
+  // single fast pass, ignoring the lossy options above. Only supported for
+  // 8-bit inputs (Image3B and MetaImageB); images with at most 256 colors are
+  // coded as palette indices. The DC preview is not available.
+  bool lossless = false;
+
+  // If true, the input must be gray (R = G = B) and only its luminance (Y) is
+  // coded; the X and B coefficients are zero and the YToB search is skipped.
+  // Decoders output R = G = B, or one plane via PikToGray. Sets
+  // Header::num_components to 1. Encoders fail for input with color. Ignored
+  // if lossless.
+  bool grayscale = false;
 
   bool alpha_channel = false;
+  // Selects the alpha codec. Zero uses Brotli at quality 9 in fast_mode and
+  // 11 otherwise. 1 predicts each sample from its neighbors and ANS-codes the
+  // residuals and runs in groups of rows that are coded (and decoded) in
+  // parallel; even on one thread it encodes several times and decodes about
+  // twice as fast as Brotli, but the output is up to twice as large. 2 to 11
+  // use Brotli at that quality. Decoders without the ANS codec cannot read 1.
+  int alpha_effort = 0;
+  // If true and the image has alpha, the alpha channel is encoded on an
+  // additional thread while the pool encodes the color planes. The groups of
+  // alpha_effort 1 are then coded serially on that thread. The output is the
+  // same.
+  bool concurrent_alpha = false;
+
+  // Splits the AC coefficients into independently decodable groups of tile
+  // rows so that the decoder can entropy-decode them in parallel. Slightly
+  // increases the size. Not supported in fast_mode.
+  bool ac_groups = false;
+
+  // Codes the AC symbols with several interleaved ANS states, which speeds up
+  // decoding at the cost of a few bytes.
+  bool interleaved_ans = false;
+
+  // Clusters the AC histograms with a faster k-means based method instead of
+  // the greedy pairwise merging. The output may be slightly larger. Has no
+  // effect in fast_mode, which uses a static context map.
+  bool fast_clustering = false;
+
+  // Allows replacing the AC histograms with a built-in set when that is
+  // smaller, which mainly helps small images. Not supported with ac_groups.
+  bool static_ac_codes = false;
+
+  // Stores an Index section with the sizes of the parts of the image data, so
+  // that decoders can seek directly to e.g. the DC or alpha (see PikToAlpha).
+  // Decoders predating Header::kSections cannot read the result.
+  bool section_index = false;
+
+  // Number of consecutive FramesToPik frames of the same size that share the
+  // quant field (and Y-to-blue values) chosen for the first of them, which
+  // saves their search time and quant field bits but no longer bounds their
+  // butteraugli distance. One searches each frame.
+  int quant_field_frames = 1;
+
+  // Optimizes the per-tile Y-to-blue correlation of all tiles independently
+  // (and in parallel), starting from the same global histograms. The result
+  // differs slightly from the serial search but not with the thread count.
+  bool parallel_ytob = false;
+  // With parallel_ytob, adds a serial pass over all tiles that only tries
+  // values close to the parallel result.
+  bool ytob_refinement = false;
+
+  // If non-zero and the opsin image plus the coefficients of the input image
+  // (18 bytes per pixel) would exceed this many bytes, the uniform_quant and
+  // fast_mode paths of PixelsToPik convert the input to opsin in stripes of
+  // 8 rows instead of storing the whole opsin image. The output is the same,
+  // but the conversion is done twice. The other paths ignore this.
+  size_t max_encoder_memory = 0;
+
+  // Number of worker threads for the parallel stages of the encoder. Zero
+  // runs everything on the calling thread, negative values use one thread
+  // per core. The output does not depend on it nor on the instruction set
+  // (benchmark_pik --determinism checks this).
+  int num_threads = 0;
+  // If true, pins each worker thread to a CPU so that the memory it touches
+  // first is local to its NUMA node (see ThreadPool).
+  bool pin_threads = false;
 
+  // If non-zero, allocations of at least this many bytes (e.g. the image
+  // planes of large images) use transparent huge pages where supported,
+  // which reduces TLB misses (see HugePageScope). 8 MiB is a reasonable
+  // value; does not change the output.
+  size_t huge_page_bytes = 0;
 };
 
 struct DecompressParams {
@@ -32,6 +196,36 @@ struct DecompressParams {
   // If true, checks at the end of decoding that all of the compressed data
   // was consumed by the decoder.
   bool check_decompressed_size = true;
+  // Number of worker threads, see CompressParams::num_threads.
+  int num_threads = 0;
+  // See CompressParams::pin_threads and huge_page_bytes.
+  bool pin_threads = false;
+  size_t huge_page_bytes = 0;
+  // If crop_xsize and crop_ysize are non-zero, only the rectangle starting at
+  // (crop_x0, crop_y0) is reconstructed and returned. This only touches the
+  // blocks overlapping the rectangle and, with CompressParams::ac_groups, only
+  // entropy-decodes the AC groups overlapping it.
+  size_t crop_x0 = 0;
+  size_t crop_y0 = 0;
+  size_t crop_xsize = 0;
+  size_t crop_ysize = 0;
+  // If true, only the DC coefficients are decoded and the result is a preview
+  // downsampled by 8 in each direction (one pixel per 8x8 block). Much faster
+  // than a full decode. Alpha is not decoded and crop_* must be zero.
+  bool dc_preview = false;
+  // If 2 or 4, the result is downsampled by this factor in each direction
+  // (rounded up), reconstructed from the low-frequency coefficients of each
+  // block with a reduced IDCT. Cheaper than a full decode followed by a
+  // resize. Alpha is not decoded and crop_* must be zero.
+  int downsampling = 1;
+  // If true, stores only the non-zero AC coefficients while decoding (see
+  // CompressedImage::SetSparseAC). Same output; needs less memory.
+  bool sparse_ac = false;
+  // If set, the color planes are reconstructed in bands of 512 rows (or those
+  // passed to an Image3Sink) and this is invoked before each with the
+  // fraction of rows done, i.e. also once after the entropy decoding. The
+  // output is the same. Not for dc_preview, downsampling or lossless images.
+  ProgressCallback progress;
 };
 }  // namespace pik
 
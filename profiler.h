@@ -40,6 +40,16 @@
 #define PROFILER_THREAD_STORAGE 200ULL
 #endif
 
+// If nonzero (and PROFILER_ENABLED), also records hardware performance
+// counters (instructions, last-level cache misses, branch misses) per zone via
+// perf_event_open. Linux only; reading the counters on every zone entry/exit
+// costs a system call, so the reported durations include more overhead. If the
+// counters cannot be opened (e.g. due to perf_event_paranoid), only durations
+// are reported.
+#ifndef PROFILER_COUNTERS
+#define PROFILER_COUNTERS 0
+#endif
+
 #if PROFILER_ENABLED
 
 #define PROFILER_PRINT_OVERHEAD 0
@@ -61,6 +71,13 @@
 #include "status.h"
 #include "tsc_timer.h"
 
+#if PROFILER_COUNTERS && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // Non-portable aspects:
 // - SSE2 128-bit load/store (write-combining, UpdateOrAdd)
 // - RDTSCP timestamps (serializing, high-resolution)
@@ -167,12 +184,117 @@ inline T ClampedSubtract(const T minuend, const T subtrahend) {
   return minuend - subtrahend;
 }
 
+#if PROFILER_COUNTERS
+
+static constexpr size_t kNumCounters = 3;
+
+// Hardware counter values (or their differences), in the order of
+// PerfCounters::Name. POD.
+struct CounterValues {
+  void Add(const CounterValues& other) {
+    for (size_t i = 0; i < kNumCounters; ++i) {
+      counts[i] += other.counts[i];
+    }
+  }
+
+  uint64_t counts[kNumCounters];
+};
+
+// Group of per-thread hardware counters, which only count user-mode events.
+// Read() returns zeros until Open() succeeds.
+class PerfCounters {
+ public:
+  static const char* Name(const size_t i) {
+    static const char* names[kNumCounters] = {"instructions", "LLC misses",
+                                              "branch misses"};
+    return names[i];
+  }
+
+  // Starts counting events of the calling thread. Returns false if the
+  // counters are unavailable.
+  bool Open() {
+#ifdef __linux__
+    const uint64_t configs[kNumCounters] = {PERF_COUNT_HW_INSTRUCTIONS,
+                                            PERF_COUNT_HW_CACHE_MISSES,
+                                            PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t i = 0; i < kNumCounters; ++i) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = configs[i];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.disabled = (i == 0);  // The leader enables the whole group.
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      // Calling thread, any CPU.
+      fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+                        i == 0 ? -1 : fds_[0], 0);
+      if (fds_[i] < 0) {
+        Close();
+        return false;
+      }
+    }
+    ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  ~PerfCounters() { Close(); }
+
+  bool Available() const { return fds_[0] >= 0; }
+
+  void Read(CounterValues* values) const {
+#ifdef __linux__
+    if (Available()) {
+      // PERF_FORMAT_GROUP layout: number of counters, then their values.
+      uint64_t buf[1 + kNumCounters];
+      if (read(fds_[0], buf, sizeof(buf)) == sizeof(buf)) {
+        memcpy(values->counts, buf + 1, sizeof(values->counts));
+        return;
+      }
+    }
+#endif
+    memset(values->counts, 0, sizeof(values->counts));
+  }
+
+ private:
+  void Close() {
+    for (size_t i = 0; i < kNumCounters; ++i) {
+#ifdef __linux__
+      if (fds_[i] >= 0) close(fds_[i]);
+#endif
+      fds_[i] = -1;
+    }
+  }
+
+  int fds_[kNumCounters] = {-1, -1, -1};
+};
+
+// Active zone for the purpose of counting; analogous to Node. POD.
+struct CounterNode {
+  size_t biased_offset;
+  CounterValues begin;
+  CounterValues child_total;
+};
+
+// Self counts of all zones with the same name. POD.
+struct CounterAccumulator {
+  size_t biased_offset;
+  CounterValues self;
+};
+
+#endif  // PROFILER_COUNTERS
+
 // Per-thread call graph (stack) and Accumulator for each zone.
 class Results {
  public:
   Results() {
     // Zero-initialize first accumulator to avoid a check for num_zones_ == 0.
-    memset(zones_, 0, sizeof(Accumulator));
+    memset(static_cast<void*>(zones_), 0, sizeof(Accumulator));
   }
 
   // Used for computing overhead when this thread encounters its first Zone.
@@ -197,6 +319,28 @@ class Results {
     child_overhead_ = child_overhead;
   }
 
+#if PROFILER_COUNTERS
+  void SetCountersAvailable() { counters_available_ = true; }
+
+  // Adds the self counts of one call to the zone identified by biased_offset.
+  // Zones are few, so a linear search suffices.
+  void UpdateCounters(const size_t biased_offset, const CounterValues& self) {
+    for (size_t i = 0; i < num_counter_zones_; ++i) {
+      if (counter_zones_[i].biased_offset == biased_offset) {
+        counter_zones_[i].self.Add(self);
+        return;
+      }
+    }
+    PIK_ASSERT(num_counter_zones_ < kMaxZones);
+    counter_zones_[num_counter_zones_].biased_offset = biased_offset;
+    counter_zones_[num_counter_zones_].self = self;
+    ++num_counter_zones_;
+  }
+
+  // Forgets the zones recorded by ComputeOverhead.
+  void DiscardCounters() { num_counter_zones_ = 0; }
+#endif
+
   // Draw all required information from the packets, which can be discarded
   // afterwards. Called whenever this thread's storage is full.
   void AnalyzePackets(const Packet* packets, const size_t num_packets) {
@@ -245,6 +389,13 @@ class Results {
       const Accumulator& zone = other.zones_[i];
       UpdateOrAdd(zone.BiasedOffset(), zone.NumCalls(), zone.total_duration);
     }
+#if PROFILER_COUNTERS
+    for (size_t i = 0; i < other.num_counter_zones_; ++i) {
+      const CounterAccumulator& zone = other.counter_zones_[i];
+      UpdateCounters(zone.biased_offset, zone.self);
+    }
+    counters_available_ |= other.counters_available_;
+#endif
     const uint64_t t1 = Stop<uint64_t>();
     analyze_elapsed_ += t1 - t0 + other.analyze_elapsed_;
   }
@@ -267,6 +418,9 @@ class Results {
       printf("%40s: %10zu x %15zu = %15zu\n", string_origin + r.BiasedOffset(),
              num_calls, r.total_duration / num_calls, r.total_duration);
     }
+#if PROFILER_COUNTERS
+    PrintCounters();
+#endif
 
     const uint64_t t1 = Stop<uint64_t>();
     analyze_elapsed_ += t1 - t0;
@@ -274,6 +428,40 @@ class Results {
   }
 
  private:
+#if PROFILER_COUNTERS
+  // Prints average self counts per call in the same order as Print.
+  void PrintCounters() const {
+    if (!counters_available_) {
+      printf("Hardware performance counters unavailable.\n");
+      return;
+    }
+    printf("%40s  ", "per call:");
+    for (size_t c = 0; c < kNumCounters; ++c) {
+      printf(" %15s", PerfCounters::Name(c));
+    }
+    printf("\n");
+
+    const char* string_origin = StringOrigin();
+    for (size_t i = 0; i < num_zones_; ++i) {
+      const char* name = string_origin + zones_[i].BiasedOffset();
+      // Sum over duplicates, which MergeDuplicates only combined in zones_.
+      CounterValues total;
+      memset(&total, 0, sizeof(total));
+      for (size_t j = 0; j < num_counter_zones_; ++j) {
+        if (!strcmp(name, string_origin + counter_zones_[j].biased_offset)) {
+          total.Add(counter_zones_[j].self);
+        }
+      }
+      const uint64_t num_calls = zones_[i].NumCalls();
+      printf("%40s: ", name);
+      for (size_t c = 0; c < kNumCounters; ++c) {
+        printf(" %15zu", total.counts[c] / num_calls);
+      }
+      printf("\n");
+    }
+  }
+#endif
+
 #if PIK_ARCH_X64
   static bool SameOffset(const __m128i& zone, const size_t biased_offset) {
     const uint64_t num_calls = _mm_cvtsi128_si64(zone);
@@ -405,6 +593,12 @@ class Results {
 
   alignas(64) Node nodes_[kMaxDepth];         // Stack
   alignas(64) Accumulator zones_[kMaxZones];  // Self-organizing list
+
+#if PROFILER_COUNTERS
+  bool counters_available_ = false;
+  size_t num_counter_zones_ = 0;
+  CounterAccumulator counter_zones_[kMaxZones];
+#endif
 };
 
 // Per-thread packet storage, allocated via CacheAligned.
@@ -444,6 +638,41 @@ class ThreadSpecific {
     Write(Packet::Make(biased_offset, timestamp));
   }
 
+#if PROFILER_COUNTERS
+  // Called after ComputeOverhead so that its zones do not read the counters.
+  void OpenCounters() {
+    results_.DiscardCounters();
+    if (counters_.Open()) results_.SetCountersAvailable();
+  }
+
+  // Counterparts of WriteEntry/WriteExit. Reads the counters as late as
+  // possible on entry and as early as possible on exit.
+  void EnterCounters(const char* name) {
+    PIK_ASSERT(counter_depth_ < kMaxDepth);
+    CounterNode& node = counter_nodes_[counter_depth_++];
+    node.biased_offset = name - string_origin_;
+    memset(&node.child_total, 0, sizeof(node.child_total));
+    counters_.Read(&node.begin);
+  }
+
+  void ExitCounters() {
+    CounterValues end;
+    counters_.Read(&end);
+    PIK_ASSERT(counter_depth_ != 0);
+    const CounterNode& node = counter_nodes_[--counter_depth_];
+    CounterValues self;
+    for (size_t i = 0; i < kNumCounters; ++i) {
+      const uint64_t total = end.counts[i] - node.begin.counts[i];
+      self.counts[i] = ClampedSubtract(total, node.child_total.counts[i]);
+      // Deduct from the parent's self counts, as for durations.
+      if (counter_depth_ != 0) {
+        counter_nodes_[counter_depth_ - 1].child_total.counts[i] += total;
+      }
+    }
+    results_.UpdateCounters(node.biased_offset, self);
+  }
+#endif
+
   void AnalyzeRemainingPackets() {
 #if PIK_ARCH_X64
     // Ensures prior weakly-ordered streaming stores are globally visible.
@@ -508,6 +737,12 @@ class ThreadSpecific {
   // Cached here because we already read this cache line on zone entry/exit.
   const char* PIK_RESTRICT string_origin_;
   Results results_;
+
+#if PROFILER_COUNTERS
+  PerfCounters counters_;
+  size_t counter_depth_ = 0;
+  CounterNode counter_nodes_[kMaxDepth];
+#endif
 };
 
 class ThreadList {
@@ -557,8 +792,14 @@ class Zone {
       Threads().Add(thread_specific);
       StaticThreadSpecific() = thread_specific;
       thread_specific->ComputeOverhead();
+#if PROFILER_COUNTERS
+      thread_specific->OpenCounters();
+#endif
     }
 
+#if PROFILER_COUNTERS
+    thread_specific->EnterCounters(name);
+#endif
     // (Capture timestamp ASAP, not inside WriteEntry.)
     PIK_COMPILER_FENCE;
     const uint64_t timestamp = Start<uint64_t>();
@@ -568,7 +809,11 @@ class Zone {
   PIK_NOINLINE ~Zone() {
     PIK_COMPILER_FENCE;
     const uint64_t timestamp = Stop<uint64_t>();
-    StaticThreadSpecific()->WriteExit(timestamp);
+    ThreadSpecific* PIK_RESTRICT thread_specific = StaticThreadSpecific();
+#if PROFILER_COUNTERS
+    thread_specific->ExitCounters();
+#endif
+    thread_specific->WriteExit(timestamp);
     PIK_COMPILER_FENCE;
   }
 
@@ -605,7 +850,7 @@ class Zone {
   const Zone zone(__func__); \
   PIK_COMPILER_FENCE
 
-#define PROFILER_PRINT_RESULTS Zone::PrintResults
+#define PROFILER_PRINT_RESULTS ::pik::Zone::PrintResults
 
 inline void ThreadSpecific::ComputeOverhead() {
   // Delay after capturing timestamps before/after the actual zone runs. Even
@@ -15,13 +15,17 @@
 #include "quantizer.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <algorithm>
 #include <vector>
 
 #include "arch_specific.h"
 #include "compiler_specific.h"
 #include "dct.h"
+#include "kernel_targets.h"
 #include "opsin_codec.h"
+#include "quantizer_target.h"
+#include "status.h"
 
 namespace pik {
 
@@ -29,6 +33,8 @@ static const int kGlobalScaleDenom = 1 << 16;
 static const int kQuantMax = 256;
 static const int kDefaultQuant = 64;
 
+static const KernelTable<QuantizerFunctionsForTarget> kernels;
+
 int ClampVal(int val) {
   return std::min(kQuantMax, std::max(1, val));
 }
@@ -43,7 +49,8 @@ Quantizer::Quantizer(int quant_xsize, int quant_ysize, int coeffs_per_block,
     quant_dc_(kDefaultQuant),
     quant_img_ac_(quant_xsize_, quant_ysize_, kDefaultQuant),
     scale_(quant_xsize_ * coeffs_per_block_, quant_ysize_),
-    initialized_(false) {
+    initialized_(false),
+    dirty_cells_(quant_xsize_, quant_ysize_, 0) {
 }
 
 bool Quantizer::SetQuantField(const float quant_dc, const ImageF& qf) {
@@ -63,6 +70,7 @@ bool Quantizer::SetQuantField(const float quant_dc, const ImageF& qf) {
   if (new_global_scale != global_scale_) {
     global_scale_ = new_global_scale;
     changed = true;
+    all_dirty_ = true;
   }
   const float scale = global_scale_ * 1.0f / kGlobalScaleDenom;
   const float inv_scale = 1.0f / scale;
@@ -70,18 +78,22 @@ bool Quantizer::SetQuantField(const float quant_dc, const ImageF& qf) {
   if (val != quant_dc_) {
     quant_dc_ = val;
     changed = true;
+    all_dirty_ = true;
   }
   for (int y = 0; y < quant_ysize_; ++y) {
+    uint8_t* const PIK_RESTRICT row_dirty = dirty_cells_.Row(y);
     for (int x = 0; x < quant_xsize_; ++x) {
       int val = ClampVal(qf.Row(y)[x] * inv_scale + 0.5f);
       if (val != quant_img_ac_.Row(y)[x]) {
         quant_img_ac_.Row(y)[x] = val;
+        row_dirty[x] = 1;
         changed = true;
       }
     }
   }
   if (!initialized_) {
     changed = true;
+    all_dirty_ = true;
   }
   if (changed) {
     const float* const PIK_RESTRICT kDequantMatrix = dequant_matrix_;
@@ -113,6 +125,43 @@ bool Quantizer::SetQuantField(const float quant_dc, const ImageF& qf) {
   return changed;
 }
 
+void Quantizer::CopyQuantField(const Quantizer& other) {
+  PIK_CHECK(other.quant_xsize_ == quant_xsize_ &&
+            other.quant_ysize_ == quant_ysize_ &&
+            other.coeffs_per_block_ == coeffs_per_block_);
+  global_scale_ = other.global_scale_;
+  quant_dc_ = other.quant_dc_;
+  for (int y = 0; y < quant_ysize_; ++y) {
+    memcpy(quant_img_ac_.Row(y), other.quant_img_ac_.Row(y),
+           quant_xsize_ * sizeof(quant_img_ac_.Row(y)[0]));
+    for (int c = 0; c < 3; ++c) {
+      memcpy(scale_.PlaneRow(c, y), other.scale_.ConstPlaneRow(c, y),
+             scale_.xsize() * sizeof(float));
+    }
+  }
+  inv_global_scale_ = other.inv_global_scale_;
+  inv_quant_dc_ = other.inv_quant_dc_;
+  initialized_ = other.initialized_;
+  all_dirty_ = true;
+}
+
+bool Quantizer::QuantizeBlock(int quant_x, int quant_y, int c, int k_start,
+                              int k_end, const float* PIK_RESTRICT block_in,
+                              int16_t* PIK_RESTRICT block_out) const {
+  const float* const PIK_RESTRICT scale =
+      &scale_.Row(quant_y)[c][quant_x * coeffs_per_block_];
+  static const float kZeroBias[3] = { 0.65f, 0.6f, 0.7f };
+  return kernels().quantize_block(block_in, scale, kZeroBias[c], k_start,
+                                  k_end, block_out);
+}
+
+void Quantizer::ClearDirty() {
+  for (int y = 0; y < quant_ysize_; ++y) {
+    memset(dirty_cells_.Row(y), 0, quant_xsize_);
+  }
+  all_dirty_ = false;
+}
+
 void Quantizer::GetQuantField(float* quant_dc, ImageF* qf) {
   const float scale = global_scale_ * 1.0f / kGlobalScaleDenom;
   *quant_dc = scale * quant_dc_;
@@ -145,6 +194,7 @@ bool Quantizer::Decode(BitReader* br) {
   inv_global_scale_ = kGlobalScaleDenom * 1.0 / global_scale_;
   inv_quant_dc_ = inv_global_scale_ / quant_dc_;
   initialized_ = true;
+  all_dirty_ = true;
   return true;
 }
 
@@ -48,24 +48,34 @@ class Quantizer {
     SetQuantField(quant, ImageF(quant_xsize_, quant_ysize_, quant));
   }
 
+  // Sets the same quantization field as "other", which must have the same
+  // dimensions, e.g. that of the previous animation frame.
+  void CopyQuantField(const Quantizer& other);
+
   float inv_quant_dc() const { return inv_quant_dc_; }
   float inv_quant_ac(int quant_x, int quant_y) const {
     return inv_global_scale_ / quant_img_ac_.Row(quant_y)[quant_x];
   }
 
-  void QuantizeBlock(int quant_x, int quant_y,
+  // Integer representation of the current quantization field. Two fields
+  // with equal values produce identical quantized coefficients.
+  int global_scale() const { return global_scale_; }
+  int quant_dc() const { return quant_dc_; }
+  const Image<int>& quant_img_ac() const { return quant_img_ac_; }
+
+  // Tracks which cells of the quantization field changed since the last
+  // ClearDirty(). If AllDirty(), e.g. because the global scale or the DC
+  // quantization changed, every cell is affected and dirty_cells() is
+  // undefined; otherwise its non-zero entries mark the changed cells.
+  bool AllDirty() const { return all_dirty_; }
+  const ImageB& dirty_cells() const { return dirty_cells_; }
+  void ClearDirty();
+
+  // Returns whether any of the quantized AC coefficients (k > 0) is non-zero.
+  bool QuantizeBlock(int quant_x, int quant_y,
                      int c, int k_start, int k_end,
                      const float* PIK_RESTRICT block_in,
-                     int16_t* PIK_RESTRICT block_out) const {
-    const float* const PIK_RESTRICT scale =
-        &scale_.Row(quant_y)[c][quant_x * coeffs_per_block_];
-    for (int k = k_start; k < k_end; ++k) {
-      const float val = block_in[k] * scale[k];
-      static const float kZeroBias[3] = { 0.65f, 0.6f, 0.7f };
-      const float thres = kZeroBias[c];
-      block_out[k] = (k > 0 && std::abs(val) < thres) ? 0 : std::round(val);
-    }
-  }
+                     int16_t* PIK_RESTRICT block_out) const;
 
   std::string Encode(PikImageSizeInfo* info) const;
   size_t EncodedSize() const;
@@ -87,6 +97,8 @@ class Quantizer {
   // Scaled quantization multipliers, one for each channel.
   Image3F scale_;
   bool initialized_ = false;
+  ImageB dirty_cells_;
+  bool all_dirty_ = true;
 };
 
 }  // namespace pik
@@ -0,0 +1,63 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiled once per instruction set; see quantizer_target_<target>.cc.
+
+#include "quantizer_target.h"
+
+#include <cmath>
+
+#include "compiler_specific.h"
+#include "simd/simd.h"
+
+namespace pik {
+namespace SIMD_NAMESPACE {
+namespace {
+
+// A plain loop: the compiler vectorizes it for each target, and the results
+// do not depend on the lane count.
+bool QuantizeBlock(const float* PIK_RESTRICT block_in,
+                   const float* PIK_RESTRICT scale, const float zero_bias,
+                   const int k_start, const int k_end,
+                   int16_t* PIK_RESTRICT block_out) {
+  int k = k_start;
+  if (k == 0 && k < k_end) {
+    // The DC is never zeroed.
+    block_out[0] = std::round(block_in[0] * scale[0]);
+    k = 1;
+  }
+  int16_t nonzero_ac = 0;
+  for (; k < k_end; ++k) {
+    const float val = block_in[k] * scale[k];
+    const int16_t quantized =
+        std::abs(val) < zero_bias ? 0 : static_cast<int16_t>(std::round(val));
+    block_out[k] = quantized;
+    nonzero_ac |= quantized;
+  }
+  return nonzero_ac != 0;
+}
+
+}  // namespace
+}  // namespace SIMD_NAMESPACE
+
+// Instantiate for the current target.
+template <>
+QuantizerFunctions QuantizerFunctionsForTarget::operator()<SIMD_TARGET>()
+    const {
+  QuantizerFunctions functions;
+  functions.quantize_block = &SIMD_NAMESPACE::QuantizeBlock;
+  return functions;
+}
+
+}  // namespace pik
@@ -0,0 +1,44 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef QUANTIZER_TARGET_H_
+#define QUANTIZER_TARGET_H_
+
+// Per-instruction-set implementations of Quantizer::QuantizeBlock. Only
+// quantizer.cc should include this.
+
+#include <stdint.h>
+
+namespace pik {
+
+struct QuantizerFunctions {
+  // Writes the rounded block_in[k] * scale[k] for k in [k_start, k_end) to
+  // block_out, or zero if k > 0 and its magnitude is below "zero_bias".
+  // Returns whether any of those with k > 0 is non-zero.
+  bool (*quantize_block)(const float* block_in, const float* scale,
+                         float zero_bias, int k_start, int k_end,
+                         int16_t* block_out);
+};
+
+// Call via KernelTable<QuantizerFunctionsForTarget>. operator()<SIMD_TARGET>
+// is specialized in quantizer_target.cc, which is compiled once per
+// instruction set (quantizer_target_<target>.cc).
+struct QuantizerFunctionsForTarget {
+  template <class Target>
+  QuantizerFunctions operator()() const;
+};
+
+}  // namespace pik
+
+#endif  // QUANTIZER_TARGET_H_
@@ -0,0 +1,2 @@
+#define SIMD_ENABLE 4  // SSE4
+#include "quantizer_target.cc"
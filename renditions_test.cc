@@ -0,0 +1,142 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that PixelsToPik for several distances produces the same output as
+// separate encodes at each distance, whether the searches run concurrently or
+// one after the other, and that params.progress cancels all of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "image.h"
+#include "padded_bytes.h"
+#include "pik.h"
+#include "pik_params.h"
+
+namespace pik {
+namespace {
+
+// Not a multiple of the block size.
+constexpr size_t kXsize = 83;
+constexpr size_t kYsize = 61;
+
+MetaImageB TestImage() {
+  Image3B image(kXsize, kYsize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYsize; ++y) {
+      uint8_t* const PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < kXsize; ++x) {
+        const double ring = std::sqrt(double(x * x + y * y)) * (0.25 + 0.1 * c);
+        row[x] = static_cast<uint8_t>(128 + 80 * std::sin(ring) +
+                                      40 * std::cos(x * 0.7 + y * 0.2));
+      }
+    }
+  }
+  MetaImageB meta;
+  meta.SetColor(std::move(image));
+  return meta;
+}
+
+bool SameBytes(const PaddedBytes& a, const PaddedBytes& b) {
+  return a.size() == b.size() && std::equal(a.data(), a.data() + a.size(),
+                                            b.data());
+}
+
+// Returns whether the renditions of "image" with "num_threads" equal
+// "expected".
+bool CheckRenditions(const MetaImageB& image,
+                     const std::vector<float>& distances,
+                     const std::vector<PaddedBytes>& expected,
+                     const int num_threads) {
+  CompressParams params;
+  params.num_threads = num_threads;
+  float last_fraction = 0.0f;
+  bool monotonic = true;
+  params.progress = [&last_fraction, &monotonic](const float fraction_done) {
+    monotonic &= fraction_done >= last_fraction && fraction_done <= 1.0f;
+    last_fraction = fraction_done;
+    return true;
+  };
+  std::vector<PaddedBytes> compressed;
+  if (!PixelsToPik(params, image, distances, &compressed, nullptr)) {
+    fprintf(stderr, "Renditions with %d threads failed.\n", num_threads);
+    return false;
+  }
+  for (size_t i = 0; i < distances.size(); ++i) {
+    if (!SameBytes(compressed[i], expected[i])) {
+      fprintf(stderr, "Rendition %zu with %d threads differs.\n", i,
+              num_threads);
+      return false;
+    }
+  }
+  if (!monotonic || last_fraction == 0.0f) {
+    fprintf(stderr, "Invalid progress with %d threads.\n", num_threads);
+    return false;
+  }
+  return true;
+}
+
+// Returns whether cancelling after a few progress reports fails all
+// renditions.
+bool CheckCancel(const MetaImageB& image, const std::vector<float>& distances,
+                 const int num_threads) {
+  CompressParams params;
+  params.num_threads = num_threads;
+  std::atomic<int> num_calls{0};
+  params.progress = [&num_calls](const float fraction_done) {
+    return ++num_calls < 3;
+  };
+  std::vector<PaddedBytes> compressed;
+  if (PixelsToPik(params, image, distances, &compressed, nullptr)) {
+    fprintf(stderr, "Cancelled renditions with %d threads succeeded.\n",
+            num_threads);
+    return false;
+  }
+  return true;
+}
+
+int RunTests() {
+  const MetaImageB image = TestImage();
+  const std::vector<float> distances = {1.5f, 0.8f, 3.0f};
+  std::vector<PaddedBytes> expected(distances.size());
+  for (size_t i = 0; i < distances.size(); ++i) {
+    CompressParams params;
+    params.butteraugli_distance = distances[i];
+    if (!PixelsToPik(params, image, &expected[i], nullptr)) {
+      fprintf(stderr, "Separate encode at distance %f failed.\n",
+              distances[i]);
+      return 1;
+    }
+  }
+
+  bool ok = true;
+  // Concurrent searches, then one after the other on more threads than
+  // renditions.
+  for (const int num_threads : {0, 2, 4}) {
+    ok &= CheckRenditions(image, distances, expected, num_threads);
+    ok &= CheckCancel(image, distances, num_threads);
+  }
+  if (!ok) return 1;
+  printf("Renditions equal separate encodes.\n");
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main() { return pik::RunTests(); }
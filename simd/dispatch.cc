@@ -89,9 +89,20 @@ enum {
   kLZCNT = 1 << 9,
   kBMI = 1 << 10,
   kBMI2 = 1 << 11,
-
-  kGroupAVX2 = kAVX | kAVX2 | kFMA | kLZCNT | kBMI | kBMI2,
-  kGroupSSE4 = kSSE | kSSE2 | kSSE3 | kSSSE3 | kSSE41 | kSSE42
+  kAVX512F = 1 << 12,
+  kAVX512DQ = 1 << 13,
+  kAVX512BW = 1 << 14,
+  kAVX512VL = 1 << 15,
+  kPOPCNT = 1 << 16,
+  kAES = 1 << 17,
+  kPCLMUL = 1 << 18,
+
+  // SSE4 code is compiled with -msse4.2 (which implies POPCNT) -maes -mpclmul.
+  kGroupSSE4 = kSSE | kSSE2 | kSSE3 | kSSSE3 | kSSE41 | kSSE42 | kPOPCNT |
+               kAES | kPCLMUL,
+  // AVX2 code is also compiled with the SSE4 flags.
+  kGroupAVX2 = kGroupSSE4 | kAVX | kAVX2 | kFMA | kLZCNT | kBMI | kBMI2,
+  kGroupAVX512 = kGroupAVX2 | kAVX512F | kAVX512DQ | kAVX512BW | kAVX512VL
 };
 
 }  // namespace
@@ -120,6 +131,9 @@ int SupportedTargets() {
   flags |= IsBitSet(abcd[2], 9) ? kSSSE3 : 0;
   flags |= IsBitSet(abcd[2], 19) ? kSSE41 : 0;
   flags |= IsBitSet(abcd[2], 20) ? kSSE42 : 0;
+  flags |= IsBitSet(abcd[2], 23) ? kPOPCNT : 0;
+  flags |= IsBitSet(abcd[2], 25) ? kAES : 0;
+  flags |= IsBitSet(abcd[2], 1) ? kPCLMUL : 0;
   flags |= IsBitSet(abcd[2], 12) ? kFMA : 0;
   flags |= IsBitSet(abcd[2], 28) ? kAVX : 0;
   const bool has_osxsave = IsBitSet(abcd[2], 27);
@@ -134,6 +148,10 @@ int SupportedTargets() {
     flags |= IsBitSet(abcd[1], 3) ? kBMI : 0;
     flags |= IsBitSet(abcd[1], 5) ? kAVX2 : 0;
     flags |= IsBitSet(abcd[1], 8) ? kBMI2 : 0;
+    flags |= IsBitSet(abcd[1], 16) ? kAVX512F : 0;
+    flags |= IsBitSet(abcd[1], 17) ? kAVX512DQ : 0;
+    flags |= IsBitSet(abcd[1], 30) ? kAVX512BW : 0;
+    flags |= IsBitSet(abcd[1], 31) ? kAVX512VL : 0;
   }
 
   // Verify OS support for XSAVE, without which XMM/YMM registers are not
@@ -149,9 +167,16 @@ int SupportedTargets() {
     if (!IsBitSet(xcr0, 2)) {
       flags &= ~(kAVX | kAVX2);
     }
+    // Opmask, ZMM upper halves and ZMM16-31
+    if (!IsBitSet(xcr0, 5) || !IsBitSet(xcr0, 6) || !IsBitSet(xcr0, 7)) {
+      flags &= ~(kAVX512F | kAVX512DQ | kAVX512BW | kAVX512VL);
+    }
   }
 
   // Set target bit(s) if all their group's flags are all set.
+  if ((flags & kGroupAVX512) == kGroupAVX512) {
+    supported |= SIMD_AVX512;
+  }
   if ((flags & kGroupAVX2) == kGroupAVX2) {
     supported |= SIMD_AVX2;
   }
@@ -21,7 +21,8 @@
 // Usage: for each dispatch site, declare a Functor class, add a source file
 // that specializes its operator()<SIMD_TARGET>, dispatch::Run<Functor>(..).
 
-#include <utility>  // std::forward
+#include <type_traits>  // std::integral_constant
+#include <utility>      // std::forward
 
 #include "simd/port.h"
 
@@ -43,19 +44,57 @@ constexpr bool IsSupported<None>(const int targets) {
   return true;
 }
 
-// Chooses "kTarget", the best instruction set supported by the current CPU,
-// and returns func.operator()<Target>(args). The dispatch overhead is low,
-// about 4 cycles, but this should be called infrequently. The member function
-// template (as opposed to a class template) allows stateful functors.
+#if SIMD_ARCH_X86
+// AVX-512 specializations are opt-in (see Run) because most functors are only
+// compiled for AVX2, SSE4 and None.
+constexpr int kDefaultTargets = ~SIMD_AVX512;
+#else
+constexpr int kDefaultTargets = ~0;
+#endif
+
+namespace detail {
+
+template <class Func, typename... Args>
+using RunResult = decltype(std::declval<Func>().template operator()<None>(
+    std::declval<Args>()...));
+
+#if SIMD_ARCH_X86
+// Tag dispatch ensures operator()<AVX512> is only instantiated if requested.
+template <class Func, typename... Args>
+SIMD_INLINE RunResult<Func, Args...> RunAVX512(std::true_type, Func&& func,
+                                               Args&&... args) {
+  return std::forward<Func>(func).template operator()<AVX512>(
+      std::forward<Args>(args)...);
+}
+// Unreachable (Run checks kTargets first) but must compile.
 template <class Func, typename... Args>
-SIMD_INLINE auto Run(Func&& func, Args&&... args)
-    -> decltype(std::forward<Func>(func).template operator()<None>(
-        std::forward<Args>(args)...)) {
-  const int supported = SupportedTargets();
+SIMD_INLINE RunResult<Func, Args...> RunAVX512(std::false_type, Func&& func,
+                                               Args&&... args) {
+  return std::forward<Func>(func).template operator()<AVX2>(
+      std::forward<Args>(args)...);
+}
+#endif
+
+}  // namespace detail
+
+// Chooses "kTarget", the best instruction set supported by the current CPU
+// and included in "kTargets", and returns func.operator()<Target>(args). The
+// dispatch overhead is low, about 4 cycles, but this should be called
+// infrequently. The member function template (as opposed to a class template)
+// allows stateful functors. Functors with an AVX-512 specialization opt in via
+// Run<~0>(func).
+template <int kTargets = kDefaultTargets, class Func, typename... Args>
+SIMD_INLINE detail::RunResult<Func, Args...> Run(Func&& func, Args&&... args) {
+  const int supported = SupportedTargets() & kTargets;
   (void)supported;
   // NOTE: do not check SIMD_ENABLE_*: SIMD_ENABLE might be zero in this
   // translation unit, but the instantiation[s] can still be called.
 #if SIMD_ARCH_X86
+  if (supported & SIMD_AVX512) {
+    return detail::RunAVX512(
+        std::integral_constant<bool, (kTargets & SIMD_AVX512) != 0>(),
+        std::forward<Func>(func), std::forward<Args>(args)...);
+  }
   if (supported & SIMD_AVX2) {
     return std::forward<Func>(func).template operator()<AVX2>(
         std::forward<Args>(args)...);
@@ -76,7 +115,8 @@ SIMD_INLINE auto Run(Func&& func, Args&&... args)
 }
 
 // Calls func.operator()<Target>(args) for all instruction sets in "targets"
-// (typically the return value of SupportedTargets).
+// (typically the return value of SupportedTargets). Unlike Run, this includes
+// AVX512 if its bit is set, so "func" must be specialized for it.
 template <class Func, typename... Args>
 SIMD_INLINE void ForeachTarget(const int targets, Func&& func, Args&&... args) {
   // NOTE: do not check SIMD_ENABLE_*: SIMD_ENABLE might be zero in this
@@ -90,6 +130,10 @@ SIMD_INLINE void ForeachTarget(const int targets, Func&& func, Args&&... args) {
     std::forward<Func>(func).template operator()<AVX2>(
         std::forward<Args>(args)...);
   }
+  if (targets & SIMD_AVX512) {
+    std::forward<Func>(func).template operator()<AVX512>(
+        std::forward<Args>(args)...);
+  }
 #elif SIMD_ARCH_ARM
   if (targets & SIMD_ARM) {
     std::forward<Func>(func).template operator()<ARM8>(
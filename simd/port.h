@@ -19,7 +19,8 @@
 
 // Ensures an array is aligned and suitable for load()/store() functions.
 // Example: SIMD_ALIGN T lanes[V::N];
-#define SIMD_ALIGN alignas(32)
+// 64 bytes because AVX-512 load()/store() require the full vector alignment.
+#define SIMD_ALIGN alignas(64)
 
 // SIMD_TARGET_ATTR prerequisites on Clang/GCC: __has_attribute(target) does not
 // guarantee intrinsics are usable, hence we must check for specific versions.
@@ -113,14 +114,18 @@
 #if defined(SIMD_TARGET_ATTR) && 0
 #define SIMD_ENABLE_SSE4 (SIMD_ENABLE & SIMD_SSE4)
 #define SIMD_ENABLE_AVX2 (SIMD_ENABLE & SIMD_AVX2)
+#define SIMD_ENABLE_AVX512 (SIMD_ENABLE & SIMD_AVX512)
 #define SIMD_ENABLE_NEON (SIMD_ENABLE & SIMD_ARM)
 #define SIMD_ATTR_SSE4 SIMD_TARGET_ATTR("sse4.2,aes,pclmul")
 #define SIMD_ATTR_AVX2 SIMD_TARGET_ATTR("avx,avx2,fma")
+#define SIMD_ATTR_AVX512 \
+  SIMD_TARGET_ATTR("avx512f,avx512bw,avx512dq,avx512vl")
 
 // Older compiler: can only use an instruction set if the extra flags are set.
 #else
 #define SIMD_ATTR_SSE4
 #define SIMD_ATTR_AVX2
+#define SIMD_ATTR_AVX512
 
 #if defined(__SSE4_2__) && defined(__AES__)
 #define SIMD_ENABLE_SSE4 (SIMD_ENABLE & SIMD_SSE4)
@@ -134,6 +139,14 @@
 #define SIMD_ENABLE_AVX2 0
 #endif
 
+// Subset of AVX-512 available on Skylake-SP and later.
+#if defined(__AVX512F__) && defined(__AVX512BW__) && \
+    defined(__AVX512DQ__) && defined(__AVX512VL__)
+#define SIMD_ENABLE_AVX512 (SIMD_ENABLE & SIMD_AVX512)
+#else
+#define SIMD_ENABLE_AVX512 0
+#endif
+
 #if defined(SIMD_ARCH_ARM) && defined(__ARM_NEON)
 #define SIMD_ENABLE_NEON (SIMD_ENABLE & SIMD_ARM)
 #else
@@ -144,7 +157,9 @@
 
 // Whether any SIMD instruction set is active (used to exclude tests not
 // supported by scalar.h).
-#define SIMD_ENABLE_ANY (SIMD_ENABLE_SSE4 | SIMD_ENABLE_AVX2 | SIMD_ENABLE_NEON)
+#define SIMD_ENABLE_ANY                                            \
+  (SIMD_ENABLE_SSE4 | SIMD_ENABLE_AVX2 | SIMD_ENABLE_AVX512 | \
+   SIMD_ENABLE_NEON)
 
 // Detects "best available" instruction set and includes their headers;
 // defines SIMD_NAMESPACE, SIMD_TARGET for vec<T, SIMD_TARGET> and SIMD_ATTR
@@ -153,7 +168,13 @@
 // are avoided if all their functions (static inline in Clang's library and
 // extern inline in GCC's) are inlined.
 #if SIMD_ARCH_X86
-#if SIMD_ENABLE_AVX2
+#if SIMD_ENABLE_AVX512
+#include <immintrin.h>
+#define SIMD_NAMESPACE avx512
+#define SIMD_TARGET AVX512
+#define SIMD_ATTR SIMD_ATTR_AVX512
+
+#elif SIMD_ENABLE_AVX2
 #include <immintrin.h>
 #define SIMD_NAMESPACE avx2
 #define SIMD_TARGET AVX2
@@ -36,6 +36,7 @@
 // vec64<T>: half of a 128-bit vector, limited operations;
 // vec128<T>: 128-bit vector;
 // vec256<T>: 256-bit vector, only available to AVX2-specific programs;
+// vec512<T>: 512-bit vector, only available to AVX-512-specific programs;
 // vec<T>: alias template for the best instruction set from SIMD_ENABLE;
 // vec<T, SSE4>: alias template for a specific instruction set (SSE4);
 // PB[B]xN[N]: fixed-type, fixed-width type aliases, where
@@ -79,6 +80,7 @@ struct NumLanes {
 // effect because the headers are empty #ifdef SIMD_DEPS.
 #ifdef SIMD_DEPS
 #include "simd/x86_avx2.h"
+#include "simd/x86_avx512.h"
 #include "simd/x86_sse4.h"
 #endif
 
@@ -91,6 +93,11 @@ struct NumLanes {
 #include "simd/x86_avx2.h"
 #endif
 
+// Requires both of the above (half-vector types and shared helpers).
+#if SIMD_ENABLE_SSE4 && SIMD_ENABLE_AVX2 && SIMD_ENABLE_AVX512
+#include "simd/x86_avx512.h"
+#endif
+
 #if SIMD_ENABLE_NEON
 #include "simd/arm64_neon.h"
 #endif
@@ -118,6 +125,13 @@ struct VecT<AVX2> {
   using type = vec256<T>;
 };
 #endif
+#if SIMD_ENABLE_AVX512
+template <>
+struct VecT<AVX512> {
+  template <typename T>
+  using type = vec512<T>;
+};
+#endif
 // Alias of a vector class with lane type T and instruction set Target,
 // typically obtained from SIMD_TARGET or dispatch::Run. The default Target is
 // the 'best' (i.e. with the widest vectors) of all SIMD_ENABLE bits.
@@ -1162,26 +1162,28 @@ struct TestFloatCompare {
 // Returns "bits" after zeroing any upper bits that wouldn't be returned by
 // movemask for the given vector "V".
 template <class V>
-uint32_t ValidBits(const uint32_t bits) {
-  const uint64_t mask = (1ull << NumLanes<V>()) - 1;
+uint64_t ValidBits(const uint64_t bits) {
+  const size_t N = NumLanes<V>();
+  const uint64_t mask = (N >= 64) ? ~0ull : (1ull << N) - 1;
   return bits & mask;
 }
 
+// Arrays are large enough for 512-bit vectors; the remaining lanes are zero.
 void TestMovemask() {
   using V = vec<uint8_t>;
-  SIMD_ALIGN const uint8_t bytes[32] = {
+  SIMD_ALIGN const uint8_t bytes[64] = {
       0x80, 0xFF, 0x7F, 0x00, 0x01, 0x10,      0x20, 0x40, 0x80, 0x02, 0x04,
       0x08, 0xC0, 0xC1, 0xFE, 0x0F, /**/ 0x0F, 0xFE, 0xC1, 0xC0, 0x08, 0x04,
       0x02, 0x80, 0x40, 0x20, 0x10, 0x01,      0x00, 0x7F, 0xFF, 0x80};
   ASSERT_EQ(ValidBits<V>(0xC08E7103), ext::movemask(load(V(), bytes)));
 
-  SIMD_ALIGN const float lanes[8] = {-1.0f,  1E30f, -0.0f, 1E-30f,
-                                     1E-30f, -0.0f, 1E30f, -1.0f};
+  SIMD_ALIGN const float lanes[16] = {-1.0f,  1E30f, -0.0f, 1E-30f,
+                                      1E-30f, -0.0f, 1E30f, -1.0f};
   using VF = vec<float>;
   ASSERT_EQ(ValidBits<VF>(0xa5), ext::movemask(load(VF(), lanes)));
 
   using VD = vec<double>;
-  SIMD_ALIGN const double lanes2[4] = {1E300, -1E-300, -0.0, 1E-10};
+  SIMD_ALIGN const double lanes2[8] = {1E300, -1E-300, -0.0, 1E-10};
   ASSERT_EQ(ValidBits<VD>(6), ext::movemask(load(VD(), lanes2)));
 }
 
@@ -1366,9 +1368,37 @@ void TestStream() {
   TestStreamT<double>();
 }
 
+template <typename T, class V>
+struct TestLoadStoreMasked {
+  void operator()() const {
+#if SIMD_ENABLE_AVX512
+    constexpr size_t N = NumLanes<V>();
+    SIMD_ALIGN T lanes[N];
+    for (size_t i = 0; i < N; ++i) {
+      lanes[i] = T(i + 1);
+    }
+    for (size_t num = 0; num <= N; ++num) {
+      // Lanes beyond "num" are zero.
+      SIMD_ALIGN T expected[N];
+      SIMD_ALIGN T out[N];
+      for (size_t i = 0; i < N; ++i) {
+        expected[i] = (i < num) ? lanes[i] : T(0);
+        out[i] = T(0);
+      }
+      ASSERT_VEC_EQ(load(V(), expected), ext::load_masked(V(), lanes, num));
+
+      // Only the first "num" lanes are overwritten.
+      ext::store_masked(load(V(), lanes), out, num);
+      ASSERT_EQ(true, BytesEqual(expected, out, sizeof(expected)));
+    }
+#endif
+  }
+};
+
 void TestMemory() {
   ForeachLaneType<TestLoadStore>();
   ForeachLaneType<TestLoadDup128>();
+  ForeachLaneType<TestLoadStoreMasked>();
   TestStream();
 }
 
@@ -1442,7 +1472,7 @@ struct TestSubset {
     const auto from128 = from_subset(V(), v128);
     const auto from64 = from_subset(V(), v64);
 #if SIMD_ENABLE_AVX2
-    ASSERT_VEC_EQ(v, from_subset(V(), v256));
+    ASSERT_VEC_EQ(v256, to_subset(vec256<T>(), from_subset(V(), v256)));
 #endif
     ASSERT_VEC_EQ(v128, to_subset(vec128<T>(), from128));
     ASSERT_VEC_EQ(v64, to_subset(vec64<T>(), from64));
@@ -1607,10 +1637,13 @@ struct TestShuffleT {
     }
     using V8 = vec<uint8_t>;
     const V in(load(V8(), in_bytes));
-    SIMD_ALIGN const uint8_t index_bytes[32] = {
+    // (Large enough for 512-bit vectors; the pattern repeats every 32 bytes.)
+    SIMD_ALIGN const uint8_t index_bytes[64] = {
         // Same index as source, multiple outputs from same input,
         // unused input (9), ascending/descending and nonconsecutive neighbors.
         0,  2,  1, 2, 15, 12, 13, 14, 6,  7,  8,  5,  4, 3, 10, 11,
+        11, 10, 3, 4, 5,  8,  7,  6,  14, 13, 12, 15, 2, 1, 2,  0,
+        0,  2,  1, 2, 15, 12, 13, 14, 6,  7,  8,  5,  4, 3, 10, 11,
         11, 10, 3, 4, 5,  8,  7,  6,  14, 13, 12, 15, 2, 1, 2,  0};
     const V indices(load(V8(), index_bytes));
     SIMD_ALIGN T out_lanes[NumLanes<V>()];
@@ -0,0 +1,2 @@
+#define SIMD_ENABLE 22  // SSE4 + AVX2 + AVX512
+#include "simd_test_target.cc"
@@ -0,0 +1,1446 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// 512-bit AVX-512 (F/BW/DQ/VL) vectors and operations.
+// (No include guard nor namespace: this is included from the middle of simd.h.)
+
+// WARNING: as with AVX2, most operations do not cross 128-bit boundaries. In
+// particular, "broadcast", shuffles and zip operate on each 128-bit block.
+// Comparisons return vectors (not AVX-512 mask registers) for compatibility
+// with the other targets.
+
+// Avoid compile errors when generating deps.mk.
+#ifndef SIMD_DEPS
+
+// ================================================== vec512
+
+// Primary template for 1-8 byte integer lanes.
+template <typename T>
+struct Raw512 {
+  using type = __m512i;
+};
+
+template <>
+struct Raw512<float> {
+  using type = __m512;
+};
+
+template <>
+struct Raw512<double> {
+  using type = __m512d;
+};
+
+// Returned by load_dup128.
+template <typename T>
+struct dup128x4 {
+  using Raw = typename Raw512<T>::type;
+  explicit dup128x4(const Raw v) : raw(v) {}
+  Raw raw;
+};
+
+template <typename Lane>
+class vec512 {
+  using Raw = typename Raw512<Lane>::type;
+
+ public:
+  using T = Lane;
+
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512() {}
+  vec512(const vec512&) = default;
+  vec512& operator=(const vec512&) = default;
+  SIMD_ATTR_AVX512 SIMD_INLINE explicit vec512(const Raw v) : v_(v) {}
+
+  // Used by non-member functions; avoids verbose .raw() for each argument and
+  // reduces Clang compile time of the test by 10-20%.
+  SIMD_ATTR_AVX512 SIMD_INLINE operator Raw() const { return v_; }  // NOLINT
+
+  // Compound assignment. Only usable if there is a corresponding non-member
+  // binary operator overload. For example, only f32 and f64 support division.
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator*=(const vec512 other) {
+    return *this = (*this * other);
+  }
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator/=(const vec512 other) {
+    return *this = (*this / other);
+  }
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator+=(const vec512 other) {
+    return *this = (*this + other);
+  }
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator-=(const vec512 other) {
+    return *this = (*this - other);
+  }
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator&=(const vec512 other) {
+    return *this = (*this & other);
+  }
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator|=(const vec512 other) {
+    return *this = (*this | other);
+  }
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator^=(const vec512 other) {
+    return *this = (*this ^ other);
+  }
+  template <typename ShiftArg>  // int or vec512
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator<<=(const ShiftArg count) {
+    return *this = operator<<(*this, count);
+  }
+  template <typename ShiftArg>
+  SIMD_ATTR_AVX512 SIMD_INLINE vec512& operator>>=(const ShiftArg count) {
+    return *this = operator>>(*this, count);
+  }
+
+ private:
+  Raw v_;
+};
+
+template <typename Lane>
+struct IsVec<vec512<Lane>> {
+  static constexpr bool value = true;
+};
+
+using u8x64 = vec512<uint8_t>;
+using u16x32 = vec512<uint16_t>;
+using u32x16 = vec512<uint32_t>;
+using u64x8 = vec512<uint64_t>;
+
+using i8x64 = vec512<int8_t>;
+using i16x32 = vec512<int16_t>;
+using i32x16 = vec512<int32_t>;
+using i64x8 = vec512<int64_t>;
+
+using f32x16 = vec512<float>;
+using f64x8 = vec512<double>;
+
+// ------------------------------ Set
+
+// Returns an all-zero vector.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> setzero(vec512<T>) {
+  return vec512<T>(_mm512_setzero_si512());
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 setzero(f32x16) {
+  return f32x16(_mm512_setzero_ps());
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 setzero(f64x8) {
+  return f64x8(_mm512_setzero_pd());
+}
+
+// Returns a vector with all lanes set to "t".
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 set1(u8x64, const uint8_t t) {
+  return u8x64(_mm512_set1_epi8(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 set1(u16x32, const uint16_t t) {
+  return u16x32(_mm512_set1_epi16(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 set1(u32x16, const uint32_t t) {
+  return u32x16(_mm512_set1_epi32(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 set1(u64x8, const uint64_t t) {
+  return u64x8(_mm512_set1_epi64(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 set1(i8x64, const int8_t t) {
+  return i8x64(_mm512_set1_epi8(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 set1(i16x32, const int16_t t) {
+  return i16x32(_mm512_set1_epi16(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 set1(i32x16, const int32_t t) {
+  return i32x16(_mm512_set1_epi32(t));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 set1(i64x8, const int64_t t) {
+  return i64x8(_mm512_set1_epi64(t));
+}
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 set1(f32x16, const T t) {
+  return f32x16(_mm512_set1_ps(t));
+}
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 set1(f64x8, const T t) {
+  return f64x8(_mm512_set1_pd(t));
+}
+
+// ------------------------------ Cast to/from vector subset (zero-cost)
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> to_subset(vec512<T>, const vec512<T> v) {
+  return v;
+}
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec256<T> to_subset(vec256<T>, const vec512<T> v) {
+  return vec256<T>(_mm512_castsi512_si256(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x8 to_subset(f32x8, const f32x16 v) {
+  return f32x8(_mm512_castps512_ps256(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x4 to_subset(f64x4, const f64x8 v) {
+  return f64x4(_mm512_castpd512_pd256(v));
+}
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec128<T> to_subset(vec128<T>, const vec512<T> v) {
+  return vec128<T>(_mm512_castsi512_si128(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x4 to_subset(f32x4, const f32x16 v) {
+  return f32x4(_mm512_castps512_ps128(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x2 to_subset(f64x2, const f64x8 v) {
+  return f64x2(_mm512_castpd512_pd128(v));
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec64<T> to_subset(vec64<T>, const vec512<T> v) {
+  return vec64<T>(to_subset(vec128<T>(), v));
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec32<T> to_subset(vec32<T>, const vec512<T> v) {
+  return vec32<T>(to_subset(vec128<T>(), v));
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> from_subset(vec512<T>,
+                                                   const vec512<T> v) {
+  return v;
+}
+// Upper lane(s) are undefined.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> from_subset(vec512<T>,
+                                                   const vec256<T> v) {
+  return vec512<T>(_mm512_castsi256_si512(v));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 from_subset(f32x16, const f32x8 v) {
+  return f32x16(_mm512_castps256_ps512(v));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 from_subset(f64x8, const f64x4 v) {
+  return f64x8(_mm512_castpd256_pd512(v));
+}
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> from_subset(vec512<T>,
+                                                   const vec128<T> v) {
+  return vec512<T>(_mm512_castsi128_si512(v));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 from_subset(f32x16, const f32x4 v) {
+  return f32x16(_mm512_castps128_ps512(v));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 from_subset(f64x8, const f64x2 v) {
+  return f64x8(_mm512_castpd128_pd512(v));
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> from_subset(vec512<T>,
+                                                   const vec64<T> v) {
+  return from_subset(vec512<T>(), vec128<T>(v));
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> from_subset(vec512<T>,
+                                                   const vec32<T> v) {
+  return from_subset(vec512<T>(), vec128<T>(v));
+}
+
+// ================================================== ARITHMETIC
+
+// ------------------------------ Addition
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 operator+(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_add_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 operator+(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_add_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator+(const u32x16 a, const u32x16 b) {
+  return u32x16(_mm512_add_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator+(const u64x8 a, const u64x8 b) {
+  return u64x8(_mm512_add_epi64(a, b));
+}
+
+// Signed
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 operator+(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_add_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator+(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_add_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator+(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_add_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator+(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_add_epi64(a, b));
+}
+
+// Float
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator+(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_add_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator+(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_add_pd(a, b));
+}
+
+// ------------------------------ Subtraction
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 operator-(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_sub_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 operator-(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_sub_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator-(const u32x16 a, const u32x16 b) {
+  return u32x16(_mm512_sub_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator-(const u64x8 a, const u64x8 b) {
+  return u64x8(_mm512_sub_epi64(a, b));
+}
+
+// Signed
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 operator-(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_sub_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator-(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_sub_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator-(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_sub_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator-(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_sub_epi64(a, b));
+}
+
+// Float
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator-(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_sub_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator-(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_sub_pd(a, b));
+}
+
+// ------------------------------ Saturating addition
+
+// Returns a + b clamped to the destination range.
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 add_sat(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_adds_epu8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 add_sat(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_adds_epu16(a, b));
+}
+
+// Signed
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 add_sat(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_adds_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 add_sat(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_adds_epi16(a, b));
+}
+
+// ------------------------------ Saturating subtraction
+
+// Returns a - b clamped to the destination range.
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 sub_sat(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_subs_epu8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 sub_sat(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_subs_epu16(a, b));
+}
+
+// Signed
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 sub_sat(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_subs_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 sub_sat(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_subs_epi16(a, b));
+}
+
+// ------------------------------ Average
+
+// Returns (a + b + 1) / 2
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 avg(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_avg_epu8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 avg(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_avg_epu16(a, b));
+}
+
+// ------------------------------ Shift lanes by constant #bits
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 operator<<(const u16x32 v, const int bits) {
+  return u16x32(_mm512_slli_epi16(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 operator>>(const u16x32 v, const int bits) {
+  return u16x32(_mm512_srli_epi16(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator<<(const u32x16 v, const int bits) {
+  return u32x16(_mm512_slli_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator>>(const u32x16 v, const int bits) {
+  return u32x16(_mm512_srli_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator<<(const u64x8 v, const int bits) {
+  return u64x8(_mm512_slli_epi64(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator>>(const u64x8 v, const int bits) {
+  return u64x8(_mm512_srli_epi64(v, bits));
+}
+
+// Signed (no i64 shr)
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator<<(const i16x32 v, const int bits) {
+  return i16x32(_mm512_slli_epi16(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator>>(const i16x32 v, const int bits) {
+  return i16x32(_mm512_srai_epi16(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator<<(const i32x16 v, const int bits) {
+  return i32x16(_mm512_slli_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator>>(const i32x16 v, const int bits) {
+  return i32x16(_mm512_srai_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator<<(const i64x8 v, const int bits) {
+  return i64x8(_mm512_slli_epi64(v, bits));
+}
+
+// ------------------------------ Shift lanes by independent variable #bits
+
+// Unsigned (no u8,u16)
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator<<(const u32x16 v,
+                                               const u32x16 bits) {
+  return u32x16(_mm512_sllv_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator>>(const u32x16 v,
+                                               const u32x16 bits) {
+  return u32x16(_mm512_srlv_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator<<(const u64x8 v, const u64x8 bits) {
+  return u64x8(_mm512_sllv_epi64(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator>>(const u64x8 v, const u64x8 bits) {
+  return u64x8(_mm512_srlv_epi64(v, bits));
+}
+
+// Signed (no i8,i16,i64)
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator<<(const i32x16 v,
+                                               const i32x16 bits) {
+  return i32x16(_mm512_sllv_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator>>(const i32x16 v,
+                                               const i32x16 bits) {
+  return i32x16(_mm512_srav_epi32(v, bits));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator<<(const i64x8 v, const i64x8 bits) {
+  return i64x8(_mm512_sllv_epi64(v, bits));
+}
+
+// ------------------------------ Minimum
+
+// Unsigned (no u64)
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 min(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_min_epu8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 min(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_min_epu16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 min(const u32x16 a, const u32x16 b) {
+  return u32x16(_mm512_min_epu32(a, b));
+}
+
+// Signed (no i64)
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 min(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_min_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 min(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_min_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 min(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_min_epi32(a, b));
+}
+
+// Float
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 min(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_min_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 min(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_min_pd(a, b));
+}
+
+// ------------------------------ Maximum
+
+// Unsigned (no u64)
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 max(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_max_epu8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 max(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_max_epu16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 max(const u32x16 a, const u32x16 b) {
+  return u32x16(_mm512_max_epu32(a, b));
+}
+
+// Signed (no i64)
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 max(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_max_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 max(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_max_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 max(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_max_epi32(a, b));
+}
+
+// Float
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 max(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_max_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 max(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_max_pd(a, b));
+}
+
+// ------------------------------ Integer multiplication
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 operator*(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_mullo_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator*(const u32x16 a, const u32x16 b) {
+  return u32x16(_mm512_mullo_epi32(a, b));
+}
+
+// Signed
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator*(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_mullo_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator*(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_mullo_epi32(a, b));
+}
+
+// "Extensions": useful but quite performance-portable operations. We add
+// functions to this namespace in multiple places.
+namespace ext {
+
+// Returns the upper 16 bits of a * b in each lane.
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 mulhi(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_mulhi_epi16(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 mulhrs(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_mulhrs_epi16(a, b));
+}
+
+}  // namespace ext
+
+// Multiplies even lanes (0, 2 ..) and places the double-wide result into
+// even and the upper half into its odd neighbor lane.
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 mul_even(const i32x16 a, const i32x16 b) {
+  return i64x8(_mm512_mul_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 mul_even(const u32x16 a, const u32x16 b) {
+  return u64x8(_mm512_mul_epu32(a, b));
+}
+
+// ------------------------------ Floating-point mul / div
+
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator*(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_mul_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator*(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_mul_pd(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator/(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_div_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator/(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_div_pd(a, b));
+}
+
+// Approximate reciprocal (relative error < 2^-14)
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 rcp_approx(const f32x16 v) {
+  return f32x16(_mm512_rcp14_ps(v));
+}
+
+// ------------------------------ Floating-point multiply-add variants
+
+// Returns mul * x + add
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 mul_add(const f32x16 mul, const f32x16 x,
+                                            const f32x16 add) {
+  return f32x16(_mm512_fmadd_ps(mul, x, add));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 mul_add(const f64x8 mul, const f64x8 x,
+                                           const f64x8 add) {
+  return f64x8(_mm512_fmadd_pd(mul, x, add));
+}
+
+// Returns mul * x - sub
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 mul_sub(const f32x16 mul, const f32x16 x,
+                                            const f32x16 sub) {
+  return f32x16(_mm512_fmsub_ps(mul, x, sub));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 mul_sub(const f64x8 mul, const f64x8 x,
+                                           const f64x8 sub) {
+  return f64x8(_mm512_fmsub_pd(mul, x, sub));
+}
+
+// Returns add - mul * x
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 nmul_add(const f32x16 mul, const f32x16 x,
+                                             const f32x16 add) {
+  return f32x16(_mm512_fnmadd_ps(mul, x, add));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 nmul_add(const f64x8 mul, const f64x8 x,
+                                            const f64x8 add) {
+  return f64x8(_mm512_fnmadd_pd(mul, x, add));
+}
+
+// nmul_sub would require an additional negate of mul or x.
+
+// ------------------------------ Floating-point square root
+
+// Full precision square root
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 sqrt(const f32x16 v) {
+  return f32x16(_mm512_sqrt_ps(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 sqrt(const f64x8 v) {
+  return f64x8(_mm512_sqrt_pd(v));
+}
+
+// Approximate reciprocal square root (relative error < 2^-14)
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 rsqrt_approx(const f32x16 v) {
+  return f32x16(_mm512_rsqrt14_ps(v));
+}
+
+// ------------------------------ Floating-point rounding
+
+// Toward nearest integer
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 round_nearest(const f32x16 v) {
+  return f32x16(
+      _mm512_roundscale_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 round_nearest(const f64x8 v) {
+  return f64x8(
+      _mm512_roundscale_pd(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+// Toward +infinity, aka ceiling
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 round_pos_inf(const f32x16 v) {
+  return f32x16(
+      _mm512_roundscale_ps(v, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 round_pos_inf(const f64x8 v) {
+  return f64x8(
+      _mm512_roundscale_pd(v, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC));
+}
+
+// Toward -infinity, aka floor
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 round_neg_inf(const f32x16 v) {
+  return f32x16(
+      _mm512_roundscale_ps(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 round_neg_inf(const f64x8 v) {
+  return f64x8(
+      _mm512_roundscale_pd(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+}
+
+// ------------------------------ Convert i32 <=> f32
+
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 f32_from_i32(const i32x16 v) {
+  return f32x16(_mm512_cvtepi32_ps(v));
+}
+// Uses current rounding mode, which defaults to round-to-nearest.
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 i32_from_f32(const f32x16 v) {
+  return i32x16(_mm512_cvtps_epi32(v));
+}
+
+// ------------------------------ Cast to/from floating-point representation
+
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 float_from_bits(const u32x16 v) {
+  return f32x16(_mm512_castsi512_ps(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 float_from_bits(const i32x16 v) {
+  return f32x16(_mm512_castsi512_ps(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 bits_from_float(const f32x16 v) {
+  return i32x16(_mm512_castps_si512(v));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 float_from_bits(const u64x8 v) {
+  return f64x8(_mm512_castsi512_pd(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 float_from_bits(const i64x8 v) {
+  return f64x8(_mm512_castsi512_pd(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 bits_from_float(const f64x8 v) {
+  return i64x8(_mm512_castpd_si512(v));
+}
+
+// ------------------------------ Horizontal sum (reduction)
+
+// "Extensions": useful but quite performance-portable operations. We add
+// functions to this namespace in multiple places.
+namespace ext {
+
+// Returns 64-bit sums of 8-byte groups.
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 horz_sum(const u8x64 v) {
+  return u64x8(_mm512_sad_epu8(v, setzero(u8x64())));
+}
+
+// Supported for {uif}32x16, {uif}64x8. Returns the sum in each lane.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec128<T> horz_sum(const vec512<T> v) {
+  const vec256<T> v0 = to_subset(vec256<T>(), v);
+  const vec256<T> v1 = to_other_half(v);
+  return horz_sum(v0 + v1);
+}
+
+}  // namespace ext
+
+// ================================================== COMPARE
+
+// Comparisons fill a lane with 1-bits if the condition is true, else 0.
+// AVX-512 comparisons return a mask register; these helpers expand each mask
+// bit to a full lane so that the results can be used with select/andnot.
+
+SIMD_ATTR_AVX512 SIMD_INLINE __m512 MaskToFloat(const __mmask16 mask) {
+  return _mm512_castsi512_ps(_mm512_movm_epi32(mask));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE __m512d MaskToDouble(const __mmask8 mask) {
+  return _mm512_castsi512_pd(_mm512_movm_epi64(mask));
+}
+
+// ------------------------------ Equality
+
+// Unsigned
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 operator==(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_movm_epi8(_mm512_cmpeq_epi8_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 operator==(const u16x32 a, const u16x32 b) {
+  return u16x32(_mm512_movm_epi16(_mm512_cmpeq_epi16_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 operator==(const u32x16 a, const u32x16 b) {
+  return u32x16(_mm512_movm_epi32(_mm512_cmpeq_epi32_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 operator==(const u64x8 a, const u64x8 b) {
+  return u64x8(_mm512_movm_epi64(_mm512_cmpeq_epi64_mask(a, b)));
+}
+
+// Signed
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 operator==(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_movm_epi8(_mm512_cmpeq_epi8_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator==(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_movm_epi16(_mm512_cmpeq_epi16_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator==(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_movm_epi32(_mm512_cmpeq_epi32_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator==(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_movm_epi64(_mm512_cmpeq_epi64_mask(a, b)));
+}
+
+// Float
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator==(const f32x16 a, const f32x16 b) {
+  return f32x16(MaskToFloat(_mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator==(const f64x8 a, const f64x8 b) {
+  return f64x8(MaskToDouble(_mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ)));
+}
+
+// ------------------------------ Strict inequality
+
+// Signed/float <
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 operator<(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_movm_epi8(_mm512_cmpgt_epi8_mask(b, a)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator<(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_movm_epi16(_mm512_cmpgt_epi16_mask(b, a)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator<(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_movm_epi32(_mm512_cmpgt_epi32_mask(b, a)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator<(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_movm_epi64(_mm512_cmpgt_epi64_mask(b, a)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator<(const f32x16 a, const f32x16 b) {
+  return f32x16(MaskToFloat(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator<(const f64x8 a, const f64x8 b) {
+  return f64x8(MaskToDouble(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)));
+}
+
+// Signed/float >
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 operator>(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_movm_epi8(_mm512_cmpgt_epi8_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 operator>(const i16x32 a, const i16x32 b) {
+  return i16x32(_mm512_movm_epi16(_mm512_cmpgt_epi16_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 operator>(const i32x16 a, const i32x16 b) {
+  return i32x16(_mm512_movm_epi32(_mm512_cmpgt_epi32_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 operator>(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_movm_epi64(_mm512_cmpgt_epi64_mask(a, b)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator>(const f32x16 a, const f32x16 b) {
+  return f32x16(MaskToFloat(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator>(const f64x8 a, const f64x8 b) {
+  return f64x8(MaskToDouble(_mm512_cmp_pd_mask(a, b, _CMP_GT_OQ)));
+}
+
+// ------------------------------ Weak inequality
+
+// Float <= >=
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator<=(const f32x16 a, const f32x16 b) {
+  return f32x16(MaskToFloat(_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator<=(const f64x8 a, const f64x8 b) {
+  return f64x8(MaskToDouble(_mm512_cmp_pd_mask(a, b, _CMP_LE_OQ)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator>=(const f32x16 a, const f32x16 b) {
+  return f32x16(MaskToFloat(_mm512_cmp_ps_mask(a, b, _CMP_GE_OQ)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator>=(const f64x8 a, const f64x8 b) {
+  return f64x8(MaskToDouble(_mm512_cmp_pd_mask(a, b, _CMP_GE_OQ)));
+}
+
+// "Extensions": useful but quite performance-portable operations. We add
+// functions to this namespace in multiple places.
+namespace ext {
+
+// Returns a bit array of the most significant bit of each byte in "v", i.e.
+// sum_i=0..63 of (v[i] >> 7) << i; v[0] is the least-significant byte of "v".
+// This is useful for testing/branching based on comparison results.
+SIMD_ATTR_AVX512 SIMD_INLINE uint64_t movemask(const u8x64 v) {
+  return _mm512_movepi8_mask(v);
+}
+
+// Returns the most significant bit of each float/double lane (see above).
+SIMD_ATTR_AVX512 SIMD_INLINE uint32_t movemask(const f32x16 v) {
+  return _mm512_movepi32_mask(_mm512_castps_si512(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE uint32_t movemask(const f64x8 v) {
+  return _mm512_movepi64_mask(_mm512_castpd_si512(v));
+}
+
+// Returns whether all lanes are equal to zero. Supported for all integer V.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE bool all_zero(const vec512<T> v) {
+  return _mm512_test_epi64_mask(v, v) == 0;
+}
+
+}  // namespace ext
+
+// ================================================== LOGICAL
+
+// ------------------------------ Bitwise AND
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> operator&(const vec512<T> a,
+                                                 const vec512<T> b) {
+  return vec512<T>(_mm512_and_si512(a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator&(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_and_ps(a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator&(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_and_pd(a, b));
+}
+
+// ------------------------------ Bitwise AND-NOT
+
+// Returns ~not_mask & mask.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> andnot(const vec512<T> not_mask,
+                                              const vec512<T> mask) {
+  return vec512<T>(_mm512_andnot_si512(not_mask, mask));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 andnot(const f32x16 not_mask,
+                                           const f32x16 mask) {
+  return f32x16(_mm512_andnot_ps(not_mask, mask));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 andnot(const f64x8 not_mask,
+                                          const f64x8 mask) {
+  return f64x8(_mm512_andnot_pd(not_mask, mask));
+}
+
+// ------------------------------ Bitwise OR
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> operator|(const vec512<T> a,
+                                                 const vec512<T> b) {
+  return vec512<T>(_mm512_or_si512(a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator|(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_or_ps(a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator|(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_or_pd(a, b));
+}
+
+// ------------------------------ Bitwise XOR
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> operator^(const vec512<T> a,
+                                                 const vec512<T> b) {
+  return vec512<T>(_mm512_xor_si512(a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 operator^(const f32x16 a, const f32x16 b) {
+  return f32x16(_mm512_xor_ps(a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 operator^(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_xor_pd(a, b));
+}
+
+// ================================================== STORE
+
+// ------------------------------ Load all lanes
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> load(vec512<T>,
+                                            const T* SIMD_RESTRICT aligned) {
+  return vec512<T>(_mm512_load_si512(aligned));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16
+load<float>(f32x16, const float* SIMD_RESTRICT aligned) {
+  return f32x16(_mm512_load_ps(aligned));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8
+load<double>(f64x8, const double* SIMD_RESTRICT aligned) {
+  return f64x8(_mm512_load_pd(aligned));
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> load_unaligned(
+    vec512<T>, const T* SIMD_RESTRICT p) {
+  return vec512<T>(_mm512_loadu_si512(p));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16
+load_unaligned<float>(f32x16, const float* SIMD_RESTRICT p) {
+  return f32x16(_mm512_loadu_ps(p));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8
+load_unaligned<double>(f64x8, const double* SIMD_RESTRICT p) {
+  return f64x8(_mm512_loadu_pd(p));
+}
+
+// Loads 128 bit and duplicates into all four 128-bit blocks. This avoids the
+// 3-cycle cost of moving data between 128-bit blocks and avoids port 5.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE dup128x4<T> load_dup128(
+    vec512<T>, const T* const SIMD_RESTRICT p) {
+  return dup128x4<T>(_mm512_broadcast_i32x4(load(vec128<T>(), p)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE dup128x4<float> load_dup128(
+    f32x16, const float* const SIMD_RESTRICT p) {
+  return dup128x4<float>(_mm512_broadcast_f32x4(_mm_load_ps(p)));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE dup128x4<double> load_dup128(
+    f64x8, const double* const SIMD_RESTRICT p) {
+  return dup128x4<double>(_mm512_broadcast_f64x2(_mm_load_pd(p)));
+}
+
+// ------------------------------ Store all lanes
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE void store(const vec512<T> v,
+                                        T* SIMD_RESTRICT aligned) {
+  _mm512_store_si512(aligned, v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void store<float>(const f32x16 v,
+                                               float* SIMD_RESTRICT aligned) {
+  _mm512_store_ps(aligned, v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void store<double>(const f64x8 v,
+                                                double* SIMD_RESTRICT aligned) {
+  _mm512_store_pd(aligned, v);
+}
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE void store_unaligned(const vec512<T> v,
+                                                  T* SIMD_RESTRICT p) {
+  _mm512_storeu_si512(p, v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void store_unaligned<float>(
+    const f32x16 v, float* SIMD_RESTRICT p) {
+  _mm512_storeu_ps(p, v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void store_unaligned<double>(
+    const f64x8 v, double* SIMD_RESTRICT p) {
+  _mm512_storeu_pd(p, v);
+}
+
+// ------------------------------ Partial load/store
+
+namespace ext {
+
+// Returns a lane mask with the lowest "num" bits set.
+SIMD_INLINE uint64_t FirstLanes(const size_t num) {
+  return (num >= 64) ? ~0ull : ((1ull << num) - 1);
+}
+
+// Returns a vector whose lowest min(num, N) lanes are loaded from "p"; the
+// other lanes are zero. Memory beyond p[num - 1] is not accessed (no faults),
+// which avoids scalar loops or padding for the remainder of a row.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> load_masked(vec512<T>,
+                                                   const T* SIMD_RESTRICT p,
+                                                   const size_t num) {
+  const uint64_t mask = FirstLanes(num);
+  // (Constant-folded because sizeof(T) is known.)
+  if (sizeof(T) == 1) return vec512<T>(_mm512_maskz_loadu_epi8(mask, p));
+  if (sizeof(T) == 2) return vec512<T>(_mm512_maskz_loadu_epi16(mask, p));
+  if (sizeof(T) == 4) return vec512<T>(_mm512_maskz_loadu_epi32(mask, p));
+  return vec512<T>(_mm512_maskz_loadu_epi64(mask, p));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 load_masked<float>(
+    f32x16, const float* SIMD_RESTRICT p, const size_t num) {
+  return f32x16(_mm512_maskz_loadu_ps(FirstLanes(num), p));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 load_masked<double>(
+    f64x8, const double* SIMD_RESTRICT p, const size_t num) {
+  return f64x8(_mm512_maskz_loadu_pd(FirstLanes(num), p));
+}
+
+// Stores the lowest min(num, N) lanes of "v" to "p"; memory beyond
+// p[num - 1] is left unchanged.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE void store_masked(const vec512<T> v,
+                                               T* SIMD_RESTRICT p,
+                                               const size_t num) {
+  const uint64_t mask = FirstLanes(num);
+  if (sizeof(T) == 1) {
+    _mm512_mask_storeu_epi8(p, mask, v);
+  } else if (sizeof(T) == 2) {
+    _mm512_mask_storeu_epi16(p, mask, v);
+  } else if (sizeof(T) == 4) {
+    _mm512_mask_storeu_epi32(p, mask, v);
+  } else {
+    _mm512_mask_storeu_epi64(p, mask, v);
+  }
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void store_masked<float>(const f32x16 v,
+                                                      float* SIMD_RESTRICT p,
+                                                      const size_t num) {
+  _mm512_mask_storeu_ps(p, FirstLanes(num), v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void store_masked<double>(const f64x8 v,
+                                                       double* SIMD_RESTRICT p,
+                                                       const size_t num) {
+  _mm512_mask_storeu_pd(p, FirstLanes(num), v);
+}
+
+}  // namespace ext
+
+// ------------------------------ Non-temporal stores
+
+// Same as aligned stores on non-x86.
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE void stream(const vec512<T> v,
+                                         T* SIMD_RESTRICT aligned) {
+  _mm512_stream_si512(reinterpret_cast<__m512i*>(aligned), v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void stream<float>(const f32x16 v,
+                                                float* SIMD_RESTRICT aligned) {
+  _mm512_stream_ps(aligned, v);
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE void stream<double>(
+    const f64x8 v, double* SIMD_RESTRICT aligned) {
+  _mm512_stream_pd(aligned, v);
+}
+
+// stream(u32/64), store_fence and cache control already defined by x86_sse4.h.
+
+// ================================================== SWIZZLE
+
+// ------------------------------ Extract other half (see to_subset)
+
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec256<T> to_other_half(const vec512<T> v) {
+  return vec256<T>(_mm512_extracti64x4_epi64(v, 1));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x8 to_other_half(const f32x16 v) {
+  return f32x8(_mm512_extractf32x8_ps(v, 1));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x4 to_other_half(const f64x8 v) {
+  return f64x4(_mm512_extractf64x4_pd(v, 1));
+}
+
+// ------------------------------ Shift vector by constant #bytes
+
+// 0x01..0F, kBytes = 1 => 0x02..0F00
+template <int kBytes, typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> shift_bytes_left(const vec512<T> v) {
+  return vec512<T>(_mm512_bslli_epi128(v, kBytes));
+}
+
+// 0x01..0F, kBytes = 1 => 0x0001..0E
+template <int kBytes, typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> shift_bytes_right(const vec512<T> v) {
+  return vec512<T>(_mm512_bsrli_epi128(v, kBytes));
+}
+
+// ------------------------------ Extract from 2x 128-bit at constant offset
+
+// Extracts 128 bits from <hi, lo> by skipping the least-significant kBytes
+// (independently for each 128-bit block).
+template <int kBytes, typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> extract_concat_bytes(
+    const vec512<T> hi, const vec512<T> lo) {
+  return vec512<T>(_mm512_alignr_epi8(hi, lo, kBytes));
+}
+
+// ------------------------------ Broadcast/splat any lane
+
+// Unsigned
+template <int kLane>
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 broadcast(const u32x16 v) {
+  static_assert(0 <= kLane && kLane < NumLanes<u32x4>(), "Invalid lane");
+  return u32x16(_mm512_shuffle_epi32(v, _MM_PERM_ENUM(0x55 * kLane)));
+}
+template <int kLane>
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 broadcast(const u64x8 v) {
+  static_assert(0 <= kLane && kLane < NumLanes<u64x2>(), "Invalid lane");
+  return u64x8(_mm512_shuffle_epi32(v, kLane ? _MM_PERM_DCDC : _MM_PERM_BABA));
+}
+
+// Signed
+template <int kLane>
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 broadcast(const i32x16 v) {
+  static_assert(0 <= kLane && kLane < NumLanes<i32x4>(), "Invalid lane");
+  return i32x16(_mm512_shuffle_epi32(v, _MM_PERM_ENUM(0x55 * kLane)));
+}
+template <int kLane>
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 broadcast(const i64x8 v) {
+  static_assert(0 <= kLane && kLane < NumLanes<i64x2>(), "Invalid lane");
+  return i64x8(_mm512_shuffle_epi32(v, kLane ? _MM_PERM_DCDC : _MM_PERM_BABA));
+}
+
+// Float
+template <int kLane>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 broadcast(const f32x16 v) {
+  static_assert(0 <= kLane && kLane < NumLanes<f32x4>(), "Invalid lane");
+  return f32x16(_mm512_shuffle_ps(v, v, 0x55 * kLane));
+}
+template <int kLane>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 broadcast(const f64x8 v) {
+  static_assert(0 <= kLane && kLane < NumLanes<f64x2>(), "Invalid lane");
+  return f64x8(_mm512_shuffle_pd(v, v, 255 * kLane));
+}
+
+// ------------------------------ Shuffle bytes with variable indices
+
+// Returns vector of bytes[from[i]]. "from" must be valid indices in [0, 16) or
+// >= 0x80 to zero the i-th output byte.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> shuffle_bytes(const vec512<T> bytes,
+                                                     const vec512<T> from) {
+  return vec512<T>(_mm512_shuffle_epi8(bytes, from));
+}
+
+// ------------------------------ Hard-coded shuffles
+
+// Notation: let i32x16 have lanes F..0 (0 is least-significant).
+// shuffle_0321 rotates four-lane blocks one lane to the right (the previous
+// least-significant lane is now most-significant => ..47650321). These could
+// also be implemented via extract_concat_bytes but the shuffle_abcd notation
+// is more convenient.
+
+// Swap 64-bit halves
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 shuffle_1032(const i32x16 v) {
+  return i32x16(_mm512_shuffle_epi32(v, _MM_PERM_BADC));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 shuffle_1032(const f32x16 v) {
+  return f32x16(_mm512_shuffle_ps(v, v, 0x4E));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 shuffle_01(const i64x8 v) {
+  return i64x8(_mm512_shuffle_epi32(v, _MM_PERM_BADC));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 shuffle_01(const f64x8 v) {
+  return f64x8(_mm512_shuffle_pd(v, v, 0x55));
+}
+
+// Rotate right 32 bits
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 shuffle_0321(const i32x16 v) {
+  return i32x16(_mm512_shuffle_epi32(v, _MM_PERM_ADCB));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 shuffle_0321(const f32x16 v) {
+  return f32x16(_mm512_shuffle_ps(v, v, 0x39));
+}
+// Rotate left 32 bits
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 shuffle_2103(const i32x16 v) {
+  return i32x16(_mm512_shuffle_epi32(v, _MM_PERM_CBAD));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 shuffle_2103(const f32x16 v) {
+  return f32x16(_mm512_shuffle_ps(v, v, 0x93));
+}
+
+// ------------------------------ Interleave lanes
+
+// Interleaves lanes from halves of the 128-bit blocks of "a" (which provides
+// the least-significant lane) and "b". To concatenate two half-width integers
+// into one, use zip_lo/hi instead (also works with vec1).
+
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 interleave_lo(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_unpacklo_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 interleave_lo(const u16x32 a,
+                                                  const u16x32 b) {
+  return u16x32(_mm512_unpacklo_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 interleave_lo(const u32x16 a,
+                                                  const u32x16 b) {
+  return u32x16(_mm512_unpacklo_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 interleave_lo(const u64x8 a, const u64x8 b) {
+  return u64x8(_mm512_unpacklo_epi64(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 interleave_lo(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_unpacklo_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 interleave_lo(const i16x32 a,
+                                                  const i16x32 b) {
+  return i16x32(_mm512_unpacklo_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 interleave_lo(const i32x16 a,
+                                                  const i32x16 b) {
+  return i32x16(_mm512_unpacklo_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 interleave_lo(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_unpacklo_epi64(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 interleave_lo(const f32x16 a,
+                                                  const f32x16 b) {
+  return f32x16(_mm512_unpacklo_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 interleave_lo(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_unpacklo_pd(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE u8x64 interleave_hi(const u8x64 a, const u8x64 b) {
+  return u8x64(_mm512_unpackhi_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 interleave_hi(const u16x32 a,
+                                                  const u16x32 b) {
+  return u16x32(_mm512_unpackhi_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 interleave_hi(const u32x16 a,
+                                                  const u32x16 b) {
+  return u32x16(_mm512_unpackhi_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 interleave_hi(const u64x8 a, const u64x8 b) {
+  return u64x8(_mm512_unpackhi_epi64(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i8x64 interleave_hi(const i8x64 a, const i8x64 b) {
+  return i8x64(_mm512_unpackhi_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 interleave_hi(const i16x32 a,
+                                                  const i16x32 b) {
+  return i16x32(_mm512_unpackhi_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 interleave_hi(const i32x16 a,
+                                                  const i32x16 b) {
+  return i32x16(_mm512_unpackhi_epi32(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 interleave_hi(const i64x8 a, const i64x8 b) {
+  return i64x8(_mm512_unpackhi_epi64(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 interleave_hi(const f32x16 a,
+                                                  const f32x16 b) {
+  return f32x16(_mm512_unpackhi_ps(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 interleave_hi(const f64x8 a, const f64x8 b) {
+  return f64x8(_mm512_unpackhi_pd(a, b));
+}
+
+// ------------------------------ Zip lanes
+
+// Same as interleave_*, except that the return lanes are double-width integers;
+// this is necessary because the single-lane vec1 cannot return two values.
+
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 zip_lo(const u8x64 a, const u8x64 b) {
+  return u16x32(_mm512_unpacklo_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 zip_lo(const u16x32 a, const u16x32 b) {
+  return u32x16(_mm512_unpacklo_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 zip_lo(const u32x16 a, const u32x16 b) {
+  return u64x8(_mm512_unpacklo_epi32(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 zip_lo(const i8x64 a, const i8x64 b) {
+  return i16x32(_mm512_unpacklo_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 zip_lo(const i16x32 a, const i16x32 b) {
+  return i32x16(_mm512_unpacklo_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 zip_lo(const i32x16 a, const i32x16 b) {
+  return i64x8(_mm512_unpacklo_epi32(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 zip_hi(const u8x64 a, const u8x64 b) {
+  return u16x32(_mm512_unpackhi_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 zip_hi(const u16x32 a, const u16x32 b) {
+  return u32x16(_mm512_unpackhi_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 zip_hi(const u32x16 a, const u32x16 b) {
+  return u64x8(_mm512_unpackhi_epi32(a, b));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 zip_hi(const i8x64 a, const i8x64 b) {
+  return i16x32(_mm512_unpackhi_epi8(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 zip_hi(const i16x32 a, const i16x32 b) {
+  return i32x16(_mm512_unpackhi_epi16(a, b));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 zip_hi(const i32x16 a, const i32x16 b) {
+  return i64x8(_mm512_unpackhi_epi32(a, b));
+}
+
+// ------------------------------ Promotions (subset w/ narrow lanes -> full)
+
+// Unsigned: zero-extend.
+// Note: these have 3 cycle latency; if inputs are already split across the
+// 128 bit blocks (in their upper/lower halves), then zip_hi/lo would be faster.
+SIMD_ATTR_AVX512 SIMD_INLINE u16x32 convert_to(uint16_t, const u8x32 v) {
+  return u16x32(_mm512_cvtepu8_epi16(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 convert_to(uint32_t, const u8x16 v) {
+  return u32x16(_mm512_cvtepu8_epi32(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 convert_to(int16_t, const u8x32 v) {
+  return i16x32(_mm512_cvtepu8_epi16(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 convert_to(int32_t, const u8x16 v) {
+  return i32x16(_mm512_cvtepu8_epi32(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u32x16 convert_to(uint32_t, const u16x16 v) {
+  return u32x16(_mm512_cvtepu16_epi32(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 convert_to(int32_t, const u16x16 v) {
+  return i32x16(_mm512_cvtepu16_epi32(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE u64x8 convert_to(uint64_t, const u32x8 v) {
+  return u64x8(_mm512_cvtepu32_epi64(v));
+}
+
+// Signed: replicate sign bit.
+// Note: these have 3 cycle latency; if inputs are already split across the
+// 128 bit blocks (in their upper/lower halves), then zip_hi/lo followed by
+// signed shift would be faster.
+SIMD_ATTR_AVX512 SIMD_INLINE i16x32 convert_to(int16_t, const i8x32 v) {
+  return i16x32(_mm512_cvtepi8_epi16(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 convert_to(int32_t, const i8x16 v) {
+  return i32x16(_mm512_cvtepi8_epi32(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i32x16 convert_to(int32_t, const i16x16 v) {
+  return i32x16(_mm512_cvtepi16_epi32(v));
+}
+SIMD_ATTR_AVX512 SIMD_INLINE i64x8 convert_to(int64_t, const i32x8 v) {
+  return i64x8(_mm512_cvtepi32_epi64(v));
+}
+
+// ------------------------------ Demotions (full -> subset w/ narrow lanes)
+
+// Unlike packus/packs, these preserve the lane order. The unsigned variants
+// saturate unsigned inputs, hence negative values are first clamped to zero.
+
+SIMD_ATTR_AVX512 SIMD_INLINE u16x16 convert_to(uint16_t, const i32x16 v) {
+  const __m512i nonnegative = _mm512_max_epi32(v, _mm512_setzero_si512());
+  return u16x16(_mm512_cvtusepi32_epi16(nonnegative));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE u8x16 convert_to(uint8_t, const i32x16 v) {
+  const __m512i nonnegative = _mm512_max_epi32(v, _mm512_setzero_si512());
+  return u8x16(_mm512_cvtusepi32_epi8(nonnegative));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i16x16 convert_to(int16_t, const i32x16 v) {
+  return i16x16(_mm512_cvtsepi32_epi16(v));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i8x16 convert_to(int8_t, const i32x16 v) {
+  return i8x16(_mm512_cvtsepi32_epi8(v));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE u8x32 convert_to(uint8_t, const i16x32 v) {
+  const __m512i nonnegative = _mm512_max_epi16(v, _mm512_setzero_si512());
+  return u8x32(_mm512_cvtusepi16_epi8(nonnegative));
+}
+
+SIMD_ATTR_AVX512 SIMD_INLINE i8x32 convert_to(int8_t, const i16x32 v) {
+  return i8x32(_mm512_cvtsepi16_epi8(v));
+}
+
+// ------------------------------ Select/blend
+
+// Returns mask ? b : a. Due to ARM's semantics, each lane of "mask" must
+// equal T(0) or ~T(0) although x86 may only check the most significant bit.
+template <typename T>
+SIMD_ATTR_AVX512 SIMD_INLINE vec512<T> select(const vec512<T> a,
+                                              const vec512<T> b,
+                                              const vec512<T> mask) {
+  return vec512<T>(_mm512_mask_blend_epi8(_mm512_movepi8_mask(mask), a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f32x16 select<float>(const f32x16 a,
+                                                  const f32x16 b,
+                                                  const f32x16 mask) {
+  const __mmask16 k = _mm512_movepi32_mask(_mm512_castps_si512(mask));
+  return f32x16(_mm512_mask_blend_ps(k, a, b));
+}
+template <>
+SIMD_ATTR_AVX512 SIMD_INLINE f64x8 select<double>(const f64x8 a,
+                                                  const f64x8 b,
+                                                  const f64x8 mask) {
+  const __mmask8 k = _mm512_movepi64_mask(_mm512_castpd_si512(mask));
+  return f64x8(_mm512_mask_blend_pd(k, a, b));
+}
+
+// aes_round already defined by x86_sse4.h.
+
+#endif  // SIMD_DEPS
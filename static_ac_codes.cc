@@ -0,0 +1,546 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "static_ac_codes.h"
+
+#include "status.h"
+
+namespace pik {
+
+namespace {
+
+// Derived from the AC statistics of photographic images quantized with the
+// adaptive quantization field of the fast mode, scaled to lower (set 1) and
+// higher (set 2) quality.
+const uint16_t kStaticACCountsData[kNumStaticACCodeSets][kNumStaticACContexts]
+                                  [kStaticACAlphabetSize] = {
+  {  // Set 1: lower quality.
+    {
+      42, 61, 154, 222, 126, 80, 61, 43, 32, 27, 21, 19,
+      16, 15, 13, 10, 8, 10, 5, 7, 6, 5, 4, 3,
+      2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      13, 26, 52, 91, 93, 58, 41, 36, 49, 50, 35, 33,
+      33, 34, 32, 26, 29, 25, 24, 21, 21, 18, 19, 18,
+      17, 15, 13, 12, 11, 13, 9, 9, 6, 6, 4, 3,
+      2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      212, 180, 220, 37, 7, 5, 6, 6, 6, 6, 9, 9,
+      13, 14, 16, 17, 17, 18, 20, 20, 18, 17, 16, 16,
+      13, 15, 10, 13, 10, 8, 9, 6, 5, 4, 2, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 207, 400, 205, 63, 16, 21, 27, 28, 1, 1, 2,
+      2, 1, 10, 2, 1, 0, 1, 15, 1, 12, 1, 1,
+      1, 1, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 169, 47, 2, 172, 1, 55, 67, 43, 47, 0, 36,
+      3, 22, 2, 18, 18, 0, 15, 1, 18, 211, 1, 12,
+      13, 13, 0, 2, 1, 12, 12, 0, 0, 1, 1, 1,
+      0, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 191, 31, 4, 115, 1, 85, 10, 70, 54, 0, 47,
+      1, 41, 9, 31, 26, 0, 32, 3, 32, 133, 1, 21,
+      16, 20, 1, 2, 1, 15, 12, 0, 0, 2, 1, 1,
+      1, 1, 1, 1, 1, 0, 1, 0, 0, 1, 1, 1,
+      0, 1, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 204, 16, 1, 136, 1, 103, 7, 81, 72, 0, 60,
+      1, 52, 4, 45, 32, 0, 34, 6, 20, 48, 1, 23,
+      18, 15, 1, 2, 1, 14, 9, 0, 0, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 1, 1,
+      0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 237, 363, 172, 80, 20, 19, 57, 10, 9, 1, 6,
+      4, 4, 5, 2, 2, 1, 2, 3, 1, 9, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 0,
+      1, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 272, 218, 167, 106, 14, 57, 54, 34, 17, 1, 9,
+      6, 8, 12, 3, 2, 1, 2, 5, 2, 1, 1, 2,
+      2, 1, 1, 4, 1, 1, 1, 0, 0, 1, 6, 1,
+      0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 155, 295, 319, 27, 101, 5, 50, 3, 1, 24, 2,
+      19, 1, 3, 1, 1, 3, 1, 1, 1, 0, 1, 0,
+      0, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 0,
+      1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 268, 266, 167, 101, 4, 38, 53, 31, 1, 0, 2,
+      45, 1, 12, 0, 1, 0, 0, 21, 0, 4, 1, 0,
+      0, 0, 5, 0, 0, 1, 0, 0, 0, 0, 1, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 232, 146, 53, 84, 1, 93, 49, 70, 36, 1, 17,
+      11, 12, 8, 13, 9, 0, 8, 5, 8, 64, 1, 7,
+      6, 7, 2, 22, 1, 6, 5, 1, 0, 1, 2, 1,
+      1, 1, 1, 27, 1, 1, 1, 0, 1, 0, 1, 1,
+      1, 0, 0, 0, 2, 0, 0, 0, 0, 1, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 244, 104, 48, 147, 10, 86, 21, 60, 41, 2, 30,
+      2, 22, 10, 17, 13, 1, 16, 7, 9, 22, 1, 7,
+      7, 12, 1, 4, 3, 4, 2, 1, 1, 2, 1, 2,
+      1, 1, 9, 1, 7, 1, 1, 0, 1, 1, 1, 1,
+      0, 15, 2, 1, 1, 1, 4, 1, 1, 0, 1, 1,
+      0, 0, 1, 1, 0, 1, 0, 3, 0, 0, 1, 1,
+      0, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 278, 51, 11, 167, 2, 112, 15, 84, 58, 1, 43,
+      1, 35, 7, 26, 19, 1, 14, 5, 12, 16, 1, 10,
+      9, 7, 1, 4, 3, 4, 4, 0, 0, 2, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1,
+      0, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 212, 311, 210, 33, 93, 8, 37, 10, 8, 23, 4,
+      18, 2, 3, 1, 1, 1, 1, 3, 1, 7, 11, 1,
+      1, 1, 1, 1, 4, 1, 1, 2, 1, 1, 1, 0,
+      1, 1, 1, 0, 0, 2, 0, 1, 0, 1, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 301, 217, 72, 125, 32, 62, 51, 34, 15, 7, 9,
+      15, 6, 17, 4, 3, 1, 2, 6, 1, 1, 3, 1,
+      1, 1, 4, 6, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 4, 1, 1, 1, 1, 1, 0, 1, 0,
+      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,
+      0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 187, 355, 224, 32, 85, 9, 35, 6, 3, 19, 1,
+      21, 1, 5, 1, 1, 10, 1, 1, 1, 0, 7, 0,
+      0, 0, 2, 1, 1, 0, 0, 1, 2, 0, 1, 0,
+      1, 0, 1, 1, 0, 1, 0, 1, 1, 1, 0, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 594, 114, 17, 182, 3, 20, 51, 15, 1, 1, 1,
+      10, 1, 1, 1, 0, 0, 1, 3, 1, 1, 1, 1,
+      0, 0, 0, 0, 0, 1, 1, 1, 0, 0, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 465, 103, 31, 105, 9, 25, 19, 22, 39, 1, 16,
+      7, 17, 12, 10, 8, 0, 1, 19, 1, 12, 1, 1,
+      1, 1, 5, 21, 6, 2, 3, 1, 0, 4, 1, 16,
+      0, 13, 1, 4, 0, 2, 0, 0, 0, 0, 1, 5,
+      0, 0, 2, 1, 1, 1, 0, 0, 0, 1, 0, 1,
+      0, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 249, 132, 32, 136, 1, 85, 42, 55, 42, 1, 24,
+      5, 22, 24, 15, 12, 0, 11, 14, 11, 9, 1, 6,
+      6, 6, 3, 12, 7, 4, 1, 1, 0, 6, 2, 5,
+      1, 3, 5, 1, 5, 1, 3, 0, 1, 3, 1, 1,
+      0, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1,
+      0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1,
+      0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 263, 148, 25, 122, 1, 79, 32, 58, 43, 1, 35,
+      2, 24, 24, 15, 14, 0, 10, 21, 9, 4, 1, 5,
+      4, 3, 2, 14, 11, 3, 1, 1, 0, 8, 1, 5,
+      1, 3, 2, 1, 2, 1, 1, 0, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+      0, 0, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0,
+      0, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 242, 214, 151, 85, 43, 28, 35, 17, 16, 10, 9,
+      28, 6, 16, 5, 5, 1, 2, 10, 1, 25, 3, 3,
+      4, 1, 10, 19, 11, 6, 1, 1, 0, 4, 1, 1,
+      1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 1, 1,
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+      0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 294, 159, 53, 153, 11, 83, 60, 48, 26, 1, 13,
+      10, 13, 26, 7, 5, 0, 2, 15, 2, 5, 1, 1,
+      2, 1, 4, 5, 2, 1, 1, 0, 0, 4, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 0,
+      1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 321, 230, 45, 133, 13, 57, 85, 30, 15, 2, 11,
+      10, 4, 24, 3, 3, 1, 1, 8, 1, 1, 1, 1,
+      0, 1, 2, 3, 2, 0, 0, 1, 0, 1, 1, 1,
+      1, 2, 0, 1, 0, 1, 1, 1, 1, 0, 0, 1,
+      1, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+  },
+  {  // Set 2: higher quality.
+    {
+      13, 17, 46, 117, 71, 66, 36, 40, 30, 30, 27, 20,
+      18, 20, 18, 21, 20, 24, 21, 23, 22, 19, 18, 17,
+      17, 15, 16, 15, 15, 16, 13, 14, 13, 15, 12, 12,
+      10, 10, 11, 11, 8, 8, 8, 6, 5, 4, 3, 3,
+      3, 2, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      1, 4, 13, 28, 49, 62, 58, 54, 33, 28, 23, 19,
+      12, 10, 7, 7, 6, 8, 9, 10, 12, 14, 13, 13,
+      13, 13, 11, 15, 14, 14, 16, 20, 18, 20, 22, 22,
+      23, 22, 25, 22, 26, 21, 21, 21, 16, 20, 17, 21,
+      18, 13, 12, 11, 7, 5, 2, 1, 2, 1, 1, 1,
+      1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      21, 74, 224, 180, 87, 44, 24, 14, 8, 7, 2, 2,
+      1, 1, 1, 1, 1, 2, 2, 1, 2, 2, 3, 3,
+      2, 5, 7, 7, 7, 8, 8, 8, 11, 13, 13, 12,
+      13, 14, 15, 16, 13, 15, 15, 13, 14, 16, 13, 13,
+      11, 9, 7, 7, 5, 2, 1, 1, 1, 1, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 154, 218, 311, 46, 200, 13, 26, 7, 1, 8, 1,
+      7, 1, 7, 1, 1, 0, 1, 7, 1, 1, 1, 1,
+      1, 1, 4, 0, 0, 0, 1, 0, 0, 0, 2, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 287, 76, 56, 111, 12, 74, 86, 41, 52, 0, 21,
+      24, 13, 5, 9, 10, 0, 5, 12, 8, 63, 2, 8,
+      6, 8, 0, 15, 1, 5, 3, 0, 0, 1, 1, 1,
+      0, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 310, 146, 14, 147, 3, 82, 49, 49, 29, 0, 22,
+      3, 17, 20, 13, 9, 0, 13, 10, 13, 17, 1, 5,
+      6, 7, 2, 5, 4, 4, 2, 0, 0, 2, 1, 1,
+      1, 1, 2, 1, 3, 0, 1, 0, 0, 1, 1, 1,
+      0, 1, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 313, 121, 7, 165, 1, 93, 49, 59, 41, 0, 27,
+      2, 21, 23, 14, 9, 0, 7, 12, 6, 6, 1, 4,
+      4, 3, 1, 8, 4, 2, 1, 0, 0, 3, 1, 2,
+      1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 1, 1,
+      0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 160, 234, 257, 40, 158, 8, 50, 6, 4, 49, 4,
+      15, 2, 4, 1, 1, 2, 1, 3, 1, 7, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 0,
+      1, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 292, 224, 93, 120, 25, 61, 62, 31, 16, 3, 10,
+      10, 6, 23, 4, 2, 1, 2, 8, 2, 1, 1, 1,
+      1, 1, 2, 5, 1, 1, 1, 0, 0, 1, 1, 1,
+      0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 137, 233, 286, 26, 202, 7, 37, 3, 1, 35, 1,
+      26, 1, 5, 1, 1, 3, 1, 2, 1, 0, 4, 0,
+      0, 0, 2, 1, 1, 0, 0, 1, 1, 1, 1, 0,
+      1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 254, 337, 144, 111, 14, 30, 55, 7, 1, 0, 1,
+      30, 1, 18, 0, 1, 0, 0, 8, 0, 1, 3, 0,
+      0, 0, 5, 0, 0, 1, 0, 0, 0, 0, 1, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 385, 134, 50, 110, 19, 105, 33, 42, 28, 1, 6,
+      12, 8, 27, 3, 1, 0, 1, 8, 1, 3, 5, 1,
+      1, 1, 1, 3, 1, 1, 1, 1, 0, 1, 3, 1,
+      1, 1, 1, 5, 1, 1, 1, 0, 5, 0, 1, 1,
+      1, 0, 0, 0, 4, 0, 0, 0, 0, 1, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 312, 215, 69, 120, 33, 52, 61, 25, 13, 8, 6,
+      9, 5, 19, 3, 2, 2, 3, 8, 2, 1, 1, 1,
+      1, 1, 3, 4, 2, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1,
+      0, 2, 2, 1, 1, 1, 2, 1, 1, 0, 4, 1,
+      0, 0, 1, 1, 0, 1, 0, 1, 0, 0, 1, 1,
+      0, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 353, 198, 29, 150, 5, 67, 59, 35, 20, 1, 12,
+      5, 7, 23, 4, 3, 1, 2, 10, 1, 1, 1, 1,
+      1, 1, 2, 5, 3, 1, 1, 0, 0, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1,
+      0, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 127, 197, 261, 15, 245, 3, 17, 3, 1, 83, 1,
+      10, 1, 1, 1, 1, 21, 1, 1, 1, 1, 8, 1,
+      1, 1, 1, 1, 1, 1, 1, 4, 1, 1, 1, 0,
+      1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 304, 270, 85, 95, 25, 36, 66, 15, 5, 14, 3,
+      19, 2, 19, 1, 1, 14, 1, 6, 1, 1, 6, 1,
+      1, 1, 4, 2, 1, 1, 1, 1, 2, 1, 1, 1,
+      2, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0,
+      1, 0, 0, 0, 1, 1, 0, 0, 0, 1, 0, 0,
+      0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 115, 218, 300, 15, 197, 5, 19, 2, 1, 73, 1,
+      17, 1, 3, 1, 1, 19, 1, 1, 1, 0, 10, 0,
+      0, 0, 1, 1, 1, 0, 0, 3, 4, 0, 1, 0,
+      1, 0, 1, 1, 0, 1, 0, 1, 1, 1, 0, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 315, 438, 64, 63, 3, 29, 41, 39, 1, 1, 1,
+      8, 1, 3, 1, 0, 0, 1, 6, 1, 1, 2, 1,
+      0, 0, 0, 0, 0, 1, 1, 1, 0, 0, 1, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 287, 110, 14, 233, 6, 36, 26, 26, 53, 3, 38,
+      1, 28, 3, 10, 6, 0, 6, 2, 6, 75, 1, 5,
+      3, 4, 1, 7, 1, 3, 3, 1, 0, 1, 1, 1,
+      0, 1, 1, 3, 0, 1, 0, 0, 0, 0, 1, 3,
+      0, 0, 1, 1, 2, 1, 0, 0, 0, 1, 0, 1,
+      0, 1, 0, 1, 1, 1, 0, 0, 0, 1, 0, 0,
+      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 258, 267, 98, 98, 27, 37, 77, 17, 8, 1, 4,
+      19, 4, 26, 2, 2, 0, 3, 9, 2, 10, 3, 1,
+      1, 1, 7, 4, 2, 1, 1, 1, 0, 2, 2, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1,
+      0, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1,
+      0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1,
+      0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 260, 256, 94, 106, 20, 47, 66, 23, 12, 1, 7,
+      15, 3, 28, 2, 2, 0, 1, 14, 1, 1, 2, 1,
+      1, 1, 7, 7, 4, 1, 1, 1, 0, 2, 4, 1,
+      1, 1, 1, 2, 1, 1, 1, 0, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+      0, 0, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0,
+      0, 1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 263, 387, 147, 51, 51, 12, 33, 5, 2, 20, 5,
+      10, 1, 4, 1, 1, 3, 1, 1, 1, 1, 2, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1,
+      1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 1, 1,
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+      0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 250, 309, 144, 58, 44, 21, 80, 7, 4, 10, 2,
+      25, 2, 20, 1, 1, 0, 1, 5, 1, 1, 3, 1,
+      1, 1, 6, 5, 1, 1, 1, 0, 0, 1, 2, 1,
+      1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 0,
+      1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+      0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+      0, 209, 317, 194, 48, 56, 11, 71, 6, 2, 18, 1,
+      33, 1, 15, 1, 1, 3, 1, 5, 1, 1, 6, 1,
+      0, 1, 4, 1, 1, 0, 0, 1, 0, 1, 1, 1,
+      1, 1, 0, 1, 0, 1, 1, 1, 1, 0, 0, 1,
+      1, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+  },
+};
+
+}  // namespace
+
+const uint16_t* StaticACCounts(const int index) {
+  PIK_ASSERT(1 <= index && index <= kNumStaticACCodeSets);
+  return &kStaticACCountsData[index - 1][0][0];
+}
+
+std::vector<uint8_t> StaticACContextMap() {
+  static const int kStaticZdensContextMap[120] = {
+    0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
+    0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
+    5, 5, 5, 5, 5, 5, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3,
+    6, 6, 6, 6, 5, 5, 2, 2, 2, 2, 2, 3, 3, 3, 3,
+    6, 6, 6, 6, 5, 5, 2, 2, 2, 2, 2, 3, 3, 3,
+    6, 6, 6, 6, 5, 5, 2, 2, 2, 2, 2,
+  };
+  static const int kNumStaticZdensContexts = 7;
+  std::vector<uint8_t> context_map(48 + 3 * 120);
+  for (int c = 0; c < 3; ++c) {
+    for (int i = 0; i < 16; ++i) {
+      context_map[c * 16 + i] = c;
+    }
+    for (int i = 0; i < 120; ++i) {
+      context_map[48 + c * 120 + i] =
+          3 + c * kNumStaticZdensContexts + kStaticZdensContextMap[i];
+    }
+  }
+  return context_map;
+}
+
+}  // namespace pik
@@ -0,0 +1,50 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef STATIC_AC_CODES_H_
+#define STATIC_AC_CODES_H_
+
+// Built-in AC histograms that an image can reference by index instead of
+// transmitting its own (see Header::kStaticACCodes).
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace pik {
+
+// Index 0 means the histograms are transmitted; built-in sets are numbered
+// from 1. New sets (or revised versions of existing ones) must be appended
+// with a new index so that existing files remain decodable.
+static const int kNumStaticACCodeSets = 2;
+
+// Number of histograms after applying StaticACContextMap().
+static const int kNumStaticACContexts = 24;
+
+// Symbols (after kIndexLut) at or above this have zero probability.
+static const int kStaticACAlphabetSize = 96;
+
+// Returns the kNumStaticACContexts x kStaticACAlphabetSize ANS counts of
+// built-in set "index" in [1, kNumStaticACCodeSets]. Each histogram sums to
+// ANS_TAB_SIZE.
+const uint16_t* StaticACCounts(int index);
+
+// Maps the ACBlockProcessor contexts to kNumStaticACContexts histograms: one
+// for the number of non-zeros per channel and seven zero density contexts per
+// channel.
+std::vector<uint8_t> StaticACContextMap();
+
+}  // namespace pik
+
+#endif  // STATIC_AC_CODES_H_
@@ -0,0 +1,210 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace pik {
+namespace {
+
+double Now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void PinThreads(std::vector<std::thread>* threads) {
+#ifdef __linux__
+  cpu_set_t available;
+  if (sched_getaffinity(0, sizeof(available), &available) != 0) return;
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &available)) cpus.push_back(cpu);
+  }
+  if (cpus.empty()) return;
+  for (size_t i = 0; i < threads->size(); ++i) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpus[i % cpus.size()], &cpu_set);
+    // Failure only affects performance.
+    pthread_setaffinity_np((*threads)[i].native_handle(), sizeof(cpu_set),
+                           &cpu_set);
+  }
+#endif
+}
+
+}  // namespace
+
+ThreadContext* CurrentThreadContext() {
+  static thread_local ThreadContext context;
+  return &context;
+}
+
+void ThreadPoolStats::Assimilate(const ThreadPoolStats& victim) {
+  num_runs += victim.num_runs;
+  num_tasks += victim.num_tasks;
+  num_stolen += victim.num_stolen;
+  num_serial_tasks += victim.num_serial_tasks;
+  run_seconds += victim.run_seconds;
+  if (idle_seconds.size() < victim.idle_seconds.size()) {
+    idle_seconds.resize(victim.idle_seconds.size(), 0.0);
+  }
+  for (size_t i = 0; i < victim.idle_seconds.size(); ++i) {
+    idle_seconds[i] += victim.idle_seconds[i];
+  }
+}
+
+ThreadPoolStats ThreadPoolStats::Since(const ThreadPoolStats& before) const {
+  ThreadPoolStats delta = *this;
+  delta.num_runs -= before.num_runs;
+  delta.num_tasks -= before.num_tasks;
+  delta.num_stolen -= before.num_stolen;
+  delta.num_serial_tasks -= before.num_serial_tasks;
+  delta.run_seconds -= before.run_seconds;
+  const size_t num = std::min(idle_seconds.size(), before.idle_seconds.size());
+  for (size_t i = 0; i < num; ++i) {
+    delta.idle_seconds[i] -= before.idle_seconds[i];
+  }
+  return delta;
+}
+
+double ThreadPoolStats::TotalIdleSeconds() const {
+  double total = 0.0;
+  for (const double seconds : idle_seconds) {
+    total += seconds;
+  }
+  return total;
+}
+
+ThreadPool::ThreadPool(const int num_threads, const bool pin_threads) {
+  if (num_threads <= 0) return;
+  ranges_.reset(new Range[num_threads]);
+  worker_stats_.reset(new WorkerStats[num_threads]);
+  for (int i = 0; i < num_threads; ++i) {
+    ranges_[i].next.store(0, std::memory_order_relaxed);
+    ranges_[i].end = 0;
+  }
+  stats_.idle_seconds.resize(num_threads, 0.0);
+  workers_.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+  if (pin_threads) PinThreads(&workers_);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_ready_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::RunTasks(const int begin, const int end,
+                          const Callback callback, const void* opaque) {
+  const int num_workers = static_cast<int>(workers_.size());
+  const int num_tasks = end - begin;
+  // ceil(num_tasks / num_workers) tasks per worker; trailing workers may get
+  // empty ranges and then immediately start stealing.
+  const int per_worker = (num_tasks + num_workers - 1) / num_workers;
+  for (int i = 0; i < num_workers; ++i) {
+    const int range_begin = std::min(end, begin + i * per_worker);
+    ranges_[i].next.store(range_begin, std::memory_order_relaxed);
+    ranges_[i].end = std::min(end, range_begin + per_worker);
+    worker_stats_[i].num_tasks = 0;
+    worker_stats_[i].num_stolen = 0;
+    worker_stats_[i].busy_seconds = 0.0;
+  }
+
+  const double start = Now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  callback_ = callback;
+  opaque_ = opaque;
+  context_ = *CurrentThreadContext();
+  num_busy_ = num_workers;
+  ++generation_;
+  work_ready_.notify_all();
+  work_done_.wait(lock, [this] { return num_busy_ == 0; });
+
+  // The mutex also ensures the workers' counters are visible here.
+  const double elapsed = Now() - start;
+  ++stats_.num_runs;
+  stats_.run_seconds += elapsed;
+  for (int i = 0; i < num_workers; ++i) {
+    const WorkerStats& worker = worker_stats_[i];
+    stats_.num_tasks += worker.num_tasks;
+    stats_.num_stolen += worker.num_stolen;
+    stats_.idle_seconds[i] += std::max(0.0, elapsed - worker.busy_seconds);
+  }
+}
+
+void ThreadPool::WorkerLoop(const int thread) {
+  uint64_t seen_generation = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_ready_.wait(lock, [this, seen_generation] {
+        return shutdown_ || generation_ != seen_generation;
+      });
+      if (shutdown_) return;
+      seen_generation = generation_;
+      *CurrentThreadContext() = context_;
+    }
+
+    ProcessTasks(thread);
+    // Before the caller may end the scopes that own the context.
+    *CurrentThreadContext() = ThreadContext();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--num_busy_ == 0) {
+      work_done_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::ProcessTasks(const int thread) {
+  const double start = Now();
+  WorkerStats& stats = worker_stats_[thread];
+  const int num_workers = static_cast<int>(workers_.size());
+  // Own range first, then steal from the others in round-robin order.
+  for (int i = 0; i < num_workers; ++i) {
+    Range& range = ranges_[(thread + i) % num_workers];
+    for (;;) {
+      const int task = range.next.fetch_add(1, std::memory_order_relaxed);
+      if (task >= range.end) break;
+      callback_(opaque_, task, thread);
+      ++stats.num_tasks;
+      if (i != 0) ++stats.num_stolen;
+    }
+  }
+  stats.busy_seconds = Now() - start;
+}
+
+int NumThreadsFromParam(const int num_threads) {
+  if (num_threads >= 0) return num_threads;
+  const int num_cores = static_cast<int>(std::thread::hardware_concurrency());
+  return num_cores == 0 ? 1 : num_cores;
+}
+
+}  // namespace pik
@@ -0,0 +1,198 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+// Parallel for-loop over a range of task indices, shared by the encoder,
+// decoder and butteraugli. Only depends on the standard library.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pik {
+
+class AllocationCounters;
+class ImageArena;
+namespace butteraugli {
+class ImageCache;
+}  // namespace butteraugli
+
+// Per-thread state of the encode/decode call that a thread works for, which
+// ThreadPool::Run passes from the calling thread to the workers while they
+// execute its tasks, so that it applies to the whole call.
+struct ThreadContext {
+  // See ImageArenaScope in cache_aligned.h; null if none.
+  ImageArena* arena = nullptr;
+  // See butteraugli::ImageCacheScope; null if none.
+  butteraugli::ImageCache* butteraugli_cache = nullptr;
+  // See AllocationTracker in cache_aligned.h; null if none.
+  AllocationCounters* counters = nullptr;
+  // See HugePageScope in cache_aligned.h and butteraugli.h; zero if disabled.
+  size_t huge_page_min_bytes = 0;
+  size_t butteraugli_huge_page_min_bytes = 0;
+};
+
+// Returns the context of the calling thread, initially empty. Changing it
+// only affects subsequent Run() calls.
+ThreadContext* CurrentThreadContext();
+
+// Counters of a ThreadPool for diagnosing poor scaling, e.g. serial stages or
+// load imbalance. Accumulated over all Run() calls since construction.
+struct ThreadPoolStats {
+  void Assimilate(const ThreadPoolStats& victim);
+
+  // Returns the counters accumulated after "before", an earlier copy.
+  ThreadPoolStats Since(const ThreadPoolStats& before) const;
+
+  // Sum of idle_seconds over all workers.
+  double TotalIdleSeconds() const;
+
+  // Number of Run() calls that used the worker threads.
+  uint64_t num_runs = 0;
+  // Tasks executed by workers, and the subset of them that a worker stole
+  // from the range initially assigned to another worker.
+  uint64_t num_tasks = 0;
+  uint64_t num_stolen = 0;
+  // Tasks executed on the calling thread because their Run() had a single
+  // task or the pool has no workers; large values indicate serial stages.
+  uint64_t num_serial_tasks = 0;
+  // Wall time of the Run() calls that used the workers, i.e. how long the
+  // calling thread waited for them [seconds].
+  double run_seconds = 0.0;
+  // For each worker: part of run_seconds it spent waking up or waiting for
+  // the others to finish instead of executing tasks.
+  std::vector<double> idle_seconds;
+};
+
+// Executes tasks on a fixed set of worker threads. Each Run() splits the task
+// range into one contiguous sub-range per worker; a worker that finishes its
+// own sub-range steals remaining tasks from the others. This keeps neighboring
+// tasks (e.g. block rows) on the same thread while still balancing uneven
+// per-task costs.
+//
+// Run() is not reentrant: tasks must not call Run() on the same pool.
+class ThreadPool {
+ public:
+  // Starts "num_threads" worker threads. Zero means Run() executes all tasks
+  // on the calling thread, which is also what happens for a null pool.
+  // If "pin_threads", worker i only runs on the i-th CPU (modulo their number)
+  // available to the process, hence first-touched memory stays on its NUMA
+  // node and consecutive workers, which start with neighboring tasks, tend to
+  // share a node. Only supported on Linux.
+  explicit ThreadPool(int num_threads, bool pin_threads = false);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Upper bound (exclusive) of the "thread" argument passed to tasks. Useful
+  // for allocating per-thread scratch storage.
+  int NumThreads() const {
+    return workers_.empty() ? 1 : static_cast<int>(workers_.size());
+  }
+
+  // Calls func(task, thread) for every task in [begin, end), in unspecified
+  // order, and returns after all calls have finished. "thread" is in
+  // [0, NumThreads()) and no two concurrent calls receive the same value.
+  template <class Func>
+  void Run(const int begin, const int end, const Func& func) {
+    if (end <= begin) return;
+    if (workers_.empty() || end - begin == 1) {
+      stats_.num_serial_tasks += end - begin;
+      for (int task = begin; task < end; ++task) {
+        func(task, 0);
+      }
+      return;
+    }
+    RunTasks(begin, end, &CallFunc<Func>, &func);
+  }
+
+  // Returns the counters of all previous Run() calls. Must not be called
+  // concurrently with Run().
+  const ThreadPoolStats& Stats() const { return stats_; }
+
+ private:
+  using Callback = void (*)(const void* opaque, int task, int thread);
+
+  template <class Func>
+  static void CallFunc(const void* opaque, const int task, const int thread) {
+    (*static_cast<const Func*>(opaque))(task, thread);
+  }
+
+  // Sub-range of tasks initially assigned to one worker. Padded to the size
+  // of a cache line to avoid false sharing between the atomic counters.
+  struct Range {
+    std::atomic<int> next;
+    int end;
+    uint8_t padding[64 - 2 * sizeof(int)];
+  };
+
+  // Counters of the current Run(), only written by the respective worker.
+  struct WorkerStats {
+    uint64_t num_tasks;
+    uint64_t num_stolen;
+    double busy_seconds;
+    uint8_t padding[64 - 2 * sizeof(uint64_t) - sizeof(double)];
+  };
+
+  void RunTasks(int begin, int end, Callback callback, const void* opaque);
+  void WorkerLoop(int thread);
+  void ProcessTasks(int thread);
+
+  std::vector<std::thread> workers_;
+  std::unique_ptr<Range[]> ranges_;
+  std::unique_ptr<WorkerStats[]> worker_stats_;
+  ThreadPoolStats stats_;
+
+  std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::condition_variable work_done_;
+  // Incremented for every Run() so that workers notice new work.
+  uint64_t generation_ = 0;
+  int num_busy_ = 0;
+  bool shutdown_ = false;
+
+  // Current job, valid while num_busy_ != 0.
+  Callback callback_ = nullptr;
+  const void* opaque_ = nullptr;
+  ThreadContext context_;
+};
+
+// Convenience wrapper: runs serially on the calling thread if "pool" is null.
+template <class Func>
+void RunOnPool(ThreadPool* pool, const int begin, const int end,
+               const Func& func) {
+  if (pool == nullptr) {
+    for (int task = begin; task < end; ++task) {
+      func(task, 0);
+    }
+  } else {
+    pool->Run(begin, end, func);
+  }
+}
+
+// Returns the number of threads the pool should use for a user-facing
+// "num_threads" parameter: negative values select one thread per core.
+int NumThreadsFromParam(int num_threads);
+
+}  // namespace pik
+
+#endif  // THREAD_POOL_H_
@@ -0,0 +1,80 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TSC_TIMER_H_
+#define TSC_TIMER_H_
+
+// High-resolution (~10 ns) timestamps, using fences to prevent reordering and
+// ensure exactly the desired regions are measured.
+
+#include <stdint.h>
+#include <time.h>  // clock_gettime
+
+#include "arch_specific.h"
+#include "compiler_specific.h"
+
+#if PIK_ARCH_X64
+#include <emmintrin.h>  // _mm_lfence
+#if PIK_COMPILER_MSVC
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+namespace pik {
+
+// Start/Stop return absolute timestamps and must be placed immediately before
+// and after the region to measure. They use different fences: RDTSC is not
+// serializing, so Start is LFENCE/RDTSC/LFENCE, which prevents earlier and
+// region instructions from leaking across the timestamp. RDTSCP already waits
+// for all earlier instructions, so Stop is RDTSCP/LFENCE; the trailing fence
+// keeps subsequent instructions out of the region.
+//
+// Returns a timestamp in units of 'ticks'; divide by InvariantTicksPerSecond()
+// to convert to seconds. Elsewhere, falls back to a monotonic clock [ns].
+template <typename T>
+inline T Start() {
+  uint64_t t;
+#if PIK_ARCH_X64
+  _mm_lfence();
+  PIK_COMPILER_FENCE;
+  t = __rdtsc();
+  _mm_lfence();
+  PIK_COMPILER_FENCE;
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  t = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+  return static_cast<T>(t);
+}
+
+template <typename T>
+inline T Stop() {
+  uint64_t t;
+#if PIK_ARCH_X64
+  unsigned aux;
+  t = __rdtscp(&aux);
+  _mm_lfence();
+  PIK_COMPILER_FENCE;
+#else
+  t = Start<uint64_t>();
+#endif
+  return static_cast<T>(t);
+}
+
+}  // namespace pik
+
+#endif  // TSC_TIMER_H_
@@ -21,6 +21,7 @@
 
 #include "compiler_specific.h"
 #include "gamma_correct.h"
+#include "simd/simd.h"
 
 namespace pik {
 
@@ -121,6 +122,71 @@ void RGBPixelToYUV(T r, T g, T b, int bits,
   RGBPixelToYUV(rd, gd, bd, bits, y, u, v);
 }
 
+#if SIMD_ENABLE_AVX2
+
+namespace {
+
+using namespace SIMD_NAMESPACE;
+using VF = vec256<float>;
+constexpr size_t kLanes = 8;
+
+// Single-precision out = mul * (in * in_scale - pre_add) + post_add, scaled by
+// out_scale, for a 3x3 "mul" and vectors of kLanes pixels. Accurate to well
+// below one unit of 16-bit output; integer outputs add 0.5 and round down
+// like the scalar code.
+class AffineTransform {
+ public:
+  AffineTransform(const double* mul, const double* pre_add,
+                  const double* post_add, double in_scale, double out_scale,
+                  double round) {
+    for (int c = 0; c < 3; ++c) {
+      double add = round;
+      for (int k = 0; k < 3; ++k) {
+        mul_[3 * c + k] = set1(VF(), out_scale * in_scale * mul[3 * c + k]);
+        add -= out_scale * mul[3 * c + k] * pre_add[k];
+      }
+      add_[c] = set1(VF(), add + out_scale * post_add[c]);
+    }
+  }
+
+  PIK_INLINE void operator()(const VF in[3], VF out[3]) const {
+    for (int c = 0; c < 3; ++c) {
+      const VF sum = mul_add(mul_[3 * c + 1], in[1], add_[c]);
+      out[c] = mul_add(mul_[3 * c + 0], in[0],
+                       mul_add(mul_[3 * c + 2], in[2], sum));
+    }
+  }
+
+ private:
+  VF mul_[9];
+  VF add_[3];
+};
+
+constexpr double kZero[3] = {0.0, 0.0, 0.0};
+
+PIK_INLINE VF LoadPixels(const uint8_t* PIK_RESTRICT from) {
+  return f32_from_i32(convert_to(int32_t(), load(vec64<uint8_t>(), from)));
+}
+PIK_INLINE VF LoadPixels(const uint16_t* PIK_RESTRICT from) {
+  return f32_from_i32(convert_to(int32_t(), load(vec128<uint16_t>(), from)));
+}
+
+// "v" is already clamped to the range of T and offset by 0.5.
+PIK_INLINE void StorePixels(const VF v, uint8_t* PIK_RESTRICT to) {
+  store(convert_to(uint8_t(), i32_from_f32(round_neg_inf(v))), to);
+}
+PIK_INLINE void StorePixels(const VF v, uint16_t* PIK_RESTRICT to) {
+  store(convert_to(uint16_t(), i32_from_f32(round_neg_inf(v))), to);
+}
+
+PIK_INLINE VF ClampTo(const VF v, const VF maxv) {
+  return min(max(v, setzero(VF())), maxv);
+}
+
+}  // namespace
+
+#endif  // SIMD_ENABLE_AVX2
+
 //
 // Wrapper functions to convert between 8-bit, 16-bit or linear sRGB images
 // and 8, 10 or 12 bit YUV Rec 709 images.
@@ -128,10 +194,28 @@ void RGBPixelToYUV(T r, T g, T b, int bits,
 
 template <typename T>
 void YUVRec709ImageToRGB(const Image3U& yuv, int bit_depth, Image3<T>* rgb) {
+#if SIMD_ENABLE_AVX2
+  const double maxv_out = (1 << (8 * sizeof(T))) - 1;
+  const AffineTransform transform(YUVtoRGBMatrix, RGBtoYUVMatrixAdd, kZero,
+                                  1.0 / ((1 << bit_depth) - 1), maxv_out, 0.5);
+  const VF vmax = set1(VF(), maxv_out + 0.5);
+#endif
   for (int y = 0; y < yuv.ysize(); ++y) {
     auto row_yuv = yuv.Row(y);
     auto row_rgb = rgb->Row(y);
-    for (int x = 0; x < yuv.xsize(); ++x) {
+    int x = 0;
+#if SIMD_ENABLE_AVX2
+    for (; x + kLanes <= yuv.xsize(); x += kLanes) {
+      const VF in[3] = {LoadPixels(row_yuv[0] + x), LoadPixels(row_yuv[1] + x),
+                        LoadPixels(row_yuv[2] + x)};
+      VF out[3];
+      transform(in, out);
+      for (int c = 0; c < 3; ++c) {
+        StorePixels(ClampTo(out[c], vmax), row_rgb[c] + x);
+      }
+    }
+#endif
+    for (; x < yuv.xsize(); ++x) {
       YUVPixelToRGB(row_yuv[0][x], row_yuv[1][x], row_yuv[2][x], bit_depth,
                     &row_rgb[0][x], &row_rgb[1][x], &row_rgb[2][x]);
     }
@@ -152,10 +236,26 @@ Image3U RGB16ImageFromYUVRec709(const Image3U& yuv, int bit_depth) {
 
 Image3F RGBLinearImageFromYUVRec709(const Image3U& yuv, int bit_depth) {
   Image3F rgb(yuv.xsize(), yuv.ysize());
+#if SIMD_ENABLE_AVX2
+  const AffineTransform transform(YUVtoRGBMatrix, RGBtoYUVMatrixAdd, kZero,
+                                  1.0 / ((1 << bit_depth) - 1), 255.0, 0.0);
+#endif
   for (int y = 0; y < yuv.ysize(); ++y) {
     const auto row_yuv = yuv.ConstRow(y);
     auto row_linear = rgb.Row(y);
-    for (int x = 0; x < yuv.xsize(); ++x) {
+    int x = 0;
+#if SIMD_ENABLE_AVX2
+    for (; x + kLanes <= yuv.xsize(); x += kLanes) {
+      const VF in[3] = {LoadPixels(row_yuv[0] + x), LoadPixels(row_yuv[1] + x),
+                        LoadPixels(row_yuv[2] + x)};
+      VF out[3];
+      transform(in, out);
+      for (int c = 0; c < 3; ++c) {
+        store(SrgbToLinearPoly(out[c]), row_linear[c] + x);
+      }
+    }
+#endif
+    for (; x < yuv.xsize(); ++x) {
       double rd, gd, bd;
       YUVPixelToRGB(row_yuv[0][x], row_yuv[1][x], row_yuv[2][x], bit_depth,
                     &rd, &gd, &bd);
@@ -169,10 +269,29 @@ Image3F RGBLinearImageFromYUVRec709(const Image3U& yuv, int bit_depth) {
 
 template <typename T>
 void RGBImageToYUVRec709(const Image3<T>& rgb, int bit_depth, Image3U* yuv) {
+#if SIMD_ENABLE_AVX2
+  const double maxv = (1 << bit_depth) - 1;
+  const AffineTransform transform(RGBtoYUVMatrix, kZero, RGBtoYUVMatrixAdd,
+                                  1.0 / ((1 << (8 * sizeof(T))) - 1), maxv,
+                                  0.5);
+  const VF vmax = set1(VF(), maxv + 0.5);
+#endif
   for (int y = 0; y < rgb.ysize(); ++y) {
     const auto row_rgb = rgb.ConstRow(y);
     auto row_yuv = yuv->Row(y);
-    for (int x = 0; x < rgb.xsize(); ++x) {
+    int x = 0;
+#if SIMD_ENABLE_AVX2
+    for (; x + kLanes <= rgb.xsize(); x += kLanes) {
+      const VF in[3] = {LoadPixels(row_rgb[0] + x), LoadPixels(row_rgb[1] + x),
+                        LoadPixels(row_rgb[2] + x)};
+      VF out[3];
+      transform(in, out);
+      for (int c = 0; c < 3; ++c) {
+        StorePixels(ClampTo(out[c], vmax), row_yuv[c] + x);
+      }
+    }
+#endif
+    for (; x < rgb.xsize(); ++x) {
       RGBPixelToYUV(row_rgb[0][x], row_rgb[1][x], row_rgb[2][x], bit_depth,
                     &row_yuv[0][x], &row_yuv[1][x], &row_yuv[2][x]);
     }
@@ -194,10 +313,31 @@ Image3U YUVRec709ImageFromRGB16(const Image3U& rgb, int out_bit_depth) {
 Image3U YUVRec709ImageFromRGBLinear(const Image3F& rgb, int out_bit_depth) {
   Image3U yuv(rgb.xsize(), rgb.ysize());
   const double norm = 1. / 255.;
+#if SIMD_ENABLE_AVX2
+  const double maxv = (1 << out_bit_depth) - 1;
+  const AffineTransform transform(RGBtoYUVMatrix, kZero, RGBtoYUVMatrixAdd,
+                                  norm, maxv, 0.5);
+  const VF vmax = set1(VF(), maxv + 0.5);
+#endif
   for (int y = 0; y < yuv.ysize(); ++y) {
     auto row_yuv = yuv.Row(y);
     const auto row_linear = rgb.ConstRow(y);
-    for (int x = 0; x < yuv.xsize(); ++x) {
+    int x = 0;
+#if SIMD_ENABLE_AVX2
+    for (; x + kLanes <= yuv.xsize(); x += kLanes) {
+      VF in[3];
+      for (int c = 0; c < 3; ++c) {
+        const VF linear = load(VF(), row_linear[c] + x);
+        in[c] = LinearToSrgbPoly(ClampTo(linear, set1(VF(), 255.0f)));
+      }
+      VF out[3];
+      transform(in, out);
+      for (int c = 0; c < 3; ++c) {
+        StorePixels(ClampTo(out[c], vmax), row_yuv[c] + x);
+      }
+    }
+#endif
+    for (; x < yuv.xsize(); ++x) {
       double rd = LinearToSrgb8Direct(row_linear[0][x]) * norm;
       double gd = LinearToSrgb8Direct(row_linear[1][x]) * norm;
       double bd = LinearToSrgb8Direct(row_linear[2][x]) * norm;
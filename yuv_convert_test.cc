@@ -0,0 +1,148 @@
+// Copyright 2017 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the vectorized image conversions of yuv_convert.h and
+// yuv_opsin_convert.h against the double-precision per-pixel functions, which
+// they use for the pixels after the last full vector of a row. Hence the
+// conversion of each column by itself serves as the reference.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "image.h"
+#include "yuv_convert.h"
+#include "yuv_opsin_convert.h"
+
+namespace pik {
+namespace {
+
+// Not a multiple of the vector size, so that rows also end in scalar pixels.
+constexpr size_t kXsize = 67;
+constexpr size_t kYsize = 9;
+
+template <typename T>
+Image3<T> RandomImage(const int max_value, std::mt19937* rng) {
+  std::uniform_int_distribution<int> dist(0, max_value);
+  Image3<T> image(kXsize, kYsize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYsize; ++y) {
+      T* const PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < kXsize; ++x) {
+        row[x] = dist(*rng);
+      }
+    }
+  }
+  return image;
+}
+
+Image3F RandomLinearImage(std::mt19937* rng) {
+  std::uniform_real_distribution<float> dist(0.0f, 255.0f);
+  Image3F image(kXsize, kYsize);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < kYsize; ++y) {
+      float* const PIK_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < kXsize; ++x) {
+        row[x] = dist(*rng);
+      }
+    }
+  }
+  return image;
+}
+
+template <typename T>
+Image3<T> Column(const Image3<T>& image, const size_t x) {
+  Image3<T> column(1, image.ysize());
+  for (int c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < image.ysize(); ++y) {
+      column.PlaneRow(c, y)[0] = image.PlaneRow(c, y)[x];
+    }
+  }
+  return column;
+}
+
+// Returns whether convert(in, bit_depth) differs by at most "tolerance" from
+// the conversions of its columns.
+template <typename In, typename Out>
+bool CheckConversion(const char* name, const Image3<In>& in,
+                     Image3<Out> (*convert)(const Image3<In>&, int),
+                     const int bit_depth, const double tolerance) {
+  const Image3<Out> out = convert(in, bit_depth);
+  double max_diff = 0.0;
+  for (size_t x = 0; x < in.xsize(); ++x) {
+    const Image3<Out> expected = convert(Column(in, x), bit_depth);
+    for (int c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < in.ysize(); ++y) {
+        const double diff =
+            std::abs(static_cast<double>(out.PlaneRow(c, y)[x]) -
+                     static_cast<double>(expected.PlaneRow(c, y)[0]));
+        max_diff = std::max(max_diff, diff);
+      }
+    }
+  }
+  if (max_diff > tolerance) {
+    fprintf(stderr, "%s, %d bits: max difference %f exceeds %f.\n", name,
+            bit_depth, max_diff, tolerance);
+    return false;
+  }
+  return true;
+}
+
+int RunTests() {
+  std::mt19937 rng(129);
+  bool ok = true;
+  for (const int bits : {8, 10, 12}) {
+    const Image3U yuv = RandomImage<uint16_t>((1 << bits) - 1, &rng);
+    ok &= CheckConversion("RGB8ImageFromYUVRec709", yuv,
+                          RGB8ImageFromYUVRec709, bits, 1.0);
+    ok &= CheckConversion("RGB16ImageFromYUVRec709", yuv,
+                          RGB16ImageFromYUVRec709, bits, 1.0);
+    ok &= CheckConversion("RGBLinearImageFromYUVRec709", yuv,
+                          RGBLinearImageFromYUVRec709, bits, 0.0015);
+    ok &= CheckConversion("RGB8ImageFromYUVOpsin", yuv, RGB8ImageFromYUVOpsin,
+                          bits, 1.0);
+    // Limited by LinearToSrgbPoly.
+    ok &= CheckConversion("RGB16ImageFromYUVOpsin", yuv,
+                          RGB16ImageFromYUVOpsin, bits, 3.0);
+    ok &= CheckConversion("RGBLinearImageFromYUVOpsin", yuv,
+                          RGBLinearImageFromYUVOpsin, bits, 0.0015);
+
+    const Image3B rgb8 = RandomImage<uint8_t>(255, &rng);
+    const Image3U rgb16 = RandomImage<uint16_t>(65535, &rng);
+    const Image3F linear = RandomLinearImage(&rng);
+    ok &= CheckConversion("YUVRec709ImageFromRGB8", rgb8,
+                          YUVRec709ImageFromRGB8, bits, 1.0);
+    ok &= CheckConversion("YUVRec709ImageFromRGB16", rgb16,
+                          YUVRec709ImageFromRGB16, bits, 1.0);
+    ok &= CheckConversion("YUVRec709ImageFromRGBLinear", linear,
+                          YUVRec709ImageFromRGBLinear, bits, 1.0);
+    // Not vectorized, but the same result is also expected from them.
+    ok &= CheckConversion("YUVOpsinImageFromRGB8", rgb8,
+                          YUVOpsinImageFromRGB8, bits, 0.0);
+    ok &= CheckConversion("YUVOpsinImageFromRGB16", rgb16,
+                          YUVOpsinImageFromRGB16, bits, 0.0);
+    ok &= CheckConversion("YUVOpsinImageFromRGBLinear", linear,
+                          YUVOpsinImageFromRGBLinear, bits, 0.0);
+  }
+  if (!ok) return 1;
+  printf("Vectorized YUV conversions match the per-pixel reference.\n");
+  return 0;
+}
+
+}  // namespace
+}  // namespace pik
+
+int main() { return pik::RunTests(); }
@@ -21,6 +21,7 @@
 
 #include "compiler_specific.h"
 #include "gamma_correct.h"
+#include "simd/simd.h"
 
 namespace pik {
 
@@ -195,6 +196,97 @@ void RGBPixelToYUVOpsin(T r, T g, T b, int bits,
 #endif
 }
 
+#if SIMD_ENABLE_AVX2
+
+namespace {
+
+using namespace SIMD_NAMESPACE;
+using VF = vec256<float>;
+constexpr size_t kLanes = 8;
+
+// Single-precision version of YUVOpsinPixelToRGB for kLanes pixels. The
+// outputs are linear RGB, scaled to [0.0, 255.0] but not yet clamped.
+class YUVOpsinToLinear {
+ public:
+  explicit YUVOpsinToLinear(const int bits) {
+    const double norm = 1. / ((1 << bits) - 1);
+    const double scale_x = kXRadius / kScaleUV / kScaleX;
+    // Coefficients of (Y, U, V) * norm - offset in (rmg, gmg, bmg).
+    const double mul[9] = {
+        kInvScaleR / kScaleY, 0.0, kInvScaleR * scale_x,
+        kInvScaleG / kScaleY, 0.0, -kInvScaleG * scale_x,
+        1.0 / kScaleY, 1.0 / kScaleUV / kScaleB, 0.0,
+    };
+    const double offset[3] = {kOffsetY, kOffsetUV, kOffsetUV};
+    const double add[3] = {kInvScaleR * kXCenter, -kInvScaleG * kXCenter, 0.0};
+    for (int c = 0; c < 3; ++c) {
+      double sum = add[c];
+      for (int k = 0; k < 3; ++k) {
+        mul_[3 * c + k] = set1(VF(), mul[3 * c + k] * norm);
+        sum -= mul[3 * c + k] * offset[k];
+      }
+      add_[c] = set1(VF(), sum);
+    }
+    for (int i = 0; i < 9; ++i) {
+      inverse_[i] = set1(VF(), 255.0 * kOpsinAbsorbanceInverseMatrix[i]);
+    }
+  }
+
+  PIK_INLINE void operator()(
+      const std::array<const uint16_t * PIK_RESTRICT, 3>& row_yuv,
+      const size_t x, VF linear[3]) const {
+    VF yuv[3];
+    for (int c = 0; c < 3; ++c) {
+      yuv[c] = f32_from_i32(
+          convert_to(int32_t(), load(vec128<uint16_t>(), row_yuv[c] + x)));
+    }
+    VF mixed[3];
+    for (int c = 0; c < 3; ++c) {
+      const VF gamma = mul_add(
+          mul_[3 * c], yuv[0],
+          mul_add(mul_[3 * c + 1], yuv[1],
+                  mul_add(mul_[3 * c + 2], yuv[2], add_[c])));
+      mixed[c] = SimpleGammaInverse(gamma);
+    }
+    for (int c = 0; c < 3; ++c) {
+      linear[c] = mul_add(inverse_[3 * c], mixed[0],
+                          mul_add(inverse_[3 * c + 1], mixed[1],
+                                  inverse_[3 * c + 2] * mixed[2]));
+    }
+  }
+
+ private:
+  static PIK_INLINE VF SimpleGammaInverse(const VF x) {
+    const VF linear = x * set1(VF(), 1.0 / 29.16);
+    const VF t = (x + set1(VF(), 0.08f)) * set1(VF(), 1.0 / 1.08);
+    return select(t * t * t, linear, x < set1(VF(), 0.04f));
+  }
+
+  VF mul_[9];
+  VF add_[3];
+  VF inverse_[9];
+};
+
+PIK_INLINE VF Clamp255(const VF v) {
+  return min(max(v, setzero(VF())), set1(VF(), 255.0f));
+}
+
+// Stores floor(srgb * mul + 0.5); "srgb" is in [0.0, 255.0].
+PIK_INLINE void StorePixels(const VF srgb, const VF mul,
+                            uint8_t* PIK_RESTRICT to) {
+  const VF v = round_neg_inf(mul_add(srgb, mul, set1(VF(), 0.5f)));
+  store(convert_to(uint8_t(), i32_from_f32(v)), to);
+}
+PIK_INLINE void StorePixels(const VF srgb, const VF mul,
+                            uint16_t* PIK_RESTRICT to) {
+  const VF v = round_neg_inf(mul_add(srgb, mul, set1(VF(), 0.5f)));
+  store(convert_to(uint16_t(), i32_from_f32(v)), to);
+}
+
+}  // namespace
+
+#endif  // SIMD_ENABLE_AVX2
+
 //
 // Wrapper functions to convert between 8-bit, 16-bit or linear sRGB images
 // and 8, 10 or 12 bit YUV Opsin images.
@@ -202,10 +294,25 @@ void RGBPixelToYUVOpsin(T r, T g, T b, int bits,
 
 template <typename T>
 void YUVOpsinImageToRGB(const Image3U& yuv, int bit_depth, Image3<T>* rgb) {
+#if SIMD_ENABLE_AVX2
+  const YUVOpsinToLinear to_linear(bit_depth);
+  const VF mul = set1(VF(), ((1 << (8 * sizeof(T))) - 1) / 255.0);
+#endif
   for (int y = 0; y < yuv.ysize(); ++y) {
     auto row_yuv = yuv.Row(y);
     auto row_rgb = rgb->Row(y);
-    for (int x = 0; x < yuv.xsize(); ++x) {
+    int x = 0;
+#if SIMD_ENABLE_AVX2
+    for (; x + kLanes <= yuv.xsize(); x += kLanes) {
+      VF linear[3];
+      to_linear(row_yuv, x, linear);
+      for (int c = 0; c < 3; ++c) {
+        const VF srgb = LinearToSrgbPoly(Clamp255(linear[c]));
+        StorePixels(srgb, mul, row_rgb[c] + x);
+      }
+    }
+#endif
+    for (; x < yuv.xsize(); ++x) {
       YUVOpsinPixelToRGB(row_yuv[0][x], row_yuv[1][x], row_yuv[2][x], bit_depth,
                          &row_rgb[0][x], &row_rgb[1][x], &row_rgb[2][x]);
     }
@@ -226,10 +333,24 @@ Image3U RGB16ImageFromYUVOpsin(const Image3U& yuv, int bit_depth) {
 
 Image3F RGBLinearImageFromYUVOpsin(const Image3U& yuv, int bit_depth) {
   Image3F rgb(yuv.xsize(), yuv.ysize());
+#if SIMD_ENABLE_AVX2
+  const YUVOpsinToLinear to_linear(bit_depth);
+#endif
   for (int y = 0; y < yuv.ysize(); ++y) {
     const auto row_yuv = yuv.ConstRow(y);
     auto row_linear = rgb.Row(y);
-    for (int x = 0; x < yuv.xsize(); ++x) {
+    int x = 0;
+#if SIMD_ENABLE_AVX2
+    for (; x + kLanes <= yuv.xsize(); x += kLanes) {
+      VF linear[3];
+      to_linear(row_yuv, x, linear);
+      // The sRGB round trip of the scalar code only clamps.
+      for (int c = 0; c < 3; ++c) {
+        store(Clamp255(linear[c]), row_linear[c] + x);
+      }
+    }
+#endif
+    for (; x < yuv.xsize(); ++x) {
       double rd, gd, bd;
       YUVOpsinPixelToRGB(row_yuv[0][x], row_yuv[1][x], row_yuv[2][x], bit_depth,
                          &rd, &gd, &bd);